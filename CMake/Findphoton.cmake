@@ -1,6 +1,9 @@
 include(FetchContent)
 set(FETCHCONTENT_QUIET false)
 set(PHOTON_ENABLE_EXTFS ON)
+if(ENABLE_IOURING)
+  set(PHOTON_ENABLE_URING ON)
+endif()
 
 FetchContent_Declare(
   photon
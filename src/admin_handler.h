@@ -0,0 +1,147 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <photon/common/alog.h>
+#include <photon/common/estring.h>
+#include <photon/net/http/server.h>
+
+#include "bk_download.h"
+#include "cache_transfer.h"
+#include "prefetch.h"
+#include "overlaybd/cache/pool_store.h"
+
+// Changes the settings below at runtime, for all the devices, until the
+// process restarts. GET returns them as JSON, PUT or POST sets those in the
+// query, e.g. `PUT /admin?cacheSizeGB=100&downloadMaxMBps=50`, and all of
+// them are checked before any is applied.
+//   - cacheSizeGB: capacity of the file cache, shrinking is evicted in the
+//     background
+//   - maxRefillSize: max adaptive refill window of the file cache, 0 to
+//     refill by refillSize only
+//   - prefetchConcurrency: cap on the replay threads of each image, below
+//     prefetchConfig.concurrency, 0 for no cap
+//   - downloadMaxMBps: background download rate of each image overriding its
+//     download.maxMBps, 0 for unlimited, -1 to go back to it
+// Requests must carry "Authorization: Bearer <token>" if `token` isn't empty.
+struct AdminHandler : public photon::net::http::HTTPHandler {
+    FileSystem::ICachePool *pool; // file cache only
+    uint64_t cache_size_GB;
+    size_t refill_size, max_refill_size;
+    std::string token;
+
+    AdminHandler(FileSystem::ICachePool *pool, uint64_t cache_size_GB, size_t refill_size,
+                 size_t max_refill_size, std::string token = "")
+        : pool(pool), cache_size_GB(cache_size_GB), refill_size(refill_size),
+          max_refill_size(max_refill_size > refill_size ? max_refill_size : 0),
+          token(std::move(token)) {
+    }
+
+    std::string render() {
+        return estring().appends("{\"cacheSizeGB\":", cache_size_GB,
+                                 ",\"maxRefillSize\":", max_refill_size,
+                                 ",\"prefetchConcurrency\":", prefetch_get_max_concurrency(),
+                                 ",\"downloadMaxMBps\":", BKDL::get_max_MBps(), "}\n");
+    }
+
+    // returns an error message, empty if all the settings are applied
+    std::string apply(std::string_view query) {
+        std::map<std::string, int64_t> params;
+        while (!query.empty()) {
+            auto amp = query.find('&');
+            auto kv = query.substr(0, amp);
+            query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+            auto eq = kv.find('=');
+            if (eq == std::string_view::npos)
+                return estring().appends("no value of `", std::string(kv), "`");
+            std::string key(kv.substr(0, eq)), val(kv.substr(eq + 1));
+            char *end = nullptr;
+            auto n = strtoll(val.c_str(), &end, 10);
+            if (val.empty() || *end != '\0')
+                return estring().appends("invalid value of `", key, "`: ", val);
+            params[key] = n;
+        }
+        for (auto &p : params) {
+            auto &key = p.first;
+            auto n = p.second;
+            if (key == "cacheSizeGB" || key == "maxRefillSize") {
+                if (pool == nullptr)
+                    return estring().appends("`", key, "` is only for the file cache");
+                if (key == "cacheSizeGB" && n < 1)
+                    return "cacheSizeGB must be at least 1";
+                if (key == "maxRefillSize" && (n < 0 || n % refill_size != 0))
+                    return estring().appends("maxRefillSize must be a multiple of ", refill_size);
+            } else if (key == "prefetchConcurrency") {
+                if (n < 0)
+                    return "prefetchConcurrency must not be negative";
+            } else if (key == "downloadMaxMBps") {
+                if (n < -1)
+                    return "downloadMaxMBps must be at least -1";
+            } else {
+                return estring().appends("unknown setting `", key, "`");
+            }
+        }
+        for (auto &p : params) {
+            auto &key = p.first;
+            auto n = p.second;
+            if (key == "cacheSizeGB") {
+                if (pool->resize((size_t)n << 30) != 0)
+                    return estring().appends("failed to resize the cache, errno ", errno);
+                cache_size_GB = n;
+            } else if (key == "maxRefillSize") {
+                max_refill_size = (size_t)n > refill_size ? n : 0;
+                pool->set_max_refill_size(max_refill_size);
+            } else if (key == "prefetchConcurrency") {
+                prefetch_set_max_concurrency(n);
+            } else if (key == "downloadMaxMBps") {
+                BKDL::set_max_MBps(n);
+            }
+            LOG_INFO("admin: set ` to `", key, n);
+        }
+        return {};
+    }
+
+    int handle_request(photon::net::http::Request& req,
+                       photon::net::http::Response& resp,
+                       std::string_view) override {
+        std::string body;
+        int code = 200;
+        auto verb = req.verb();
+        if (!CacheTransfer::authorized(req.headers["Authorization"], token)) {
+            code = 401;
+        } else if (verb == photon::net::http::Verb::PUT || verb == photon::net::http::Verb::POST) {
+            body = apply(req.query());
+            code = body.empty() ? 200 : 400;
+        } else if (verb != photon::net::http::Verb::GET) {
+            code = 405;
+        }
+        if (code == 200)
+            body = render();
+        else if (!body.empty())
+            body.append("\n");
+        resp.set_result(code);
+        resp.keep_alive(true);
+        resp.headers.insert("Content-Type", code == 200 ? "application/json" : "text/plain");
+        resp.headers.content_length(body.length());
+        if (resp.write((void*)body.data(), body.length()) != (ssize_t)body.length())
+            LOG_ERRNO_RETURN(0, -1, "Failed to write admin response");
+        return 0;
+    }
+};
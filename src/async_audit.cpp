@@ -0,0 +1,225 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "async_audit.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+
+namespace AsyncAudit {
+
+static std::atomic<uint64_t> n_dropped{0}, n_rings{0};
+
+uint64_t dropped() {
+    return n_dropped.load(std::memory_order_relaxed);
+}
+
+uint64_t rings() {
+    return n_rings.load(std::memory_order_relaxed);
+}
+
+// audit records are a line of a few hundred bytes; longer ones are written
+// through
+static const uint32_t RECORD_SIZE = 504;
+// threads beyond it write through
+static const uint32_t MAX_RINGS = 64;
+static const size_t BATCH_SIZE = 64 * 1024;
+
+struct Record {
+    int level;
+    uint32_t len;
+    char data[RECORD_SIZE];
+};
+
+// single producer (the thread owning it) and single consumer
+struct Ring {
+    std::unique_ptr<Record[]> records;
+    uint32_t size;
+    std::atomic<uint64_t> head{0}; // written by the producer
+    char pad[64];
+    std::atomic<uint64_t> tail{0}; // written by the consumer
+    std::atomic<bool> owned{false};
+
+    explicit Ring(uint32_t n) : records(new Record[n]), size(n) {
+        n_rings.fetch_add(1, std::memory_order_relaxed);
+    }
+    ~Ring() {
+        n_rings.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    bool push(int level, const char *begin, uint32_t len) {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= size)
+            return false;
+        auto &r = records[h % size];
+        r.level = level;
+        r.len = len;
+        memcpy(r.data, begin, len);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+class AsyncLogOutput final : public ILogOutput {
+public:
+    AsyncLogOutput(ILogOutput *output, uint32_t ring_size)
+        : m_output(output), m_ring_size(ring_size), m_id(++n_outputs) {
+        m_consumer = std::thread(&AsyncLogOutput::consume, this);
+    }
+
+    void write(int level, const char *begin, const char *end) override {
+        auto len = (uint32_t)(end - begin);
+        auto ring = len <= RECORD_SIZE ? thread_ring() : nullptr;
+        if (ring == nullptr)
+            return m_output->write(level, begin, end);
+        if (!ring->push(level, begin, len))
+            n_dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    int get_log_file_fd() override {
+        return m_output->get_log_file_fd();
+    }
+    uint64_t set_throttle(uint64_t t) override {
+        return m_output->set_throttle(t);
+    }
+    uint64_t get_throttle() override {
+        return m_output->get_throttle();
+    }
+    void destruct() override {
+        m_running = false;
+        m_consumer.join();
+        drain();
+        m_output->destruct();
+        delete this;
+    }
+
+private:
+    static std::atomic<uint64_t> n_outputs;
+
+    ILogOutput *m_output;
+    uint32_t m_ring_size;
+    uint64_t m_id; // tells the rings of an output from a later one at the same address
+    // read by the consumer, and held by the output along with the threads
+    // using them, so that a ring is freed once both are gone
+    std::atomic<Ring *> m_rings[MAX_RINGS] = {};
+    std::shared_ptr<Ring> m_holders[MAX_RINGS];
+    std::atomic<bool> m_running{true};
+    std::thread m_consumer;
+    std::string m_batch;
+    int m_batch_level = 0;
+    uint64_t m_reported = 0;
+
+    // releases the ring of a thread when it exits, or moves to another
+    // output, for the threads to come
+    struct Owner {
+        uint64_t output = 0;
+        std::shared_ptr<Ring> ring;
+        void reset(uint64_t id) {
+            if (ring)
+                ring->owned.store(false, std::memory_order_release);
+            ring.reset();
+            output = id;
+        }
+        ~Owner() {
+            reset(0);
+        }
+    };
+
+    Ring *thread_ring() {
+        static thread_local Owner owner;
+        if (owner.output == m_id)
+            return owner.ring.get();
+        owner.reset(m_id);
+        for (uint32_t i = 0; i < MAX_RINGS; i++) {
+            auto ring = m_rings[i].load(std::memory_order_acquire);
+            if (ring == nullptr) {
+                auto r = std::make_shared<Ring>(m_ring_size);
+                r->owned = true;
+                if (m_rings[i].compare_exchange_strong(ring, r.get())) {
+                    m_holders[i] = r;
+                    owner.ring = std::move(r);
+                    return owner.ring.get();
+                }
+            }
+            if (ring->owned.load(std::memory_order_relaxed))
+                continue;
+            bool expected = false;
+            // released by its owner, which set m_holders[i] before
+            if (ring->owned.compare_exchange_strong(expected, true)) {
+                owner.ring = m_holders[i];
+                return ring;
+            }
+        }
+        return nullptr;
+    }
+
+    void flush() {
+        if (m_batch.empty())
+            return;
+        m_output->write(m_batch_level, m_batch.data(), m_batch.data() + m_batch.size());
+        m_batch.clear();
+    }
+
+    // returns the # of records written
+    size_t drain() {
+        size_t n = 0;
+        for (auto &slot : m_rings) {
+            auto ring = slot.load(std::memory_order_acquire);
+            if (ring == nullptr)
+                break;
+            auto t = ring->tail.load(std::memory_order_relaxed);
+            auto h = ring->head.load(std::memory_order_acquire);
+            for (; t < h; t++, n++) {
+                auto &r = ring->records[t % ring->size];
+                if (m_batch.size() + r.len > BATCH_SIZE || r.level != m_batch_level)
+                    flush();
+                m_batch_level = r.level;
+                m_batch.append(r.data, r.len);
+            }
+            ring->tail.store(t, std::memory_order_release);
+        }
+        flush();
+        auto d = dropped();
+        if (d != m_reported) {
+            auto line = std::to_string(d - m_reported) + " audit records dropped\n";
+            m_output->write(m_batch_level, line.data(), line.data() + line.size());
+            m_reported = d;
+        }
+        return n;
+    }
+
+    void consume() {
+        m_batch.reserve(BATCH_SIZE);
+        while (m_running.load(std::memory_order_relaxed)) {
+            if (drain() == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+};
+
+std::atomic<uint64_t> AsyncLogOutput::n_outputs{0};
+
+ILogOutput *new_async_log_output(ILogOutput *output, uint32_t ring_size) {
+    if (output == nullptr)
+        return nullptr;
+    if (ring_size == 0)
+        ring_size = 1;
+    return new AsyncLogOutput(output, ring_size);
+}
+
+} // namespace AsyncAudit
@@ -0,0 +1,40 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <photon/common/alog.h>
+#include <cstdint>
+
+// A log output for the audit logger that takes the records off the I/O path.
+// write() copies a record into the lock-free ring of the calling OS thread (a
+// photon vcpu, or a worker thread) and returns; a background thread gathers
+// the records of all the rings and writes them to `output` in batches. A
+// record that finds its ring full is dropped and counted rather than waited
+// for; the count is reported in the audit log itself, and by dropped().
+namespace AsyncAudit {
+
+// takes the ownership of `output`; `ring_size` records per thread
+ILogOutput *new_async_log_output(ILogOutput *output, uint32_t ring_size = 4096);
+
+// the # of records dropped so far
+uint64_t dropped();
+
+// the # of rings allocated; a ring is freed once its output is destructed
+// and the thread using it exits, or writes to another output
+uint64_t rings();
+
+} // namespace AsyncAudit
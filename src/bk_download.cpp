@@ -15,6 +15,9 @@
 */
 #include "bk_download.h"
 #include <errno.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
 #include <list>
 #include <set>
 #include <string>
@@ -23,13 +26,17 @@
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/common/alog-audit.h>
+#include <photon/common/iovector.h>
+#include <photon/fs/forwardfs.h>
 #include <photon/fs/localfs.h>
-#include <photon/fs/throttled-file.h>
 #include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
 #include <openssl/sha.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include "switch_file.h"
+#include "overlaybd/cache/cache.h"
+#include "qos_fs.h"
 #include "image_file.h"
 #include "tools/sha256file.h"
 
@@ -55,6 +62,16 @@ bool check_downloaded(const std::string &dir) {
 
 static std::set<std::string> lock_files;
 
+static std::atomic<int32_t> g_max_MBps{-1};
+
+void set_max_MBps(int32_t limit) {
+    g_max_MBps = limit;
+}
+
+int32_t get_max_MBps() {
+    return g_max_MBps;
+}
+
 void BkDownload::switch_to_local_file() {
     std::string path = dir + "/" + COMMIT_FILE_NAME;
     ((ISwitchFile *)sw_file)->set_switch_file(path.c_str());
@@ -73,20 +90,29 @@ bool BkDownload::download_done() {
     old_name = dir + "/" + DOWNLOAD_TMP_NAME;
     new_name = dir + "/" + COMMIT_FILE_NAME;
 
-    // verify sha256
-    photon::semaphore done;
+    // verify sha256, which is mostly hashed while downloading
     std::string shares;
-    std::thread sha256_thread([&]() {
-        shares = sha256sum(old_name.c_str());
-        done.signal(1);
-    });
-    sha256_thread.detach();
-    // wait verify finish
-    done.wait(1);
+    if (m_hash && m_hashed == (file_size + block_size - 1) / block_size) {
+        shares = m_hash->sha256_checksum();
+    } else {
+        LOG_INFO("hash ` from the start", old_name);
+        photon::semaphore done;
+        std::thread sha256_thread([&]() {
+            shares = sha256sum(old_name.c_str());
+            done.signal(1);
+        });
+        sha256_thread.detach();
+        // wait verify finish
+        done.wait(1);
+    }
+    delete m_hash;
+    m_hash = nullptr;
+    m_hashed = 0;
 
     if (shares != digest) {
         LOG_ERROR("verify checksum ` failed (expect: `, got: `)", old_name, digest, shares);
         force_download = true; // force redownload next time
+        publish_ranges({});
         return false;
     }
 
@@ -126,87 +152,357 @@ void BkDownload::unlock_file() {
     lock_files.erase(dir);
 }
 
-bool BkDownload::download_blob() {
-    std::string dl_file_path = dir + "/" + DOWNLOAD_TMP_NAME;
-    try_cnt--;
-    IFile *src = src_file;
-    if (limit_MB_ps > 0) {
-        ThrottleLimits limits;
-        limits.R.throughput = limit_MB_ps * 1024UL * 1024; // MB
-        limits.R.block_size = 1024UL * 1024;
-        limits.time_window = 1UL;
-        src = new_throttled_file(src, limits);
-    }
-    DEFER({
-        if (limit_MB_ps > 0)
-            delete src;
-    });
+// the bitmap is saved after this many blocks are written
+static constexpr uint32_t BITMAP_SAVE_INTERVAL = 64;
+// at most this many blocks are read back to hash at a time, beyond that the
+// blob is hashed from the start after the download
+static constexpr uint32_t HASH_READ_BACK = 64;
 
-    auto dst = open_localfile_adaptor(dl_file_path.c_str(), O_RDWR | O_CREAT, 0644);
-    if (dst == nullptr) {
-        LOG_ERRNO_RETURN(0, false, "failed to open dst file `", dl_file_path.c_str());
+static inline bool test_bit(const std::vector<uint8_t> &bitmap, uint64_t i) {
+    return bitmap[i / 8] & (1 << (i % 8));
+}
+
+bool BkDownload::load_bitmap(IFile *dst, std::vector<uint8_t> &bitmap) {
+    uint64_t nblocks = (file_size + block_size - 1) / block_size;
+    bitmap.assign((nblocks + 7) / 8, 0);
+    publish_ranges({});
+    delete m_hash;
+    m_hash = new_sha256_stream();
+    m_hashed = 0;
+    if (force_download) {
+        // the last one failed verification, start over
+        force_download = false;
+        return true;
     }
-    DEFER(delete dst;);
-    dst->ftruncate(file_size);
 
-    size_t bs = block_size;
-    off_t offset = 0;
-    void *buff = nullptr;
-    // buffer allocate, with 4K alignment
-    ::posix_memalign(&buff, ALIGNMENT, bs);
-    if (buff == nullptr)
-        LOG_ERRNO_RETURN(0, false, "failed to allocate buffer with ", VALUE(bs));
-    DEFER(free(buff));
-
-    LOG_INFO("download blob start. (`)", url);
-    while (offset < (ssize_t)file_size) {
-        if (running != 1) {
-            LOG_INFO("image file exit when background downloading");
-            return false;
-        }
-        if (!force_download) {
-            // check aleady downloaded.
+    struct stat st;
+    if (dst->fstat(&st) != 0)
+        LOG_ERRNO_RETURN(0, false, "failed to stat download file of `", url);
+    DownloadMeta meta;
+    if (st.st_size >= (off_t)(file_size + sizeof(meta) + bitmap.size()) &&
+        dst->pread(&meta, sizeof(meta), file_size) == (ssize_t)sizeof(meta) &&
+        meta.magic == DOWNLOAD_META_MAGIC && meta.file_size == file_size &&
+        meta.nblocks == nblocks && meta.block_size == block_size) {
+        if (dst->pread(bitmap.data(), bitmap.size(), file_size + sizeof(meta)) !=
+            (ssize_t)bitmap.size())
+            LOG_ERRNO_RETURN(0, false, "failed to read download bitmap of `", url);
+        if (meta.hashed > 0 && meta.hashed <= nblocks &&
+            meta.hash_state_size <= sizeof(meta.hash_state) &&
+            m_hash->restore(std::string(meta.hash_state, meta.hash_state_size)))
+            m_hashed = meta.hashed;
+        publish_ranges(bitmap);
+    } else if (st.st_size == (off_t)file_size) {
+        // written by an older version, or complete but not verified yet.
+        // blocks without holes are taken as written, verification tells.
+        for (uint64_t i = 0; i < nblocks; i++) {
+            off_t offset = i * block_size;
             auto hole_pos = dst->lseek(offset, SEEK_HOLE);
-            if (hole_pos >= offset + (ssize_t)bs) {
-                // alread downloaded
-                offset += bs;
-                continue;
-            }
+            if (hole_pos >= std::min(offset + (off_t)block_size, (off_t)file_size))
+                bitmap[i / 8] |= 1 << (i % 8);
         }
+    }
+    return true;
+}
+
+bool BkDownload::save_bitmap(IFile *dst, const std::vector<uint8_t> &bitmap) {
+    // blocks written after the data is synced are left to the next save,
+    // the hash covers written blocks only
+    auto snapshot = bitmap;
+    auto state = m_hash ? m_hash->state() : std::string();
+    auto hashed = m_hashed;
+    if (dst->fdatasync() != 0)
+        LOG_ERRNO_RETURN(0, false, "failed to sync download file of `", url);
+    DownloadMeta meta;
+    memset(&meta, 0, sizeof(meta));
+    meta.magic = DOWNLOAD_META_MAGIC;
+    meta.file_size = file_size;
+    meta.nblocks = (file_size + block_size - 1) / block_size;
+    meta.block_size = block_size;
+    if (state.size() <= sizeof(meta.hash_state)) {
+        meta.hashed = hashed;
+        meta.hash_state_size = state.size();
+        memcpy(meta.hash_state, state.data(), state.size());
+    }
+    if (dst->pwrite(&meta, sizeof(meta), file_size) != (ssize_t)sizeof(meta) ||
+        dst->pwrite(snapshot.data(), snapshot.size(), file_size + sizeof(meta)) !=
+            (ssize_t)snapshot.size())
+        LOG_ERRNO_RETURN(0, false, "failed to save download bitmap of `", url);
+    publish_ranges(snapshot);
+    return true;
+}
 
-        int retry = 2;
-        auto count = bs;
-        if (offset + count > file_size)
-            count = file_size - offset;
-    again_read:
-        if (!(retry--))
-            LOG_ERROR_RETURN(EIO, false, "failed to read at ", VALUE(offset), VALUE(count));
+void BkDownload::publish_ranges(const std::vector<uint8_t> &bitmap) {
+    if (ranges == nullptr)
+        return;
+    ranges->block_size = block_size;
+    ranges->bitmap = bitmap;
+}
+
+ssize_t BkDownload::fetch_block(IFile *src, void *buf, size_t count, off_t offset) {
+    if (cache_file) {
+        struct iovec iov{buf, count};
+        if (cache_file->preadv2(&iov, 1, offset, RW_V2_CACHE_ONLY) == (ssize_t)count)
+            return count;
+    }
+    auto limit = g_max_MBps.load(std::memory_order_relaxed);
+    if (limit < 0)
+        limit = limit_MB_ps;
+    m_throttle.set_rate(limit > 0 ? limit * 1024UL * 1024 : 0);
+    auto wait = m_throttle.take(count);
+    if (wait)
+        photon::thread_usleep(wait);
+    int retry = 2;
+    while (retry--) {
         ssize_t rlen;
         {
             SCOPE_AUDIT("bk_download", AU_FILEOP(url, offset, rlen));
-            rlen = src->pread(buff, bs, offset);
+            rlen = src->pread(buf, count, offset);
         }
-        if (rlen < 0) {
-            LOG_WARN("failed to read at ", VALUE(offset), VALUE(count), VALUE(errno), " retry...");
-            goto again_read;
+        if (rlen == (ssize_t)count)
+            return rlen;
+        LOG_WARN("failed to read at ", VALUE(offset), VALUE(count), VALUE(rlen), VALUE(errno),
+                 " retry...");
+    }
+    LOG_ERROR_RETURN(EIO, -1, "failed to read at ", VALUE(offset), VALUE(count));
+}
+
+IFile *BkDownload::open_dst(std::vector<uint8_t> &bitmap) {
+    std::string dl_file_path = dir + "/" + DOWNLOAD_TMP_NAME;
+    auto dst = open_localfile_adaptor(dl_file_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (dst == nullptr) {
+        LOG_ERRNO_RETURN(0, nullptr, "failed to open dst file `", dl_file_path.c_str());
+    }
+    if (!load_bitmap(dst, bitmap)) {
+        delete dst;
+        return nullptr;
+    }
+    return dst;
+}
+
+void BkDownload::advance_hash(IFile *dst, const std::vector<uint8_t> &bitmap, void *buf,
+                              uint64_t ready) {
+    if (m_hash == nullptr || m_hashing)
+        return;
+    m_hashing = true;
+    DEFER(m_hashing = false);
+    uint64_t nblocks = (file_size + block_size - 1) / block_size;
+    uint32_t read_back = 0;
+    while (m_hashed < nblocks && test_bit(bitmap, m_hashed)) {
+        off_t offset = m_hashed * block_size;
+        auto count = std::min((size_t)block_size, file_size - offset);
+        if (m_hashed != ready) {
+            if (read_back++ >= HASH_READ_BACK)
+                return;
+            // written ahead of the hash, mostly still in the page cache
+            if (dst->pread(buf, count, offset) != (ssize_t)count) {
+                LOG_WARN("failed to read back at ", VALUE(offset), VALUE(count), VALUE(errno));
+                return;
+            }
+            ready = -1;
         }
-        retry = 2;
-    again_write:
-        if (!(retry--))
-            LOG_ERROR_RETURN(EIO, false, "failed to write at ", VALUE(offset), VALUE(count));
-        auto wlen = dst->pwrite(buff, count, offset);
-        // but once write lenth larger than read length treats as OK
-        if (wlen < rlen) {
-            LOG_WARN("failed to write at ", VALUE(offset), VALUE(count), VALUE(errno), " retry...");
-            goto again_write;
+        m_hash->update(buf, count);
+        m_hashed++;
+    }
+}
+
+bool BkDownload::fetch_blocks(IFile *src, IFile *dst, std::vector<uint8_t> &bitmap,
+                              const std::vector<uint64_t> &blocks) {
+    size_t bs = block_size;
+    size_t next = 0;
+    uint32_t unsaved = 0;
+    bool failed = false, exited = false;
+    photon::mutex save_mtx;
+    // blocks are taken in order by the workers, and written where they belong
+    auto worker = [&]() {
+        QosScope qos(IoClass::Download, qos_bucket);
+        void *buff = nullptr;
+        // buffer allocate, with 4K alignment
+        ::posix_memalign(&buff, ALIGNMENT, bs);
+        if (buff == nullptr) {
+            LOG_ERROR("failed to allocate buffer with ", VALUE(bs));
+            failed = true;
+            return;
         }
-        offset += count;
+        DEFER(free(buff));
+        // blocks written before, hashed only if the state was not saved
+        advance_hash(dst, bitmap, buff, -1);
+        while (!failed && !exited) {
+            if (running != 1) {
+                exited = true;
+                return;
+            }
+            if (next >= blocks.size())
+                return;
+            auto i = blocks[next++];
+            if (test_bit(bitmap, i))
+                continue;
+
+            off_t offset = i * bs;
+            auto count = std::min(bs, file_size - offset);
+            if (fetch_block(src, buff, count, offset) < 0) {
+                failed = true;
+                return;
+            }
+            int retry = 2;
+            while (dst->pwrite(buff, count, offset) < (ssize_t)count) {
+                if (!(retry--)) {
+                    LOG_ERROR("failed to write at ", VALUE(offset), VALUE(count));
+                    failed = true;
+                    return;
+                }
+                LOG_WARN("failed to write at ", VALUE(offset), VALUE(count), VALUE(errno),
+                         " retry...");
+            }
+            bitmap[i / 8] |= 1 << (i % 8);
+            advance_hash(dst, bitmap, buff, i);
+            if (++unsaved >= BITMAP_SAVE_INTERVAL) {
+                unsaved = 0;
+                photon::scoped_lock lock(save_mtx);
+                save_bitmap(dst, bitmap);
+            }
+        }
+    };
+
+    std::vector<photon::join_handle *> jhs;
+    for (uint32_t k = 1; k < std::max(concurrency, 1U); k++) {
+        jhs.push_back(photon::thread_enable_join(photon::thread_create11(worker)));
+    }
+    worker();
+    for (auto jh : jhs) {
+        photon::thread_join(jh);
+    }
+
+    // keep what is written for the next try
+    photon::scoped_lock lock(save_mtx);
+    save_bitmap(dst, bitmap);
+    if (exited)
+        LOG_INFO("image file exit when background downloading");
+    return !exited && !failed;
+}
+
+bool BkDownload::download_blob() {
+    try_cnt--;
+    std::vector<uint8_t> bitmap;
+    auto dst = open_dst(bitmap);
+    if (dst == nullptr)
+        return false;
+    DEFER(delete dst;);
+
+    uint64_t nblocks = (file_size + block_size - 1) / block_size;
+    std::vector<uint64_t> blocks;
+    for (uint64_t i = 0; i < nblocks; i++) {
+        if (!test_bit(bitmap, i))
+            blocks.push_back(i);
     }
-    LOG_INFO("download blob done. (`)", dl_file_path);
+    LOG_INFO("download blob start. (`, ` of ` blocks left, concurrency `)", url, blocks.size(),
+             nblocks, concurrency);
+    if (!fetch_blocks(src_file, dst, bitmap, blocks))
+        return false;
+    if (dst->ftruncate(file_size) != 0) {
+        LOG_ERRNO_RETURN(0, false, "failed to truncate download file of `", url);
+    }
+    LOG_INFO("download blob done. (`)", dir + "/" + DOWNLOAD_TMP_NAME);
     return true;
 }
 
-void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec, int &running) {
+bool BkDownload::download_hot(size_t max_blocks) {
+    if (stats == nullptr || check_downloaded(dir))
+        return false;
+    std::vector<uint8_t> bitmap;
+    auto dst = open_dst(bitmap);
+    if (dst == nullptr)
+        return false;
+    DEFER(delete dst;);
+
+    std::vector<uint64_t> blocks;
+    for (uint64_t i = 0; i < stats->reads.size(); i++) {
+        if (stats->reads[i].load(std::memory_order_relaxed) && !test_bit(bitmap, i))
+            blocks.push_back(i);
+    }
+    if (blocks.empty())
+        return false;
+    auto n = std::min(max_blocks, blocks.size());
+    std::partial_sort(blocks.begin(), blocks.begin() + n, blocks.end(), [&](uint64_t a, uint64_t b) {
+        auto ra = stats->reads[a].load(std::memory_order_relaxed);
+        auto rb = stats->reads[b].load(std::memory_order_relaxed);
+        return ra != rb ? ra > rb : a < b;
+    });
+    blocks.resize(n);
+    LOG_DEBUG("download ` hot blocks of `", blocks.size(), url);
+    return fetch_blocks(src_file, dst, bitmap, blocks);
+}
+
+// The blocks of a layer read through the image, in blocks of the download.
+class AccessTrackedFile : public ForwardFile_Ownership {
+public:
+    AccessStats *m_stats;
+
+    AccessTrackedFile(IFile *file, AccessStats *stats)
+        : ForwardFile_Ownership(file, true), m_stats(stats) {
+    }
+    ~AccessTrackedFile() {
+        delete m_stats;
+    }
+
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        m_stats->add(offset, count);
+        return m_file->pread(buf, count, offset);
+    }
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        m_stats->add(offset, iovector_view((struct iovec *)iov, iovcnt).sum());
+        return m_file->preadv(iov, iovcnt, offset);
+    }
+};
+
+void AccessStats::add(off_t offset, size_t count) {
+    if (count == 0 || reads.empty())
+        return;
+    uint64_t last = std::min((offset + count - 1) / block_size, (uint64_t)reads.size() - 1);
+    bool first = false;
+    for (uint64_t i = offset / block_size; i <= last; i++)
+        first |= reads[i].fetch_add(1, std::memory_order_relaxed) == 0;
+    // re-reads hit the cache, and the reads of prefetch and download are not
+    // what the container is missing on
+    if (first && current_io_class() == IoClass::Foreground)
+        last_foreground.store(photon::now, std::memory_order_relaxed);
+}
+
+IFile *new_access_tracked_file(IFile *file, AccessStats *stats) {
+    return new AccessTrackedFile(file, stats);
+}
+
+// Takes up to `HOT_BATCH` of the most read blocks of each layer at a time, the
+// layers the container missed on most recently first, until no read block is
+// left to download.
+static constexpr size_t HOT_BATCH = 16;
+
+static void download_hot_blocks(std::list<BKDL::BkDownload *> &dl_list, int &running) {
+    std::vector<BKDL::BkDownload *> items;
+    for (auto item : dl_list) {
+        if (item->stats)
+            items.push_back(item);
+    }
+    while (!items.empty() && running == 1) {
+        std::stable_sort(items.begin(), items.end(), [](BkDownload *a, BkDownload *b) {
+            return a->stats->last_foreground.load() > b->stats->last_foreground.load();
+        });
+        std::vector<BKDL::BkDownload *> left;
+        for (auto item : items) {
+            if (running != 1)
+                break;
+            if (!item->lock_file())
+                continue;
+            bool more = item->download_hot(HOT_BATCH);
+            item->unlock_file();
+            if (more)
+                left.push_back(item);
+        }
+        items.swap(left);
+    }
+}
+
+void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec, int &running,
+                      bool hot_first) {
     LOG_INFO("BACKGROUND DOWNLOAD THREAD STARTED.");
     uint64_t time_st = photon::now;
     while (photon::now - time_st < delay_sec * 1000000) {
@@ -215,6 +511,16 @@ void bk_download_proc(std::list<BKDL::BkDownload *> &dl_list, uint64_t delay_sec
             break;
     }
 
+    if (hot_first && running == 1) {
+        LOG_INFO("download hot blocks first");
+        download_hot_blocks(dl_list, running);
+        // then the rest, of the layers the container missed on most recently first
+        dl_list.sort([](BkDownload *a, BkDownload *b) {
+            return (a->stats ? a->stats->last_foreground.load() : 0) >
+                   (b->stats ? b->stats->last_foreground.load() : 0);
+        });
+    }
+
     while (!dl_list.empty()) {
         if (running != 1) {
             LOG_WARN("image exited, background download exit...");
@@ -14,13 +14,18 @@
    limitations under the License.
 */
 #pragma once
+#include <atomic>
 #include <list>
 #include <string>
+#include <vector>
 #include <cstdint>
 #include <photon/fs/filesystem.h>
+#include "qos_fs.h"
 
 class ImageFile;
 class ISwitchFile;
+class SHA256Stream;
+struct LocalRanges;
 
 namespace BKDL {
 
@@ -28,18 +33,73 @@ static std::string DOWNLOAD_TMP_NAME = ".download";
 
 bool check_downloaded(const std::string &dir);
 
+// The `.download` file keeps the blob at [0, file_size), followed by a
+// DownloadMeta and a bitmap of the blocks written, so that a download resumes
+// where it stopped. The tail is cut off when every block is written.
+struct DownloadMeta {
+    uint64_t magic;
+    uint64_t file_size;
+    uint64_t nblocks;
+    uint32_t block_size;
+    uint32_t hash_state_size;
+    // the sha256 of the first `hashed` blocks, 0 if unknown
+    uint64_t hashed;
+    char hash_state[128];
+};
+static constexpr uint64_t DOWNLOAD_META_MAGIC = 0x50414d544942444cULL; // "LDBITMAP"
+
+// overrides the maxMBps of all the images at runtime, from their next block
+// on; 0 for unlimited, -1 (default) to go back to their own
+void set_max_MBps(int32_t limit);
+int32_t get_max_MBps();
+
+// How many times each block of a blob has been read through the image; the
+// most read blocks are downloaded first when scheduled so. The time the
+// container last read a block it had never read before, which missed the
+// cache most likely, tells the layers it is missing on right now. Updated
+// by the reads of any vcpu.
+struct AccessStats {
+    uint32_t block_size;
+    std::vector<std::atomic<uint32_t>> reads; // of each block
+    std::atomic<uint64_t> last_foreground{0};
+
+    AccessStats(size_t file_size, uint32_t bs) : block_size(bs), reads((file_size + bs - 1) / bs) {
+    }
+    void add(off_t offset, size_t count);
+};
+
+// Collects `stats` of the reads of the remote `file` of a layer, owns both.
+photon::fs::IFile *new_access_tracked_file(photon::fs::IFile *file, AccessStats *stats);
+
 class BkDownload {
 public:
     std::string dir;
     uint32_t try_cnt;
+    // reads are charged to the image's bucket if given
+    TokenBucket *qos_bucket = nullptr;
+    // blocks are fetched by this many threads at once
+    uint32_t concurrency = 1;
+    // the blob opened on the registry cache, blocks already cached are
+    // copied from it instead of fetched again. owned if given.
+    photon::fs::IFile *cache_file = nullptr;
+    // the reads of the layer through the image, owned by its tracked file
+    AccessStats *stats = nullptr;
+    // the blocks written and synced are served from the download file through
+    // these, owned by the range switch file of the layer
+    LocalRanges *ranges = nullptr;
 
     bool download();
+    // downloads up to `max_blocks` of the blocks read but not written yet,
+    // the most read first; returns false when there is none or it fails
+    bool download_hot(size_t max_blocks);
     bool lock_file();
     void unlock_file();
 
     BkDownload() = delete;
     ~BkDownload() {
         unlock_file();
+        delete m_hash;
+        delete cache_file;
         delete src_file;
     }
     BkDownload(ISwitchFile *sw_file, photon::fs::IFile *src_file, size_t file_size,
@@ -54,6 +114,15 @@ private:
     void switch_to_local_file();
     bool download_blob();
     bool download_done();
+    bool load_bitmap(photon::fs::IFile *dst, std::vector<uint8_t> &bitmap);
+    bool save_bitmap(photon::fs::IFile *dst, const std::vector<uint8_t> &bitmap);
+    ssize_t fetch_block(photon::fs::IFile *src, void *buf, size_t count, off_t offset);
+    bool fetch_blocks(photon::fs::IFile *src, photon::fs::IFile *dst, std::vector<uint8_t> &bitmap,
+                      const std::vector<uint64_t> &blocks);
+    photon::fs::IFile *open_dst(std::vector<uint8_t> &bitmap);
+    void publish_ranges(const std::vector<uint8_t> &bitmap);
+    void advance_hash(photon::fs::IFile *dst, const std::vector<uint8_t> &bitmap, void *buf,
+                      uint64_t ready);
 
     ISwitchFile *sw_file = nullptr;
     photon::fs::IFile *src_file = nullptr;
@@ -62,10 +131,16 @@ private:
     std::string url;
     int &running;
     int32_t limit_MB_ps;
+    TokenBucket m_throttle;
     uint32_t block_size;
     bool force_download = false;
+    // the blob is hashed in order as the blocks land, up to `m_hashed`
+    SHA256Stream *m_hash = nullptr;
+    uint64_t m_hashed = 0;
+    bool m_hashing = false;
 };
 
-void bk_download_proc(std::list<BKDL::BkDownload *> &, uint64_t, int &);
+// with `hot_first`, the hot blocks of all layers are downloaded before the rest
+void bk_download_proc(std::list<BKDL::BkDownload *> &, uint64_t, int &, bool hot_first = false);
 
 } // namespace BKDL
\ No newline at end of file
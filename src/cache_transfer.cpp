@@ -0,0 +1,447 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "cache_transfer.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/estring.h>
+#include <photon/common/utility.h>
+#include <photon/net/http/client.h>
+#include <photon/thread/thread11.h>
+#include <rapidjson/document.h>
+#include <rapidjson/stringbuffer.h>
+#include <rapidjson/writer.h>
+
+#include "overlaybd/buffer_pool.h"
+
+namespace CacheTransfer {
+
+using photon::net::http::Verb;
+using HTTP_OP = photon::net::http::Client::OperationOnStack<64 * 1024 - 1>;
+typedef std::pair<uint64_t, uint64_t> Range; // offset, length
+
+static size_t chunk_size(size_t refill_unit) {
+    return std::max<size_t>(kChunkSize / refill_unit, 1) * refill_unit;
+}
+
+static std::string query_param(std::string_view query, std::string_view key) {
+    while (!query.empty()) {
+        auto amp = query.find('&');
+        auto kv = query.substr(0, amp);
+        query = amp == std::string_view::npos ? std::string_view() : query.substr(amp + 1);
+        auto eq = kv.find('=');
+        if (eq != std::string_view::npos && kv.substr(0, eq) == key)
+            return std::string(kv.substr(eq + 1));
+    }
+    return {};
+}
+
+static bool ends_with(std::string_view s, std::string_view suffix) {
+    return s.size() >= suffix.size() && s.substr(s.size() - suffix.size()) == suffix;
+}
+
+static const char kBearer[] = "Bearer ";
+
+bool valid_name(std::string_view name) {
+    if (name.size() < 2 || name[0] != '/')
+        return false;
+    for (auto c : name) {
+        if ((unsigned char)c < 0x20 || c == 0x7f)
+            return false;
+    }
+    name.remove_prefix(1);
+    while (!name.empty()) {
+        auto slash = name.find('/');
+        auto part = name.substr(0, slash);
+        if (part.empty() || part == "." || part == "..")
+            return false;
+        if (slash == std::string_view::npos)
+            break;
+        name.remove_prefix(slash + 1);
+        // a trailing slash leaves an empty component
+        if (name.empty())
+            return false;
+    }
+    return true;
+}
+
+// compares in a time that doesn't depend on where they differ
+static bool equal_token(std::string_view a, std::string_view b) {
+    if (a.size() != b.size())
+        return false;
+    unsigned char diff = 0;
+    for (size_t i = 0; i < a.size(); i++)
+        diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+bool authorized(std::string_view auth, std::string_view token) {
+    if (token.empty())
+        return true;
+    return auth.substr(0, sizeof(kBearer) - 1) == kBearer &&
+           equal_token(auth.substr(sizeof(kBearer) - 1), token);
+}
+
+static int reply(photon::net::http::Response &resp, int code, const char *type = nullptr,
+                 const void *body = nullptr, size_t len = 0) {
+    resp.set_result(code);
+    resp.keep_alive(true);
+    if (type)
+        resp.headers.insert("Content-Type", type);
+    resp.headers.content_length(len);
+    if (len && resp.write((void *)body, len) != (ssize_t)len)
+        LOG_ERRNO_RETURN(0, -1, "failed to write cache export response");
+    return 0;
+}
+
+// the ranges of `name` cached, in refill units
+static int cached_ranges(FileSystem::ICachePool *pool, size_t refill_unit, const std::string &name,
+                         uint64_t &size, std::vector<Range> &ranges) {
+    // it may have been evicted since listed
+    auto store = pool->open(name, O_RDONLY, 0);
+    if (store == nullptr)
+        return -1;
+    DEFER(store->release());
+    struct stat st;
+    if (store->fstat(&st) != 0)
+        return -1;
+    size = st.st_size;
+    for (uint64_t off = 0; off < size; off += refill_unit) {
+        auto len = std::min<uint64_t>(refill_unit, size - off);
+        auto q = store->queryRefillRange(off, len);
+        if (q.first < 0)
+            return -1;
+        if (q.second)
+            continue;
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == off)
+            ranges.back().second += len;
+        else
+            ranges.emplace_back(off, len);
+    }
+    return 0;
+}
+
+int ExportHandler::handle_request(photon::net::http::Request &req,
+                                  photon::net::http::Response &resp, std::string_view) {
+    if (req.verb() != Verb::GET)
+        return reply(resp, 405);
+    if (!authorized(req.headers["Authorization"], m_token))
+        return reply(resp, 401);
+    auto target = req.target();
+    auto path = target.substr(0, target.find('?'));
+    auto it = m_pools.find(query_param(req.query(), "pool"));
+    if (it == m_pools.end())
+        return reply(resp, 404);
+    if (ends_with(path, "/manifest"))
+        return manifest(resp, it->first, it->second);
+    if (ends_with(path, "/data"))
+        return data(req, resp, it->second);
+    return reply(resp, 404);
+}
+
+int ExportHandler::manifest(photon::net::http::Response &resp, const std::string &name,
+                            Pool &pool) {
+    std::vector<std::string> names;
+    if (pool.pool->list_files(names) != 0)
+        LOG_ERRNO_RETURN(0, reply(resp, 500), "failed to list the files of ` cache", name);
+    rapidjson::StringBuffer buf;
+    rapidjson::Writer<rapidjson::StringBuffer> w(buf);
+    w.StartObject();
+    w.Key("pool");
+    w.String(name.data(), name.size());
+    w.Key("refillUnit");
+    w.Uint64(pool.refill_unit);
+    w.Key("files");
+    w.StartArray();
+    uint64_t nfiles = 0, total = 0;
+    std::set<std::string> listed;
+    for (auto &file : names) {
+        uint64_t size = 0;
+        std::vector<Range> ranges;
+        if (!valid_name(file) ||
+            cached_ranges(pool.pool, pool.refill_unit, file, size, ranges) != 0 || ranges.empty())
+            continue;
+        w.StartObject();
+        w.Key("name");
+        w.String(file.data(), file.size());
+        w.Key("size");
+        w.Uint64(size);
+        w.Key("ranges");
+        w.StartArray();
+        for (auto &r : ranges) {
+            w.StartArray();
+            w.Uint64(r.first);
+            w.Uint64(r.second);
+            w.EndArray();
+            total += r.second;
+        }
+        w.EndArray();
+        w.EndObject();
+        listed.insert(file);
+        nfiles++;
+    }
+    w.EndArray();
+    w.EndObject();
+    // swapped in at once, as data requests run meanwhile
+    pool.listed.swap(listed);
+    LOG_INFO("export manifest of ` cache, ` files, ` bytes cached", name, nfiles, total);
+    return reply(resp, 200, "application/json", buf.GetString(), buf.GetSize());
+}
+
+int ExportHandler::data(photon::net::http::Request &req, photon::net::http::Response &resp,
+                        Pool &pool) {
+    std::string file(req.headers[kFileHeader]);
+    std::string range(req.headers["Range"]);
+    long long begin, end;
+    if (file.empty() || sscanf(range.c_str(), "bytes=%lld-%lld", &begin, &end) != 2 ||
+        begin < 0 || end < begin || (size_t)(end - begin + 1) > chunk_size(pool.refill_unit))
+        return reply(resp, 400);
+    if (!valid_name(file))
+        return reply(resp, 400);
+    // not anything the pool would open, or create the directories of
+    if (pool.listed.count(file) == 0)
+        return reply(resp, 404);
+    size_t count = end - begin + 1;
+    auto store = pool.pool->open(file, O_RDONLY, 0);
+    if (store == nullptr)
+        return reply(resp, 404);
+    DEFER(store->release());
+    // only what's cached, as a miss would be refilled from the registry
+    if (begin + (off_t)count > store->get_actual_size())
+        return reply(resp, 416);
+    auto q = store->queryRefillRange(begin, count);
+    if (q.first < 0 || q.second)
+        return reply(resp, 416);
+    auto buf = BufferPool::buffer(count);
+    auto ret = store->pread(buf.get(), count, begin);
+    if (ret != (ssize_t)count) {
+        LOG_ERRNO_RETURN(0, reply(resp, 500), "failed to read cached range ", VALUE(file),
+                         VALUE(begin), VALUE(count));
+    }
+    return reply(resp, 206, "application/octet-stream", buf.get(), count);
+}
+
+struct Importer {
+    struct File {
+        std::string name;
+        uint64_t size;
+        FileSystem::ICacheStore *store = nullptr;
+        uint32_t pending = 0; // chunks not loaded yet
+    };
+    struct Chunk {
+        uint32_t file;
+        uint64_t offset, count;
+    };
+
+    photon::net::http::Client *client;
+    std::string url; // of the data
+    std::string auth;
+    FileSystem::ICachePool *pool;
+    size_t chunk;
+    std::vector<File> files;
+    std::vector<Chunk> chunks;
+    // shared by the workers, all on the vcpu of the caller
+    size_t next = 0;
+    uint64_t loaded = 0, skipped = 0, failed = 0;
+    bool full = false;
+
+    FileSystem::ICacheStore *open(File &f) {
+        if (f.store)
+            return f.store;
+        auto store = pool->open(f.name, O_RDWR | O_CREAT, 0644);
+        if (store == nullptr)
+            return nullptr;
+        // opened by another worker meanwhile
+        if (f.store) {
+            store->release();
+            return f.store;
+        }
+        if (store->get_actual_size() < (off_t)f.size)
+            store->set_actual_size(f.size);
+        f.store = store;
+        return store;
+    }
+
+    void close(File &f) {
+        if (--f.pending == 0 && f.store) {
+            f.store->release();
+            f.store = nullptr;
+        }
+    }
+
+    int load(File &f, Chunk &c, char *buf) {
+        auto store = open(f);
+        if (store == nullptr)
+            LOG_ERRNO_RETURN(0, -1, "failed to open cache file `", f.name);
+        auto q = store->queryRefillRange(c.offset, c.count);
+        if (q.first < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to query cache file `", f.name);
+        // cached already, e.g. by an import before
+        if (q.second == 0) {
+            skipped += c.count;
+            return 0;
+        }
+        HTTP_OP op(client, Verb::GET, url);
+        op.req.headers.insert(kFileHeader, f.name);
+        if (!auth.empty())
+            op.req.headers.insert("Authorization", auth);
+        op.req.headers.range(c.offset, c.offset + c.count - 1);
+        op.set_enable_proxy(false);
+        client->call(&op);
+        if (op.status_code != 206) {
+            LOG_ERROR_RETURN(EIO, -1, "failed to fetch cached range ", VALUE(f.name),
+                             VALUE(c.offset), VALUE(op.status_code));
+        }
+        uint64_t got = 0;
+        while (got < c.count) {
+            auto ret = op.resp.read(buf + got, c.count - got);
+            if (ret <= 0)
+                break;
+            got += ret;
+        }
+        if (got != c.count)
+            LOG_ERROR_RETURN(EIO, -1, "short read of cached range ", VALUE(f.name), VALUE(c.offset),
+                             VALUE(got));
+        if (store->pwrite(buf, c.count, c.offset) != (ssize_t)c.count) {
+            if (errno == ENOSPC)
+                full = true;
+            LOG_ERRNO_RETURN(0, -1, "failed to write cached range ", VALUE(f.name),
+                             VALUE(c.offset));
+        }
+        loaded += c.count;
+        return 0;
+    }
+
+    void work() {
+        auto buf = BufferPool::buffer(chunk);
+        while (!full && next < chunks.size()) {
+            auto &c = chunks[next++];
+            auto &f = files[c.file];
+            if (load(f, c, buf.get()) != 0)
+                failed++;
+            close(f);
+        }
+    }
+};
+
+static int fetch_manifest(photon::net::http::Client *client, const std::string &url,
+                          const std::string &auth, std::string &body) {
+    HTTP_OP op(client, Verb::GET, url);
+    if (!auth.empty())
+        op.req.headers.insert("Authorization", auth);
+    op.set_enable_proxy(false);
+    client->call(&op);
+    if (op.status_code != 200)
+        LOG_ERROR_RETURN(EIO, -1, "failed to fetch cache manifest ", VALUE(url),
+                         VALUE(op.status_code));
+    const size_t step = 64 * 1024;
+    while (true) {
+        auto size = body.size();
+        body.resize(size + step);
+        auto ret = op.resp.read(&body[size], step);
+        body.resize(size + (ret > 0 ? ret : 0));
+        if (ret <= 0)
+            break;
+    }
+    return 0;
+}
+
+ssize_t import(const std::string &url, const char *name, FileSystem::ICachePool *pool,
+               size_t refill_unit, uint32_t concurrency, const std::string &token) {
+    auto client = photon::net::http::new_http_client();
+    if (client == nullptr)
+        LOG_ERRNO_RETURN(0, -1, "failed to create http client");
+    DEFER(delete client);
+    std::string auth, body;
+    if (!token.empty())
+        auth = estring().appends(kBearer, token);
+    if (fetch_manifest(client, estring().appends(url, "/manifest?pool=", name), auth, body) != 0)
+        return -1;
+    rapidjson::Document doc;
+    doc.Parse(body.data(), body.size());
+    if (doc.HasParseError() || !doc.IsObject() || !doc.HasMember("refillUnit") ||
+        !doc["refillUnit"].IsUint64() || !doc.HasMember("files") || !doc["files"].IsArray())
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid cache manifest from `", url);
+    // the ranges are cached by units, and kept by units if compressed
+    if (doc["refillUnit"].GetUint64() != refill_unit)
+        LOG_ERROR_RETURN(EINVAL, -1, "refill unit of ` cache is `, but ` of the peer", name,
+                         refill_unit, doc["refillUnit"].GetUint64());
+
+    Importer im;
+    im.client = client;
+    im.url = estring().appends(url, "/data?pool=", name);
+    im.auth = auth;
+    im.pool = pool;
+    im.chunk = chunk_size(refill_unit);
+    uint64_t total = 0;
+    for (auto &f : doc["files"].GetArray()) {
+        if (!f.IsObject() || !f.HasMember("name") || !f["name"].IsString() ||
+            !f.HasMember("size") || !f["size"].IsUint64() || !f.HasMember("ranges") ||
+            !f["ranges"].IsArray())
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid file in cache manifest from `", url);
+        Importer::File file;
+        file.name = f["name"].GetString();
+        file.size = f["size"].GetUint64();
+        // created in the pool by that name
+        if (!valid_name(file.name))
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid file name ` in cache manifest from `",
+                             file.name, url);
+        uint32_t index = im.files.size();
+        for (auto &r : f["ranges"].GetArray()) {
+            if (!r.IsArray() || r.Size() != 2 || !r[0].IsUint64() || !r[1].IsUint64() ||
+                r[0].GetUint64() + r[1].GetUint64() > file.size)
+                LOG_ERROR_RETURN(EINVAL, -1, "invalid range of ` in cache manifest from `",
+                                 file.name, url);
+            auto end = r[0].GetUint64() + r[1].GetUint64();
+            for (auto off = r[0].GetUint64(); off < end; off += im.chunk) {
+                im.chunks.push_back({index, off, std::min<uint64_t>(im.chunk, end - off)});
+                file.pending++;
+            }
+            total += r[1].GetUint64();
+        }
+        im.files.push_back(std::move(file));
+    }
+
+    LOG_INFO("import ` cache from `, ` files, ` bytes", name, url, im.files.size(), total);
+    auto begin = photon::now;
+    std::vector<photon::join_handle *> jhs;
+    for (uint32_t i = 0; i < std::max(concurrency, 1U); i++) {
+        auto th = photon::thread_create11(&Importer::work, &im);
+        jhs.push_back(photon::thread_enable_join(th));
+    }
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    // left open if the cache got full
+    for (auto &f : im.files) {
+        if (f.store)
+            f.store->release();
+    }
+    auto elapsed = std::max<uint64_t>(photon::now - begin, 1);
+    LOG_INFO("imported ` cache, ` bytes loaded, ` cached already, ` chunks failed, in `ms, `MB/s",
+             name, im.loaded, im.skipped, im.failed, elapsed / 1000,
+             im.loaded * 1000000 / elapsed >> 20);
+    if (im.full)
+        LOG_WARN("` cache got full during the import", name);
+    return im.loaded;
+}
+
+} // namespace CacheTransfer
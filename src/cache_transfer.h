@@ -0,0 +1,92 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <sys/types.h>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <photon/net/http/server.h>
+
+#include "overlaybd/cache/pool_store.h"
+
+// Moves the contents of the file cache and the gzip cache from a warm node to
+// a new one, so that it starts with the hot set instead of refilling it from
+// the registry.
+//
+// A node exports its caches through the exporter server:
+//   - GET <prefix>/manifest?pool=<pool> returns the files of the cache with
+//     the ranges cached, in refill units, as JSON:
+//     {"pool":"file","refillUnit":262144,"files":[{"name":"/sha256:...",
+//      "size":1234,"ranges":[[0,524288],...]},...]}
+//   - GET <prefix>/data?pool=<pool> returns the data of a cached range, the
+//     file named by the kFileHeader header and the range by Range, of the
+//     files listed by the last manifest only
+// and a new node imports them by a manifest, fetching the ranges it misses
+// in parallel and writing them to its own cache, before it serves devices.
+// Requests carry "Authorization: Bearer <token>" if the exporter has a token.
+namespace CacheTransfer {
+
+static const char kFileHeader[] = "X-Overlaybd-Cache-File";
+// max bytes of a data request, rounded down to refill units
+static const size_t kChunkSize = 4UL << 20;
+
+// whether `name` may be a file of a cache, i.e. an absolute path without
+// empty, "." or ".." components, as the pools list them
+bool valid_name(std::string_view name);
+
+// whether the Authorization header `auth` carries "Bearer <token>", compared
+// in a time that doesn't depend on where they differ; any if `token` is empty
+bool authorized(std::string_view auth, std::string_view token);
+
+class ExportHandler : public photon::net::http::HTTPHandler {
+public:
+    // requests without `token` are rejected, unless it's empty
+    explicit ExportHandler(const std::string &token = "") : m_token(token) {
+    }
+
+    // serves `pool` by `name`, e.g. "file" or "gzip"
+    void add(const char *name, FileSystem::ICachePool *pool, size_t refill_unit) {
+        m_pools[name] = {pool, refill_unit, {}};
+    }
+
+    int handle_request(photon::net::http::Request &req, photon::net::http::Response &resp,
+                       std::string_view) override;
+
+private:
+    struct Pool {
+        FileSystem::ICachePool *pool;
+        size_t refill_unit;
+        // listed by the last manifest, the files served by data
+        std::set<std::string> listed;
+    };
+    std::string m_token;
+    std::map<std::string, Pool> m_pools;
+
+    int manifest(photon::net::http::Response &resp, const std::string &name, Pool &pool);
+    int data(photon::net::http::Request &req, photon::net::http::Response &resp, Pool &pool);
+};
+
+// loads the pool named `name` exported at `url` (the prefix of the exporter)
+// into `pool`, by `concurrency` requests at a time, authorized by `token` if
+// not empty; returns the bytes loaded, or -1 if the manifest can't be fetched,
+// doesn't match the pool or names a file not valid_name()
+ssize_t import(const std::string &url, const char *name, FileSystem::ICachePool *pool,
+               size_t refill_unit, uint32_t concurrency, const std::string &token = "");
+
+} // namespace CacheTransfer
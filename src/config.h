@@ -41,6 +41,9 @@ struct UpperConfig : public ConfigUtils::Config {
     APPCFG_PARA(data, std::string, "");
     APPCFG_PARA(target, std::string, "");
     APPCFG_PARA(gzipIndex, std::string, "");
+    APPCFG_PARA(writeCache, bool, false);
+    APPCFG_PARA(gcIntervalSec, uint32_t, 0);
+    APPCFG_PARA(gcGarbagePercent, uint32_t, 50);
 };
 
 struct DownloadConfig : public ConfigUtils::Config {
@@ -52,6 +55,8 @@ struct DownloadConfig : public ConfigUtils::Config {
     APPCFG_PARA(maxMBps, int, 100);
     APPCFG_PARA(tryCnt, int, 5);
     APPCFG_PARA(blockSize, uint32_t, 262144);
+    APPCFG_PARA(concurrency, uint32_t, 4);
+    APPCFG_PARA(schedule, std::string, "sequential");
 };
 
 struct ImageConfig : public ConfigUtils::Config {
@@ -64,6 +69,9 @@ struct ImageConfig : public ConfigUtils::Config {
     APPCFG_PARA(download, DownloadConfig);
     APPCFG_PARA(accelerationLayer, bool, false);
     APPCFG_PARA(recordTracePath, std::string, "");
+    APPCFG_PARA(ioRecordPath, std::string, "");
+    APPCFG_PARA(mergedIndex, std::string, "");
+    APPCFG_PARA(cachePriority, std::string, "normal");
 };
 
 struct P2PConfig : public ConfigUtils::Config {
@@ -71,6 +79,11 @@ struct P2PConfig : public ConfigUtils::Config {
 
     APPCFG_PARA(enable, bool, false);
     APPCFG_PARA(address, std::string, "http://localhost:9731/accelerator");
+    APPCFG_PARA(self, std::string, "");
+    APPCFG_PARA(peers, std::vector<std::string>);
+    APPCFG_PARA(peerPort, uint32_t, 19150);
+    APPCFG_PARA(peerBindAddress, std::string, "");
+    APPCFG_PARA(peerToken, std::string, "");
 };
 
 struct GzipCacheConfig : public ConfigUtils::Config {
@@ -80,6 +93,9 @@ struct GzipCacheConfig : public ConfigUtils::Config {
     APPCFG_PARA(cacheDir, std::string, "/opt/overlaybd/gzip_cache");
     APPCFG_PARA(cacheSizeGB, uint32_t, 4);
     APPCFG_PARA(refillSize, uint32_t, 1024 * 1024);
+    APPCFG_PARA(compress, bool, false);
+    APPCFG_PARA(shareCapacity, bool, false);
+    APPCFG_PARA(reservedGB, uint32_t, 0);
 };
 
 struct ExporterConfig : public ConfigUtils::Config {
@@ -88,7 +104,14 @@ struct ExporterConfig : public ConfigUtils::Config {
     APPCFG_PARA(enable, bool, false);
     APPCFG_PARA(uriPrefix, std::string, "/metrics");
     APPCFG_PARA(port, int, 9863);
+    APPCFG_PARA(address, std::string, "");
     APPCFG_PARA(updateInterval, uint64_t, 60UL * 1000 * 1000);
+    APPCFG_PARA(traceSampleRate, uint32_t, 0);
+    APPCFG_PARA(traceUriPrefix, std::string, "/trace");
+    APPCFG_PARA(adminUriPrefix, std::string, "");
+    APPCFG_PARA(cacheUriPrefix, std::string, "");
+    APPCFG_PARA(cacheToken, std::string, "");
+    APPCFG_PARA(cpuAccounting, bool, false);
 };
 
 struct CredentialConfig : public ConfigUtils::Config {
@@ -96,6 +119,7 @@ struct CredentialConfig : public ConfigUtils::Config {
     APPCFG_PARA(mode, std::string, "");
     APPCFG_PARA(path, std::string, "");
     APPCFG_PARA(timeout, int, 1);
+    APPCFG_PARA(cacheTTL, uint32_t, 60);
 };
 
 struct CacheConfig : public ConfigUtils::Config {
@@ -106,6 +130,19 @@ struct CacheConfig : public ConfigUtils::Config {
     APPCFG_PARA(cacheSizeGB, uint32_t, 4);
     APPCFG_PARA(refillSize, uint32_t, 262144);
     APPCFG_PARA(blockSize, uint32_t, 65536);
+    APPCFG_PARA(memoryCacheSizeMB, uint32_t, 0);
+    APPCFG_PARA(evictionPolicy, std::string, "lru");
+    APPCFG_PARA(maxRefillSize, uint32_t, 0);
+    APPCFG_PARA(writebackBufferMB, uint32_t, 0);
+    APPCFG_PARA(poolShards, uint32_t, 1);
+    APPCFG_PARA(directWrite, bool, false);
+    APPCFG_PARA(ioEngine, uint32_t, 0);
+    APPCFG_PARA(reservedGB, uint32_t, 0);
+    APPCFG_PARA(warmFrom, std::string, "");
+    APPCFG_PARA(warmConcurrency, uint32_t, 8);
+    APPCFG_PARA(warmToken, std::string, "");
+    APPCFG_PARA(pinMetadata, bool, true);
+    APPCFG_PARA(ocfHugePage, bool, false);
 };
 
 struct LogConfig : public ConfigUtils::Config {
@@ -121,6 +158,48 @@ struct PrefetchConfig : public ConfigUtils::Config {
     APPCFG_CLASS
 
     APPCFG_PARA(concurrency, int, 16);
+    APPCFG_PARA(aheadMs, uint32_t, 0);
+    APPCFG_PARA(aheadMB, uint32_t, 0);
+    APPCFG_PARA(minHitPercent, uint32_t, 50);
+};
+
+struct RegistryConfig : public ConfigUtils::Config {
+    APPCFG_CLASS
+
+    APPCFG_PARA(maxConnsPerHost, uint32_t, 0);
+    APPCFG_PARA(coalesceWindowUs, uint32_t, 0);
+    APPCFG_PARA(coalesceGap, uint32_t, 65536);
+    APPCFG_PARA(stripeSizeKB, uint32_t, 0);
+    APPCFG_PARA(hedgeRequests, bool, false);
+    APPCFG_PARA(warmConnections, uint32_t, 0);
+};
+
+struct QosConfig : public ConfigUtils::Config {
+    APPCFG_CLASS
+
+    APPCFG_PARA(enable, bool, false);
+    APPCFG_PARA(maxInflight, uint32_t, 32);
+    APPCFG_PARA(prefetchMBps, uint32_t, 0);
+    APPCFG_PARA(downloadMBps, uint32_t, 0);
+    APPCFG_PARA(imageMBps, uint32_t, 0);
+    APPCFG_PARA(latencyTargetMs, uint32_t, 50);
+};
+
+struct SquashConfig : public ConfigUtils::Config {
+    APPCFG_CLASS
+
+    APPCFG_PARA(enable, bool, false);
+    APPCFG_PARA(dir, std::string, "/opt/overlaybd/squash");
+    APPCFG_PARA(minLayers, uint32_t, 32);
+    APPCFG_PARA(minOpens, uint32_t, 2);
+    APPCFG_PARA(delaySec, uint32_t, 300);
+};
+
+struct LazyOpenConfig : public ConfigUtils::Config {
+    APPCFG_CLASS
+
+    APPCFG_PARA(enable, bool, false);
+    APPCFG_PARA(dir, std::string, "/opt/overlaybd/merged_index");
 };
 
 struct CertConfig : public ConfigUtils::Config {
@@ -144,15 +223,38 @@ struct GlobalConfig : public ConfigUtils::Config {
     APPCFG_PARA(download, DownloadConfig);
     APPCFG_PARA(enableAudit, bool, true);
     APPCFG_PARA(enableThread, bool, false);
+    APPCFG_PARA(vcpuNum, uint32_t, 0);
+    APPCFG_PARA(numaAware, bool, false);
+    APPCFG_PARA(batchCommands, bool, false);
+    APPCFG_PARA(deviceMaxInflight, uint32_t, 0);
+    APPCFG_PARA(handoffPath, std::string, "");
     APPCFG_PARA(p2pConfig, P2PConfig);
     APPCFG_PARA(exporterConfig, ExporterConfig);
     APPCFG_PARA(auditPath, std::string, "/var/log/overlaybd-audit.log");
+    APPCFG_PARA(auditAsync, bool, true);
     APPCFG_PARA(registryFsVersion, std::string, "v2");
+    APPCFG_PARA(registryConfig, RegistryConfig);
+    APPCFG_PARA(qosConfig, QosConfig);
     APPCFG_PARA(cacheConfig, CacheConfig);
     APPCFG_PARA(gzipCacheConfig, GzipCacheConfig);
     APPCFG_PARA(logConfig, LogConfig);
     APPCFG_PARA(prefetchConfig, PrefetchConfig);
     APPCFG_PARA(certConfig, CertConfig);
+    APPCFG_PARA(squashConfig, SquashConfig);
+    APPCFG_PARA(lazyOpenConfig, LazyOpenConfig);
+    APPCFG_PARA(indexLayout, std::string, "flat");
+    APPCFG_PARA(lsmtIoConcurrency, uint32_t, 1);
+    APPCFG_PARA(lsmtPooledIndex, bool, false);
+    APPCFG_PARA(layerOpenConcurrency, uint32_t, 32);
+    APPCFG_PARA(imageOpenConcurrency, uint32_t, 16);
+    APPCFG_PARA(imageMemoryBudgetMB, uint32_t, 0);
+    APPCFG_PARA(zfileCacheSizeMB, uint32_t, 0);
+    APPCFG_PARA(zfileDecompressThreads, uint32_t, 0);
+    APPCFG_PARA(zfileVerifySampling, uint32_t, 0);
+    APPCFG_PARA(gzipSpanCacheSizeMB, uint32_t, 0);
+    APPCFG_PARA(gzipInflateBackend, std::string, "");
+    APPCFG_PARA(gzipWindowMmap, bool, false);
+    APPCFG_PARA(ioBufferHugePage, bool, false);
 };
 
 struct AuthConfig : public ConfigUtils::Config {
@@ -0,0 +1,96 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "credential_cache.h"
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/thread/thread11.h>
+
+CredentialCache::~CredentialCache() {
+    photon::scoped_lock l(m_mtx);
+    while (m_refreshing)
+        m_refreshed.wait(m_mtx);
+}
+
+CredentialCache::Credential CredentialCache::get(const std::string &key,
+                                                 const std::string &remote_path) {
+    Entry *entry;
+    {
+        photon::scoped_lock l(m_mtx);
+        auto &e = m_entries[key];
+        if (!e)
+            e.reset(new Entry);
+        entry = e.get();
+        while (true) {
+            auto age = photon::now - entry->resolved;
+            if (entry->valid && age < m_ttl) {
+                if (age >= m_ttl / 2 && !entry->resolving) {
+                    LOG_DEBUG("refresh credential of ` in background", key);
+                    entry->resolving = true;
+                    m_refreshing++;
+                    photon::thread_create11(&CredentialCache::refresh, this, entry,
+                                            remote_path);
+                }
+                return entry->cred;
+            }
+            if (!entry->resolving)
+                break;
+            // shares the resolution in flight
+            auto generation = entry->generation;
+            while (entry->generation == generation)
+                entry->done.wait(m_mtx);
+            if (photon::now - entry->resolved >= m_ttl)
+                return entry->valid ? entry->cred : Credential();
+        }
+        entry->resolving = true;
+    }
+    resolve(entry, remote_path);
+    photon::scoped_lock l(m_mtx);
+    return entry->valid ? entry->cred : Credential();
+}
+
+void CredentialCache::invalidate(const std::string &key) {
+    photon::scoped_lock l(m_mtx);
+    auto it = m_entries.find(key);
+    if (it == m_entries.end() || !it->second->valid)
+        return;
+    LOG_INFO("credential of ` rejected, resolve it again", key);
+    it->second->valid = false;
+}
+
+void CredentialCache::resolve(Entry *entry, const std::string &remote_path) {
+    Credential cred;
+    auto ret = m_resolver(remote_path, cred);
+    photon::scoped_lock l(m_mtx);
+    if (ret == 0) {
+        entry->cred = cred;
+        entry->resolved = photon::now;
+        entry->valid = true;
+    } else {
+        LOG_WARN("failed to resolve credential of `, ` credential kept", remote_path,
+                 entry->valid ? "the expired" : "no");
+    }
+    entry->resolving = false;
+    entry->generation++;
+    entry->done.notify_all();
+}
+
+void CredentialCache::refresh(Entry *entry, std::string remote_path) {
+    resolve(entry, remote_path);
+    photon::scoped_lock l(m_mtx);
+    if (--m_refreshing == 0)
+        m_refreshed.notify_all();
+}
@@ -0,0 +1,72 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <photon/common/callback.h>
+#include <photon/thread/thread.h>
+
+// The credentials resolved for a repository, kept for `ttl_us` so that the
+// images and layers of one repository cost a single resolution. A lookup
+// finding a resolution in flight for its repository waits for it instead of
+// starting another; one finding its credential past half of its ttl gets it
+// at once and has it resolved again in background. A failed resolution is not
+// kept, and an expired credential is still returned if resolving it again
+// fails. A credential the registry rejects is invalidated, so that the
+// lookup retrying it resolves it again.
+class CredentialCache {
+public:
+    typedef std::pair<std::string, std::string> Credential; // username, password
+    // resolves the credential of `remote_path`, 0 on success even if no
+    // credential is configured for it
+    typedef Delegate<int, const std::string &, Credential &> Resolver;
+
+    CredentialCache(Resolver resolver, uint64_t ttl_us) : m_resolver(resolver), m_ttl(ttl_us) {
+    }
+    // waits for the resolutions in background
+    ~CredentialCache();
+
+    // `key` names the repository of `remote_path`
+    Credential get(const std::string &key, const std::string &remote_path);
+
+    // drops the credential of `key`, e.g. rejected by the registry
+    void invalidate(const std::string &key);
+
+private:
+    struct Entry {
+        Credential cred;
+        uint64_t resolved = 0; // photon::now
+        bool valid = false;
+        bool resolving = false;
+        uint64_t generation = 0; // of resolutions done
+        photon::condition_variable done;
+    };
+
+    Resolver m_resolver;
+    uint64_t m_ttl;
+    photon::mutex m_mtx;
+    std::map<std::string, std::unique_ptr<Entry>> m_entries;
+    uint32_t m_refreshing = 0;
+    photon::condition_variable m_refreshed;
+
+    void resolve(Entry *entry, const std::string &remote_path);
+    void refresh(Entry *entry, std::string remote_path);
+};
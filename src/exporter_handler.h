@@ -16,11 +16,19 @@
 
 #pragma once
 
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <photon/common/conststr.h>
 #include <photon/common/estring.h>
 #include <photon/common/metric-meter/metrics.h>
 #include <photon/net/http/server.h>
 
+#include "io_trace.h"
+#include "overlaybd/cpu_account.h"
+#include "latency_histogram.h"
+#include "metrics_fs.h"
 #include "textexporter.h"
 
 namespace ExposeMetrics {
@@ -49,6 +57,32 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
     EXPOSE_PHOTON_METRICLIST(latency, Metric::MaxLatencyCounter);
     EXPOSE_PHOTON_METRICLIST(count, Metric::AddCounter);
     EXPOSE_PHOTON_METRICLIST(cache, Metric::ValueCounter);
+    EXPOSE_PHOTON_METRICLIST(index, Metric::ValueCounter);
+    EXPOSE_PHOTON_METRICLIST(zfile_cache, Metric::ValueCounter);
+    EXPOSE_PHOTON_METRICLIST(gzip_span_cache, Metric::ValueCounter);
+    EXPOSE_PHOTON_METRICLIST(refill, Metric::ValueCounter);
+    EXPOSE_PHOTON_METRICLIST(histogram, LatencyHistogram);
+
+    // renders metrics not known in advance, appended as is
+    std::function<std::string()> extra;
+
+    std::mutex layers_mtx;
+    std::map<std::string, std::weak_ptr<LayerStats>> layers;
+
+    // the per-layer stats of `source`, created on first use and exported
+    // while any image or file holds them
+    std::shared_ptr<LayerStats> layer_stats(const std::string& image, const std::string& layer,
+                                            const std::string& source) {
+        auto key = image + "\n" + layer + "\n" + source;
+        std::lock_guard<std::mutex> lock(layers_mtx);
+        auto& w = layers[key];
+        auto s = w.lock();
+        if (!s) {
+            s = std::make_shared<LayerStats>(image, layer, source);
+            w = s;
+        }
+        return s;
+    }
 
     template <typename... Args>
     ExposeRender(Args&&... args) {}
@@ -61,6 +95,11 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
         EXPOSE_TEMPLATE(latency, OverlayBD_MaxLatency
                         : gauge{node, type, mode} #us);
         EXPOSE_TEMPLATE(count, OverlayBD_Count : gauge{node, type} #Bytes);
+        EXPOSE_TEMPLATE(cache, OverlayBD_Cache : gauge{node, type});
+        EXPOSE_TEMPLATE(index, OverlayBD_Index : gauge{node, type});
+        EXPOSE_TEMPLATE(zfile_cache, OverlayBD_ZFile_Cache : gauge{node, type});
+        EXPOSE_TEMPLATE(gzip_span_cache, OverlayBD_Gzip_Span_Cache : gauge{node, type});
+        EXPOSE_TEMPLATE(refill, OverlayBD_Cache_Refill : gauge{node, type});
         std::string ret(alive.help_str());
         ret.append("\n")
             .append(alive.type_str())
@@ -71,9 +110,84 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
         LOOP_APPEND_METRIC(ret, qps);
         LOOP_APPEND_METRIC(ret, latency);
         LOOP_APPEND_METRIC(ret, count);
+        LOOP_APPEND_METRIC(ret, cache);
+        LOOP_APPEND_METRIC(ret, index);
+        LOOP_APPEND_METRIC(ret, zfile_cache);
+        LOOP_APPEND_METRIC(ret, gzip_span_cache);
+        LOOP_APPEND_METRIC(ret, refill);
+        if (!va_histogram.empty()) {
+            ret.append("# HELP OverlayBD_Latency_us latency distribution, by type\n"
+                       "# TYPE OverlayBD_Latency_us histogram\n");
+            for (auto x : va_histogram) {
+                ret.append(x.second->render("OverlayBD_Latency_us",
+                                            estring().appends("type=\"", x.first, "\"")));
+            }
+            ret.append("\n");
+        }
+        render_layers(ret);
+        render_cpu(ret);
+        if (extra)
+            ret.append(extra());
         return ret;
     }
 
+    void render_layers(std::string& ret) {
+        EXPOSE_TEMPLATE(layer_reads, OverlayBD_Layer_Reads : counter{image, layer, source});
+        EXPOSE_TEMPLATE(layer_bytes, OverlayBD_Layer_Read_Bytes
+                        : counter{image, layer, source} #Bytes);
+        EXPOSE_TEMPLATE(layer_errors, OverlayBD_Layer_Read_Errors
+                        : counter{image, layer, source});
+        EXPOSE_TEMPLATE(layer_latency, OverlayBD_Layer_MaxLatency
+                        : gauge{image, layer, source} #us);
+        std::vector<std::shared_ptr<LayerStats>> live;
+        {
+            std::lock_guard<std::mutex> lock(layers_mtx);
+            for (auto it = layers.begin(); it != layers.end();) {
+                if (auto s = it->second.lock()) {
+                    live.push_back(std::move(s));
+                    ++it;
+                } else {
+                    it = layers.erase(it);
+                }
+            }
+        }
+        if (live.empty())
+            return;
+#define APPEND_LAYER_METRIC(name, expr)                                                       \
+        ret.append(name.help_str()).append("\n").append(name.type_str()).append("\n");      \
+        for (auto& s : live)                                                                  \
+            ret.append(name.render(expr, s->image, s->layer, s->source)).append("\n");       \
+        ret.append("\n");
+        APPEND_LAYER_METRIC(layer_reads, s->reads.load());
+        APPEND_LAYER_METRIC(layer_bytes, s->bytes.load());
+        APPEND_LAYER_METRIC(layer_errors, s->errors.load());
+        APPEND_LAYER_METRIC(layer_latency, s->latency.val());
+#undef APPEND_LAYER_METRIC
+    }
+
+    // the cycles of each subsystem by the threads that ran it, see CpuAccount
+    void render_cpu(std::string& ret) {
+        if (!CpuAccount::enabled())
+            return;
+        EXPOSE_TEMPLATE(cpu_cycles, OverlayBD_CPU_Cycles : counter{thread, subsystem});
+        EXPOSE_TEMPLATE(cpu_calls, OverlayBD_CPU_Calls : counter{thread, subsystem});
+        auto& st = CpuAccount::state();
+#define APPEND_CPU_METRIC(name, field)                                                        \
+        ret.append(name.help_str()).append("\n").append(name.type_str()).append("\n");      \
+        for (uint32_t t = 0; t < CpuAccount::MAX_THREADS; t++) {                              \
+            auto& slot = st.slots[t];                                                         \
+            if (!slot.used.load())                                                            \
+                continue;                                                                     \
+            for (int i = 0; i < CpuAccount::SUBSYSTEMS; i++)                                  \
+                ret.append(name.render(slot.field[i].load(), std::to_string(t),               \
+                                       CpuAccount::SUBSYSTEM_NAMES[i])).append("\n");        \
+        }                                                                                     \
+        ret.append("\n");
+        APPEND_CPU_METRIC(cpu_cycles, cycles);
+        APPEND_CPU_METRIC(cpu_calls, calls);
+#undef APPEND_CPU_METRIC
+    }
+
     int handle_request(photon::net::http::Request& req,
                        photon::net::http::Response& resp,
                        std::string_view) override {
@@ -92,6 +206,22 @@ struct ExposeRender : public photon::net::http::HTTPHandler {
     }
 };
 
+// serves the sampled request traces, see IOTrace::dump()
+struct TraceRender : public photon::net::http::HTTPHandler {
+    int handle_request(photon::net::http::Request& req,
+                       photon::net::http::Response& resp,
+                       std::string_view) override {
+        auto body = IOTrace::dump();
+        resp.set_result(200);
+        resp.keep_alive(true);
+        resp.headers.insert("Content-Type", "application/x-ndjson");
+        resp.headers.content_length(body.length());
+        if (resp.write((void*)body.data(), body.length()) != (ssize_t)body.length())
+            LOG_ERRNO_RETURN(0, -1, "Failed to write trace response");
+        return 0;
+    }
+};
+
 #undef LOOP_APPEND_METRIC
 #undef EXPOSE_PHOTON_METRICLIST
 };  // namespace ExposeMetrics
\ No newline at end of file
@@ -25,10 +25,24 @@
 #include "config.h"
 #include "exporter_handler.h"
 #include "metrics_fs.h"
+#include "overlaybd/cache/pool_store.h"
+#include "overlaybd/gzindex/gzfile.h"
+#include "overlaybd/lsmt/file.h"
+#include "overlaybd/zfile/zfile.h"
 
 class OverlayBDMetric {
 public:
     MetricMeta pread, download;
+    // TCMU commands, from being taken off the ring to completion
+    LatencyHistogram tcmu_read, tcmu_write;
+    Metric::ValueCounter index_layers, index_bytes, index_saved_bytes;
+    Metric::ValueCounter zfile_cache_hits, zfile_cache_misses, zfile_cache_bytes;
+    Metric::ValueCounter gzip_span_hits, gzip_span_misses, gzip_dict_hits, gzip_dict_misses,
+        gzip_span_bytes;
+    Metric::ValueCounter refill_sequential, refill_random, refill_readahead, refill_bytes,
+        refill_window;
+    Metric::ValueCounter cache_hit_bytes, cache_miss_bytes, cache_refills, cache_refill_us,
+        cache_refilling, cache_evicted_bytes;
 
     ExposeMetrics::ExposeRender exporter;
 
@@ -41,21 +55,91 @@ public:
         exporter.add_latency("download", download.latency);
         exporter.add_qps("download", download.qps);
         exporter.add_count("download", download.total);
+        pread.trace_stage = IOTrace::CACHE;
+        download.trace_stage = IOTrace::REMOTE;
+        // pread covers cache hits and misses, download the remote reads of the misses
+        exporter.add_histogram("pread", pread.histogram);
+        exporter.add_histogram("download", download.histogram);
+        exporter.add_histogram("tcmu_read", tcmu_read);
+        exporter.add_histogram("tcmu_write", tcmu_write);
+        exporter.add_index("layers", index_layers);
+        exporter.add_index("bytes", index_bytes);
+        exporter.add_index("saved_bytes", index_saved_bytes);
+        exporter.add_zfile_cache("hits", zfile_cache_hits);
+        exporter.add_zfile_cache("misses", zfile_cache_misses);
+        exporter.add_zfile_cache("bytes", zfile_cache_bytes);
+        exporter.add_gzip_span_cache("hits", gzip_span_hits);
+        exporter.add_gzip_span_cache("misses", gzip_span_misses);
+        exporter.add_gzip_span_cache("dict_hits", gzip_dict_hits);
+        exporter.add_gzip_span_cache("dict_misses", gzip_dict_misses);
+        exporter.add_gzip_span_cache("bytes", gzip_span_bytes);
+        exporter.add_refill("sequential", refill_sequential);
+        exporter.add_refill("random", refill_random);
+        exporter.add_refill("readahead", refill_readahead);
+        exporter.add_refill("bytes", refill_bytes);
+        exporter.add_refill("window", refill_window);
+        exporter.add_cache("hit_bytes", cache_hit_bytes);
+        exporter.add_cache("miss_bytes", cache_miss_bytes);
+        exporter.add_cache("refills", cache_refills);
+        exporter.add_cache("refill_us", cache_refill_us);
+        exporter.add_cache("refilling", cache_refilling);
+        exporter.add_cache("evicted_bytes", cache_evicted_bytes);
+    }
+
+    void update_stats() {
+        auto st = LSMT::get_index_sharing_stats();
+        index_layers.set(st.layer_indexes + st.merged_indexes);
+        index_bytes.set(st.bytes);
+        index_saved_bytes.set(st.saved_bytes);
+        auto zst = ZFile::zfile_block_cache_stats();
+        zfile_cache_hits.set(zst.hits);
+        zfile_cache_misses.set(zst.misses);
+        zfile_cache_bytes.set(zst.bytes);
+        auto gst = gzfile_span_cache_stats();
+        gzip_span_hits.set(gst.hits);
+        gzip_span_misses.set(gst.misses);
+        gzip_dict_hits.set(gst.dict_hits);
+        gzip_dict_misses.set(gst.dict_misses);
+        gzip_span_bytes.set(gst.bytes);
+        auto rst = FileSystem::cache_refill_stats();
+        refill_sequential.set(rst.sequential);
+        refill_random.set(rst.random);
+        refill_readahead.set(rst.readahead);
+        refill_bytes.set(rst.bytes);
+        refill_window.set(rst.window);
+        auto cst = FileSystem::cache_io_stats();
+        cache_hit_bytes.set(cst.hit_bytes);
+        cache_miss_bytes.set(cst.miss_bytes);
+        cache_refills.set(cst.refills);
+        cache_refill_us.set(cst.refill_us);
+        cache_refilling.set(cst.refilling);
+        cache_evicted_bytes.set(cst.evicted_bytes);
     }
 };
 
 struct ExporterServer {
     photon::net::http::HTTPServer *httpserver = nullptr;
     photon::net::ISocketServer *tcpserver = nullptr;
+    photon::Timer *timer = nullptr;
+    OverlayBDMetric *metrics = nullptr;
+    ExposeMetrics::TraceRender trace_render;
 
     bool ready = false;
 
     ExporterServer(ImageConfigNS::GlobalConfig &config,
-                   OverlayBDMetric *metrics) {
+                   OverlayBDMetric *metrics) : metrics(metrics) {
+        // all the interfaces, unless told otherwise
+        photon::net::IPAddr ip;
+        auto addr = config.exporterConfig().address();
+        if (!addr.empty()) {
+            ip = photon::net::IPAddr(addr.c_str());
+            if (ip.undefined())
+                LOG_ERROR_RETURN(EINVAL, , "invalid exporter address `", addr);
+        }
         tcpserver = photon::net::new_tcp_socket_server();
         tcpserver->setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
-        if (tcpserver->bind(config.exporterConfig().port()) < 0)
-            LOG_ERRNO_RETURN(0, , "Failed to bind exporter port `",
+        if (tcpserver->bind(config.exporterConfig().port(), ip) < 0)
+            LOG_ERRNO_RETURN(0, , "Failed to bind exporter address `:`", addr,
                              config.exporterConfig().port());
         if (tcpserver->listen() < 0)
             LOG_ERRNO_RETURN(0, , "Failed to listen exporter port `",
@@ -63,12 +147,24 @@ struct ExporterServer {
         httpserver = photon::net::http::new_http_server();
         httpserver->add_handler(&metrics->exporter, false,
                                 config.exporterConfig().uriPrefix());
+        if (config.exporterConfig().traceSampleRate())
+            httpserver->add_handler(&trace_render, false,
+                                    config.exporterConfig().traceUriPrefix());
         tcpserver->set_handler(httpserver->get_connection_handler());
         tcpserver->start_loop();
+        metrics->update_stats();
+        timer = new photon::Timer(config.exporterConfig().updateInterval(),
+                                  {this, &ExporterServer::on_timer}, true);
         ready = true;
     }
 
+    static uint64_t on_timer(void *data) {
+        static_cast<ExporterServer *>(data)->metrics->update_stats();
+        return 0;
+    }
+
     ~ExporterServer() {
+        delete timer;
         delete tcpserver;
         delete httpserver;
     }
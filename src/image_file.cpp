@@ -16,6 +16,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <memory>
 #include <string>
 #include <sys/types.h>
 #include <unistd.h>
@@ -26,19 +27,28 @@
 #include <photon/common/alog-stdstring.h>
 #include <photon/fs/filesystem.h>
 #include <photon/fs/aligned-file.h>
+#include <photon/fs/forwardfs.h>
 #include <photon/fs/localfs.h>
+#include <photon/fs/virtual-file.h>
+#include <photon/thread/thread.h>
 #include "overlaybd/lsmt/file.h"
 #include "overlaybd/zfile/zfile.h"
 #include "config.h"
 #include "image_file.h"
+#include "layer_squash.h"
 #include "switch_file.h"
+#include "overlaybd/cache/cache.h"
 #include "overlaybd/gzip/gz.h"
 #include "overlaybd/gzindex/gzfile.h"
 #include "overlaybd/tar/tar_file.h"
+#include "overlaybd/registryfs/registryfs.h"
 
 #define PARALLEL_LOAD_INDEX 32
 using namespace photon::fs;
 
+// index appends buffered per upper layer with upper.writeCache
+#define WRITE_CACHE_INDEX_BUFFER (16 * 1024)
+
 #define SET_LOCAL_DIR 118
 #define SET_SIZE 119
 
@@ -92,6 +102,52 @@ IFile *ImageFile::__open_ro_file(const std::string &path) {
     return file;
 }
 
+// A remote layer pinning the data it reads in the file cache until it's
+// closed, see IOCTL_PIN_RANGE: while it's being opened, that is its headers,
+// the jump table of zfile and the index of LSMT, or all along for an image of
+// cachePriority `high`.
+class PinningFile : public ForwardFile_Ownership {
+public:
+    bool pinning = true;
+
+    PinningFile(IFile *file) : ForwardFile_Ownership(file, true) {
+    }
+
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        pin(offset, count);
+        return m_file->pread(buf, count, offset);
+    }
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        pin(offset, iov_length(iov, iovcnt));
+        return m_file->preadv(iov, iovcnt, offset);
+    }
+    ssize_t preadv2(const struct iovec *iov, int iovcnt, off_t offset, int flags) override {
+        pin(offset, iov_length(iov, iovcnt));
+        return m_file->preadv2(iov, iovcnt, offset, flags);
+    }
+
+private:
+    void pin(off_t offset, size_t count) {
+        if (pinning && count)
+            m_file->ioctl(IOCTL_PIN_RANGE, offset, count);
+    }
+    static size_t iov_length(const struct iovec *iov, int iovcnt) {
+        size_t n = 0;
+        for (int i = 0; i < iovcnt; i++)
+            n += iov[i].iov_len;
+        return n;
+    }
+};
+
+void ImageFile::stop_pinning(int index) {
+    for (size_t i = 0; i < m_pinning.size(); i++) {
+        if ((index < 0 || (size_t)index == i) && m_pinning[i]) {
+            m_pinning[i]->pinning = false;
+            m_pinning[i] = nullptr;
+        }
+    }
+}
+
 IFile *ImageFile::__open_ro_target_file(const std::string &path) {
     auto file = open_localfile_adaptor(path.c_str(), O_RDONLY, 0644, 0);
     if (!file) {
@@ -124,6 +180,10 @@ IFile *ImageFile::__open_ro_target_remote(const std::string &dir, const std::str
             set_failed("failed to open remote file " + url);
         LOG_ERROR_RETURN(0, nullptr, "failed to open remote file `", url);
     }
+    // warm up while the layer index is loading, ahead of the first reads
+    auto warm_conns = image_service.global_conf.registryConfig().warmConnections();
+    if (warm_conns)
+        ((RegistryFS *)image_service.global_fs.underlay_registryfs)->warmup(url.c_str(), warm_conns);
 
     return remote_file;
 }
@@ -157,6 +217,7 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
                                     digest);
 
     LOG_INFO("open file from remotefs: `, size: `", url, size);
+    auto open_start = photon::now;
     IFile *remote_file = image_service.global_fs.remote_fs->open(url.c_str(), O_RDONLY);
     if (!remote_file) {
         std::string err_msg;
@@ -164,9 +225,50 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
         set_failed("failed to open remote file ", url, ": ", err_msg);
         LOG_ERRNO_RETURN(0, nullptr, "failed to open remote file `: `", url, err_msg);
     }
+    auto prefix = estring().appends("layer", layer_index, ".");
+    timeline.add(prefix + "registry_open", open_start);
     remote_file->ioctl(SET_SIZE, size);
     remote_file->ioctl(SET_LOCAL_DIR, dir);
+    if (image_service.metrics) {
+        std::string image, layer;
+        layer_labels(url, image, layer);
+        bool p2p = image_service.global_fs.remote_fs == image_service.global_fs.srcfs;
+        remote_file = new LayerMetricFile(
+            remote_file, image_service.metrics->exporter.layer_stats(image, layer, p2p ? "p2p" : "cache"));
+    }
+    // only the file cache pins, and p2p reads skip it
+    auto &fs = image_service.global_fs;
+    if (fs.cache_pool && fs.remote_fs == fs.cached_fs) {
+        bool high = conf.cachePriority() == "high";
+        bool slot = layer_index >= 0 && (size_t)layer_index < m_pinning.size();
+        if (high || (slot && image_service.global_conf.cacheConfig().pinMetadata())) {
+            auto pinning = new PinningFile(remote_file);
+            remote_file = pinning;
+            if (!high)
+                m_pinning[layer_index] = pinning;
+        }
+    }
+    auto warm_conns = image_service.global_conf.registryConfig().warmConnections();
+    if (warm_conns)
+        ((RegistryFS *)image_service.global_fs.underlay_registryfs)->warmup(url.c_str(), warm_conns);
 
+    bool download = conf.HasMember("download") && conf.download().enable() == 1;
+    BKDL::AccessStats *stats = nullptr;
+    if (download && conf.download().schedule() == "hot") {
+        // the blocks read by the container and by prefetch are downloaded first
+        stats = new BKDL::AccessStats(size, conf.download().blockSize());
+        remote_file = BKDL::new_access_tracked_file(remote_file, stats);
+    }
+    LocalRanges *ranges = nullptr;
+    if (download) {
+        // the downloaded blocks are read locally before the whole layer is verified
+        ranges = new LocalRanges;
+        auto dl_path = dir + "/" + BKDL::DOWNLOAD_TMP_NAME;
+        remote_file = new_range_switch_file(remote_file, dl_path.c_str(), ranges);
+    }
+
+    // the tar and zfile headers, and the jump table of zfile
+    auto header_start = photon::now;
     IFile *tar_file = new_tar_file_adaptor(remote_file);
     if (!tar_file) {
         std::string err_msg;
@@ -182,8 +284,9 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
         delete tar_file;
         LOG_ERRNO_RETURN(0, nullptr, "failed to open switch file `", url);
     }
+    timeline.add(prefix + "jump_table", header_start);
 
-    if (conf.HasMember("download") && conf.download().enable() == 1) {
+    if (download) {
         // download from registry, verify sha256 after downloaded.
         IFile *srcfile = image_service.global_fs.srcfs->open(url.c_str(), O_RDONLY);
         if (srcfile == nullptr) {
@@ -192,6 +295,15 @@ IFile *ImageFile::__open_ro_remote(const std::string &dir, const std::string &di
             BKDL::BkDownload *obj =
                 new BKDL::BkDownload(switch_file, srcfile, size, dir, digest, url, m_status,
                     conf.download().maxMBps(), conf.download().tryCnt(), conf.download().blockSize());
+            obj->qos_bucket = &m_qos_bucket;
+            obj->concurrency = conf.download().concurrency();
+            obj->stats = stats;
+            obj->ranges = ranges;
+            if (image_service.global_conf.cacheConfig().cacheType() == "file" &&
+                image_service.global_fs.cached_fs) {
+                // blocks the image has read are copied from the registry cache
+                obj->cache_file = image_service.global_fs.cached_fs->open(url.c_str(), O_RDONLY);
+            }
             LOG_DEBUG("add to download list for `", dir);
             dl_list.push_back(obj);
         }
@@ -209,10 +321,16 @@ void ImageFile::start_bk_dl_thread() {
     uint64_t extra_range = conf.download().delayExtra();
     extra_range = (extra_range <= 0) ? 30 : extra_range;
     uint64_t delay_sec = (rand() % extra_range) + conf.download().delay();
-    LOG_INFO("background download is enabled, delay `, maxMBps `, tryCnt `, blockSize `",
-             delay_sec, conf.download().maxMBps(), conf.download().tryCnt(), conf.download().blockSize());
+    auto schedule = conf.download().schedule();
+    if (schedule != "hot" && schedule != "sequential") {
+        LOG_WARN("unknown download schedule `, use sequential", schedule);
+    }
+    LOG_INFO("background download is enabled, delay `, maxMBps `, tryCnt `, blockSize `, concurrency `, schedule `",
+             delay_sec, conf.download().maxMBps(), conf.download().tryCnt(), conf.download().blockSize(),
+             conf.download().concurrency(), schedule);
     dl_thread_jh = photon::thread_enable_join(
-        photon::thread_create11(&BKDL::bk_download_proc, dl_list, delay_sec, m_status));
+        photon::thread_create11(&BKDL::bk_download_proc, dl_list, delay_sec, m_status,
+                                schedule == "hot"));
 }
 
 struct ParallelOpenTask {
@@ -220,6 +338,8 @@ struct ParallelOpenTask {
     int eno = 0;
     int i = 0, nlayers;
     std::vector<ImageConfigNS::LayerConfig> &layers;
+    // how long each layer took to open, 0 if not tried
+    std::vector<uint64_t> open_us;
 
     int get_next_job_index() {
         LOG_DEBUG("create job, layer_id: `", i);
@@ -236,7 +356,7 @@ struct ParallelOpenTask {
 
     ParallelOpenTask(std::vector<IFile *> &files, size_t nlayers,
                      std::vector<ImageConfigNS::LayerConfig> &layers)
-        : files(files), nlayers(nlayers), layers(layers) {
+        : files(files), nlayers(nlayers), layers(layers), open_us(nlayers, 0) {
     }
 };
 
@@ -247,7 +367,13 @@ void *do_parallel_open_files(ImageFile *imgfile, ParallelOpenTask &tm) {
             // error occured from another threads.
             return nullptr;
         }
+        auto start = photon::now;
+        auto name = estring().appends("layer", idx);
+        // credential resolution of the layer is recorded by ImageService
+        OpenTimeline::Scope _timeline(&imgfile->timeline, name + ".");
         int ret = imgfile->open_lower_layer(tm.files[idx], tm.layers[idx], idx);
+        tm.open_us[idx] = std::max(photon::now - start, 1UL);
+        imgfile->timeline.add(name, start);
         if (ret < 0) {
             tm.set_error(errno);
             LOG_ERROR_RETURN(0, nullptr, "failed to open files");
@@ -257,7 +383,7 @@ void *do_parallel_open_files(ImageFile *imgfile, ParallelOpenTask &tm) {
 }
 
 int ImageFile::open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer,
-                                int index) {
+                                int index, bool warmup) {
     std::string opened;
     if (layer.file() != "") {
         opened = layer.file();
@@ -276,6 +402,16 @@ int ImageFile::open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer,
             } else {
                 opened = layer.digest();
                 file = __open_ro_remote(layer.dir(), layer.digest(), layer.size(), index);
+                // fetch the LSMT metadata in this thread, concurrently with the other
+                // layers, so that loading the indexes of all layers later hits the cache
+                auto &fs = image_service.global_fs;
+                auto warmup_start = photon::now;
+                if (warmup && file && fs.cached_fs && fs.remote_fs == fs.cached_fs) {
+                    if (LSMT::warmup_index(file) != 0)
+                        LOG_WARN("failed to warm up index of layer `, ignore", index);
+                    timeline.add(estring().appends("layer", index, ".index_warmup"),
+                                 warmup_start);
+                }
             }
         }
     }
@@ -312,6 +448,9 @@ int ImageFile::open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer,
     if (target_file != nullptr) {
         file = LSMT::open_warpfile_ro(file, target_file, true);
     }
+    if (file != nullptr && IOTrace::enabled()) {
+        file = new IOTrace::TracedFile(file, IOTrace::LAYER);
+    }
     if (file != nullptr) {
         LOG_DEBUG("layer index: `, open(`) success", index, opened);
         return 0;
@@ -319,6 +458,79 @@ int ImageFile::open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer,
     return -1;
 }
 
+// a lower layer opened by its first read, in the chain of layers opened with
+// their merged index built before, see mergedIndex and lazyOpenConfig
+class LazyLayerFile : public VirtualReadOnlyFile {
+public:
+    LazyLayerFile(ImageFile *imgfile, ImageConfigNS::LayerConfig &layer, int index,
+                  const std::string &index_path)
+        : m_imgfile(imgfile), m_index(index), m_index_path(index_path) {
+        m_layer.CopyFrom(layer, m_layer.GetAllocator());
+        m_uuid.clear();
+    }
+
+    // the UUID the merged index recorded for the layer
+    UUID m_uuid;
+    ~LazyLayerFile() {
+        delete m_file;
+    }
+
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        auto file = get();
+        return file ? file->pread(buf, count, offset) : -1;
+    }
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        auto file = get();
+        return file ? file->preadv(iov, iovcnt, offset) : -1;
+    }
+    virtual int fstat(struct stat *buf) override {
+        auto file = get();
+        return file ? file->fstat(buf) : -1;
+    }
+    virtual IFileSystem *filesystem() override {
+        return nullptr;
+    }
+    virtual int close() override {
+        return 0;
+    }
+
+    UNIMPLEMENTED(ssize_t read(void *buf, size_t count));
+    UNIMPLEMENTED(ssize_t readv(const struct iovec *iov, int iovcnt));
+    UNIMPLEMENTED(off_t lseek(off_t offset, int whence));
+
+private:
+    ImageFile *m_imgfile;
+    ImageConfigNS::LayerConfig m_layer;
+    int m_index;
+    std::string m_index_path;
+    photon::mutex m_mtx;
+    IFile *m_file = nullptr;
+
+    IFile *get() {
+        if (m_file)
+            return m_file;
+        SCOPED_LOCK(m_mtx);
+        if (m_file == nullptr) {
+            IFile *file = nullptr;
+            if (m_imgfile->open_lower_layer(file, m_layer, m_index, false) < 0 || !file)
+                LOG_ERRNO_RETURN(0, nullptr, "failed to open layer ` lazily", m_index);
+            // the mappings of the index are only valid for the very layers it
+            // was merged from; a stale one is dropped for the later opens
+            UUID uuid;
+            if (LSMT::get_layer_uuid(file, uuid) != 0 || uuid != m_uuid) {
+                delete file;
+                ::unlink(m_index_path.c_str());
+                LOG_ERROR_RETURN(EIO, nullptr, "layer ` (`) doesn't match merged index `, dropped",
+                                 m_index, m_layer.digest(), m_index_path);
+            }
+            m_file = file;
+            m_imgfile->stop_pinning(m_index);
+            LOG_INFO("layer ` opened lazily (`)", m_index, m_layer.digest());
+        }
+        return m_file;
+    }
+};
+
 LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &lowers,
                                       bool &has_error) {
     LSMT::IFileRO *ret = NULL;
@@ -327,22 +539,84 @@ LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &l
     if (lowers.size() == 0)
         return NULL;
 
-    photon::join_handle *ths[PARALLEL_LOAD_INDEX];
+    // a record or replay of a trace, whose wrappers are put on each layer,
+    // needs the layers themselves rather than their flattened layer
+    std::string squash_key;
+    if (image_service.squash && m_prefetcher == nullptr) {
+        squash_key = image_service.squash->key(lowers);
+        std::string path;
+        if (!squash_key.empty())
+            path = image_service.squash->lookup(squash_key);
+        if (!path.empty()) {
+            ret = open_squashed(path, lowers.size());
+            if (ret)
+                return ret;
+            LOG_WARN("failed to open flattened layer `, open ` layers instead", path,
+                     lowers.size());
+        }
+    }
+
+    // with a replay or background download, which read each layer anyway,
+    // the layers are opened as usual, and so are chains with local or
+    // turboOCI layers, which have no key
+    bool lazy = m_prefetcher == nullptr && !conf.download().enable() &&
+                !LayerSquash::chain_key(lowers).empty();
+    if (lazy && !conf.mergedIndex().empty()) {
+        ret = open_lazily(lowers, conf.mergedIndex());
+        if (ret)
+            return ret;
+        LOG_WARN("failed to open ` layers with merged index `, open them as usual",
+                 lowers.size(), conf.mergedIndex());
+    }
+    std::string lazy_path;
+    auto &lazy_conf = image_service.global_conf.lazyOpenConfig();
+    if (lazy && lazy_conf.enable() && conf.mergedIndex().empty()) {
+        auto key = LayerSquash::chain_key(lowers);
+        if (!key.empty())
+            lazy_path = lazy_conf.dir() + "/" + key + ".index";
+        if (!lazy_path.empty() && ::access(lazy_path.c_str(), F_OK) == 0) {
+            ret = open_lazily(lowers, lazy_path);
+            if (ret)
+                return ret;
+            LOG_WARN("failed to open ` layers with merged index `, open them as usual",
+                     lowers.size(), lazy_path);
+        }
+    }
+
     std::vector<IFile *> files;
+    m_pinning.assign(lowers.size(), nullptr);
     files.resize(lowers.size(), nullptr);
-    auto n = std::min(PARALLEL_LOAD_INDEX, (int)lowers.size());
+    int concurrency = image_service.global_conf.layerOpenConcurrency();
+    if (concurrency <= 0)
+        concurrency = PARALLEL_LOAD_INDEX;
+    auto n = std::min(concurrency, (int)lowers.size());
     LOG_DEBUG("create ` photon threads to open lowers", n);
 
+    auto start = photon::now;
     ParallelOpenTask tm(files, lowers.size(), lowers);
+    std::vector<photon::join_handle *> ths;
     for (auto i = 0; i < n; ++i) {
-        ths[i] =
-            photon::thread_enable_join(photon::thread_create11(&do_parallel_open_files, this, tm));
+        ths.push_back(
+            photon::thread_enable_join(photon::thread_create11(&do_parallel_open_files, this, tm)));
     }
 
-    for (int i = 0; i < n; i++) {
-        photon::thread_join(ths[i]);
+    for (auto th : ths) {
+        photon::thread_join(th);
     }
 
+    // the open latency of each layer, to find the outliers
+    size_t slowest = 0;
+    for (size_t i = 0; i < lowers.size(); i++) {
+        if (tm.open_us[i] == 0)
+            continue;
+        LOG_INFO("layer ` ` in ` ms (`)", i, files[i] ? "opened" : "failed", tm.open_us[i] / 1000,
+                 lowers[i].digest());
+        if (tm.open_us[i] > tm.open_us[slowest])
+            slowest = i;
+    }
+    LOG_INFO("` layers opened in ` ms by ` threads, the slowest is layer ` in ` ms",
+             lowers.size(), (photon::now - start) / 1000, n, slowest, tm.open_us[slowest] / 1000);
+
     for (size_t i = 0; i < files.size(); i++) {
         if (files[i] == NULL) {
             LOG_ERROR("layer index ` open failed, exit.", i);
@@ -352,15 +626,24 @@ LSMT::IFileRO *ImageFile::open_lowers(std::vector<ImageConfigNS::LayerConfig> &l
             goto ERROR_EXIT;
         }
     }
+    start = photon::now;
     ret = LSMT::open_files_ro((IFile **)&(files[0]), lowers.size(), true);
+    timeline.add("index_load", start);
     if (!ret) {
         LOG_ERROR("LSMT::open_files_ro(files, `, `) return NULL", lowers.size(), true);
         goto ERROR_EXIT;
     }
     LOG_INFO("LSMT::open_files_ro(files, `) success", lowers.size());
+    stop_pinning();
+    if (!lazy_path.empty())
+        save_merged_index(ret, lazy_path);
 
     if (m_prefetcher != nullptr) {
         m_prefetcher->replay();
+    } else if (!squash_key.empty()) {
+        // the chain is counted once the image opens
+        m_squash_key = squash_key;
+        m_squash_lowers = ret;
     }
 
     return ret;
@@ -369,6 +652,7 @@ ERROR_EXIT:
     if (m_exception == "") {
         m_exception = "failed to create overlaybd device";
     }
+    m_pinning.clear();
     for (size_t i = 0; i < lowers.size(); i++) {
         if (files[i] != NULL)
             delete files[i];
@@ -377,11 +661,146 @@ ERROR_EXIT:
     return NULL;
 }
 
+LSMT::IFileRO *ImageFile::open_squashed(const std::string &path, size_t nlayers) {
+    auto start = photon::now;
+    auto file = open_localfile_adaptor(path.c_str(), O_RDONLY, 0644, 0);
+    if (file == nullptr)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to open flattened layer `", path);
+    auto ret = LSMT::open_file_ro(file, true);
+    if (ret == nullptr) {
+        delete file;
+        LOG_ERRNO_RETURN(0, nullptr, "failed to load flattened layer `", path);
+    }
+    timeline.add("squashed_open", start);
+    LOG_INFO("` layers opened as flattened layer ` in ` ms", nlayers, path,
+             (photon::now - start) / 1000);
+    return ret;
+}
+
+LSMT::IFileRO *ImageFile::open_lazily(std::vector<ImageConfigNS::LayerConfig> &lowers,
+                                      const std::string &path) {
+    auto start = photon::now;
+    std::unique_ptr<IFile> index(open_localfile_adaptor(path.c_str(), O_RDONLY, 0644, 0));
+    if (!index)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to open merged index `", path);
+    std::vector<IFile *> files;
+    m_pinning.assign(lowers.size(), nullptr);
+    for (size_t i = 0; i < lowers.size(); i++)
+        files.push_back(new LazyLayerFile(this, lowers[i], i, path));
+    auto ret = LSMT::open_files_ro_with_index(files.data(), files.size(), index.get(), true);
+    if (ret == nullptr) {
+        for (auto f : files)
+            delete f;
+        m_pinning.clear();
+        return nullptr;
+    }
+    // top first
+    for (size_t i = 0; i < files.size(); i++)
+        ret->get_uuid(((LazyLayerFile *)files[i])->m_uuid, files.size() - 1 - i);
+    timeline.add("lazy_open", start);
+    LOG_INFO("` layers opened lazily with merged index ` in ` ms", lowers.size(), path,
+             (photon::now - start) / 1000);
+    return ret;
+}
+
+// saves the merged index of the lowers for the later opens of the chain, written
+// to a temporary file of this image first so that they never see a partial one
+void ImageFile::save_merged_index(LSMT::IFileRO *lowers, const std::string &path) {
+    auto tmp = path + ".tmp." + std::to_string((uintptr_t)this);
+    std::unique_ptr<IFile> out(
+        open_localfile_adaptor(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644, 0));
+    if (!out) {
+        LOG_ERRNO_RETURN(0, , "failed to create merged index `", tmp);
+    }
+    if (LSMT::save_merged_index(lowers, out.get()) != 0 || out->fsync() != 0 ||
+        ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        LOG_ERRNO_RETURN(0, , "failed to save merged index `", path);
+    }
+    LOG_INFO("merged index of ` layers saved to `", lowers->get_lower_files().size(), path);
+}
+
+// merges the lowers once the image has settled, as a background download
+void ImageFile::squash_lowers() {
+    auto delay = image_service.global_conf.squashConfig().delaySec();
+    for (uint32_t i = 0; i < delay && m_status != -1; i++)
+        photon::thread_usleep(1000 * 1000);
+    if (m_status == -1) {
+        image_service.squash->cancel(m_squash_key);
+        return;
+    }
+    QosScope qos(IoClass::Download, &m_qos_bucket);
+    image_service.squash->squash(m_squash_key, m_squash_lowers->get_lower_files(), m_status);
+}
+
+struct GCFiles {
+    std::string data, index;
+    int rename(IFile *, IFile *) {
+        // the data goes first, so that a `.gc` index without a `.gc` data file
+        // tells an interrupted swap, which is completed by open_upper()
+        for (auto path : {&data, &index}) {
+            if (::rename((*path + ".gc").c_str(), path->c_str()) != 0)
+                LOG_ERRNO_RETURN(0, -1, "failed to rename `.gc", *path);
+        }
+        return 0;
+    }
+};
+
+int gc_upper_layer(LSMT::IFileRW *file, const std::string &data, const std::string &index,
+                   uint32_t garbage_percent) {
+    GCFiles files{data, index};
+    LSMT::IFileRW::GCArgs args;
+    args.fdata = open_localfile_adaptor((data + ".gc").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (args.fdata)
+        args.findex =
+            open_localfile_adaptor((index + ".gc").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    args.garbage_ratio = garbage_percent / 100.0;
+    args.on_swap = {&files, &GCFiles::rename};
+    int ret = -1;
+    if (args.fdata && args.findex)
+        ret = file->gc(args);
+    else
+        LOG_ERRNO("failed to create gc files of `", data);
+    if (ret != 0) {
+        auto eno = errno;
+        delete args.fdata;
+        delete args.findex;
+        ::unlink((data + ".gc").c_str());
+        ::unlink((index + ".gc").c_str());
+        errno = eno;
+    }
+    return ret;
+}
+
+void ImageFile::gc_upper() {
+    auto interval = conf.upper().gcIntervalSec();
+    auto percent = conf.upper().gcGarbagePercent();
+    while (m_status != -1) {
+        for (uint32_t i = 0; i < interval && m_status != -1; i++)
+            photon::thread_usleep(1000 * 1000);
+        if (m_status == -1)
+            break;
+        if (gc_upper_layer(m_upper, conf.upper().data(), conf.upper().index(), percent) < 0 &&
+            errno == ENOTSUP) {
+            LOG_WARN("gc is not supported by the upper layer `", conf.upper().data());
+            break;
+        }
+    }
+}
+
 LSMT::IFileRW *ImageFile::open_upper(ImageConfigNS::UpperConfig &upper) {
     IFile *data_file = NULL;
     IFile *idx_file = NULL;
     IFile *target_file = NULL;
     LSMT::IFileRW *ret = NULL;
+    auto gc_index = upper.index() + ".gc";
+    if (::access(gc_index.c_str(), F_OK) == 0 && ::access((upper.data() + ".gc").c_str(), F_OK) != 0) {
+        LOG_INFO("complete the interrupted gc of upper layer `", upper.data());
+        if (::rename(gc_index.c_str(), upper.index().c_str()) != 0) {
+            LOG_ERROR("rename(`), `:`", gc_index, errno, strerror(errno));
+            goto ERROR_EXIT;
+        }
+    }
     data_file = open_localfile_adaptor(upper.data().c_str(), O_RDWR, 0644);
     if (!data_file) {
         LOG_ERROR("open(`,flags), `:`", upper.data(), errno, strerror(errno));
@@ -440,8 +859,18 @@ int ImageFile::init_image_file() {
     ImageConfigNS::UpperConfig upper;
     bool record_no_download = false;
     bool has_error = false;
+    uint64_t upper_start = 0;
     auto lowers = conf.lowers();
-    auto concurrency = image_service.global_conf.prefetchConfig().concurrency();
+    auto &prefetch_conf = image_service.global_conf.prefetchConfig();
+    PrefetchOptions prefetch_opts;
+    prefetch_opts.concurrency = prefetch_conf.concurrency();
+    prefetch_opts.qos_bucket = &m_qos_bucket;
+    prefetch_opts.align = image_service.global_conf.cacheConfig().refillSize();
+    prefetch_opts.ahead_us = prefetch_conf.aheadMs() * 1000UL;
+    prefetch_opts.ahead_bytes = prefetch_conf.aheadMB() * 1024UL * 1024;
+    prefetch_opts.min_hit_percent = prefetch_conf.minHitPercent();
+    prefetch_opts.timeline = &timeline;
+    m_qos_bucket.set_rate(image_service.global_conf.qosConfig().imageMBps() * 1024UL * 1024);
 
     if (conf.accelerationLayer() && !conf.recordTracePath().empty()) {
         LOG_ERROR("Cannot record trace while acceleration layer exists");
@@ -455,7 +884,7 @@ int ImageFile::init_image_file() {
         std::string trace_file = accel_layer + "/trace";
         if (Prefetcher::detect_mode(trace_file) ==
             Prefetcher::Mode::Replay) {
-            m_prefetcher = new_prefetcher(trace_file, concurrency);
+            m_prefetcher = new_prefetcher(trace_file, prefetch_opts);
         }
 
     } else if (!conf.recordTracePath().empty()) {
@@ -464,9 +893,10 @@ int ImageFile::init_image_file() {
             LOG_ERROR("Prefetch: incorrect mode ` for prefetching", mode);
             goto ERROR_EXIT;
         }
-        m_prefetcher = new_prefetcher(conf.recordTracePath(), concurrency);
+        m_prefetcher = new_prefetcher(conf.recordTracePath(), prefetch_opts);
         if (mode == Prefetcher::Mode::Record) {
             record_no_download = true;
+            m_record_trace = true;
         }
     }
 
@@ -486,7 +916,9 @@ int ImageFile::init_image_file() {
         goto SUCCESS_EXIT;
     }
 
+    upper_start = photon::now;
     upper_file = open_upper(upper);
+    timeline.add("upper_open", upper_start);
     if (!upper_file) {
         LOG_ERROR("open upper layer failed.");
         goto ERROR_EXIT;
@@ -497,12 +929,39 @@ int ImageFile::init_image_file() {
         goto ERROR_EXIT;
     }
     m_file = stack_ret;
+    m_upper = stack_ret;
     read_only = false;
+    if (upper.writeCache()) {
+        // index appends are buffered and group committed, and only synced
+        // on fdatasync (SYNCHRONIZE_CACHE / FUA / flush)
+        if (stack_ret->set_index_group_commit(WRITE_CACHE_INDEX_BUFFER) != 0) {
+            LOG_ERROR("set index group commit failed, write cache disabled");
+        } else {
+            write_cache = true;
+            LOG_INFO("write cache enabled, index buffer: `", WRITE_CACHE_INDEX_BUFFER);
+        }
+    }
 
 SUCCESS_EXIT:
+    check_memory_budget();
+    if (!conf.ioRecordPath().empty()) {
+        // recording is a diagnosis, the image runs without it
+        m_recorder = IORecorder::create(conf.ioRecordPath());
+    }
+    if (m_file && image_service.global_conf.lsmtIoConcurrency() > 1) {
+        ((LSMT::IFileRO *)m_file)
+            ->set_max_io_concurrency(image_service.global_conf.lsmtIoConcurrency());
+    }
     if (conf.download().enable() && !record_no_download) {
         start_bk_dl_thread();
     }
+    if (!m_squash_key.empty() && image_service.squash->opened(m_squash_key)) {
+        m_squash_jh = photon::thread_enable_join(
+            photon::thread_create11(&ImageFile::squash_lowers, this));
+    }
+    if (m_upper && conf.upper().target().empty() && conf.upper().gcIntervalSec() > 0) {
+        m_gc_jh = photon::thread_enable_join(photon::thread_create11(&ImageFile::gc_upper, this));
+    }
     return 1;
 
 ERROR_EXIT:
@@ -511,6 +970,38 @@ ERROR_EXIT:
     return -1;
 }
 
+ImageFile::MemoryUsage ImageFile::memory_usage() const {
+    MemoryUsage usage;
+    if (m_file) {
+        auto index = ((LSMT::IFileRO *)m_file)->index();
+        if (index)
+            usage.index = index->size() * sizeof(LSMT::SegmentMapping);
+    }
+    if (m_prefetcher)
+        usage.prefetch = m_prefetcher->memory_usage();
+    return usage;
+}
+
+// the index is required, the replay plan of prefetch is shed if the image
+// takes more than imageMemoryBudgetMB
+void ImageFile::check_memory_budget() {
+    size_t budget = (size_t)image_service.global_conf.imageMemoryBudgetMB() << 20;
+    if (budget == 0)
+        return;
+    auto usage = memory_usage();
+    if (usage.total() <= budget)
+        return;
+    if (m_prefetcher && usage.prefetch) {
+        auto freed = m_prefetcher->shed();
+        LOG_WARN("image takes ` bytes, over budget `, prefetch plan of ` bytes shed",
+                 usage.total(), budget, freed);
+        usage = memory_usage();
+    }
+    if (usage.total() > budget)
+        LOG_WARN("image still takes ` bytes (index: `), over budget `", usage.total(),
+                 usage.index, budget);
+}
+
 void ImageFile::set_auth_failed() {
     if (m_status == 0) // only set exit in image boot phase
     {
@@ -24,12 +24,17 @@
 #include <sys/types.h>
 #include <thread>
 #include <unistd.h>
+#include <vector>
 #include <sys/stat.h>
 #include "image_service.h"
 #include "bk_download.h"
+#include "io_record.h"
+#include "io_trace.h"
+#include "open_timeline.h"
 #include "config.h"
 #include "image_service.h"
 #include "prefetch.h"
+#include "qos_fs.h"
 #include <photon/common/alog.h>
 #include <photon/fs/filesystem.h>
 #include <photon/fs/forwardfs.h>
@@ -39,6 +44,14 @@
 static std::string COMMIT_FILE_NAME = "overlaybd.commit";
 static std::string SEALED_FILE_NAME = "overlaybd.sealed";
 
+class PinningFile;
+
+// one pass of online gc of the writable layer `file`, whose files are `data` and
+// `index`, into `<data>.gc` and `<index>.gc`, which are renamed as the old ones
+// once they take over; return 0 for success, 1 for skipped, -1 otherwise
+int gc_upper_layer(LSMT::IFileRW *file, const std::string &data, const std::string &index,
+                   uint32_t garbage_percent);
+
 class ImageFile : public photon::fs::ForwardFile {
 public:
     ImageFile(ImageConfigNS::ImageConfig &_conf, ImageService &is)
@@ -57,7 +70,12 @@ public:
         m_status = -1;
         if (dl_thread_jh != nullptr)
             photon::thread_join(dl_thread_jh);
+        if (m_squash_jh != nullptr)
+            photon::thread_join(m_squash_jh);
+        if (m_gc_jh != nullptr)
+            photon::thread_join(m_gc_jh);
         delete m_prefetcher;
+        delete m_recorder;
         if (m_file) {
             m_file->close();
             delete m_file;
@@ -78,39 +96,96 @@ public:
         if (read_only) {
             LOG_ERROR_RETURN(EROFS, -1, "writing read only file");
         }
-        return m_file->pwritev(iov, iovcnt, offset);
+        auto start = photon::now;
+        auto ret = m_file->pwritev(iov, iovcnt, offset);
+        if (m_recorder)
+            m_recorder->put(IORecord::WRITE, offset, iov_length(iov, iovcnt), start, ret < 0);
+        return ret;
     }
 
     ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
-        return m_file->preadv(iov, iovcnt, offset);
+        IOTrace::ScopeStage _trace(IOTrace::LSMT);
+        auto start = photon::now;
+        auto ret = m_file->preadv(iov, iovcnt, offset);
+        if (m_recorder)
+            m_recorder->put(IORecord::READ, offset, iov_length(iov, iovcnt), start, ret < 0);
+        if (!m_first_read) {
+            m_first_read = true;
+            timeline.add("first_read", start);
+            timeline.save();
+        }
+        return ret;
     }
 
     int fdatasync() override {
-        return m_file->fdatasync();
+        auto start = photon::now;
+        auto ret = m_file->fdatasync();
+        if (m_recorder)
+            m_recorder->put(IORecord::SYNC, 0, 0, start, ret < 0);
+        return ret;
     }
 
     int fallocate(int mode, off_t offset, off_t len) override {
-        return m_file->fallocate(mode, offset, len);
+        auto start = photon::now;
+        auto ret = m_file->fallocate(mode, offset, len);
+        if (m_recorder)
+            m_recorder->put(IORecord::DISCARD, offset, len, start, ret < 0);
+        return ret;
     }
 
     void set_auth_failed();
-    int open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer, int index);
+    // `warmup` fetches the LSMT metadata of a remote layer ahead of loading its index
+    int open_lower_layer(IFile *&file, ImageConfigNS::LayerConfig &layer, int index,
+                         bool warmup = true);
+    // stops pinning the metadata read by the remote layer `index` (all if -1)
+    // in the file cache, once opened
+    void stop_pinning(int index = -1);
 
     std::string m_exception;
+    // see OpenTimeline
+    OpenTimeline timeline;
     int m_status = 0; // 0: not started, 1: running, -1 exit
 
     size_t size;
     uint64_t num_lbas;
     uint32_t block_size;
     bool read_only = false;
+    // writes are acknowledged before the index is synced, see upper.writeCache
+    bool write_cache = false;
 
     IFile* get_base() {
         return m_file;
     }
 
+    // bytes of memory held by the image, by structure
+    struct MemoryUsage {
+        size_t index = 0;    // LSMT segment mappings
+        size_t prefetch = 0; // trace records and replay plan
+        size_t total() const {
+            return index + prefetch;
+        }
+    };
+    MemoryUsage memory_usage() const;
+
 private:
+    // the remote reads of prefetch and background download of this image
+    TokenBucket m_qos_bucket;
     Prefetcher *m_prefetcher = nullptr;
+    // guest I/O recorded for overlaybd-replay, see ioRecordPath
+    IORecorder *m_recorder = nullptr;
+    bool m_first_read = false;
+    // a trace is being recorded, through the files of each layer
+    bool m_record_trace = false;
+    // the chain of lowers to be squashed if opened often enough, see squashConfig
+    std::string m_squash_key;
+    LSMT::IFileRO *m_squash_lowers = nullptr;
+    photon::join_handle *m_squash_jh = nullptr;
+    // the writable layer collected by m_gc_jh, see upper.gcIntervalSec
+    LSMT::IFileRW *m_upper = nullptr;
+    photon::join_handle *m_gc_jh = nullptr;
     ImageConfigNS::ImageConfig conf;
+    // the remote layers pinning what they read while being opened, by index
+    std::vector<PinningFile *> m_pinning;
     std::list<BKDL::BkDownload *> dl_list;
     photon::join_handle *dl_thread_jh = nullptr;
     ImageService &image_service;
@@ -124,4 +199,18 @@ private:
     IFile *__open_ro_remote(const std::string &dir, const std::string &, const uint64_t, int);
     IFile *__open_ro_target_remote(const std::string &dir, const std::string &, const uint64_t, int);
     void start_bk_dl_thread();
+    LSMT::IFileRO *open_squashed(const std::string &path, size_t nlayers);
+    LSMT::IFileRO *open_lazily(std::vector<ImageConfigNS::LayerConfig> &lowers,
+                               const std::string &path);
+    void save_merged_index(LSMT::IFileRO *lowers, const std::string &path);
+    void squash_lowers();
+    void gc_upper();
+    void check_memory_budget();
+
+    static uint64_t iov_length(const struct iovec *iov, int iovcnt) {
+        uint64_t n = 0;
+        for (int i = 0; i < iovcnt; i++)
+            n += iov[i].iov_len;
+        return n;
+    }
 };
@@ -14,18 +14,33 @@
    limitations under the License.
 */
 #include "image_service.h"
+#include "admin_handler.h"
+#include "cache_transfer.h"
 #include "config.h"
+#include "credential_cache.h"
 #include "image_file.h"
+#include "async_audit.h"
+#include "io_trace.h"
+#include "layer_squash.h"
+#include "open_timeline.h"
+#include "overlaybd/cpu_account.h"
+#include "overlaybd/buffer_pool.h"
+#include "qos_fs.h"
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/common/io-alloc.h>
+#include <photon/common/utility.h>
 #include <photon/fs/localfs.h>
 #include <photon/fs/path.h>
 #include <photon/net/curl.h>
 #include <photon/net/http/url.h>
 #include <photon/net/socket.h>
+#include <photon/photon.h>
 #include <photon/thread/thread.h>
 #include "overlaybd/cache/cache.h"
+#include "overlaybd/cache/full_file_cache/cache_group.h"
+#include "overlaybd/gzindex/gzfile.h"
+#include "overlaybd/lsmt/index.h"
 #include "overlaybd/registryfs/registryfs.h"
 #include "overlaybd/zfile/zfile.h"
 #include "overlaybd/base64.h"
@@ -184,6 +199,10 @@ int ImageService::read_global_config_and_set() {
             default_audit_logger.log_output = new_log_output_file(global_conf.auditPath().c_str(), LOG_SIZE, LOG_NUM);
             if (!default_audit_logger.log_output) {
                 default_audit_logger.log_output = log_output_null;
+            } else if (global_conf.auditAsync()) {
+                LOG_INFO("write audit records in background");
+                m_audit_output = AsyncAudit::new_async_log_output(default_audit_logger.log_output);
+                default_audit_logger.log_output = m_audit_output;
             }
         }
     } else {
@@ -217,39 +236,93 @@ int ImageService::read_global_config_and_set() {
     }
     // display in log file
     LOG_INFO("log config: ", VALUE(log_level), VALUE(log_path), VALUE(log_size), VALUE(log_num));
+
+    if (global_conf.indexLayout() == "eytzinger") {
+        LSMT::set_index_layout(LSMT::IndexLayout::Eytzinger);
+    } else if (global_conf.indexLayout() != "flat") {
+        LOG_WARN("unknown index layout: `, use flat", global_conf.indexLayout());
+    }
+    if (global_conf.lsmtPooledIndex()) {
+        LSMT::set_pooled_index0(true);
+    }
+    if (global_conf.zfileCacheSizeMB() > 0) {
+        ZFile::zfile_set_block_cache((size_t)global_conf.zfileCacheSizeMB() << 20);
+    }
+    if (global_conf.zfileDecompressThreads() > 0) {
+        ZFile::zfile_set_decompress_threads(global_conf.zfileDecompressThreads());
+    }
+    if (global_conf.zfileVerifySampling() > 0) {
+        ZFile::zfile_set_verify_sampling(global_conf.zfileVerifySampling());
+    }
+    if (global_conf.gzipSpanCacheSizeMB() > 0) {
+        gzfile_set_span_cache((size_t)global_conf.gzipSpanCacheSizeMB() << 20);
+    }
+    if (!global_conf.gzipInflateBackend().empty() &&
+        gzfile_set_inflate_backend(global_conf.gzipInflateBackend().c_str()) != 0) {
+        LOG_WARN("failed to set gzip inflate backend `, use the default",
+                 global_conf.gzipInflateBackend());
+    }
+    if (global_conf.gzipWindowMmap()) {
+        gzfile_set_window_mmap(true);
+    }
     return 0;
 }
 
-std::pair<std::string, std::string>
-ImageService::reload_auth(const char *remote_path) {
-    LOG_DEBUG("Acquire credential for ", VALUE(remote_path));
+int ImageService::resolve_auth(const std::string &remote_path,
+                               std::pair<std::string, std::string> &cred) {
     std::string username, password;
     int res = 0;
     if (global_conf.credentialConfig().mode().empty()) {
         LOG_INFO("reload auth from legacy configuration [`]", global_conf.credentialFilePath());
-        res = load_cred_from_file(global_conf.credentialFilePath(), std::string(remote_path), username, password);
+        res = load_cred_from_file(global_conf.credentialFilePath(), remote_path, username, password);
     } else {
         auto mode = global_conf.credentialConfig().mode();
         auto path = global_conf.credentialConfig().path();
         if (path.empty()) {
-            LOG_ERROR("empty authentication path.");
-            return std::make_pair("","");
+            LOG_ERROR_RETURN(0, -1, "empty authentication path.");
         }
         if (mode == "file") {
-            res = load_cred_from_file(path, std::string(remote_path), username, password);
+            res = load_cred_from_file(path, remote_path, username, password);
         } else if (mode == "http") {
             auto timeout = global_conf.credentialConfig().timeout();
-            res = load_cred_from_http(path, std::string(remote_path), username, password, timeout);
+            res = load_cred_from_http(path, remote_path, username, password, timeout);
         } else {
-            LOG_ERROR("invalid mode for authentication.");
-            return std::make_pair("","");
+            LOG_ERROR_RETURN(0, -1, "invalid mode for authentication.");
         }
     }
-    if (res == 0) {
-        LOG_INFO("auth found for `: `", remote_path, username);
-        return std::make_pair(username, password);
-    }
-    return std::make_pair("", "");
+    if (res != 0)
+        return res;
+    LOG_INFO("auth found for `: `", remote_path, username);
+    cred = std::make_pair(username, password);
+    return 0;
+}
+
+std::pair<std::string, std::string>
+ImageService::reload_auth(const char *remote_path) {
+    LOG_DEBUG("Acquire credential for ", VALUE(remote_path));
+    auto start = photon::now;
+    DEFER(OpenTimeline::add_current("credential", start));
+    if (m_cred_cache)
+        return m_cred_cache->get(cred_key(remote_path), remote_path);
+    std::pair<std::string, std::string> cred;
+    if (resolve_auth(remote_path, cred) != 0)
+        return std::make_pair("", "");
+    return cred;
+}
+
+void ImageService::auth_failed(const char *remote_path) {
+    if (m_cred_cache)
+        m_cred_cache->invalidate(cred_key(remote_path));
+}
+
+// credentials are cached by the registry and repository
+std::string ImageService::cred_key(const char *remote_path) {
+    struct ImageRef ref;
+    std::string key;
+    parse_blob_url(remote_path, ref);
+    for (auto &seg : ref.seg)
+        key += seg + "/";
+    return key.empty() ? remote_path : key;
 }
 
 void ImageService::set_result_file(std::string &filename, std::string &data) {
@@ -305,10 +378,25 @@ bool check_accelerate_url(std::string_view a_url) {
     return true;
 }
 
+// whether the handlers with control of the node or its caches may be exposed
+// by the exporter, i.e. they're behind cacheToken or not bound to all interfaces
+static bool exporter_restricted(ImageConfigNS::ExporterConfig &conf) {
+    auto addr = conf.address();
+    return !conf.cacheToken().empty() || !(addr.empty() || addr == "0.0.0.0" || addr == "::");
+}
+
 int ImageService::init() {
     if (read_global_config_and_set() < 0) {
         return -1;
     }
+    m_open_limit = global_conf.imageOpenConcurrency();
+    if (m_open_limit)
+        m_open_slots.signal(m_open_limit);
+    if (auto ttl = global_conf.credentialConfig().cacheTTL()) {
+        LOG_INFO("keep resolved credentials for `s", ttl);
+        m_cred_cache.reset(new CredentialCache({this, &ImageService::resolve_auth},
+                                               (uint64_t)ttl * 1000000));
+    }
 
     std::string cache_type, cache_dir;
     uint32_t cache_size_GB, refill_size, block_size;
@@ -330,6 +418,18 @@ int ImageService::init() {
     LOG_INFO("cache config: ", VALUE(cache_type), VALUE(cache_dir),
                                VALUE(cache_size_GB), VALUE(refill_size));
 
+    int media_ioengine = global_conf.cacheConfig().ioEngine();
+    if (media_ioengine != ioengine_psync && media_ioengine != ioengine_iouring) {
+        LOG_WARN("unsupported io engine ` of cache media, use psync", media_ioengine);
+        media_ioengine = ioengine_psync;
+    }
+#ifndef ENABLE_IOURING
+    if (media_ioengine == ioengine_iouring) {
+        LOG_WARN("io_uring is not enabled in this build, use psync for cache media");
+        media_ioengine = ioengine_psync;
+    }
+#endif
+
     if (!create_dir(cache_dir.c_str()))
         return -1;
 
@@ -353,32 +453,116 @@ int ImageService::init() {
         if (global_fs.underlay_registryfs == nullptr) {
             LOG_ERROR_RETURN(0, -1, "create registryfs failed.");
         }
+        if (m_cred_cache)
+            ((RegistryFS *)global_fs.underlay_registryfs)
+                ->setAuthFailedCallback({this, &ImageService::auth_failed});
+        auto max_conns = global_conf.registryConfig().maxConnsPerHost();
+        if (max_conns) {
+            LOG_INFO("limit registry connections per host to `", max_conns);
+            ((RegistryFS *)global_fs.underlay_registryfs)->setMaxConnsPerHost(max_conns);
+        }
+        auto coalesce_window = global_conf.registryConfig().coalesceWindowUs();
+        if (coalesce_window) {
+            auto coalesce_gap = global_conf.registryConfig().coalesceGap();
+            LOG_INFO("coalesce registry reads, ", VALUE(coalesce_window), VALUE(coalesce_gap));
+            ((RegistryFS *)global_fs.underlay_registryfs)
+                ->setReadCoalescing(coalesce_window, coalesce_gap);
+        }
+        auto stripe_size = global_conf.registryConfig().stripeSizeKB() * 1024UL;
+        auto hedge = global_conf.registryConfig().hedgeRequests();
+        if (stripe_size || hedge) {
+            LOG_INFO("split registry reads, ", VALUE(stripe_size), VALUE(hedge));
+            ((RegistryFS *)global_fs.underlay_registryfs)->setRangeSplitting(stripe_size, hedge);
+        }
+        auto peers = global_conf.p2pConfig().peers();
+        if (!peers.empty()) {
+            auto self = global_conf.p2pConfig().self();
+            LOG_INFO("share registry blocks among ` peers, ", peers.size(), VALUE(self));
+            if (((RegistryFS *)global_fs.underlay_registryfs)
+                    ->setPeers(self.c_str(), peers, refill_size,
+                               global_conf.p2pConfig().peerToken().c_str()) < 0)
+                LOG_ERRNO_RETURN(0, -1, "failed to set peers for registryfs");
+        }
         if (global_conf.exporterConfig().enable()) {
             metrics.reset(new OverlayBDMetric());
-            global_fs.srcfs = new MetricFS(global_fs.underlay_registryfs, &metrics->download);
+            auto registryfs = (RegistryFS *)global_fs.underlay_registryfs;
+            metrics->exporter.extra = [registryfs]() { return registryfs->endpointMetrics(); };
+            auto srcfs = new MetricFS(global_fs.underlay_registryfs, &metrics->download);
+            auto exporter_render = &metrics->exporter;
+            srcfs->layer_stats_of = [exporter_render](const char *fn) {
+                std::string image, layer;
+                layer_labels(fn, image, layer);
+                return exporter_render->layer_stats(image, layer, "remote");
+            };
+            global_fs.srcfs = srcfs;
+            if (IOTrace::init(global_conf.exporterConfig().traceSampleRate()) != 0)
+                LOG_ERROR_RETURN(0, -1, "Failed to init io tracing");
+            if (global_conf.exporterConfig().cpuAccounting()) {
+                LOG_INFO("account cpu cycles of decompress, crc32c, inflate and lookup");
+                CpuAccount::enable(true);
+            }
             exporter = new ExporterServer(global_conf, metrics.get());
             if (!exporter->ready)
                 LOG_ERROR_RETURN(0, -1, "Failed to start http server for metrics exporter");
         } else {
             global_fs.srcfs = global_fs.underlay_registryfs;
         }
+        if (global_conf.qosConfig().enable()) {
+            auto qos = global_conf.qosConfig();
+            QosOptions opts;
+            opts.max_inflight = qos.maxInflight();
+            opts.prefetch_rate = qos.prefetchMBps() * 1024UL * 1024;
+            opts.download_rate = qos.downloadMBps() * 1024UL * 1024;
+            opts.latency_target_us = qos.latencyTargetMs() * 1000UL;
+            LOG_INFO("schedule remote reads by class, ", VALUE(opts.max_inflight),
+                     VALUE(opts.prefetch_rate), VALUE(opts.download_rate),
+                     VALUE(opts.latency_target_us));
+            global_fs.srcfs = new_qos_fs(global_fs.srcfs, opts, true);
+        }
 
         if (global_conf.enableThread() == true && cache_type == "file") {
             LOG_ERROR_RETURN(0, -1, "multi-thread has not been valid for file cache");
         }
 
-        global_fs.io_alloc = new IOAlloc;
+        if (global_conf.ioBufferHugePage())
+            BufferPool::enable_hugepage();
+        global_fs.io_alloc = BufferPool::new_io_alloc();
 
         if (cache_type == "file") {
-            auto registry_cache_fs = new_localfs_adaptor(cache_dir.c_str());
+            auto registry_cache_fs = new_localfs_adaptor(cache_dir.c_str(), media_ioengine);
             if (registry_cache_fs == nullptr) {
                 delete global_fs.srcfs;
                 LOG_ERROR_RETURN(0, -1, "new_localfs_adaptor for ` failed", cache_dir.c_str());
             }
+            int eviction_policy = EVICT_LRU;
+            auto policy_name = global_conf.cacheConfig().evictionPolicy();
+            if (policy_name == "2q") {
+                eviction_policy = EVICT_2Q;
+            } else if (policy_name != "lru") {
+                LOG_WARN("unknown cache eviction policy `, use lru", policy_name);
+            }
             // file cache will delete its src_fs automatically when destructed
-            global_fs.cached_fs = FileSystem::new_full_file_cached_fs(
+            auto file_cached_fs = FileSystem::new_full_file_cached_fs(
                 global_fs.srcfs, registry_cache_fs, refill_size, cache_size_GB, 10000000,
-                (uint64_t)1048576 * 1024, global_fs.io_alloc, 0, {nullptr, &cache_fn_trans_sha256});
+                (uint64_t)1048576 * 1024, global_fs.io_alloc, 0, {nullptr, &cache_fn_trans_sha256},
+                eviction_policy, global_conf.cacheConfig().poolShards());
+            auto max_refill_size = global_conf.cacheConfig().maxRefillSize();
+            if (file_cached_fs && max_refill_size > refill_size) {
+                LOG_INFO("use adaptive refill size, ", VALUE(max_refill_size));
+                file_cached_fs->get_pool()->set_max_refill_size(max_refill_size);
+            }
+            auto writeback_size = global_conf.cacheConfig().writebackBufferMB() * 1024UL * 1024;
+            if (file_cached_fs && writeback_size) {
+                LOG_INFO("write refilled data back in the background, ", VALUE(writeback_size));
+                file_cached_fs->get_pool()->set_writeback_limit(writeback_size);
+            }
+            if (file_cached_fs && global_conf.cacheConfig().directWrite()) {
+                LOG_INFO("write refilled data to the cache media with O_DIRECT");
+                file_cached_fs->get_pool()->set_direct_write(true);
+            }
+            global_fs.cached_fs = file_cached_fs;
+            if (file_cached_fs)
+                global_fs.cache_pool = file_cached_fs->get_pool();
 
         } else if (cache_type == "ocf") {
             auto namespace_dir = std::string(cache_dir + "/namespace");
@@ -397,17 +581,23 @@ int ImageService::init() {
             if (::access(media_file_path.c_str(), F_OK) != 0) {
                 reload_media = false;
                 media_file = open_localfile_adaptor(media_file_path.c_str(), O_RDWR | O_CREAT, 0644,
-                                                                ioengine_psync);
+                                                                media_ioengine);
                 media_file->fallocate(0, 0, cache_size_GB * 1024UL * 1024 * 1024);
             } else {
                 reload_media = true;
                 media_file = open_localfile_adaptor(media_file_path.c_str(), O_RDWR, 0644,
-                                                                ioengine_psync);
+                                                                media_ioengine);
             }
             global_fs.media_file = media_file;
 
+            auto hugepage = global_conf.cacheConfig().ocfHugePage();
+            if (hugepage)
+                LOG_INFO("back OCF metadata by hugepages");
             global_fs.cached_fs = FileSystem::new_ocf_cached_fs(global_fs.srcfs, namespace_fs, block_size, refill_size,
-                                                                media_file, reload_media, global_fs.io_alloc);
+                                                                media_file, reload_media, global_fs.io_alloc, hugepage,
+                                                                media_ioengine == ioengine_iouring
+                                                                    ? photon::INIT_EVENT_IOURING
+                                                                    : 0);
         } else if (cache_type == "download") {
             global_fs.cached_fs = FileSystem::new_download_cached_fs(global_fs.srcfs, 4096, refill_size, global_fs.io_alloc);
         } else {
@@ -417,10 +607,43 @@ int ImageService::init() {
             LOG_ERRNO_RETURN(0, -1, "failed to create cached_fs");
         }
 
+        if (global_conf.cacheConfig().memoryCacheSizeMB() > 0) {
+            auto memory_size = global_conf.cacheConfig().memoryCacheSizeMB() * 1024UL * 1024;
+            LOG_INFO("use memory cache tier, ", VALUE(memory_size));
+            auto memory_fs = FileSystem::new_memory_cached_fs(global_fs.cached_fs, memory_size,
+                                                              refill_size, true);
+            if (memory_fs == nullptr) {
+                LOG_ERRNO_RETURN(0, -1, "failed to create memory cache tier");
+            }
+            global_fs.cached_fs = memory_fs;
+        }
+
+        if (!global_conf.p2pConfig().peers().empty() &&
+            !global_conf.p2pConfig().self().empty()) {
+            if (global_fs.cache_pool == nullptr)
+                LOG_ERROR_RETURN(0, -1, "serving blocks to peers needs the file cache");
+            peer_server = new PeerServer(global_conf, global_fs.cache_pool, refill_size);
+            if (!peer_server->ready)
+                LOG_ERROR_RETURN(0, -1, "Failed to start http server for peers");
+        }
+
         if (global_conf.exporterConfig().enable()) {
             global_fs.cached_fs = new MetricFS(global_fs.cached_fs, &metrics->pread);
+            auto &exporter_conf = global_conf.exporterConfig();
+            auto admin_prefix = exporter_conf.adminUriPrefix();
+            if (!admin_prefix.empty() && !exporter_restricted(exporter_conf)) {
+                LOG_WARN("runtime settings need exporterConfig.cacheToken or "
+                         "exporterConfig.address, not served");
+            } else if (!admin_prefix.empty()) {
+                LOG_INFO("serve runtime settings at `", admin_prefix);
+                admin = new AdminHandler(global_fs.cache_pool, cache_size_GB, refill_size,
+                                         global_conf.cacheConfig().maxRefillSize(),
+                                         exporter_conf.cacheToken());
+                exporter->httpserver->add_handler(admin, false, admin_prefix);
+            }
         }
 
+        auto registry_size_GB = cache_size_GB;
         if (global_conf.gzipCacheConfig().enable()) {
             LOG_INFO("use gzip file cache");
             cache_dir = global_conf.gzipCacheConfig().cacheDir();
@@ -429,7 +652,7 @@ int ImageService::init() {
             if (!create_dir(cache_dir.c_str())) {
                 return -1;
             }
-            auto gzip_cache_fs = new_localfs_adaptor(cache_dir.c_str());
+            auto gzip_cache_fs = new_localfs_adaptor(cache_dir.c_str(), media_ioengine);
             if (gzip_cache_fs == nullptr) {
                 delete global_fs.srcfs;
                 LOG_ERROR_RETURN(0, -1, "new_localfs_adaptor for ` failed", cache_dir.c_str());
@@ -437,9 +660,73 @@ int ImageService::init() {
 
             global_fs.gzcache_fs = Cache::new_gzip_cached_fs(
                 gzip_cache_fs, refill_size, cache_size_GB,
-                10000000, (uint64_t)1048576 * 4096, global_fs.io_alloc);
+                10000000, (uint64_t)1048576 * 4096, global_fs.io_alloc,
+                global_conf.gzipCacheConfig().compress());
+        }
+
+        auto &gz_conf = global_conf.gzipCacheConfig();
+        if (gz_conf.shareCapacity() && global_fs.gzcache_fs && global_fs.cache_pool) {
+            // either one may take the space the other leaves idle, down to its reservation
+            auto capacity = registry_size_GB + gz_conf.cacheSizeGB();
+            LOG_INFO("the file cache and the gzip cache share `GB, reserved `GB and `GB",
+                     capacity, global_conf.cacheConfig().reservedGB(), gz_conf.reservedGB());
+            global_fs.cache_group = new Cache::FileCacheGroup(capacity);
+            if (global_fs.cache_group->add(global_fs.cache_pool,
+                                           global_conf.cacheConfig().reservedGB() * 1024UL *
+                                               1024 * 1024) != 0 ||
+                global_fs.cache_group->add(global_fs.gzcache_fs->get_pool(),
+                                           gz_conf.reservedGB() * 1024UL * 1024 * 1024) != 0)
+                LOG_ERRNO_RETURN(0, -1, "failed to share the capacity of the caches");
+        } else if (gz_conf.shareCapacity()) {
+            LOG_WARN("only the file cache shares its capacity with the gzip cache, ignored");
+        }
+
+        auto gz_pool = global_fs.gzcache_fs ? global_fs.gzcache_fs->get_pool() : nullptr;
+        auto registry_refill = global_conf.cacheConfig().refillSize();
+        auto warm_from = global_conf.cacheConfig().warmFrom();
+        if (!warm_from.empty()) {
+            // before any device is served, so the new node starts warm
+            auto concurrency = global_conf.cacheConfig().warmConcurrency();
+            auto token = global_conf.cacheConfig().warmToken();
+            if (global_fs.cache_pool)
+                CacheTransfer::import(warm_from, "file", global_fs.cache_pool, registry_refill,
+                                      concurrency, token);
+            if (gz_pool)
+                CacheTransfer::import(warm_from, "gzip", gz_pool, gz_conf.refillSize(),
+                                      concurrency, token);
+        }
+        auto &exporter_conf = global_conf.exporterConfig();
+        auto cache_prefix = exporter_conf.cacheUriPrefix();
+        // the caches hold the layers of every image, never to be served to anyone who asks
+        if (exporter && !cache_prefix.empty() && !exporter_restricted(exporter_conf)) {
+            LOG_WARN("cache export needs exporterConfig.cacheToken or exporterConfig.address, "
+                     "not exported");
+        } else if (exporter && !cache_prefix.empty() && (global_fs.cache_pool || gz_pool)) {
+            LOG_INFO("export cache contents at `", cache_prefix);
+            cache_export = new CacheTransfer::ExportHandler(exporter_conf.cacheToken());
+            if (global_fs.cache_pool)
+                cache_export->add("file", global_fs.cache_pool, registry_refill);
+            if (gz_pool)
+                cache_export->add("gzip", gz_pool, gz_conf.refillSize());
+            exporter->httpserver->add_handler(cache_export, false, cache_prefix);
         }
     }
+
+    auto &squash_conf = global_conf.squashConfig();
+    if (squash_conf.enable()) {
+        if (!create_dir(squash_conf.dir().c_str()))
+            return -1;
+        LOG_INFO("squash chains of at least ` layers opened ` times into `",
+                 squash_conf.minLayers(), squash_conf.minOpens(), squash_conf.dir());
+        squash = new LayerSquash(squash_conf.dir(), squash_conf.minLayers(),
+                                 squash_conf.minOpens());
+    }
+    auto &lazy_conf = global_conf.lazyOpenConfig();
+    if (lazy_conf.enable()) {
+        if (!create_dir(lazy_conf.dir().c_str()))
+            return -1;
+        LOG_INFO("open lower layers lazily with merged indexes in `", lazy_conf.dir());
+    }
     return 0;
 }
 
@@ -457,6 +744,7 @@ bool ImageService::enable_acceleration() {
 }
 
 ImageFile *ImageService::create_image_file(const char *config_path) {
+    auto parse_start = photon::now;
     ImageConfigNS::GlobalConfig defaultDlCfg;
     if (!defaultDlCfg.ParseJSON(m_config_path)) {
         LOG_WARN("default download config parse failed, ignore");
@@ -479,7 +767,21 @@ ImageFile *ImageService::create_image_file(const char *config_path) {
     }
 
     auto resFile = cfg.resultFile();
+    auto wait_start = photon::now;
+    if (m_open_limit)
+        m_open_slots.wait(1);
+    DEFER(if (m_open_limit) m_open_slots.signal(1));
+    if (photon::now - wait_start > 1000 * 1000)
+        LOG_INFO("waited ` ms to open `", (photon::now - wait_start) / 1000, config_path);
+    auto open_start = photon::now;
     ImageFile *ret = new ImageFile(cfg, *this);
+    ret->timeline.add("config_parse", parse_start, wait_start);
+    ret->timeline.add("open_wait", wait_start, open_start);
+    ret->timeline.add("open", open_start);
+    if (!resFile.empty())
+        ret->timeline.set_path(resFile + ".timeline");
+    ret->timeline.save();
+    LOG_INFO("open timeline of `: `", config_path, ret->timeline.to_json());
     if (ret->m_status <= 0) {
         std::string data = "failed:" + ret->m_exception;
         set_result_file(resFile, data);
@@ -496,16 +798,36 @@ ImageService::ImageService(const char *config_path) {
 }
 
 ImageService::~ImageService() {
+    m_cred_cache.reset();
+    delete exporter;
+    delete admin;
+    delete cache_export;
+    delete peer_server;
+    delete squash;
     delete global_fs.media_file;
     delete global_fs.namespace_fs;
     delete global_fs.cached_fs;
     delete global_fs.gzcache_fs;
+    delete global_fs.cache_group;
     delete global_fs.srcfs;
     delete global_fs.io_alloc;
-    delete exporter;
+    if (m_audit_output) {
+        default_audit_logger.log_output = log_output_null;
+        m_audit_output->destruct();
+    }
     LOG_INFO("image service is fully stopped");
 }
 
+uint64_t cache_media_event_engine(const char *config_path) {
+#ifdef ENABLE_IOURING
+    ImageConfigNS::GlobalConfig conf;
+    if (conf.ParseJSON(config_path ? config_path : DEFAULT_CONFIG_PATH) &&
+        conf.cacheConfig().ioEngine() == ioengine_iouring)
+        return photon::INIT_EVENT_IOURING;
+#endif
+    return 0;
+}
+
 ImageService *create_image_service(const char *config_path) {
     ImageService *ret = new ImageService(config_path);
     if (ret->init() < 0) {
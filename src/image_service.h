@@ -19,12 +19,18 @@
 #include <string>
 #include "config.h"
 #include "exporter_server.h"
+#include "peer_server.h"
 #include "overlaybd/cache/gzip_cache/cached_fs.h"
 #include <photon/fs/filesystem.h>
 #include <photon/common/io-alloc.h>
+#include <photon/thread/thread.h>
+#include <photon/common/alog.h>
 
 using namespace photon::fs;
 
+namespace Cache {
+class FileCacheGroup;
+}
 
 struct GlobalFs {
     IFileSystem *underlay_registryfs = nullptr;
@@ -32,6 +38,10 @@ struct GlobalFs {
     IFileSystem *srcfs = nullptr;
     IFileSystem *cached_fs = nullptr;
     Cache::GzipCachedFs *gzcache_fs = nullptr;
+    // file cache only
+    FileSystem::ICachePool *cache_pool = nullptr;
+    // the capacity shared by the file cache and the gzip cache, see gzipCacheConfig
+    Cache::FileCacheGroup *cache_group = nullptr;
 
     // ocf cache only
     IFile *media_file = nullptr;
@@ -48,6 +58,12 @@ struct ImageAuthResponse : public ConfigUtils::Config {
 };
 
 struct ImageFile;
+struct AdminHandler;
+class LayerSquash;
+class CredentialCache;
+namespace CacheTransfer {
+class ExportHandler;
+}
 
 class ImageService {
 public:
@@ -62,16 +78,37 @@ public:
     struct GlobalFs global_fs;
     std::unique_ptr<OverlayBDMetric> metrics;
     ExporterServer *exporter = nullptr;
+    AdminHandler *admin = nullptr;
+    // see exporterConfig.cacheUriPrefix
+    CacheTransfer::ExportHandler *cache_export = nullptr;
+    PeerServer *peer_server = nullptr;
+    // see squashConfig
+    LayerSquash *squash = nullptr;
 
 private:
     int read_global_config_and_set();
     std::pair<std::string, std::string> reload_auth(const char *remote_path);
+    void auth_failed(const char *remote_path);
+    std::string cred_key(const char *remote_path);
+    int resolve_auth(const std::string &remote_path, std::pair<std::string, std::string> &cred);
     void set_result_file(std::string &filename, std::string &data);
     std::string m_config_path;
+    // bounds the images opened at the same time, see imageOpenConcurrency
+    photon::semaphore m_open_slots{0};
+    uint32_t m_open_limit = 0;
+    // see auditAsync
+    ILogOutput *m_audit_output = nullptr;
+    // see credentialConfig.cacheTTL
+    std::unique_ptr<CredentialCache> m_cred_cache;
 };
 
 ImageService *create_image_service(const char *config_path = nullptr);
 
+// the photon event engine needed besides the default ones by the vcpus doing I/O
+// to the cache media, i.e. io_uring if cacheConfig.ioEngine selects it, otherwise
+// 0; it's read from the global config before any vcpu is initialized
+uint64_t cache_media_event_engine(const char *config_path = nullptr);
+
 int load_cred_from_file(const std::string path, const std::string &remote_path,
                         std::string &username, std::string &password);
 
@@ -0,0 +1,141 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "io_record.h"
+#include <fcntl.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
+
+IORecorder *IORecorder::create(const std::string &path) {
+    int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to create io record file `", path);
+    IORecordHeader header;
+    struct timeval tv;
+    gettimeofday(&tv, nullptr);
+    header.start_us = tv.tv_sec * 1000000UL + tv.tv_usec;
+    if (::write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header)) {
+        ::close(fd);
+        LOG_ERRNO_RETURN(0, nullptr, "failed to write io record file `", path);
+    }
+    auto r = new IORecorder;
+    r->m_fd = fd;
+    r->m_start = photon::now;
+    r->m_batch.reserve(BATCH);
+    photon::thread_create11(&IORecorder::writer, r);
+    LOG_INFO("record io to `", path);
+    return r;
+}
+
+IORecorder::~IORecorder() {
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_stopping = true;
+    }
+    m_sem.signal(1);
+    m_exited.wait(1);
+    write(m_batch);
+    ::close(m_fd);
+}
+
+void IORecorder::put(IORecord::Op op, uint64_t offset, uint64_t length, uint64_t start,
+                     bool failed) {
+    IORecord r;
+    memset(&r, 0, sizeof(r));
+    r.time_us = start - m_start;
+    r.offset = offset;
+    r.length = length;
+    r.latency_us = std::min<uint64_t>(photon::now - start, UINT32_MAX);
+    r.op = op;
+    r.failed = failed;
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_batch.push_back(r);
+    if (m_batch.size() < BATCH)
+        return;
+    // a full batch is handed to the writer, for a spare one
+    m_full.emplace_back(std::move(m_batch));
+    if (m_spare.empty()) {
+        m_batch = {};
+        m_batch.reserve(BATCH);
+    } else {
+        m_batch = std::move(m_spare.back());
+        m_spare.pop_back();
+    }
+    m_sem.signal(1);
+}
+
+// a batch is 128KB written to the page cache, once per BATCH requests
+void IORecorder::write(const std::vector<IORecord> &batch) {
+    if (batch.empty())
+        return;
+    auto size = batch.size() * sizeof(IORecord);
+    if (::write(m_fd, batch.data(), size) != (ssize_t)size)
+        LOG_ERRNO_RETURN(0, , "failed to write ` io records, dropped", batch.size());
+}
+
+void IORecorder::writer() {
+    std::vector<std::vector<IORecord>> full;
+    bool stopping = false;
+    while (!stopping) {
+        m_sem.wait(1);
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            full.swap(m_full);
+            stopping = m_stopping;
+        }
+        for (auto &batch : full) {
+            write(batch);
+            batch.clear();
+        }
+        std::lock_guard<std::mutex> lock(m_mtx);
+        for (auto &batch : full)
+            m_spare.emplace_back(std::move(batch));
+        full.clear();
+    }
+    m_exited.signal(1);
+}
+
+int IORecorder::load(const std::string &path, std::vector<IORecord> &records,
+                     IORecordHeader *header) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to open io record file `", path);
+    IORecordHeader h;
+    auto n = ::read(fd, &h, sizeof(h));
+    if (n != (ssize_t)sizeof(h) || h.magic != IORecordHeader::MAGIC ||
+        h.record_size != sizeof(IORecord)) {
+        ::close(fd);
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid io record file `", path);
+    }
+    std::vector<IORecord> batch(BATCH);
+    while ((n = ::read(fd, batch.data(), BATCH * sizeof(IORecord))) > 0)
+        records.insert(records.end(), batch.begin(), batch.begin() + n / sizeof(IORecord));
+    ::close(fd);
+    if (n < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to read io record file `", path);
+    // records are put at completion, replay them by submission
+    std::stable_sort(records.begin(), records.end(),
+                     [](const IORecord &a, const IORecord &b) { return a.time_us < b.time_us; });
+    if (header)
+        *header = h;
+    return 0;
+}
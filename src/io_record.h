@@ -0,0 +1,80 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <photon/thread/thread.h>
+
+// Records the I/O of a device as the ImageFile serves it, to be replayed by
+// overlaybd-replay against other images or configurations. A record file is
+// an IORecordHeader followed by IORecords, appended in batches so that the
+// I/O path only copies a record into memory; the batches are written by a
+// background photon thread.
+struct IORecord {
+    enum Op : uint8_t { READ = 'R', WRITE = 'W', SYNC = 'S', DISCARD = 'D' };
+
+    uint64_t time_us;    // of the submission, since recording started
+    uint64_t offset;
+    uint64_t length;     // a discard may span the whole device
+    uint32_t latency_us;
+    uint8_t op;
+    uint8_t failed;
+    uint8_t reserved[2];
+};
+static_assert(sizeof(IORecord) == 32, "io record is 32 bytes");
+
+struct IORecordHeader {
+    uint32_t magic = MAGIC;
+    uint32_t record_size = sizeof(IORecord);
+    uint64_t start_us = 0; // wall clock when recording started
+
+    static const uint32_t MAGIC = 0x4f49424f; // "OBIO"
+};
+
+class IORecorder {
+public:
+    // creates or truncates `path`; nullptr if it fails
+    static IORecorder *create(const std::string &path);
+
+    ~IORecorder();
+
+    // `start` is photon::now at submission
+    void put(IORecord::Op op, uint64_t offset, uint64_t length, uint64_t start, bool failed);
+
+    // loads the records of `path`, in the order of submission
+    static int load(const std::string &path, std::vector<IORecord> &records,
+                    IORecordHeader *header = nullptr);
+
+private:
+    static const size_t BATCH = 4096;
+
+    int m_fd = -1;
+    uint64_t m_start = 0; // photon::now when recording started
+    std::mutex m_mtx;
+    std::vector<IORecord> m_batch;
+    // batches full, to be written, and written, to be reused
+    std::vector<std::vector<IORecord>> m_full, m_spare;
+    bool m_stopping = false;
+    photon::semaphore m_sem, m_exited;
+
+    IORecorder() = default;
+    void writer();
+    void write(const std::vector<IORecord> &batch);
+};
@@ -0,0 +1,115 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "io_trace.h"
+#include <photon/common/alog.h>
+#include <photon/common/estring.h>
+#include <photon/thread/thread-key.h>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace IOTrace {
+
+std::atomic<uint32_t> sample_rate{0};
+
+static const char *STAGE_NAMES[STAGES] = {"lsmt", "layer", "cache", "remote"};
+
+static photon::thread_key_t trace_key;
+static std::atomic<uint64_t> seq{0};
+
+// traces are only put and dumped by the few sampled requests, a plain mutex
+// is enough
+static std::mutex ring_mtx;
+static std::vector<Trace> ring;
+static size_t ring_next = 0, ring_count = 0;
+
+int init(uint32_t n, size_t ring_size) {
+    if (n == 0 || ring_size == 0) {
+        sample_rate = 0;
+        return 0;
+    }
+    if (photon::thread_key_create(&trace_key, nullptr) != 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to create thread key for io tracing");
+    {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        ring.assign(ring_size, Trace{});
+        ring_next = ring_count = 0;
+    }
+    sample_rate = n;
+    LOG_INFO("trace 1 of ` requests, keep the last `", n, ring_size);
+    return 0;
+}
+
+Trace *current() {
+    return (Trace *)photon::thread_getspecific(trace_key);
+}
+
+Trace *begin(const char *op, uint64_t offset, uint64_t length) {
+    auto n = sample_rate.load(std::memory_order_relaxed);
+    if (n == 0 || seq.fetch_add(1, std::memory_order_relaxed) % n != 0)
+        return nullptr;
+    auto t = new Trace;
+    memset(t, 0, sizeof(*t));
+    t->start = photon::now;
+    t->op = op;
+    t->offset = offset;
+    t->length = length;
+    photon::thread_setspecific(trace_key, t);
+    return t;
+}
+
+void end(Trace *t, int64_t result) {
+    if (t == nullptr)
+        return;
+    photon::thread_setspecific(trace_key, nullptr);
+    t->total_us = photon::now - t->start;
+    t->result = result;
+    {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        ring[ring_next] = *t;
+        ring_next = (ring_next + 1) % ring.size();
+        if (ring_count < ring.size())
+            ring_count++;
+    }
+    delete t;
+}
+
+std::string dump() {
+    std::vector<Trace> traces;
+    {
+        std::lock_guard<std::mutex> lock(ring_mtx);
+        traces.reserve(ring_count);
+        auto first = (ring_next + ring.size() - ring_count) % (ring.empty() ? 1 : ring.size());
+        for (size_t i = 0; i < ring_count; i++)
+            traces.push_back(ring[(first + i) % ring.size()]);
+    }
+    std::string ret;
+    for (auto &t : traces) {
+        ret.append(estring().appends("{\"start\":", t.start, ",\"op\":\"", t.op,
+                                     "\",\"offset\":", t.offset, ",\"length\":", t.length,
+                                     ",\"result\":", t.result, ",\"total_us\":", t.total_us,
+                                     ",\"stages\":{"));
+        for (int i = 0; i < STAGES; i++) {
+            ret.append(estring().appends(i ? "," : "", "\"", STAGE_NAMES[i], "\":{\"us\":",
+                                         t.stage_us[i], ",\"calls\":", t.stage_calls[i], "}"));
+        }
+        ret.append("}}\n");
+    }
+    return ret;
+}
+
+} // namespace IOTrace
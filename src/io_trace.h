@@ -0,0 +1,122 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <photon/fs/forwardfs.h>
+#include <photon/thread/thread.h>
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Sampled tracing of device requests through the read stack. A traced
+// request records, for every stage it passes, the time spent in it and the
+// # of calls. Stages nest (lsmt > layer > cache > remote) and times are
+// inclusive, so the time of a stage itself is its time minus the next one.
+// Finished traces are kept in a ring buffer, rendered by dump().
+//
+// Only the photon thread serving the request is traced, the work it hands
+// off to other threads (refilling, prefetching) is not attributed.
+namespace IOTrace {
+
+enum Stage : int {
+    LSMT = 0, // ImageFile, merging the layers
+    LAYER,    // a layer file, including tar / zfile / gzip decoding
+    CACHE,    // the cache of remote layers
+    REMOTE,   // registry or p2p reads of cache misses
+    STAGES,
+    NONE = -1,
+};
+
+struct Trace {
+    uint64_t start;    // photon::now
+    uint64_t total_us;
+    uint64_t offset;
+    uint64_t length;
+    int64_t result;
+    const char *op;    // "read" or "write"
+    uint64_t stage_us[STAGES];
+    uint32_t stage_calls[STAGES];
+};
+
+extern std::atomic<uint32_t> sample_rate;
+
+// traces 1 of every `n` requests and keeps the last `ring_size` traces;
+// n == 0 turns tracing off. Must be called before requests are served.
+int init(uint32_t n, size_t ring_size = 1024);
+
+inline bool enabled() {
+    return sample_rate.load(std::memory_order_relaxed) != 0;
+}
+
+// starts tracing the request served by the current photon thread, if it is
+// sampled; returns nullptr otherwise
+Trace *begin(const char *op, uint64_t offset, uint64_t length);
+
+// finishes `t` (may be nullptr) and puts it into the ring buffer
+void end(Trace *t, int64_t result);
+
+// the trace of the current photon thread, if any
+Trace *current();
+
+// the traces in the ring buffer, oldest first, as one JSON object per line
+std::string dump();
+
+// adds the time from construction to destruction to `stage` of the current
+// trace
+struct ScopeStage {
+    Trace *t = nullptr;
+    int stage;
+    uint64_t start;
+
+    explicit ScopeStage(int stage) : stage(stage) {
+        if (stage != NONE && enabled() && (t = current()) != nullptr)
+            start = photon::now;
+    }
+    ~ScopeStage() {
+        if (t) {
+            t->stage_us[stage] += photon::now - start;
+            t->stage_calls[stage]++;
+        }
+    }
+};
+
+// a file whose reads are accounted to `stage`
+class TracedFile : public photon::fs::ForwardFile_Ownership {
+public:
+    int stage;
+
+    TracedFile(photon::fs::IFile *file, int stage)
+        : photon::fs::ForwardFile_Ownership(file, true), stage(stage) {}
+
+    virtual ssize_t pread(void *buf, size_t cnt, off_t offset) override {
+        ScopeStage _s(stage);
+        return m_file->pread(buf, cnt, offset);
+    }
+
+    virtual ssize_t preadv(const struct iovec *iovec, int iovcnt, off_t offset) override {
+        ScopeStage _s(stage);
+        return m_file->preadv(iovec, iovcnt, offset);
+    }
+
+    virtual ssize_t preadv2(const struct iovec *iovec, int iovcnt, off_t offset,
+                            int flags) override {
+        ScopeStage _s(stage);
+        return m_file->preadv2(iovec, iovcnt, offset, flags);
+    }
+};
+
+} // namespace IOTrace
@@ -0,0 +1,140 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <photon/common/estring.h>
+#include <photon/thread/thread.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+
+// Latency histogram in microseconds, with two buckets per power of 2 (upper
+// bounds 1, 2, 3, 4, 6, 8, 12, ... up to ~25s). Counts are sharded by thread
+// so that vcpus recording at the same time rarely share a cache line, and
+// are only summed up when rendered.
+class LatencyHistogram {
+public:
+    static constexpr int OCTAVES = 25;
+    static constexpr int BUCKETS = OCTAVES * 2; // the last one is +Inf
+    static constexpr int SHARDS = 16;
+
+    static uint64_t upper_bound(int i) {
+        // 1, 2, 3, 4, 6, 8, 12, 16, ...
+        if (i == 0)
+            return 1;
+        return (i % 2) ? 1UL << ((i + 1) / 2) : 3UL << (i / 2 - 1);
+    }
+
+    static int bucket_of(uint64_t us) {
+        int lo = 0, hi = BUCKETS - 1;
+        while (lo < hi) {
+            int mid = (lo + hi) / 2;
+            if (us <= upper_bound(mid))
+                hi = mid;
+            else
+                lo = mid + 1;
+        }
+        return lo;
+    }
+
+    void put(uint64_t us) {
+        auto &s = m_shards[shard_index()];
+        s.counts[bucket_of(us)].fetch_add(1, std::memory_order_relaxed);
+        s.sum.fetch_add(us, std::memory_order_relaxed);
+    }
+
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (int i = 0; i < BUCKETS; i++)
+            n += bucket(i);
+        return n;
+    }
+
+    uint64_t sum() const {
+        uint64_t n = 0;
+        for (auto &s : m_shards)
+            n += s.sum.load(std::memory_order_relaxed);
+        return n;
+    }
+
+    // # of samples in the `i`-th bucket, not cumulative
+    uint64_t bucket(int i) const {
+        uint64_t n = 0;
+        for (auto &s : m_shards)
+            n += s.counts[i].load(std::memory_order_relaxed);
+        return n;
+    }
+
+    // the upper bound of the bucket holding the `q`-quantile, 0 if empty
+    uint64_t quantile(double q) const {
+        auto total = count();
+        if (total == 0)
+            return 0;
+        uint64_t target = std::max<uint64_t>(1, (uint64_t)(q * total + 0.5)), acc = 0;
+        for (int i = 0; i < BUCKETS; i++) {
+            acc += bucket(i);
+            if (acc >= target)
+                return upper_bound(i);
+        }
+        return upper_bound(BUCKETS - 1);
+    }
+
+    // renders in Prometheus histogram format; `labels` are put before `le`,
+    // e.g. `type="pread"`
+    std::string render(const char *name, const std::string &labels) const {
+        std::string out;
+        auto prefix = labels.empty() ? std::string("{") : "{" + labels + ",";
+        uint64_t acc = 0;
+        for (int i = 0; i < BUCKETS - 1; i++) {
+            acc += bucket(i);
+            out.append(estring().appends(name, "_bucket", prefix, "le=\"", upper_bound(i),
+                                         "\"} ", acc, "\n"));
+        }
+        acc += bucket(BUCKETS - 1);
+        out.append(estring().appends(name, "_bucket", prefix, "le=\"+Inf\"} ", acc, "\n"));
+        auto plain = labels.empty() ? std::string() : "{" + labels + "}";
+        out.append(estring().appends(name, "_sum", plain, " ", sum(), "\n"));
+        out.append(estring().appends(name, "_count", plain, " ", acc, "\n"));
+        return out;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counts[BUCKETS] = {};
+        std::atomic<uint64_t> sum{0};
+    };
+    Shard m_shards[SHARDS];
+
+    static int shard_index() {
+        static thread_local int idx =
+            std::hash<std::thread::id>()(std::this_thread::get_id()) % SHARDS;
+        return idx;
+    }
+};
+
+// records the time from construction to destruction, in photon::now
+struct ScopeLatencyHistogram {
+    LatencyHistogram *h;
+    uint64_t start;
+    explicit ScopeLatencyHistogram(LatencyHistogram *h) : h(h), start(photon::now) {}
+    ~ScopeLatencyHistogram() {
+        if (h)
+            h->put(photon::now - start);
+    }
+};
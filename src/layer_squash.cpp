@@ -0,0 +1,107 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "layer_squash.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/utility.h>
+#include <photon/fs/forwardfs.h>
+#include <photon/fs/localfs.h>
+#include "overlaybd/lsmt/file.h"
+
+namespace {
+
+// the merge writes the flattened layer sequentially, stopping it at a write
+class StoppableFile : public photon::fs::ForwardFile_Ownership {
+public:
+    const int &m_status;
+
+    StoppableFile(photon::fs::IFile *file, const int &status)
+        : ForwardFile_Ownership(file, true), m_status(status) {
+    }
+
+    ssize_t write(const void *buf, size_t count) override {
+        if (m_status == -1)
+            LOG_ERROR_RETURN(ECANCELED, -1, "squash stopped");
+        return m_file->write(buf, count);
+    }
+};
+
+} // namespace
+
+std::string LayerSquash::chain_key(std::vector<ImageConfigNS::LayerConfig> &lowers) {
+    std::string chain;
+    for (auto &layer : lowers) {
+        if (layer.digest().empty() || !layer.file().empty() || !layer.targetFile().empty() ||
+            !layer.targetDigest().empty() || !layer.gzipIndex().empty())
+            return {};
+        chain.append(layer.digest()).append("\n");
+    }
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)chain.data(), chain.size(), sha);
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        snprintf(hex + i * 2, 3, "%02x", sha[i]);
+    return hex;
+}
+
+std::string LayerSquash::lookup(const std::string &key) const {
+    auto p = path(key);
+    return ::access(p.c_str(), F_OK) == 0 ? p : std::string();
+}
+
+bool LayerSquash::opened(const std::string &key) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (m_running.count(key))
+        return false;
+    if (++m_opens[key] < m_min_opens)
+        return false;
+    m_opens.erase(key);
+    m_running.insert(key);
+    return true;
+}
+
+int LayerSquash::squash(const std::string &key, const std::vector<photon::fs::IFile *> &files,
+                        const int &status) {
+    DEFER(cancel(key));
+    auto p = path(key);
+    // renamed when complete, so that lookup() never finds a partial one
+    auto tmp = p + ".tmp";
+    auto file = photon::fs::open_localfile_adaptor(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file == nullptr)
+        LOG_ERRNO_RETURN(0, -1, "failed to create flattened layer `", tmp);
+    auto start = photon::now;
+    LOG_INFO("squash ` layers into `", files.size(), p);
+    int ret;
+    {
+        StoppableFile out(file, status);
+        LSMT::CommitArgs args(&out);
+        ret = LSMT::merge_files_ro((photon::fs::IFile **)files.data(), files.size(), args);
+        if (ret == 0)
+            ret = out.fdatasync();
+    }
+    if (ret != 0 || ::rename(tmp.c_str(), p.c_str()) != 0) {
+        auto eno = errno;
+        ::unlink(tmp.c_str());
+        LOG_ERROR_RETURN(eno, -1, "failed to squash ` layers into `", files.size(), p);
+    }
+    LOG_INFO("squashed ` layers into ` in ` ms", files.size(), p, (photon::now - start) / 1000);
+    return 0;
+}
@@ -0,0 +1,76 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+#include <photon/fs/filesystem.h>
+#include "config.h"
+
+// Flattens the lower layers of deep images into a single local layer by
+// LSMT::merge_files_ro(), once a chain of layers has been opened often
+// enough, so that the later opens of it load one index and read one file.
+// The flattened layers are named by the digests of their chains, see
+// squashConfig.
+class LayerSquash {
+public:
+    LayerSquash(const std::string &dir, uint32_t min_layers, uint32_t min_opens)
+        : m_dir(dir), m_min_layers(min_layers), m_min_opens(min_opens) {
+    }
+
+    // the key of a chain, bottom first, empty if it is not squashed: shorter
+    // than minLayers, or with a local layer or a layer of turboOCI
+    std::string key(std::vector<ImageConfigNS::LayerConfig> &lowers) const {
+        return lowers.size() < m_min_layers ? std::string() : chain_key(lowers);
+    }
+
+    // same as key(), of a chain of any length
+    static std::string chain_key(std::vector<ImageConfigNS::LayerConfig> &lowers);
+
+    // the flattened layer of `key`, empty if not there
+    std::string lookup(const std::string &key) const;
+
+    // counts an open of the chain of `key` as is, true if the caller is to
+    // squash it now, and then to call squash()
+    bool opened(const std::string &key);
+
+    // merges the layers of `key`, bottom first, into its flattened layer,
+    // stopped when `status` turns -1, as that of an ImageFile closing
+    int squash(const std::string &key, const std::vector<photon::fs::IFile *> &files,
+               const int &status);
+
+    // gives up squashing `key` after opened(), to be counted again
+    void cancel(const std::string &key) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_running.erase(key);
+    }
+
+private:
+    std::string m_dir;
+    uint32_t m_min_layers, m_min_opens;
+    std::mutex m_mtx;
+    std::map<std::string, uint32_t> m_opens;
+    std::set<std::string> m_running;
+
+    std::string path(const std::string &key) const {
+        return m_dir + "/" + key + ".lsmt";
+    }
+};
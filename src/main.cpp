@@ -15,7 +15,9 @@
 */
 #include "image_file.h"
 #include "image_service.h"
+#include "io_trace.h"
 #include <photon/common/alog.h>
+#include <photon/common/estring.h>
 #include <photon/common/event-loop.h>
 #include <photon/fs/filesystem.h>
 #include <photon/net/curl.h>
@@ -24,27 +26,53 @@
 #include <photon/photon.h>
 #include <photon/thread/thread.h>
 #include <photon/thread/thread-pool.h>
+#include <photon/thread/thread11.h>
+#include <photon/thread/workerpool.h>
 
 #include <libtcmu.h>
 #include <libtcmu_common.h>
 #include <scsi.h>
 #include <scsi_defs.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <scsi/scsi.h>
 #include <sys/resource.h>
 #include <sys/prctl.h>
+#include <endian.h>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <tuple>
+#include <thread>
+#include <vector>
 
 class TCMUDevLoop;
 
 #define MAX_OPEN_FD 1048576
 
+// cache media may be accessed by io_uring, see cacheConfig.ioEngine
+static uint64_t event_engine_extra = 0;
+
 struct obd_dev {
     ImageFile *file;
     TCMUDevLoop *loop;
     uint32_t aio_pending_wakeups;
     uint32_t inflight;
-    std::thread *work;
-    photon::semaphore start, end;
+    // with enableThread, the vcpu of the pool the device runs on, and the
+    // commands received, and those at the last rebalance
+    size_t vcpu = 0;
+    std::atomic<uint64_t> cmds{0};
+    uint64_t last_cmds = 0;
+    // of the loop, kept here for the metrics, as the loop is replaced when
+    // the device moves to another vcpu
+    std::atomic<uint32_t> inflight_limit{0};
+    struct tcmu_device *dev;
 };
 
 struct handle_args {
@@ -118,16 +146,143 @@ again:
     goto again;
 }
 
+// call tcmulib_processing_complete(dev) if needed
+static void processing_complete(obd_dev *odev, struct tcmu_device *dev) {
+    ++odev->aio_pending_wakeups;
+    int wake_up = (odev->aio_pending_wakeups == 1) ? 1 : 0;
+    while (wake_up) {
+        tcmulib_processing_complete(dev);
+        photon::thread_yield();
+
+        if (odev->aio_pending_wakeups > 1) {
+            odev->aio_pending_wakeups = 1;
+            wake_up = 1;
+        } else {
+            odev->aio_pending_wakeups = 0;
+            wake_up = 0;
+        }
+    }
+}
+
+// unmap limits advertised in the block limits VPD page; LSMTFile splits
+// larger punch-holes into segments itself, these only bound a single command
+#define MAX_UNMAP_BYTES (64UL << 20)
+#define MAX_UNMAP_DESCRIPTORS 256
+
+// libtcmu fills the logical block provisioning and block limits pages, but
+// leaves the unmap fields empty unless the handler sets them, so the kernel
+// would not expose discard to the guest. Patch them in after emulation.
+static int emulate_inquiry(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
+    int ret = tcmu_emulate_inquiry(dev, NULL, cmd->cdb, cmd->iovec, cmd->iov_cnt);
+    if (ret != TCMU_STS_OK || !(cmd->cdb[1] & 0x01))
+        return ret;
+
+    uint8_t page[64] = {0};
+    uint32_t block_size = tcmu_dev_get_block_size(dev);
+    if (cmd->cdb[2] == 0xb0) {
+        size_t len = tcmu_memcpy_from_iovec(page, sizeof(page), cmd->iovec, cmd->iov_cnt);
+        if (len < 36)
+            return ret;
+        uint32_t v = htobe32(MAX_UNMAP_BYTES / block_size);
+        memcpy(page + 20, &v, 4); // MAXIMUM UNMAP LBA COUNT
+        v = htobe32(MAX_UNMAP_DESCRIPTORS);
+        memcpy(page + 24, &v, 4); // MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT
+        v = htobe32(1);
+        memcpy(page + 28, &v, 4); // OPTIMAL UNMAP GRANULARITY
+        if (len >= 44) {
+            uint64_t w = htobe64(MAX_UNMAP_BYTES / block_size);
+            memcpy(page + 36, &w, 8); // MAXIMUM WRITE SAME LENGTH
+        }
+        tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt, page, len);
+    } else if (cmd->cdb[2] == 0xb2) {
+        size_t len = tcmu_memcpy_from_iovec(page, sizeof(page), cmd->iovec, cmd->iov_cnt);
+        if (len < 8)
+            return ret;
+        page[5] |= 0xe0; // LBPU | LBPWS | LBPWS10
+        page[6] = (page[6] & ~0x07) | 0x02; // thin provisioned
+        tcmu_memcpy_into_iovec(cmd->iovec, cmd->iov_cnt, page, len);
+    }
+    return ret;
+}
+
+// UNMAP parameter list: an 8 byte header followed by 16 byte block
+// descriptors of (8 byte LBA, 4 byte block count), all big-endian.
+// Every range becomes a punch-hole, which LSMTFile records as a zeroed
+// segment in the RW index.
+static int handle_unmap(struct tcmu_device *dev, struct tcmulib_cmd *cmd, ImageFile *file) {
+    if (file->read_only)
+        return TCMU_STS_WR_ERR_INCOMPAT_FRMT;
+    uint16_t param_len = ((uint16_t)cmd->cdb[7] << 8) | cmd->cdb[8];
+    if (param_len == 0)
+        return TCMU_STS_OK;
+    if (param_len < 8)
+        return TCMU_STS_INVALID_PARAM_LIST_LEN;
+
+    std::vector<uint8_t> param(param_len);
+    if (tcmu_memcpy_from_iovec(param.data(), param_len, cmd->iovec, cmd->iov_cnt) != param_len)
+        return TCMU_STS_INVALID_PARAM_LIST_LEN;
+    uint16_t desc_len = ((uint16_t)param[2] << 8) | param[3];
+    if (desc_len > param_len - 8)
+        return TCMU_STS_INVALID_PARAM_LIST_LEN;
+    if (desc_len / 16 > MAX_UNMAP_DESCRIPTORS)
+        return TCMU_STS_INVALID_PARAM_LIST;
+
+    uint64_t num_lbas = tcmu_dev_get_num_lbas(dev);
+    for (uint16_t i = 0; i + 16 <= desc_len; i += 16) {
+        uint64_t lba;
+        uint32_t nlbas;
+        memcpy(&lba, &param[8 + i], 8);
+        memcpy(&nlbas, &param[8 + i + 8], 4);
+        lba = be64toh(lba);
+        nlbas = be32toh(nlbas);
+        if (nlbas == 0)
+            continue;
+        if (lba >= num_lbas || nlbas > num_lbas - lba)
+            return TCMU_STS_RANGE;
+        if (file->fallocate(3, tcmu_lba_to_byte(dev, lba), tcmu_lba_to_byte(dev, nlbas)) != 0) {
+            LOG_ERROR("unmap failed, lba: `, count: `", lba, nlbas);
+            return TCMU_STS_WR_ERR;
+        }
+    }
+    return TCMU_STS_OK;
+}
+
+static bool is_read_cmd(uint8_t op) {
+    return op == READ_6 || op == READ_10 || op == READ_12 || op == READ_16;
+}
+
+static bool is_write_cmd(uint8_t op) {
+    return op == WRITE_6 || op == WRITE_10 || op == WRITE_12 || op == WRITE_16;
+}
+
+static LatencyHistogram *cmd_histogram(uint8_t op) {
+    if (!imgservice->metrics)
+        return nullptr;
+    if (is_read_cmd(op))
+        return &imgservice->metrics->tcmu_read;
+    if (is_write_cmd(op))
+        return &imgservice->metrics->tcmu_write;
+    return nullptr;
+}
+
+// WRITE(6) has no FUA bit, the others carry it in bit 3 of byte 1
+static bool is_fua(struct tcmulib_cmd *cmd) {
+    return cmd->cdb[0] != WRITE_6 && (cmd->cdb[1] & 0x08);
+}
+
 void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
     obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
     ImageFile *file = odev->file;
     size_t ret = -1;
     size_t length;
+    auto op = cmd->cdb[0];
+    auto start = photon::now;
+    IOTrace::Trace *trace = nullptr;
 
     switch (cmd->cdb[0]) {
     case INQUIRY:
         photon::thread_yield();
-        ret = tcmu_emulate_inquiry(dev, NULL, cmd->cdb, cmd->iovec, cmd->iov_cnt);
+        ret = emulate_inquiry(dev, cmd);
         tcmulib_command_complete(dev, cmd, ret);
         break;
 
@@ -166,6 +321,7 @@ void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
     case READ_12:
     case READ_16:
         length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+        trace = IOTrace::begin("read", tcmu_cdb_to_byte(dev, cmd->cdb), length);
         ret = sure({file, &ImageFile::preadv}, cmd->iovec, cmd->iov_cnt,
                    tcmu_cdb_to_byte(dev, cmd->cdb));
         if (ret == length) {
@@ -180,7 +336,12 @@ void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
     case WRITE_12:
     case WRITE_16:
         length = tcmu_iovec_length(cmd->iovec, cmd->iov_cnt);
+        trace = IOTrace::begin("write", tcmu_cdb_to_byte(dev, cmd->cdb), length);
         ret = file->pwritev(cmd->iovec, cmd->iov_cnt, tcmu_cdb_to_byte(dev, cmd->cdb));
+        // with write cache, FUA writes must be durable before completion
+        if (ret == length && file->write_cache && is_fua(cmd) && file->fdatasync() != 0) {
+            ret = -1;
+        }
         if (ret == length) {
             tcmulib_command_complete(dev, cmd, TCMU_STS_OK);
         } else {
@@ -218,6 +379,11 @@ void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
         }
         break;
 
+    case UNMAP:
+        ret = handle_unmap(dev, cmd, file);
+        tcmulib_command_complete(dev, cmd, ret);
+        break;
+
     case MAINTENANCE_IN:
     case MAINTENANCE_OUT:
         tcmulib_command_complete(dev, cmd, TCMU_STS_NOT_HANDLED);
@@ -229,22 +395,10 @@ void cmd_handler(struct tcmu_device *dev, struct tcmulib_cmd *cmd) {
         break;
     }
 
-    // call tcmulib_processing_complete(dev) if needed
-    ++odev->aio_pending_wakeups;
-    int wake_up = (odev->aio_pending_wakeups == 1) ? 1 : 0;
-    while (wake_up) {
-        tcmulib_processing_complete(dev);
-        photon::thread_yield();
-
-        if (odev->aio_pending_wakeups > 1) {
-            odev->aio_pending_wakeups = 1;
-            wake_up = 1;
-        } else {
-            odev->aio_pending_wakeups = 0;
-            wake_up = 0;
-        }
-    }
-
+    IOTrace::end(trace, ret);
+    if (auto h = cmd_histogram(op))
+        h->put(photon::now - start);
+    processing_complete(odev, dev);
     odev->inflight--;
 }
 
@@ -255,12 +409,100 @@ void *handle(void *args) {
     return nullptr;
 }
 
+// reads or writes of adjacent LBAs, done by a single preadv or pwritev
+struct cmd_group {
+    struct tcmu_device *dev;
+    bool write;
+    off_t offset;
+    size_t length;
+    std::vector<struct tcmulib_cmd *> cmds;
+};
+
+// merged commands are limited in bytes, and in # of iovecs
+static constexpr size_t MAX_GROUP_BYTES = 1024UL * 1024;
+static constexpr size_t MAX_GROUP_IOVS = 256;
+
+void *handle_group(void *args) {
+    auto g = (cmd_group *)args;
+    auto dev = g->dev;
+    obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
+    ImageFile *file = odev->file;
+    auto start = photon::now;
+    std::vector<struct iovec> iov;
+    for (auto cmd : g->cmds)
+        iov.insert(iov.end(), cmd->iovec, cmd->iovec + cmd->iov_cnt);
+
+    int status = TCMU_STS_OK;
+    auto trace = IOTrace::begin(g->write ? "write" : "read", g->offset, g->length);
+    ssize_t ret;
+    if (g->write) {
+        ret = file->pwritev(iov.data(), iov.size(), g->offset);
+        if (ret == (ssize_t)g->length && file->write_cache &&
+            std::any_of(g->cmds.begin(), g->cmds.end(), is_fua) && file->fdatasync() != 0)
+            ret = -1;
+        if (ret != (ssize_t)g->length)
+            status = (errno == EROFS) ? TCMU_STS_WR_ERR_INCOMPAT_FRMT : TCMU_STS_WR_ERR;
+    } else {
+        ret = sure({file, &ImageFile::preadv}, iov.data(), iov.size(), g->offset);
+        if (ret != (ssize_t)g->length)
+            status = TCMU_STS_RD_ERR;
+    }
+    IOTrace::end(trace, ret);
+    for (auto cmd : g->cmds)
+        tcmulib_command_complete(dev, cmd, status);
+    if (auto h = cmd_histogram(g->write ? WRITE_10 : READ_10)) {
+        for (size_t i = 0; i < g->cmds.size(); i++)
+            h->put(photon::now - start);
+    }
+    processing_complete(odev, dev);
+    odev->inflight -= g->cmds.size();
+    delete g;
+    return nullptr;
+}
+
 class TCMUDevLoop {
 protected:
     struct tcmu_device *dev;
     EventLoop *loop;
     int fd;
-    photon::ThreadPool<32> threadpool;
+    photon::ThreadPoolBase *threadpool;
+    // commands are run by at most `max_workers` threads, the rest wait in
+    // `pending` for a worker to finish its command
+    uint32_t max_workers;
+    uint32_t workers = 0;
+    std::deque<std::pair<void *(*)(void *), void *>> pending;
+
+    struct task {
+        TCMUDevLoop *loop;
+        void *(*fn)(void *);
+        void *arg;
+    };
+
+    static void *run_tasks(void *args) {
+        auto t = (task *)args;
+        auto loop = t->loop;
+        auto fn = t->fn;
+        auto arg = t->arg;
+        delete t;
+        while (true) {
+            fn(arg);
+            if (loop->pending.empty())
+                break;
+            std::tie(fn, arg) = loop->pending.front();
+            loop->pending.pop_front();
+        }
+        loop->workers--;
+        return nullptr;
+    }
+
+    void submit(void *(*fn)(void *), void *arg) {
+        if (workers >= max_workers) {
+            pending.emplace_back(fn, arg);
+            return;
+        }
+        workers++;
+        threadpool->thread_create(&run_tasks, new task{this, fn, arg});
+    }
 
     int wait_for_readable(EventLoop *) {
         auto ret = photon::wait_for_fd_readable(fd);
@@ -277,30 +519,314 @@ protected:
         struct tcmulib_cmd *cmd;
         obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
         tcmulib_processing_start(dev);
+        std::vector<std::pair<off_t, struct tcmulib_cmd *>> reads, writes;
         while ((cmd = tcmulib_get_next_command(dev, 0)) != NULL) {
             odev->inflight++;
-            threadpool.thread_create(&handle, new handle_args{dev, cmd});
+            odev->cmds.fetch_add(1, std::memory_order_relaxed);
+            if (batch && is_read_cmd(cmd->cdb[0])) {
+                reads.emplace_back(tcmu_cdb_to_byte(dev, cmd->cdb), cmd);
+            } else if (batch && is_write_cmd(cmd->cdb[0])) {
+                writes.emplace_back(tcmu_cdb_to_byte(dev, cmd->cdb), cmd);
+            } else {
+                submit(&handle, new handle_args{dev, cmd});
+            }
         }
+        submit_groups(reads, false);
+        submit_groups(writes, true);
         return 0;
     }
 
+    // sorts the commands drained from the ring by offset, and merges those
+    // of adjacent ranges into groups. writes are merged only if none of them
+    // overlap, which keeps the order of overlapping ones up to the kernel.
+    void submit_groups(std::vector<std::pair<off_t, struct tcmulib_cmd *>> &cmds, bool write) {
+        if (cmds.empty())
+            return;
+        auto by_offset = cmds;
+        std::stable_sort(by_offset.begin(), by_offset.end(),
+                         [](const std::pair<off_t, struct tcmulib_cmd *> &a,
+                            const std::pair<off_t, struct tcmulib_cmd *> &b) {
+                             return a.first < b.first;
+                         });
+        bool merge = true;
+        if (write) {
+            for (size_t i = 1; i < by_offset.size() && merge; i++) {
+                auto &prev = by_offset[i - 1];
+                auto len = tcmu_iovec_length(prev.second->iovec, prev.second->iov_cnt);
+                merge = prev.first + (off_t)len <= by_offset[i].first;
+            }
+        }
+        if (merge)
+            cmds.swap(by_offset);
+
+        cmd_group *g = nullptr;
+        size_t iovs = 0;
+        for (auto &x : cmds) {
+            auto len = tcmu_iovec_length(x.second->iovec, x.second->iov_cnt);
+            if (g && merge && g->offset + (off_t)g->length == x.first &&
+                g->length + len <= MAX_GROUP_BYTES &&
+                iovs + x.second->iov_cnt <= MAX_GROUP_IOVS) {
+                g->length += len;
+                iovs += x.second->iov_cnt;
+                g->cmds.push_back(x.second);
+                continue;
+            }
+            if (g)
+                submit(&handle_group, g);
+            g = new cmd_group{dev, write, x.first, len, {x.second}};
+            iovs = x.second->iov_cnt;
+        }
+        submit(&handle_group, g);
+    }
+
 public:
+    // with `batch`, reads and writes of adjacent ranges in the ring are merged
+    bool batch = false;
+
     explicit TCMUDevLoop(struct tcmu_device *dev)
         : dev(dev), loop(new_event_loop({this, &TCMUDevLoop::wait_for_readable},
                                         {this, &TCMUDevLoop::on_accept})) {
         fd = tcmu_dev_get_fd(dev);
+        // as many as the kernel may queue to the device, if not configured
+        max_workers = imgservice->global_conf.deviceMaxInflight();
+        if (max_workers == 0) {
+            auto depth = tcmu_cfgfs_dev_get_attr_int(dev, "hw_queue_depth");
+            max_workers = depth > 0 ? depth : DEFAULT_MAX_WORKERS;
+        }
+        threadpool = photon::new_thread_pool(std::min(max_workers, MAX_IDLE_WORKERS));
+        ((obd_dev *)tcmu_dev_get_private(dev))->inflight_limit = max_workers;
+        LOG_INFO("device takes ` commands at most at a time", max_workers);
     }
 
     ~TCMUDevLoop() {
-        loop->stop();
+        stop();
         delete loop;
+        photon::delete_thread_pool(threadpool);
     }
 
     void run() {
         loop->async_run();
     }
+
+    // stops taking commands, and waits for those running
+    void stop() {
+        if (stopped)
+            return;
+        stopped = true;
+        loop->stop();
+        obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
+        while (odev->inflight > 0)
+            photon::thread_usleep(1000);
+    }
+
+private:
+    static constexpr uint32_t DEFAULT_MAX_WORKERS = 128;
+    // worker threads kept for later commands when idle
+    static constexpr uint32_t MAX_IDLE_WORKERS = 16;
+    bool stopped = false;
+};
+
+// the ids in a list file of sysfs, e.g. "0-15,32-47"
+static std::vector<long> read_id_list(const std::string &path) {
+    std::vector<long> ids;
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp)
+        return ids;
+    char buf[4096] = {0};
+    auto n = fread(buf, 1, sizeof(buf) - 1, fp);
+    fclose(fp);
+    buf[n] = 0;
+    for (char *p = buf; *p && *p != '\n';) {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (end == p)
+            break;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (long id = lo; id <= hi && id < CPU_SETSIZE; id++)
+            ids.push_back(id);
+        p = (*end == ',') ? end + 1 : end;
+    }
+    return ids;
+}
+
+// the cpus of each online NUMA node, whose ids may be sparse
+static std::vector<cpu_set_t> numa_node_cpus() {
+    std::vector<cpu_set_t> nodes;
+    for (auto node : read_id_list("/sys/devices/system/node/online")) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (auto cpu : read_id_list("/sys/devices/system/node/node" + std::to_string(node) +
+                                     "/cpulist"))
+            CPU_SET(cpu, &set);
+        if (CPU_COUNT(&set) > 0)
+            nodes.push_back(set);
+    }
+    return nodes;
+}
+
+// With enableThread, the devices run on a fixed pool of vcpus, rather than a
+// thread each. A new device goes to the vcpu with the fewest commands lately,
+// and devices are moved off a vcpu much busier than the others.
+class DevVcpuPool {
+public:
+    explicit DevVcpuPool(size_t n, bool numa_aware = false)
+        : m_pool(n, photon::INIT_EVENT_EPOLL | event_engine_extra, photon::INIT_IO_LIBCURL, -1),
+          m_devs(n) {
+        LOG_INFO("run devices on ` vcpus", n);
+        if (numa_aware)
+            bind_numa_nodes();
+        m_rebalancer = photon::thread_create11([this]() {
+            while (!m_stopped) {
+                photon::thread_usleep(REBALANCE_INTERVAL);
+                if (!m_stopped)
+                    rebalance();
+            }
+        });
+        m_rebalancer_jh = photon::thread_enable_join(m_rebalancer);
+    }
+
+    ~DevVcpuPool() {
+        m_stopped = true;
+        photon::thread_interrupt(m_rebalancer);
+        photon::thread_join(m_rebalancer_jh);
+    }
+
+    void add(obd_dev *odev) {
+        photon::scoped_lock lock(m_mtx);
+        size_t target = 0;
+        auto load = sample_load(false);
+        for (size_t i = 1; i < m_devs.size(); i++) {
+            if (std::make_pair(load[i], m_devs[i].size()) <
+                std::make_pair(load[target], m_devs[target].size()))
+                target = i;
+        }
+        start_on(odev, target);
+    }
+
+    void remove(obd_dev *odev) {
+        photon::scoped_lock lock(m_mtx);
+        stop_on(odev);
+    }
+
+private:
+    static constexpr uint64_t REBALANCE_INTERVAL = 10UL * 1000 * 1000;
+    // a vcpu is rebalanced if it took this many more commands than the idlest
+    static constexpr uint64_t REBALANCE_MIN_CMDS = 1000;
+
+    photon::WorkPool m_pool;
+    std::vector<std::vector<obd_dev *>> m_devs;
+    photon::mutex m_mtx;
+    photon::thread *m_rebalancer = nullptr;
+    photon::join_handle *m_rebalancer_jh = nullptr;
+    bool m_stopped = false;
+
+    // pins the vcpus to NUMA nodes in turn. memory is placed on first
+    // touch, so the loops, the IO buffers and cache entries a device
+    // allocates on its vcpu stay on that node.
+    void bind_numa_nodes() {
+        auto nodes = numa_node_cpus();
+        if (nodes.size() < 2) {
+            LOG_INFO("` NUMA node(s) found, vcpus are not pinned", nodes.size());
+            return;
+        }
+        for (size_t i = 0; i < m_devs.size(); i++) {
+            auto &set = nodes[i % nodes.size()];
+            int ret = 0;
+            call_on(i, [&]() {
+                ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            });
+            if (ret != 0)
+                LOG_ERROR("pin vcpu ` to NUMA node ` failed, ret: `", i, i % nodes.size(), ret);
+        }
+        LOG_INFO("vcpus pinned to ` NUMA nodes", nodes.size());
+    }
+
+    // runs `f` on the `i`-th vcpu of the pool, and waits for it
+    template <typename F>
+    void call_on(size_t i, F f) {
+        photon::semaphore done;
+        auto th = photon::thread_create11([&]() {
+            f();
+            done.signal(1);
+        });
+        m_pool.thread_migrate(th, i);
+        done.wait(1);
+    }
+
+    void start_on(obd_dev *odev, size_t i) {
+        call_on(i, [&]() {
+            odev->loop = new TCMUDevLoop(odev->dev);
+            odev->loop->batch = imgservice->global_conf.batchCommands();
+            odev->loop->run();
+        });
+        odev->vcpu = i;
+        m_devs[i].push_back(odev);
+    }
+
+    void stop_on(obd_dev *odev) {
+        call_on(odev->vcpu, [&]() {
+            delete odev->loop;
+            odev->loop = nullptr;
+        });
+        auto &devs = m_devs[odev->vcpu];
+        auto it = std::find(devs.begin(), devs.end(), odev);
+        if (it != devs.end())
+            devs.erase(it);
+    }
+
+    // the commands of each vcpu since the last rebalance
+    std::vector<uint64_t> sample_load(bool reset) {
+        std::vector<uint64_t> load(m_devs.size(), 0);
+        for (size_t i = 0; i < m_devs.size(); i++) {
+            for (auto odev : m_devs[i]) {
+                auto cmds = odev->cmds.load(std::memory_order_relaxed);
+                load[i] += cmds - odev->last_cmds;
+                if (reset)
+                    odev->last_cmds = cmds;
+            }
+        }
+        return load;
+    }
+
+    // moves a device from the busiest vcpu to the idlest, the busiest one
+    // that narrows the gap
+    void rebalance() {
+        photon::scoped_lock lock(m_mtx);
+        std::vector<uint64_t> delta;
+        for (auto &devs : m_devs) {
+            for (auto odev : devs)
+                delta.push_back(odev->cmds.load(std::memory_order_relaxed) - odev->last_cmds);
+        }
+        auto load = sample_load(true);
+        auto busiest = std::max_element(load.begin(), load.end()) - load.begin();
+        auto idlest = std::min_element(load.begin(), load.end()) - load.begin();
+        auto gap = load[busiest] - load[idlest];
+        if (gap < REBALANCE_MIN_CMDS || m_devs[busiest].size() < 2)
+            return;
+        obd_dev *victim = nullptr;
+        uint64_t victim_cmds = 0;
+        size_t k = 0;
+        for (size_t i = 0; i < m_devs.size(); i++) {
+            for (auto odev : m_devs[i]) {
+                auto cmds = delta[k++];
+                if ((int)i == busiest && cmds > 0 && cmds < gap && cmds > victim_cmds) {
+                    victim = odev;
+                    victim_cmds = cmds;
+                }
+            }
+        }
+        if (victim == nullptr)
+            return;
+        LOG_INFO("move device from vcpu ` to `, commands: ` of ` vs `", busiest, idlest,
+                 victim_cmds, load[busiest], load[idlest]);
+        stop_on(victim);
+        start_on(victim, idlest);
+    }
 };
 
+DevVcpuPool *dev_pool = nullptr;
+
 static char *tcmu_get_path(struct tcmu_device *dev) {
     char *config = strchr(tcmu_dev_get_cfgstring(dev), '/');
     if (!config) {
@@ -312,6 +838,113 @@ static char *tcmu_get_path(struct tcmu_device *dev) {
     return config;
 }
 
+// the devices opened, whose commands in flight are exported
+std::mutex devs_mtx;
+std::set<obd_dev *> devs;
+
+static std::string device_metrics() {
+    std::lock_guard<std::mutex> lock(devs_mtx);
+    if (devs.empty())
+        return "";
+    std::string inflight, limit, memory;
+    for (auto odev : devs) {
+        auto path = tcmu_get_path(odev->dev);
+        auto label = estring().appends("{device=\"", path ? path : "", "\"} ");
+        auto usage = odev->file->memory_usage();
+        memory.append(estring().appends("OverlayBD_Device_Memory_Bytes{device=\"", path ? path : "",
+                                        "\",kind=\"index\"} ", std::to_string(usage.index), "\n"));
+        memory.append(estring().appends("OverlayBD_Device_Memory_Bytes{device=\"", path ? path : "",
+                                        "\",kind=\"prefetch\"} ", std::to_string(usage.prefetch),
+                                        "\n"));
+        inflight.append(estring().appends("OverlayBD_Device_Inflight", label,
+                                          std::to_string(odev->inflight), "\n"));
+        if (odev->inflight_limit)
+            limit.append(estring().appends("OverlayBD_Device_Inflight_Limit", label,
+                                           std::to_string(odev->inflight_limit.load()), "\n"));
+    }
+    return "# HELP OverlayBD_Device_Inflight commands in flight, by device\n"
+           "# TYPE OverlayBD_Device_Inflight gauge\n" +
+           inflight +
+           "# HELP OverlayBD_Device_Inflight_Limit commands run at once at most, by device\n"
+           "# TYPE OverlayBD_Device_Inflight_Limit gauge\n" +
+           limit +
+           "# HELP OverlayBD_Device_Memory_Bytes memory held by the image, by device and kind\n"
+           "# TYPE OverlayBD_Device_Memory_Bytes gauge\n" +
+           memory;
+}
+
+// TCMU devices outlive the daemon, and are added back one by one when it
+// restarts. With handoffPath, the configs of the devices open at shutdown
+// are saved, and the next start opens them all in parallel beforehand, so
+// that dev_open only adopts them.
+std::map<std::string, ImageFile *> preopened;
+
+static void save_handoff(const std::string &path) {
+    std::string content;
+    {
+        std::lock_guard<std::mutex> lock(devs_mtx);
+        for (auto odev : devs) {
+            auto config = tcmu_get_path(odev->dev);
+            if (config)
+                content.append(config).append("\n");
+        }
+    }
+    auto tmp = path + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "w");
+    if (!fp) {
+        LOG_ERRNO_RETURN(0, , "open hand-off file ` failed", tmp);
+    }
+    bool ok = fwrite(content.data(), 1, content.size(), fp) == content.size();
+    ok = (fclose(fp) == 0) && ok;
+    if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        unlink(tmp.c_str());
+        LOG_ERRNO_RETURN(0, , "save hand-off file ` failed", path);
+    }
+    LOG_INFO("hand-off file ` saved", path);
+}
+
+static void load_handoff(const std::string &path) {
+    FILE *fp = fopen(path.c_str(), "r");
+    if (!fp)
+        return;
+    std::vector<std::string> configs;
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        std::string config(line);
+        while (!config.empty() && (config.back() == '\n' || config.back() == '\r'))
+            config.pop_back();
+        if (!config.empty())
+            configs.push_back(config);
+    }
+    fclose(fp);
+    // consumed once, a crash in between falls back to opening on demand
+    unlink(path.c_str());
+
+    static constexpr uint32_t HANDOFF_OPEN_CONCURRENCY = 16;
+    auto start = photon::now;
+    photon::semaphore sem(HANDOFF_OPEN_CONCURRENCY);
+    std::vector<photon::join_handle *> jhs;
+    for (auto &config : configs) {
+        if (preopened.count(config))
+            continue;
+        preopened[config] = nullptr;
+        sem.wait(1);
+        auto th = photon::thread_create11([&sem, config]() {
+            auto file = imgservice->create_image_file(config.c_str());
+            if (file)
+                preopened[config] = file;
+            else
+                LOG_ERROR("reopen ` failed, it will be opened when added", config);
+            sem.signal(1);
+        });
+        jhs.push_back(photon::thread_enable_join(th));
+    }
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    LOG_INFO("` images reopened from hand-off file, time cost ` ms", configs.size(),
+             (photon::now - start) / 1000);
+}
+
 static int dev_open(struct tcmu_device *dev) {
     char *config = tcmu_get_path(dev);
     LOG_INFO("dev open `", config);
@@ -322,7 +955,14 @@ static int dev_open(struct tcmu_device *dev) {
     struct timeval start;
     gettimeofday(&start, NULL);
 
-    ImageFile *file = imgservice->create_image_file(config);
+    ImageFile *file = nullptr;
+    auto it = preopened.find(config);
+    if (it != preopened.end()) {
+        file = it->second;
+        preopened.erase(it);
+    }
+    if (file == nullptr)
+        file = imgservice->create_image_file(config);
     if (file == nullptr) {
         LOG_ERROR_RETURN(0, -EPERM, "create image file failed");
     }
@@ -331,33 +971,24 @@ static int dev_open(struct tcmu_device *dev) {
     odev->aio_pending_wakeups = 0;
     odev->inflight = 0;
     odev->file = file;
+    odev->dev = dev;
 
     tcmu_dev_set_private(dev, odev);
+    {
+        std::lock_guard<std::mutex> lock(devs_mtx);
+        devs.insert(odev);
+    }
     tcmu_dev_set_block_size(dev, file->block_size);
     tcmu_dev_set_num_lbas(dev, file->num_lbas);
     tcmu_dev_set_unmap_enabled(dev, true);
-    tcmu_dev_set_write_cache_enabled(dev, false);
+    tcmu_dev_set_write_cache_enabled(dev, file->write_cache);
     tcmu_dev_set_write_protect_enabled(dev, file->read_only);
 
-    if (imgservice->global_conf.enableThread()) {
-        auto obd_th = [](obd_dev *odev, struct tcmu_device *dev) {
-            photon::init(photon::INIT_EVENT_EPOLL, photon::INIT_IO_LIBCURL);
-            DEFER(photon::fini());
-
-            odev->loop = new TCMUDevLoop(dev);
-            odev->loop->run();
-            LOG_INFO("obd device running");
-            odev->start.signal(1);
-
-            odev->end.wait(1);
-            delete odev->loop;
-            LOG_INFO("obd device exit");
-        };
-
-        odev->work = new std::thread(obd_th, odev, dev);
-        odev->start.wait(1);
+    if (dev_pool) {
+        dev_pool->add(odev);
     } else {
         odev->loop = new TCMUDevLoop(dev);
+        odev->loop->batch = imgservice->global_conf.batchCommands();
         odev->loop->run();
     }
 
@@ -372,15 +1003,15 @@ static int dev_open(struct tcmu_device *dev) {
 static int close_cnt = 0;
 static void dev_close(struct tcmu_device *dev) {
     obd_dev *odev = (obd_dev *)tcmu_dev_get_private(dev);
-    if (imgservice->global_conf.enableThread()) {
-        odev->end.signal(1);
-        if (odev->work->joinable()) {
-            odev->work->join();
-        }
-        delete odev->work;
+    if (dev_pool) {
+        dev_pool->remove(odev);
     } else {
         delete odev->loop;
     }
+    {
+        std::lock_guard<std::mutex> lock(devs_mtx);
+        devs.erase(odev);
+    }
     delete odev->file;
     delete odev;
     LOG_INFO("dev closed `", tcmu_get_path(dev));
@@ -404,18 +1035,23 @@ int main(int argc, char **argv) {
     mallopt(M_TRIM_THRESHOLD, 128 * 1024);
     prctl(PR_SET_THP_DISABLE, 1);
 
-    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    const char *config_path = argc > 1 ? argv[1] : nullptr;
+    event_engine_extra = cache_media_event_engine(config_path);
+    photon::init(photon::INIT_EVENT_DEFAULT | event_engine_extra, photon::INIT_IO_DEFAULT);
     photon::block_all_signal();
     photon::sync_signal(SIGTERM, &sigint_handler);
     photon::sync_signal(SIGINT, &sigint_handler);
-    if (argc > 1)
-        imgservice = create_image_service(argv[1]);
-    else
-        imgservice = create_image_service();
+    imgservice = create_image_service(config_path);
     if (imgservice == nullptr) {
         LOG_ERROR("failed to create image service");
         return -1;
     }
+    if (imgservice->metrics) {
+        auto prev = imgservice->metrics->exporter.extra;
+        imgservice->metrics->exporter.extra = [prev]() {
+            return (prev ? prev() : std::string()) + device_metrics();
+        };
+    }
 
     /*
      * Handings for rlimit and netlink are from tcmu-runner main.c
@@ -436,6 +1072,9 @@ int main(int argc, char **argv) {
         }
     }
 
+    if (!imgservice->global_conf.handoffPath().empty())
+        load_handoff(imgservice->global_conf.handoffPath());
+
     /*
      * If this is a restart we need to prevent new nl cmds from being
      * sent to us until we have everything ready.
@@ -466,9 +1105,17 @@ int main(int argc, char **argv) {
     overlaybd_handler.removed = dev_close;
     handlers.push_back(overlaybd_handler);
 
+    // before tcmulib_initialize, which adds the devices existing already
+    if (imgservice->global_conf.enableThread()) {
+        size_t n = imgservice->global_conf.vcpuNum();
+        dev_pool = new DevVcpuPool(n ? n : std::max(1U, std::thread::hardware_concurrency()),
+                                   imgservice->global_conf.numaAware());
+    }
+
     struct tcmulib_context *tcmulib_ctx = tcmulib_initialize(handlers);
     if (!tcmulib_ctx) {
         LOG_ERROR("tcmulib init failed.");
+        delete dev_pool;
         return -1;
     }
 
@@ -477,6 +1124,11 @@ int main(int argc, char **argv) {
         reset_nl_supp = false;
     }
 
+    // the images of devices gone during the restart
+    for (auto &x : preopened)
+        delete x.second;
+    preopened.clear();
+
     main_loop = new TCMULoop(tcmulib_ctx);
     main_loop->run();
 
@@ -484,9 +1136,12 @@ int main(int argc, char **argv) {
         photon::thread_usleep(200 * 1000);
     }
     LOG_INFO("main loop exited");
+    if (!imgservice->global_conf.handoffPath().empty())
+        save_handoff(imgservice->global_conf.handoffPath());
 
     tcmulib_close(tcmulib_ctx);
     LOG_INFO("tcmulib closed");
+    delete dev_pool;
 
     delete imgservice;
     return 0;
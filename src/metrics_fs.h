@@ -17,7 +17,14 @@
 #pragma once
 
 #include <photon/common/metric-meter/metrics.h>
+#include <photon/common/string_view.h>
 #include <photon/fs/forwardfs.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include "io_trace.h"
+#include "latency_histogram.h"
 
 struct MetricMeta {
     Metric::MaxLatencyCounter latency;
@@ -25,6 +32,9 @@ struct MetricMeta {
     Metric::QPSCounter qps;
     Metric::AddCounter total;
     Metric::AddCounter interval;
+    LatencyHistogram histogram;
+    // the stage of sampled requests the reads are accounted to
+    int trace_stage = IOTrace::NONE;
 
     MetricMeta() {}
 };
@@ -47,6 +57,8 @@ public:
     virtual ssize_t pread(void *buf, size_t cnt, off_t offset) override {
         metrics->qps.put();
         SCOPE_LATENCY(metrics->latency);
+        ScopeLatencyHistogram _hist(&metrics->histogram);
+        IOTrace::ScopeStage _trace(metrics->trace_stage);
         auto ret = m_file->pread(buf, cnt, offset);
         mark_metrics(ret);
         return ret;
@@ -56,6 +68,8 @@ public:
                            off_t offset) override {
         metrics->qps.put();
         SCOPE_LATENCY(metrics->latency);
+        ScopeLatencyHistogram _hist(&metrics->histogram);
+        IOTrace::ScopeStage _trace(metrics->trace_stage);
         auto ret = m_file->preadv(iovec, iovcnt, offset);
         mark_metrics(ret);
         return ret;
@@ -65,15 +79,75 @@ public:
                             int flags) override {
         metrics->qps.put();
         SCOPE_LATENCY(metrics->latency);
+        ScopeLatencyHistogram _hist(&metrics->histogram);
+        IOTrace::ScopeStage _trace(metrics->trace_stage);
         auto ret = m_file->preadv2(iovec, iovcnt, offset, flags);
         mark_metrics(ret);
         return ret;
     }
 };
 
+// reads of a layer from one source (cache, remote or p2p), exported with
+// the image and layer as labels. Shared by the files reading it, so that it
+// outlives the image if the cache keeps a file open.
+struct LayerStats {
+    std::string image, layer, source;
+    std::atomic<uint64_t> reads{0}, bytes{0}, errors{0};
+    Metric::MaxLatencyCounter latency;
+
+    LayerStats(std::string image, std::string layer, std::string source)
+        : image(std::move(image)), layer(std::move(layer)), source(std::move(source)) {}
+};
+
+// splits a blob url ".../<repository>/blobs/<digest>" into the labels of
+// LayerStats
+inline void layer_labels(std::string_view url, std::string &image, std::string &layer) {
+    while (!url.empty() && url.front() == '/')
+        url.remove_prefix(1);
+    auto pos = url.rfind('/');
+    layer = std::string(pos == url.npos ? url : url.substr(pos + 1));
+    auto blobs = url.rfind("/blobs");
+    image = std::string(url.substr(0, blobs == url.npos ? pos : blobs));
+}
+
+class LayerMetricFile : public photon::fs::ForwardFile_Ownership {
+public:
+    std::shared_ptr<LayerStats> stats;
+
+    LayerMetricFile(photon::fs::IFile *file, std::shared_ptr<LayerStats> stats)
+        : photon::fs::ForwardFile_Ownership(file, true), stats(std::move(stats)) {}
+
+    __attribute__((always_inline)) ssize_t mark(ssize_t ret) {
+        stats->reads.fetch_add(1, std::memory_order_relaxed);
+        if (ret >= 0)
+            stats->bytes.fetch_add(ret, std::memory_order_relaxed);
+        else
+            stats->errors.fetch_add(1, std::memory_order_relaxed);
+        return ret;
+    }
+
+    virtual ssize_t pread(void *buf, size_t cnt, off_t offset) override {
+        SCOPE_LATENCY(stats->latency);
+        return mark(m_file->pread(buf, cnt, offset));
+    }
+
+    virtual ssize_t preadv(const struct iovec *iovec, int iovcnt, off_t offset) override {
+        SCOPE_LATENCY(stats->latency);
+        return mark(m_file->preadv(iovec, iovcnt, offset));
+    }
+
+    virtual ssize_t preadv2(const struct iovec *iovec, int iovcnt, off_t offset,
+                            int flags) override {
+        SCOPE_LATENCY(stats->latency);
+        return mark(m_file->preadv2(iovec, iovcnt, offset, flags));
+    }
+};
+
 class MetricFS : public photon::fs::ForwardFS_Ownership {
 public:
     MetricMeta *metrics;
+    // the per-layer stats of the files opened, if any
+    std::function<std::shared_ptr<LayerStats>(const char *)> layer_stats_of;
 
     MetricFS(photon::fs::IFileSystem *fs, MetricMeta *metricMeta)
         : photon::fs::ForwardFS_Ownership(fs, true), metrics(metricMeta) {}
@@ -81,13 +155,21 @@ public:
     virtual photon::fs::IFile *open(const char *fn, int flags) override {
         auto file = m_fs->open(fn, flags);
         if (!file) return nullptr;
-        return new MetricFile(file, metrics);
+        return wrap(fn, new MetricFile(file, metrics));
     }
 
     virtual photon::fs::IFile *open(const char *fn, int flags,
                                     mode_t mode) override {
         auto file = m_fs->open(fn, flags, mode);
         if (!file) return nullptr;
-        return new MetricFile(file, metrics);
+        return wrap(fn, new MetricFile(file, metrics));
+    }
+
+private:
+    photon::fs::IFile *wrap(const char *fn, photon::fs::IFile *file) {
+        if (!layer_stats_of)
+            return file;
+        auto stats = layer_stats_of(fn);
+        return stats ? new LayerMetricFile(file, std::move(stats)) : file;
     }
 };
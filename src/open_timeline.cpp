@@ -0,0 +1,120 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "open_timeline.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <unordered_map>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/estring.h>
+
+namespace {
+
+struct Current {
+    OpenTimeline *timeline = nullptr;
+    std::string prefix;
+};
+
+std::mutex g_current_mtx;
+std::unordered_map<photon::thread *, Current> g_current;
+
+} // namespace
+
+void OpenTimeline::add(const std::string &phase, uint64_t begin, uint64_t end) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_phases.push_back({phase, begin, std::max(begin, end)});
+}
+
+void OpenTimeline::set_path(const std::string &path) {
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_path = path;
+}
+
+std::string OpenTimeline::to_json() const {
+    std::vector<Phase> phases;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        phases = m_phases;
+    }
+    std::stable_sort(phases.begin(), phases.end(),
+                     [](const Phase &a, const Phase &b) { return a.begin < b.begin; });
+    uint64_t origin = phases.empty() ? 0 : phases.front().begin;
+    estring json;
+    json.appends("{\"phases\":[");
+    for (size_t i = 0; i < phases.size(); i++) {
+        auto &p = phases[i];
+        json.appends(i ? "," : "", "{\"name\":\"", p.name, "\",\"startUs\":", p.begin - origin,
+                     ",\"us\":", p.end - p.begin, "}");
+    }
+    json.appends("]}\n");
+    return std::move(json);
+}
+
+int OpenTimeline::save() const {
+    std::string path;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        path = m_path;
+    }
+    if (path.empty())
+        return 0;
+    auto json = to_json();
+    // replaced as a whole, so that a reader never sees a partial one
+    auto tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to create open timeline `", tmp);
+    auto n = ::write(fd, json.data(), json.size());
+    ::close(fd);
+    if (n != (ssize_t)json.size() || ::rename(tmp.c_str(), path.c_str()) != 0) {
+        ::unlink(tmp.c_str());
+        LOG_ERRNO_RETURN(0, -1, "failed to write open timeline `", path);
+    }
+    return 0;
+}
+
+OpenTimeline::Scope::Scope(OpenTimeline *timeline, const std::string &prefix) {
+    std::lock_guard<std::mutex> lock(g_current_mtx);
+    auto &cur = g_current[photon::CURRENT];
+    m_prev = cur.timeline;
+    m_prev_prefix = cur.prefix;
+    cur = {timeline, prefix};
+}
+
+OpenTimeline::Scope::~Scope() {
+    std::lock_guard<std::mutex> lock(g_current_mtx);
+    if (m_prev == nullptr) {
+        g_current.erase(photon::CURRENT);
+    } else {
+        g_current[photon::CURRENT] = {m_prev, m_prev_prefix};
+    }
+}
+
+void OpenTimeline::add_current(const std::string &phase, uint64_t begin) {
+    auto end = photon::now;
+    Current cur;
+    {
+        std::lock_guard<std::mutex> lock(g_current_mtx);
+        auto it = g_current.find(photon::CURRENT);
+        if (it == g_current.end())
+            return;
+        cur = it->second;
+    }
+    cur.timeline->add(cur.prefix + phase, begin, end);
+}
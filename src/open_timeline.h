@@ -0,0 +1,69 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <photon/thread/thread.h>
+
+// The cold start of an image phase by phase, from parsing its config and
+// opening each layer to the first read of the guest and the end of prefetch.
+// Saved as JSON to `<resultFile>.timeline`, and rewritten as the phases after
+// the open complete.
+class OpenTimeline {
+public:
+    // `begin` and `end` are photon::now
+    void add(const std::string &phase, uint64_t begin, uint64_t end);
+    void add(const std::string &phase, uint64_t begin) {
+        add(phase, begin, photon::now);
+    }
+
+    // where save() writes, nothing if empty
+    void set_path(const std::string &path);
+
+    // phases by begin, as offsets from the earliest one
+    std::string to_json() const;
+    int save() const;
+
+    // Attributes add_current() of the current photon thread to `timeline`,
+    // prefixing the phases with `prefix`, for the lifetime of the scope.
+    class Scope {
+    public:
+        Scope(OpenTimeline *timeline, const std::string &prefix);
+        ~Scope();
+
+    private:
+        OpenTimeline *m_prev;
+        std::string m_prev_prefix;
+    };
+
+    // adds to the timeline of the scope of the current photon thread if any,
+    // for the phases run by shared code such as credential resolution
+    static void add_current(const std::string &phase, uint64_t begin);
+
+private:
+    struct Phase {
+        std::string name;
+        uint64_t begin, end;
+    };
+
+    mutable std::mutex m_mtx;
+    std::string m_path;
+    std::vector<Phase> m_phases;
+};
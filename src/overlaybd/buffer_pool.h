@@ -0,0 +1,223 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <memory>
+#include <photon/common/io-alloc.h>
+
+// 4 KB aligned I/O buffers of power-of-two size classes, from 4 KB to 4 MB,
+// recycled instead of being allocated per operation. Each class carves its
+// buffers from an address range reserved once, so a buffer's class is found
+// by its address; they're kept by each OS thread (a photon vcpu or a worker
+// thread) up to a few per class, and beyond that by a lock-free stack of the
+// class. The memory of the buffers stays with the pool once touched, bounded
+// by their peak use. Larger buffers, and all of them if the range can't be
+// reserved, go to posix_memalign. It's header only, like CpuAccount, so that
+// every library can use it without a link dependency.
+namespace BufferPool {
+
+static const uint32_t MIN_SHIFT = 12;
+static const uint32_t MAX_SHIFT = 22;
+static const uint32_t CLASSES = MAX_SHIFT - MIN_SHIFT + 1;
+// address space reserved for each class, not memory
+static const uint64_t ARENA_SIZE = 16ULL << 30;
+// bytes of each class kept by a thread, at least one buffer
+static const uint64_t THREAD_CACHE_SIZE = 4ULL << 20;
+static const uint32_t THREAD_CACHE_MAX = 16;
+static const uint64_t HUGE_PAGE = 2ULL << 20;
+
+struct Class {
+    char *base;
+    std::atomic<uint64_t> used;   // bytes carved
+    std::atomic<uint64_t> free;   // tag << 32 | (index + 1) of the top
+};
+
+struct State {
+    char *base = nullptr;
+    Class classes[CLASSES];
+    std::atomic<bool> hugepage{false};
+
+    State() {
+        // aligned to huge pages
+        auto p = mmap(nullptr, ARENA_SIZE * CLASSES + HUGE_PAGE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p != MAP_FAILED)
+            base = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1));
+        for (uint32_t i = 0; i < CLASSES; i++) {
+            classes[i].base = base ? base + ARENA_SIZE * i : nullptr;
+            classes[i].used = 0;
+            classes[i].free = 0;
+        }
+    }
+};
+
+// one instance across the libraries
+inline State &state() {
+    static State s;
+    return s;
+}
+
+inline int class_of(size_t size) {
+    uint32_t shift = MIN_SHIFT;
+    while (shift <= MAX_SHIFT && (1ULL << shift) < size)
+        shift++;
+    return shift <= MAX_SHIFT ? shift - MIN_SHIFT : -1;
+}
+
+inline uint64_t class_size(int c) {
+    return 1ULL << (c + MIN_SHIFT);
+}
+
+// the class of a buffer of the pool, -1 for others
+inline int class_of_buffer(void *ptr) {
+    auto &st = state();
+    if (st.base == nullptr || (char *)ptr < st.base ||
+        (char *)ptr >= st.base + ARENA_SIZE * CLASSES)
+        return -1;
+    return ((char *)ptr - st.base) / ARENA_SIZE;
+}
+
+// the link to the next free buffer is kept in the buffer, which is never
+// unmapped, so a stale read is harmless and the tag defeats ABA
+inline void push(int c, void *ptr) {
+    auto &cls = state().classes[c];
+    uint64_t index = ((char *)ptr - cls.base) / class_size(c);
+    auto link = (std::atomic<uint32_t> *)ptr;
+    auto top = cls.free.load(std::memory_order_relaxed);
+    uint64_t next;
+    do {
+        link->store((uint32_t)top, std::memory_order_relaxed);
+        next = ((top >> 32) + 1) << 32 | (index + 1);
+    } while (!cls.free.compare_exchange_weak(top, next, std::memory_order_release,
+                                             std::memory_order_relaxed));
+}
+
+inline void *pop(int c) {
+    auto &cls = state().classes[c];
+    auto top = cls.free.load(std::memory_order_acquire);
+    while ((uint32_t)top) {
+        auto ptr = cls.base + ((uint32_t)top - 1) * class_size(c);
+        auto link = ((std::atomic<uint32_t> *)ptr)->load(std::memory_order_relaxed);
+        uint64_t next = ((top >> 32) + 1) << 32 | link;
+        if (cls.free.compare_exchange_weak(top, next, std::memory_order_acquire,
+                                           std::memory_order_acquire))
+            return ptr;
+    }
+    return nullptr;
+}
+
+inline void *carve(int c) {
+    auto &cls = state().classes[c];
+    auto size = class_size(c);
+    auto off = cls.used.fetch_add(size, std::memory_order_relaxed);
+    if (off + size > ARENA_SIZE)
+        return nullptr;
+    auto ptr = cls.base + off;
+    if (size >= HUGE_PAGE && state().hugepage.load(std::memory_order_relaxed))
+        madvise(ptr, size, MADV_HUGEPAGE);
+    return ptr;
+}
+
+struct ThreadCache {
+    void *buffers[CLASSES][THREAD_CACHE_MAX];
+    uint32_t count[CLASSES] = {0};
+
+    static uint32_t capacity(int c) {
+        auto n = THREAD_CACHE_SIZE / class_size(c);
+        return n == 0 ? 1 : (n > THREAD_CACHE_MAX ? THREAD_CACHE_MAX : n);
+    }
+    ~ThreadCache() {
+        for (uint32_t c = 0; c < CLASSES; c++)
+            while (count[c])
+                push(c, buffers[c][--count[c]]);
+    }
+};
+
+inline ThreadCache &thread_cache() {
+    static thread_local ThreadCache tc;
+    return tc;
+}
+
+// backs the buffers of 2 MB and larger by huge pages, if the kernel does
+inline void enable_hugepage() {
+    state().hugepage = true;
+}
+
+inline void *alloc(size_t size) {
+    auto c = class_of(size);
+    if (c >= 0 && state().base) {
+        auto &tc = thread_cache();
+        if (tc.count[c])
+            return tc.buffers[c][--tc.count[c]];
+        auto ptr = pop(c);
+        if (ptr == nullptr)
+            ptr = carve(c);
+        if (ptr)
+            return ptr;
+    }
+    void *ptr = nullptr;
+    if (posix_memalign(&ptr, 1 << MIN_SHIFT, size) != 0)
+        return nullptr;
+    return ptr;
+}
+
+inline void dealloc(void *ptr) {
+    if (ptr == nullptr)
+        return;
+    auto c = class_of_buffer(ptr);
+    if (c < 0)
+        return free(ptr);
+    auto &tc = thread_cache();
+    if (tc.count[c] < ThreadCache::capacity(c))
+        tc.buffers[c][tc.count[c]++] = ptr;
+    else
+        push(c, ptr);
+}
+
+struct Deleter {
+    void operator()(void *ptr) {
+        dealloc(ptr);
+    }
+};
+
+template <typename T = char>
+using Buffer = std::unique_ptr<T, Deleter>;
+
+template <typename T = char>
+inline Buffer<T> buffer(size_t size) {
+    return Buffer<T>((T *)alloc(size));
+}
+
+inline void *io_allocate(void *, IOAlloc::RangeSize size) {
+    return alloc(size.max);
+}
+
+inline int io_deallocate(void *, void *ptr) {
+    dealloc(ptr);
+    return 0;
+}
+
+// an IOAlloc of the pool, for the IOVectors of the caches
+inline IOAlloc *new_io_alloc() {
+    return new IOAlloc({nullptr, &io_allocate}, {nullptr, &io_deallocate});
+}
+
+} // namespace BufferPool
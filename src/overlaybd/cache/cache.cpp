@@ -22,6 +22,7 @@
 #include <photon/thread/thread-pool.h>
 
 #include "full_file_cache/cache_pool.h"
+#include "full_file_cache/sharded_pool.h"
 
 namespace FileSystem {
 using namespace photon::fs;
@@ -29,16 +30,24 @@ ICachedFileSystem *new_full_file_cached_fs(IFileSystem *srcFs, IFileSystem *medi
                                            uint64_t refillUnit, uint64_t capacityInGB,
                                            uint64_t periodInUs, uint64_t diskAvailInBytes,
                                            IOAlloc *allocator, int quotaDirLevel,
-                                           CacheFnTransFunc fn_trans_func) {
+                                           CacheFnTransFunc fn_trans_func, int evictionPolicy,
+                                           uint32_t shards) {
     if (refillUnit % 4096 != 0 || !is_power_of_2(refillUnit)) {
         LOG_ERROR_RETURN(EINVAL, nullptr, "refill Unit need to be aligned to 4KB and power of 2")
     }
     if (!allocator) {
         allocator = new IOAlloc;
     }
+    if (shards > 1) {
+        auto pool = new ::Cache::ShardedFileCachePool(mediaFs, capacityInGB, periodInUs,
+                                                      diskAvailInBytes, refillUnit,
+                                                      evictionPolicy, shards);
+        pool->Init();
+        return new_cached_fs(srcFs, pool, 4096, allocator, fn_trans_func);
+    }
     Cache::FileCachePool *pool = nullptr;
-    pool =
-        new ::Cache::FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes, refillUnit);
+    pool = new ::Cache::FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes,
+                                      refillUnit, evictionPolicy);
     pool->Init();
     return new_cached_fs(srcFs, pool, 4096, allocator, fn_trans_func);
 }
@@ -60,6 +69,10 @@ ICachePool::~ICachePool() {
 }
 
 void ICachePool::stores_clear() {
+    // background threads hold references of their stores
+    while (m_background.load(std::memory_order_relaxed) > 0) {
+        photon::thread_usleep(1000);
+    }
     if (m_thread_pool) {
         auto pool = static_cast<photon::ThreadPoolBase *>(m_thread_pool);
         m_thread_pool = nullptr;
@@ -39,6 +39,12 @@
 #define SET_STRUCT_STAT(x) ((*(uint64_t *)x) = 0xF19A336DB7CA28E7ull)
 
 const int IOCTL_GET_PAGE_SIZE = 161;
+// ioctl(IOCTL_PIN_RANGE, off_t offset, size_t count) pins a range of a cached
+// file, see ICacheStore::pin()
+const int IOCTL_PIN_RANGE = 162;
+// ioctl(IOCTL_GET_GENERATION, uint64_t *gen) gets the generation of the data
+// of a cached file, see ICacheStore::get_generation()
+const int IOCTL_GET_GENERATION = 163;
 
 namespace Cache {
 namespace Block {
@@ -96,6 +102,17 @@ public:
     }
 
     int vioctl(int request, va_list args) override {
+        if (request == IOCTL_PIN_RANGE) {
+            auto store = get_store();
+            auto offset = va_arg(args, off_t);
+            auto count = va_arg(args, size_t);
+            return store ? store->pin(offset, count) : -1;
+        }
+        if (request == IOCTL_GET_GENERATION) {
+            auto store = get_store();
+            auto gen = va_arg(args, uint64_t *);
+            return store ? store->get_generation(gen) : -1;
+        }
         auto src = get_source();
         if (src)
             return src->vioctl(request, args);
@@ -109,26 +126,55 @@ ICachedFileSystem *new_cached_fs(photon::fs::IFileSystem *src, ICachePool *pool,
 
 ICachedFile *new_cached_file(ICacheStore *store, uint64_t pageSize, photon::fs::IFileSystem *fs);
 
+/**
+ * @param evictionPolicy EVICT_LRU evicts whole files in LRU order; EVICT_2Q tracks refill units
+ *                       with 2Q so a single scan can not flush the hot set, and punches the
+ *                       chosen units out of their media files.
+ * @param shards         splits the files among this many pools by the hash of their names,
+ *                       each with its own index, eviction and checkpoint.
+ */
 ICachedFileSystem *new_full_file_cached_fs(photon::fs::IFileSystem *srcFs,
                                            photon::fs::IFileSystem *media_fs, uint64_t refillUnit,
                                            uint64_t capacityInGB, uint64_t periodInUs,
                                            uint64_t diskAvailInBytes, IOAlloc *allocator,
                                            int quotaDirLevel,
-                                           CacheFnTransFunc fn_trans_func = nullptr);
+                                           CacheFnTransFunc fn_trans_func = nullptr,
+                                           int evictionPolicy = EVICT_LRU, uint32_t shards = 1);
 
 /**
  * @param blk_size The proper size for cache metadata and IO efficiency. Large writes to cache media
  *                 will be split into blk_size. Reads and small writes are not affected.
  * @param prefetch_unit Controls the expand prefetch size from src file. 0 means to disable this
  * feature.
+ * @param hugepage Backs the cache metadata and the request pools by hugepages, which takes TLB
+ * misses off the lookups of a large cache media.
+ * @param media_ev_engine The photon event engine needed besides the default ones to do I/O to
+ * `media_file`, e.g. INIT_EVENT_IOURING for an io_uring media file.
  */
 photon::fs::IFileSystem *new_ocf_cached_fs(photon::fs::IFileSystem *src_fs,
                                            photon::fs::IFileSystem *namespace_fs, size_t blk_size,
                                            size_t prefetch_unit, photon::fs::IFile *media_file,
-                                           bool reload_media, IOAlloc *io_alloc);
+                                           bool reload_media, IOAlloc *io_alloc,
+                                           bool hugepage = false, int media_ev_engine = 0);
 
+/**
+ * @param refill_size The unit fetched from src file into the local copy.
+ * @param window The number of units fetched at a time per blob, in any order, and read ahead of
+ * a reader.
+ */
 photon::fs::IFileSystem *new_download_cached_fs(photon::fs::IFileSystem *src_fs, size_t blk_size,
-                                                size_t refill_size, IOAlloc *io_alloc);
+                                                size_t refill_size, IOAlloc *io_alloc,
+                                                uint32_t window = 8);
+
+/**
+ * A DRAM tier in front of `fs`, usually another cached fs. Reads are cached in pages, admitted
+ * by how often they are requested (TinyLFU), so that hot pages shared by the layers stay in
+ * memory while one-off scans pass through.
+ * @param capacity Bytes of memory for cached pages.
+ * @param page_size Size of a page, a multiple of 4KB, usually the refill unit of `fs`.
+ */
+photon::fs::IFileSystem *new_memory_cached_fs(photon::fs::IFileSystem *fs, size_t capacity,
+                                              size_t page_size, bool ownership);
 } // extern "C"
 
 } // namespace FileSystem
@@ -14,7 +14,11 @@
    limitations under the License.
 */
 #include "../cache.h"
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <string>
+#include <vector>
 #include <photon/common/alog.h>
 #include <photon/common/alog-audit.h>
 #include <photon/common/alog-stdstring.h>
@@ -25,6 +29,7 @@
 #include <photon/fs/forwardfs.h>
 #include <photon/fs/fiemap.h>
 #include <photon/thread/thread.h>
+#include <photon/thread/thread11.h>
 #include <photon/common/io-alloc.h>
 #include <photon/common/expirecontainer.h>
 #include <photon/common/range-lock.h>
@@ -39,6 +44,10 @@ using namespace photon::fs;
 
 class DownloadCacheFs;
 
+// The local copy of a blob, filled by refill units of refill_size, which are
+// fetched from the source by at most `window` threads at a time, in any order.
+// The units a reader waits for are fetched first, ahead of those read ahead
+// of it. The cached units are tracked in memory, found by fiemap only once.
 class DownloadCacheStore : public ForwardFile_Ownership {
 public:
     DownloadCacheStore(IFile *file, DownloadCacheFs *fs)
@@ -58,21 +67,41 @@ public:
         return m_file->ftruncate(length);
     }
 
-    std::pair<off_t, size_t> query_refill_range(off_t offset, size_t size);
+    // sizes the local file, and finds the units cached before, once
+    int init(size_t size);
 
-    int try_lock_wait(uint64_t offset, uint64_t length) {
-        return m_range_lock.try_lock_wait(offset, length);
-    }
-    void lock(uint64_t offset, uint64_t length) {
-        m_range_lock.lock(offset, length);
-    }
-    void unlock(uint64_t offset, uint64_t length) {
-        m_range_lock.unlock(offset, length);
-    }
+    // waits until [offset, offset + count) is cached, fetching its missing
+    // units from `src` and reading ahead of it; -1 if any of them failed
+    int fetch(IFile *src, off_t offset, size_t count);
+
+    // drops the units in [offset, offset + len) from the local file
+    int evict(off_t offset, off_t len);
+
+    // stops the fetches from `src`, which is about to be closed
+    void detach(IFile *src);
 
 private:
+    enum State : uint8_t { MISSING, QUEUED, FETCHING, CACHED };
+    struct Job {
+        uint64_t unit;
+        IFile *src;
+    };
+
     RangeLock m_range_lock;
     DownloadCacheFs *m_fs;
+    photon::mutex m_mtx;
+    photon::condition_variable m_cv; // a unit is done
+    size_t m_size = 0;
+    std::vector<uint8_t> m_state; // of each unit
+    // the units waited for, and those read ahead
+    std::deque<Job> m_urgent, m_background;
+    uint32_t m_inflight = 0;
+    std::map<IFile *, uint32_t> m_src_jobs; // queued and fetching
+
+    void dispatch();
+    void do_fetch(Job job);
+    void enqueue(std::deque<Job> &queue, uint64_t unit, IFile *src);
+    int load_state();
 };
 
 class DownloadCacheFile : public VirtualFile {
@@ -109,9 +138,9 @@ private:
 
 class DownloadCacheFs : public IFileSystem {
 public:
-    DownloadCacheFs(IFileSystem *fs, size_t bs, size_t rs, IOAlloc *io_alloc)
-        : m_src_fs(fs), block_size(bs), refill_size(rs), io_alloc(io_alloc),
-          m_file_pool(1 * 1000 * 1000) {
+    DownloadCacheFs(IFileSystem *fs, size_t bs, size_t rs, IOAlloc *io_alloc, uint32_t window)
+        : block_size(bs), refill_size(rs), window(window), io_alloc(io_alloc),
+          m_file_pool(1 * 1000 * 1000), m_src_fs(fs) {
         LOG_INFO("new DownloadCacheFs");
     }
     ~DownloadCacheFs() {
@@ -154,6 +183,7 @@ public:
 
     size_t block_size;
     size_t refill_size;
+    uint32_t window; // # of units fetched at a time, and read ahead, per blob
     IOAlloc *io_alloc;
     ObjectCache<std::string, DownloadCacheStore *> m_file_pool;
 
@@ -162,6 +192,8 @@ private:
 };
 
 DownloadCacheFile::~DownloadCacheFile() {
+    if (m_local_file)
+        m_local_file->detach(m_file);
     safe_delete(m_file);
     m_fs->m_file_pool.release(m_local_path);
 }
@@ -177,66 +209,17 @@ ssize_t DownloadCacheFile::preadv(const struct iovec *iov, int iovcnt, off_t off
 
     iovector_view view((iovec *)iov, iovcnt);
     size_t count = view.sum();
-    if (count == 0) {
+    if (count == 0 || (uint64_t)offset >= m_size) {
         return 0;
     }
+    count = std::min(count, (size_t)(m_size - offset));
 
-    std::pair<off_t, size_t> q;
-
-    off_t align_left = align_down(offset, m_fs->block_size);
-    off_t align_right = align_up(offset + count, m_fs->block_size);
-
-again:
-
-     m_local_file->lock(align_left, align_right - align_left);
-    {
-        DEFER({m_local_file->unlock(align_left, align_right - align_left);});
-        q = m_local_file->query_refill_range(offset, count);
-        if (q.second == 0) { // no need to refill
-            return m_local_file->preadv(iov, iovcnt, offset);
-        }
-    }
-
-    // refill
-    uint64_t r_offset = q.first;
-    uint64_t r_count = q.second;
-    if (r_offset + r_count > m_size) {
-        r_count = m_size - r_offset;
-    }
-
-    IOVector buffer(*m_fs->io_alloc);
-
-    auto lr = m_local_file->try_lock_wait(r_offset, r_count);
-    if (lr < 0) {
-        goto again;
-    }
-    DEFER({ m_local_file->unlock(r_offset, r_count); });
-
-    auto alloc = buffer.push_back(r_count);
-    if (alloc < r_count) {
-        LOG_ERROR("memory allocate failed, refill size:`, alloc:`", r_count, alloc);
+    if (m_local_file->fetch(m_file, offset, count) < 0) {
+        LOG_WARN("failed to fetch ` bytes at `, read from source", count, offset);
         SCOPE_AUDIT("download", AU_FILEOP(m_name, offset, ret));
         ret = m_file->preadv(iov, iovcnt, offset);
         return ret;
     }
-
-    ssize_t read = 0;
-    {
-        SCOPE_AUDIT("download", AU_FILEOP(m_name, r_offset, read));
-        read = m_file->preadv(buffer.iovec(), buffer.iovcnt(), r_offset);
-    }
-
-    if (read != (ssize_t)r_count) {
-        LOG_ERRNO_RETURN(0, -1, "src file read failed, read: `, expect: `, size: `, offset: `",
-                         read, r_count, m_size, r_offset);
-    }
-
-    auto write = m_local_file->pwritev(buffer.iovec(), buffer.iovcnt(), r_offset);
-    if (write != (ssize_t)r_count) {
-        LOG_ERRNO_RETURN(0, -1, "local file write failed, write: `, expect: `, size: `, offset: `",
-                         write, r_count, m_size, r_offset);
-    }
-
     return m_local_file->preadv(iov, iovcnt, offset);
 }
 
@@ -262,8 +245,7 @@ int DownloadCacheFile::vioctl(int request, va_list args) {
         });
 
         if (m_local_file != nullptr && m_size > 0) {
-            m_local_file->ftruncate(m_size);
-            ready = true;
+            ready = m_local_file->init(m_size) == 0;
         }
         return 0;
     } else if (request == SET_SIZE) {
@@ -273,8 +255,7 @@ int DownloadCacheFile::vioctl(int request, va_list args) {
         }
         m_size = va_arg(args, size_t);
         if (m_local_file != nullptr) {
-            m_local_file->ftruncate(m_size);
-            ready = true;
+            ready = m_local_file->init(m_size) == 0;
         }
         return 0;
     } else {
@@ -296,65 +277,171 @@ int DownloadCacheFile::fallocate(int mode, off_t offset, off_t len) {
     LOG_DEBUG("fallocate offset: `, len: `, aligned offset: `, aligned len: `", offset, len,
               aligned_offset, aligned_len);
 
-    return m_local_file->trim(aligned_offset, aligned_len);
+    return m_local_file->evict(aligned_offset, aligned_len);
 }
 
-std::pair<off_t, size_t> DownloadCacheStore::query_refill_range(off_t offset, size_t size) {
-    off_t align_left = align_down(offset, m_fs->block_size);
-    off_t align_right = align_up(offset + size, m_fs->block_size);
-    auto req_offset = align_left;
-    auto req_size = static_cast<size_t>(align_right - align_left);
-
-    struct photon::fs::fiemap_t<4096> fie(req_offset, req_size);
-    fie.fm_mapped_extents = 0;
-
-    if (req_size > 0) { //  fiemap cannot handle size zero.
-        auto ok = m_file->fiemap(&fie);
-        if (ok != 0) {
-            LOG_ERRNO_RETURN(0, std::make_pair(-1, 0),
-                             "media fiemap failed : `, offset : `, size : `", ok, req_offset,
-                             req_size);
+int DownloadCacheStore::init(size_t size) {
+    photon::scoped_lock l(m_mtx);
+    if (!m_state.empty())
+        return 0;
+    if (m_file->ftruncate(size) != 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to truncate local file to `", size);
+    m_size = size;
+    m_state.assign((size + m_fs->refill_size - 1) / m_fs->refill_size, MISSING);
+    return load_state();
+}
+
+// marks the units wholly mapped in the local file as cached
+int DownloadCacheStore::load_state() {
+    auto unit = m_fs->refill_size;
+    uint64_t offset = 0;
+    while (offset < m_size) {
+        struct photon::fs::fiemap_t<4096> fie(offset, m_size - offset);
+        fie.fm_mapped_extents = 0;
+        if (m_file->fiemap(&fie) != 0)
+            LOG_ERRNO_RETURN(0, -1, "media fiemap failed, offset : `", offset);
+        if (fie.fm_mapped_extents == 0)
+            break;
+        for (uint32_t i = 0; i < fie.fm_mapped_extents; i++) {
+            auto &extent = fie.fm_extents[i];
+            offset = std::max(offset, (uint64_t)extent.fe_logical_end());
+            if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
+                (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
+                continue;
+            auto end = std::min(extent.fe_logical_end(), (uint64_t)m_size);
+            // the last unit of the blob may be partial
+            auto right = end == m_size ? m_state.size() : end / unit;
+            for (auto u = align_up(extent.fe_logical, unit) / unit; u < right; u++)
+                m_state[u] = CACHED;
+        }
+        if (fie.fm_mapped_extents < 4096)
+            break;
+    }
+    return 0;
+}
+
+void DownloadCacheStore::enqueue(std::deque<Job> &queue, uint64_t unit, IFile *src) {
+    m_state[unit] = QUEUED;
+    queue.push_back({unit, src});
+    m_src_jobs[src]++;
+}
+
+int DownloadCacheStore::fetch(IFile *src, off_t offset, size_t count) {
+    auto unit = m_fs->refill_size;
+    uint64_t first = offset / unit, last = (offset + count - 1) / unit;
+    photon::scoped_lock l(m_mtx);
+    for (auto u = first; u <= last; u++) {
+        if (m_state[u] == MISSING) {
+            enqueue(m_urgent, u, src);
+        } else if (m_state[u] == QUEUED) {
+            // read ahead before, and now waited for
+            auto it = std::find_if(m_background.begin(), m_background.end(),
+                                   [u](const Job &job) { return job.unit == u; });
+            if (it != m_background.end()) {
+                m_urgent.push_back(*it);
+                m_background.erase(it);
+            }
         }
-        if (fie.fm_mapped_extents >= 4096) {
-            LOG_ERROR_RETURN(EINVAL, std::make_pair(-1, 0), "read size is too big : `", req_size);
+    }
+    for (auto u = last + 1; u <= last + m_fs->window && u < m_state.size(); u++) {
+        if (m_state[u] == MISSING)
+            enqueue(m_background, u, src);
+    }
+    dispatch();
+    while (true) {
+        bool done = true;
+        for (auto u = first; u <= last; u++) {
+            if (m_state[u] == MISSING)
+                return -1; // failed
+            if (m_state[u] != CACHED)
+                done = false;
         }
+        if (done)
+            return 0;
+        m_cv.wait(m_mtx);
     }
+}
 
-    uint64_t hole_start = req_offset;
-    uint64_t hole_end = req_offset + req_size;
-
-    for (auto i = fie.fm_mapped_extents - 1; i < fie.fm_mapped_extents; i--) {
-        auto &extent = fie.fm_extents[i];
-        if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
-            (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
-            continue;
-        if (extent.fe_logical < hole_end) {
-            if (extent.fe_logical_end() >= hole_end) {
-                hole_end = extent.fe_logical;
-            } else
-                break;
+void DownloadCacheStore::dispatch() {
+    while (m_inflight < m_fs->window && (!m_urgent.empty() || !m_background.empty())) {
+        auto &queue = m_urgent.empty() ? m_background : m_urgent;
+        auto job = queue.front();
+        queue.pop_front();
+        m_state[job.unit] = FETCHING;
+        m_inflight++;
+        photon::thread_create11(&DownloadCacheStore::do_fetch, this, job);
+    }
+}
+
+void DownloadCacheStore::do_fetch(Job job) {
+    auto unit = m_fs->refill_size;
+    off_t offset = job.unit * unit;
+    size_t count = std::min(unit, (size_t)(m_size - offset));
+    bool ok = false;
+    IOVector buffer(*m_fs->io_alloc);
+    if (buffer.push_back(count) < count) {
+        LOG_ERROR("memory allocate failed, refill size:`", count);
+    } else {
+        ssize_t read = 0;
+        {
+            SCOPE_AUDIT("download", AU_FILEOP("", offset, read));
+            read = job.src->preadv(buffer.iovec(), buffer.iovcnt(), offset);
+        }
+        if (read != (ssize_t)count) {
+            LOG_ERROR("src file read failed, read: `, expect: `, offset: `, error: `", read, count,
+                      offset, ERRNO());
+        } else {
+            ScopedRangeLock lock(m_range_lock, offset, count);
+            auto write = m_file->pwritev(buffer.iovec(), buffer.iovcnt(), offset);
+            if (write != (ssize_t)count) {
+                LOG_ERROR("local file write failed, write: `, expect: `, offset: `, error: `",
+                          write, count, offset, ERRNO());
+            } else {
+                ok = true;
+            }
         }
     }
+    photon::scoped_lock l(m_mtx);
+    m_state[job.unit] = ok ? CACHED : MISSING;
+    m_inflight--;
+    if (--m_src_jobs[job.src] == 0)
+        m_src_jobs.erase(job.src);
+    dispatch();
+    m_cv.notify_all();
+}
 
-    for (uint32_t i = 0; i < fie.fm_mapped_extents; i++) {
-        auto &extent = fie.fm_extents[i];
-        if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
-            (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
-            continue;
-        if (extent.fe_logical_end() > hole_start) {
-            if (extent.fe_logical <= hole_start) {
-                hole_start = extent.fe_logical_end();
-            } else
-                break;
+int DownloadCacheStore::evict(off_t offset, off_t len) {
+    uint64_t unit = m_fs->refill_size;
+    {
+        photon::scoped_lock l(m_mtx);
+        auto right = std::min((offset + len + unit - 1) / unit, (uint64_t)m_state.size());
+        for (auto u = offset / unit; u < right; u++) {
+            if (m_state[u] == CACHED)
+                m_state[u] = MISSING;
         }
     }
+    ScopedRangeLock lock(m_range_lock, offset, len);
+    return m_file->trim(offset, len);
+}
 
-    if (hole_start >= hole_end)
-        return std::make_pair(0, 0);
-    // miss
-    auto left = align_down(hole_start, m_fs->refill_size);
-    auto right = align_up(hole_end, m_fs->refill_size);
-    return std::make_pair(left, right - left);
+void DownloadCacheStore::detach(IFile *src) {
+    photon::scoped_lock l(m_mtx);
+    for (auto queue : {&m_urgent, &m_background}) {
+        for (auto it = queue->begin(); it != queue->end();) {
+            if (it->src != src) {
+                ++it;
+                continue;
+            }
+            m_state[it->unit] = MISSING;
+            if (--m_src_jobs[src] == 0)
+                m_src_jobs.erase(src);
+            it = queue->erase(it);
+        }
+    }
+    // the readers of the units dropped above fall back to the source
+    m_cv.notify_all();
+    while (m_src_jobs.count(src))
+        m_cv.wait(m_mtx);
 }
 
 } // namespace Cache
@@ -363,10 +450,12 @@ namespace FileSystem {
 using namespace photon::fs;
 
 IFileSystem *new_download_cached_fs(photon::fs::IFileSystem *src_fs, size_t blk_size,
-                                    size_t refill_size, IOAlloc *io_alloc) {
+                                    size_t refill_size, IOAlloc *io_alloc, uint32_t window) {
     if (io_alloc == nullptr) {
         io_alloc = new IOAlloc;
     }
-    return new ::Cache::DownloadCacheFs(src_fs, blk_size, refill_size, io_alloc);
+    if (window == 0)
+        window = 1;
+    return new ::Cache::DownloadCacheFs(src_fs, blk_size, refill_size, io_alloc, window);
 }
 } // namespace FileSystem
@@ -0,0 +1,106 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <inttypes.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace Cache {
+
+// One bit per block of a media file, set once the block is completely
+// written. A cleared bit may still be (partially) cached, so the bitmap only
+// errs on the side of refilling.
+class BlockBitmap {
+public:
+    bool loaded = false; // filled from the sidecar file or fiemap
+    bool dirty = false;  // changed since loaded or saved
+
+    bool test(uint64_t i) const {
+        return i / 64 < m_words.size() && (m_words[i / 64] >> (i % 64)) & 1;
+    }
+
+    // set blocks [begin, end)
+    void set(uint64_t begin, uint64_t end) {
+        if (begin >= end)
+            return;
+        if ((end + 63) / 64 > m_words.size())
+            m_words.resize((end + 63) / 64, 0);
+        for (auto i = begin; i < end;) {
+            auto bit = i % 64;
+            auto n = std::min<uint64_t>(64 - bit, end - i);
+            auto mask = (n == 64) ? ~0UL : ((1UL << n) - 1) << bit;
+            m_words[i / 64] |= mask;
+            i += n;
+        }
+        dirty = true;
+    }
+
+    // clear blocks [begin, end)
+    void unset(uint64_t begin, uint64_t end) {
+        end = std::min<uint64_t>(end, m_words.size() * 64);
+        for (auto i = begin; i < end;) {
+            auto bit = i % 64;
+            auto n = std::min<uint64_t>(64 - bit, end - i);
+            auto mask = (n == 64) ? ~0UL : ((1UL << n) - 1) << bit;
+            m_words[i / 64] &= ~mask;
+            i += n;
+        }
+        dirty = true;
+    }
+
+    // returns [first, last + 1) of the blocks missing in [begin, end),
+    // or an empty range if all of them are set
+    std::pair<uint64_t, uint64_t> missing(uint64_t begin, uint64_t end) const {
+        auto first = next(begin, end, false);
+        if (first == end)
+            return {end, end};
+        auto last = end;
+        while (last > first && test(last - 1))
+            last--;
+        return {first, last};
+    }
+
+    void clear() {
+        m_words.clear();
+        dirty = true;
+    }
+
+    std::vector<uint64_t> &words() {
+        return m_words;
+    }
+
+protected:
+    std::vector<uint64_t> m_words;
+
+    // first block in [begin, end) whose bit equals `value`, or `end`
+    uint64_t next(uint64_t begin, uint64_t end, bool value) const {
+        for (auto i = begin; i < end;) {
+            uint64_t w = (i / 64 < m_words.size()) ? m_words[i / 64] : 0;
+            if (!value)
+                w = ~w;
+            w &= ~0UL << (i % 64);
+            if (w) {
+                auto r = i / 64 * 64 + __builtin_ctzll(w);
+                return r < end ? r : end;
+            }
+            i = i / 64 * 64 + 64;
+        }
+        return end;
+    }
+};
+
+} // namespace Cache
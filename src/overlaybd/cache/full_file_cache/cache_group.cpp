@@ -0,0 +1,42 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "cache_group.h"
+#include <photon/common/alog.h>
+#include "sharded_pool.h"
+
+namespace Cache {
+
+int FileCacheGroup::add(FileSystem::ICachePool *pool, uint64_t reservedInBytes) {
+    std::vector<FileCachePool *> members;
+    if (auto sharded = dynamic_cast<ShardedFileCachePool *>(pool)) {
+        members = sharded->shards_;
+    } else if (auto single = dynamic_cast<FileCachePool *>(pool)) {
+        members.push_back(single);
+    } else {
+        LOG_ERROR_RETURN(EINVAL, -1, "only full file cache pools share a capacity");
+    }
+    if (pool->resize(capacityInGB_ * 1024UL * 1024 * 1024) != 0)
+        return -1;
+    for (auto member : members) {
+        member->reserved_ = reservedInBytes / members.size();
+        member->group_ = &pools_;
+        pools_.push_back(member);
+    }
+    return 0;
+}
+
+} //  namespace Cache
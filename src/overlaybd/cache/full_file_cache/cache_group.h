@@ -0,0 +1,42 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <vector>
+#include "cache_pool.h"
+
+namespace Cache {
+
+// Full file cache pools of different kinds, such as the registry cache and the
+// gzip cache, sharing one capacity: the marks apply to their total usage, and
+// the excess is evicted from each pool by its usage above its reservation, so
+// that a kind sitting idle gives way to a busy one, down to its reservation.
+// The group must outlive its pools.
+class FileCacheGroup {
+public:
+    explicit FileCacheGroup(uint64_t capacityInGB) : capacityInGB_(capacityInGB) {
+    }
+
+    // adds a FileCachePool or a ShardedFileCachePool, whose shards share
+    // `reservedInBytes` evenly, resized to the capacity of the group
+    int add(FileSystem::ICachePool *pool, uint64_t reservedInBytes);
+
+private:
+    uint64_t capacityInGB_;
+    std::vector<FileCachePool *> pools_;
+};
+
+} //  namespace Cache
@@ -19,12 +19,17 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include <cstring>
 #include <sys/statvfs.h>
 #include "cache_store.h"
+#include "compressed_store.h"
+#include "../policy/two_queue.h"
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
+#include <photon/common/checksum/crc32c.h>
 #include <photon/common/enumerable.h>
 #include <photon/common/utility.h>
+#include <photon/fs/fiemap.h>
 #include <photon/fs/path.h>
 
 namespace Cache {
@@ -35,20 +40,77 @@ using namespace photon::fs;
 const uint64_t kGB = 1024 * 1024 * 1024;
 const uint64_t kMaxFreeSpace = 50 * kGB;
 const int64_t kEvictionMark = 5ll * kGB;
+constexpr int kFieExtentSize = 1000;
+
+struct BitmapHeader {
+    static const uint64_t kMagic = 0x50414d5449424446ULL; // "FDBITMAP"
+    uint64_t magic = kMagic;
+    uint64_t block_size;
+    uint64_t media_size;
+    uint64_t nwords;
+};
+
+constexpr const char *FileCachePool::kBitmapSuffix;
+constexpr const char *FileCachePool::kMetaFile;
+constexpr const char *FileCachePool::kJournalFile;
+
+// kMetaFile is a MetaHeader, followed by `count` MetaRecords of the index in
+// LRU order, least recently used first, each followed by the file name.
+struct MetaHeader {
+    static const uint64_t kMagic = 0x4154454d45484341ULL; // "ACHEMETA"
+    uint64_t magic = kMagic;
+    uint64_t generation;
+    uint64_t count;
+    uint32_t crc;     // of the records
+    uint32_t nshards; // of the pool the checkpoint belongs to
+};
+
+struct MetaRecord {
+    uint64_t size;
+    uint32_t len;
+    uint32_t reserved = 0;
+};
+
+// kJournalFile is the generation of the checkpoint it follows, then
+// JournalRecords, each followed by the file name.
+struct JournalRecord {
+    static const char kAdd = 'A', kRemove = 'R';
+    uint32_t crc; // of the fields below and the name
+    uint16_t len;
+    char op;
+    char reserved = 0;
+    uint32_t calc_crc(const char *name) const {
+        return crc32c_extend(name, len, crc32c(&len, sizeof(*this) - sizeof(crc)));
+    }
+};
+
+#ifndef FALLOC_FL_KEEP_SIZE
+#define FALLOC_FL_KEEP_SIZE 0x01 /* default is extend size */
+#endif
+#ifndef FALLOC_FL_PUNCH_HOLE
+#define FALLOC_FL_PUNCH_HOLE 0x02 /* de-allocates range */
+#endif
 
 FileCachePool::FileCachePool(IFileSystem *mediaFs, uint64_t capacityInGB, uint64_t periodInUs,
-                             uint64_t diskAvailInBytes, uint64_t refillUnit)
+                             uint64_t diskAvailInBytes, uint64_t refillUnit, int evictionPolicy,
+                             uint32_t shard, uint32_t nshards)
     : ICachePool(0), mediaFs_(mediaFs), capacityInGB_(capacityInGB), periodInUs_(periodInUs),
       diskAvailInBytes_(diskAvailInBytes), refillUnit_(refillUnit), totalUsed_(0), timer_(nullptr),
-      running_(false), exit_(false), isFull_(false) {
+      running_(false), exit_(false), isFull_(false), nshards_(nshards), metaFile_(kMetaFile),
+      journalFile_(kJournalFile) {
+    if (nshards_ > 1) {
+        metaFile_ += "." + std::to_string(shard);
+        journalFile_ += "." + std::to_string(shard);
+    }
+    setMarks();
     int64_t capacityInBytes = capacityInGB_ * kGB;
-    waterMark_ = calcWaterMark(capacityInBytes, kMaxFreeSpace);
-    // keep this relation : waterMark < riskMark < capacity
-    riskMark_ = std::max(capacityInBytes - kEvictionMark,
-                         (static_cast<int64_t>(waterMark_) + capacityInBytes) >> 1);
+    if (evictionPolicy == EVICT_2Q) {
+        policy_.reset(new TwoQueuePolicy(capacityInBytes / refillUnit_));
+    }
 }
 
 FileCachePool::~FileCachePool() {
+    bool inited = timer_ != nullptr;
     exit_ = true;
     if (timer_) {
         while (running_) {
@@ -57,11 +119,36 @@ FileCachePool::~FileCachePool() {
         delete timer_;
     }
     this->stores_clear();
-    delete mediaFs_;
+    if (inited) {
+        checkpoint();
+    }
+    delete journal_;
+    if (ownsMediaFs_) {
+        delete mediaFs_;
+    }
 }
 
 void FileCachePool::Init() {
-    traverseDir("/");
+    // the checkpoints of a sharded pool that ran after ours make ours stale
+    auto shardMeta = std::string(kMetaFile) + ".0";
+    if (mediaFs_->unlink(shardMeta.c_str()) == 0 || recover() != 0) {
+        traverseDir("/");
+    }
+    start();
+}
+
+int FileCachePool::recover() {
+    if (loadMeta() != 0) {
+        return -1;
+    }
+    replayJournal();
+    LOG_INFO("cache index recovered from `, files : `, used : `", metaFile_, fileIndex_.size(),
+             totalUsed_);
+    return 0;
+}
+
+void FileCachePool::start() {
+    checkpoint();
     timer_ = new photon::Timer(periodInUs_, {this, FileCachePool::timerHandler}, true,
                                8UL * 1024 * 1024);
 }
@@ -74,16 +161,22 @@ ICacheStore *FileCachePool::do_open(std::string_view pathname, int flags, mode_t
 
     auto find = fileIndex_.find(pathname);
     if (find == fileIndex_.end()) {
-        auto lruIter = lru_.push_front(fileIndex_.end());
-        std::unique_ptr<LruEntry> entry(new LruEntry{lruIter, 1, 0});
-        find = fileIndex_.emplace(pathname, std::move(entry)).first;
-        lru_.front() = find;
+        find = addFile(pathname, 1, 0);
+        journal(JournalRecord::kAdd, pathname);
     } else {
         lru_.access(find->second->lruIter);
         find->second->openCount++;
     }
 
-    return new FileCacheStore(this, localFile, refillUnit_, find);
+    IFile *directFile = nullptr;
+    if (m_direct_write) {
+        directFile = mediaFs_->open(pathname.data(), O_WRONLY | O_DIRECT);
+        if (!directFile)
+            LOG_WARN("failed to open cache media with O_DIRECT, write it buffered: `", pathname);
+    }
+    if (m_compress)
+        return new CompressedFileCacheStore(this, localFile, refillUnit_, find, directFile);
+    return new FileCacheStore(this, localFile, refillUnit_, find, directFile);
 }
 
 IFile *FileCachePool::openMedia(std::string_view name, int flags, int mode) {
@@ -135,7 +228,13 @@ bool FileCachePool::isFull() {
 }
 
 void FileCachePool::removeOpenFile(FileNameMap::iterator iter) {
-    iter->second->openCount--;
+    auto &pinned = iter->second->pinned;
+    if (--iter->second->openCount == 0 && !pinned.empty()) {
+        pinnedBytes_ -= std::min<uint64_t>(pinned.size() * refillUnit_, pinnedBytes_);
+        pinned.clear();
+        if (pinnedBytes_ < capacityInGB_ * kGB * kPinRatio / 100)
+            pinWarned_ = false;
+    }
 }
 
 void FileCachePool::forceRecycle() {
@@ -146,6 +245,46 @@ void FileCachePool::updateLru(FileNameMap::iterator iter) {
     lru_.access(iter->second->lruIter);
 }
 
+void FileCachePool::updatePolicy(FileNameMap::iterator iter, off_t offset, size_t count) {
+    if (!policy_ || count == 0) {
+        return;
+    }
+    uint64_t id = iter->second->id;
+    uint64_t end = offset + count;
+    for (uint64_t i = offset / refillUnit_; i * refillUnit_ < end; i++) {
+        policy_->access(id << 32 | i);
+    }
+}
+
+int FileCachePool::pin(FileNameMap::iterator iter, off_t offset, size_t count) {
+    auto &pinned = iter->second->pinned;
+    // as the pins of open files could take the whole cache otherwise
+    uint64_t cap = capacityInGB_ * kGB * kPinRatio / 100;
+    uint64_t end = offset + count;
+    for (uint64_t i = offset / refillUnit_; i * refillUnit_ < end; i++) {
+        if (pinned.count(i))
+            continue;
+        if (pinnedBytes_ + refillUnit_ > cap) {
+            if (!pinWarned_) {
+                pinWarned_ = true;
+                LOG_WARN("pinned ` bytes, `% of the cache capacity, the rest isn't pinned",
+                         pinnedBytes_, kPinRatio);
+            }
+            // reads of high priority images pin all along, warned once above
+            errno = ENOSPC;
+            return -1;
+        }
+        pinned.insert(i);
+        pinnedBytes_ += refillUnit_;
+    }
+    return 0;
+}
+
+bool FileCachePool::isPinned(uint64_t key) {
+    auto it = idIndex_.find(key >> 32);
+    return it != idIndex_.end() && it->second->second->pinned.count(key & 0xffffffffUL);
+}
+
 //  currently, we exist duplicate pwrite
 uint64_t FileCachePool::updateSpace(FileNameMap::iterator iter, uint64_t size) {
     auto lruEntry = iter->second.get();
@@ -155,8 +294,8 @@ uint64_t FileCachePool::updateSpace(FileNameMap::iterator iter, uint64_t size) {
         totalUsed_ += diff;
     }
     lruEntry->size = size;
-    if (totalUsed_ >= riskMark_) {
-        LOG_WARN("pwrite is so heavy, totalUsed:`,riskMark:` || lruEntry->size = `", totalUsed_,
+    if (groupUsed() >= riskMark_) {
+        LOG_WARN("pwrite is so heavy, totalUsed:`,riskMark:` || lruEntry->size = `", groupUsed(),
                  riskMark_, lruEntry->size);
         isFull_ = true;
         forceRecycle();
@@ -175,13 +314,51 @@ uint64_t FileCachePool::timerHandler(void *data) {
     cur->running_ = true;
     DEFER(cur->running_ = false;);
     cur->eviction();
+    if (photon::now - cur->lastCheckpoint_ >= kCheckpointIntervalInUs) {
+        cur->checkpoint();
+    } else if (cur->journalDirty_ && cur->journal_) {
+        cur->journalDirty_ = false;
+        cur->journal_->fdatasync();
+    }
     return 0;
 }
 
+int64_t FileCachePool::groupUsed() {
+    if (!group_) {
+        return totalUsed_;
+    }
+    int64_t used = 0;
+    for (auto shard : *group_) {
+        used += shard->totalUsed_;
+    }
+    return used;
+}
+
+// the share of the eviction of the group by the usage of this pool above its
+// reservation, or by its usage if all the pools are within them
+double FileCachePool::evictionShare() {
+    auto over = [](FileCachePool *p) {
+        return std::max(p->totalUsed_ - p->reserved_, (int64_t)0);
+    };
+    int64_t groupOver = over(this);
+    if (group_) {
+        groupOver = 0;
+        for (auto pool : *group_)
+            groupOver += over(pool);
+    }
+    if (groupOver > 0)
+        return (double)over(this) / groupOver;
+    auto used = groupUsed();
+    return used > 0 ? (double)totalUsed_ / used : 0;
+}
+
 void FileCachePool::eviction() {
     uint64_t evictByDisk = 0;
     uint64_t evictByCache = 0;
     uint64_t fsCapacity = 0;
+    // the marks apply to the whole group, each pool evicting its share
+    auto used = groupUsed();
+    double share = evictionShare();
 
     DEFER(isFull_ = false);
     struct statvfs stFs = {};
@@ -193,14 +370,14 @@ void FileCachePool::eviction() {
         fsCapacity = stFs.f_frsize * stFs.f_blocks;
         uint64_t diskAvailInBytes = stFs.f_bavail * stFs.f_frsize;
         if (diskAvailInBytes < diskAvailInBytes_) {
-            evictByDisk = diskAvailInBytes_ - diskAvailInBytes;
+            evictByDisk = (diskAvailInBytes_ - diskAvailInBytes) * share;
         } else if (fsCapacity <= waterMark_) { // we occupy the whole disk
             return;
         }
     }
 
-    if (totalUsed_ >= static_cast<int64_t>(waterMark_)) {
-        evictByCache = totalUsed_ - waterMark_;
+    if (used >= static_cast<int64_t>(waterMark_)) {
+        evictByCache = (used - waterMark_) * share;
     }
 
     auto actualEvict = static_cast<int64_t>(std::max(evictByCache, evictByDisk));
@@ -209,12 +386,29 @@ void FileCachePool::eviction() {
     }
 
     isFull_ = true;
+    auto target = actualEvict;
+    DEFER(cache_io_evicted(target - std::max<int64_t>(actualEvict, 0)));
 
-    while (actualEvict > 0 && !lru_.empty() && !exit_) {
+    if (policy_) {
+        actualEvict -= evictUnits(actualEvict);
+    }
+
+    size_t skipped = 0; // files in a row that nothing could be evicted of, as pinned
+    while (actualEvict > 0 && !lru_.empty() && !exit_ && skipped < lru_.size()) {
         auto fileIter = lru_.back();
         const auto &fileName = fileIter->first;
         auto lruEntry = fileIter->second.get();
         auto fileSize = lruEntry->size;
+        if (!lruEntry->pinned.empty()) {
+            // only open files have pins
+            lru_.access(lruEntry->lruIter);
+            auto freed = punchUnpinned(fileIter);
+            actualEvict -= freed;
+            skipped = freed > 0 ? 0 : skipped + 1;
+            photon::thread_yield();
+            continue;
+        }
+        skipped = 0;
         if (lruEntry->openCount == 0) {
             lru_.mark_key_cleared(fileIter->second->lruIter);
         } else {
@@ -231,8 +425,14 @@ void FileCachePool::eviction() {
 
         {
             photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
+            // drop the sidecar first, it must never claim data that is gone
+            removeBitmap(fileIter);
+            lruEntry->generation++;
             err = mediaFs_->truncate(fileName.data(), 0);
             lruEntry->truncate_done = false;
+            lruEntry->bitmap.clear();
+            lruEntry->bitmap.loaded = true;
+            lruEntry->bitmap.dirty = false;
         }
 
         if (err) {
@@ -253,6 +453,42 @@ void FileCachePool::eviction() {
     }
 }
 
+void FileCachePool::setMarks() {
+    int64_t capacityInBytes = capacityInGB_ * kGB;
+    waterMark_ = calcWaterMark(capacityInBytes, kMaxFreeSpace);
+    // keep this relation : waterMark < riskMark < capacity
+    riskMark_ = std::max(capacityInBytes - kEvictionMark,
+                         (static_cast<int64_t>(waterMark_) + capacityInBytes) >> 1);
+}
+
+// the capacity is in whole GBs as configured, a shrink is evicted down to
+// the new water mark by the next eviction round
+int FileCachePool::resize(size_t n, int flags) {
+    if (n < kGB) {
+        LOG_ERROR_RETURN(EINVAL, -1, "cache capacity ` is less than 1GB", n);
+    }
+    // an eviction round yields, it must not see the marks change under it
+    while (running_) {
+        photon::thread_usleep(1000);
+    }
+    running_ = true;
+    DEFER(running_ = false);
+    LOG_INFO("resize cache capacity from `GB to `GB", capacityInGB_, n / kGB);
+    capacityInGB_ = n / kGB;
+    setMarks();
+    if (policy_) {
+        policy_->resize(capacityInGB_ * kGB / refillUnit_);
+    }
+    return 0;
+}
+
+int FileCachePool::list_files(std::vector<std::string> &names) {
+    names.reserve(names.size() + fileIndex_.size());
+    for (auto &file : fileIndex_)
+        names.emplace_back(file.first.data(), file.first.size());
+    return 0;
+}
+
 uint64_t FileCachePool::calcWaterMark(uint64_t capacity, uint64_t maxFreeSpace) {
     return std::max(static_cast<uint64_t>(capacity * kWaterMarkRatio * 0.01),
                     capacity > maxFreeSpace ? capacity - maxFreeSpace : 0);
@@ -266,6 +502,7 @@ bool FileCachePool::afterFtrucate(FileNameMap::iterator iter) {
         totalUsed_ = 0;
     }
     if (0 == iter->second->openCount) {
+        removeBitmap(iter);
         auto err = mediaFs_->unlink(iter->first.data());
         ERRNO e;
         LOG_ERROR("unlink failed, name : `, ret : `, error code : `", iter->first, err, e);
@@ -275,12 +512,138 @@ bool FileCachePool::afterFtrucate(FileNameMap::iterator iter) {
         if (err && (e.no == EBUSY)) {
             return false;
         }
-        lru_.remove(iter->second->lruIter);
-        fileIndex_.erase(iter);
+        eraseFile(iter);
     }
     return true;
 }
 
+FileCachePool::FileNameMap::iterator FileCachePool::addFile(std::string_view file, int openCount,
+                                                            uint64_t size) {
+    auto lruIter = lru_.push_front(fileIndex_.end());
+    std::unique_ptr<LruEntry> entry(new LruEntry{lruIter, openCount, size});
+    entry->id = nextId_++;
+    auto iter = fileIndex_.emplace(file, std::move(entry)).first;
+    lru_.front() = iter;
+    idIndex_[iter->second->id] = iter;
+    return iter;
+}
+
+void FileCachePool::eraseFile(FileNameMap::iterator iter) {
+    journal(JournalRecord::kRemove, iter->first);
+    // keys of the file left in policy_ are skipped when they are chosen
+    idIndex_.erase(iter->second->id);
+    lru_.remove(iter->second->lruIter);
+    fileIndex_.erase(iter);
+}
+
+// Evicts refill units chosen by policy_, punching them out of their media
+// files, until `size` bytes are freed or no unit is left; returns the bytes freed.
+int64_t FileCachePool::evictUnits(int64_t size) {
+    const size_t kBatch = 64;
+    int64_t freed = 0;
+    std::vector<uint64_t> keys;
+    while (freed < size && policy_->size() > 0 && !exit_) {
+        keys.clear();
+        uint64_t key;
+        size_t popped = 0;
+        while (popped < kBatch && (int64_t)(keys.size() * refillUnit_) < size - freed &&
+               policy_->victim(&key)) {
+            popped++;
+            // a pinned unit leaves the policy, and is tracked again once read
+            if (!isPinned(key))
+                keys.push_back(key);
+        }
+        if (popped == 0) {
+            break;
+        }
+        // units of the same file are punched with a single open
+        std::sort(keys.begin(), keys.end());
+        for (size_t i = 0, j; i < keys.size(); i = j) {
+            for (j = i; j < keys.size() && (keys[j] >> 32) == (keys[i] >> 32); j++)
+                ;
+            auto it = idIndex_.find(keys[i] >> 32);
+            if (it != idIndex_.end()) {
+                freed += punchUnits(it->second, &keys[i], j - i);
+            }
+        }
+        photon::thread_yield();
+    }
+    return freed;
+}
+
+int64_t FileCachePool::punchUnits(FileNameMap::iterator iter, const uint64_t *keys, size_t n) {
+    // the keys are sorted, so adjacent units are punched at once
+    std::vector<std::pair<off_t, size_t>> ranges;
+    for (size_t i = 0; i < n; i++) {
+        off_t offset = (keys[i] & 0xffffffffUL) * refillUnit_;
+        if (!ranges.empty() && ranges.back().first + (off_t)ranges.back().second == offset)
+            ranges.back().second += refillUnit_;
+        else
+            ranges.emplace_back(offset, refillUnit_);
+    }
+    return punchRanges(iter, ranges);
+}
+
+// punches all but the pinned units of a file
+int64_t FileCachePool::punchUnpinned(FileNameMap::iterator iter) {
+    struct stat st = {};
+    if (mediaFs_->stat(iter->first.data(), &st)) {
+        LOG_ERRNO_RETURN(0, 0, "stat failed, name : `", iter->first);
+    }
+    std::vector<std::pair<off_t, size_t>> ranges;
+    off_t begin = 0;
+    for (auto unit : iter->second->pinned) {
+        off_t offset = (off_t)unit * refillUnit_;
+        if (offset >= st.st_size)
+            break;
+        if (offset > begin)
+            ranges.emplace_back(begin, offset - begin);
+        begin = offset + refillUnit_;
+    }
+    if (begin < st.st_size)
+        ranges.emplace_back(begin, st.st_size - begin);
+    return ranges.empty() ? 0 : punchRanges(iter, ranges);
+}
+
+int64_t FileCachePool::punchRanges(FileNameMap::iterator iter,
+                                   const std::vector<std::pair<off_t, size_t>> &ranges) {
+    auto lruEntry = iter->second.get();
+    if (lruEntry->size == 0) {
+        return 0;
+    }
+    auto file = mediaFs_->open(iter->first.data(), O_RDWR);
+    if (!file) {
+        LOG_ERRNO_RETURN(0, 0, "failed to open media file `", iter->first);
+    }
+    DEFER(delete file);
+    struct stat st = {};
+    {
+        photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::WLOCK);
+        // drop the sidecar first, it must never claim data that is gone
+        removeBitmap(iter);
+        lruEntry->generation++;
+        for (auto &r : ranges) {
+            if (file->fallocate(FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, r.first, r.second)) {
+                LOG_ERRNO_RETURN(0, 0, "failed to punch media file `, offset : `", iter->first,
+                                 r.first);
+            }
+            lruEntry->bitmap.unset(r.first / kBitmapBlockSize,
+                                   (r.first + r.second + kBitmapBlockSize - 1) / kBitmapBlockSize);
+        }
+        if (file->fstat(&st)) {
+            LOG_ERRNO_RETURN(0, 0, "fstat failed, name : `", iter->first);
+        }
+    }
+    uint64_t size = st.st_blocks * kDiskBlockSize;
+    int64_t freed = lruEntry->size > size ? lruEntry->size - size : 0;
+    totalUsed_ = std::max(totalUsed_ - freed, (int64_t)0);
+    lruEntry->size = size;
+    if (size == 0 && lruEntry->openCount == 0) {
+        afterFtrucate(iter);
+    }
+    return freed;
+}
+
 int FileCachePool::traverseDir(const std::string &root) {
     for (auto file : enumerable(Walker(mediaFs_, root))) {
         insertFile(file);
@@ -289,19 +652,328 @@ int FileCachePool::traverseDir(const std::string &root) {
 }
 
 int FileCachePool::insertFile(std::string_view file) {
+    std::string_view suffix(kBitmapSuffix);
+    if (file.size() > suffix.size() && file.substr(file.size() - suffix.size()) == suffix) {
+        return 0;
+    }
+    if (file.substr(0, strlen(kMetaFile)) == kMetaFile ||
+        file.substr(0, strlen(kJournalFile)) == kJournalFile) {
+        return 0;
+    }
     struct stat st = {};
     auto ret = mediaFs_->stat(file.data(), &st);
     if (ret) {
         LOG_ERRNO_RETURN(0, -1, "stat failed, name : `", file.data());
     }
     auto fileSize = st.st_blocks * kDiskBlockSize;
-
-    auto lruIter = lru_.push_front(fileIndex_.end());
-    auto entry = std::unique_ptr<LruEntry>(new LruEntry{lruIter, 0, fileSize});
-    auto iter = fileIndex_.emplace(file, std::move(entry)).first;
-    lru_.front() = iter;
+    addFile(file, 0, fileSize);
     totalUsed_ += fileSize;
     return 0;
 }
 
+void FileCachePool::removeBitmap(FileNameMap::iterator iter) {
+    std::string name(iter->first.data(), iter->first.size());
+    mediaFs_->unlink((name + kBitmapSuffix).c_str());
+}
+
+// Loads the block bitmap of `iter` from its sidecar file. Without a valid
+// sidecar, e.g. for media files cached by older versions, the bitmap is
+// rebuilt once from fiemap of the media file.
+int FileCachePool::loadBitmap(FileNameMap::iterator iter, IFile *media) {
+    auto &bitmap = iter->second->bitmap;
+    if (bitmap.loaded) {
+        return 0;
+    }
+    struct stat st = {};
+    if (media->fstat(&st) < 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to fstat media file `", iter->first);
+    }
+    bitmap.clear();
+    std::string name(iter->first.data(), iter->first.size());
+    auto side = mediaFs_->open((name + kBitmapSuffix).c_str(), O_RDONLY);
+    if (side) {
+        DEFER(delete side);
+        BitmapHeader h;
+        if (side->pread(&h, sizeof(h), 0) == sizeof(h) && h.magic == BitmapHeader::kMagic &&
+            h.block_size == kBitmapBlockSize && h.media_size == (uint64_t)st.st_size &&
+            h.nwords <= ((uint64_t)st.st_size / kBitmapBlockSize + 64) / 64) {
+            auto &words = bitmap.words();
+            words.resize(h.nwords);
+            auto bytes = h.nwords * sizeof(uint64_t);
+            if (side->pread(words.data(), bytes, sizeof(h)) == (ssize_t)bytes) {
+                bitmap.loaded = true;
+                bitmap.dirty = false;
+                return 0;
+            }
+        }
+        LOG_WARN("invalid block bitmap of `, rebuild it", iter->first);
+        bitmap.clear();
+    }
+
+    // mark the blocks completely covered by written extents
+    uint64_t offset = 0, size = st.st_size;
+    while (offset < size) {
+        struct fiemap_t<kFieExtentSize> fie(offset, size - offset);
+        fie.fm_mapped_extents = 0;
+        if (media->fiemap(&fie) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "media fiemap failed, name : `, offset : `", iter->first,
+                             offset);
+        }
+        if (fie.fm_mapped_extents == 0) {
+            break;
+        }
+        auto last = false;
+        auto prev = offset;
+        for (uint32_t i = 0; i < fie.fm_mapped_extents; i++) {
+            auto &extent = fie.fm_extents[i];
+            last = extent.fe_flags & FIEMAP_EXTENT_LAST;
+            offset = extent.fe_logical_end();
+            if ((extent.fe_flags & FIEMAP_EXTENT_UNKNOWN) ||
+                (extent.fe_flags & FIEMAP_EXTENT_UNWRITTEN))
+                continue;
+            auto end = extent.fe_logical_end();
+            // the last block of the file may be partial
+            auto right = end >= size ? (size + kBitmapBlockSize - 1) / kBitmapBlockSize
+                                     : end / kBitmapBlockSize;
+            bitmap.set((extent.fe_logical + kBitmapBlockSize - 1) / kBitmapBlockSize, right);
+        }
+        if (last || offset <= prev) {
+            break;
+        }
+    }
+    bitmap.loaded = true;
+    bitmap.dirty = true;
+    return 0;
+}
+
+// Persists the block bitmap of `iter`, after syncing the media file, so
+// that the sidecar never claims more than what is durable.
+int FileCachePool::saveBitmap(FileNameMap::iterator iter, IFile *media) {
+    auto &bitmap = iter->second->bitmap;
+    if (!bitmap.loaded || !bitmap.dirty) {
+        return 0;
+    }
+    struct stat st = {};
+    if (media->fstat(&st) < 0 || media->fdatasync() < 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to sync media file `", iter->first);
+    }
+    std::string name(iter->first.data(), iter->first.size());
+    auto side = mediaFs_->open((name + kBitmapSuffix).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (!side) {
+        LOG_ERRNO_RETURN(0, -1, "failed to open block bitmap of `", iter->first);
+    }
+    DEFER(delete side);
+    auto &words = bitmap.words();
+    BitmapHeader h;
+    h.block_size = kBitmapBlockSize;
+    h.media_size = st.st_size;
+    h.nwords = words.size();
+    auto bytes = words.size() * sizeof(uint64_t);
+    if (side->pwrite(&h, sizeof(h), 0) != sizeof(h) ||
+        side->pwrite(words.data(), bytes, sizeof(h)) != (ssize_t)bytes) {
+        LOG_ERRNO_RETURN(0, -1, "failed to write block bitmap of `", iter->first);
+    }
+    bitmap.dirty = false;
+    return 0;
+}
+
+static int read_all(IFileSystem *fs, const char *name, std::string *buf) {
+    auto file = fs->open(name, O_RDONLY);
+    if (!file) {
+        return -1;
+    }
+    DEFER(delete file);
+    struct stat st = {};
+    if (file->fstat(&st) < 0) {
+        LOG_ERRNO_RETURN(0, -1, "fstat failed, name : `", name);
+    }
+    buf->resize(st.st_size);
+    if (file->pread(&(*buf)[0], st.st_size, 0) != st.st_size) {
+        LOG_ERRNO_RETURN(0, -1, "failed to read `", name);
+    }
+    return 0;
+}
+
+// Rebuilds the index from the latest checkpoint, instead of walking the media.
+int FileCachePool::loadMeta() {
+    std::string buf;
+    if (read_all(mediaFs_, metaFile_.c_str(), &buf) < 0) {
+        return -1;
+    }
+    MetaHeader h;
+    if (buf.size() < sizeof(h)) {
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid cache meta, size : `", buf.size());
+    }
+    memcpy(&h, buf.data(), sizeof(h));
+    if (h.magic != MetaHeader::kMagic || h.nshards != nshards_ ||
+        h.crc != crc32c(buf.data() + sizeof(h), buf.size() - sizeof(h))) {
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid cache meta, magic : `, crc : `", HEX(h.magic),
+                         h.crc);
+    }
+    size_t pos = sizeof(h);
+    for (uint64_t i = 0; i < h.count; i++) {
+        MetaRecord r;
+        if (pos + sizeof(r) > buf.size()) {
+            break;
+        }
+        memcpy(&r, buf.data() + pos, sizeof(r));
+        pos += sizeof(r);
+        if (pos + r.len > buf.size()) {
+            break;
+        }
+        std::string_view name(buf.data() + pos, r.len);
+        pos += r.len;
+        if (fileIndex_.find(name) == fileIndex_.end()) {
+            addFile(name, 0, r.size);
+            totalUsed_ += r.size;
+        }
+    }
+    if (pos != buf.size()) {
+        // the crc passed, so this is a bug rather than a torn write
+        fileIndex_.clear();
+        idIndex_.clear();
+        lru_ = LRUContainer();
+        totalUsed_ = 0;
+        LOG_ERROR_RETURN(EINVAL, -1, "corrupted cache meta, records : `", h.count);
+    }
+    generation_ = h.generation;
+    return 0;
+}
+
+// Applies the files created or removed after the checkpoint; a torn record
+// at the tail, from a crash, ends the journal.
+int FileCachePool::replayJournal() {
+    std::string buf;
+    uint64_t generation;
+    if (read_all(mediaFs_, journalFile_.c_str(), &buf) < 0 || buf.size() < sizeof(generation)) {
+        return 0;
+    }
+    memcpy(&generation, buf.data(), sizeof(generation));
+    if (generation != generation_) {
+        return 0; // written before the checkpoint
+    }
+    size_t pos = sizeof(generation), added = 0, removed = 0;
+    JournalRecord r;
+    while (pos + sizeof(r) <= buf.size()) {
+        memcpy(&r, buf.data() + pos, sizeof(r));
+        auto name = buf.data() + pos + sizeof(r);
+        if (pos + sizeof(r) + r.len > buf.size() || r.crc != r.calc_crc(name)) {
+            break;
+        }
+        pos += sizeof(r) + r.len;
+        std::string file(name, r.len);
+        auto iter = fileIndex_.find(file);
+        if (r.op == JournalRecord::kAdd && iter == fileIndex_.end()) {
+            struct stat st = {};
+            if (mediaFs_->stat(file.c_str(), &st) == 0) {
+                addFile(file, 0, st.st_blocks * kDiskBlockSize);
+                totalUsed_ += st.st_blocks * kDiskBlockSize;
+                added++;
+            }
+        } else if (r.op == JournalRecord::kRemove && iter != fileIndex_.end() &&
+                   mediaFs_->access(file.c_str(), F_OK) != 0) {
+            totalUsed_ = std::max(totalUsed_ - (int64_t)iter->second->size, (int64_t)0);
+            eraseFile(iter);
+            removed++;
+        }
+    }
+    LOG_INFO("cache journal replayed, added : `, removed : `", added, removed);
+    return 0;
+}
+
+void FileCachePool::journal(char op, std::string_view file) {
+    if (!journal_ && !journalBuffering_) {
+        return;
+    }
+    JournalRecord r;
+    r.op = op;
+    r.len = file.size();
+    r.crc = r.calc_crc(file.data());
+    std::string rec((char *)&r, sizeof(r));
+    rec.append(file.data(), file.size());
+    if (journalBuffering_) {
+        journalBuf_.append(rec);
+        return;
+    }
+    // reserve the space first, as pwrite() may yield
+    auto offset = journalOffset_;
+    journalOffset_ += rec.size();
+    journalDirty_ = true;
+    if (journal_->pwrite(rec.data(), rec.size(), offset) != (ssize_t)rec.size()) {
+        LOG_ERRNO_RETURN(0, , "failed to write cache journal");
+    }
+}
+
+// Starts an empty journal following checkpoint generation_, then writes the
+// records logged while the checkpoint was being written.
+int FileCachePool::resetJournal() {
+    delete journal_;
+    journalOffset_ = 0;
+    journal_ = mediaFs_->open(journalFile_.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (!journal_) {
+        LOG_ERRNO_RETURN(0, -1, "failed to open cache journal");
+    }
+    if (journal_->pwrite(&generation_, sizeof(generation_), 0) != sizeof(generation_)) {
+        LOG_ERRNO_RETURN(0, -1, "failed to write cache journal");
+    }
+    journalOffset_ = sizeof(generation_);
+    while (!journalBuf_.empty()) {
+        std::string buf;
+        buf.swap(journalBuf_);
+        if (journal_->pwrite(buf.data(), buf.size(), journalOffset_) != (ssize_t)buf.size()) {
+            LOG_ERRNO_RETURN(0, -1, "failed to write cache journal");
+        }
+        journalOffset_ += buf.size();
+    }
+    journalDirty_ = true;
+    return 0;
+}
+
+int FileCachePool::checkpoint() {
+    if (journalBuffering_) {
+        return 0;
+    }
+    lastCheckpoint_ = photon::now;
+    // the index is serialized without yielding, changes after
+    // that go to the journal of the new generation
+    MetaHeader h;
+    h.generation = generation_ + 1;
+    h.count = 0;
+    h.nshards = nshards_;
+    std::string buf(sizeof(h), 0);
+    lru_.for_each_reverse([&](FileNameMap::iterator iter) {
+        MetaRecord r;
+        r.size = iter->second->size;
+        r.len = iter->first.size();
+        buf.append((char *)&r, sizeof(r)).append(iter->first.data(), iter->first.size());
+        h.count++;
+    });
+    h.crc = crc32c(buf.data() + sizeof(h), buf.size() - sizeof(h));
+    memcpy(&buf[0], &h, sizeof(h));
+    journalBuffering_ = true;
+    journalBuf_.clear();
+    DEFER(journalBuffering_ = false);
+
+    std::string tmp = metaFile_ + ".tmp";
+    auto file = mediaFs_->open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = file && file->pwrite(buf.data(), buf.size(), 0) == (ssize_t)buf.size() &&
+              file->fdatasync() == 0;
+    delete file;
+    if (!ok || mediaFs_->rename(tmp.c_str(), metaFile_.c_str()) != 0) {
+        ERRNO e;
+        LOG_ERROR("failed to checkpoint cache meta, error : `", e);
+        // keep the current journal, with the records logged in between
+        auto records = std::move(journalBuf_);
+        journalBuffering_ = false;
+        if (!records.empty() && journal_) {
+            auto offset = journalOffset_;
+            journalOffset_ += records.size();
+            journal_->pwrite(records.data(), records.size(), offset);
+        }
+        return -1;
+    }
+    generation_ = h.generation;
+    return resetJournal();
+}
+
 } //  namespace Cache
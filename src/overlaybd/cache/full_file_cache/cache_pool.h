@@ -18,6 +18,7 @@
 
 #include <map>
 #include <memory>
+#include <set>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -25,7 +26,9 @@
 #include <photon/thread/timer.h>
 #include <photon/common/string-keyed.h>
 #include "../policy/lru.h"
+#include "../policy/policy.h"
 #include "../pool_store.h"
+#include "block_bitmap.h"
 
 #include <photon/fs/filesystem.h>
 
@@ -34,14 +37,21 @@ namespace Cache {
 class FileCachePool : public FileSystem::ICachePool {
 public:
     FileCachePool(photon::fs::IFileSystem *mediaFs, uint64_t capacityInGB, uint64_t periodInUs,
-                  uint64_t diskAvailInBytes, uint64_t refillUnit);
+                  uint64_t diskAvailInBytes, uint64_t refillUnit, int evictionPolicy = EVICT_LRU,
+                  uint32_t shard = 0, uint32_t nshards = 1);
     ~FileCachePool();
 
     static const uint64_t kDiskBlockSize = 512; // stat(2)
     static const uint64_t kDeleteDelayInUs = 1000;
     static const uint32_t kWaterMarkRatio = 90;
+    // pinned units take up to this percent of the capacity, see pin()
+    static const uint32_t kPinRatio = 20;
 
     void Init();
+    // Init() in two steps, for shards: recover() the index from the
+    // checkpoint, and start() the eviction after it's built
+    int recover();
+    void start();
 
     //  pathname must begin with '/'
     FileSystem::ICacheStore *do_open(std::string_view pathname, int flags, mode_t mode) override;
@@ -53,6 +63,9 @@ public:
     int evict(std::string_view filename) override;
     int evict(size_t size = 0) override;
     int rename(std::string_view oldname, std::string_view newname) override;
+    // sets the capacity to `n` bytes, rounded down to GBs
+    int resize(size_t n, int flags = 0) override;
+    int list_files(std::vector<std::string> &names) override;
 
     struct LruEntry {
         LruEntry(uint32_t lruIt, int openCnt, uint64_t fileSize)
@@ -60,10 +73,15 @@ public:
         }
         ~LruEntry() = default;
         uint32_t lruIter;
+        uint32_t id = 0; // identifies the file in the keys of policy_
         int openCount;
         uint64_t size;
         photon::rwlock rw_lock_;
         bool truncate_done;
+        BlockBitmap bitmap; // shared by all the stores of the file
+        // refill units kept from eviction while the file is open, see pin()
+        std::set<uint32_t> pinned;
+        uint64_t generation = 0; // bumped whenever data of the file is dropped
     };
 
     // Normally, fileIndex(std::map) always keep growing, so its iterators always
@@ -76,14 +94,40 @@ public:
     void removeOpenFile(FileNameMap::iterator iter);
     void forceRecycle();
     void updateLru(FileNameMap::iterator iter);
+    // records an access to the refill units of [offset, offset + count)
+    void updatePolicy(FileNameMap::iterator iter, off_t offset, size_t count);
     uint64_t updateSpace(FileNameMap::iterator iter, uint64_t size);
+    // pins the refill units of [offset, offset + count) until the file is
+    // closed: they're skipped by the unit policy, and the file LRU punches
+    // the rest of the file instead of truncating it; units beyond kPinRatio
+    // of the capacity aren't pinned, failing with ENOSPC
+    int pin(FileNameMap::iterator iter, off_t offset, size_t count);
+
+    // the cached blocks of a media file are tracked by a bitmap of
+    // kBitmapBlockSize blocks, persisted in a sidecar file named by
+    // appending kBitmapSuffix to the media file's name
+    static const uint64_t kBitmapBlockSize = 4 * 1024;
+    static constexpr const char *kBitmapSuffix = ".bitmap";
+
+    // the index (files, their sizes and LRU order) is checkpointed to kMetaFile
+    // periodically and on exit, and files created or removed since then are
+    // logged in kJournalFile, so that Init() doesn't walk the whole media
+    static constexpr const char *kMetaFile = "/.cache_meta";
+    static constexpr const char *kJournalFile = "/.cache_journal";
+    static const uint64_t kCheckpointIntervalInUs = 10ULL * 60 * 1000 * 1000;
+    int checkpoint();
+    int loadBitmap(FileNameMap::iterator iter, photon::fs::IFile *media);
+    int saveBitmap(FileNameMap::iterator iter, photon::fs::IFile *media);
 
 protected:
     photon::fs::IFile *openMedia(std::string_view name, int flags, int mode);
 
     static uint64_t timerHandler(void *data);
     virtual void eviction();
+    int64_t groupUsed();
+    double evictionShare();
     uint64_t calcWaterMark(uint64_t capacity, uint64_t maxFreeSpace);
+    void setMarks();
 
     photon::fs::IFileSystem *mediaFs_; //  owned by current class
     uint64_t capacityInGB_;
@@ -93,6 +137,8 @@ protected:
     int64_t totalUsed_;
     int64_t riskMark_;
     uint64_t waterMark_;
+    uint64_t pinnedBytes_ = 0; // of all the files, by refill units
+    bool pinWarned_ = false;   // until pinnedBytes_ goes below the cap again
 
     photon::Timer *timer_;
     bool running_;
@@ -104,11 +150,50 @@ protected:
 
     int traverseDir(const std::string &root);
     virtual int insertFile(std::string_view file);
+    void removeBitmap(FileNameMap::iterator iter);
+    int loadMeta();
+    int replayJournal();
+    void journal(char op, std::string_view file);
+    int resetJournal();
+    FileNameMap::iterator addFile(std::string_view file, int openCount, uint64_t size);
+    void eraseFile(FileNameMap::iterator iter);
+    int64_t evictUnits(int64_t size);
+    int64_t punchUnits(FileNameMap::iterator iter, const uint64_t *keys, size_t n);
+    int64_t punchUnpinned(FileNameMap::iterator iter);
+    int64_t punchRanges(FileNameMap::iterator iter,
+                        const std::vector<std::pair<off_t, size_t>> &ranges);
+    bool isPinned(uint64_t key);
 
     typedef FileSystem::LRU<FileNameMap::iterator, uint32_t> LRUContainer;
     LRUContainer lru_;
     // filename -> lruEntry
     FileNameMap fileIndex_;
+    // with a unit policy, refill units are evicted first, keyed by
+    // (LruEntry::id << 32 | unit index); the file LRU above only takes
+    // over for files it knows nothing about, e.g. those cached before start
+    std::unique_ptr<FileSystem::ICachePolicy> policy_;
+    std::unordered_map<uint32_t, FileNameMap::iterator> idIndex_;
+    uint32_t nextId_ = 0;
+
+    photon::fs::IFile *journal_ = nullptr;
+    off_t journalOffset_ = 0;
+    uint64_t generation_ = 0; // of the checkpoint the journal follows
+    bool journalDirty_ = false;
+    // while a checkpoint is being written, records are kept in journalBuf_
+    bool journalBuffering_ = false;
+    std::string journalBuf_;
+    uint64_t lastCheckpoint_ = 0;
+
+    uint32_t nshards_;
+    std::string metaFile_, journalFile_;
+    bool ownsMediaFs_ = true;
+    // all the shards (including this) of a ShardedFileCachePool, or all the
+    // pools of a FileCacheGroup
+    const std::vector<FileCachePool *> *group_ = nullptr;
+    // the usage of a pool in a FileCacheGroup not evicted for the others
+    int64_t reserved_ = 0;
+    friend class ShardedFileCachePool;
+    friend class FileCacheGroup;
 };
 
 } //  namespace Cache
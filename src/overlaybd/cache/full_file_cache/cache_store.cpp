@@ -20,7 +20,6 @@
 #include <sys/uio.h>
 #include <photon/common/alog.h>
 #include <photon/common/alog-audit.h>
-#include <photon/fs/fiemap.h>
 #include <photon/fs/filesystem.h>
 #include <photon/common/iovector.h>
 #include "cache_pool.h"
@@ -31,16 +30,21 @@ using namespace photon::fs;
 namespace Cache {
 
 const uint64_t kDiskBlockSize = 512; // stat(2)
-constexpr int kFieExtentSize = 1000;
-const int kBlockSize = 4 * 1024;
+const uint64_t kBlockSize = FileCachePool::kBitmapBlockSize;
+const uint64_t kDirectAlignment = 4096;
 
 FileCacheStore::FileCacheStore(FileSystem::ICachePool *cachePool, IFile *localFile,
-                               size_t refillUnit, FileIterator iterator)
+                               size_t refillUnit, FileIterator iterator, IFile *directFile)
     : cachePool_(static_cast<FileCachePool *>(cachePool)), localFile_(localFile),
-      refillUnit_(refillUnit), iterator_(iterator) {
+      directFile_(directFile), refillUnit_(refillUnit), iterator_(iterator) {
 }
 
 FileCacheStore::~FileCacheStore() {
+    // the last store of a file persists its refill bitmap
+    if (iterator_->second->openCount == 1) {
+        cachePool_->saveBitmap(iterator_, localFile_);
+    }
+    delete directFile_;
     delete localFile_; //  will close file
     cachePool_->removeOpenFile(iterator_);
 }
@@ -59,6 +63,9 @@ ssize_t FileCacheStore::do_preadv2(const struct iovec *iov, int iovcnt, off_t of
     cachePool_->updateLru(iterator_);
     SCOPE_AUDIT_THRESHOLD(1UL * 1000, "file:read", AU_FILEOP("", offset, ret));
     ret = localFile_->preadv(iov, iovcnt, offset);
+    if (ret > 0) {
+        cachePool_->updatePolicy(iterator_, offset, ret);
+    }
     return ret;
 }
 
@@ -76,11 +83,31 @@ ssize_t FileCacheStore::do_pwritev(const struct iovec *iov, int iovcnt, off_t of
         lruEntry->truncate_done = true;
     }
     ScopedRangeLock lock(rangeLock_, offset, view.sum());
-    SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:write", AU_FILEOP("", offset, ret));
-    ret = localFile_->pwritev(iov, iovcnt, offset);
+    {
+        SCOPE_AUDIT_THRESHOLD(10UL * 1000, "file:write", AU_FILEOP("", offset, ret));
+        auto file = directWritable(iov, iovcnt, offset) ? directFile_ : localFile_;
+        ret = file->pwritev(iov, iovcnt, offset);
+    }
+    if (ret > 0 && lruEntry->bitmap.loaded) {
+        // only blocks completely written are marked, the last one of the file may be partial
+        off_t end = offset + ret;
+        auto right = end >= actual_size_ ? align_up(end, kBlockSize) / kBlockSize
+                                         : end / kBlockSize;
+        lruEntry->bitmap.set(align_up(offset, kBlockSize) / kBlockSize, right);
+    }
     return ret;
 }
 
+bool FileCacheStore::directWritable(const struct iovec *iov, int iovcnt, off_t offset) {
+    if (!directFile_ || offset % kDirectAlignment)
+        return false;
+    for (int i = 0; i < iovcnt; i++) {
+        if ((uint64_t)iov[i].iov_base % kDirectAlignment || iov[i].iov_len % kDirectAlignment)
+            return false;
+    }
+    return true;
+}
+
 ssize_t FileCacheStore::do_pwritev2(const struct iovec *iov, int iovcnt, off_t offset, int flags) {
     if (cacheIsFull()) {
         errno = ENOSPC;
@@ -99,6 +126,7 @@ ssize_t FileCacheStore::do_pwritev2(const struct iovec *iov, int iovcnt, off_t o
             LOG_ERRNO_RETURN(0, ret, "fstat failed")
         }
         cachePool_->updateLru(iterator_);
+        cachePool_->updatePolicy(iterator_, offset, ret);
         cachePool_->updateSpace(iterator_, kDiskBlockSize * st.st_blocks);
     }
     return ret;
@@ -106,63 +134,19 @@ ssize_t FileCacheStore::do_pwritev2(const struct iovec *iov, int iovcnt, off_t o
 
 std::pair<off_t, size_t> FileCacheStore::queryRefillRange(off_t offset, size_t size) {
     ScopedRangeLock lock(rangeLock_, offset, size);
-    off_t alignLeft = align_down(offset, kBlockSize);
-    off_t alignRight = align_up(offset + size, kBlockSize);
-    ReadRequest request{alignLeft, static_cast<size_t>(alignRight - alignLeft)};
-    struct fiemap_t<kFieExtentSize> fie(request.offset, request.size);
-    fie.fm_mapped_extents = 0;
-
-    if (request.size > 0) { //  fiemap cannot handle size zero.
-        auto ok = localFile_->fiemap(&fie);
-        if (ok != 0) {
-            LOG_ERRNO_RETURN(0, std::make_pair(-1, 0),
-                             "media fiemap failed : `, offset : `, size : `", ok, request.offset,
-                             request.size);
-        }
-        if (fie.fm_mapped_extents >= kFieExtentSize) { // TODO: qisheng.ds
-                                                       // it's supposed to be solved by
-                                                       // get fie extents twice,
-                                                       // but just do not concern much
-                                                       // about it rightnow.
-            LOG_ERROR_RETURN(EINVAL, std::make_pair(-1, 0), "read size is too big : `",
-                             request.size);
-        }
-    }
-
-    uint64_t holeStart = request.offset;
-    uint64_t holeEnd = request.offset + request.size;
-
-    for (ssize_t i = (ssize_t)(fie.fm_mapped_extents) - 1; i >= 0; i--) {
-        auto &extent = fie.fm_extents[i];
-        if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
-            (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
-            continue;
-        if (extent.fe_logical < holeEnd) {
-            if (extent.fe_logical_end() >= holeEnd) {
-                holeEnd = extent.fe_logical;
-            } else
-                break;
-        }
-    }
-
-    for (uint32_t i = 0; i < fie.fm_mapped_extents; i++) {
-        auto &extent = fie.fm_extents[i];
-        if ((extent.fe_flags == FIEMAP_EXTENT_UNKNOWN) ||
-            (extent.fe_flags == FIEMAP_EXTENT_UNWRITTEN))
-            continue;
-        if (extent.fe_logical_end() > holeStart) {
-            if (extent.fe_logical <= holeStart) {
-                holeStart = extent.fe_logical_end();
-            } else
-                break;
-        }
+    auto lruEntry = static_cast<FileCachePool::LruEntry *>(iterator_->second.get());
+    if (!lruEntry->bitmap.loaded && cachePool_->loadBitmap(iterator_, localFile_) < 0) {
+        return std::make_pair(-1, 0);
     }
-
-    if (holeStart >= holeEnd)
+    if (size == 0)
+        return std::make_pair(0, 0);
+    auto hole = lruEntry->bitmap.missing(align_down(offset, kBlockSize) / kBlockSize,
+                                         align_up(offset + size, kBlockSize) / kBlockSize);
+    if (hole.first >= hole.second)
         return std::make_pair(0, 0);
     // CacheMiss
-    auto left = align_down(holeStart, refillUnit_);
-    auto right = align_up(holeEnd, refillUnit_);
+    auto left = align_down(hole.first * kBlockSize, refillUnit_);
+    auto right = align_up(hole.second * kBlockSize, refillUnit_);
     return std::make_pair(left, right - left);
 }
 
@@ -177,6 +161,7 @@ int FileCacheStore::stat(CacheStat *stat) {
 }
 
 int FileCacheStore::evict(off_t offset, size_t count) {
+    iterator_->second->generation++;
     if (static_cast<size_t>(-1) == count) {
         return localFile_->ftruncate(offset);
     } else {
@@ -195,6 +180,15 @@ int FileCacheStore::fstat(struct stat *buf) {
     return localFile_->fstat(buf);
 }
 
+int FileCacheStore::pin(off_t offset, size_t count) {
+    return cachePool_->pin(iterator_, offset, count);
+}
+
+int FileCacheStore::get_generation(uint64_t *gen) {
+    *gen = iterator_->second->generation;
+    return 0;
+}
+
 bool FileCacheStore::cacheIsFull() {
     return cachePool_->isFull();
 }
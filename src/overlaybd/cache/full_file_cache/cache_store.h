@@ -28,7 +28,8 @@ class FileCacheStore : public FileSystem::ICacheStore {
 public:
     typedef FileCachePool::FileNameMap::iterator FileIterator;
     FileCacheStore(FileSystem::ICachePool *cachePool, photon::fs::IFile *localFile,
-                   size_t refillUnit, FileIterator iterator);
+                   size_t refillUnit, FileIterator iterator,
+                   photon::fs::IFile *directFile = nullptr);
     ~FileCacheStore();
 
     try_preadv_result try_preadv2(const struct iovec *iov, int iovcnt, off_t offset, int flags) override;
@@ -45,30 +46,22 @@ public:
 
     int fstat(struct stat *buf) override;
 
-protected:
-    bool cacheIsFull();
-
-    struct ReadRequest {
-        off_t offset;
-        size_t size;
-    };
+    int pin(off_t offset, size_t count) override;
 
-    //  merge from first extent to last extent(or encounter hole),
-    //  because fiemap could return multiple continuous extents even though no any hole.
-    std::pair<off_t, size_t> getFirstMergedExtents(struct fiemap *fie);
+    int get_generation(uint64_t *gen) override;
 
-    std::pair<off_t, size_t> getLastMergedExtents(struct fiemap *fie);
-
-    std::pair<off_t, off_t> getHoleFromCacheHitResult(off_t offset, size_t alignSize,
-                                                      struct fiemap *fie);
+protected:
+    bool cacheIsFull();
 
     FileCachePool *cachePool_;     //  owned by extern class
     photon::fs::IFile *localFile_; //  owned by current class
+    photon::fs::IFile *directFile_; //  the media opened with O_DIRECT, for aligned writes
     size_t refillUnit_;
     FileIterator iterator_;
     RangeLock rangeLock_;
 
     ssize_t do_pwritev(const struct iovec *iov, int iovcnt, off_t offset);
+    bool directWritable(const struct iovec *iov, int iovcnt, off_t offset);
 };
 
 } //  namespace Cache
@@ -0,0 +1,164 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "compressed_store.h"
+#include <stdlib.h>
+#include <string.h>
+#include <memory>
+#include <photon/common/alog.h>
+#include <photon/common/iovector.h>
+#include <photon/common/utility.h>
+#include <photon/common/checksum/crc32c.h>
+#include "../../zfile/lz4/lz4.h"
+#include "../../buffer_pool.h"
+
+using namespace photon::fs;
+
+namespace Cache {
+
+namespace {
+// copies `count` bytes of `buf` into `iov`, from `skip` bytes of it
+void copy_to_iov(const struct iovec *iov, int iovcnt, size_t skip, const char *buf,
+                 size_t count) {
+    for (int i = 0; i < iovcnt && count; i++) {
+        if (skip >= iov[i].iov_len) {
+            skip -= iov[i].iov_len;
+            continue;
+        }
+        auto n = std::min(count, iov[i].iov_len - skip);
+        memcpy((char *)iov[i].iov_base + skip, buf, n);
+        buf += n;
+        count -= n;
+        skip = 0;
+    }
+}
+} // namespace
+
+int CompressedFileCacheStore::read_unit(off_t offset, size_t count, char *buf, size_t from,
+                                        size_t to) {
+    auto head = std::min(count, kSlotAlignment);
+    if (localFile_->pread(buf, head, offset) != (ssize_t)head)
+        LOG_ERRNO_RETURN(0, -1, "failed to read cache slot at `", offset);
+    auto h = (SlotHeader *)buf;
+    if (count <= kSlotAlignment || h->magic != SlotHeader::MAGIC) {
+        // kept as is
+        from = std::max(from, head);
+        if (to > from &&
+            localFile_->pread(buf + from, to - from, offset + from) != (ssize_t)(to - from))
+            LOG_ERRNO_RETURN(0, -1, "failed to read cache slot at `", offset);
+        return 0;
+    }
+    if (h->size > count - sizeof(SlotHeader))
+        LOG_ERROR_RETURN(EIO, -1, "invalid cache slot at `, size: `", offset, h->size);
+    auto total = sizeof(SlotHeader) + h->size;
+    auto compressed = BufferPool::buffer(total);
+    if (!compressed)
+        LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate ` bytes", total);
+    memcpy(compressed.get(), buf, std::min(total, head));
+    if (total > head &&
+        localFile_->pread(compressed.get() + head, total - head, offset + head) !=
+            (ssize_t)(total - head))
+        LOG_ERRNO_RETURN(0, -1, "failed to read cache slot at `", offset);
+    h = (SlotHeader *)compressed.get();
+    auto data = compressed.get() + sizeof(SlotHeader);
+    if (crc32c(data, h->size) != h->crc)
+        LOG_ERROR_RETURN(EIO, -1, "checksum mismatch of cache slot at `", offset);
+    if (LZ4_decompress_safe(data, buf, h->size, count) != (int)count)
+        LOG_ERROR_RETURN(EIO, -1, "failed to decompress cache slot at `", offset);
+    return 0;
+}
+
+ssize_t CompressedFileCacheStore::do_preadv2(const struct iovec *iov, int iovcnt, off_t offset,
+                                             int flags) {
+    iovector_view view((struct iovec *)iov, iovcnt);
+    size_t count = view.sum();
+    if (offset >= actual_size_)
+        return 0;
+    count = std::min(count, (size_t)(actual_size_ - offset));
+    cachePool_->updateLru(iterator_);
+    auto unit = BufferPool::buffer(refillUnit_);
+    if (!unit)
+        LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate ` bytes", refillUnit_);
+    size_t done = 0;
+    while (done < count) {
+        off_t pos = offset + done;
+        off_t unit_off = pos / refillUnit_ * refillUnit_;
+        auto len = std::min(refillUnit_, (size_t)(actual_size_ - unit_off));
+        auto n = std::min(count - done, (size_t)(unit_off + len - pos));
+        if (read_unit(unit_off, len, unit.get(), pos - unit_off, pos - unit_off + n) < 0)
+            return -1;
+        copy_to_iov(iov, iovcnt, done, unit.get() + (pos - unit_off), n);
+        done += n;
+    }
+    cachePool_->updatePolicy(iterator_, offset, count);
+    return count;
+}
+
+ssize_t CompressedFileCacheStore::do_pwritev2(const struct iovec *iov, int iovcnt, off_t offset,
+                                              int flags) {
+    SmartCloneIOV<32> ciov(iov, iovcnt);
+    iovector_view view(ciov.iov, iovcnt);
+    size_t count = view.sum();
+    if (offset % refillUnit_ || (count % refillUnit_ && offset + count < (size_t)actual_size_))
+        LOG_ERROR_RETURN(EINVAL, -1,
+                         "compressed cache is written in whole units, offset: `, count: `", offset,
+                         count);
+    auto raw = BufferPool::buffer(refillUnit_);
+    auto compressed = BufferPool::buffer(refillUnit_);
+    if (!raw || !compressed)
+        LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate buffers of compressed cache");
+    auto lruEntry = static_cast<FileCachePool::LruEntry *>(iterator_->second.get());
+    const uint64_t kBlockSize = FileCachePool::kBitmapBlockSize;
+    size_t done = 0;
+    while (done < count) {
+        off_t unit_off = offset + done;
+        auto len = std::min(refillUnit_, count - done);
+        view.extract_front(len, raw.get());
+        auto slot = align_up(len, kSlotAlignment);
+        char *src = raw.get();
+        size_t wlen = len;
+        int clen = 0;
+        if (len > kSlotAlignment)
+            clen = LZ4_compress_default(raw.get(), compressed.get() + sizeof(SlotHeader), len,
+                                        len - sizeof(SlotHeader));
+        if (clen > 0 && align_up(sizeof(SlotHeader) + clen, kSlotAlignment) < slot) {
+            auto h = (SlotHeader *)compressed.get();
+            h->magic = SlotHeader::MAGIC;
+            h->size = clen;
+            h->crc = crc32c(compressed.get() + sizeof(SlotHeader), clen);
+            wlen = align_up(sizeof(SlotHeader) + clen, kSlotAlignment);
+            memset(compressed.get() + sizeof(SlotHeader) + clen, 0,
+                   wlen - sizeof(SlotHeader) - clen);
+            src = compressed.get();
+            // the rest of the slot may hold an earlier copy of the unit
+            evict(unit_off + wlen, slot - wlen);
+        }
+        struct iovec v = {src, wlen};
+        auto ret = FileCacheStore::do_pwritev2(&v, 1, unit_off, flags);
+        if (ret != (ssize_t)wlen)
+            return done ? (ssize_t)done : -1;
+        if (lruEntry->bitmap.loaded) {
+            // the unit is cached as a whole, though only the head of its slot is written
+            photon::scoped_rwlock rl(lruEntry->rw_lock_, photon::RLOCK);
+            lruEntry->bitmap.set(unit_off / kBlockSize,
+                                 align_up(unit_off + len, kBlockSize) / kBlockSize);
+        }
+        done += len;
+    }
+    return count;
+}
+
+} //  namespace Cache
@@ -0,0 +1,52 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include "cache_store.h"
+
+namespace Cache {
+
+// A FileCacheStore keeping each refill unit LZ4 compressed at the beginning of
+// its slot in the media file, with the rest of the slot left a hole, so that
+// the disk space charged to the pool is that of the compressed data. A slot
+// begins with a header giving the length of the compressed data, as an entry
+// of the jump table of ZFile does; a unit that doesn't compress is kept as is.
+// Refills are written in whole units, see ICachePool::set_compress().
+class CompressedFileCacheStore : public FileCacheStore {
+public:
+    using FileCacheStore::FileCacheStore;
+
+    ssize_t do_preadv2(const struct iovec *iov, int iovcnt, off_t offset, int flags) override;
+
+    ssize_t do_pwritev2(const struct iovec *iov, int iovcnt, off_t offset, int flags) override;
+
+protected:
+    struct SlotHeader {
+        static const uint64_t MAGIC = 0x544f4c535a43424fULL; // "OBCZSLOT"
+        uint64_t magic;
+        uint32_t size; // of the compressed data following the header
+        uint32_t crc;  // crc32c of the compressed data
+    };
+    // the compressed data of a slot is padded to this
+    static const uint64_t kSlotAlignment = 4096;
+
+    // reads the unit at `offset` of `count` bytes, the whole of it or the
+    // last one of the file, into `buf`, at least its bytes [from, to); a
+    // compressed unit is read as a whole, a raw one only that far
+    int read_unit(off_t offset, size_t count, char *buf, size_t from, size_t to);
+};
+
+} //  namespace Cache
@@ -0,0 +1,137 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "sharded_pool.h"
+
+#include <photon/common/alog.h>
+#include <photon/common/enumerable.h>
+#include <photon/fs/path.h>
+
+namespace Cache {
+
+using namespace FileSystem;
+using namespace photon::fs;
+
+// FNV-1a, so that the shard of a file doesn't change with the build, as the
+// checkpoints of the shards are kept across restarts
+static size_t shard_index(std::string_view name, size_t nshards) {
+    uint64_t h = 14695981039346656037ULL;
+    for (auto c : name) {
+        h ^= (uint8_t)c;
+        h *= 1099511628211ULL;
+    }
+    return h % nshards;
+}
+
+ShardedFileCachePool::ShardedFileCachePool(IFileSystem *mediaFs, uint64_t capacityInGB,
+                                           uint64_t periodInUs, uint64_t diskAvailInBytes,
+                                           uint64_t refillUnit, int evictionPolicy,
+                                           uint32_t nshards)
+    : ICachePool(0), mediaFs_(mediaFs) {
+    for (uint32_t i = 0; i < nshards; i++) {
+        auto pool = new FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes,
+                                      refillUnit, evictionPolicy, i, nshards);
+        pool->ownsMediaFs_ = false;
+        pool->group_ = &shards_;
+        shards_.push_back(pool);
+    }
+}
+
+ShardedFileCachePool::~ShardedFileCachePool() {
+    // the stores refer to the shards
+    stores_clear();
+    for (auto pool : shards_) {
+        delete pool;
+    }
+    delete mediaFs_;
+}
+
+// A shard without a valid checkpoint has to find its files on the media, and
+// they are found for all such shards by a single walk. The checkpoint of an
+// unsharded pool means the media was last used with another layout, so that
+// all the shards start over.
+void ShardedFileCachePool::Init() {
+    bool stale = mediaFs_->unlink(FileCachePool::kMetaFile) == 0;
+    std::vector<bool> walk(shards_.size());
+    bool any = false;
+    for (size_t i = 0; i < shards_.size(); i++) {
+        walk[i] = stale || shards_[i]->recover() != 0;
+        any |= walk[i];
+    }
+    if (any) {
+        for (auto file : enumerable(Walker(mediaFs_, "/"))) {
+            auto i = shard_index(file, shards_.size());
+            if (walk[i]) {
+                shards_[i]->insertFile(file);
+            }
+        }
+    }
+    for (auto pool : shards_) {
+        pool->start();
+    }
+}
+
+FileCachePool *ShardedFileCachePool::shard(std::string_view pathname) {
+    return shards_[shard_index(pathname, shards_.size())];
+}
+
+ICacheStore *ShardedFileCachePool::do_open(std::string_view pathname, int flags, mode_t mode) {
+    auto s = shard(pathname);
+    s->set_direct_write(m_direct_write);
+    s->set_compress(m_compress);
+    return s->do_open(pathname, flags, mode);
+}
+
+int ShardedFileCachePool::set_quota(std::string_view pathname, size_t quota) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ShardedFileCachePool::stat(CacheStat *stat, std::string_view pathname) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ShardedFileCachePool::evict(std::string_view filename) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ShardedFileCachePool::evict(size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ShardedFileCachePool::rename(std::string_view oldname, std::string_view newname) {
+    errno = ENOSYS;
+    return -1;
+}
+
+int ShardedFileCachePool::resize(size_t n, int flags) {
+    for (auto pool : shards_) {
+        if (pool->resize(n, flags) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int ShardedFileCachePool::list_files(std::vector<std::string> &names) {
+    for (auto pool : shards_)
+        pool->list_files(names);
+    return 0;
+}
+
+} //  namespace Cache
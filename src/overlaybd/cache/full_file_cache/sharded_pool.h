@@ -0,0 +1,60 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <vector>
+#include <photon/common/string_view.h>
+#include "cache_pool.h"
+
+namespace Cache {
+
+// Splits the files of a media among `nshards` FileCachePools by the hash of
+// their names, each with its own index, LRU, eviction and checkpoint, while
+// the watermarks still apply to the media as a whole.
+// The shards keep the containers and the checkpoints small; they don't spread
+// the work over vcpus, as the file cache runs on a single vcpu.
+class ShardedFileCachePool : public FileSystem::ICachePool {
+public:
+    ShardedFileCachePool(photon::fs::IFileSystem *mediaFs, uint64_t capacityInGB,
+                         uint64_t periodInUs, uint64_t diskAvailInBytes, uint64_t refillUnit,
+                         int evictionPolicy, uint32_t nshards);
+    ~ShardedFileCachePool();
+
+    void Init();
+
+    FileSystem::ICacheStore *do_open(std::string_view pathname, int flags, mode_t mode) override;
+
+    int set_quota(std::string_view pathname, size_t quota) override;
+    int stat(FileSystem::CacheStat *stat,
+             std::string_view pathname = std::string_view(nullptr, 0)) override;
+
+    int evict(std::string_view filename) override;
+    int evict(size_t size = 0) override;
+    int rename(std::string_view oldname, std::string_view newname) override;
+    // the marks of each shard apply to the whole media, so all of them are resized
+    int resize(size_t n, int flags = 0) override;
+    int list_files(std::vector<std::string> &names) override;
+
+    FileCachePool *shard(std::string_view pathname);
+
+protected:
+    photon::fs::IFileSystem *mediaFs_; //  owned by current class
+    std::vector<FileCachePool *> shards_;
+    friend class FileCacheGroup;
+};
+
+} //  namespace Cache
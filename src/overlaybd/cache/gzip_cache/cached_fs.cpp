@@ -23,9 +23,9 @@ namespace Cache {
 class GzipCachedFsImpl : public GzipCachedFs {
 public:
     GzipCachedFsImpl(FileSystem::ICachePool *pool, size_t page_size,
-                     size_t refill_unit, IOAlloc *io_alloc)
+                     size_t refill_unit, IOAlloc *io_alloc, bool compress)
                  : pool_(pool), page_size_(page_size),
-                 refill_unit_(refill_unit), io_alloc_(io_alloc) {
+                 refill_unit_(refill_unit), io_alloc_(io_alloc), compress_(compress) {
     }
     ~GzipCachedFsImpl() {
         delete pool_;
@@ -39,6 +39,10 @@ public:
         if (fn[0] != '/') {
             fn = estring().appends("/", fn);
         }
+        if (compress_) {
+            // not to be read as inflated data as is, if it's disabled later
+            fn = estring().appends(fn, ".lz4");
+        }
         auto cache_store = pool_->open(fn, O_RDWR | O_CREAT, 0644);
         if (cache_store == nullptr) {
             delete file;
@@ -55,16 +59,21 @@ public:
         }
         return ret;
     }
+    FileSystem::ICachePool *get_pool() override {
+        return pool_;
+    }
 private:
     FileSystem::ICachePool *pool_;
     size_t page_size_;
     size_t refill_unit_;
     IOAlloc *io_alloc_;
+    bool compress_;
 };
 
 GzipCachedFs *new_gzip_cached_fs(photon::fs::IFileSystem *mediaFs, uint64_t refillUnit,
                                             uint64_t capacityInGB, uint64_t periodInUs,
-                                            uint64_t diskAvailInBytes, IOAlloc *allocator) {
+                                            uint64_t diskAvailInBytes, IOAlloc *allocator,
+                                            bool compress) {
     if (refillUnit % 4096 != 0) {
         LOG_ERROR_RETURN(EINVAL, nullptr, "refill Unit need to be aligned to 4KB")
     }
@@ -74,6 +83,8 @@ GzipCachedFs *new_gzip_cached_fs(photon::fs::IFileSystem *mediaFs, uint64_t refi
     FileCachePool *pool = nullptr;
     pool = new FileCachePool(mediaFs, capacityInGB, periodInUs, diskAvailInBytes, refillUnit);
     pool->Init();
-    return new GzipCachedFsImpl(pool, 4096, refillUnit, allocator);
+    // inflated data is kept LZ4 compressed, cheaper to read than inflating it again
+    pool->set_compress(compress);
+    return new GzipCachedFsImpl(pool, 4096, refillUnit, allocator, compress);
 }
 } // namespace Cache
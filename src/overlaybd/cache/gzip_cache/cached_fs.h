@@ -15,14 +15,19 @@
 */
 #include <photon/common/io-alloc.h>
 #include <photon/fs/filesystem.h>
+namespace FileSystem {
+class ICachePool;
+}
 namespace Cache {
 
 class GzipCachedFs {
 public:
     virtual ~GzipCachedFs() {}
     virtual photon::fs::IFile *open_cached_gzip_file(photon::fs::IFile *file, const char *file_name) = 0;
+    virtual FileSystem::ICachePool *get_pool() = 0;
 };
 GzipCachedFs *new_gzip_cached_fs(photon::fs::IFileSystem *mediaFs, uint64_t refillUnit,
                                             uint64_t capacityInGB, uint64_t periodInUs,
-                                            uint64_t diskAvailInBytes, IOAlloc *allocator);
+                                            uint64_t diskAvailInBytes, IOAlloc *allocator,
+                                            bool compress = false);
 } // namespace Cache
@@ -0,0 +1,440 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "../cache.h"
+#include <string.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/utility.h>
+#include <photon/fs/forwardfs.h>
+#include "../../buffer_pool.h"
+
+namespace Cache {
+
+using namespace photon::fs;
+
+static inline uint64_t mix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// Count-min sketch of 4-bit saturating counters, estimating how often a
+// page was requested recently. Counters are halved every `sample` increments,
+// so that the history fades out (TinyLFU).
+class FrequencySketch {
+public:
+    explicit FrequencySketch(size_t capacity) {
+        size_t width = 64;
+        while (width < capacity * 4)
+            width <<= 1;
+        m_mask = width - 1;
+        m_table.assign(width * DEPTH, 0);
+        m_sample = capacity * 10;
+    }
+
+    void increment(uint64_t h) {
+        for (int i = 0; i < DEPTH; i++) {
+            auto &c = at(i, h);
+            if (c < 15)
+                c++;
+        }
+        if (++m_additions >= m_sample) {
+            for (auto &c : m_table)
+                c >>= 1;
+            m_additions /= 2;
+        }
+    }
+
+    uint8_t estimate(uint64_t h) const {
+        uint8_t f = 15;
+        for (int i = 0; i < DEPTH; i++)
+            f = std::min(f, const_cast<FrequencySketch *>(this)->at(i, h));
+        return f;
+    }
+
+protected:
+    static const int DEPTH = 4;
+    std::vector<uint8_t> m_table;
+    size_t m_mask, m_sample, m_additions = 0;
+
+    uint8_t &at(int i, uint64_t h) {
+        auto x = mix64(h + i);
+        return m_table[i * (m_mask + 1) + (x & m_mask)];
+    }
+};
+
+struct PageKey {
+    uint64_t file, index;
+    bool operator==(const PageKey &rhs) const {
+        return file == rhs.file && index == rhs.index;
+    }
+    uint64_t hash() const {
+        return mix64(file * 0x100000001b3ULL ^ index);
+    }
+};
+
+struct PageKeyHash {
+    size_t operator()(const PageKey &k) const {
+        return k.hash();
+    }
+};
+
+// A shard of the page cache: an LRU list of fixed-size pages, whose buffers
+// are recycled on eviction, and the sketch deciding which pages get in.
+class MemoryCacheShard {
+public:
+    MemoryCacheShard(size_t capacity, size_t page_size)
+        : m_capacity(capacity), m_page_size(page_size), m_sketch(capacity) {
+    }
+
+    ~MemoryCacheShard() {
+        for (auto &p : m_lru)
+            free(p.buf);
+        for (auto b : m_free)
+            free(b);
+    }
+
+    // copies [offset, offset + count) of a page into `buf`, and records
+    // the access whether it hits or not; returns the bytes copied, less than
+    // `count` for the last page of a file, or -1 if the page is not cached
+    ssize_t get(const PageKey &k, uint64_t h, void *buf, size_t offset, size_t count) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_sketch.increment(h);
+        auto it = m_map.find(k);
+        if (it == m_map.end())
+            return -1;
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        auto len = it->second->len;
+        count = offset < len ? std::min(count, len - offset) : 0;
+        memcpy(buf, it->second->buf + offset, count);
+        return count;
+    }
+
+    // admits a missed page if there is room, or if it is requested more
+    // often than the page it would evict; one-hit wonders never get in,
+    // which keeps sequential scans from flushing the cache
+    bool admit(uint64_t h) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_capacity == 0)
+            return false;
+        auto f = m_sketch.estimate(h);
+        if (m_lru.size() < m_capacity)
+            return f >= 2;
+        return f > m_sketch.estimate(m_lru.back().key.hash());
+    }
+
+    char *acquire() {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            if (!m_free.empty()) {
+                auto b = m_free.back();
+                m_free.pop_back();
+                return b;
+            }
+        }
+        void *b = nullptr;
+        if (::posix_memalign(&b, 4096, m_page_size) != 0)
+            return nullptr;
+        return (char *)b;
+    }
+
+    void release(char *buf) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_free.push_back(buf);
+    }
+
+    // inserts a page read into a buffer from acquire(), taking its ownership
+    void put(const PageKey &k, char *buf, size_t len) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (m_map.count(k) || m_capacity == 0) {
+            m_free.push_back(buf);
+            return;
+        }
+        shrink(m_capacity - 1);
+        m_lru.push_front(Page{k, buf, len});
+        m_map[k] = m_lru.begin();
+    }
+
+    void erase(const PageKey &k) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = m_map.find(k);
+        if (it == m_map.end())
+            return;
+        m_free.push_back(it->second->buf);
+        m_lru.erase(it->second);
+        m_map.erase(it);
+    }
+
+    void erase_file(uint64_t file) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        for (auto it = m_lru.begin(); it != m_lru.end();) {
+            if (it->key.file == file) {
+                m_map.erase(it->key);
+                m_free.push_back(it->buf);
+                it = m_lru.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+protected:
+    struct Page {
+        PageKey key;
+        char *buf;
+        size_t len;
+    };
+    std::mutex m_mtx;
+    size_t m_capacity, m_page_size;
+    FrequencySketch m_sketch;
+    std::list<Page> m_lru;
+    std::unordered_map<PageKey, std::list<Page>::iterator, PageKeyHash> m_map;
+    std::vector<char *> m_free;
+
+    // evicts from the LRU tail until at most `n` pages are left
+    void shrink(size_t n) {
+        while (m_lru.size() > n) {
+            auto &p = m_lru.back();
+            m_map.erase(p.key);
+            m_free.push_back(p.buf);
+            m_lru.pop_back();
+        }
+    }
+};
+
+class MemoryCachedFs;
+
+class MemoryCachedFile : public ForwardFile_Ownership {
+public:
+    MemoryCachedFile(IFile *file, MemoryCachedFs *fs, uint64_t id)
+        : ForwardFile_Ownership(file, true), m_fs(fs), m_id(id) {
+    }
+
+    ssize_t pread(void *buf, size_t count, off_t offset) override;
+
+    ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        if (iovcnt == 1)
+            return pread(iov->iov_base, iov->iov_len, offset);
+        size_t count = 0;
+        for (int i = 0; i < iovcnt; i++)
+            count += iov[i].iov_len;
+        auto buf = BufferPool::buffer(count);
+        if (!buf)
+            LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate ` bytes", count);
+        auto ret = pread(buf.get(), count, offset);
+        if (ret <= 0)
+            return ret;
+        size_t done = 0;
+        for (int i = 0; i < iovcnt && done < (size_t)ret; i++) {
+            auto n = std::min(iov[i].iov_len, (size_t)ret - done);
+            memcpy(iov[i].iov_base, buf.get() + done, n);
+            done += n;
+        }
+        return ret;
+    }
+
+    ssize_t pwrite(const void *buf, size_t count, off_t offset) override {
+        invalidate(offset, count);
+        return m_file->pwrite(buf, count, offset);
+    }
+
+    ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override {
+        size_t count = 0;
+        for (int i = 0; i < iovcnt; i++)
+            count += iov[i].iov_len;
+        invalidate(offset, count);
+        return m_file->pwritev(iov, iovcnt, offset);
+    }
+
+    ssize_t write(const void *buf, size_t count) override {
+        invalidate(0, -1UL);
+        return m_file->write(buf, count);
+    }
+
+    ssize_t writev(const struct iovec *iov, int iovcnt) override {
+        invalidate(0, -1UL);
+        return m_file->writev(iov, iovcnt);
+    }
+
+protected:
+    MemoryCachedFs *m_fs;
+    uint64_t m_id;
+
+    void invalidate(off_t offset, size_t count);
+};
+
+// A DRAM tier in front of another (disk) cached fs. Reads are cached in
+// pages of `page_size`, shared among all the files opened of the same path.
+class MemoryCachedFs : public ForwardFS_Ownership {
+public:
+    static const size_t MAX_SHARDS = 16;
+    static const size_t MIN_SHARD_PAGES = 64;
+
+    MemoryCachedFs(IFileSystem *fs, size_t capacity, size_t page_size, bool ownership)
+        : ForwardFS_Ownership(fs, ownership), m_page_size(page_size) {
+        auto pages = capacity / page_size;
+        // small caches use less shards, so that a shard holds enough pages to compare
+        size_t nshards = MAX_SHARDS;
+        while (nshards > 1 && pages / nshards < MIN_SHARD_PAGES)
+            nshards /= 2;
+        for (size_t i = 0; i < nshards; i++) {
+            // spread the remainder, so that the shards sum up to `pages`
+            auto n = pages / nshards + (i < pages % nshards ? 1 : 0);
+            m_shards.emplace_back(new MemoryCacheShard(n, page_size));
+        }
+    }
+
+    IFile *open(const char *pathname, int flags) override {
+        return wrap(pathname, m_fs->open(pathname, flags));
+    }
+
+    IFile *open(const char *pathname, int flags, mode_t mode) override {
+        return wrap(pathname, m_fs->open(pathname, flags, mode));
+    }
+
+    size_t page_size() const {
+        return m_page_size;
+    }
+
+    MemoryCacheShard &shard(uint64_t h) {
+        return *m_shards[h % m_shards.size()];
+    }
+
+    void erase_file(uint64_t id) {
+        for (auto &s : m_shards)
+            s->erase_file(id);
+    }
+
+protected:
+    size_t m_page_size;
+    std::vector<std::unique_ptr<MemoryCacheShard>> m_shards;
+    std::mutex m_ids_mtx;
+    std::unordered_map<std::string, uint64_t> m_ids;
+
+    IFile *wrap(const char *pathname, IFile *file) {
+        if (!file)
+            return nullptr;
+        uint64_t id;
+        {
+            std::lock_guard<std::mutex> lock(m_ids_mtx);
+            auto it = m_ids.emplace(pathname, m_ids.size()).first;
+            id = it->second;
+        }
+        return new MemoryCachedFile(file, this, id);
+    }
+};
+
+// The file size is not known here, as a remote file may not have it until
+// its first read; a short read of the underlay file marks the end instead.
+ssize_t MemoryCachedFile::pread(void *buf, size_t count, off_t offset) {
+    auto page_size = m_fs->page_size();
+    auto p = (char *)buf;
+    // consecutive pages that are neither cached nor admitted are read at once
+    off_t pass_off = offset;
+    size_t pass_len = 0;
+    auto flush = [&]() -> ssize_t {
+        if (pass_len == 0)
+            return 0;
+        auto ret = m_file->pread(p + (pass_off - offset), pass_len, pass_off);
+        if (ret < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to read underlay file ", VALUE(pass_off),
+                             VALUE(pass_len));
+        pass_len = 0;
+        return ret;
+    };
+    off_t end = offset + count;
+    for (off_t pos = offset; pos < end;) {
+        PageKey k{m_id, pos / page_size};
+        auto page_off = k.index * page_size;
+        auto in_page = pos - page_off;
+        auto n = std::min(page_size - in_page, (size_t)(end - pos));
+        auto h = k.hash();
+        auto &shard = m_fs->shard(h);
+        auto dst = p + (pos - offset);
+        auto copied = shard.get(k, h, dst, in_page, n);
+        char *page = nullptr;
+        if (copied < 0 && shard.admit(h))
+            page = shard.acquire();
+        if (copied < 0 && !page) {
+            if (pass_len == 0)
+                pass_off = pos;
+            pass_len += n;
+            pos += n;
+            continue;
+        }
+        auto want = pass_len;
+        auto ret = flush();
+        if (ret < (ssize_t)want) {
+            if (page)
+                shard.release(page);
+            return ret < 0 ? ret : pass_off - offset + ret;
+        }
+        if (page) {
+            ret = m_file->pread(page, page_size, page_off);
+            if (ret < 0) {
+                shard.release(page);
+                LOG_ERRNO_RETURN(0, -1, "failed to read underlay file ", VALUE(page_off));
+            }
+            copied = (size_t)ret > in_page ? std::min(n, (size_t)ret - in_page) : 0;
+            memcpy(dst, page + in_page, copied);
+            if (ret > 0)
+                shard.put(k, page, ret);
+            else
+                shard.release(page);
+        }
+        pos += copied;
+        if ((size_t)copied < n)
+            return pos - offset;
+    }
+    auto want = pass_len;
+    auto ret = flush();
+    if (ret < (ssize_t)want)
+        return ret < 0 ? ret : pass_off - offset + ret;
+    return count;
+}
+
+void MemoryCachedFile::invalidate(off_t offset, size_t count) {
+    if (count == -1UL) {
+        m_fs->erase_file(m_id);
+        return;
+    }
+    auto page_size = m_fs->page_size();
+    for (auto i = offset / page_size; i * page_size < offset + count; i++) {
+        PageKey k{m_id, i};
+        auto h = k.hash();
+        m_fs->shard(h).erase(k);
+    }
+}
+
+} // namespace Cache
+
+namespace FileSystem {
+using namespace photon::fs;
+IFileSystem *new_memory_cached_fs(IFileSystem *fs, size_t capacity, size_t page_size,
+                                  bool ownership) {
+    if (page_size == 0 || page_size % 4096 != 0) {
+        LOG_ERROR_RETURN(EINVAL, nullptr, "page size must be a multiple of 4KB");
+    }
+    return new Cache::MemoryCachedFs(fs, capacity, page_size, ownership);
+}
+} // namespace FileSystem
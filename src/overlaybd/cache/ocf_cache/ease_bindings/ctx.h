@@ -2,6 +2,7 @@
 
 #include <sys/uio.h>
 #include <string>
+#include <unordered_map>
 
 #include <photon/thread/thread.h>
 #include <photon/fs/filesystem.h>
@@ -70,7 +71,9 @@ struct ease_ocf_config {
 
 struct ease_ocf_queue {
     ocf_queue_t mngt_queue;
-    ocf_queue_t io_queue;
+    /* io queues by the vcpu they serve, created on first use */
+    std::unordered_map<photon::vcpu_base *, ocf_queue_t> io_queues;
+    photon::mutex io_queues_lock;
 };
 
 /* Context config */
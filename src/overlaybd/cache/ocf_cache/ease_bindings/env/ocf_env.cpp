@@ -3,12 +3,124 @@
 
 #include <execinfo.h>
 #include <sched.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <vector>
 
 extern "C" {
 #include "ocf_env.h"
 }
 
+/* HUGEPAGES */
+static std::atomic<bool> huge_enabled{false};
+static std::mutex huge_lock;
+/*!< Size of each hugepage mapping */
+static std::unordered_map<const void *, size_t> huge_maps;
+
+#define HUGE_2M (2UL << 20)
+#define HUGE_1G (1UL << 30)
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << MAP_HUGE_SHIFT)
+#endif
+#ifndef MAP_HUGE_1GB
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT)
+#endif
+
+static inline size_t align_size(size_t size, size_t align)
+{
+	return (size + align - 1) / align * align;
+}
+
+void env_set_hugepage(int enable)
+{
+	huge_enabled = enable;
+}
+
+static void *huge_mmap(size_t size, int flags)
+{
+	void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+
+	return ptr == MAP_FAILED ? NULL : ptr;
+}
+
+void *env_huge_alloc(size_t size)
+{
+	void *ptr = NULL;
+
+	if (!huge_enabled.load(std::memory_order_relaxed) || size < HUGE_2M)
+		return NULL;
+
+	if (size >= HUGE_1G) {
+		size = align_size(size, HUGE_1G);
+		ptr = huge_mmap(size, MAP_HUGETLB | MAP_HUGE_1GB);
+	}
+	if (!ptr) {
+		size = align_size(size, HUGE_2M);
+		ptr = huge_mmap(size, MAP_HUGETLB | MAP_HUGE_2MB);
+	}
+	if (!ptr) {
+		/* no hugepages reserved, fall back to transparent ones */
+		ptr = huge_mmap(size, 0);
+		if (!ptr)
+			return NULL;
+		madvise(ptr, size, MADV_HUGEPAGE);
+	}
+
+	std::lock_guard<std::mutex> lock(huge_lock);
+	huge_maps[ptr] = size;
+	return ptr;
+}
+
+int env_huge_free(const void *ptr)
+{
+	size_t size;
+
+	if (!ptr || !huge_enabled.load(std::memory_order_relaxed))
+		return 0;
+	{
+		std::lock_guard<std::mutex> lock(huge_lock);
+		auto it = huge_maps.find(ptr);
+		if (it == huge_maps.end())
+			return 0;
+		size = it->second;
+		huge_maps.erase(it);
+	}
+	munmap((void *)ptr, size);
+	return 1;
+}
+
 /* ALLOCATOR */
+
+/*!< OS threads (photon vcpus) with free lists of their own */
+#define ALLOCATOR_THREADS 64
+/*!< Items a thread keeps to itself, the rest spill to the shared list */
+#define ALLOCATOR_LOCAL_MAX 256
+
+struct _env_allocator_item {
+	union {
+		struct {
+			uint32_t flags;
+			uint32_t cpu;
+		};
+		/*!< Next free item, while in a free list */
+		_env_allocator_item *next;
+	};
+	char data[];
+};
+
+struct _env_allocator_list {
+	_env_allocator_item *head;
+	uint32_t count;
+};
+
 struct _env_allocator {
 	/*!< Memory pool ID unique name */
 	char *name;
@@ -18,23 +130,143 @@ struct _env_allocator {
 
 	/*!< Number of currently allocated items in pool */
 	env_atomic count;
+
+	/*!< Whether items are carved from hugepage slabs, else calloc()-ed
+	 * and free()-d one by one */
+	bool huge;
+
+	/*!< Freed hugepage items: up to ALLOCATOR_LOCAL_MAX per thread, reused
+	 * by it without locking, the rest (and those of threads beyond
+	 * ALLOCATOR_THREADS) in the shared list */
+	_env_allocator_list local[ALLOCATOR_THREADS];
+	std::mutex shared_lock;
+	_env_allocator_item *shared;
+
+	std::mutex slab_lock;
+	std::vector<void *> slabs;
+	size_t slab_used;
 };
 
-struct _env_allocator_item {
-	uint32_t flags;
-	uint32_t cpu;
-	char data[];
+/*!< Thread ids released by exited threads, handed to new ones along with
+ * the free lists they left */
+static std::mutex allocator_ids_lock;
+static std::vector<uint32_t> allocator_ids;
+
+struct allocator_thread_id {
+	uint32_t id = ALLOCATOR_THREADS;
+
+	allocator_thread_id()
+	{
+		static uint32_t next_id = 0;
+		std::lock_guard<std::mutex> lock(allocator_ids_lock);
+
+		if (!allocator_ids.empty()) {
+			id = allocator_ids.back();
+			allocator_ids.pop_back();
+		} else if (next_id < ALLOCATOR_THREADS) {
+			id = next_id++;
+		}
+	}
+
+	~allocator_thread_id()
+	{
+		if (id == ALLOCATOR_THREADS)
+			return;
+		std::lock_guard<std::mutex> lock(allocator_ids_lock);
+		allocator_ids.push_back(id);
+	}
 };
 
+static uint32_t allocator_thread(void)
+{
+	static thread_local allocator_thread_id tid;
+
+	return tid.id;
+}
+
+static _env_allocator_item *allocator_carve(env_allocator *allocator)
+{
+	std::lock_guard<std::mutex> lock(allocator->slab_lock);
+
+	if (allocator->slabs.empty() ||
+			allocator->slab_used + allocator->item_size > HUGE_2M) {
+		void *slab = env_huge_alloc(HUGE_2M);
+
+		if (!slab)
+			return NULL;
+		allocator->slabs.push_back(slab);
+		allocator->slab_used = 0;
+	}
+	auto item = (_env_allocator_item *)
+		((char *)allocator->slabs.back() + allocator->slab_used);
+	allocator->slab_used += allocator->item_size;
+	return item;
+}
+
+static _env_allocator_item *allocator_get(env_allocator *allocator)
+{
+	_env_allocator_item *item = NULL;
+	uint32_t id = allocator_thread();
+
+	if (id < ALLOCATOR_THREADS) {
+		auto &list = allocator->local[id];
+
+		item = list.head;
+		if (item) {
+			list.head = item->next;
+			list.count--;
+			return item;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(allocator->shared_lock);
+
+		item = allocator->shared;
+		if (item)
+			allocator->shared = item->next;
+	}
+	return item ? item : allocator_carve(allocator);
+}
+
+static void allocator_put(env_allocator *allocator, _env_allocator_item *item)
+{
+	uint32_t id = allocator_thread();
+
+	if (id < ALLOCATOR_THREADS) {
+		auto &list = allocator->local[id];
+
+		if (list.count < ALLOCATOR_LOCAL_MAX) {
+			item->next = list.head;
+			list.head = item;
+			list.count++;
+			return;
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(allocator->shared_lock);
+	item->next = allocator->shared;
+	allocator->shared = item;
+}
+
 void *env_allocator_new(env_allocator *allocator)
 {
-	auto item = (_env_allocator_item *)calloc(1, allocator->item_size);
+	_env_allocator_item *item;
 
-	if (item) {
-		item->cpu = 0;
-		env_atomic_inc(&allocator->count);
+	if (allocator->huge) {
+		item = allocator_get(allocator);
+		if (item)
+			memset(item, 0, allocator->item_size);
+	} else {
+		item = (_env_allocator_item *)calloc(1, allocator->item_size);
 	}
 
+	if (!item)
+		return NULL;
+
+	item->cpu = 0;
+	env_atomic_inc(&allocator->count);
+
 	return &item->data;
 }
 
@@ -44,13 +276,15 @@ env_allocator *env_allocator_create(uint32_t size, const char *fmt_name, ...)
 	int result, error = -1;
 	va_list args;
 
-	auto allocator = (env_allocator *) calloc(1, sizeof(env_allocator));
+	auto allocator = new (std::nothrow) env_allocator();
 	if (!allocator) {
 		error = __LINE__;
 		goto err;
 	}
 
-	allocator->item_size = size + sizeof(struct _env_allocator_item);
+	/* aligned, as items are carved one after another from slabs */
+	allocator->item_size = align_size(size + sizeof(struct _env_allocator_item), 8);
+	allocator->huge = huge_enabled && allocator->item_size <= HUGE_2M;
 
 	/* Format allocator name */
 	va_start(args, fmt_name);
@@ -86,7 +320,10 @@ void env_allocator_del(env_allocator *allocator, void *obj)
 
 	env_atomic_dec(&allocator->count);
 
-	free(item);
+	if (allocator->huge)
+		allocator_put(allocator, item);
+	else
+		free(item);
 }
 
 void env_allocator_destroy(env_allocator *allocator)
@@ -97,8 +334,11 @@ void env_allocator_destroy(env_allocator *allocator)
 			ENV_WARN(true, OCF_PREFIX_SHORT" Cleanup problem\n");
 		}
 
+		/* the free lists only hold items carved from the slabs */
+		for (auto slab : allocator->slabs)
+			env_huge_free(slab);
 		free(allocator->name);
-		free(allocator);
+		delete allocator;
 	}
 }
 
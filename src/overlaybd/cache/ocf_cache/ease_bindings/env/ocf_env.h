@@ -103,6 +103,21 @@ typedef uint64_t sector_t;
 	})
 
 /* MEMORY MANAGEMENT */
+
+/*
+ * With hugepages enabled, the large allocations of the cache metadata and
+ * the slabs of the allocators are backed by hugepages: 1GB pages for 1GB and
+ * larger, else 2MB ones, else transparent hugepages. Must be set before the
+ * cache is started.
+ */
+void env_set_hugepage(int enable);
+
+/* NULL if hugepages are off, or `size` is smaller than a hugepage; zeroed */
+void *env_huge_alloc(size_t size);
+
+/* 0 if `ptr` is not from env_huge_alloc() */
+int env_huge_free(const void *ptr);
+
 static inline void *env_malloc(size_t size, int flags)
 {
 	return malloc(size);
@@ -125,27 +140,32 @@ static inline void env_free(const void *ptr)
 
 static inline void *env_vmalloc_flags(size_t size, int flags)
 {
-	return malloc(size);
+	void *ptr = env_huge_alloc(size);
+
+	return ptr ? ptr : malloc(size);
 }
 
 static inline void *env_vzalloc_flags(size_t size, int flags)
 {
-	return env_zalloc(size, 0);
+	void *ptr = env_huge_alloc(size);
+
+	return ptr ? ptr : env_zalloc(size, 0);
 }
 
 static inline void *env_vmalloc(size_t size)
 {
-	return malloc(size);
+	return env_vmalloc_flags(size, 0);
 }
 
 static inline void *env_vzalloc(size_t size)
 {
-	return env_zalloc(size, 0);
+	return env_vzalloc_flags(size, 0);
 }
 
 static inline void env_vfree(const void *ptr)
 {
-	free((void *)ptr);
+	if (!env_huge_free(ptr))
+		free((void *)ptr);
 }
 
 /* SECURE MEMORY MANAGEMENT */
@@ -165,7 +185,11 @@ static inline void env_vfree(const void *ptr)
 
 static inline void *env_secure_alloc(size_t size)
 {
-	void *ptr = malloc(size);
+	void *ptr = env_huge_alloc(size);
+
+	if (ptr)
+		return ptr;
+	ptr = malloc(size);
 
 #if SECURE_MEMORY_HANDLING
 	if (ptr && mlock(ptr, size)) {
@@ -185,7 +209,8 @@ static inline void env_secure_free(const void *ptr, size_t size)
 		/* TODO: flush CPU caches ? */
 		ENV_BUG_ON(munlock(ptr));
 #endif
-		free((void*)ptr);
+		if (!env_huge_free(ptr))
+			free((void*)ptr);
 	}
 }
 
@@ -109,14 +109,8 @@ int ease_ocf_provider::start(bool reload_media) {
     }
     ocf_mngt_cache_set_mngt_queue(m_cache, m_queue->mngt_queue);
 
-    /* Create IO submission queue */
-    ret = ocf_queue_create(m_cache, &m_queue->io_queue, get_queue_ops());
-    if (ret != 0) {
-        LOG_ERROR("OCF: failed to create io queue");
-        return ret;
-    }
-
-    init_queues(m_queue->mngt_queue, m_queue->io_queue);
+    /* IO submission queues are created per vcpu, see local_io_queue() */
+    init_queues(m_queue->mngt_queue);
 
     if (reload_media) {
         /* Reload cache instance */
@@ -175,6 +169,10 @@ int ease_ocf_provider::stop() {
     }
 
     if (m_queue != nullptr) {
+        for (auto &it : m_queue->io_queues) {
+            ocf_queue_put(it.second);
+        }
+        LOG_DEBUG("OCF: done put ` io queues", m_queue->io_queues.size());
         ocf_queue_put(m_queue->mngt_queue);
         LOG_DEBUG("OCF: done put management queue");
     }
@@ -265,6 +263,24 @@ void ease_ocf_provider::copy_aligned_iov(size_t count, alignment &a, IOVector &i
     }
 }
 
+ocf_queue_t ease_ocf_provider::local_io_queue() {
+    auto vcpu = photon::get_vcpu();
+    photon::scoped_lock lock(m_queue->io_queues_lock);
+    auto it = m_queue->io_queues.find(vcpu);
+    if (it != m_queue->io_queues.end()) {
+        return it->second;
+    }
+    ocf_queue_t queue = nullptr;
+    int ret = ocf_queue_create(m_cache, &queue, get_io_queue_ops());
+    if (ret != 0) {
+        LOG_ERROR_RETURN(0, nullptr, "OCF: failed to create io queue, ret `", ret);
+    }
+    init_io_queue(queue);
+    m_queue->io_queues.emplace(vcpu, queue);
+    LOG_INFO("OCF: created io queue for vcpu `, total `", vcpu, m_queue->io_queues.size());
+    return queue;
+}
+
 ssize_t ease_ocf_provider::ocf_pread(void *buf, size_t count, off_t offset, size_t blk_addr,
                                      OcfSrcFileCtx *ctx, bool prefetch) {
     LOG_DEBUG("New IO: pread buf `, count `, offset `", buf, count, offset);
@@ -296,8 +312,12 @@ ssize_t ease_ocf_provider::ocf_pread(void *buf, size_t count, off_t offset, size
     /* Create data */
     ease_ocf_io_data data(iov.iovec(), iov.iovcnt(), iov.sum(), blk_addr, ctx, prefetch);
 
-    /* Create io */
-    ocf_io *io = ocf_core_new_io(m_core, m_queue->io_queue, data.blk_addr + align.lower_bound,
+    /* Create io on the queue of current vcpu, so it's processed and completed locally */
+    auto queue = local_io_queue();
+    if (queue == nullptr) {
+        LOG_ERRNO_RETURN(ENOMEM, -1, "OCF: no io queue for current vcpu");
+    }
+    ocf_io *io = ocf_core_new_io(m_core, queue, data.blk_addr + align.lower_bound,
                                  (uint32_t)iov.sum(), OCF_READ, 0, 0);
     if (io == nullptr) {
         LOG_ERRNO_RETURN(ENOMEM, -1, "OCF: failed to create new IO, count `, offset `, blk_addr `",
@@ -71,6 +71,9 @@ private:
         off_t upper_bound;
     };
 
+    /* Get (or create) the io queue of current vcpu */
+    ocf_queue_t local_io_queue();
+
     static void prepare_aligned_iov(size_t count, off_t offset, alignment &a, IOVector &iov,
                                     const void *buf, void *padding_buf);
 
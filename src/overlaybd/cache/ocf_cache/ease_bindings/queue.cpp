@@ -1,5 +1,6 @@
 #include "queue.h"
 
+#include <atomic>
 #include <photon/thread/thread-pool.h>
 #include <photon/thread/workerpool.h>
 #include <photon/photon.h>
@@ -37,12 +38,55 @@ private:
     photon::WorkPool* work_pool = nullptr;
 };
 
-int init_queues(ocf_queue_t mngt_queue, ocf_queue_t io_queue) {
-    auto mngt_queue_kicker = new QueueKicker(mngt_queue, 2, 0, 0, 64);
-    auto io_queue_kicker = new QueueKicker(io_queue, 4, photon::INIT_EVENT_EPOLL, photon::INIT_IO_LIBCURL, 64);
+/* Per-vcpu queue runner, requests of the queue are processed on its own vcpu */
+class VcpuQueueRunner {
+public:
+    explicit VcpuQueueRunner(ocf_queue_t queue) : m_queue(queue), m_vcpu(photon::get_vcpu()) {
+    }
+    ~VcpuQueueRunner() {
+        // wait for the running threads, which may be on another vcpu
+        while (m_running.load(std::memory_order_acquire) > 0) {
+            photon::thread_usleep(1000);
+        }
+    }
+
+    inline void kick() {
+        m_running.fetch_add(1, std::memory_order_relaxed);
+        auto th = photon::thread_create(&VcpuQueueRunner::run, this);
+        if (photon::get_vcpu() != m_vcpu) {
+            photon::thread_migrate(th, m_vcpu);
+        }
+    }
+
+private:
+    static void *run(void *args) {
+        auto runner = (VcpuQueueRunner *)args;
+        ocf_queue_run(runner->m_queue);
+        runner->m_running.fetch_sub(1, std::memory_order_release);
+        return nullptr;
+    }
+
+    /* associated OCF queue */
+    ocf_queue_t m_queue;
+    /* the vcpu that created the queue */
+    photon::vcpu_base *m_vcpu;
+    std::atomic<uint32_t> m_running{0};
+};
 
+static int mngt_queue_ev_engine = 0;
+
+void set_mngt_queue_event_engine(int ev_engine) {
+    mngt_queue_ev_engine = ev_engine;
+}
+
+int init_queues(ocf_queue_t mngt_queue) {
+    auto mngt_queue_kicker = new QueueKicker(mngt_queue, 2, mngt_queue_ev_engine, 0, 64);
     ocf_queue_set_priv(mngt_queue, mngt_queue_kicker);
-    ocf_queue_set_priv(io_queue, io_queue_kicker);
+    return 0;
+}
+
+int init_io_queue(ocf_queue_t io_queue) {
+    ocf_queue_set_priv(io_queue, new VcpuQueueRunner(io_queue));
     return 0;
 }
 
@@ -58,6 +102,16 @@ static void queue_thread_stop(ocf_queue_t q) {
     delete qk;
 }
 
+static void io_queue_kick(ocf_queue_t q) {
+    auto runner = (VcpuQueueRunner *)ocf_queue_get_priv(q);
+    runner->kick();
+}
+
+static void io_queue_stop(ocf_queue_t q) {
+    auto runner = (VcpuQueueRunner *)ocf_queue_get_priv(q);
+    delete runner;
+}
+
 /* Queue ops */
 static const ocf_queue_ops queue_ops = {
     .kick = queue_thread_kick,
@@ -65,6 +119,16 @@ static const ocf_queue_ops queue_ops = {
     .stop = queue_thread_stop,
 };
 
+static const ocf_queue_ops io_queue_ops = {
+    .kick = io_queue_kick,
+    .kick_sync = nullptr,
+    .stop = io_queue_stop,
+};
+
 const ocf_queue_ops *get_queue_ops() {
     return &queue_ops;
 }
+
+const ocf_queue_ops *get_io_queue_ops() {
+    return &io_queue_ops;
+}
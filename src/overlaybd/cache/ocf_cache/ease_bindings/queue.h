@@ -4,6 +4,15 @@ extern "C" {
 #include <ocf/ocf.h>
 }
 
-int init_queues(ocf_queue_t mngt_queue, ocf_queue_t io_queue);
+int init_queues(ocf_queue_t mngt_queue);
+
+// the photon event engine needed besides the default ones by the vcpu of the
+// management queue, which does I/O to the media file too
+void set_mngt_queue_event_engine(int ev_engine);
+
+/* IO queues are per vcpu, and must be initialized on the vcpu they serve */
+int init_io_queue(ocf_queue_t io_queue);
 
 const ocf_queue_ops *get_queue_ops();
+
+const ocf_queue_ops *get_io_queue_ops();
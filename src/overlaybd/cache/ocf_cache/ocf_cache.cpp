@@ -15,6 +15,7 @@
 
 
 extern IOAlloc *g_io_alloc;
+extern "C" void env_set_hugepage(int enable);
 
 using namespace photon::fs;
 namespace Cache {
@@ -276,7 +277,9 @@ namespace FileSystem {
 
 IFileSystem *new_ocf_cached_fs(IFileSystem *src_fs, IFileSystem *namespace_fs, size_t blk_size,
                                size_t prefetch_unit, IFile *media_file, bool reload_media,
-                               IOAlloc *io_alloc) {
+                               IOAlloc *io_alloc, bool hugepage, int media_ev_engine) {
+    env_set_hugepage(hugepage);
+    set_mngt_queue_event_engine(media_ev_engine);
     auto ocf_ns = new_ocf_namespace_on_fs(blk_size, namespace_fs);
     if (ocf_ns->init() != 0) {
         delete ocf_ns;
@@ -1,6 +1,8 @@
 #include <fcntl.h>
 #include <unistd.h>
+#include <atomic>
 #include <ctime>
+#include <memory>
 #include <vector>
 
 #include <gflags/gflags.h>
@@ -9,6 +11,7 @@
 #include <photon/common/event-loop.h>
 #include <photon/thread/thread.h>
 #include <photon/thread/thread11.h>
+#include <photon/thread/workerpool.h>
 #include <photon/fs/aligned-file.h>
 #include <photon/fs/localfs.h>
 #include <photon/net/curl.h>
@@ -25,6 +28,10 @@ DEFINE_uint64(media_file_size_gb, 1, "media file size in gb");
 DEFINE_int64(io_engine, 0, "0: psync, 1: libaio, 3: iouring");
 DEFINE_uint64(concurrency, 16, "read concurrency");
 DEFINE_uint64(ocf_prefetch_unit, 0, "prefetch unit in bytes");
+DEFINE_uint64(vcpus, 1, "num of vcpus the readers are spread on");
+DEFINE_bool(scaling, false,
+            "run with 1, 2, 4 ... up to --vcpus vcpus, and report the qps of each");
+DEFINE_uint64(scaling_seconds, 10, "duration of each run in scaling test");
 
 // Single file test params
 DEFINE_bool(random_read, true, "random read or sequential read");
@@ -39,9 +46,12 @@ DEFINE_uint64(num_files, 100, "num of files");
 DEFINE_uint64(file_size_mb, 10, "file size in mb");
 
 // Global variables
-int qps, last_qps = 0;
-uint64_t total_req = 0;
+std::atomic<int> qps{0};
+int last_qps = 0;
+std::atomic<uint64_t> total_req{0};
 bool stop_test = false;
+// stops the current run of scaling test
+bool stop_run = false;
 
 static void handle_signal(int) {
     LOG_INFO("try to stop test");
@@ -63,8 +73,7 @@ static void handle_qps() {
 static void show_qps_loop() {
     while (!stop_test) {
         photon::thread_sleep(1);
-        LOG_INFO("qps: `", qps);
-        qps = 0;
+        LOG_INFO("qps: `", qps.exchange(0));
     }
 }
 
@@ -76,7 +85,7 @@ static int random_read(T *file, void *buf, size_t num_pages, photon::fs::IFile *
     IOVector iov;
     iov.push_back(buf, FLAGS_page_size);
     LOG_DEBUG("random_read: num_pages = `", num_pages);
-    while (!stop_test) {
+    while (!stop_test && !stop_run) {
         int index = rand() % num_pages;
         off_t offset = FLAGS_page_size * index;
         ret = file->preadv(iov.iovec(), iov.iovcnt(), offset);
@@ -104,7 +113,7 @@ static int sequential_read(T *file, void *buf, size_t start_index, size_t num_pa
     LOG_DEBUG("sequential_read: start_index = `, num_pages = `", start_index, num_pages);
     IOVector iov;
     iov.push_back(buf, FLAGS_page_size);
-    while (!stop_test) {
+    while (!stop_test && !stop_run) {
         off_t offset = FLAGS_page_size * index;
         ret = file->preadv(iov.iovec(), iov.iovcnt(), offset);
         if (ret != (int)FLAGS_page_size) {
@@ -145,28 +154,60 @@ static int work(T *cache_file, IOAlloc *io_alloc) {
     }
 
     size_t num_pages = st_buf.st_size / FLAGS_page_size;
-    std::vector<photon::join_handle *> join_hdls;
 
     void *buf = io_alloc->alloc(FLAGS_page_size);
     DEFER(io_alloc->dealloc(buf));
 
-    if (FLAGS_random_read) {
-        for (uint64_t i = 0; i < FLAGS_concurrency; i++) {
-            auto th = photon::thread_create11(random_read<T>, cache_file, buf, num_pages, dst_file);
-            join_hdls.push_back(photon::thread_enable_join(th));
+    // runs the readers on `vcpus` vcpus, the current one included
+    auto run = [&](uint64_t vcpus) {
+        std::unique_ptr<photon::WorkPool> pool;
+        if (vcpus > 1) {
+            pool.reset(new photon::WorkPool(vcpus - 1, photon::INIT_EVENT_DEFAULT,
+                                            photon::INIT_IO_DEFAULT, -1));
         }
-    } else {
+        // readers on other vcpus can't be joined, they signal when done
+        photon::semaphore done;
         for (uint64_t i = 0; i < FLAGS_concurrency; i++) {
-            ssize_t start_index = num_pages / FLAGS_concurrency * i;
-            auto th = photon::thread_create11(sequential_read<T>, cache_file, buf, start_index,
-                                              num_pages, dst_file);
-            join_hdls.push_back(photon::thread_enable_join(th));
+            auto th = photon::thread_create11([&, i]() {
+                if (FLAGS_random_read) {
+                    random_read<T>(cache_file, buf, num_pages, dst_file);
+                } else {
+                    ssize_t start_index = num_pages / FLAGS_concurrency * i;
+                    sequential_read<T>(cache_file, buf, start_index, num_pages, dst_file);
+                }
+                done.signal(1);
+            });
+            if (pool && i % vcpus != 0) {
+                pool->thread_migrate(th, i % vcpus - 1);
+            }
         }
-    }
+        done.wait(FLAGS_concurrency);
+    };
 
-    for (auto join_hdl : join_hdls) {
-        photon::thread_join(join_hdl);
+    if (!FLAGS_scaling) {
+        run(FLAGS_vcpus);
+        return 0;
+    }
+    std::vector<std::pair<uint64_t, double>> results;
+    for (uint64_t vcpus = 1; vcpus <= FLAGS_vcpus && !stop_test; vcpus *= 2) {
+        stop_run = false;
+        auto begin = total_req.load();
+        auto timer = photon::thread_create11([&]() {
+            photon::thread_sleep(FLAGS_scaling_seconds);
+            stop_run = true;
+        });
+        auto timer_hdl = photon::thread_enable_join(timer);
+        run(vcpus);
+        photon::thread_join(timer_hdl);
+        double qps_avg = double(total_req.load() - begin) / FLAGS_scaling_seconds;
+        results.emplace_back(vcpus, qps_avg);
+        LOG_INFO("vcpus: `, qps: `", vcpus, qps_avg);
+    }
+    for (auto &r : results) {
+        LOG_INFO("scaling: vcpus `, qps `, speedup `", r.first, r.second,
+                 r.second / results.front().second);
     }
+    stop_test = true;
     return 0;
 }
 
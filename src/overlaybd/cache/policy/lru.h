@@ -99,6 +99,14 @@ public:
     bool empty() {
         return m_head == PTR(m_head)->prev;
     }
+    // calls `f` with the values from the least recently used one to the most
+    template <typename F>
+    void for_each_reverse(F &&f) {
+        auto end = PTR(m_head)->prev; // the dummy node
+        for (auto i = PTR(end)->prev; i != end; i = PTR(i)->prev) {
+            f(PTR(i)->val);
+        }
+    }
 
 protected:
     struct Record {
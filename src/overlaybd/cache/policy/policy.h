@@ -0,0 +1,39 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <stddef.h>
+#include <inttypes.h>
+
+namespace FileSystem {
+// An eviction policy, tracking cached units by an opaque key and choosing
+// the next one to evict. Not thread-safe, callers serialize the accesses.
+class ICachePolicy {
+public:
+    virtual ~ICachePolicy() {
+    }
+    // records an access to `key`, starting to track it if not yet
+    virtual void access(uint64_t key) = 0;
+    // stops tracking `key`, if tracked
+    virtual void remove(uint64_t key) = 0;
+    // pops the next key to evict; returns false if nothing is tracked
+    virtual bool victim(uint64_t *key) = 0;
+    // # of keys tracked, excluding any history of evicted ones
+    virtual size_t size() const = 0;
+    // the expected # of keys when the cache is full has changed
+    virtual void resize(size_t capacity) {
+    }
+};
+} // namespace FileSystem
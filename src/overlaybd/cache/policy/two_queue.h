@@ -0,0 +1,115 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+#include <list>
+#include <unordered_map>
+#include "policy.h"
+
+namespace FileSystem {
+// The full version of 2Q (Johnson & Shasha, VLDB'94). Keys seen for the first
+// time enter a FIFO `a1in`; when evicted from there, they are remembered in a
+// ghost FIFO `a1out`. Only keys accessed again while remembered are promoted
+// to the LRU `am`, so a one-pass scan never displaces the hot set.
+class TwoQueuePolicy : public ICachePolicy {
+public:
+    // `capacity` is the expected # of keys when the cache is full
+    explicit TwoQueuePolicy(size_t capacity) {
+        resize(capacity);
+    }
+
+    // the keys of a shrunk `a1in` and `am` are left to the next victims,
+    // only the memory of evicted ones is dropped at once
+    void resize(size_t capacity) override {
+        m_kin = capacity / 4 ? capacity / 4 : 1;
+        m_kout = capacity / 2 ? capacity / 2 : 1;
+        while (m_a1out.size() > m_kout) {
+            m_map.erase(m_a1out.back());
+            m_a1out.pop_back();
+        }
+    }
+
+    void access(uint64_t key) override {
+        auto it = m_map.find(key);
+        if (it == m_map.end()) {
+            m_a1in.push_front(key);
+            m_map[key] = {A1IN, m_a1in.begin()};
+            return;
+        }
+        auto &e = it->second;
+        switch (e.queue) {
+        case AM:
+            m_am.splice(m_am.begin(), m_am, e.pos);
+            break;
+        case A1OUT:
+            m_a1out.erase(e.pos);
+            m_am.push_front(key);
+            e = {AM, m_am.begin()};
+            break;
+        case A1IN: // correlated references, stay in the fifo
+            break;
+        }
+    }
+
+    void remove(uint64_t key) override {
+        auto it = m_map.find(key);
+        if (it == m_map.end())
+            return;
+        queue(it->second.queue).erase(it->second.pos);
+        m_map.erase(it);
+    }
+
+    bool victim(uint64_t *key) override {
+        auto from = A1IN;
+        if (m_a1in.empty() || (m_a1in.size() <= m_kin && !m_am.empty()))
+            from = AM;
+        auto &q = queue(from);
+        if (q.empty())
+            return false;
+        *key = q.back();
+        q.pop_back();
+        if (from == AM) {
+            m_map.erase(*key);
+            return true;
+        }
+        // remember the key, dropping the oldest memory
+        m_a1out.push_front(*key);
+        m_map[*key] = {A1OUT, m_a1out.begin()};
+        if (m_a1out.size() > m_kout) {
+            m_map.erase(m_a1out.back());
+            m_a1out.pop_back();
+        }
+        return true;
+    }
+
+    size_t size() const override {
+        return m_a1in.size() + m_am.size();
+    }
+
+protected:
+    enum Queue { A1IN, A1OUT, AM };
+    struct Entry {
+        Queue queue;
+        std::list<uint64_t>::iterator pos;
+    };
+    size_t m_kin, m_kout;
+    std::list<uint64_t> m_a1in, m_a1out, m_am;
+    std::unordered_map<uint64_t, Entry> m_map;
+
+    std::list<uint64_t> &queue(Queue q) {
+        return q == A1IN ? m_a1in : q == AM ? m_am : m_a1out;
+    }
+};
+} // namespace FileSystem
@@ -14,6 +14,8 @@
    limitations under the License.
 */
 #pragma once
+#include <map>
+#include <string>
 #include <vector>
 #include <assert.h>
 #include <inttypes.h>
@@ -50,6 +52,12 @@ enum ResizeType : int {
     RSZ_LOWER = 0x20, // resize lower layer cache's capacity
 };
 
+// eviction policies of cache pools
+enum EvictionPolicy : int {
+    EVICT_LRU = 0, // evict whole files, the least recently used first
+    EVICT_2Q = 1,  // evict refill units by 2Q, resistant to scans
+};
+
 namespace FileSystem {
 // `CacheFnTransFunc` use to transform the filename in the cached store.
 // `std::string_view` is the filename before transformation (as src_name).
@@ -70,6 +78,28 @@ struct CacheStat {
     uint64_t evict_user;   // in bytes, initialized to -1UL means reset
 };
 
+// refills of all the stores, sized by the adaptive refill window
+struct RefillStats {
+    uint64_t sequential = 0, random = 0; // # of refills of streaming / random reads
+    uint64_t readahead = 0;              // # of refills ahead of streaming reads
+    uint64_t bytes = 0;                  // total size of the refills above
+    uint64_t window = 0;                 // the latest refill window of a streaming read
+};
+RefillStats cache_refill_stats();
+
+// reads of all the stores and evictions of all the pools
+struct CacheIOStats {
+    uint64_t hit_bytes = 0;     // bytes read from the cache media
+    uint64_t miss_bytes = 0;    // bytes read from the source, including refills shared in flight
+    uint64_t refills = 0;       // # of source reads of refills
+    uint64_t refill_us = 0;     // total time of the source reads of refills
+    uint64_t refilling = 0;     // # of refills being written in the background
+    uint64_t evicted_bytes = 0; // bytes freed by the pools to stay within their capacity
+};
+CacheIOStats cache_io_stats();
+// called by the pools after eviction
+void cache_io_evicted(uint64_t bytes);
+
 class ICachePool : public Object {
 public:
     ICachePool(uint32_t pool_size = 128, uint32_t max_refilling = 128,
@@ -109,6 +139,13 @@ public:
         return -1;
     }
 
+    // appends the names of the files in the cache to `names`, e.g. to export
+    // the cached data to another node
+    virtual int list_files(std::vector<std::string> &names) {
+        errno = ENOSYS;
+        return -1;
+    }
+
     UNIMPLEMENTED_POINTER(void *get_underlay_object(int i = 0));
 
     // reset cache's data
@@ -123,6 +160,33 @@ public:
         return -1;
     }
 
+    // grow the refill window of streaming reads up to `size` bytes, and shrink
+    // it for random reads; 0 (default) refills by the unit of the pool only
+    void set_max_refill_size(size_t size) {
+        m_max_refill_size = size;
+    }
+
+    // return refilled data to the reader right after it's fetched, and write it to
+    // the cache media in the background, buffering at most `limit` bytes; beyond
+    // that, refills are written synchronously again. 0 (default) disables it.
+    void set_writeback_limit(size_t limit) {
+        m_writeback_limit = limit;
+    }
+
+    // write refilled data to the cache media with O_DIRECT when its buffers
+    // and range are aligned, saving the copy into the page cache; only
+    // supported by the full file cache
+    void set_direct_write(bool enable) {
+        m_direct_write = enable;
+    }
+
+    // keep refilled data LZ4 compressed on the cache media, in refill units,
+    // so that the same capacity holds more of it, at the cost of decompressing
+    // a whole unit on each read; only supported by the full file cache
+    void set_compress(bool enable) {
+        m_compress = enable;
+    }
+
 protected:
     void *m_stores;
     CacheFnTransFunc fn_trans_func;
@@ -131,9 +195,17 @@ protected:
     std::atomic<uint32_t> m_refilling{0};
     const uint32_t m_max_refilling = 128;
     const uint32_t m_refilling_threshold = -1U;
+    size_t m_max_refill_size = 0;
+    size_t m_writeback_limit = 0;
+    bool m_direct_write = false;
+    bool m_compress = false;
+    std::atomic<size_t> m_writeback_bytes{0};
+    std::atomic<uint32_t> m_background{0}; // # of write-back and readahead threads
     friend class ICacheStore;
 };
 
+struct RefillContext;
+
 class ICacheStore : public Object {
 public:
     virtual ~ICacheStore();
@@ -149,6 +221,13 @@ public:
     // offset + size must <= origin file size
     virtual std::pair<off_t, size_t> queryRefillRange(off_t offset, size_t size) = 0;
     virtual int fstat(struct stat *buf) = 0;
+    // keeps [offset, offset + count) from being evicted, by refill units,
+    // while the file is open; reads flagged RW_V2_HIGH_PRIORITY pin what
+    // they read
+    virtual int pin(off_t offset, size_t count) {
+        errno = ENOSYS;
+        return -1;
+    }
     virtual int set_crc(uint32_t crc) {
         errno = ENOSYS;
         return -1;
@@ -157,6 +236,13 @@ public:
         errno = ENOSYS;
         return -1;
     }
+    // the generation of the data cached, which changes whenever any of it is
+    // dropped (evicted or trimmed), so that what a reader verified of it can
+    // be trusted while it's unchanged
+    virtual int get_generation(uint64_t *gen) {
+        errno = ENOSYS;
+        return -1;
+    }
     virtual uint64_t get_handle() {
         return -1UL;
     }
@@ -252,6 +338,13 @@ private:
                             IOVector *input = nullptr, off_t offset = 0, int flags = 0);
     int tryget_size();
     static void *async_refill(void *args);
+    ssize_t read_inflight(IOVector *input, off_t offset, size_t count);
+    void finish_refill(RefillContext *ctx);
+    void put_refill(RefillContext *ctx);
+    void track_access(off_t offset, size_t count);
+    void adapt_refill(off_t offset, size_t count, try_preadv_result *tr);
+    void readahead(off_t offset, size_t count);
+    static void *async_readahead(void *args);
 
 protected:
     std::string src_name_;
@@ -267,6 +360,15 @@ protected:
     IOAlloc *allocator_ = nullptr;
     RangeLock range_lock_;
     photon::mutex open_lock_;
+    // refills in progress, keyed by refill offset; guarded by inflight_lock_
+    std::map<uint64_t, RefillContext *> inflight_;
+    photon::mutex inflight_lock_;
+    // sequential detector of the reads, for the adaptive refill window
+    off_t seq_next_ = -1;       // where a sequential read would start
+    uint32_t seq_count_ = 0;    // # of sequential reads in a row
+    size_t refill_window_ = 0;  // refill size of the latest streaming miss
+    off_t readahead_next_ = -1; // where the next readahead starts
+    bool readahead_running_ = false;
     friend class ICachePool;
 };
 
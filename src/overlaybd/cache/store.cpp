@@ -29,6 +29,49 @@ using namespace photon::fs;
 namespace FileSystem {
 
 static const uint32_t MAX_REFILLING = 128;
+// # of sequential reads in a row before a read is taken as streaming
+static const uint32_t SEQ_THRESHOLD = 2;
+// the refill size of random reads
+static const size_t MIN_REFILL_SIZE = 64 * 1024;
+
+static struct {
+    std::atomic<uint64_t> sequential{0}, random{0}, readahead{0}, bytes{0}, window{0};
+} refill_stats;
+
+static struct {
+    std::atomic<uint64_t> hit_bytes{0}, miss_bytes{0}, refills{0}, refill_us{0}, refilling{0},
+        evicted_bytes{0};
+} io_stats;
+
+CacheIOStats cache_io_stats() {
+    CacheIOStats st;
+    st.hit_bytes = io_stats.hit_bytes.load(std::memory_order_relaxed);
+    st.miss_bytes = io_stats.miss_bytes.load(std::memory_order_relaxed);
+    st.refills = io_stats.refills.load(std::memory_order_relaxed);
+    st.refill_us = io_stats.refill_us.load(std::memory_order_relaxed);
+    st.refilling = io_stats.refilling.load(std::memory_order_relaxed);
+    st.evicted_bytes = io_stats.evicted_bytes.load(std::memory_order_relaxed);
+    return st;
+}
+
+void cache_io_evicted(uint64_t bytes) {
+    io_stats.evicted_bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+static inline void count_miss(ssize_t ret) {
+    if (ret > 0)
+        io_stats.miss_bytes.fetch_add(ret, std::memory_order_relaxed);
+}
+
+RefillStats cache_refill_stats() {
+    RefillStats st;
+    st.sequential = refill_stats.sequential.load(std::memory_order_relaxed);
+    st.random = refill_stats.random.load(std::memory_order_relaxed);
+    st.readahead = refill_stats.readahead.load(std::memory_order_relaxed);
+    st.bytes = refill_stats.bytes.load(std::memory_order_relaxed);
+    st.window = refill_stats.window.load(std::memory_order_relaxed);
+    return st;
+}
 
 ICacheStore::~ICacheStore() {
     delete src_file_;
@@ -55,6 +98,8 @@ ssize_t ICacheStore::preadv2(const struct iovec *iov, int iovcnt, off_t offset,
         input.extract_back(offset + static_cast<off_t>(iov_size) - actual_size_);
         iov_size = actual_size_ - offset;
     }
+    if (flags & RW_V2_HIGH_PRIORITY)
+        pin(offset, iov_size);
 
     if ((flags & RW_V2_CACHE_ONLY) || (open_flags_ & O_CACHE_ONLY)) {
         auto tr = try_preadv2(input.iovec(), input.iovcnt(), offset, flags);
@@ -65,10 +110,20 @@ ssize_t ICacheStore::preadv2(const struct iovec *iov, int iovcnt, off_t offset,
         }
     }
 
+    bool adaptive = pool_ && pool_->m_max_refill_size;
+    if (adaptive) {
+        track_access(offset, iov_size);
+        if (seq_count_ >= SEQ_THRESHOLD)
+            readahead(offset, iov_size);
+    }
+
+    ssize_t served = 0;
 again:
     auto tr = try_preadv2(input.iovec(), input.iovcnt(), offset, flags);
-    if (tr.refill_size == 0 && tr.size >= 0)
-        return tr.size;
+    if (tr.refill_size == 0 && tr.size >= 0) {
+        io_stats.hit_bytes.fetch_add(tr.size, std::memory_order_relaxed);
+        return served + tr.size;
+    }
     // open src file only when cache miss
     if (open_src_file() != 0 || !src_file_) {
         LOG_ERROR_RETURN(0, -1, "cache preadv2 failed, offset : `, count : `, flags : `", offset,
@@ -78,14 +133,32 @@ again:
     if (tr.refill_offset < 0) {
         SCOPE_AUDIT("download", AU_FILEOP(get_src_name(), offset, tr.size));
         tr.size = src_file_->preadv2(input.iovec(), input.iovcnt(), offset, flags);
-        return tr.size;
+        count_miss(tr.size);
+        return tr.size < 0 ? tr.size : served + tr.size;
+    }
+
+    if (adaptive)
+        adapt_refill(offset, iov_size, &tr);
+
+    // another thread may be fetching the head of this miss already
+    auto n = read_inflight(&input, offset, iov_size);
+    if (n > 0) {
+        count_miss(n);
+        served += n;
+        if ((size_t)n == iov_size)
+            return served;
+        input.extract_front(n);
+        offset += n;
+        iov_size -= n;
+        goto again;
     }
 
     ssize_t ret =
         do_refill_range(tr.refill_offset, tr.refill_size, iov_size, &input, offset, flags);
     if (ret == -EAGAIN)
         goto again;
-    return ret;
+    count_miss(ret);
+    return ret < 0 ? ret : served + ret;
 }
 
 ssize_t ICacheStore::pwritev2(const struct iovec *iov, int iovcnt, off_t offset, int flags) {
@@ -166,34 +239,180 @@ again:
     return ret;
 }
 
+// A refill in progress. It stays in ICacheStore::inflight_ until the data is
+// written to the cache, so that misses it covers are served from `buffer`
+// (single-flight) instead of reading the source again.
 struct RefillContext {
     ICacheStore *store;
     IOVector buffer;
     uint64_t refill_off;
     uint64_t refill_size;
     int flags;
+    int refs = 1;       // the refilling thread and the waiters
+    bool ready = false; // `buffer` is filled, or `failed`
+    bool failed = false;
+    bool writeback = false; // written by a background thread of the current vcpu
+    photon::condition_variable cv;
 };
 
 void *ICacheStore::async_refill(void *args) {
     auto ctx = (RefillContext *)args;
-    auto write = ctx->store->do_pwritev2(ctx->buffer.iovec(), ctx->buffer.iovcnt(), ctx->refill_off,
-                                         ctx->flags);
+    auto store = ctx->store;
+    auto pool = store->pool_;
+    auto write = store->do_pwritev2(ctx->buffer.iovec(), ctx->buffer.iovcnt(), ctx->refill_off,
+                                    ctx->flags);
     if (write != static_cast<ssize_t>(ctx->refill_size)) {
         if (ENOSPC != errno)
             LOG_ERROR(
                 "cache file write failed : `, error : `, actual_size_ : `, offset : `, sum : `",
-                write, ERRNO(errno), ctx->store->actual_size_, ctx->refill_off, ctx->buffer.sum());
+                write, ERRNO(errno), store->actual_size_, ctx->refill_off, ctx->buffer.sum());
     }
 
-    ctx->store->pool_->m_refilling.fetch_sub(1, std::memory_order_relaxed);
-    ctx->store->range_lock_.unlock(ctx->refill_off, ctx->refill_size);
-    ctx->store->release();
-    photon::thread_migrate(photon::CURRENT,
-                           static_cast<photon::vcpu_base *>(ctx->store->pool_->m_vcpu));
+    pool->m_refilling.fetch_sub(1, std::memory_order_relaxed);
+    io_stats.refilling.fetch_sub(1, std::memory_order_relaxed);
+    if (ctx->writeback) {
+        pool->m_writeback_bytes.fetch_sub(ctx->refill_size, std::memory_order_relaxed);
+        store->finish_refill(ctx);
+        store->release();
+        pool->m_background.fetch_sub(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    store->finish_refill(ctx);
+    store->release();
+    photon::thread_migrate(photon::CURRENT, static_cast<photon::vcpu_base *>(pool->m_vcpu));
+    return nullptr;
+}
+
+// Copies the head of [offset, offset + count) from an in-flight refill
+// covering `offset` into `input`, waiting for its source read if needed.
+// Returns the # of bytes copied, 0 if there's no such refill.
+ssize_t ICacheStore::read_inflight(IOVector *input, off_t offset, size_t count) {
+    RefillContext *ctx;
+    {
+        photon::scoped_lock l(inflight_lock_);
+        auto it = inflight_.upper_bound(offset);
+        if (it == inflight_.begin())
+            return 0;
+        ctx = (--it)->second;
+        if (ctx->refill_off + ctx->refill_size <= static_cast<uint64_t>(offset))
+            return 0;
+        ctx->refs++;
+        while (!ctx->ready)
+            ctx->cv.wait(inflight_lock_);
+    }
+    DEFER(put_refill(ctx));
+    if (ctx->failed)
+        return 0;
+    IOVector buffer(ctx->buffer.iovec(), ctx->buffer.iovcnt());
+    buffer.extract_front(offset - ctx->refill_off);
+    auto view = input->view();
+    return buffer.memcpy_to(&view, std::min(count, (size_t)buffer.sum()));
+}
+
+void ICacheStore::track_access(off_t offset, size_t count) {
+    if (offset == seq_next_) {
+        if (seq_count_ < -1U)
+            seq_count_++;
+    } else {
+        seq_count_ = 0;
+    }
+    seq_next_ = offset + count;
+}
+
+// Resizes the refill of a miss by the access pattern: a streaming read
+// doubles the window up to m_max_refill_size, while a random read only
+// fetches the MIN_REFILL_SIZE blocks around it.
+void ICacheStore::adapt_refill(off_t offset, size_t count, try_preadv_result *tr) {
+    off_t refill_end = tr->refill_offset + tr->refill_size;
+    if (seq_count_ >= SEQ_THRESHOLD) {
+        refill_window_ = std::min(std::max(refill_window_ * 2, (size_t)tr->refill_size),
+                                  pool_->m_max_refill_size);
+        auto end = std::min(offset + (off_t)refill_window_, actual_size_);
+        if (end > refill_end) {
+            auto q = queryRefillRange(tr->refill_offset, end - tr->refill_offset);
+            if (q.first == tr->refill_offset && q.second > tr->refill_size)
+                tr->refill_size = q.second;
+        }
+        readahead_next_ = std::max(readahead_next_, (off_t)(tr->refill_offset + tr->refill_size));
+        refill_stats.sequential.fetch_add(1, std::memory_order_relaxed);
+        refill_stats.window.store(refill_window_, std::memory_order_relaxed);
+    } else if (seq_count_ == 0) {
+        refill_window_ = 0;
+        auto unit = std::max(page_size_, MIN_REFILL_SIZE);
+        off_t begin = std::max((off_t)(offset / unit * unit), tr->refill_offset);
+        off_t end = std::min((off_t)((offset + count + unit - 1) / unit * unit), refill_end);
+        if (begin < end) {
+            tr->refill_offset = begin;
+            tr->refill_size = end - begin;
+        }
+        refill_stats.random.fetch_add(1, std::memory_order_relaxed);
+    }
+    refill_stats.bytes.fetch_add(tr->refill_size, std::memory_order_relaxed);
+}
+
+struct ReadaheadContext {
+    ICacheStore *store;
+    off_t offset;
+    size_t count;
+};
+
+// Keeps a streaming reader from waiting for the source at the end of each
+// window: once it has consumed half of the latest refill, the next (doubled)
+// window is fetched in the background.
+void ICacheStore::readahead(off_t offset, size_t count) {
+    if (readahead_running_ || refill_window_ == 0 || readahead_next_ < 0 ||
+        readahead_next_ >= actual_size_ ||
+        offset + (off_t)(count + refill_window_ / 2) < readahead_next_)
+        return;
+    refill_window_ = std::min(refill_window_ * 2, pool_->m_max_refill_size);
+    refill_stats.window.store(refill_window_, std::memory_order_relaxed);
+    auto ctx = new ReadaheadContext{this, readahead_next_, refill_window_};
+    readahead_next_ += refill_window_;
+    readahead_running_ = true;
+    ref_.fetch_add(1, std::memory_order_relaxed);
+    pool_->m_background.fetch_add(1, std::memory_order_relaxed);
+    photon::thread_create(&async_readahead, ctx);
+}
+
+void *ICacheStore::async_readahead(void *args) {
+    auto ctx = (ReadaheadContext *)args;
+    auto store = ctx->store;
+    auto pool = store->pool_;
+    if (store->try_refill_range(ctx->offset, ctx->count) < 0) {
+        LOG_WARN("readahead failed, offset : `, count : `", ctx->offset, ctx->count);
+    } else {
+        refill_stats.readahead.fetch_add(1, std::memory_order_relaxed);
+        refill_stats.bytes.fetch_add(ctx->count, std::memory_order_relaxed);
+    }
+    store->readahead_running_ = false;
     delete ctx;
+    store->release();
+    pool->m_background.fetch_sub(1, std::memory_order_relaxed);
     return nullptr;
 }
 
+void ICacheStore::finish_refill(RefillContext *ctx) {
+    auto refill_off = ctx->refill_off, refill_size = ctx->refill_size;
+    {
+        photon::scoped_lock l(inflight_lock_);
+        auto it = inflight_.find(refill_off);
+        if (it != inflight_.end() && it->second == ctx)
+            inflight_.erase(it);
+        if (!ctx->ready) {
+            ctx->ready = ctx->failed = true;
+            ctx->cv.notify_all();
+        }
+    }
+    range_lock_.unlock(refill_off, refill_size);
+    put_refill(ctx);
+}
+
+void ICacheStore::put_refill(RefillContext *ctx) {
+    photon::scoped_lock l(inflight_lock_);
+    if (--ctx->refs == 0)
+        delete ctx;
+}
+
 ssize_t ICacheStore::do_refill_range(uint64_t refill_off, uint64_t refill_size, size_t count,
                                      IOVector *input, off_t offset, int flags) {
     ssize_t ret = 0;
@@ -214,11 +433,12 @@ ssize_t ICacheStore::do_refill_range(uint64_t refill_off, uint64_t refill_size,
     {
         static uint32_t max_refilling = pool_ ? pool_->m_max_refilling : MAX_REFILLING;
         uint32_t refilling = max_refilling;
+        auto ctx = new RefillContext{this, IOVector(*allocator_), refill_off, refill_size, flags};
         DEFER({
             if (refilling >= max_refilling)
-                range_lock_.unlock(refill_off, refill_size);
+                finish_refill(ctx);
         });
-        IOVector buffer(*allocator_);
+        auto &buffer = ctx->buffer;
         auto alloc = buffer.push_back(refill_size);
         if (alloc < refill_size) {
             LOG_ERROR("memory allocate failed, refill_size:`, alloc:`", refill_size, alloc);
@@ -230,9 +450,22 @@ ssize_t ICacheStore::do_refill_range(uint64_t refill_off, uint64_t refill_size,
                 return -1;
         }
 
+        {
+            photon::scoped_lock l(inflight_lock_);
+            inflight_[refill_off] = ctx;
+        }
         {
             SCOPE_AUDIT("download", AU_FILEOP(get_src_name(), refill_off, ret));
+            auto start = photon::now;
             ret = src_file_->preadv2(buffer.iovec(), buffer.iovcnt(), refill_off, flags);
+            io_stats.refills.fetch_add(1, std::memory_order_relaxed);
+            io_stats.refill_us.fetch_add(photon::now - start, std::memory_order_relaxed);
+        }
+        {
+            photon::scoped_lock l(inflight_lock_);
+            ctx->ready = true;
+            ctx->failed = ret != static_cast<ssize_t>(refill_size);
+            ctx->cv.notify_all();
         }
 
         if (ret != static_cast<ssize_t>(refill_size)) {
@@ -242,6 +475,18 @@ ssize_t ICacheStore::do_refill_range(uint64_t refill_off, uint64_t refill_size,
                 ret, refill_size, actual_size_, refill_off, buffer.sum());
         }
 
+        // reserves the buffer of a background write, within m_writeback_limit
+        auto reserve_writeback = [&]() {
+            auto limit = pool_->m_writeback_limit;
+            if (limit == 0)
+                return false;
+            auto bytes = pool_->m_writeback_bytes.fetch_add(refill_size, std::memory_order_relaxed);
+            if (bytes + refill_size <= limit)
+                return true;
+            pool_->m_writeback_bytes.fetch_sub(refill_size, std::memory_order_relaxed);
+            return false;
+        };
+
         // buffer need async refill
         IOVector refill_buf(buffer.iovec(), buffer.iovcnt());
         if (input && (off_t)refill_off <= offset) {
@@ -262,11 +507,19 @@ ssize_t ICacheStore::do_refill_range(uint64_t refill_off, uint64_t refill_size,
             (refilling = pool_->m_refilling.load(std::memory_order_relaxed)) <
                 pool_->m_max_refilling) {
             pool_->m_refilling.fetch_add(1, std::memory_order_relaxed);
+            io_stats.refilling.fetch_add(1, std::memory_order_relaxed);
             ref_.fetch_add(1, std::memory_order_relaxed);
-            auto ctx = new RefillContext{this, std::move(buffer), refill_off, refill_size, flags};
             auto th = static_cast<photon::ThreadPoolBase *>(pool_->m_thread_pool)
                           ->thread_create(&async_refill, ctx);
             photon::thread_migrate(th, photon::get_vcpu());
+        } else if (input && pool_ && reserve_writeback()) {
+            refilling = 0;
+            ctx->writeback = true;
+            pool_->m_refilling.fetch_add(1, std::memory_order_relaxed);
+            io_stats.refilling.fetch_add(1, std::memory_order_relaxed);
+            pool_->m_background.fetch_add(1, std::memory_order_relaxed);
+            ref_.fetch_add(1, std::memory_order_relaxed);
+            photon::thread_create(&async_refill, ctx);
         } else {
             auto write = do_pwritev2(buffer.iovec(), buffer.iovcnt(), refill_off, flags);
             if (write != static_cast<ssize_t>(refill_size)) {
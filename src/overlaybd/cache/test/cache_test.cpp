@@ -25,16 +25,24 @@
 #include <random>
 #include <algorithm>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
 
 #include "photon/common/alog.h"
 #include "photon/common/callback.h"
 #include "photon/fs/localfs.h"
 #include "photon/fs/aligned-file.h"
+#include "photon/fs/forwardfs.h"
 #include "photon/thread/thread.h"
 #include "photon/io/fd-events.h"
 #include "photon/io/aio-wrapper.h"
 #include "photon/common/io-alloc.h"
 #include "../cache.h"
+#include "../full_file_cache/cache_pool.h"
+#include "../full_file_cache/cache_group.h"
+#include "../policy/two_queue.h"
+#include "../../buffer_pool.h"
 #include "random_generator.h"
 
 namespace Cache {
@@ -534,6 +542,764 @@ TEST(CachedFS, fn_trans_func) {
   EXPECT_EQ(cs1, cs2);
 }
 
+TEST(RoCachedFs, block_bitmap) {
+  std::string srcRoot("/tmp/ease/cache/src_bitmap/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_bitmap/file bs=1K count=3000");
+  std::string root("/tmp/ease/cache/cache_bitmap/");
+  SetupTestDir(root);
+
+  const size_t len = 3000 * 1024;
+  std::vector<char> src(len), buf(len);
+  auto fd = ::open("/tmp/ease/cache/src_bitmap/file", O_RDONLY);
+  EXPECT_EQ((ssize_t)len, ::pread(fd, src.data(), len, 0));
+  ::close(fd);
+
+  auto readAll = [&](IFileSystem *srcFs) {
+    auto mediaFs = new_localfs_adaptor(root.c_str());
+    auto cachedFs = new_full_file_cached_fs(srcFs, mediaFs, 1024 * 1024, 512, 1000 * 1000 * 1,
+                                            128ul * 1024 * 1024, nullptr, 0);
+    DEFER(delete cachedFs);
+    auto cachedFile = cachedFs->open("/file", O_RDONLY);
+    DEFER(delete cachedFile);
+    buf.assign(len, 0);
+    return cachedFile->pread(buf.data(), len, 0);
+  };
+
+  // fill the cache, the bitmap is persisted when the file is closed
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str());
+  EXPECT_EQ((ssize_t)len, readAll(srcFs));
+  delete srcFs;
+  EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+  struct stat st;
+  EXPECT_EQ(0, ::stat((root + "file.bitmap").c_str(), &st));
+
+  // without a source, reads must be served from the persisted bitmap
+  EXPECT_EQ((ssize_t)len, readAll(nullptr));
+  EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+
+  // an invalid sidecar falls back to fiemap of the media file
+  system("truncate -s 7 /tmp/ease/cache/cache_bitmap/file.bitmap");
+  EXPECT_EQ((ssize_t)len, readAll(nullptr));
+  EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+}
+
+// counts the reads of the source, and makes them slow enough to overlap
+class CountingFile : public ForwardFile_Ownership {
+public:
+  CountingFile(IFile *file, std::atomic<int> *count)
+    : ForwardFile_Ownership(file, true), count_(count) {}
+  ssize_t preadv2(const struct iovec *iov, int iovcnt, off_t offset, int flags) override {
+    (*count_)++;
+    photon::thread_usleep(10 * 1000);
+    return m_file->preadv2(iov, iovcnt, offset, flags);
+  }
+  std::atomic<int> *count_;
+};
+
+class CountingFs : public ForwardFS_Ownership {
+public:
+  explicit CountingFs(IFileSystem *fs) : ForwardFS_Ownership(fs, true) {}
+  IFile *open(const char *pathname, int flags) override {
+    auto file = m_fs->open(pathname, flags);
+    return file ? new CountingFile(file, &count) : nullptr;
+  }
+  IFile *open(const char *pathname, int flags, mode_t mode) override {
+    auto file = m_fs->open(pathname, flags, mode);
+    return file ? new CountingFile(file, &count) : nullptr;
+  }
+  std::atomic<int> count{0};
+};
+
+TEST(RoCachedFs, single_flight) {
+  std::string srcRoot("/tmp/ease/cache/src_flight/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_flight/file bs=1M count=1");
+  std::string root("/tmp/ease/cache/cache_flight/");
+  SetupTestDir(root);
+
+  const size_t len = 1024 * 1024;
+  std::vector<char> src(len);
+  auto fd = ::open("/tmp/ease/cache/src_flight/file", O_RDONLY);
+  EXPECT_EQ((ssize_t)len, ::pread(fd, src.data(), len, 0));
+  ::close(fd);
+
+  auto srcFs = new CountingFs(new_localfs_adaptor(srcRoot.c_str()));
+  DEFER(delete srcFs);
+  auto mediaFs = new_localfs_adaptor(root.c_str());
+  auto cachedFs = new_full_file_cached_fs(srcFs, mediaFs, 1024 * 1024, 512, 1000 * 1000 * 1,
+                                          128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  auto cachedFile = cachedFs->open("/file", O_RDONLY);
+  DEFER(delete cachedFile);
+
+  // misses on the same refill unit wait for a single source read
+  struct Reader {
+    IFile *file;
+    off_t offset;
+    char buf[64 * 1024];
+    ssize_t ret;
+  };
+  std::vector<Reader> readers(8);
+  std::vector<photon::join_handle *> jhs;
+  for (size_t i = 0; i < readers.size(); i++) {
+    readers[i].file = cachedFile;
+    readers[i].offset = i * 128 * 1024;
+    jhs.push_back(photon::thread_enable_join(photon::thread_create(
+        [](void *arg) -> void * {
+          auto r = (Reader *)arg;
+          r->ret = r->file->pread(r->buf, sizeof(r->buf), r->offset);
+          return nullptr;
+        },
+        &readers[i])));
+  }
+  for (auto jh : jhs) {
+    photon::thread_join(jh);
+  }
+  for (auto &r : readers) {
+    EXPECT_EQ((ssize_t)sizeof(r.buf), r.ret);
+    EXPECT_EQ(0, memcmp(r.buf, src.data() + r.offset, sizeof(r.buf)));
+  }
+  EXPECT_EQ(1, srcFs->count.load());
+}
+
+// ioctls of the download cached files, as image_file.cpp
+#define SET_LOCAL_DIR 118
+#define SET_SIZE 119
+
+TEST(DownloadCachedFs, fetch) {
+  std::string srcRoot("/tmp/ease/cache/src_download/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_download/file bs=64K count=16");
+  std::string localDir("/tmp/ease/cache/download");
+  SetupTestDir(localDir + "/");
+
+  const size_t unit = 64 * 1024, len = 16 * unit;
+  std::vector<char> src(len), buf(len);
+  auto fd = ::open("/tmp/ease/cache/src_download/file", O_RDONLY);
+  EXPECT_EQ((ssize_t)len, ::pread(fd, src.data(), len, 0));
+  ::close(fd);
+
+  auto srcFs = new CountingFs(new_localfs_adaptor(srcRoot.c_str()));
+  DEFER(delete srcFs);
+  IOAlloc alloc;
+  // 4 units fetched at a time, and read ahead
+  auto dlFs = new_download_cached_fs(srcFs, 4096, unit, &alloc, 4);
+  DEFER(delete dlFs);
+  auto openFile = [&]() {
+    auto file = dlFs->open("/file", O_RDONLY);
+    EXPECT_NE(nullptr, file);
+    EXPECT_EQ(0, file->ioctl(SET_SIZE, len));
+    EXPECT_EQ(0, file->ioctl(SET_LOCAL_DIR, localDir));
+    return file;
+  };
+
+  auto file = openFile();
+  // the unit read, and the 4 after it in the background
+  EXPECT_EQ(4096, file->pread(buf.data(), 4096, 100));
+  EXPECT_EQ(0, memcmp(src.data() + 100, buf.data(), 4096));
+  photon::thread_usleep(200 * 1000);
+  EXPECT_EQ(5, srcFs->count.load());
+
+  // the rest is fetched concurrently, each unit once
+  EXPECT_EQ((ssize_t)len, file->pread(buf.data(), len, 0));
+  EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+  EXPECT_EQ(16, srcFs->count.load());
+  delete file;
+
+  // cached units are found in the local file when it's opened again
+  photon::thread_usleep(1100 * 1000);
+  file = openFile();
+  buf.assign(len, 0);
+  EXPECT_EQ((ssize_t)len, file->pread(buf.data(), len, 0));
+  EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+  EXPECT_EQ(16, srcFs->count.load());
+  delete file;
+}
+
+TEST(RoCachedFs, adaptive_refill) {
+  std::string srcRoot("/tmp/ease/cache/src_adaptive/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_adaptive/file bs=1M count=8");
+  system("cp /tmp/ease/cache/src_adaptive/file /tmp/ease/cache/src_adaptive/file2");
+  std::string root("/tmp/ease/cache/cache_adaptive/");
+  SetupTestDir(root);
+
+  const size_t len = 8 * 1024 * 1024, refillUnit = 256 * 1024;
+  std::vector<char> src(len), buf(64 * 1024);
+  auto fd = ::open("/tmp/ease/cache/src_adaptive/file", O_RDONLY);
+  EXPECT_EQ((ssize_t)len, ::pread(fd, src.data(), len, 0));
+  ::close(fd);
+
+  auto srcFs = new CountingFs(new_localfs_adaptor(srcRoot.c_str()));
+  DEFER(delete srcFs);
+  auto mediaFs = new_localfs_adaptor(root.c_str());
+  auto cachedFs = new_full_file_cached_fs(srcFs, mediaFs, refillUnit, 512, 1000 * 1000 * 1,
+                                          128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  cachedFs->get_pool()->set_max_refill_size(4 * 1024 * 1024);
+  auto cachedFile = cachedFs->open("/file", O_RDONLY);
+  DEFER(delete cachedFile);
+
+  // a streaming read of the first half takes fewer source reads than refill units,
+  // while the rest of the file is read ahead
+  auto st0 = cache_refill_stats();
+  for (off_t offset = 0; offset < (off_t)len / 2; offset += buf.size()) {
+    EXPECT_EQ((ssize_t)buf.size(), cachedFile->pread(buf.data(), buf.size(), offset));
+    EXPECT_EQ(0, memcmp(buf.data(), src.data() + offset, buf.size()));
+  }
+  photon::thread_usleep(200 * 1000); // readahead
+  auto st1 = cache_refill_stats();
+  EXPECT_GT(st1.sequential, st0.sequential);
+  EXPECT_GT(st1.window, refillUnit);
+  EXPECT_LT(srcFs->count.load(), (int)(len / 2 / refillUnit));
+
+  // random reads only fetch the blocks around them
+  auto randomFile = cachedFs->open("/file2", O_RDONLY);
+  DEFER(delete randomFile);
+  int count = srcFs->count.load();
+  for (off_t offset : {7 * 1024 * 1024, 5 * 1024 * 1024 + 4096}) {
+    EXPECT_EQ((ssize_t)4096, randomFile->pread(buf.data(), 4096, offset));
+    EXPECT_EQ(0, memcmp(buf.data(), src.data() + offset, 4096));
+  }
+  auto st2 = cache_refill_stats();
+  EXPECT_EQ(st1.random + 2, st2.random);
+  EXPECT_EQ(count + 2, srcFs->count.load());
+  EXPECT_EQ(st1.bytes + 2 * 64 * 1024, st2.bytes);
+}
+
+TEST(RoCachedFs, io_stats) {
+  std::string srcRoot("/tmp/ease/cache/src_io_stats/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_io_stats/file bs=1M count=1");
+  std::string root("/tmp/ease/cache/cache_io_stats/");
+  SetupTestDir(root);
+
+  auto srcFs = new CountingFs(new_localfs_adaptor(srcRoot.c_str()));
+  DEFER(delete srcFs);
+  auto mediaFs = new_localfs_adaptor(root.c_str());
+  auto cachedFs = new_full_file_cached_fs(srcFs, mediaFs, 256 * 1024, 512, 1000 * 1000 * 1,
+                                          128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  auto cachedFile = cachedFs->open("/file", O_RDONLY);
+  DEFER(delete cachedFile);
+  std::vector<char> buf(4096);
+
+  // the first read misses and refills
+  auto io0 = cache_io_stats();
+  EXPECT_EQ((ssize_t)4096, cachedFile->pread(buf.data(), 4096, 512 * 1024));
+  auto io1 = cache_io_stats();
+  EXPECT_GE(io1.refills, io0.refills + 1);
+  EXPECT_GT(io1.miss_bytes, io0.miss_bytes);
+  EXPECT_EQ(io0.hit_bytes, io1.hit_bytes);
+
+  // reading it again hits the cache
+  photon::thread_usleep(100 * 1000);
+  EXPECT_EQ((ssize_t)4096, cachedFile->pread(buf.data(), 4096, 512 * 1024));
+  auto io2 = cache_io_stats();
+  EXPECT_EQ(io1.hit_bytes + 4096, io2.hit_bytes);
+  EXPECT_EQ(io1.miss_bytes, io2.miss_bytes);
+  EXPECT_EQ(io1.refills, io2.refills);
+}
+
+TEST(RoCachedFs, writeback) {
+  std::string srcRoot("/tmp/ease/cache/src_writeback/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_writeback/file bs=1M count=4");
+  std::string root("/tmp/ease/cache/cache_writeback/");
+  SetupTestDir(root);
+
+  const size_t len = 4 * 1024 * 1024;
+  std::vector<char> src(len), buf(len);
+  auto fd = ::open("/tmp/ease/cache/src_writeback/file", O_RDONLY);
+  EXPECT_EQ((ssize_t)len, ::pread(fd, src.data(), len, 0));
+  ::close(fd);
+
+  auto srcFs = new CountingFs(new_localfs_adaptor(srcRoot.c_str()));
+  DEFER(delete srcFs);
+  auto mediaFs = new_localfs_adaptor(root.c_str());
+  auto cachedFs = new_full_file_cached_fs(srcFs, mediaFs, 1024 * 1024, 512, 1000 * 1000 * 1,
+                                          128ul * 1024 * 1024, nullptr, 0);
+  // room for 2 refills in the background, the others are written synchronously
+  cachedFs->get_pool()->set_writeback_limit(2 * 1024 * 1024);
+  auto cachedFile = cachedFs->open("/file", O_RDONLY);
+  for (off_t offset = 0; offset < (off_t)len; offset += 1024 * 1024) {
+    EXPECT_EQ(1024 * 1024, cachedFile->pread(buf.data() + offset, 1024 * 1024, offset));
+  }
+  EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+  delete cachedFile;
+  // waits for the background writes
+  delete cachedFs;
+  EXPECT_EQ(4, srcFs->count.load());
+
+  // everything has been persisted to the media
+  mediaFs = new_localfs_adaptor(root.c_str());
+  cachedFs = new_full_file_cached_fs(nullptr, mediaFs, 1024 * 1024, 512, 1000 * 1000 * 1,
+                                     128ul * 1024 * 1024, nullptr, 0);
+  DEFER(delete cachedFs);
+  cachedFile = cachedFs->open("/file", O_RDONLY);
+  DEFER(delete cachedFile);
+  buf.assign(len, 0);
+  EXPECT_EQ((ssize_t)len, cachedFile->pread(buf.data(), len, 0));
+  EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+}
+
+TEST(RoCachedFs, direct_write) {
+  std::string srcRoot("/tmp/ease/cache/src_direct/");
+  SetupTestDir(srcRoot);
+  // an unaligned tail, written without O_DIRECT
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_direct/file bs=1000 count=2100");
+  std::string root("/tmp/ease/cache/cache_direct/");
+  SetupTestDir(root);
+
+  const size_t len = 2100 * 1000;
+  std::vector<char> src(len), buf(len);
+  auto fd = ::open("/tmp/ease/cache/src_direct/file", O_RDONLY);
+  EXPECT_EQ((ssize_t)len, ::pread(fd, src.data(), len, 0));
+  ::close(fd);
+
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str());
+  DEFER(delete srcFs);
+  auto mediaFs = new_localfs_adaptor(root.c_str());
+  auto cachedFs = new_full_file_cached_fs(srcFs, mediaFs, 1024 * 1024, 512, 1000 * 1000 * 1,
+                                          128ul * 1024 * 1024, nullptr, 0);
+  cachedFs->get_pool()->set_direct_write(true);
+  auto cachedFile = cachedFs->open("/file", O_RDONLY);
+  EXPECT_EQ((ssize_t)len, cachedFile->pread(buf.data(), len, 0));
+  EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+  delete cachedFile;
+  delete cachedFs;
+
+  // the media holds the data, whichever way it was written
+  std::vector<char> media(len);
+  fd = ::open("/tmp/ease/cache/cache_direct/file", O_RDONLY);
+  EXPECT_EQ((ssize_t)len, ::pread(fd, media.data(), len, 0));
+  ::close(fd);
+  EXPECT_EQ(0, memcmp(src.data(), media.data(), len));
+}
+
+TEST(RoCachedFs, compress) {
+  std::string srcRoot("/tmp/ease/cache/src_compress/");
+  SetupTestDir(srcRoot);
+  std::string root("/tmp/ease/cache/cache_compress/");
+  SetupTestDir(root);
+
+  // a compressible unit, one of random data kept as is, and a compressible tail
+  const size_t unit = 1024 * 1024, len = 2 * unit + 100 * 1000;
+  std::vector<char> src(len), buf(len);
+  for (size_t i = 0; i < len; i++)
+    src[i] = 'a' + (i / 100) % 26;
+  for (size_t i = unit; i < 2 * unit; i++)
+    src[i] = rand();
+  auto fd = ::open("/tmp/ease/cache/src_compress/file", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  EXPECT_EQ((ssize_t)len, ::pwrite(fd, src.data(), len, 0));
+  ::close(fd);
+
+  for (int round = 0; round < 2; round++) {
+    // served from the source, then from the media
+    auto srcFs = new_localfs_adaptor(srcRoot.c_str());
+    auto mediaFs = new_localfs_adaptor(root.c_str());
+    auto cachedFs = new_full_file_cached_fs(srcFs, mediaFs, unit, 512, 1000 * 1000 * 1,
+                                            128ul * 1024 * 1024, nullptr, 0);
+    cachedFs->get_pool()->set_compress(true);
+    auto cachedFile = cachedFs->open("/file", O_RDONLY);
+    buf.assign(len, 0);
+    EXPECT_EQ((ssize_t)len, cachedFile->pread(buf.data(), len, 0));
+    EXPECT_EQ(0, memcmp(src.data(), buf.data(), len));
+    // within a unit and across units
+    EXPECT_EQ(4096, cachedFile->pread(buf.data(), 4096, 12345));
+    EXPECT_EQ(0, memcmp(src.data() + 12345, buf.data(), 4096));
+    EXPECT_EQ((ssize_t)unit, cachedFile->pread(buf.data(), unit, unit + 4096));
+    EXPECT_EQ(0, memcmp(src.data() + unit + 4096, buf.data(), unit));
+    // only the range read of the unit kept as is, unaligned
+    EXPECT_EQ(1000, cachedFile->pread(buf.data(), 1000, unit + 500001));
+    EXPECT_EQ(0, memcmp(src.data() + unit + 500001, buf.data(), 1000));
+    EXPECT_EQ(100, cachedFile->pread(buf.data(), 100, unit + 10));
+    EXPECT_EQ(0, memcmp(src.data() + unit + 10, buf.data(), 100));
+    delete cachedFile;
+    delete cachedFs;
+  }
+
+  struct stat st;
+  EXPECT_EQ(0, ::stat("/tmp/ease/cache/cache_compress/file", &st));
+  EXPECT_LT((size_t)st.st_blocks * 512, len - unit / 2);
+}
+
+class IndexedCachePool : public FileCachePool {
+public:
+  using FileCachePool::FileCachePool;
+  size_t files() { return fileIndex_.size(); }
+  int64_t used() { return totalUsed_; }
+  uint64_t waterMark() { return waterMark_; }
+  double share() { return evictionShare(); }
+  bool pinned(const char *name, uint32_t unit) {
+    auto it = fileIndex_.find(name);
+    return it != fileIndex_.end() && it->second->pinned.count(unit);
+  }
+  int64_t punch(const char *name) { return punchUnpinned(fileIndex_.find(name)); }
+};
+
+TEST(FileCachePool, recover_from_meta) {
+  std::string root("/tmp/ease/cache/cache_meta/");
+  SetupTestDir(root);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/cache_meta/a bs=1M count=1");
+  system("mkdir -p /tmp/ease/cache/cache_meta/dir");
+  system("dd if=/dev/urandom of=/tmp/ease/cache/cache_meta/dir/b bs=1M count=2");
+
+  auto newPool = [&]() {
+    auto pool = new IndexedCachePool(new_localfs_adaptor(root.c_str()), 1, 1000 * 1000 * 1,
+                                     128ul * 1024 * 1024, 1024 * 1024);
+    pool->Init();
+    return pool;
+  };
+  // the first start walks the media, the index is checkpointed on exit
+  auto pool = newPool();
+  EXPECT_EQ(2UL, pool->files());
+  auto used = pool->used();
+  EXPECT_GE(used, 3 * 1024 * 1024);
+  delete pool;
+  struct stat st;
+  EXPECT_EQ(0, ::stat((root + ".cache_meta").c_str(), &st));
+
+  // the next one recovers from the checkpoint, without a walk
+  system("dd if=/dev/urandom of=/tmp/ease/cache/cache_meta/c bs=1M count=1");
+  pool = newPool();
+  EXPECT_EQ(2UL, pool->files());
+  EXPECT_EQ(used, pool->used());
+  delete pool;
+
+  // a corrupted checkpoint falls back to the walk
+  system("truncate -s 40 /tmp/ease/cache/cache_meta/.cache_meta");
+  pool = newPool();
+  EXPECT_EQ(3UL, pool->files());
+  delete pool;
+}
+
+TEST(FileCachePool, resize) {
+  std::string root("/tmp/ease/cache/cache_resize/");
+  SetupTestDir(root);
+  auto pool = new IndexedCachePool(new_localfs_adaptor(root.c_str()), 1, 1000 * 1000 * 1,
+                                   128ul * 1024 * 1024, 1024 * 1024);
+  DEFER(delete pool);
+  pool->Init();
+  auto mark = pool->waterMark();
+  EXPECT_EQ(-1, pool->resize(1024 * 1024));
+  EXPECT_EQ(EINVAL, errno);
+  EXPECT_EQ(mark, pool->waterMark());
+  EXPECT_EQ(0, pool->resize(4ul << 30));
+  EXPECT_GT(pool->waterMark(), mark);
+  EXPECT_EQ(0, pool->resize(1ul << 30));
+  EXPECT_EQ(mark, pool->waterMark());
+}
+
+TEST(FileCachePool, pin) {
+  std::string root("/tmp/ease/cache/cache_pin/");
+  SetupTestDir(root);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/cache_pin/a bs=1M count=4");
+  auto pool = new IndexedCachePool(new_localfs_adaptor(root.c_str()), 1, 1000 * 1000 * 1,
+                                   128ul * 1024 * 1024, 1024 * 1024);
+  DEFER(delete pool);
+  pool->Init();
+  auto store = pool->do_open("/a", O_RDWR, 0644);
+  ASSERT_NE(nullptr, store);
+
+  // the unit of the range is pinned, the file LRU punches the others
+  EXPECT_EQ(0, store->pin(1024 * 1024 + 10, 10));
+  EXPECT_FALSE(pool->pinned("/a", 0));
+  EXPECT_TRUE(pool->pinned("/a", 1));
+  EXPECT_GE(pool->punch("/a"), 3 * 1024 * 1024);
+  struct stat st;
+  EXPECT_EQ(0, ::stat((root + "a").c_str(), &st));
+  EXPECT_EQ(4 * 1024 * 1024, st.st_size);
+  EXPECT_GE(st.st_blocks * 512, 1024 * 1024);
+  EXPECT_LT(st.st_blocks * 512, 2 * 1024 * 1024);
+  // nothing left to punch
+  EXPECT_EQ(0, pool->punch("/a"));
+
+  // unpinned once closed
+  store->release();
+  EXPECT_FALSE(pool->pinned("/a", 1));
+}
+
+TEST(FileCachePool, pin_cap) {
+  std::string root("/tmp/ease/cache/cache_pin_cap/");
+  SetupTestDir(root);
+  const uint64_t unit = 1024 * 1024;
+  auto pool = new IndexedCachePool(new_localfs_adaptor(root.c_str()), 1, 1000 * 1000 * 1,
+                                   128ul * 1024 * 1024, unit);
+  DEFER(delete pool);
+  pool->Init();
+  auto store = pool->do_open("/a", O_RDWR | O_CREAT, 0644);
+  ASSERT_NE(nullptr, store);
+
+  // pinned up to kPinRatio of the capacity
+  auto cap = (1UL << 30) * FileCachePool::kPinRatio / 100 / unit;
+  EXPECT_EQ(-1, store->pin(0, 2 * cap * unit));
+  EXPECT_EQ(ENOSPC, errno);
+  EXPECT_TRUE(pool->pinned("/a", cap - 1));
+  EXPECT_FALSE(pool->pinned("/a", cap));
+  // pinned already
+  EXPECT_EQ(0, store->pin(0, unit));
+
+  // and again once the pins of the file are dropped
+  store->release();
+  store = pool->do_open("/a", O_RDWR, 0644);
+  ASSERT_NE(nullptr, store);
+  EXPECT_EQ(0, store->pin(cap * unit, unit));
+  EXPECT_TRUE(pool->pinned("/a", cap));
+  store->release();
+}
+
+TEST(FileCachePool, generation) {
+  std::string root("/tmp/ease/cache/cache_generation/");
+  SetupTestDir(root);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/cache_generation/a bs=1M count=2");
+  auto pool = new IndexedCachePool(new_localfs_adaptor(root.c_str()), 1, 1000 * 1000 * 1,
+                                   128ul * 1024 * 1024, 1024 * 1024);
+  DEFER(delete pool);
+  pool->Init();
+  auto store = pool->do_open("/a", O_RDWR, 0644);
+  ASSERT_NE(nullptr, store);
+  DEFER(store->release());
+
+  // changed by whatever drops data of the file
+  uint64_t gen0, gen1, gen2;
+  ASSERT_EQ(0, store->get_generation(&gen0));
+  EXPECT_EQ(0, store->evict(0, 4096));
+  ASSERT_EQ(0, store->get_generation(&gen1));
+  EXPECT_NE(gen0, gen1);
+  EXPECT_GT(pool->punch("/a"), 0);
+  ASSERT_EQ(0, store->get_generation(&gen2));
+  EXPECT_NE(gen1, gen2);
+}
+
+TEST(FileCacheGroup, reserved) {
+  std::string rootA("/tmp/ease/cache/cache_group_a/"), rootB("/tmp/ease/cache/cache_group_b/");
+  SetupTestDir(rootA);
+  SetupTestDir(rootB);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/cache_group_a/a bs=1M count=3");
+  system("dd if=/dev/urandom of=/tmp/ease/cache/cache_group_b/b bs=1M count=1");
+  auto newPool = [&](const std::string &root) {
+    auto pool = new IndexedCachePool(new_localfs_adaptor(root.c_str()), 1, 1000 * 1000 * 1,
+                                     128ul * 1024 * 1024, 1024 * 1024);
+    pool->Init();
+    return pool;
+  };
+  FileCacheGroup group(2);
+  auto a = newPool(rootA), b = newPool(rootB);
+  DEFER({
+    delete a;
+    delete b;
+  });
+  auto mark = a->waterMark();
+  EXPECT_EQ(0, group.add(a, 0));
+  EXPECT_EQ(0, group.add(b, 2 * 1024 * 1024));
+  // both with the marks of the capacity of the group
+  EXPECT_GT(a->waterMark(), mark);
+  EXPECT_EQ(a->waterMark(), b->waterMark());
+  // b is within its reservation, all of the excess is evicted from a
+  EXPECT_DOUBLE_EQ(1.0, a->share());
+  EXPECT_DOUBLE_EQ(0.0, b->share());
+}
+
+TEST(RoCachedFs, sharded_pool) {
+  std::string srcRoot("/tmp/ease/cache/src_sharded/");
+  SetupTestDir(srcRoot);
+  for (int i = 0; i < 8; i++) {
+    auto cmd = "dd if=/dev/urandom of=/tmp/ease/cache/src_sharded/" + std::to_string(i) +
+               " bs=1M count=1";
+    system(cmd.c_str());
+  }
+  std::string root("/tmp/ease/cache/cache_sharded/");
+  SetupTestDir(root);
+
+  auto srcFs = new CountingFs(new_localfs_adaptor(srcRoot.c_str()));
+  DEFER(delete srcFs);
+  auto newFs = [&](uint32_t shards) {
+    return new_full_file_cached_fs(srcFs, new_localfs_adaptor(root.c_str()), 1024 * 1024, 512,
+                                   1000 * 1000 * 1, 128ul * 1024 * 1024, nullptr, 0, nullptr,
+                                   EVICT_LRU, shards);
+  };
+  const size_t len = 1024 * 1024;
+  std::vector<char> buf(len);
+  auto readAll = [&](ICachedFileSystem *cachedFs) {
+    for (int i = 0; i < 8; i++) {
+      auto cachedFile = cachedFs->open(("/" + std::to_string(i)).c_str(), O_RDONLY);
+      ASSERT_NE(nullptr, cachedFile);
+      EXPECT_EQ((ssize_t)len, cachedFile->pread(buf.data(), len, 0));
+      delete cachedFile;
+    }
+  };
+
+  // each shard checkpoints its own files on exit
+  auto cachedFs = newFs(4);
+  readAll(cachedFs);
+  delete cachedFs;
+  EXPECT_EQ(8, srcFs->count.load());
+  struct stat st;
+  for (int i = 0; i < 4; i++) {
+    EXPECT_EQ(0, ::stat((root + ".cache_meta." + std::to_string(i)).c_str(), &st));
+  }
+
+  // the next start recovers every shard, and all the data is still cached
+  cachedFs = newFs(4);
+  readAll(cachedFs);
+  delete cachedFs;
+  EXPECT_EQ(8, srcFs->count.load());
+
+  // an unsharded pool drops the shards' checkpoints and walks the media
+  cachedFs = newFs(1);
+  readAll(cachedFs);
+  delete cachedFs;
+  EXPECT_EQ(8, srcFs->count.load());
+  EXPECT_NE(0, ::stat((root + ".cache_meta.0").c_str(), &st));
+}
+
+TEST(MemoryCachedFs, admission) {
+  std::string srcRoot("/tmp/ease/cache/src_memory/");
+  SetupTestDir(srcRoot);
+  system("dd if=/dev/urandom of=/tmp/ease/cache/src_memory/file bs=64K count=16");
+  const size_t page = 64 * 1024, len = 16 * page;
+
+  auto srcFs = new_localfs_adaptor(srcRoot.c_str());
+  auto memFs = new_memory_cached_fs(srcFs, 4 * page, page, true);
+  ASSERT_NE(nullptr, memFs);
+  DEFER(delete memFs);
+  auto file = memFs->open("/file", O_RDWR);
+  ASSERT_NE(nullptr, file);
+  DEFER(delete file);
+
+  std::vector<char> origin(len), buf(len);
+  EXPECT_EQ((ssize_t)len, file->pread(origin.data(), len, 0));
+  // page 0 is hot; a single scan of the whole file must not push it out
+  for (int i = 0; i < 4; i++)
+    EXPECT_EQ((ssize_t)page, file->pread(buf.data(), page, 0));
+  EXPECT_EQ((ssize_t)len, file->pread(buf.data(), len, 0));
+  EXPECT_EQ(0, memcmp(origin.data(), buf.data(), len));
+
+  // change the file behind the tier, a cached page still serves the old data
+  auto fd = ::open("/tmp/ease/cache/src_memory/file", O_RDWR);
+  std::vector<char> junk(len, 'x');
+  EXPECT_EQ((ssize_t)len, ::pwrite(fd, junk.data(), len, 0));
+  ::close(fd);
+  EXPECT_EQ((ssize_t)page, file->pread(buf.data(), page, 0));
+  EXPECT_EQ(0, memcmp(origin.data(), buf.data(), page));
+  // pages not admitted are read around the tier
+  EXPECT_EQ((ssize_t)page, file->pread(buf.data(), page, 8 * page));
+  EXPECT_EQ(0, memcmp(junk.data(), buf.data(), page));
+
+  // writes through the tier invalidate the cached pages
+  EXPECT_EQ(4096, file->pwrite(junk.data(), 4096, 0));
+  EXPECT_EQ((ssize_t)page, file->pread(buf.data(), page, 0));
+  EXPECT_EQ(0, memcmp(junk.data(), buf.data(), page));
+
+  // reads across the end of file are short
+  EXPECT_EQ(4096, file->pread(buf.data(), page, len - 4096));
+  EXPECT_EQ(4096, file->pread(buf.data(), page, len - 4096));
+}
+
+TEST(TwoQueuePolicy, scan_resistant) {
+  TwoQueuePolicy policy(100);
+  uint64_t key;
+  // the hot set is seen once, evicted, and seen again while remembered
+  for (uint64_t i = 0; i < 50; i++) policy.access(i);
+  for (int i = 0; i < 50; i++) EXPECT_TRUE(policy.victim(&key));
+  EXPECT_EQ(0UL, policy.size());
+  for (uint64_t i = 0; i < 50; i++) policy.access(i);
+  EXPECT_EQ(50UL, policy.size());
+
+  // a one-pass scan is evicted before anything of the hot set
+  for (uint64_t i = 1000; i < 2000; i++) policy.access(i);
+  for (int i = 0; i < 1000 - 25; i++) {
+    EXPECT_TRUE(policy.victim(&key));
+    EXPECT_GE(key, 1000UL);
+  }
+
+  policy.remove(1999);
+  policy.remove(3);
+  EXPECT_EQ(25UL - 1 + 49, policy.size());
+  while (policy.victim(&key))
+    ;
+  EXPECT_EQ(0UL, policy.size());
+}
+
+TEST(TwoQueuePolicy, resize) {
+  TwoQueuePolicy policy(100);
+  uint64_t key;
+  for (uint64_t i = 0; i < 50; i++) policy.access(i);
+  for (int i = 0; i < 50; i++) EXPECT_TRUE(policy.victim(&key));
+  // shrinking forgets the oldest evicted keys beyond the new memory
+  policy.resize(40);
+  for (uint64_t i = 0; i < 50; i++) policy.access(i);
+  EXPECT_EQ(50UL, policy.size());
+  // 0..29 are seen for the first time again, and go first down to the
+  // shrunk `a1in`, then the hot ones remembered and promoted to `am`
+  for (int i = 0; i < 20; i++) {
+    EXPECT_TRUE(policy.victim(&key));
+    EXPECT_LT(key, 30UL);
+  }
+  EXPECT_TRUE(policy.victim(&key));
+  EXPECT_GE(key, 30UL);
+}
+
+TEST(BufferPool, concurrent) {
+  // buffers taken and given back by several OS threads, many of them freed
+  // by another thread than the one taking them, so that they go through the
+  // thread caches and the shared stacks of their classes
+  const int nthreads = 8, rounds = 20000;
+  std::mutex mtx;
+  struct Handed {
+    uint64_t *p, size, tag;
+  };
+  std::vector<Handed> handed;
+  std::atomic<int> corrupted{0};
+  auto check_free = [&](uint64_t *p, uint64_t size, uint64_t tag) {
+    // each word holds the tag of its owner, a buffer given twice is overwritten
+    for (uint64_t i = 0; i < size / sizeof(uint64_t); i += 512)
+      if (p[i] != tag) corrupted++;
+    BufferPool::dealloc(p);
+  };
+  std::vector<std::thread> threads;
+  for (int t = 0; t < nthreads; t++) {
+    threads.emplace_back([&, t]() {
+      std::mt19937 rng(t);
+      for (int r = 0; r < rounds; r++) {
+        uint64_t size = 4096ULL << (rng() % 6);
+        auto p = (uint64_t *)BufferPool::alloc(size);
+        ASSERT_NE(nullptr, p);
+        ASSERT_EQ(0UL, (uintptr_t)p % 4096);
+        ASSERT_GE(BufferPool::class_of_buffer(p), 0);
+        uint64_t tag = (uint64_t)t << 32 | r;
+        for (uint64_t i = 0; i < size / sizeof(uint64_t); i += 512) p[i] = tag;
+        if (rng() % 2 == 0) {
+          check_free(p, size, tag);
+          continue;
+        }
+        Handed other = {nullptr, 0, 0};
+        {
+          std::lock_guard<std::mutex> lock(mtx);
+          handed.push_back({p, size, tag});
+          if (handed.size() > 64) {
+            auto i = rng() % handed.size();
+            other = handed[i];
+            handed[i] = handed.back();
+            handed.pop_back();
+          }
+        }
+        if (other.p) check_free(other.p, other.size, other.tag);
+      }
+    });
+  }
+  for (auto &th : threads) th.join();
+  for (auto &h : handed) check_free(h.p, h.size, h.tag);
+  EXPECT_EQ(0, corrupted.load());
+
+  // larger buffers are not from the pool
+  auto big = BufferPool::buffer(8 << 20);
+  ASSERT_NE(nullptr, big);
+  EXPECT_EQ(-1, BufferPool::class_of_buffer(big.get()));
+}
+
 }  //  namespace Cache
 
 int main(int argc, char** argv) {
@@ -0,0 +1,116 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// Accounts the CPU time of the hot subsystems of the read path, by the cycle
+// counter around each call, per OS thread (a photon vcpu or a worker thread
+// such as those of zfile decompression). A disabled scope costs a relaxed
+// load; it's header only so that every library can be hooked without a link
+// dependency.
+namespace CpuAccount {
+
+enum Subsystem : int {
+    DECOMPRESS = 0, // zfile blocks
+    CRC32C,         // zfile block checksums
+    INFLATE,        // gzip streams
+    LOOKUP,         // LSMT index
+    SUBSYSTEMS,
+};
+
+static const char *const SUBSYSTEM_NAMES[SUBSYSTEMS] = {"decompress", "crc32c", "inflate",
+                                                        "lookup"};
+
+// threads beyond it share the slots
+static const uint32_t MAX_THREADS = 64;
+
+struct alignas(64) Slot {
+    std::atomic<uint64_t> cycles[SUBSYSTEMS];
+    std::atomic<uint64_t> calls[SUBSYSTEMS];
+    std::atomic<bool> used;
+};
+
+struct State {
+    std::atomic<bool> enabled;
+    std::atomic<uint32_t> threads;
+    Slot slots[MAX_THREADS];
+};
+
+// zero initialized, and one instance across the libraries
+inline State &state() {
+    static State s;
+    return s;
+}
+
+inline bool enabled() {
+    return state().enabled.load(std::memory_order_relaxed);
+}
+
+inline void enable(bool on) {
+    state().enabled = on;
+}
+
+// TSC on x86_64, the generic timer on aarch64, nanoseconds elsewhere
+inline uint64_t cycles() {
+#if defined(__x86_64__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+inline Slot &slot() {
+    static thread_local Slot *s = nullptr;
+    if (s == nullptr) {
+        auto &st = state();
+        s = &st.slots[st.threads.fetch_add(1, std::memory_order_relaxed) % MAX_THREADS];
+        s->used = true;
+    }
+    return *s;
+}
+
+class Scope {
+public:
+    explicit Scope(Subsystem sub) : m_sub(sub), m_start(enabled() ? cycles() : 0) {
+    }
+    ~Scope() {
+        if (m_start == 0)
+            return;
+        auto &s = slot();
+        s.cycles[m_sub].fetch_add(cycles() - m_start, std::memory_order_relaxed);
+        s.calls[m_sub].fetch_add(1, std::memory_order_relaxed);
+    }
+
+private:
+    Subsystem m_sub;
+    uint64_t m_start;
+};
+
+} // namespace CpuAccount
@@ -0,0 +1,110 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <errno.h>
+#include <stddef.h>
+#include <functional>
+#include <vector>
+#include <photon/thread/thread11.h>
+
+// Fans the sub-requests of a request out over a few photon threads, instead of
+// a thread per sub-request. They're submitted to a group as they're found and
+// completed by waiting for the group; at most `concurrency` threads run them,
+// the waiting one included, each taking the next one queued when done with
+// one. The threads are started on submission, so the first sub-requests are in
+// flight while the submitter goes on looking for the others, and the queued
+// ones are dropped once one of them has failed. A group belongs to the thread
+// creating it, and its threads to the same vcpu, so it takes no lock. It's
+// header only, like BufferPool, so that every layer can use it without a link
+// dependency.
+namespace FanOut {
+
+// `Task` is a sub-request, called with no argument and returning < 0 with errno
+// set on failure. Those of a hot path had better be a small struct of their own,
+// kept in the queue as is, than a std::function that may allocate for each.
+template <typename Task = std::function<int()>>
+class Group {
+public:
+    explicit Group(size_t concurrency) : m_concurrency(concurrency ? concurrency : 1) {
+    }
+    Group(const Group &) = delete;
+    Group &operator=(const Group &) = delete;
+    // the sub-requests refer to the submitter's buffers, so they're completed
+    ~Group() {
+        wait();
+    }
+
+    void submit(Task task) {
+        if (m_errno)
+            return;
+        m_tasks.push_back(std::move(task));
+        // the waiting thread takes part too
+        if (m_running + 1 < m_concurrency && m_running < m_tasks.size() - m_next) {
+            m_running++;
+            m_threads.push_back(
+                photon::thread_enable_join(photon::thread_create11(&Group::work, this)));
+        }
+    }
+
+    // runs the queued sub-requests along with the threads, until they're all
+    // done; returns 0, or -1 with errno of the first failure
+    int wait() {
+        run();
+        for (auto th : m_threads)
+            photon::thread_join(th);
+        m_started += m_threads.size();
+        m_threads.clear();
+        if (m_errno) {
+            errno = m_errno;
+            return -1;
+        }
+        return 0;
+    }
+
+    // # of threads started for the sub-requests
+    size_t threads() const {
+        return m_started + m_threads.size();
+    }
+
+private:
+    size_t m_concurrency;
+    size_t m_running = 0;
+    size_t m_started = 0;
+    int m_errno = 0;
+    std::vector<Task> m_tasks;
+    size_t m_next = 0; // of m_tasks, to be taken
+    std::vector<photon::join_handle *> m_threads;
+
+    void run() {
+        while (m_errno == 0 && m_next < m_tasks.size()) {
+            // taken out, as submissions may move the queue while it runs
+            auto task = std::move(m_tasks[m_next++]);
+            if (task() < 0 && m_errno == 0)
+                m_errno = errno ? errno : EIO;
+        }
+        m_tasks.clear();
+        m_next = 0;
+    }
+
+    void work() {
+        run();
+        m_running--;
+    }
+};
+
+} // namespace FanOut
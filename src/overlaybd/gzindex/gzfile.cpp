@@ -18,10 +18,20 @@
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
+#include <zstd.h>
+#include <atomic>
 #include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <algorithm>
+#include "gzfile.h"
+#include "inflater.h"
 #include "gzfile_index.h"
+#include "../cpu_account.h"
 #include "photon/common/alog.h"
 #include "photon/common/alog-stdstring.h"
 #include "photon/fs/localfs.h"
@@ -32,12 +42,139 @@
 namespace FileSystem {
 using namespace photon::fs;
 
+// A sharded LRU of the inflated spans between two index entries, and of the
+// inflated dictionaries of the entries, shared by all the GzFiles and keyed by
+// an id of the file and the position of the span / dictionary. Without it, a
+// random read inflates from the nearest entry up to its offset every time.
+class SpanCache {
+public:
+    static const size_t NSHARDS = 16;
+    // dictionaries are keyed by their position in the index file, with this
+    // bit set to tell them from the spans, which are keyed by de_pos
+    static const uint64_t DICT_BIT = 1ULL << 63;
+
+    struct Key {
+        uint64_t file_id, pos;
+        bool operator==(const Key &rhs) const {
+            return file_id == rhs.file_id && pos == rhs.pos;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key &k) const {
+            return std::hash<uint64_t>()(k.file_id * 1000000007ULL + k.pos);
+        }
+    };
+    struct Entry {
+        Key key;
+        std::vector<unsigned char> data;
+    };
+    struct Shard {
+        std::mutex mtx;
+        std::list<Entry> lru; // most recently used at front
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map;
+        size_t bytes = 0;
+    } m_shards[NSHARDS];
+
+    std::atomic<size_t> m_capacity{0}; // in bytes, 0 for disabled
+    std::atomic<uint64_t> m_hits{0}, m_misses{0}, m_dict_hits{0}, m_dict_misses{0};
+    std::atomic<uint64_t> m_next_file_id{1};
+
+    Shard &shard(const Key &k) {
+        return m_shards[KeyHash()(k) % NSHARDS];
+    }
+
+    bool enabled() const {
+        return m_capacity.load(std::memory_order_relaxed) > 0;
+    }
+
+    // whether an entry of `count` bytes would be kept at all
+    bool fits(size_t count) const {
+        return count <= m_capacity.load(std::memory_order_relaxed) / NSHARDS;
+    }
+
+    // copy [offset, offset + count) of the entry to `buf` if it's cached
+    bool get(uint64_t file_id, uint64_t pos, void *buf, size_t offset, size_t count) {
+        Key k{file_id, pos};
+        auto &s = shard(k);
+        bool hit = false;
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            auto it = s.map.find(k);
+            if (it != s.map.end() && offset + count <= it->second->data.size()) {
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                memcpy(buf, it->second->data.data() + offset, count);
+                hit = true;
+            }
+        }
+        if (pos & DICT_BIT) {
+            hit ? m_dict_hits++ : m_dict_misses++;
+        } else {
+            hit ? m_hits++ : m_misses++;
+        }
+        return hit;
+    }
+
+    void put(uint64_t file_id, uint64_t pos, const void *buf, size_t count) {
+        auto cap = m_capacity.load(std::memory_order_relaxed) / NSHARDS;
+        if (count > cap)
+            return;
+        Key k{file_id, pos};
+        auto &s = shard(k);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        if (s.map.count(k))
+            return;
+        s.lru.push_front(Entry{k, std::vector<unsigned char>((const unsigned char *)buf,
+                                                             (const unsigned char *)buf + count)});
+        s.map[k] = s.lru.begin();
+        s.bytes += count;
+        evict(s, cap);
+    }
+
+    void evict(Shard &s, size_t cap) {
+        while (s.bytes > cap && !s.lru.empty()) {
+            auto &e = s.lru.back();
+            s.bytes -= e.data.size();
+            s.map.erase(e.key);
+            s.lru.pop_back();
+        }
+    }
+
+    void set_capacity(size_t capacity) {
+        m_capacity = capacity;
+        for (auto &s : m_shards) {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            evict(s, capacity / NSHARDS);
+        }
+    }
+
+    GzSpanCacheStats stats() {
+        GzSpanCacheStats st;
+        st.hits = m_hits;
+        st.misses = m_misses;
+        st.dict_hits = m_dict_hits;
+        st.dict_misses = m_dict_misses;
+        st.capacity = m_capacity;
+        for (auto &s : m_shards) {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            st.bytes += s.bytes;
+            st.entries += s.map.size();
+        }
+        return st;
+    }
+};
+
+static SpanCache span_cache;
+static std::atomic<bool> window_mmap{false};
+
 class GzFile : public VirtualReadOnlyFile {
 public:
     bool m_file_ownership = false;
     GzFile() = delete;
     explicit GzFile(photon::fs::IFile* gzip_file, photon::fs::IFile* index);
     virtual ~GzFile(){
+        if (windows_) {
+            munmap(windows_, (size_t)index_.size() * WINSIZE);
+        }
         if (m_file_ownership) {
             delete gzip_file_;
             delete index_file_;
@@ -62,12 +199,21 @@ private:
     struct IndexFileHeader index_header_;
     INDEX index_;
     bool inited_ = false;
+    uint64_t cache_id_ = span_cache.m_next_file_id++;
+    // the decompressed windows of the entries, and whether they are loaded
+    enum { WINDOW_NONE, WINDOW_LOADING, WINDOW_LOADED };
+    unsigned char *windows_ = nullptr;
+    std::unique_ptr<std::atomic<uint8_t>[]> window_state_;
     int init();
     int parse_index();
     IndexEntry *seek_index(INDEX &index, off_t offset);
+    int64_t seek_index_pos(INDEX &index, off_t offset);
+    ssize_t cached_pread(unsigned char *buf, size_t count, off_t offset);
     ssize_t extract(const struct IndexEntry *found_idx,
                     off_t offset, unsigned char *buf, int len);
     int get_dict_by_index(const IndexEntry *found_idx, unsigned char *window_buf);
+    int load_dict(const IndexEntry *found_idx, unsigned char *window_buf);
+    int init_window_mmap();
 };
 
 static int zlib_decompress(unsigned char *in, int in_len, unsigned char *out, int& out_len) {
@@ -83,7 +229,10 @@ static int zlib_decompress(unsigned char *in, int in_len, unsigned char *out, in
     strm.next_in = in;
     strm.avail_out = out_len;
     strm.next_out = out;
-    ret = inflate(&strm, Z_FINISH);
+    {
+        CpuAccount::Scope _cpu(CpuAccount::INFLATE);
+        ret = inflate(&strm, Z_FINISH);
+    }
     if (ret != Z_STREAM_END) {
         LOG_ERRNO_RETURN(0, -1, "ret != Z_STREAM_END, ret:`", ret);
     }
@@ -91,6 +240,25 @@ static int zlib_decompress(unsigned char *in, int in_len, unsigned char *out, in
     return 0;
 }
 
+static int zstd_decompress(unsigned char *in, int in_len, unsigned char *out, int& out_len) {
+    auto ret = ZSTD_decompress(out, out_len, in, in_len);
+    if (ZSTD_isError(ret)) {
+        LOG_ERRNO_RETURN(0, -1, "Failed to ZSTD_decompress, err:`", ZSTD_getErrorName(ret));
+    }
+    out_len = ret;
+    return 0;
+}
+
+static int dict_decompress(int algo, unsigned char *in, int in_len, unsigned char *out, int& out_len) {
+    if (algo == DICT_COMPRESS_ALGO_ZLIB) {
+        return zlib_decompress(in, in_len, out, out_len);
+    }
+    if (algo == DICT_COMPRESS_ALGO_ZSTD) {
+        return zstd_decompress(in, in_len, out, out_len);
+    }
+    LOG_ERRNO_RETURN(0, -1, "Wrong dict compress algorithm:`", algo);
+}
+
 GzFile::GzFile(photon::fs::IFile* gzip_file, photon::fs::IFile* index) {
     gzip_file_ = gzip_file;
     index_file_ = index;
@@ -119,8 +287,8 @@ int GzFile::parse_index() {
     }
 
     if (index_header_.dict_compress_algo != 0) {
-        if (zlib_decompress(idx_area_buf, idx_area_buf_len, index_buf, index_buf_len) != 0) {
-            LOG_ERRNO_RETURN(0, -1, "Faild to zlib_decompress, idx_area_buf_len:`, index_buf_len:`", idx_area_buf_len, index_buf_len);
+        if (dict_decompress(index_header_.dict_compress_algo, idx_area_buf, idx_area_buf_len, index_buf, index_buf_len) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "Faild to decompress index, idx_area_buf_len:`, index_buf_len:`", idx_area_buf_len, index_buf_len);
         }
         if (index_buf_len != index_header_.index_num * index_header_.index_size) {
             LOG_ERRNO_RETURN(0, -1, "Wrong uncompressed buffer len for index.");
@@ -196,6 +364,9 @@ int GzFile::init() {
     if (parse_index() != 0) {
         LOG_ERRNO_RETURN(0, -1, "Failed parse_index()");
     }
+    if (window_mmap && init_window_mmap() != 0) {
+        LOG_ERRNO_RETURN(0, -1, "Failed init_window_mmap()");
+    }
 
     inited_ = true;
     return 0;
@@ -203,23 +374,89 @@ int GzFile::init() {
 
 static bool indx_compare(struct IndexEntry* i, struct IndexEntry* j) { return i->de_pos < j->de_pos; }
 IndexEntry *GzFile::seek_index(INDEX &index, off_t offset) {
-    if (index.size() == 0) {
+    auto idx = seek_index_pos(index, offset);
+    if (idx < 0) {
         return nullptr;
     }
+    return index.at(idx);
+}
+
+int64_t GzFile::seek_index_pos(INDEX &index, off_t offset) {
+    if (index.size() == 0) {
+        return -1;
+    }
     struct IndexEntry tmp;
     tmp.de_pos = offset;
     INDEX::iterator iter = std::upper_bound(index.begin(), index.end(), &tmp, indx_compare);
     if (iter == index.end()) {
-        return index.at(index.size() - 1);
+        return index.size() - 1;
     }
-    int idx = iter - index.begin();
+    int64_t idx = iter - index.begin();
     if (idx > 0) {
         idx --;
     }
-    return index.at(idx);
+    return idx;
+}
+
+// the pages are only backed once a window is loaded there
+int GzFile::init_window_mmap() {
+    if (index_.empty()) {
+        return 0;
+    }
+    size_t len = (size_t)index_.size() * WINSIZE;
+    auto p = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+        LOG_ERRNO_RETURN(0, -1, "Failed to mmap windows, len:`", len);
+    }
+    windows_ = (unsigned char *)p;
+    window_state_.reset(new std::atomic<uint8_t>[index_.size()]);
+    for (size_t i = 0; i < index_.size(); i++) {
+        window_state_[i] = WINDOW_NONE;
+    }
+    return 0;
 }
 
 int GzFile::get_dict_by_index(const IndexEntry *found_idx, unsigned char *dict_buf) {
+    if (windows_) {
+        size_t i = std::lower_bound(index_.begin(), index_.end(), (IndexEntry *)found_idx, indx_compare) - index_.begin();
+        while (i < index_.size() && index_[i] != found_idx) {
+            i++;
+        }
+        if (i == index_.size()) {
+            LOG_ERRNO_RETURN(0, -1, "Entry is not in the index, de_pos:`", found_idx->de_pos+0);
+        }
+        auto window = windows_ + (size_t)i * WINSIZE;
+        if (window_state_[i].load(std::memory_order_acquire) == WINDOW_LOADED) {
+            memcpy(dict_buf, window, WINSIZE);
+            return 0;
+        }
+        if (load_dict(found_idx, dict_buf) != 0) {
+            return -1;
+        }
+        // one of the racing readers keeps it
+        uint8_t none = WINDOW_NONE;
+        if (window_state_[i].compare_exchange_strong(none, WINDOW_LOADING)) {
+            memcpy(window, dict_buf, WINSIZE);
+            window_state_[i].store(WINDOW_LOADED, std::memory_order_release);
+        }
+        return 0;
+    }
+
+    bool use_cache = span_cache.enabled();
+    uint64_t dict_key = found_idx->win_pos | SpanCache::DICT_BIT;
+    if (use_cache && span_cache.get(cache_id_, dict_key, dict_buf, 0, WINSIZE)) {
+        return 0;
+    }
+    if (load_dict(found_idx, dict_buf) != 0) {
+        return -1;
+    }
+    if (use_cache) {
+        span_cache.put(cache_id_, dict_key, dict_buf, WINSIZE);
+    }
+    return 0;
+}
+
+int GzFile::load_dict(const IndexEntry *found_idx, unsigned char *dict_buf) {
     if (index_header_.dict_compress_algo == 0) {
         if (found_idx->win_len != WINSIZE) {
             LOG_ERRNO_RETURN(0, -1, "Wrong window size:`", found_idx->win_len+0);
@@ -232,23 +469,18 @@ int GzFile::get_dict_by_index(const IndexEntry *found_idx, unsigned char *dict_b
 
     unsigned char *tmp_buf = new unsigned char[found_idx->win_len];
     DEFER(delete []tmp_buf);
-    if (index_header_.dict_compress_algo != 1) {
-        LOG_ERRNO_RETURN(0, -1, "Wrong dict compress algorithm:`", index_header_.dict_compress_algo);
-    }
-
     if (index_file_->pread(tmp_buf, found_idx->win_len, found_idx->win_pos) != found_idx->win_len) {
         LOG_ERRNO_RETURN(0, -1, "Fail to index_file_->pread, offset:`, len:`", found_idx->win_pos+0, found_idx->win_len+0);
     }
 
     int window_buf_len = WINSIZE;
-    if (zlib_decompress(tmp_buf, found_idx->win_len, dict_buf, window_buf_len) != 0) {
-        LOG_ERRNO_RETURN(0, -1, "Failed to dict_zlib_decompress.");
+    if (dict_decompress(index_header_.dict_compress_algo, tmp_buf, found_idx->win_len, dict_buf, window_buf_len) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "Failed to decompress dict.");
     }
 
     if (window_buf_len != WINSIZE) {
         LOG_ERRNO_RETURN(0, -1, "window_buf_len != `", WINSIZE);
     }
-
     return 0;
 }
 
@@ -261,55 +493,33 @@ ssize_t GzFile::extract(
     unsigned char dict[WINSIZE];
     unsigned char discard[CHUNK];
 
-    z_stream strm;
-    memset(&strm, 0, sizeof(strm));
-
-    int ret = inflateInit2(&strm, -15);
-    if (ret != Z_OK) {
-        LOG_ERRNO_RETURN(0, -1, "Fail to inflateInit2(&strm, -15)");
-    }
-    DEFER(inflateEnd(&strm));
-
     off_t start_pos = found_idx->en_pos - (found_idx->bits ? 1 : 0);
-    // ret = gzip_file_->lseek(start_pos, SEEK_SET);
-    if (ret == -1){
-        LOG_ERRNO_RETURN(0, -1, "Fail to gzip_file->lseek(`, SEEK_SET)", start_pos);
-    }
+    int prime = 0;
     if (found_idx->bits) {
         unsigned char tmp;
         if (gzip_file_->pread(&tmp, 1, start_pos) != 1) {
             LOG_ERRNO_RETURN(0, -1, "Fail to gzip_file->pread");
         }
         start_pos++;
-        inflatePrime(&strm, found_idx->bits, tmp >> (8 - found_idx->bits));
+        prime = tmp >> (8 - found_idx->bits);
     }
 
     if (get_dict_by_index(found_idx, dict) != 0) {
         LOG_ERRNO_RETURN(0, -1, "Faild to get window data.");
     }
-    inflateSetDictionary(&strm, dict, WINSIZE);
-
-    offset -= found_idx->de_pos;
-    strm.avail_in = 0;
-    bool skip = true;
-    do {
-        if (offset == 0 && skip) {
-            strm.avail_out = buf_len;
-            strm.next_out = buf;
-            skip = false;
-        }
-        if (offset > CHUNK) {
-            strm.avail_out = CHUNK;
-            strm.next_out = discard;
-            offset -= CHUNK;
-        } else if (offset != 0) {
-            strm.avail_out = static_cast<unsigned int>(offset);
-            strm.next_out = discard;
-            offset = 0;
-        }
+    std::unique_ptr<RawInflater> inflater(new_raw_inflater());
+    if (inflater->init(found_idx->bits, prime, dict, WINSIZE) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "Fail to init inflater");
+    }
 
-        do {
-            if (strm.avail_in == 0) {
+    const unsigned char *in = nullptr;
+    size_t avail_in = 0;
+    bool stream_end = false;
+    // inflates `len` bytes to `out`, or less at the end of the stream
+    auto inflate_to = [&](unsigned char *out, size_t len) -> ssize_t {
+        size_t avail_out = len;
+        while (avail_out != 0 && !stream_end) {
+            if (avail_in == 0) {
                 ssize_t read_cnt = gzip_file_->pread(inbuf, CHUNK, start_pos);
                 if (read_cnt < 0 ) {
                     LOG_ERRNO_RETURN(0, -1, "Fail to gzip_file->pread(input, CHUNK, `)", start_pos);
@@ -318,26 +528,35 @@ ssize_t GzFile::extract(
                     LOG_ERRNO_RETURN(Z_DATA_ERROR, -1, "Fail to gzip_file->pread(input, CHUNK, `)", start_pos);
                 }
                 start_pos += read_cnt;
-                strm.avail_in = read_cnt;
-                strm.next_in = inbuf;
+                avail_in = read_cnt;
+                in = inbuf;
             }
-            ret = inflate(&strm, Z_NO_FLUSH);
-            if (ret == Z_STREAM_END) {
-                break;
+            int ret;
+            {
+                CpuAccount::Scope _cpu(CpuAccount::INFLATE);
+                ret = inflater->inflate(in, avail_in, out, avail_out);
             }
-            if (ret != Z_OK && ret != Z_BUF_ERROR) {
-                LOG_ERRNO_RETURN(0, -1, "Fail to inflate. ret:`", ret);
+            if (ret < 0) {
+                return -1;
             }
-        } while (strm.avail_out != 0);
-        if (ret == Z_STREAM_END) {
-            break;
+            stream_end = ret > 0;
         }
-    } while (skip);
-    if (skip) {
-        return 0;
+        return len - avail_out;
+    };
+
+    offset -= found_idx->de_pos;
+    while (offset > 0) {
+        auto n = std::min(offset, (off_t)CHUNK);
+        if (inflate_to(discard, n) < 0) {
+            return -1;
+        }
+        if (stream_end) {
+            return 0;
+        }
+        offset -= n;
     }
     //LOG_DEBUG("offset:`,len:`,return:`", offset, len, len - strm.avail_out);
-    return buf_len - strm.avail_out;
+    return inflate_to(buf, buf_len);
 #undef CHUNK
 }
 
@@ -351,6 +570,10 @@ ssize_t GzFile::pread(void *buf, size_t count, off_t offset) {
         LOG_ERRNO_RETURN(EINVAL, -1, "invalid offset: ` < 0", offset);
     }
 
+    if (span_cache.enabled()) {
+        return cached_pread((unsigned char*)buf, count, offset);
+    }
+
     struct IndexEntry * p = seek_index(index_, offset);
     if (p == nullptr) {
         LOG_ERRNO_RETURN(0, -1, "Failed to seek_index(,`)", offset);
@@ -359,6 +582,51 @@ ssize_t GzFile::pread(void *buf, size_t count, off_t offset) {
     return extract(p, offset, (unsigned char*)buf, count);
 }
 
+// reads span by span, inflating a missing span as a whole into the cache,
+// so that the following reads in it are served by a memcpy
+ssize_t GzFile::cached_pread(unsigned char *buf, size_t count, off_t offset) {
+    off_t file_size = index_header_.uncompress_file_size;
+    size_t done = 0;
+    while (done < count && offset < file_size) {
+        auto idx = seek_index_pos(index_, offset);
+        if (idx < 0) {
+            LOG_ERRNO_RETURN(0, -1, "Failed to seek_index(,`)", offset);
+        }
+        auto p = index_[idx];
+        off_t span_begin = p->de_pos;
+        off_t span_end = (size_t)idx + 1 < index_.size() ? index_[idx + 1]->de_pos : file_size;
+        size_t span_len = span_end - span_begin;
+        size_t n = std::min(count - done, (size_t)(span_end - offset));
+        if (!span_cache.fits(span_len)) {
+            // too large to be kept, inflate only what is asked
+            auto ret = extract(p, offset, buf + done, n);
+            if (ret < 0) {
+                return -1;
+            }
+            done += ret;
+            if ((size_t)ret < n) {
+                break;
+            }
+        } else if (!span_cache.get(cache_id_, span_begin, buf + done, offset - span_begin, n)) {
+            std::vector<unsigned char> span(span_len);
+            auto ret = extract(p, span_begin, span.data(), span_len);
+            if (ret < 0) {
+                return -1;
+            }
+            if ((size_t)ret != span_len) {
+                LOG_ERRNO_RETURN(EIO, -1, "short span inflated, offset:`, ` != `", span_begin, ret, span_len);
+            }
+            span_cache.put(cache_id_, span_begin, span.data(), span_len);
+            memcpy(buf + done, span.data() + (offset - span_begin), n);
+            done += n;
+        } else {
+            done += n;
+        }
+        offset += n;
+    }
+    return done;
+}
+
 } // namespace FileSystem
 
 photon::fs::IFile* new_gzfile(photon::fs::IFile* gzip_file, photon::fs::IFile* index, bool ownership) {
@@ -370,6 +638,36 @@ photon::fs::IFile* new_gzfile(photon::fs::IFile* gzip_file, photon::fs::IFile* i
     return rst;
 }
 
+void gzfile_set_span_cache(size_t capacity) {
+    LOG_INFO("set capacity of gzfile span cache: `", capacity);
+    FileSystem::span_cache.set_capacity(capacity);
+}
+
+GzSpanCacheStats gzfile_span_cache_stats() {
+    return FileSystem::span_cache.stats();
+}
+
+void gzfile_set_window_mmap(bool enable) {
+    LOG_INFO("keep gzfile windows in mmap: `", enable);
+    FileSystem::window_mmap = enable;
+}
+
+int gzfile_set_inflate_backend(const char *name) {
+    InflateBackend backend;
+    if (strcmp(name, "zlib") == 0) {
+        backend = InflateBackend::Zlib;
+    } else if (strcmp(name, "isal") == 0) {
+        backend = InflateBackend::Isal;
+    } else {
+        LOG_ERRNO_RETURN(EINVAL, -1, "unknown inflate backend: `", name);
+    }
+    if (set_inflate_backend(backend) != 0) {
+        return -1;
+    }
+    LOG_INFO("set inflate backend of gzfile: `", name);
+    return 0;
+}
+
 bool is_gzfile(photon::fs::IFile* file) {
     char buf[4] = {0};
     file->read(buf, 2);
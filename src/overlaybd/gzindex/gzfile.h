@@ -30,12 +30,52 @@ extern photon::fs::IFile* new_gzfile(photon::fs::IFile* gzip_file, photon::fs::I
 //dict_compress_algo:
 //0: don't compress dictionary
 //1: compress dictionary with zlib
+//2: compress dictionary with zstd, which decompresses several times faster
 
 //dict_compress_level:
 //0: no compression
 //1: best speed
 //9: best compression
+//for zstd, it's in [1, ZSTD_maxCLevel()]
 extern int create_gz_index(photon::fs::IFile* gzip_file, const char *index_file_path,
     off_t chunk_size=GZ_CHUNK_SIZE, int dict_compress_algo=GZ_DICT_COMPERSS_ALGO, int dict_compress_level=GZ_COMPRESS_LEVEL);
 
+// like create_gz_index(), but places the index entries every `hot_span` in the
+// `hot_ranges` of the uncompressed data, so that random reads there inflate
+// less, and every `chunk_size` elsewhere, so that the index stays small.
+// hot_span must be in [64KB, chunk_size].
+extern int create_gz_index_adaptive(photon::fs::IFile* gzip_file, const char *index_file_path,
+    const std::vector<GzHotRange> &hot_ranges, off_t hot_span,
+    off_t chunk_size=GZ_CHUNK_SIZE, int dict_compress_algo=GZ_DICT_COMPERSS_ALGO, int dict_compress_level=GZ_COMPRESS_LEVEL);
+
+// like create_gz_index(), but inflates the gzip file with `nthreads` threads:
+// the compressed data is split into chunks, the deflate blocks starting each
+// chunk are found by trial, and the chunks are inflated before the windows
+// they start with are known, which are filled in by a quick sequential pass
+// afterwards. Falls back to create_gz_index() if the trial goes wrong.
+extern int create_gz_index_parallel(photon::fs::IFile* gzip_file, const char *index_file_path, int nthreads,
+    off_t chunk_size=GZ_CHUNK_SIZE, int dict_compress_algo=GZ_DICT_COMPERSS_ALGO, int dict_compress_level=GZ_COMPRESS_LEVEL);
+
 bool is_gzfile(photon::fs::IFile* file);
+
+// set the capacity (in bytes) of the cache of the inflated spans between index
+// entries and of their dictionaries, which is shared by all the gzfiles;
+// 0 (default) disables the cache.
+void gzfile_set_span_cache(size_t capacity);
+
+struct GzSpanCacheStats {
+    uint64_t hits = 0, misses = 0;
+    uint64_t dict_hits = 0, dict_misses = 0;
+    uint64_t entries = 0, bytes = 0, capacity = 0;
+};
+GzSpanCacheStats gzfile_span_cache_stats();
+
+// select the inflate implementation of the gzfile reads: "zlib", or "isal"
+// (ISA-L igzip) which is only built in, and the default, with ENABLE_ISAL.
+// returns -1 for an unknown or unavailable one.
+int gzfile_set_inflate_backend(const char *name);
+
+// keep the windows of each gzfile decompressed in an anonymous mmap of the
+// gzfile once loaded, so that a seek costs the inflate alone; memory grows by
+// up to 32KB per index entry read. Takes effect on the gzfiles opened later.
+void gzfile_set_window_mmap(bool enable);
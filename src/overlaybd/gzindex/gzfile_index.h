@@ -25,7 +25,11 @@
 #include "photon/fs/filesystem.h"
 
 #define GZ_CHUNK_SIZE 1048576
-#define GZ_DICT_COMPERSS_ALGO 1
+#define DICT_COMPRESS_ALGO_NONE 0
+#define DICT_COMPRESS_ALGO_ZLIB 1
+#define DICT_COMPRESS_ALGO_ZSTD 2
+
+#define GZ_DICT_COMPERSS_ALGO DICT_COMPRESS_ALGO_ZLIB
 #define GZ_COMPRESS_LEVEL 6
 
 #define WINSIZE 32768U
@@ -85,12 +89,24 @@ struct IndexEntry {
 
 typedef std::vector<struct IndexEntry *> INDEX;
 
+// a range of the uncompressed data read often, e.g. recorded in a trace
+struct GzHotRange {
+    off_t offset;
+    size_t length;
+};
+
 class IndexFilterRecorder;
 IndexFilterRecorder *new_index_filter(IndexFileHeader *h, INDEX *index, photon::fs::IFile *save_as);
 void delete_index_filter(IndexFilterRecorder *&);
 
+// checks the level is valid for the algorithm
+int check_dict_compress(int dict_compress_algo, int dict_compress_level);
+
 int init_index_header(photon::fs::IFile* src, IndexFileHeader &h,  off_t span, int dict_compress_algo, int dict_compress_level);
 
+// adds an entry with the (linear) window `dict`, entries must be added in order
+int add_index_entry(IndexFilterRecorder *filter, int bits, off_t en_pos, off_t de_pos, unsigned char *dict);
+
 int create_index_entry(z_stream strm, IndexFilterRecorder *filter, off_t en_pos, off_t de_pos, unsigned char *window);
 
 int save_index_to_file(IndexFileHeader &h, INDEX& index, photon::fs::IFile *index_file, ssize_t gzip_file_size = -1);
@@ -17,8 +17,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <zlib.h>
+#include <zstd.h>
 #include <sys/fcntl.h>
+#include <algorithm>
 
+#include "gzfile.h"
 #include "gzfile_index.h"
 
 #include "photon/common/alog.h"
@@ -26,8 +29,6 @@
 #include "photon/fs/localfs.h"
 #include "photon/photon.h"
 
-#define DICT_COMPRESS_ALGO_NONE 0
-#define DICT_COMPRESS_ALGO_ZLIB 1
 
 #define EACH_DEFLATE_BLOCK_BIT  0X080
 #define LAST_DEFLATE_BLOCK_BIT   0X40
@@ -64,7 +65,7 @@ public:
             }
             last_.keep_entry(bits, en_pos, de_pos, left, window);
             while(expected_len_ < de_pos) {
-                expected_len_ += h_->span;
+                expected_len_ = next_checkpoint(expected_len_);
             }
         }
         if (de_pos == expected_len_) {
@@ -73,11 +74,50 @@ public:
             if (add_index_entry(bits, en_pos, de_pos, left, window) != 0 ) {
                 return -1;
             }
-            expected_len_ += h_->span;
+            expected_len_ = next_checkpoint(expected_len_);
         }
         return 0;
     }
+
+    // adds an entry of a window known to be in order, bypassing the span check
+    int add_entry(int bits, off_t en_pos, off_t de_pos, unsigned char *dict) {
+        return add_index_entry(bits, en_pos, de_pos, 0, dict);
+    }
+
+    // places the entries every `hot_span` in `ranges`, instead of every h_->span
+    void set_hot_ranges(const std::vector<GzHotRange> &ranges, off_t hot_span) {
+        auto sorted = ranges;
+        std::sort(sorted.begin(), sorted.end(),
+                  [](const GzHotRange &a, const GzHotRange &b) { return a.offset < b.offset; });
+        hot_ranges_.clear();
+        for (auto &r : sorted) {
+            if (!hot_ranges_.empty()) {
+                auto &last = hot_ranges_.back();
+                if (r.offset <= (off_t)(last.offset + last.length)) {
+                    last.length = std::max(last.length, (size_t)(r.offset + r.length - last.offset));
+                    continue;
+                }
+            }
+            hot_ranges_.push_back(r);
+        }
+        hot_span_ = hot_span;
+    }
 private:
+    off_t next_checkpoint(off_t pos) {
+        // the first hot range not ending before pos
+        auto it = std::upper_bound(hot_ranges_.begin(), hot_ranges_.end(), pos,
+                                   [](off_t pos, const GzHotRange &r) { return pos < r.offset; });
+        if (it != hot_ranges_.begin() && (off_t)((it - 1)->offset + (it - 1)->length) > pos) {
+            return pos + hot_span_;
+        }
+        off_t next = pos + h_->span;
+        // don't step over the start of the next hot range
+        if (it != hot_ranges_.end() && it->offset < next) {
+            next = it->offset;
+        }
+        return next;
+    }
+
     int add_index_entry(int bits, off_t en_pos, off_t de_pos, unsigned int left,
             unsigned char *window) {
         struct IndexEntry* p = new IndexEntry;
@@ -109,6 +149,8 @@ private:
     }
 private:
     int64_t expected_len_ = 0;
+    std::vector<GzHotRange> hot_ranges_;
+    off_t hot_span_ = 0;
     unsigned char *buf_ = nullptr;
     int32_t buf_len_ = DEFLATE_BLOCK_UNCOMPRESS_MAX_SIZE; //64KB the max size of deflate block uncompressed data
     IndexFileHeader* h_ = nullptr;
@@ -159,6 +201,15 @@ static int zlib_compress(int level, unsigned char *in, int in_len, unsigned char
     return 0;
 }
 
+static int zstd_compress(int level, unsigned char *in, int in_len, unsigned char *out, int& out_len) {
+    auto ret = ZSTD_compress(out, out_len, in, in_len, level);
+    if (ZSTD_isError(ret)) {
+        LOG_ERRNO_RETURN(0, -1, "Failed to ZSTD_compress, err:`", ZSTD_getErrorName(ret));
+    }
+    out_len = ret;
+    return 0;
+}
+
 static int dict_compress(const IndexFileHeader& h,
         unsigned char *dict, int dict_len, unsigned char *out, int& out_len) {
     if (h.dict_compress_algo == 0) {
@@ -170,12 +221,18 @@ static int dict_compress(const IndexFileHeader& h,
         return 0;
     }
 
-    if (h.dict_compress_algo == 1) {
+    if (h.dict_compress_algo == DICT_COMPRESS_ALGO_ZLIB) {
         if (zlib_compress(h.dict_compress_level, dict, WINSIZE, out , out_len) != 0) {
             LOG_ERRNO_RETURN(0, -1, "Failed to dict_compress");
         }
         return 0;
     }
+    if (h.dict_compress_algo == DICT_COMPRESS_ALGO_ZSTD) {
+        if (zstd_compress(h.dict_compress_level, dict, WINSIZE, out , out_len) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "Failed to dict_compress");
+        }
+        return 0;
+    }
     LOG_ERRNO_RETURN(0, -1, "Wrong compress algorithm. h.dict_compress_algo:`", h.dict_compress_algo);
     return -1;
 }
@@ -190,6 +247,10 @@ int create_index_entry(z_stream strm, IndexFilterRecorder *filter, off_t en_pos,
     return 0;
 }
 
+int add_index_entry(IndexFilterRecorder *filter, int bits, off_t en_pos, off_t de_pos, unsigned char *dict) {
+    return filter->add_entry(bits, en_pos, de_pos, dict);
+}
+
 IndexFilterRecorder* new_index_filter(IndexFileHeader *h, INDEX *index, photon::fs::IFile *save_as)
 {
     return new IndexFilterRecorder(h, index, save_as);
@@ -200,10 +261,14 @@ void delete_index_filter(IndexFilterRecorder *&idx_filter) {
     idx_filter = nullptr;
 }
 
-static int build_index(IndexFileHeader& h,photon::fs::IFile *gzfile, INDEX &index, photon::fs::IFile* index_file) {
+static int build_index(IndexFileHeader& h,photon::fs::IFile *gzfile, INDEX &index, photon::fs::IFile* index_file,
+        const std::vector<GzHotRange> &hot_ranges, off_t hot_span) {
     // IndexFilterRecorder filter(&h, &index, index_file);
     auto filter = new IndexFilterRecorder(&h, &index, index_file);
     DEFER(delete filter);
+    if (!hot_ranges.empty()) {
+        filter->set_hot_ranges(hot_ranges, hot_span);
+    }
     int32_t inbuf_size = WINSIZE;
     unsigned char *inbuf = new unsigned char[inbuf_size];
     DEFER(delete []inbuf);
@@ -278,6 +343,9 @@ static int get_compressed_index(const IndexFileHeader& h, const INDEX& index, un
         return 0;
     }
     LOG_INFO("index crc: `", crc32(0, buf, index_len));
+    if (h.dict_compress_algo == DICT_COMPRESS_ALGO_ZSTD) {
+        return zstd_compress(h.dict_compress_level, buf, index_len, out, out_len);
+    }
     return zlib_compress(h.dict_compress_level, buf, index_len, out, out_len);
 }
 
@@ -317,6 +385,21 @@ int save_index_to_file(IndexFileHeader &h, INDEX& index, photon::fs::IFile *inde
     return 0;
 }
 
+int check_dict_compress(int dict_compress_algo, int dict_compress_level) {
+    if (dict_compress_algo == DICT_COMPRESS_ALGO_ZLIB) {
+        if (dict_compress_level < -1 || dict_compress_level > 9) {
+            LOG_ERRNO_RETURN(0, -1, "Invalid dict_compress_level:`, it must be in [-1, 9]", dict_compress_level);
+        }
+    } else if (dict_compress_algo == DICT_COMPRESS_ALGO_ZSTD) {
+        if (dict_compress_level < 1 || dict_compress_level > ZSTD_maxCLevel()) {
+            LOG_ERRNO_RETURN(0, -1, "Invalid dict_compress_level:`, it must be in [1, `]", dict_compress_level, ZSTD_maxCLevel());
+        }
+    } else if (dict_compress_algo != DICT_COMPRESS_ALGO_NONE) {
+        LOG_ERRNO_RETURN(0, -1, "Invalid dict_compress_algo:`", dict_compress_algo);
+    }
+    return 0;
+}
+
 int init_index_header(photon::fs::IFile* src, IndexFileHeader &h,  off_t span, int dict_compress_algo, int dict_compress_level) {
 
     struct stat sbuf;
@@ -342,19 +425,25 @@ int init_index_header(photon::fs::IFile* src, IndexFileHeader &h,  off_t span, i
 //int create_gz_index(photon::fs::IFile* gzip_file, const char *index_file_path, off_t span, unsigned char dict_compress_algo) {
 //int create_gz_index(photon::fs::IFile* gzip_file, off_t span, const char *index_file_path) {
 int create_gz_index(photon::fs::IFile* gzip_file, const char *index_file_path, off_t span, int dict_compress_algo, int dict_compress_level) {
-    LOG_INFO("span:`,dict_compress_algo:`,dict_compress_level:`", span, dict_compress_algo, dict_compress_level);
-    if (dict_compress_algo != DICT_COMPRESS_ALGO_NONE && dict_compress_algo != DICT_COMPRESS_ALGO_ZLIB) {
-        LOG_ERRNO_RETURN(0, -1, "Invalid dict_compress_algo:`", dict_compress_algo);
-    }
+    return create_gz_index_adaptive(gzip_file, index_file_path, {}, 0, span, dict_compress_algo, dict_compress_level);
+}
 
-    if (dict_compress_algo == DICT_COMPRESS_ALGO_ZLIB) {
-        if (dict_compress_level < -1 || dict_compress_level > 9) {
-            LOG_ERRNO_RETURN(0, -1, "Invalid dict_compress_level:`, it must be in [-1, 9]", dict_compress_level);
-        }
+int create_gz_index_adaptive(photon::fs::IFile* gzip_file, const char *index_file_path,
+    const std::vector<GzHotRange> &hot_ranges, off_t hot_span,
+    off_t span, int dict_compress_algo, int dict_compress_level) {
+    LOG_INFO("span:`,dict_compress_algo:`,dict_compress_level:`", span, dict_compress_algo, dict_compress_level);
+    if (check_dict_compress(dict_compress_algo, dict_compress_level) != 0) {
+        return -1;
     }
     if (span < DEFLATE_BLOCK_UNCOMPRESS_MAX_SIZE) {
         LOG_ERRNO_RETURN(0, -1, "Span is too small, must be greater than 100, span:`", span);
     }
+    if (!hot_ranges.empty()) {
+        if (hot_span < DEFLATE_BLOCK_UNCOMPRESS_MAX_SIZE || hot_span > span) {
+            LOG_ERRNO_RETURN(EINVAL, -1, "Invalid hot span:`, it must be in [`, span]", hot_span, DEFLATE_BLOCK_UNCOMPRESS_MAX_SIZE);
+        }
+        LOG_INFO("hot ranges:`, hot span:`", hot_ranges.size(), hot_span);
+    }
 
     photon::fs::IFile *index_file = photon::fs::open_localfile_adaptor(index_file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
     if (index_file == nullptr) {
@@ -372,7 +461,7 @@ int create_gz_index(photon::fs::IFile* gzip_file, const char *index_file_path, o
             delete it;
         }
     });
-    int ret = build_index(h, gzip_file, index, index_file);
+    int ret = build_index(h, gzip_file, index, index_file, hot_ranges, hot_span);
     if (ret != 0) {
         LOG_ERRNO_RETURN(0, -1, "Faild to build_index");
     }
@@ -0,0 +1,481 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <string.h>
+#include <zlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "gzfile.h"
+#include "gzfile_index.h"
+
+#include "photon/common/alog.h"
+#include "photon/common/alog-stdstring.h"
+#include "photon/fs/localfs.h"
+
+// The chunks are inflated speculatively, before the 32KB window preceding
+// each of them is known. A chunk is inflated twice, with two made-up
+// dictionaries where byte i of the window is (a(i), b(i)), a != b:
+//   a(i) = i & 0xff, b(i) = a(i) + (i >> 8) + 1
+// A literal comes out the same in both, a byte copied from the unknown window
+// comes out as (a(i), b(i)) and tells the i it's copied from, however many
+// times it's copied again. The windows of a chunk are then resolved by the
+// final window of the chunk before it, in order, which is cheap.
+namespace {
+
+const size_t CHUNK_SIZE = 4UL << 20;     // of compressed data
+const size_t CHUNK_MARGIN = 1UL << 20;   // read past a batch, to confirm the next start
+const uint64_t NO_STOP = UINT64_MAX;
+
+struct AccessPoint {
+    int bits;
+    off_t en_pos;
+    off_t de_pos; // in the chunk
+};
+
+struct ChunkTask {
+    const unsigned char *data; // data[0] is at `data_offset` of the gzip file
+    size_t len;
+    off_t data_offset;
+    uint64_t start_bit;        // 0 for the gzip header
+    // the starts of the later chunks, ending with NO_STOP; some may be false
+    // ones, the chunk goes past them and stops at the next one
+    const std::vector<uint64_t> *stops;
+    size_t stop;               // where the chunk stopped in `stops`
+    off_t span;
+
+    int ret[2] = {-1, -1};
+    bool stream_end = false;
+    off_t total_out = 0;
+    std::vector<AccessPoint> points;
+    std::vector<std::vector<unsigned char>> windows[2];
+    std::vector<unsigned char> final_window[2];
+
+    bool head() const {
+        return start_bit == 0;
+    }
+};
+
+void make_dict(int lane, unsigned char *dict) {
+    for (uint32_t i = 0; i < WINSIZE; i++) {
+        uint8_t a = i & 0xff;
+        dict[i] = lane == 0 ? a : (uint8_t)(a + (i >> 8) + 1);
+    }
+}
+
+// the window of `left` bytes to be written in the cyclic buffer, oldest first
+void linear_window(const unsigned char *window, unsigned int left, unsigned char *out) {
+    if (left) {
+        memcpy(out, window + WINSIZE - left, left);
+    }
+    if (left < WINSIZE) {
+        memcpy(out + left, window, WINSIZE - left);
+    }
+}
+
+void resolve_window(const unsigned char *w0, const unsigned char *w1, const unsigned char *prev,
+                    unsigned char *out) {
+    for (uint32_t i = 0; i < WINSIZE; i++) {
+        if (w0[i] == w1[i]) {
+            out[i] = w0[i];
+        } else {
+            uint32_t hi = (uint8_t)(w1[i] - w0[i] - 1);
+            out[i] = prev[w0[i] | (hi << 8)];
+        }
+    }
+}
+
+// sets up `strm` to inflate raw deflate at `bit` of the gzip file
+int raw_inflate_at(z_stream &strm, const unsigned char *data, size_t len, off_t data_offset,
+                   uint64_t bit, const unsigned char *dict) {
+    size_t pos = bit / 8 - data_offset;
+    int skip = bit % 8;
+    if (pos >= len || inflateReset2(&strm, -15) != Z_OK) {
+        return -1;
+    }
+    if (skip) {
+        inflatePrime(&strm, 8 - skip, data[pos] >> skip);
+        pos++;
+    }
+    if (inflateSetDictionary(&strm, dict, WINSIZE) != Z_OK) {
+        return -1;
+    }
+    strm.next_in = (unsigned char *)data + pos;
+    strm.avail_in = len - pos;
+    return 0;
+}
+
+uint32_t get_bits(const unsigned char *data, uint64_t &bit, int n) {
+    uint32_t v = 0;
+    for (int i = 0; i < n; i++, bit++) {
+        v |= ((data[bit / 8] >> (bit % 8)) & 1) << i;
+    }
+    return v;
+}
+
+// rules out most of the bit positions that can't start a non-final stored or
+// dynamic block, before trying to inflate there
+bool maybe_block_start(const unsigned char *data, size_t len, uint64_t bit) {
+    if (bit + 3 + 64 > len * 8) {
+        return false;
+    }
+    auto bfinal = get_bits(data, bit, 1);
+    auto btype = get_bits(data, bit, 2);
+    if (bfinal) {
+        return false;
+    }
+    if (btype == 0) {
+        if (get_bits(data, bit, (8 - bit % 8) % 8) != 0) {
+            return false;
+        }
+        auto len16 = get_bits(data, bit, 16);
+        auto nlen16 = get_bits(data, bit, 16);
+        return (len16 ^ nlen16) == 0xffff;
+    }
+    if (btype != 2) {
+        return false;
+    }
+    auto hlit = get_bits(data, bit, 5);
+    auto hdist = get_bits(data, bit, 5);
+    auto hclen = get_bits(data, bit, 4) + 4;
+    if (hlit > 29 || hdist > 29 || bit + hclen * 3 > len * 8) {
+        return false;
+    }
+    // the code length code must be complete
+    uint32_t kraft = 0;
+    for (uint32_t i = 0; i < hclen; i++) {
+        auto l = get_bits(data, bit, 3);
+        if (l) {
+            kraft += 128 >> l;
+        }
+    }
+    return kraft == 128;
+}
+
+// the type of the block starting at `bit`, -1 if it's out of `data`
+int block_type(const unsigned char *data, size_t len, uint64_t bit, bool &final) {
+    if (bit + 3 > len * 8) {
+        return -1;
+    }
+    final = get_bits(data, bit, 1);
+    return get_bits(data, bit, 2);
+}
+
+// a stored block header is followed by padding to the byte, so the starts
+// within the padding of a real one read a header too, and inflate the same
+bool same_stored_block(const unsigned char *data, size_t len, off_t data_offset, uint64_t a,
+                       uint64_t b) {
+    auto stored_at = [&](uint64_t bit) {
+        bool final = false;
+        return block_type(data, len, bit - data_offset * 8, final) == 0 && !final;
+    };
+    if (a == b || a == NO_STOP || b == NO_STOP || (a + 3 + 7) / 8 != (b + 3 + 7) / 8) {
+        return false;
+    }
+    return stored_at(a) && stored_at(b);
+}
+
+// finds the first position in [from, to) where inflating goes through a few
+// stored or dynamic blocks, or to the end of the stream, without error. Random
+// bits easily inflate as fixed blocks, which real streams seldom have but at
+// the end, so they don't count.
+uint64_t find_block_start(const unsigned char *data, size_t len, off_t data_offset,
+                          uint64_t from, uint64_t to) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, -15) != Z_OK) {
+        return NO_STOP;
+    }
+    DEFER(inflateEnd(&strm));
+    unsigned char dict[WINSIZE], out[WINSIZE];
+    make_dict(0, dict);
+    for (auto bit = from; bit < to; bit++) {
+        if (!maybe_block_start(data, len, bit - data_offset * 8)) {
+            continue;
+        }
+        if (raw_inflate_at(strm, data, len, data_offset, bit, dict) != 0) {
+            continue;
+        }
+        int boundaries = 0, ret;
+        bool ok = true;
+        do {
+            strm.next_out = out;
+            strm.avail_out = WINSIZE;
+            ret = inflate(&strm, Z_BLOCK);
+            if (ret == Z_OK && (strm.data_type & 128)) {
+                boundaries++;
+                uint64_t next = (strm.next_in - data) * 8 - (strm.data_type & 7);
+                bool final = false;
+                auto type = block_type(data, len, next, final);
+                if (type == -1) {
+                    break;
+                }
+                ok = (type == 0 || type == 2 || final);
+            }
+        } while (ok && ret == Z_OK && boundaries < 4);
+        // running out of data after a boundary is as good as it gets
+        bool failed = ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR;
+        if (ok && !failed && (ret == Z_STREAM_END || boundaries > 0)) {
+            return bit;
+        }
+    }
+    return NO_STOP;
+}
+
+// inflates the chunk with the dictionary of `lane`, or from the gzip header,
+// keeping the windows at the access points, about every `span` bytes
+int inflate_chunk(ChunkTask &t, int lane) {
+    z_stream strm;
+    memset(&strm, 0, sizeof(strm));
+    if (inflateInit2(&strm, t.head() ? 47 : -15) != Z_OK) {
+        LOG_ERROR_RETURN(0, -1, "Failed to inflateInit2");
+    }
+    DEFER(inflateEnd(&strm));
+    std::vector<unsigned char> window(WINSIZE, 0);
+    if (t.head()) {
+        strm.next_in = (unsigned char *)t.data;
+        strm.avail_in = t.len;
+    } else {
+        make_dict(lane, window.data());
+        if (raw_inflate_at(strm, t.data, t.len, t.data_offset, t.start_bit, window.data()) != 0) {
+            LOG_ERROR_RETURN(0, -1, "Failed to start inflating at bit `", t.start_bit);
+        }
+        // raw inflate doesn't stop before the first block, the start is a point too
+        int skip = t.start_bit % 8;
+        t.windows[lane].push_back(window);
+        if (lane == 0) {
+            t.points.push_back({skip ? 8 - skip : 0, (off_t)(t.start_bit / 8) + (skip ? 1 : 0), 0});
+        }
+    }
+
+    off_t out = 0, next_point = t.head() ? 0 : t.span;
+    strm.avail_out = 0;
+    for (;;) {
+        if (strm.avail_out == 0) {
+            strm.avail_out = WINSIZE;
+            strm.next_out = window.data();
+        }
+        auto avail = strm.avail_out;
+        auto ret = inflate(&strm, Z_BLOCK);
+        out += avail - strm.avail_out;
+        if (ret == Z_STREAM_END) {
+            t.stream_end = true;
+            break;
+        }
+        if (ret != Z_OK && !(ret == Z_BUF_ERROR && strm.avail_in != 0)) {
+            LOG_ERROR_RETURN(0, -1, "Fail to inflate chunk at bit `, ret:`", t.start_bit, ret);
+        }
+        if (!(strm.data_type & 128) || (strm.data_type & 64)) {
+            continue;
+        }
+        int bits = strm.data_type & 7;
+        off_t en_pos = t.data_offset + (strm.next_in - t.data);
+        uint64_t bit = en_pos * 8 - bits;
+        auto &stops = *t.stops;
+        auto at_stop = [&]() {
+            return bit == stops[t.stop] ||
+                   same_stored_block(t.data, t.len, t.data_offset, bit, stops[t.stop]);
+        };
+        while (bit > stops[t.stop] && !at_stop()) {
+            t.stop++;
+        }
+        if (at_stop()) {
+            break;
+        }
+        if (out >= next_point) {
+            std::vector<unsigned char> w(WINSIZE);
+            linear_window(window.data(), strm.avail_out, w.data());
+            t.windows[lane].push_back(std::move(w));
+            if (lane == 0) {
+                t.points.push_back({bits, en_pos, out});
+            }
+            next_point = (out / t.span + 1) * t.span;
+        }
+    }
+    t.total_out = out;
+    t.final_window[lane].resize(WINSIZE);
+    linear_window(window.data(), strm.avail_out, t.final_window[lane].data());
+    return 0;
+}
+
+void parallel_for(size_t n, int nthreads, const std::function<void(size_t)> &fn) {
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthreads && (size_t)i < n; i++) {
+        threads.emplace_back([&]() {
+            for (size_t j; (j = next++) < n;) {
+                fn(j);
+            }
+        });
+    }
+    for (auto &th : threads) {
+        th.join();
+    }
+}
+
+int build_index_parallel(IndexFileHeader &h, photon::fs::IFile *gzfile, IndexFilterRecorder *filter,
+                         int nthreads) {
+    struct stat st;
+    if (gzfile->fstat(&st) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "Failed to gzfile->fstat()");
+    }
+    off_t file_size = st.st_size;
+    std::vector<unsigned char> buf;
+    unsigned char prev_window[WINSIZE] = {0}, window[WINSIZE];
+    uint64_t start_bit = 0;
+    off_t de_base = 0;
+
+    for (;;) {
+        // a batch of chunks from start_bit, one for each thread
+        off_t begin = start_bit / 8;
+        size_t len = std::min((off_t)(nthreads * CHUNK_SIZE + CHUNK_MARGIN), file_size - begin);
+        buf.resize(len);
+        if (gzfile->pread(buf.data(), len, begin) != (ssize_t)len) {
+            LOG_ERRNO_RETURN(0, -1, "Failed to gzfile->pread(`, `)", len, begin);
+        }
+        bool last_batch = begin + len == file_size;
+        size_t nchunks = std::max((size_t)1, std::min((size_t)nthreads, (len + CHUNK_SIZE - 1) / CHUNK_SIZE));
+        // the starts of the chunks after the first one, and of the next batch
+        std::vector<uint64_t> starts(nchunks + 1, NO_STOP);
+        starts[0] = start_bit;
+        parallel_for(nchunks, nthreads, [&](size_t i) {
+            uint64_t from = (begin + (i + 1) * CHUNK_SIZE) * 8;
+            uint64_t to = std::min(from + CHUNK_SIZE * 8, (uint64_t)(begin + len) * 8);
+            if (from < to) {
+                starts[i + 1] = find_block_start(buf.data(), len, begin, from, to);
+            }
+        });
+        if (!last_batch && starts[nchunks] == NO_STOP) {
+            LOG_ERROR_RETURN(0, -1, "No block start found for the next batch at `", begin + nchunks * CHUNK_SIZE);
+        }
+
+        // a chunk without a start is inflated by the one before
+        std::vector<uint64_t> stops;
+        for (auto s : starts) {
+            if (s != NO_STOP) {
+                stops.push_back(s);
+            }
+        }
+        size_t next_batch = last_batch ? stops.size() : stops.size() - 1;
+        stops.push_back(NO_STOP);
+        std::vector<ChunkTask> tasks;
+        for (size_t i = 0; i < next_batch; i++) {
+            tasks.push_back({buf.data(), len, begin, stops[i], &stops, i + 1, (off_t)h.span});
+        }
+        size_t lanes = tasks[0].head() ? 2 * tasks.size() - 1 : 2 * tasks.size();
+        parallel_for(lanes, nthreads, [&](size_t i) {
+            // the head chunk knows its window, a single lane of it does
+            if (tasks[0].head() && i > 0)
+                i++;
+            auto &t = tasks[i / 2];
+            t.ret[i % 2] = inflate_chunk(t, i % 2);
+        });
+
+        // from the first chunk, through the ones where the chunk before stopped
+        for (size_t i = 0; i < next_batch; i = tasks[i].stop) {
+            auto &t = tasks[i];
+            if (t.ret[0] != 0 || (!t.head() && t.ret[1] != 0)) {
+                LOG_ERROR_RETURN(0, -1, "Failed to inflate chunk at bit `", t.start_bit);
+            }
+            if (!t.head() && (t.windows[0].size() != t.windows[1].size() ||
+                              t.points.size() != t.windows[0].size())) {
+                LOG_ERROR_RETURN(0, -1, "Mismatched lanes of chunk at bit `", t.start_bit);
+            }
+            for (size_t k = 0; k < t.points.size(); k++) {
+                auto w = t.windows[0][k].data();
+                if (!t.head()) {
+                    resolve_window(w, t.windows[1][k].data(), prev_window, window);
+                    w = window;
+                }
+                auto &p = t.points[k];
+                if (add_index_entry(filter, p.bits, p.en_pos, de_base + p.de_pos, w) != 0) {
+                    LOG_ERROR_RETURN(0, -1, "Failed to add_index_entry");
+                }
+            }
+            if (t.head()) {
+                memcpy(prev_window, t.final_window[0].data(), WINSIZE);
+            } else {
+                resolve_window(t.final_window[0].data(), t.final_window[1].data(), prev_window, window);
+                memcpy(prev_window, window, WINSIZE);
+            }
+            de_base += t.total_out;
+            if (t.stream_end) {
+                h.uncompress_file_size = de_base;
+                return 0;
+            }
+        }
+        if (last_batch) {
+            LOG_ERROR_RETURN(0, -1, "Unexpected end of gzip file");
+        }
+        start_bit = stops[next_batch];
+    }
+}
+
+} // namespace
+
+int create_gz_index_parallel(photon::fs::IFile* gzip_file, const char *index_file_path, int nthreads,
+    off_t span, int dict_compress_algo, int dict_compress_level) {
+    if (nthreads <= 1) {
+        return create_gz_index(gzip_file, index_file_path, span, dict_compress_algo, dict_compress_level);
+    }
+    LOG_INFO("span:`,dict_compress_algo:`,dict_compress_level:`,nthreads:`", span, dict_compress_algo, dict_compress_level, nthreads);
+    if (check_dict_compress(dict_compress_algo, dict_compress_level) != 0) {
+        return -1;
+    }
+    if (span < DEFLATE_BLOCK_UNCOMPRESS_MAX_SIZE) {
+        LOG_ERRNO_RETURN(0, -1, "Span is too small, must be greater than 100, span:`", span);
+    }
+
+    int ret = -1;
+    {
+        photon::fs::IFile *index_file = photon::fs::open_localfile_adaptor(index_file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (index_file == nullptr) {
+            LOG_ERROR_RETURN(0, -1, "Failed to open(`)", index_file_path);
+        }
+        DEFER(delete index_file);
+
+        IndexFileHeader h;
+        if (init_index_header(gzip_file, h, span, dict_compress_algo, dict_compress_level) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "init index header failed.");
+        }
+        INDEX index;
+        DEFER({
+            for (auto it : index) {
+                delete it;
+            }
+        });
+        auto filter = new_index_filter(&h, &index, index_file);
+        DEFER(delete_index_filter(filter));
+        ret = build_index_parallel(h, gzip_file, filter, nthreads);
+        if (ret == 0) {
+            ret = save_index_to_file(h, index, index_file);
+            if (ret != 0) {
+                LOG_ERRNO_RETURN(0, -1, "Failed to save_index_to_file(...)");
+            }
+        }
+    }
+    if (ret != 0) {
+        LOG_WARN("parallel gzip index failed, build it sequentially");
+        gzip_file->lseek(0, SEEK_SET);
+        return create_gz_index(gzip_file, index_file_path, span, dict_compress_algo, dict_compress_level);
+    }
+    return 0;
+}
@@ -0,0 +1,133 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "inflater.h"
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+#include <atomic>
+#include "photon/common/alog.h"
+#ifdef ENABLE_ISAL
+#include <igzip_lib.h>
+#endif
+
+class ZlibInflater : public RawInflater {
+public:
+    ~ZlibInflater() {
+        if (m_inited)
+            inflateEnd(&m_strm);
+    }
+
+    int init(int bits, int value, const unsigned char *dict, size_t dict_len) override {
+        memset(&m_strm, 0, sizeof(m_strm));
+        if (inflateInit2(&m_strm, -15) != Z_OK) {
+            LOG_ERROR_RETURN(0, -1, "Fail to inflateInit2(&strm, -15)");
+        }
+        m_inited = true;
+        if (bits)
+            inflatePrime(&m_strm, bits, value);
+        if (inflateSetDictionary(&m_strm, dict, dict_len) != Z_OK) {
+            LOG_ERROR_RETURN(0, -1, "Fail to inflateSetDictionary");
+        }
+        return 0;
+    }
+
+    int inflate(const unsigned char *&in, size_t &avail_in, unsigned char *&out,
+                size_t &avail_out) override {
+        m_strm.next_in = (Bytef *)in;
+        m_strm.avail_in = avail_in;
+        m_strm.next_out = out;
+        m_strm.avail_out = avail_out;
+        auto ret = ::inflate(&m_strm, Z_NO_FLUSH);
+        in = m_strm.next_in;
+        avail_in = m_strm.avail_in;
+        out = m_strm.next_out;
+        avail_out = m_strm.avail_out;
+        if (ret == Z_STREAM_END)
+            return 1;
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            LOG_ERROR_RETURN(0, -1, "Fail to inflate. ret:`", ret);
+        }
+        return 0;
+    }
+
+private:
+    z_stream m_strm;
+    bool m_inited = false;
+};
+
+#ifdef ENABLE_ISAL
+class IsalInflater : public RawInflater {
+public:
+    int init(int bits, int value, const unsigned char *dict, size_t dict_len) override {
+        isal_inflate_init(&m_state);
+        m_state.crc_flag = ISAL_DEFLATE;
+        // the bit buffer is read from the lowest bit, as inflatePrime() inserts them
+        m_state.read_in = value;
+        m_state.read_in_length = bits;
+        if (isal_inflate_set_dict(&m_state, (uint8_t *)dict, dict_len) != ISAL_DECOMP_OK) {
+            LOG_ERROR_RETURN(0, -1, "Fail to isal_inflate_set_dict");
+        }
+        return 0;
+    }
+
+    int inflate(const unsigned char *&in, size_t &avail_in, unsigned char *&out,
+                size_t &avail_out) override {
+        m_state.next_in = (uint8_t *)in;
+        m_state.avail_in = avail_in;
+        m_state.next_out = out;
+        m_state.avail_out = avail_out;
+        auto ret = isal_inflate(&m_state);
+        in = m_state.next_in;
+        avail_in = m_state.avail_in;
+        out = m_state.next_out;
+        avail_out = m_state.avail_out;
+        if (ret < 0) {
+            LOG_ERROR_RETURN(0, -1, "Fail to isal_inflate. ret:`", ret);
+        }
+        return m_state.block_state == ISAL_BLOCK_FINISH ? 1 : 0;
+    }
+
+private:
+    inflate_state m_state;
+};
+
+static std::atomic<InflateBackend> g_backend{InflateBackend::Isal};
+#else
+static std::atomic<InflateBackend> g_backend{InflateBackend::Zlib};
+#endif
+
+int set_inflate_backend(InflateBackend backend) {
+#ifndef ENABLE_ISAL
+    if (backend == InflateBackend::Isal) {
+        LOG_ERROR_RETURN(ENOTSUP, -1, "isal inflate is not built in, rebuild with ENABLE_ISAL");
+    }
+#endif
+    g_backend = backend;
+    return 0;
+}
+
+InflateBackend get_inflate_backend() {
+    return g_backend;
+}
+
+RawInflater *new_raw_inflater() {
+#ifdef ENABLE_ISAL
+    if (g_backend == InflateBackend::Isal)
+        return new IsalInflater();
+#endif
+    return new ZlibInflater();
+}
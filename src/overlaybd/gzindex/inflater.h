@@ -0,0 +1,46 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+#include <stddef.h>
+
+// A raw deflate decoder resuming at an access point of the gzip index, which
+// is where the random reads of a GzFile start from.
+class RawInflater {
+public:
+    virtual ~RawInflater() {}
+
+    // starts decoding with `bits` bits of `value` pending before the input,
+    // and `dict` as the window of the data preceding the access point
+    virtual int init(int bits, int value, const unsigned char *dict, size_t dict_len) = 0;
+
+    // decodes from `in` into `out`, advancing both; returns 1 at the end of
+    // the deflate stream, 0 for more to come, or -1 on error
+    virtual int inflate(const unsigned char *&in, size_t &avail_in, unsigned char *&out,
+                        size_t &avail_out) = 0;
+};
+
+enum class InflateBackend {
+    Zlib,
+    Isal,
+};
+
+// the backend of the new inflaters: zlib, or ISA-L igzip when built with
+// ENABLE_ISAL, which is the default then
+int set_inflate_backend(InflateBackend backend);
+InflateBackend get_inflate_backend();
+
+RawInflater *new_raw_inflater();
@@ -111,6 +111,34 @@ protected:
         }
     }
 
+    // builds an index of gzdata with the hot ranges as `fn`, returns # of entries
+    static int64_t build_adaptive_index(const char *fn, const std::vector<GzHotRange> &hot_ranges) {
+        std::string path = std::string("/tmp/") + fn;
+        gzdata->lseek(0, SEEK_SET);
+        if (create_gz_index_adaptive(gzdata, path.c_str(), hot_ranges, 128 << 10) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "failed to create gz index: `", fn);
+        }
+        IndexFileHeader h;
+        auto index = lfs->open(fn, O_RDONLY);
+        if (index == nullptr) {
+            LOG_ERRNO_RETURN(0, -1, "failed to open gz index: `", fn);
+        }
+        DEFER(delete index);
+        if (index->pread(&h, sizeof(h), 0) != sizeof(h)) {
+            LOG_ERRNO_RETURN(0, -1, "failed to read gz index header: `", fn);
+        }
+        return h.index_num;
+    }
+
+    static photon::fs::IFile *open_gzfile(const char *fn, photon::fs::IFile *&index) {
+        index = lfs->open(fn, O_RDONLY);
+        return index ? new_gzfile(gzdata, index) : nullptr;
+    }
+
+    static void remove_file(const char *fn) {
+        lfs->unlink(fn);
+    }
+
 private:
     static photon::fs::IFileSystem *lfs;
     static photon::fs::IFile *gzdata;
@@ -366,6 +394,126 @@ TEST_F(GzIndexTest, pread_rand) {
     group_test_pread(t);
 }
 
+TEST_F(GzIndexTest, span_cache) {
+    gzfile_set_span_cache(256UL << 20);
+    DEFER(gzfile_set_span_cache(0));
+    std::vector<PreadTestCase> t{
+        {0, 10, 10},
+        {1000000, 1000000, 1000000},
+        {1000010, 10, 10},
+        {(off_t)vsize - 400, 1000, 400},
+        {(off_t)vsize, 1, 0},
+    };
+    for (size_t i = 0; i < 1000; i++) {
+        size_t x = rand() % vsize;
+        size_t y = std::min((size_t)vsize, x + rand() % (4UL << 20));
+        t.push_back({(off_t)x, y - x, (ssize_t)(y - x)});
+    }
+    auto before = gzfile_span_cache_stats();
+    group_test_pread(t);
+    auto st = gzfile_span_cache_stats();
+    EXPECT_GT(st.hits, before.hits);
+    EXPECT_GT(st.misses, before.misses);
+    EXPECT_GT(st.bytes, 0UL);
+    EXPECT_LE(st.bytes, 256UL << 20);
+}
+
+TEST_F(GzIndexTest, inflate_backend) {
+    EXPECT_EQ(-1, gzfile_set_inflate_backend("unknown"));
+    std::vector<std::string> backends{"zlib"};
+    if (gzfile_set_inflate_backend("isal") == 0)
+        backends.push_back("isal");
+    std::vector<PreadTestCase> t;
+    for (size_t i = 0; i < 200; i++) {
+        size_t x = rand() % vsize;
+        size_t n = std::min((size_t)vsize - x, (size_t)(rand() % (1UL << 20)));
+        t.push_back({(off_t)x, n, (ssize_t)n});
+    }
+    for (auto &b : backends) {
+        ASSERT_EQ(0, gzfile_set_inflate_backend(b.c_str()));
+        auto start = photon::now;
+        group_test_pread(t);
+        auto elapsed = photon::now - start;
+        size_t bytes = 0;
+        for (auto &c : t)
+            bytes += c.count;
+        LOG_INFO("inflate backend `: ` bytes in ` us, ` MB/s", b, bytes, elapsed,
+                 elapsed ? bytes / elapsed : 0);
+    }
+}
+
+TEST_F(GzIndexTest, adaptive_span) {
+    auto plain = build_adaptive_index("findex_plain", {});
+    std::vector<GzHotRange> hot{{2 << 20, 2 << 20}, {7 << 20, 512 << 10}, {(3 << 20) + 4096, 1 << 20}};
+    auto adaptive = build_adaptive_index("findex_adaptive", hot);
+    DEFER(remove_file("findex_plain"));
+    DEFER(remove_file("findex_adaptive"));
+    ASSERT_GT(plain, 0);
+    // ~2.5MB of hot ranges at 128KB a span make up to ~20 more entries
+    EXPECT_GT(adaptive, plain + 8);
+    EXPECT_LT(adaptive, plain + 24);
+
+    photon::fs::IFile *index = nullptr;
+    auto file = open_gzfile("findex_adaptive", index);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete index);
+    DEFER(delete file);
+    std::vector<char> buf1(1 << 20), buf2(1 << 20);
+    for (int i = 0; i < 200; i++) {
+        size_t offset = rand() % vsize;
+        size_t count = std::min((size_t)vsize - offset, (size_t)(rand() % (1 << 20)));
+        ASSERT_EQ((ssize_t)count, defile->pread(buf1.data(), count, offset));
+        ASSERT_EQ((ssize_t)count, file->pread(buf2.data(), count, offset));
+        ASSERT_EQ(0, memcmp(buf1.data(), buf2.data(), count));
+    }
+}
+
+TEST_F(GzIndexTest, parallel_index) {
+    gzdata->lseek(0, SEEK_SET);
+    ASSERT_EQ(0, create_gz_index_parallel(gzdata, "/tmp/findex_parallel", 4, 1 << 20));
+    DEFER(remove_file("findex_parallel"));
+
+    photon::fs::IFile *index = nullptr;
+    auto file = open_gzfile("findex_parallel", index);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete index);
+    DEFER(delete file);
+    struct stat st;
+    ASSERT_EQ(0, file->fstat(&st));
+    EXPECT_EQ((off_t)vsize, st.st_size);
+    std::vector<char> buf1(1 << 20), buf2(1 << 20);
+    for (int i = 0; i < 200; i++) {
+        size_t offset = rand() % vsize;
+        size_t count = std::min((size_t)vsize - offset, (size_t)(rand() % (1 << 20)));
+        ASSERT_EQ((ssize_t)count, defile->pread(buf1.data(), count, offset));
+        ASSERT_EQ((ssize_t)count, file->pread(buf2.data(), count, offset));
+        ASSERT_EQ(0, memcmp(buf1.data(), buf2.data(), count));
+    }
+}
+
+TEST_F(GzIndexTest, zstd_window_mmap) {
+    gzdata->lseek(0, SEEK_SET);
+    ASSERT_EQ(0, create_gz_index(gzdata, "/tmp/findex_zstd", 1 << 20, DICT_COMPRESS_ALGO_ZSTD, 3));
+    DEFER(remove_file("findex_zstd"));
+    gzfile_set_window_mmap(true);
+    DEFER(gzfile_set_window_mmap(false));
+
+    photon::fs::IFile *index = nullptr;
+    auto file = open_gzfile("findex_zstd", index);
+    ASSERT_NE(nullptr, file);
+    DEFER(delete index);
+    DEFER(delete file);
+    std::vector<char> buf1(1 << 20), buf2(1 << 20);
+    // ~10 entries, most of the reads seek from a loaded window
+    for (int i = 0; i < 400; i++) {
+        size_t offset = rand() % vsize;
+        size_t count = std::min((size_t)vsize - offset, (size_t)(rand() % (1 << 20)));
+        ASSERT_EQ((ssize_t)count, defile->pread(buf1.data(), count, offset));
+        ASSERT_EQ((ssize_t)count, file->pread(buf2.data(), count, offset));
+        ASSERT_EQ(0, memcmp(buf1.data(), buf2.data(), count));
+    }
+}
+
 TEST_F(GzIndexTest, fstat) {
     size_t data_size = vsize;
     struct stat st;
@@ -25,10 +25,15 @@ limitations under the License.
 #include <sys/uio.h>
 #include <sys/time.h>
 #include <vector>
+#include <map>
+#include <mutex>
+#include <string>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
 #include "index.h"
+#include "../fan_out.h"
+#include "../zfile/crc32/crc32c.h"
 #include "photon/common/alog.h"
 #include "photon/common/uuid.h"
 #include "photon/fs/filesystem.h"
@@ -84,6 +89,8 @@ struct HeaderTrailer {
     static const uint32_t FLAG_SHIFT_TYPE = 1;   // 1:data file,     0:index file
     static const uint32_t FLAG_SHIFT_SEALED = 2; // 1:YES,           0:NO
     static const uint32_t FLAG_SPARSE_RW = 4;    // 1:sparse file    0:normal file
+    static const uint32_t FLAG_SHIFT_FENCED_INDEX = 5; // 1:page-aligned, checksummed index
+    static const uint32_t FLAG_SHIFT_WIDE_INDEX = 7;   // 1:index of WideSegmentMappings
 
     uint32_t get_flag_bit(uint32_t shift) const {
         return flags & (1 << shift);
@@ -112,6 +119,12 @@ struct HeaderTrailer {
     bool is_sparse_rw() const {
         return get_flag_bit(FLAG_SPARSE_RW);
     }
+    bool has_fenced_index() const {
+        return get_flag_bit(FLAG_SHIFT_FENCED_INDEX);
+    }
+    bool has_wide_index() const {
+        return get_flag_bit(FLAG_SHIFT_WIDE_INDEX);
+    }
 
     void set_header() {
         set_flag_bit(FLAG_SHIFT_HEADER);
@@ -168,12 +181,51 @@ struct HeaderTrailer {
 
     static const uint8_t LSMT_V1 = 1;     // v1 (UUID check)
     static const uint8_t LSMT_SUB_V1 = 1; // .1 deprecated level range.
+    static const uint8_t LSMT_SUB_V2 = 2; // .2 wide index entries, see FLAG_SHIFT_WIDE_INDEX
 
     uint8_t version = LSMT_V1;
     uint8_t sub_version = LSMT_SUB_V1;
 
     char user_tag[TAG_SIZE]{}; // 256B commit message.
 
+    // offset 390
+    // When FLAG_SHIFT_FENCED_INDEX is set in trailer, the index starts at a page-aligned
+    // offset, and consists of `index_count` sorted valid mappings with tag 0, followed by
+    // invalid paddings. They are read as is, without filtering or copying; once their
+    // crc32c matches `index_crc`, the order and range checks of every mapping are
+    // skipped too. `fences[i]` is the offset of mapping #(i * fence_stride), for a
+    // quick check of the structure before the checksum.
+    static const uint32_t MAX_FENCES = 128;
+    uint64_t index_count = 0;
+    uint32_t fence_stride = 0;
+    uint32_t nfences = 0;
+    uint64_t fences[MAX_FENCES]{};
+    // offset 1430
+    uint32_t index_crc = 0;
+
+    void set_fences(const SegmentMapping *index, size_t n) {
+        set_flag_bit(FLAG_SHIFT_FENCED_INDEX);
+        index_count = n;
+        fence_stride = (n + MAX_FENCES - 1) / MAX_FENCES;
+        if (fence_stride == 0)
+            fence_stride = 1;
+        nfences = (n + fence_stride - 1) / fence_stride;
+        for (uint32_t i = 0; i < nfences; ++i)
+            fences[i] = index[(size_t)i * fence_stride].offset;
+        index_crc = crc32::crc32c(index, n * sizeof(SegmentMapping));
+    }
+    bool check_fences(const SegmentMapping *index, size_t n) const {
+        if (n != index_count || nfences > MAX_FENCES ||
+            (uint64_t)nfences * fence_stride < n)
+            return false;
+        for (uint32_t i = 0; i < nfences; ++i) {
+            auto j = (size_t)i * fence_stride;
+            if (j >= n || index[j].offset != fences[i])
+                return false;
+        }
+        return crc32::crc32c(index, n * sizeof(SegmentMapping)) == index_crc;
+    }
+
 } __attribute__((packed));
 
 class LSMTReadOnlyFile;
@@ -186,8 +238,13 @@ static const uint32_t ALIGNMENT4K = 4096;
 
 static const int ABORT_FLAG_DETECTED = -2;
 
+// `fenced_index` (with `index_count` valid mappings) is given for a trailer whose index
+// region is in the fenced layout, see FLAG_SHIFT_FENCED_INDEX; `wide_index` for a
+// trailer whose index consists of `index_size` WideSegmentMappings
 static int write_header_trailer(IFile *file, bool is_header, bool is_sealed, bool is_data_file,
-                                uint64_t index_offset, uint64_t index_size, const LayerInfo &args) {
+                                uint64_t index_offset, uint64_t index_size, const LayerInfo &args,
+                                const SegmentMapping *fenced_index = nullptr,
+                                size_t index_count = 0, bool wide_index = false) {
     ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
     memset(buf, 0, HeaderTrailer::SPACE);
     auto pht = new (buf) HeaderTrailer;
@@ -216,6 +273,12 @@ static int write_header_trailer(IFile *file, bool is_header, bool is_sealed, boo
     pht->parent_uuid = args.parent_uuid;
     if (pht->set_tag(args.user_tag, args.len) != 0)
         return -1;
+    if (fenced_index && !is_header)
+        pht->set_fences(fenced_index, index_count);
+    if (wide_index && !is_header) {
+        pht->set_flag_bit(HeaderTrailer::FLAG_SHIFT_WIDE_INDEX);
+        pht->sub_version = HeaderTrailer::LSMT_SUB_V2;
+    }
     if (is_header) {
         LOG_INFO("write header {virtual_size: `, uuid: `, parent_uuid: `}", args.virtual_size,
                  pht->uuid.c_str(), pht->parent_uuid.c_str());
@@ -243,6 +306,8 @@ struct CompactOptions {
     uint64_t io_usleep_time = 0;
     char *TRIM_BLOCK = nullptr;
     size_t trim_blk_size = 0;
+    // the data may be copied by copy_range(), as is, without zero detection
+    bool copy_range = false;
 
     CompactOptions(const vector<IFile *> *files, SegmentMapping *mapping, size_t index_size,
                    size_t vsize, const CommitArgs *args)
@@ -252,90 +317,265 @@ struct CompactOptions {
     };
 };
 
-static int push_segment(char *buf, char *data, int &data_length, int &prev_end, int zero_detect,
-                        SegmentMapping &s, vector<SegmentMapping> &index) {
-    auto start_moffset = s.moffset;
-    if (zero_detect == 1)
-        s.discard();
-    else {
-        memcpy(data + data_length, buf + prev_end * ALIGNMENT, s.length * ALIGNMENT);
-        data_length += s.length * ALIGNMENT;
-    }
-    prev_end += s.length;
-    LOG_DEBUG("push ", s, ' ', VALUE(data_length));
-    index.push_back(s);
-    start_moffset = s.mend();
-    s.zeroed = 0;
-    s.offset = s.end();
-    s.length = 0;
-    s.moffset = start_moffset;
-    return 0;
-}
-
-static int is_zero_block(char *buf, size_t n) {
-    return 1;
-    // TODO: fixme: result data error
-    if (n & (sizeof(uint64_t) - 1)) {
-        LOG_ERROR("buf size invalid.");
-        return -1;
-    }
-    for (uint64_t j = 0; j < n; j += sizeof(uint64_t)) {
-        if ((uint64_t)(*(buf + j)) == (uint64_t)0)
-            continue;
-        return 1;
+static bool is_zero_block(const char *buf, size_t n) {
+    // n is a multiple of ALIGNMENT; OR-ing words 64B at a time lets the compiler
+    // vectorize the loop, while still returning early on non-zero data
+    auto p = (const uint64_t *)buf;
+    for (size_t i = 0; i < n / sizeof(uint64_t); i += 8) {
+        uint64_t x = 0;
+        for (size_t j = 0; j < 8; ++j)
+            x |= p[i + j];
+        if (x)
+            return false;
     }
-    return 0;
+    return true;
 }
 
-static ssize_t pcopy(const CompactOptions &opt, const SegmentMapping &m, uint64_t moffset,
-                     vector<SegmentMapping> &index) {
-    auto offset = m.moffset * ALIGNMENT;
-    auto count = m.length * ALIGNMENT;
-    auto bytes = 0;
-    const size_t BUFFER_SIZE = 32 * 1024;
-    ALIGNED_MEM4K(buf, BUFFER_SIZE);
-    ALIGNED_MEM4K(data, BUFFER_SIZE);
-    LOG_DEBUG("check segment: [ offset: `, len: `, moffset: `]", m.offset, m.length, m.moffset);
-    SegmentMapping s{m.offset, 0, moffset, m.tag};
-    while (count > 0) {
-        ssize_t step = min((size_t)count, BUFFER_SIZE /* BUFFER_SIZE 32K */);
-        LOG_DEBUG("read from src_file, offset: `, step: `", offset, step);
-        ssize_t ret = opt.src_files[m.tag]->pread(buf, step, offset);
-        if (ret < (ssize_t)step)
+// Copies data of the mappings to `commit_args->as`, as a pipeline of chunks (pieces of
+// the mappings, at most `io_buffer_size` each): `io_workers` photon threads each take
+// the next chunk of the index, read it, squeeze out zero blocks and those equal to
+// `dedup_base`, and then write it when all chunks before it have been written, so the
+// data stays in order of index.
+class CompactEngine {
+public:
+    const CompactOptions &opt;
+    vector<SegmentMapping> &index;
+    atomic_uint64_t &compacted_idx_size;
+    uint64_t moffset; // in sectors, where the next chunk is to be written
+    size_t chunk_sectors;
+    bool zero_detect;
+    IFile *dedup_base;
+    uint64_t deduped = 0; // in sectors
+    int passthrough_tag = -1; // mappings with this tag go to the index as is, without data
+
+    size_t next_m = 0;       // mapping of the next chunk
+    uint64_t next_off = 0;   // offset (in sectors) of the next chunk within its mapping
+    uint64_t next_seq = 0;   // sequence # of the next chunk
+    uint64_t write_seq = 0;  // sequence # of the chunk to be written
+    int eno = 0;
+    photon::condition_variable cond;
+
+    CompactEngine(const CompactOptions &opt, vector<SegmentMapping> &index,
+                  atomic_uint64_t &compacted_idx_size, uint64_t moffset)
+        : opt(opt), index(index), compacted_idx_size(compacted_idx_size), moffset(moffset) {
+        auto args = opt.commit_args;
+        auto bs = max(args->io_buffer_size, (size_t)ALIGNMENT4K) / ALIGNMENT4K * ALIGNMENT4K;
+        chunk_sectors = min(bs / ALIGNMENT, (size_t)Segment::MAX_LENGTH / 8 * 8);
+        zero_detect = args->zero_detect;
+        dedup_base = args->dedup_base;
+    }
+
+    struct Chunk {
+        SegmentMapping m;
+        uint64_t seq;
+        bool last; // the last chunk of the mapping
+        bool passthrough;
+    };
+
+    bool get_chunk(Chunk &c) {
+        if (next_m >= opt.index_size)
+            return false;
+        auto &m = opt.raw_index[next_m];
+        c.m = m;
+        c.passthrough = (m.tag == passthrough_tag);
+        if (c.passthrough) {
+            c.last = true;
+            next_m++;
+            c.seq = next_seq++;
+            return true;
+        }
+        c.m.forward_offset_to(m.offset + next_off);
+        if (c.m.length > chunk_sectors)
+            c.m.backward_end_to(c.m.offset + chunk_sectors);
+        next_off += c.m.length;
+        c.last = (next_off >= m.length);
+        if (c.last) {
+            next_m++;
+            next_off = 0;
+        }
+        c.seq = next_seq++;
+        return true;
+    }
+
+    // read chunk `c` into `buf`, moving its non-zero blocks to the front, and
+    // returning the resulted segments (with moffset relative to `buf`), with
+    // the blocks equal to `dedup_base` (read into `base`) left out
+    int read_chunk(const Chunk &c, char *buf, char *base, vector<SegmentMapping> &segs) {
+        segs.clear();
+        if (c.passthrough || c.m.zeroed) {
+            segs.push_back(c.m);
+            return 0;
+        }
+        ssize_t count = c.m.length * ALIGNMENT;
+        auto ret = opt.src_files[c.m.tag]->pread(buf, count, c.m.moffset * ALIGNMENT);
+        if (ret < count)
             LOG_ERRNO_RETURN(0, -1, "failed to read from file");
-        auto zero_detected = -1;
-        auto data_length = 0;
-        auto prev_end = 0;
-        for (auto i = 0; i < step; i += (ssize_t)ALIGNMENT) {
-            if (is_zero_block(buf + i, ALIGNMENT) == 0) {
-                if (zero_detected == 0 && s.length) {
-                    push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
-                }
-                s.length++;
-                zero_detected = 1;
+        // beyond the end of the base, or failing to read it, nothing is deduped
+        if (dedup_base && dedup_base->pread(base, count, c.m.offset * ALIGNMENT) < count)
+            base = nullptr;
+        if (!zero_detect && !base) {
+            segs.push_back(c.m);
+            segs.back().moffset = 0;
+            return 0;
+        }
+        const uint32_t BLK = ALIGNMENT4K / ALIGNMENT;
+        uint64_t data_len = 0; // in sectors
+        for (uint32_t i = 0; i < c.m.length; i += BLK) {
+            auto len = min(BLK, c.m.length - i);
+            if (base && memcmp(buf + i * ALIGNMENT, base + i * ALIGNMENT, len * ALIGNMENT) == 0) {
+                // unmapped, the base shows through
+                deduped += len;
                 continue;
             }
-            if (zero_detected == 1) {
-                push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+            bool zero = zero_detect && is_zero_block(buf + i * ALIGNMENT, len * ALIGNMENT);
+            if (!segs.empty() && segs.back().zeroed == zero &&
+                segs.back().end() == c.m.offset + i) {
+                segs.back().length += len;
+            } else {
+                SegmentMapping s(c.m.offset + i, len, data_len, c.m.tag);
+                s.zeroed = zero;
+                segs.push_back(s);
+            }
+            if (!zero) {
+                if (data_len != i)
+                    memmove(buf + data_len * ALIGNMENT, buf + i * ALIGNMENT, len * ALIGNMENT);
+                data_len += len;
             }
-            zero_detected = 0;
-            s.length++;
         }
-        if (s.length) {
-            push_segment(buf, data, data_length, prev_end, zero_detected, s, index);
+        return 0;
+    }
+
+    int write_chunk(const Chunk &c, const char *buf, vector<SegmentMapping> &segs) {
+        uint64_t data_len = 0;
+        for (auto &s : segs) {
+            if (c.passthrough) {
+                index.push_back(s);
+                continue;
+            }
+            s.moffset = moffset + data_len;
+            if (!s.zeroed)
+                data_len += s.length;
+            index.push_back(s);
+        }
+        if (data_len) {
+            ssize_t nbytes = data_len * ALIGNMENT;
+            auto ret = opt.commit_args->as->write(buf, nbytes);
+            if (ret < nbytes)
+                LOG_ERRNO_RETURN(0, -1, "failed to write to file");
+        }
+        moffset += data_len;
+        if (c.last)
+            compacted_idx_size.fetch_add(1);
+        return 0;
+    }
+
+    void fail(int e) {
+        if (eno == 0)
+            eno = e ? e : EIO;
+        cond.notify_all();
+    }
+
+    static void *worker(void *param) {
+        auto self = (CompactEngine *)param;
+        auto size = self->chunk_sectors * ALIGNMENT;
+        char *buf = nullptr;
+        if (posix_memalign((void **)&buf, ALIGNMENT4K, size) != 0) {
+            self->fail(ENOMEM);
+            return nullptr;
         }
-        /* write non-zeroed data */
-        LOG_DEBUG("write valid data(size: `)", data_length);
-        if (data_length) {
-            ret = opt.commit_args->as->write(data, data_length);
-            if (ret < (ssize_t)data_length)
-                LOG_ERROR_RETURN(0, -1, "failed to write to file");
+        DEFER(free(buf));
+        char *base = nullptr;
+        if (self->dedup_base && posix_memalign((void **)&base, ALIGNMENT4K, size) != 0) {
+            self->fail(ENOMEM);
+            return nullptr;
         }
-        bytes += data_length;
-        offset += step;
-        count -= step;
+        DEFER(free(base));
+        vector<SegmentMapping> segs;
+        Chunk c;
+        while (self->eno == 0 && self->get_chunk(c)) {
+            if (self->read_chunk(c, buf, base, segs) < 0) {
+                self->fail(errno);
+                break;
+            }
+            while (self->eno == 0 && self->write_seq != c.seq)
+                self->cond.wait_no_lock();
+            if (self->eno)
+                break;
+            if (self->write_chunk(c, buf, segs) < 0) {
+                self->fail(errno);
+                break;
+            }
+            self->write_seq++;
+            self->cond.notify_all();
+        }
+        return nullptr;
+    }
+
+    int run() {
+        auto n = max(opt.commit_args->io_workers, 1);
+        LOG_INFO("compact data with ` workers, chunk size: `, zero detect: `, dedup: `", n,
+                 chunk_sectors * ALIGNMENT, zero_detect, dedup_base != nullptr);
+        vector<photon::join_handle *> ths;
+        for (int i = 1; i < n; ++i)
+            ths.push_back(photon::thread_enable_join(photon::thread_create(&worker, this)));
+        worker(this);
+        for (auto th : ths)
+            photon::thread_join(th);
+        if (eno) {
+            errno = eno;
+            return -1;
+        }
+        if (dedup_base)
+            LOG_INFO("` bytes equal to the base are left out", deduped * ALIGNMENT);
+        return 0;
     }
-    return bytes / ALIGNMENT;
+};
+
+// Copies the data of the mappings of a single file within the kernel by
+// copy_file_range(2), appending it to `as` from `moffset` (in sectors) on.
+// Returns 1 with nothing copied if it is not supported between the files.
+// Filesystems only reflink whole blocks at the same offset within a block,
+// so each extent is placed at the offset of its source within a block,
+// leaving a hole before it, and its partial head block is copied alone.
+static int copy_range(const CompactOptions &opt, vector<SegmentMapping> &index,
+                      atomic_uint64_t &compacted_idx_size, uint64_t &moffset) {
+    auto args = opt.commit_args;
+    struct stat st;
+    uint64_t blk = ALIGNMENT4K;
+    if (::fstat(args->as_fd, &st) == 0 && st.st_blksize > (blksize_t)blk &&
+        st.st_blksize % ALIGNMENT4K == 0)
+        blk = st.st_blksize;
+    const uint64_t blk_sectors = blk / ALIGNMENT;
+    bool copied = false;
+    for (size_t i = 0; i < opt.index_size; i++) {
+        auto m = opt.raw_index[i];
+        if (!m.zeroed) {
+            moffset += (m.moffset + blk_sectors - moffset % blk_sectors) % blk_sectors;
+            loff_t in = m.moffset * ALIGNMENT, out = moffset * ALIGNMENT;
+            size_t left = m.length * ALIGNMENT;
+            while (left) {
+                size_t len = left;
+                if (in % blk)
+                    len = std::min<size_t>(left, blk - in % blk);
+                auto n = ::copy_file_range(args->data_fd, &in, args->as_fd, &out, len, 0);
+                if (n < 0 && !copied &&
+                    (errno == ENOSYS || errno == EXDEV || errno == EOPNOTSUPP || errno == EINVAL))
+                    return 1;
+                if (n <= 0)
+                    LOG_ERRNO_RETURN(n == 0 ? EIO : 0, -1, "failed to copy range of `", m);
+                copied = true;
+                left -= n;
+            }
+            m.moffset = moffset;
+            moffset += m.length;
+        }
+        index.push_back(m);
+        compacted_idx_size.fetch_add(1);
+    }
+    // the index and trailer follow through `as`
+    if (args->as->lseek(moffset * ALIGNMENT, SEEK_SET) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to seek to the end of data.");
+    return 0;
 }
 
 static int load_layer_info(IFile **src_files, size_t n, LayerInfo &layer, bool oper_seal = false) {
@@ -399,25 +639,64 @@ static int compact(const CompactOptions &opt, atomic_uint64_t &compacted_idx_siz
     if (ret < 0) {
         LOG_ERRNO_RETURN(0, -1, "failed to write header.");
     }
-    auto marray = ptr_array(opt.raw_index, opt.index_size);
-    uint64_t moffset = HeaderTrailer::SPACE;
     vector<SegmentMapping> compact_index;
-    moffset /= ALIGNMENT;
-    for (auto &m : marray) {
-        compacted_idx_size.fetch_add(1);
-        if (m.zeroed) {
-            m.moffset = moffset;
-            compact_index.push_back(m);
-            // there is no need do pcopy if current block is zero-marked.
-            continue;
-        }
-        auto ret = pcopy(opt, m, moffset, compact_index);
-        if (ret < 0)
-            return (int)ret;
-        moffset += ret;
+    uint64_t moffset = HeaderTrailer::SPACE / ALIGNMENT;
+    int unsupported = 1;
+    if (opt.copy_range && opt.n == 1 && commit_args->data_fd >= 0 && commit_args->as_fd >= 0 &&
+        commit_args->dedup_base == nullptr) {
+        unsupported = copy_range(opt, compact_index, compacted_idx_size, moffset);
+        if (unsupported < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to copy data.");
+        LOG_INFO("copy data `", unsupported ? "through user space, copy_file_range not supported"
+                                            : "by copy_file_range");
+    }
+    if (unsupported) {
+        CompactEngine engine(opt, compact_index, compacted_idx_size, moffset);
+        if (engine.run() < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to compact data.");
+        moffset = engine.moffset;
+    }
+    // pad the data, so as to make the fenced index page-aligned
+    bool fenced = commit_args->fenced_index && !commit_args->wide_index;
+    const uint64_t SECTORS_PER_PAGE = ALIGNMENT4K / ALIGNMENT;
+    if (fenced && moffset % SECTORS_PER_PAGE) {
+        auto npad = SECTORS_PER_PAGE - moffset % SECTORS_PER_PAGE;
+        ALIGNED_MEM4K(zeros, ALIGNMENT4K);
+        memset(zeros, 0, ALIGNMENT4K);
+        ret = dest_file->write(zeros, npad * ALIGNMENT);
+        if (ret < (ssize_t)(npad * ALIGNMENT))
+            LOG_ERRNO_RETURN(0, -1, "failed to write padding of data.");
+        moffset += npad;
     }
     uint64_t index_offset = moffset * ALIGNMENT;
     auto index_size = compress_raw_index(&compact_index[0], compact_index.size());
+    auto index_count = index_size;
+    if (fenced || commit_args->wide_index) {
+        for (size_t i = 0; i < index_count; i++)
+            compact_index[i].tag = 0;
+    }
+    if (commit_args->wide_index) {
+        vector<WideSegmentMapping> wide(index_count);
+        auto nwide = compress_raw_index_wide(compact_index.data(), index_count, wide.data());
+        // padded with zeros to a page, though not needed by the loader
+        auto nbytes = nwide * sizeof(WideSegmentMapping);
+        auto padded = max((nbytes + ALIGNMENT4K - 1) / ALIGNMENT4K * ALIGNMENT4K,
+                          (size_t)ALIGNMENT4K);
+        auto raw = (char *)aligned_alloc(ALIGNMENT4K, padded);
+        if (!raw)
+            LOG_ERRNO_RETURN(ENOMEM, -1, "failed to allocate wide index buffer");
+        DEFER(free(raw));
+        memcpy(raw, wide.data(), nbytes);
+        memset(raw + nbytes, 0, padded - nbytes);
+        ret = dest_file->write(raw, padded);
+        if (ret < (ssize_t)padded)
+            LOG_ERRNO_RETURN(0, -1, "failed to write wide index.");
+        ret = write_header_trailer(dest_file, false, true, true, index_offset, nwide, layer,
+                                   nullptr, 0, true);
+        if (ret < 0)
+            LOG_ERROR_RETURN(0, -1, "failed to write trailer");
+        return 0;
+    }
     LOG_DEBUG("write index to dest_file `, size: `*`", dest_file, index_size,
               sizeof(SegmentMapping));
 
@@ -447,7 +726,8 @@ static int compact(const CompactOptions &opt, atomic_uint64_t &compacted_idx_siz
     assert(writen == index_size * sizeof(SegmentMapping));
     auto trailer_offset = dest_file->lseek(0, 2);
     LOG_DEBUG("trailer offset: `", trailer_offset);
-    ret = write_header_trailer(dest_file, false, true, true, index_offset, index_size, layer);
+    ret = write_header_trailer(dest_file, false, true, true, index_offset, index_size, layer,
+                               fenced ? compact_index.data() : nullptr, index_count);
     if (ret < 0)
         LOG_ERROR_RETURN(0, -1, "failed to write trailer");
     return 0;
@@ -462,12 +742,18 @@ public:
     IMemoryIndex *m_index = nullptr;
     bool m_file_ownership = false;
     uint64_t m_data_offset = HeaderTrailer::SPACE / ALIGNMENT;
+    size_t m_max_io_concurrency = 1;
     uint32_t lsmt_io_cnt = 0;
     uint64_t lsmt_io_size = 0;
+    uint32_t lsmt_req_cnt = 0;      // # of pread requests
+    uint32_t lsmt_parallel_cnt = 0; // # of requests whose sub-reads ran concurrently
+    uint32_t lsmt_max_subreads = 0; // max # of sub-reads of a request
     LSMTFileType m_filetype = LSMTFileType::RO;
 
     virtual ~LSMTReadOnlyFile() {
-        LOG_INFO("pread times: `, size: `M", lsmt_io_cnt, lsmt_io_size >> 20);
+        LOG_INFO("pread times: `, size: `M, requests: ` (parallel: `, max sub-reads: `)",
+                 lsmt_io_cnt, lsmt_io_size >> 20, lsmt_req_cnt, lsmt_parallel_cnt,
+                 lsmt_max_subreads);
         close();
         if (m_file_ownership) {
             LOG_DEBUG("m_file_ownership:`, m_files.size:`", m_file_ownership, m_files.size());
@@ -497,6 +783,19 @@ public:
         return this->MAX_IO_SIZE;
     }
 
+    virtual int set_max_io_concurrency(size_t n) override {
+        if (n == 0) {
+            LOG_ERROR_RETURN(EINVAL, -1, "max io concurrency must be positive.");
+        }
+        LOG_INFO("`", n);
+        this->m_max_io_concurrency = n;
+        return 0;
+    }
+
+    virtual size_t get_max_io_concurrency() override {
+        return this->m_max_io_concurrency;
+    }
+
     virtual IMemoryIndex0 *index() const override {
         return (IMemoryIndex0 *)m_index;
     }
@@ -542,46 +841,92 @@ public:
     virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
         CHECK_ALIGNMENT(count, offset);
         auto nbytes = count;
-        while (count > MAX_IO_SIZE) {
-            auto ret = pread(buf, MAX_IO_SIZE, offset);
-            if (ret < (ssize_t)MAX_IO_SIZE)
-                return -1;
-            (char *&)buf += MAX_IO_SIZE;
-            count -= MAX_IO_SIZE;
-            offset += MAX_IO_SIZE;
-        }
-        count /= ALIGNMENT;
-        offset /= ALIGNMENT;
-        Segment s{(uint64_t)offset, (uint32_t)count};
-        auto ret = foreach_segments(
-            m_index, s,
-            [&](const Segment &m) __attribute__((always_inline)) {
-                auto step = m.length * ALIGNMENT;
-                memset(buf, 0, step);
-                (char *&)buf += step;
+        auto cb_zero = [&](const Segment &m) __attribute__((always_inline)) {
+            auto step = m.length * ALIGNMENT;
+            memset(buf, 0, step);
+            (char *&)buf += step;
+            return 0;
+        };
+        uint32_t nsubreads = 0;
+        int ret;
+        if (m_max_io_concurrency > 1 && m_files.size() > 1) {
+            // sub-reads are issued as they're found, so as to run concurrently, when there
+            // may be several layers
+            FanOut::Group<SubRead> group(m_max_io_concurrency);
+            auto cb_data = [&](const SegmentMapping &m) __attribute__((always_inline)) {
+                nsubreads++;
+                group.submit({this, buf, m});
+                (char *&)buf += m.length * ALIGNMENT;
                 return 0;
-            },
-            [&](const SegmentMapping &m) __attribute__((always_inline)) {
-                if (m.tag >= m_files.size()) {
-                    LOG_DEBUG(" ` >= `", m.tag, m_files.size());
-                }
-                assert(m.tag < m_files.size());
-                ssize_t size = m.length * ALIGNMENT;
-                // LOG_DEBUG("offset: `, length: `", m.moffset, size);
-                ssize_t ret = m_files[m.tag]->pread(buf, size, m.moffset * ALIGNMENT);
-                if (ret < size) {
-                    LOG_ERRNO_RETURN(0, (int)ret,
-                                     "failed to read from `-th file ( ` pread return: ` < size: `)",
-                                     m.tag, m_files[m.tag], ret, size);
-                }
-                lsmt_io_size += ret;
-                lsmt_io_cnt++;
-                (char *&)buf += size;
+            };
+            ret = foreach_mappings(count, offset, cb_zero, cb_data);
+            if (group.wait() < 0)
+                ret = -1;
+            if (group.threads() > 0)
+                lsmt_parallel_cnt++;
+        } else {
+            auto cb_data = [&](const SegmentMapping &m) __attribute__((always_inline)) {
+                nsubreads++;
+                auto ret = read_mapping(buf, m);
+                if (ret < 0)
+                    return ret;
+                (char *&)buf += m.length * ALIGNMENT;
                 return 0;
-            });
+            };
+            ret = foreach_mappings(count, offset, cb_zero, cb_data);
+        }
+        lsmt_req_cnt++;
+        if (nsubreads > lsmt_max_subreads)
+            lsmt_max_subreads = nsubreads;
         return (ret >= 0) ? nbytes : ret;
     }
 
+    template <typename CB_Zero, typename CB_Data>
+    int foreach_mappings(size_t count, off_t offset, CB_Zero &cb_zero, CB_Data &cb_data) {
+        if (count <= MAX_IO_SIZE) {
+            Segment s{(uint64_t)offset / ALIGNMENT, (uint32_t)(count / ALIGNMENT)};
+            return foreach_segments(m_index, s, cb_zero, cb_data);
+        }
+        // a large request is split into segments of MAX_IO_SIZE at most,
+        // whose mappings are resolved in batches
+        vector<Segment> segs;
+        segs.reserve((count + MAX_IO_SIZE - 1) / MAX_IO_SIZE);
+        for (size_t x = 0; x < count; x += MAX_IO_SIZE) {
+            auto n = std::min(MAX_IO_SIZE, count - x);
+            segs.push_back({(uint64_t)(offset + x) / ALIGNMENT, (uint32_t)(n / ALIGNMENT)});
+        }
+        return foreach_segments(m_index, segs.data(), segs.size(), cb_zero, cb_data);
+    }
+
+    // a sub-read of pread(), queued by value in its FanOut::Group
+    struct SubRead {
+        LSMTReadOnlyFile *file;
+        void *buf;
+        SegmentMapping m;
+        int operator()() {
+            return file->read_mapping(buf, m);
+        }
+    };
+
+    // read the data of mapping `m` from its layer into `buf`
+    int read_mapping(void *buf, const SegmentMapping &m) {
+        if (m.tag >= m_files.size()) {
+            LOG_DEBUG(" ` >= `", m.tag, m_files.size());
+        }
+        assert(m.tag < m_files.size());
+        ssize_t size = m.length * ALIGNMENT;
+        // LOG_DEBUG("offset: `, length: `", m.moffset, size);
+        ssize_t ret = m_files[m.tag]->pread(buf, size, m.moffset * ALIGNMENT);
+        if (ret < size) {
+            LOG_ERRNO_RETURN(0, (int)ret,
+                             "failed to read from `-th file ( ` pread return: ` < size: `)",
+                             m.tag, m_files[m.tag], ret, size);
+        }
+        lsmt_io_size += ret;
+        lsmt_io_cnt++;
+        return 0;
+    }
+
     virtual IFile *front_file() {
         for (auto x : m_files)
             if (x)
@@ -610,6 +955,7 @@ public:
 
     UNIMPLEMENTED(int update_vsize(size_t vsize) override);
     UNIMPLEMENTED(int close_seal(IFileRO **reopen_as = nullptr) override);
+    UNIMPLEMENTED(int gc(const GCArgs &args) override);
 
     // It can commit a RO file after close_seal()
     int commit(const CommitArgs &args) const override {
@@ -622,8 +968,10 @@ public:
         if (!pht->is_sealed()) {
             LOG_ERROR_RETURN(ENOTSUP, -1, "Commit a compacted LSMTReadonlyFile is not allowed.");
         }
-        CompactOptions opts(&m_files, (SegmentMapping *)m_index->buffer(), m_index->size(), m_vsize,
-                            &args);
+        // compact() modifies the mappings, and the index may be shared
+        unique_ptr<SegmentMapping[]> mapping(new SegmentMapping[m_index->size()]);
+        memcpy(mapping.get(), m_index->buffer(), m_index->size() * sizeof(SegmentMapping));
+        CompactOptions opts(&m_files, mapping.get(), m_index->size(), m_vsize, &args);
 
         atomic_uint64_t _no_use_var(0);
         return compact(opts, _no_use_var);
@@ -662,6 +1010,23 @@ public:
     uint32_t nmapping = 0;
     // # of elements in the mapping buffer
 
+    photon::rwlock m_gc_rwlock; // keeps reads off the data file while gc() swaps it
+    bool m_gc_running = false;
+
+    // a write waiting for m_rw_mtx, which the holder of it may append
+    // together with its own, see pwrite()
+    struct PendingWrite {
+        const void *buf;
+        size_t count;
+        off_t offset;
+        ssize_t ret = 0;
+        int eno = 0;
+        bool done = false;
+    };
+    static const size_t MAX_COMBINED_WRITES = 64;
+    std::mutex m_pending_mtx;
+    vector<PendingWrite *> m_pending;
+
     LSMTFile() {
         m_compacted_idx_size.store(0);
         m_filetype = LSMTFileType::RW;
@@ -743,6 +1108,7 @@ public:
     }
 
     virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        photon::scoped_rwlock lock(m_gc_rwlock, photon::RLOCK);
         return LSMTReadOnlyFile::pread(buf, count, offset);
     }
 
@@ -759,6 +1125,15 @@ public:
         }
     }
 
+    void append_index(const SegmentMapping *ms, size_t n) {
+        if (m_findex && m_stacked_mappings.empty()) {
+            append(m_findex, ms, n * sizeof(ms[0]));
+            return;
+        }
+        for (size_t i = 0; i < n; i++)
+            append_index(ms[i]);
+    }
+
     virtual ssize_t pwritev(const struct iovec *iov, int iovcnt, off_t offset) override {
         return VirtualFile::pwritev(iov, iovcnt, offset);
     }
@@ -775,30 +1150,81 @@ public:
             count -= MAX_IO_SIZE;
             offset += MAX_IO_SIZE;
         }
-        // wait unlock
-        off_t moffset = -1;
+        // The writes arriving while the lock is held queue up, and whichever
+        // gets it next appends all of them by a single writev() to the data
+        // file and a single append to the index, so the batches grow with the
+        // load without delaying a lone write.
+        PendingWrite w;
+        w.buf = buf;
+        w.count = count;
+        w.offset = offset;
         {
-            Lock lock(m_rw_mtx);
-            moffset = append(m_files[m_rw_tag], buf, count);
-            if (moffset == 0)
-                return -1;
-            m_vsize = max(m_vsize, count + offset);
-            if (m_vsize < count + offset) {
-                LOG_INFO("resize m_visze: `->`", m_vsize, count + offset);
+            std::lock_guard<std::mutex> guard(m_pending_mtx);
+            m_pending.push_back(&w);
+        }
+        Lock lock(m_rw_mtx);
+        if (!w.done) {
+            vector<PendingWrite *> batch;
+            {
+                std::lock_guard<std::mutex> guard(m_pending_mtx);
+                auto n = min(m_pending.size(), MAX_COMBINED_WRITES);
+                // ours is among them, as no one else has taken it
+                auto it = find(m_pending.begin(), m_pending.end(), &w);
+                if (it - m_pending.begin() >= (ssize_t)n)
+                    swap(*it, m_pending[n - 1]);
+                batch.assign(m_pending.begin(), m_pending.begin() + n);
+                m_pending.erase(m_pending.begin(), m_pending.begin() + n);
+            }
+            append_batch(batch);
+        }
+        if (w.ret < 0) {
+            errno = w.eno;
+            return -1;
+        }
+        return bytes;
+    }
+
+    // appends the data of the writes, and then their mappings, in order
+    void append_batch(vector<PendingWrite *> &batch) {
+        iovec iov[MAX_COMBINED_WRITES];
+        size_t total = 0;
+        for (size_t i = 0; i < batch.size(); i++) {
+            iov[i] = {(void *)batch[i]->buf, batch[i]->count};
+            total += batch[i]->count;
+        }
+        auto file = m_files[m_rw_tag];
+        off_t moffset = file->lseek(0, SEEK_END);
+        ssize_t ret = file->writev(iov, batch.size());
+        if (ret < (ssize_t)total) {
+            auto eno = errno;
+            LOG_ERROR("write failed, file:`, ret:`, pos:`, count:`, writes: `", file, ret, moffset,
+                      total, batch.size());
+            for (auto w : batch) {
+                w->ret = -1;
+                w->eno = eno ? eno : EIO;
+                w->done = true;
             }
-            SegmentMapping m{
-                (uint64_t)offset / (uint64_t)ALIGNMENT,
-                (uint32_t)count / (uint32_t)ALIGNMENT,
+            return;
+        }
+        SegmentMapping ms[MAX_COMBINED_WRITES];
+        for (size_t i = 0; i < batch.size(); i++) {
+            auto w = batch[i];
+            m_vsize = max(m_vsize, w->count + w->offset);
+            auto &m = ms[i];
+            m = SegmentMapping{
+                (uint64_t)w->offset / (uint64_t)ALIGNMENT,
+                (uint32_t)w->count / (uint32_t)ALIGNMENT,
                 (uint64_t)moffset / (uint64_t)ALIGNMENT,
             };
             m.tag = m_rw_tag;
             assert(m.length > (uint32_t)0);
+            moffset += w->count;
             m_data_offset = m.mend();
             static_cast<IMemoryIndex0 *>(m_index)->insert(m);
-            append_index(m);
+            w->ret = w->count;
+            w->done = true;
         }
-
-        return bytes;
+        append_index(ms, batch.size());
     }
 
 #ifndef FALLOC_FL_KEEP_SIZE
@@ -923,9 +1349,10 @@ public:
                 return commit_ret;
             }
         }
-        m_files[m_rw_tag]->fsync();
-        if (m_findex)
-            m_findex->fsync();
+        if (m_files[m_rw_tag]->fsync() != 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to fsync the data file");
+        if (m_findex && m_findex->fsync() != 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to fsync the index file");
         return 0;
     }
     virtual int fdatasync() override {
@@ -941,6 +1368,155 @@ public:
         return 0;
     }
 
+    // collect the live mappings of the RW layer whose data lies at or after
+    // `moffset` of the data file, sorted by moffset; return the end of their
+    // data, after which all the data is written later
+    uint64_t gc_collect(uint64_t moffset, vector<SegmentMapping> &ms) const {
+        auto m_index0 = (IMemoryIndex0 *)m_index;
+        unique_ptr<SegmentMapping[]> mapping(m_index0->dump());
+        ms.clear();
+        for (auto &m : ptr_array(mapping.get(), m_index0->size())) {
+            if (m.tag == m_rw_tag && !m.zeroed && m.moffset >= moffset)
+                ms.push_back(m);
+        }
+        sort(ms.begin(), ms.end(), [](const SegmentMapping &a, const SegmentMapping &b) {
+            return a.moffset < b.moffset;
+        });
+        return ms.empty() ? moffset : ms.back().mend();
+    }
+
+    // copy the data of `ms` to `fdata` at `wpos` (in sectors), merging the
+    // reads of contiguous data, and record the moves in `table`
+    int gc_copy(IFile *fdata, const vector<SegmentMapping> &ms, vector<SegmentMapping> &table,
+                uint64_t &wpos, char *buf, const GCArgs *args, uint64_t &copied, uint64_t t0) {
+        auto src = m_files[m_rw_tag];
+        for (size_t i = 0; i < ms.size();) {
+            uint64_t begin = ms[i].moffset, end = ms[i].mend();
+            auto j = i + 1;
+            while (j < ms.size() && ms[j].moffset == end &&
+                   (ms[j].mend() - begin) * ALIGNMENT <= MAX_IO_SIZE)
+                end = ms[j++].mend();
+            auto bytes = (end - begin) * ALIGNMENT;
+            if (src->pread(buf, bytes, begin * ALIGNMENT) != (ssize_t)bytes)
+                LOG_ERRNO_RETURN(0, -1, "failed to read data file at `", begin * ALIGNMENT);
+            if (fdata->pwrite(buf, bytes, wpos * ALIGNMENT) != (ssize_t)bytes)
+                LOG_ERRNO_RETURN(0, -1, "failed to write new data file at `", wpos * ALIGNMENT);
+            for (; i < j; ++i) {
+                SegmentMapping e(ms[i].moffset, ms[i].length, wpos + (ms[i].moffset - begin));
+                table.push_back(e);
+            }
+            wpos += end - begin;
+            copied += bytes;
+            if (args && args->rate_limit) {
+                auto expected = copied * 1000000 / args->rate_limit;
+                auto elapsed = photon::now - t0;
+                if (expected > elapsed)
+                    photon::thread_usleep(expected - elapsed);
+            }
+        }
+        return 0;
+    }
+
+    virtual int gc(const GCArgs &args) override {
+        if (!args.fdata || !args.findex)
+            LOG_ERROR_RETURN(EINVAL, -1, "fresh data file and index file are required");
+        if (m_filetype != LSMTFileType::RW || !m_findex)
+            LOG_ERROR_RETURN(ENOTSUP, -1, "gc is only supported by append-only RW layers");
+        if (m_gc_running)
+            LOG_ERROR_RETURN(EBUSY, -1, "gc is already running");
+        m_gc_running = true;
+        DEFER(m_gc_running = false);
+
+        struct stat st;
+        if (m_files[m_rw_tag]->fstat(&st) != 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to fstat() data file");
+        vector<SegmentMapping> ms, table;
+        auto copied_end = gc_collect(0, ms);
+        uint64_t total = st.st_size - HeaderTrailer::SPACE, live = 0;
+        for (auto &m : ms)
+            live += m.length * ALIGNMENT;
+        if (total == 0 || total - live < total * args.garbage_ratio) {
+            LOG_INFO("gc skipped, garbage: ` of ` bytes", total - live, total);
+            return 1;
+        }
+        LOG_INFO("gc started, garbage: ` of ` bytes", total - live, total);
+
+        // the headers are kept as they are
+        ALIGNED_MEM4K(buf, HeaderTrailer::SPACE);
+        auto fdata = m_files[m_rw_tag];
+        for (auto x : {make_pair(fdata, args.fdata), make_pair(m_findex, args.findex)}) {
+            if (x.first->pread(buf, HeaderTrailer::SPACE, 0) != HeaderTrailer::SPACE ||
+                x.second->pwrite(buf, HeaderTrailer::SPACE, 0) != HeaderTrailer::SPACE)
+                LOG_ERRNO_RETURN(0, -1, "failed to copy header");
+        }
+        auto data = (char *)aligned_alloc(ALIGNMENT4K, MAX_IO_SIZE);
+        if (!data)
+            LOG_ERRNO_RETURN(ENOMEM, -1, "failed to allocate copy buffer");
+        DEFER(free(data));
+
+        // copy the live data in background, and then the data written meanwhile,
+        // for a few passes, before blocking the writes for the rest
+        uint64_t wpos = HeaderTrailer::SPACE / ALIGNMENT, copied = 0, t0 = photon::now;
+        for (int pass = 0; pass < 4; ++pass) {
+            if (gc_copy(args.fdata, ms, table, wpos, data, &args, copied, t0) < 0)
+                return -1;
+            copied_end = gc_collect(copied_end, ms);
+            if (ms.size() * sizeof(SegmentMapping) < MAX_IO_SIZE / 16)
+                break;
+        }
+
+        Lock lock(m_rw_mtx);
+        gc_collect(copied_end, ms);
+        if (gc_copy(args.fdata, ms, table, wpos, data, nullptr, copied, t0) < 0)
+            return -1;
+
+        auto m_index0 = (IMemoryIndex0 *)m_index;
+        auto n = m_index0->size();
+        size_t nalign = ALIGNMENT4K / sizeof(SegmentMapping);
+        auto nindex = (n + nalign - 1) / nalign * nalign;
+        auto index = (SegmentMapping *)aligned_alloc(ALIGNMENT4K, nindex * sizeof(SegmentMapping));
+        if (!index)
+            LOG_ERRNO_RETURN(ENOMEM, -1, "failed to allocate index buffer");
+        DEFER(free(index));
+        unique_ptr<SegmentMapping[]> mapping(m_index0->dump());
+        for (size_t i = 0; i < nindex; ++i) {
+            if (i >= n) {
+                index[i] = SegmentMapping::invalid_mapping();
+                continue;
+            }
+            index[i] = mapping[i];
+            if (index[i].tag == m_rw_tag && !index[i].zeroed &&
+                !relocate_mapping(index[i], table.data(), table.size()))
+                LOG_ERROR_RETURN(EIO, -1, "mapping ` is missing in relocated data", index[i]);
+            index[i].tag = 0;
+        }
+        auto index_bytes = nindex * sizeof(SegmentMapping);
+        if (args.findex->pwrite(index, index_bytes, HeaderTrailer::SPACE) != (ssize_t)index_bytes)
+            LOG_ERRNO_RETURN(0, -1, "failed to write new index file");
+        if (args.fdata->fsync() < 0 || args.findex->fsync() < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to sync new files");
+
+        auto old_fdata = m_files[m_rw_tag], old_findex = m_findex;
+        {
+            // wait for the reads on the old data file
+            photon::scoped_rwlock wlock(m_gc_rwlock, photon::WLOCK);
+            m_index0->relocate(m_rw_tag, table.data(), table.size());
+            m_files[m_rw_tag] = args.fdata;
+            m_findex = args.findex;
+            m_data_offset = wpos;
+            nmapping = 0; // already written in the new index file
+        }
+        LOG_INFO("gc swapped data file, ` -> ` bytes", total,
+                 wpos * ALIGNMENT - HeaderTrailer::SPACE);
+        if (args.on_swap && args.on_swap(old_fdata, old_findex) < 0)
+            LOG_ERROR("on_swap() failed after gc");
+        if (m_file_ownership) {
+            delete old_fdata;
+            delete old_findex;
+        }
+        return 0;
+    }
+
     virtual DataStat data_stat() const override {
         struct stat buf;
         auto ret = m_files[m_rw_tag]->fstat(&buf);
@@ -1044,6 +1620,21 @@ public:
         return 0;
     }
 
+    // the data lies at its offset in the data file, extent by extent as found
+    // by create_mappings(), and is copied in the kernel if the fds are given
+    virtual int commit(const CommitArgs &args) const override {
+        if (m_files.size() > 1) {
+            LOG_ERROR_RETURN(ENOTSUP, -1, "not supported: commit stacked files");
+        }
+        auto m_index0 = (IMemoryIndex0 *)m_index;
+        unique_ptr<SegmentMapping[]> mapping(m_index0->dump());
+        CompactOptions opts(&m_files, mapping.get(), m_index->size(), m_vsize, &args);
+        opts.copy_range = true;
+
+        atomic_uint64_t _no_use_var(0);
+        return compact(opts, _no_use_var);
+    }
+
     virtual int update_vsize(size_t vsize) override {
         LOG_INFO("update vsize for LSMTSparseFile ", VALUE(vsize));
         m_vsize = vsize;
@@ -1125,28 +1716,14 @@ public:
     size_t compact(CompactOptions &opts, size_t moffset, size_t &nindex) const {
 
         auto dest_file = opts.commit_args->as;
-        auto marray = ptr_array(&opts.raw_index[0], opts.index_size);
         vector<SegmentMapping> compact_index;
-        size_t compacted_idx_size = 0;
-        moffset /= ALIGNMENT;
-        for (auto &m : marray) {
-            if (m.tag == (uint8_t)SegmentType::remoteData) {
-                compact_index.push_back(m);
-                compacted_idx_size++;
-                continue;
-            }
-            compacted_idx_size++;
-            if (m.zeroed) {
-                m.moffset = moffset;
-                compact_index.push_back(m);
-                // there is no need do pcopy if current block is zero-marked.
-                continue;
-            }
-            auto ret = pcopy(opts, m, moffset, compact_index);
-            if (ret < 0)
-                return (int)ret;
-            moffset += ret;
-        }
+        atomic_uint64_t compacted_idx_size(0);
+        // remote data stays where it is, only fs meta is copied
+        CompactEngine engine(opts, compact_index, compacted_idx_size, moffset / ALIGNMENT);
+        engine.passthrough_tag = (int)SegmentType::remoteData;
+        if (engine.run() < 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to compact data.");
+        moffset = engine.moffset;
         uint64_t index_offset = moffset * ALIGNMENT;
         auto index_size = compress_raw_index(&compact_index[0], compact_index.size());
         LOG_DEBUG("write index to dest_file `, offset: `, size: `*`", dest_file, index_offset,
@@ -1221,11 +1798,53 @@ static HeaderTrailer *verify_ht(IFile *file, char *buf, bool is_trailer, ssize_t
     return pht;
 }
 
+// read an index in the fenced layout right into its final buffer, checked by the
+// fences and the checksum instead of going through every mapping
+static SegmentMapping *load_fenced_index(IFile *file, const HeaderTrailer *pht) {
+    auto n = pht->index_count;
+    if (n > pht->index_size || pht->index_offset % ALIGNMENT4K)
+        LOG_ERROR_RETURN(0, nullptr, "invalid fenced index: `, `, `", n, pht->index_size + 0,
+                         pht->index_offset + 0);
+    unique_ptr<SegmentMapping[]> p(new SegmentMapping[n]);
+    ssize_t nbytes = n * sizeof(SegmentMapping);
+    auto ret = file->pread(p.get(), nbytes, pht->index_offset);
+    if (ret < nbytes)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read fenced index.");
+    if (!pht->check_fences(p.get(), n))
+        LOG_ERROR_RETURN(0, nullptr, "fences or checksum of index don't match");
+    return p.release();
+}
+
+// read the wide entries of an index in the wide format, with tag 0
+static WideSegmentMapping *load_wide_index(IFile *file, const HeaderTrailer *pht) {
+    auto nwide = pht->index_size;
+    unique_ptr<WideSegmentMapping[]> wide(new WideSegmentMapping[nwide]);
+    ssize_t nbytes = nwide * sizeof(WideSegmentMapping);
+    auto ret = file->pread(wide.get(), nbytes, pht->index_offset);
+    if (ret < nbytes)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read wide index.");
+    for (size_t i = 0; i < nwide; ++i)
+        wide[i].tag = 0;
+    LOG_INFO("load ` wide index entries", nwide);
+    return wide.release();
+}
+
+// `header`, if given, is the header of `file` read before, so it's not read again;
+// for a layer with a wide index, the entries are returned in `*pwide` instead,
+// if it's given, or it fails with ENOTSUP
 static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer, bool trailer,
-                                     uint8_t warp_file_tag = 0) {
+                                     uint8_t warp_file_tag = 0,
+                                     const HeaderTrailer *header = nullptr,
+                                     WideSegmentMapping **pwide = nullptr) {
 
     ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
-    auto pht = verify_ht(file, buf);
+    HeaderTrailer *pht;
+    if (header) {
+        memcpy(buf, header, sizeof(HeaderTrailer));
+        pht = (HeaderTrailer *)buf;
+    } else {
+        pht = verify_ht(file, buf);
+    }
     if (pht == nullptr) {
         return nullptr;
     }
@@ -1244,9 +1863,18 @@ static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer
         }
         auto trailer_offset = stat.st_size - HeaderTrailer::SPACE;
         LOG_DEBUG("index_size: `, trailer offset: `", pht->index_size + 0, trailer_offset);
-        index_bytes = pht->index_size * sizeof(SegmentMapping);
+        index_bytes = pht->index_size * (pht->has_wide_index() ? sizeof(WideSegmentMapping)
+                                                                : sizeof(SegmentMapping));
         if (index_bytes > trailer_offset - pht->index_offset)
             LOG_ERROR_RETURN(0, nullptr, "invalid index bytes or size");
+        if (pht->has_wide_index()) {
+            if (warp_file_tag || !pwide)
+                LOG_ERROR_RETURN(ENOTSUP, nullptr, "wide index is not supported here");
+            *pwide = load_wide_index(file, pht);
+            if (*pwide && pheader_trailer)
+                *pheader_trailer = *pht;
+            return nullptr;
+        }
 
     } else {
         if (!pht->is_index_file() || pht->is_sealed())
@@ -1257,6 +1885,19 @@ static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer
         pht->index_size = index_bytes / sizeof(SegmentMapping);
     }
 
+    if (trailer && !warp_file_tag && pht->has_fenced_index()) {
+        auto p = load_fenced_index(file, pht);
+        if (p) {
+            pht->index_size = pht->index_count;
+            if (pheader_trailer)
+                *pheader_trailer = *pht;
+            return p;
+        }
+        LOG_WARN("failed to load fenced index, fallback to parsing the index region");
+    }
+    // so that the flag in `*pheader_trailer` tells the index passed the checksum
+    pht->clr_flag_bit(HeaderTrailer::FLAG_SHIFT_FENCED_INDEX);
+
     SegmentMapping *ibuf = nullptr;
     posix_memalign((void **)&ibuf, ALIGNMENT4K, pht->index_size * sizeof(*ibuf));
     ret = file->pread(ibuf, index_bytes, pht->index_offset);
@@ -1298,6 +1939,139 @@ static SegmentMapping *do_load_index(IFile *file, HeaderTrailer *pheader_trailer
     return p;
 }
 
+// Indexes of single sealed layers, shared by all the files opened on the same
+// layer (e.g. a lower layer used by several images), keyed by UUID of the layer.
+// An entry lives as long as any file is still using it.
+class LayerIndexRegistry {
+public:
+    struct Entry {
+        std::weak_ptr<const IMemoryIndex> index;
+        size_t bytes;
+    };
+    std::mutex m_mtx;
+    map<string, Entry> m_entries;
+    bool m_enabled = true;
+
+    shared_ptr<const IMemoryIndex> get(const string &key) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return nullptr;
+        auto sp = it->second.index.lock();
+        if (!sp)
+            m_entries.erase(it);
+        return sp;
+    }
+
+    // register a newly loaded index, or take the registered one if another
+    // file has loaded the same layer meanwhile
+    shared_ptr<const IMemoryIndex> put(const string &key, IMemoryIndex *index) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto &e = m_entries[key];
+        auto sp = e.index.lock();
+        if (sp) {
+            delete index;
+            return sp;
+        }
+        sp.reset(index);
+        e = Entry{sp, index->size() * sizeof(SegmentMapping)};
+        return sp;
+    }
+
+    void stats(IndexSharingStats &st) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        for (auto it = m_entries.begin(); it != m_entries.end();) {
+            auto sp = it->second.index.lock();
+            if (!sp) {
+                it = m_entries.erase(it);
+                continue;
+            }
+            // minus the local reference `sp`
+            auto refs = (uint64_t)sp.use_count() - 1;
+            st.layer_indexes++;
+            st.bytes += it->second.bytes;
+            st.saved_bytes += (refs - 1) * it->second.bytes;
+            ++it;
+        }
+    }
+} layer_index_registry;
+
+void set_layer_index_sharing(bool enable) {
+    LOG_INFO("set sharing of layer indexes: `", enable);
+    std::lock_guard<std::mutex> lock(layer_index_registry.m_mtx);
+    layer_index_registry.m_enabled = enable;
+}
+
+static bool g_pooled_index0 = false;
+
+void set_pooled_index0(bool enable) {
+    LOG_INFO("set pooled index of RW layers: `", enable);
+    g_pooled_index0 = enable;
+}
+
+// create the memory index of a sealed layer from the mappings, or the wide entries,
+// loaded by do_load_index(), which are owned by the index from now on, or freed;
+// a fenced index loaded is not checked again, its checksum matched
+static IMemoryIndex *create_layer_index(SegmentMapping *p, WideSegmentMapping *wide,
+                                        const HeaderTrailer &ht, uint64_t moffset_begin,
+                                        uint64_t vsize = 0) {
+    auto moffset_end = ht.index_offset / ALIGNMENT;
+    if (wide) {
+        unique_ptr<WideSegmentMapping[]> holder(wide);
+        return create_wide_memory_index(wide, ht.index_size, moffset_begin, moffset_end, vsize);
+    }
+    if (ht.has_fenced_index())
+        return create_trusted_memory_index(p, ht.index_size, true, vsize);
+    auto pi = create_memory_index(p, ht.index_size, moffset_begin, moffset_end, true, vsize);
+    if (!pi)
+        delete[] p;
+    return pi;
+}
+
+// load the index of a sealed layer, or share the one already loaded by other
+// files opened on the same layer
+static IMemoryIndex *load_layer_index(IFile *file, HeaderTrailer &ht, uint8_t warp_file_tag) {
+    string key;
+    if (layer_index_registry.m_enabled) {
+        ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+        auto pht = verify_ht(file, buf);
+        if (!pht)
+            LOG_ERROR_RETURN(EIO, nullptr, "failed to load header from file.");
+        UUID uu;
+        if (uu.parse(pht->uuid) == 0 && !uu.is_null()) {
+            key = pht->uuid.c_str();
+            if (warp_file_tag)
+                key += "/warp";
+        }
+        if (!key.empty()) {
+            auto sp = layer_index_registry.get(key);
+            if (sp) {
+                LOG_INFO("share loaded index of layer `", pht->uuid);
+                ht = *pht;
+                return create_shared_index(std::move(sp));
+            }
+        }
+    }
+
+    WideSegmentMapping *wide = nullptr;
+    auto p = do_load_index(file, &ht, true, warp_file_tag, nullptr, &wide);
+    if (!p && !wide)
+        LOG_ERROR_RETURN(EIO, nullptr, "failed to load index from file.");
+    IMemoryIndex *pi;
+    if (warp_file_tag) {
+        pi = create_memory_index(p, ht.index_size, 0, -1);
+        if (!pi)
+            delete[] p;
+    } else {
+        pi = create_layer_index(p, wide, ht, HeaderTrailer::SPACE / ALIGNMENT);
+    }
+    if (!pi)
+        LOG_ERROR_RETURN(0, nullptr, "failed to create memory index!");
+    if (key.empty())
+        return pi;
+    return create_shared_index(layer_index_registry.put(key, pi));
+}
+
 static LSMTReadOnlyFile *open_file_ro(IFile *file, bool ownership, bool reserve_tag) {
     if (!file) {
         LOG_ERROR("invalid file ptr. file: `", file);
@@ -1305,15 +2079,9 @@ static LSMTReadOnlyFile *open_file_ro(IFile *file, bool ownership, bool reserve_
     }
 
     HeaderTrailer ht;
-    auto p = do_load_index(file, &ht, true);
-    if (!p)
-        LOG_ERROR_RETURN(EIO, nullptr, "failed to load index from file.");
-    auto pi = create_memory_index(p, ht.index_size, HeaderTrailer::SPACE / ALIGNMENT,
-                                  ht.index_offset / ALIGNMENT);
-    if (!pi) {
-        delete[] p;
-        LOG_ERROR_RETURN(0, nullptr, "failed to create memory index!");
-    }
+    auto pi = load_layer_index(file, ht, 0);
+    if (!pi)
+        return nullptr;
     auto rst = new LSMTReadOnlyFile;
     rst->m_index = pi;
     rst->m_files = {file};
@@ -1342,6 +2110,7 @@ IFileRW *open_file_rw(IFile *fdata, IFile *findex, bool ownership) {
         LOG_ERRNO_RETURN(0, nullptr, "failed to stat data file.");
     }
     IMemoryIndex0 *pi = nullptr;
+    auto create_index0 = g_pooled_index0 ? &create_pooled_memory_index0 : &create_memory_index0;
     if (pht->is_sparse_rw() == false) {
         HeaderTrailer ht;
         auto p = do_load_index(findex, &ht, false);
@@ -1349,8 +2118,8 @@ IFileRW *open_file_rw(IFile *fdata, IFile *findex, bool ownership) {
             LOG_ERROR_RETURN(EIO, nullptr, "failed to load index from file.");
         }
         DEFER(delete[] p);
-        pi = create_memory_index0(p, ht.index_size, HeaderTrailer::SPACE / ALIGNMENT,
-                                  stat.st_size / ALIGNMENT);
+        pi = create_index0(p, ht.index_size, HeaderTrailer::SPACE / ALIGNMENT,
+                           stat.st_size / ALIGNMENT);
         if (!pi) {
             LOG_ERROR_RETURN(0, nullptr, "failed to create memory index!");
         }
@@ -1361,8 +2130,8 @@ IFileRW *open_file_rw(IFile *fdata, IFile *findex, bool ownership) {
         if (LSMTSparseFile::create_mappings(fdata, mappings) == -1) {
             LOG_ERROR_RETURN(0, nullptr, "failed to create segment mappings from sparse file!");
         }
-        pi = create_memory_index0((const SegmentMapping *)&mappings[0], mappings.size(),
-                                  HeaderTrailer::SPACE / ALIGNMENT, stat.st_size / ALIGNMENT);
+        pi = create_index0((const SegmentMapping *)&mappings[0], mappings.size(),
+                           HeaderTrailer::SPACE / ALIGNMENT, stat.st_size / ALIGNMENT);
         if (!pi) {
             LOG_ERROR_RETURN(0, nullptr, "failed to create memory index from sparse file!");
         }
@@ -1401,7 +2170,10 @@ IFileRW *create_file_rw(const LayerInfo &args, bool ownership) {
     } else {
         rst = new LSMTSparseFile;
     }
-    rst->m_index = create_memory_index0((const SegmentMapping *)nullptr, 0, 0, 0);
+    if (g_pooled_index0)
+        rst->m_index = create_pooled_memory_index0((const SegmentMapping *)nullptr, 0, 0, 0);
+    else
+        rst->m_index = create_memory_index0((const SegmentMapping *)nullptr, 0, 0, 0);
     rst->m_findex = findex;
     rst->m_files.push_back(fdata);
     LOG_DEBUG("unparse uuid");
@@ -1425,6 +2197,139 @@ IFileRW *create_file_rw(const LayerInfo &args, bool ownership) {
     return rst;
 }
 
+// The sealed layer of turboOCI, whose fs meta is kept in the layer and whose
+// file data refers to the target file (the original blob). The fs meta is
+// small and hot, so it's loaded into memory at open if no larger than
+// MAX_FSMETA_SIZE. The remote data of a request are read from the target file
+// by one preadv() per run of adjacent mappings, instead of one pread() each.
+class LSMTWarpFileRO : public LSMTReadOnlyFile {
+public:
+    const static size_t MAX_FSMETA_SIZE = 64UL << 20;
+    const static size_t MAX_IOVS = 256;
+    char *m_fsmeta = nullptr;    // fs meta data in [m_fsmeta_begin, m_fsmeta_end)
+    uint64_t m_fsmeta_begin = 0; // in ALIGNMENT
+    uint64_t m_fsmeta_end = 0;
+    uint32_t lsmt_fsmeta_hits = 0; // # of mappings served from memory
+    uint32_t lsmt_coalesced = 0;   // # of remote mappings read along with the previous ones
+
+    struct RemoteRead {
+        uint64_t moffset; // in ALIGNMENT
+        vector<struct iovec> iov;
+    };
+
+    LSMTWarpFileRO() {
+        m_filetype = LSMTFileType::WarpFileRO;
+    }
+    ~LSMTWarpFileRO() {
+        LOG_INFO("fs meta hits: `, coalesced remote reads: `", lsmt_fsmeta_hits, lsmt_coalesced);
+        free(m_fsmeta);
+    }
+
+    // the data of the layer lies in [HeaderTrailer::SPACE, index_offset), and
+    // it's read on demand if it fails to load
+    void load_fsmeta(const HeaderTrailer &ht) {
+        if (ht.index_offset <= HeaderTrailer::SPACE)
+            return;
+        size_t size = ht.index_offset - HeaderTrailer::SPACE;
+        if (size > MAX_FSMETA_SIZE) {
+            LOG_INFO("fs meta of ` bytes is larger than `, read on demand", size,
+                     MAX_FSMETA_SIZE);
+            return;
+        }
+        void *buf = nullptr;
+        if (posix_memalign(&buf, ALIGNMENT4K, size) != 0)
+            LOG_ERRNO_RETURN(0, , "failed to allocate ` bytes for fs meta", size);
+        auto ret = m_files[(uint8_t)SegmentType::fsMeta]->pread(buf, size, HeaderTrailer::SPACE);
+        if (ret != (ssize_t)size) {
+            free(buf);
+            LOG_ERRNO_RETURN(0, , "failed to load fs meta (` bytes), read on demand", size);
+        }
+        m_fsmeta = (char *)buf;
+        m_fsmeta_begin = HeaderTrailer::SPACE / ALIGNMENT;
+        m_fsmeta_end = ht.index_offset / ALIGNMENT;
+        LOG_INFO("fs meta loaded, size: `", size);
+    }
+
+    bool fsmeta_cached(const SegmentMapping &m) const {
+        return m_fsmeta && m.moffset >= m_fsmeta_begin && m.moffset + m.length <= m_fsmeta_end;
+    }
+
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        CHECK_ALIGNMENT(count, offset);
+        auto nbytes = count;
+        vector<RemoteRead> reads;
+        uint64_t rnext = 0; // moffset next to the last remote mapping
+        auto cb_zero = [&](const Segment &m) __attribute__((always_inline)) {
+            auto step = m.length * ALIGNMENT;
+            memset(buf, 0, step);
+            (char *&)buf += step;
+            return 0;
+        };
+        auto cb_data = [&](const SegmentMapping &m) __attribute__((always_inline)) {
+            size_t size = m.length * ALIGNMENT;
+            if (m.tag == (uint8_t)SegmentType::remoteData) {
+                if (!reads.empty() && m.moffset == rnext && reads.back().iov.size() < MAX_IOVS) {
+                    auto &last = reads.back().iov.back();
+                    if ((char *)last.iov_base + last.iov_len == buf)
+                        last.iov_len += size;
+                    else
+                        reads.back().iov.push_back({buf, size});
+                    lsmt_coalesced++;
+                } else {
+                    reads.push_back({m.moffset, {{buf, size}}});
+                }
+                rnext = m.moffset + m.length;
+            } else if (fsmeta_cached(m)) {
+                memcpy(buf, m_fsmeta + (m.moffset - m_fsmeta_begin) * ALIGNMENT, size);
+                lsmt_fsmeta_hits++;
+            } else {
+                auto ret = read_mapping(buf, m);
+                if (ret < 0)
+                    return ret;
+            }
+            (char *&)buf += size;
+            return 0;
+        };
+        int ret = foreach_mappings(count, offset, cb_zero, cb_data);
+        if (ret >= 0 && !reads.empty()) {
+            FanOut::Group<RemoteTask> group(m_max_io_concurrency);
+            for (auto &r : reads)
+                group.submit({this, &r});
+            ret = group.wait();
+            if (group.threads() > 0)
+                lsmt_parallel_cnt++;
+        }
+        lsmt_req_cnt++;
+        if (reads.size() > lsmt_max_subreads)
+            lsmt_max_subreads = reads.size();
+        return (ret >= 0) ? nbytes : ret;
+    }
+
+    // a read_remote() in a FanOut::Group
+    struct RemoteTask {
+        LSMTWarpFileRO *file;
+        const RemoteRead *r;
+        int operator()() {
+            return file->read_remote(*r);
+        }
+    };
+
+    int read_remote(const RemoteRead &r) {
+        ssize_t size = 0;
+        for (auto &v : r.iov)
+            size += v.iov_len;
+        auto file = m_files[(uint8_t)SegmentType::remoteData];
+        auto ret = file->preadv(r.iov.data(), r.iov.size(), r.moffset * ALIGNMENT);
+        if (ret < size) {
+            LOG_ERRNO_RETURN(0, -1, "failed to read from target file ( preadv return: ` < size: `)",
+                             ret, size);
+        }
+        lsmt_io_size += ret;
+        lsmt_io_cnt++;
+        return 0;
+    }
+};
+
 IFileRW *create_warpfile(WarpFileArgs &args, bool ownership) {
     auto rst = new LSMTWarpFile();
     rst->m_findex = args.findex;
@@ -1481,22 +2386,17 @@ IFileRO *open_warpfile_ro(IFile *warpfile, IFile *target_file, bool ownership) {
         return nullptr;
     }
     HeaderTrailer ht;
-    auto p = do_load_index(warpfile, &ht, true, 3);
-    if (!p)
-        LOG_ERROR_RETURN(EIO, nullptr, "failed to load index from file.");
-    auto pi = create_memory_index(p, ht.index_size, 0, -1);
-    if (!pi) {
-        delete[] p;
-        LOG_ERROR_RETURN(0, nullptr, "failed to create memory index!");
-    }
-    auto rst = new LSMTReadOnlyFile;
-    rst->m_filetype = LSMTFileType::WarpFileRO;
+    auto pi = load_layer_index(warpfile, ht, 3);
+    if (!pi)
+        return nullptr;
+    auto rst = new LSMTWarpFileRO;
     rst->m_index = pi;
     rst->m_files = {warpfile, target_file};
     rst->m_uuid.resize(1);
     rst->m_uuid[0].parse(ht.uuid);
     rst->m_vsize = ht.virtual_size;
     rst->m_file_ownership = ownership;
+    rst->load_fsmeta(ht);
     LOG_INFO("Layer Info: { UUID: `, Parent_UUID: `, Virtual size: `, Version: `.` }", ht.uuid,
              ht.parent_uuid, rst->m_vsize, ht.version, ht.sub_version);
     return rst;
@@ -1541,14 +2441,38 @@ struct parallel_load_task {
         return &jobs[i];
     }
 
-    parallel_load_task(IFile **files, size_t nlayers) {
+    // only load UUID of each layer, without index; the headers are kept in
+    // the jobs, for a full load of the layers to come
+    bool uuid_only = false;
+    // the headers read by such a load, if any
+    const HeaderTrailer *headers = nullptr;
+
+    parallel_load_task(IFile **files, size_t nlayers, bool uuid_only = false) {
         this->nlayers = nlayers;
         this->files = files;
+        this->uuid_only = uuid_only;
         indexes.resize(nlayers);
         jobs.resize(nlayers);
     }
 };
 
+static int load_layer_header(IFile *file, HeaderTrailer &ht) {
+    auto type = file->ioctl(IFileRO::GetType);
+    if (type != -1) {
+        UUID uuid;
+        if (((IFileRO *)file)->get_uuid(uuid) != 0)
+            return -1;
+        ht.set_uuid(uuid);
+        return 0;
+    }
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    auto pht = verify_ht(file, buf);
+    if (pht == nullptr)
+        return -1;
+    ht = *pht;
+    return 0;
+}
+
 SegmentMapping *copy_lsmt_index(IFile *file, HeaderTrailer &ht) {
     auto lsmtfile = (IFileRO *)file;
     auto n = lsmtfile->index()->size();
@@ -1566,6 +2490,31 @@ SegmentMapping *copy_lsmt_index(IFile *file, HeaderTrailer &ht) {
     return p;
 }
 
+// take the index of a layer of a chain from the registry, if it's still used by
+// files opened on that layer alone; only the trailer is read for the geometry.
+// Layers shared by different chains are thus loaded once, as long as any file
+// keeps them alive, while the merged indexes are cached per chain (see below).
+static IMemoryIndex *find_layer_index(IFile *file, const HeaderTrailer &header,
+                                      HeaderTrailer &ht) {
+    if (!layer_index_registry.m_enabled)
+        return nullptr;
+    UUID uu;
+    if (uu.parse(header.uuid) != 0 || uu.is_null())
+        return nullptr;
+    auto sp = layer_index_registry.get(header.uuid.c_str());
+    if (!sp)
+        return nullptr;
+    struct stat st;
+    if (file->fstat(&st) < 0)
+        return nullptr;
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    auto pht = verify_ht(file, buf, true, st.st_size);
+    if (!pht || !pht->is_data_file())
+        return nullptr;
+    ht = *pht;
+    return create_shared_index(std::move(sp));
+}
+
 void *do_parallel_load_index(void *param) {
     parallel_load_task *tm = (parallel_load_task *)param;
     while (true) {
@@ -1575,9 +2524,17 @@ void *do_parallel_load_index(void *param) {
             return nullptr;
         }
         auto file = job->get_file();
+        if (tm->uuid_only) {
+            if (load_layer_header(file, job->ht) != 0) {
+                job->set_error(EIO);
+                LOG_ERROR_RETURN(0, nullptr, "failed to load uuid from `-th file", job->i);
+            }
+            continue;
+        }
         LOG_INFO("check `-th file is normal file or LSMT file", job->i);
         IMemoryIndex *pi = nullptr;
         LSMT::SegmentMapping *p = nullptr;
+        WideSegmentMapping *wide = nullptr;
         auto type = file->ioctl(IFileRO::GetType);
         auto verify_begin = HeaderTrailer::SPACE / ALIGNMENT;
         if (type != -1) {
@@ -1593,16 +2550,23 @@ void *do_parallel_load_index(void *param) {
             verify_begin = 0;
 
         } else {
-            p = do_load_index(job->get_file(), &job->ht, true);
-            if (!p) {
+            if (tm->headers) {
+                pi = find_layer_index(file, tm->headers[job->i], job->ht);
+                if (pi) {
+                    LOG_INFO("share loaded index of `-th file", job->i);
+                    job->set_index(pi);
+                    continue;
+                }
+            }
+            p = do_load_index(job->get_file(), &job->ht, true, 0,
+                              tm->headers ? &tm->headers[job->i] : nullptr, &wide);
+            if (!p && !wide) {
                 job->set_error(EIO);
                 LOG_ERROR_RETURN(0, nullptr, "failed to load index from `-th file", job->i);
             }
         }
-        pi = create_memory_index(p, job->ht.index_size, verify_begin,
-                                 job->ht.index_offset / ALIGNMENT);
+        pi = create_layer_index(p, wide, job->ht, verify_begin);
         if (!pi) {
-            delete[] p;
             job->set_error(EIO);
             LOG_ERROR_RETURN(0, nullptr, "failed to create memory index!");
         }
@@ -1612,25 +2576,185 @@ void *do_parallel_load_index(void *param) {
     return NULL;
 }
 
-static IMemoryIndex *load_merge_index(vector<IFile *> &files, vector<UUID> &uuid, uint64_t &vsize) {
+// Merged indexes of lower layers, shared by all the files stacked on the same
+// chain of layers, keyed by UUIDs of the layers from bottom to top. When a file is
+// opened on a chain that extends a cached one, only the extra layers are loaded,
+// and then merged over the cached index.
+// A merged index is a single flat array, as required by lookups and by stacking
+// an RW layer over it, so chains that only share some base layers can't share
+// memory here; the per-layer indexes are instead taken from the layer registry
+// while loading (see find_layer_index()), which saves the reads of those layers.
+// Entries no longer used by any file are kept for later opens, until their total
+// size exceeds `capacity`; capacity 0 disables the cache.
+class MergedIndexCache {
+public:
+    struct Entry {
+        shared_ptr<const IMemoryIndex> index;
+        uint64_t vsize;
+        uint64_t atime;
+        size_t bytes() const {
+            return index->size() * sizeof(SegmentMapping);
+        }
+    };
+    std::mutex m_mtx;
+    map<string, Entry> m_entries;
+    size_t m_capacity = 256UL << 20;
+    uint64_t m_clock = 0;
+
+    bool enabled() const {
+        return m_capacity > 0;
+    }
+
+    shared_ptr<const IMemoryIndex> get(const string &key, uint64_t &vsize) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        auto it = m_entries.find(key);
+        if (it == m_entries.end())
+            return nullptr;
+        it->second.atime = ++m_clock;
+        vsize = it->second.vsize;
+        return it->second.index;
+    }
+
+    void put(const string &key, shared_ptr<const IMemoryIndex> index, uint64_t vsize) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_entries[key] = Entry{std::move(index), vsize, ++m_clock};
+        evict();
+    }
+
+    void set_capacity(size_t capacity) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_capacity = capacity;
+        evict();
+    }
+
+    void stats(IndexSharingStats &st) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        for (auto &x : m_entries) {
+            // minus the reference held by the cache itself
+            auto refs = (uint64_t)x.second.index.use_count() - 1;
+            st.merged_indexes++;
+            st.bytes += x.second.bytes();
+            if (refs > 1)
+                st.saved_bytes += (refs - 1) * x.second.bytes();
+        }
+    }
+
+    // evict the least recently used idle entries, until the idle ones fit in capacity
+    void evict() {
+        size_t idle = 0;
+        for (auto &x : m_entries)
+            if (x.second.index.use_count() == 1)
+                idle += x.second.bytes();
+        while (idle > m_capacity) {
+            auto victim = m_entries.end();
+            for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+                if (it->second.index.use_count() == 1 &&
+                    (victim == m_entries.end() || it->second.atime < victim->second.atime))
+                    victim = it;
+            }
+            if (victim == m_entries.end())
+                break;
+            idle -= victim->second.bytes();
+            LOG_INFO("evict merged index, size: `", victim->second.index->size());
+            m_entries.erase(victim);
+        }
+    }
+} merged_index_cache;
+
+IndexSharingStats get_index_sharing_stats() {
+    IndexSharingStats st;
+    layer_index_registry.stats(st);
+    merged_index_cache.stats(st);
+    return st;
+}
+
+void set_merged_index_cache_capacity(size_t capacity) {
+    LOG_INFO("set capacity of merged index cache: `", capacity);
+    merged_index_cache.set_capacity(capacity);
+}
+
+static void run_parallel_load_task(parallel_load_task &tm) {
     photon::join_handle *ths[PARALLEL_LOAD_INDEX];
-    auto n = min(PARALLEL_LOAD_INDEX, (int)files.size());
-    LOG_DEBUG("create ` photon threads to merge index", n);
-    parallel_load_task tm((IFile **)&(files[0]), files.size());
+    auto n = min(PARALLEL_LOAD_INDEX, (int)tm.nlayers);
+    LOG_DEBUG("create ` photon threads to load index", n);
     for (auto i = 0; i < n; ++i) {
         ths[i] = photon::thread_enable_join(photon::thread_create(&do_parallel_load_index, &tm));
     }
     for (int i = 0; i < n; ++i) {
         photon::thread_join(ths[i]);
     }
+}
+
+// returns keys of the layer chains [0, k] for each k in [0, n), or an empty vector
+// if any of the layers has no UUID; the headers read are returned in `headers`,
+// so that a miss doesn't read them again
+static vector<string> load_chain_keys(vector<IFile *> &files, vector<UUID> &uuid,
+                                      vector<HeaderTrailer> &headers) {
+    vector<string> keys;
+    parallel_load_task tu((IFile **)&(files[0]), files.size(), true);
+    run_parallel_load_task(tu);
+    if (tu.eno != 0) {
+        LOG_WARN("failed to load layer uuid, ignore merged index cache");
+        return keys;
+    }
+    for (size_t i = 0; i < files.size(); i++)
+        headers.push_back(tu.get_result(i)->ht);
+    string key;
+    for (size_t i = 0; i < files.size(); i++) {
+        uuid[i].parse(tu.get_result(i)->ht.uuid);
+        if (uuid[i].is_null()) {
+            LOG_WARN("`-th layer has no uuid, ignore merged index cache", i);
+            return {};
+        }
+        key.append(tu.get_result(i)->ht.uuid.c_str()).append("/");
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+static IMemoryIndex *load_merge_index(vector<IFile *> &files, vector<UUID> &uuid, uint64_t &vsize) {
+    // layers [0, nbase) are covered by a cached merged index
+    size_t nbase = 0;
+    shared_ptr<const IMemoryIndex> base;
+    uint64_t base_vsize = 0;
+    vector<string> keys;
+    vector<HeaderTrailer> headers;
+    if (merged_index_cache.enabled() || layer_index_registry.m_enabled) {
+        keys = load_chain_keys(files, uuid, headers);
+        if (!merged_index_cache.enabled())
+            keys.clear();
+        for (auto k = keys.size(); k > 0; k--) {
+            base = merged_index_cache.get(keys[k - 1], base_vsize);
+            if (base) {
+                nbase = k;
+                break;
+            }
+        }
+        if (nbase)
+            LOG_INFO("found cached merged index of ` layers, size: `", nbase, base->size());
+    }
+    if (nbase == files.size()) {
+        std::reverse(files.begin(), files.end());
+        std::reverse(uuid.begin(), uuid.end());
+        vsize = base_vsize;
+        return create_shared_index(base);
+    }
+
+    // only load the layers above the cached ones
+    auto nload = files.size() - nbase;
+    parallel_load_task tm((IFile **)&(files[nbase]), nload);
+    if (!headers.empty())
+        tm.headers = &headers[nbase];
+    run_parallel_load_task(tm);
     if (tm.eno != 0) {
         LOG_ERROR_RETURN(tm.eno, nullptr, "load index failed.");
     }
-    for (size_t i = 0; i < files.size(); i++) {
+    for (size_t i = 0; i < nload; i++) {
         auto job = tm.get_result(i);
-        uuid[i].parse(job->ht.uuid);
+        uuid[nbase + i].parse(job->ht.uuid);
     }
-    assert(tm.jobs.back().i == files.size() - 1);
+    assert(tm.jobs.back().i == nload - 1);
+    vsize = base_vsize;
     for (auto it = tm.jobs.rbegin(); it != tm.jobs.rend(); ++it) {
         if ((*it).ht.virtual_size > 0) {
             vsize = (*it).ht.virtual_size;
@@ -1644,7 +2768,17 @@ static IMemoryIndex *load_merge_index(vector<IFile *> &files, vector<UUID> &uuid
     auto pmi = merge_memory_indexes((const IMemoryIndex **)&tm.indexes[0], tm.indexes.size());
     if (!pmi)
         LOG_ERROR_RETURN(0, nullptr, "failed to merge indexes");
-    return pmi;
+    if (base) {
+        unique_ptr<IMemoryIndex> upper(pmi);
+        pmi = merge_memory_indexes_over(upper.get(), base.get(), nload);
+        if (!pmi)
+            LOG_ERROR_RETURN(0, nullptr, "failed to merge indexes over the cached one");
+    }
+    if (keys.empty())
+        return pmi;
+    shared_ptr<const IMemoryIndex> merged(pmi);
+    merged_index_cache.put(keys.back(), merged, vsize);
+    return create_shared_index(merged);
 }
 
 IFileRO *open_files_ro(IFile **files, size_t n, bool ownership) {
@@ -1675,6 +2809,83 @@ IFileRO *open_files_ro(IFile **files, size_t n, bool ownership) {
     return rst;
 }
 
+// the layout of a merged index saved by save_merged_index(), followed by the
+// UUIDs of the layers, top first, and the mappings
+struct MergedIndexHeader {
+    static const uint64_t MAGIC = 0x5844494d544d534cULL; // "LSMTMIDX"
+    static const uint32_t VERSION = 1;
+    uint64_t magic = MAGIC;
+    uint32_t version = VERSION;
+    uint32_t nlayers = 0;
+    uint64_t vsize = 0;
+    uint64_t size = 0; // # of mappings
+};
+
+int save_merged_index(IFileRO *file, IFile *out) {
+    auto f = (LSMTReadOnlyFile *)file;
+    if (!f || !out || !f->m_index)
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid argument(s)");
+    MergedIndexHeader h;
+    h.nlayers = f->m_files.size();
+    h.vsize = f->m_vsize;
+    h.size = f->m_index->size();
+    ssize_t ubytes = h.nlayers * sizeof(UUID), mbytes = h.size * sizeof(SegmentMapping);
+    if (out->pwrite(&h, sizeof(h), 0) != (ssize_t)sizeof(h) ||
+        out->pwrite(f->m_uuid.data(), ubytes, sizeof(h)) != ubytes ||
+        out->pwrite(f->m_index->buffer(), mbytes, sizeof(h) + ubytes) != mbytes)
+        LOG_ERRNO_RETURN(0, -1, "failed to write merged index");
+    return 0;
+}
+
+IFileRO *open_files_ro_with_index(IFile **files, size_t n, IFile *index, bool ownership) {
+    if (!files || n == 0 || n > MAX_STACK_LAYERS || !index)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid argument(s)");
+    MergedIndexHeader h;
+    struct stat st;
+    if (index->pread(&h, sizeof(h), 0) != (ssize_t)sizeof(h) || index->fstat(&st) != 0)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read merged index");
+    size_t ubytes = n * sizeof(UUID);
+    if (h.magic != MergedIndexHeader::MAGIC || h.version != MergedIndexHeader::VERSION ||
+        h.nlayers != n || (uint64_t)st.st_size != sizeof(h) + ubytes + h.size * sizeof(SegmentMapping))
+        LOG_ERROR_RETURN(EINVAL, nullptr, "merged index doesn't match ` layers", n);
+    vector<UUID> uuid(n);
+    unique_ptr<SegmentMapping[]> mappings(new SegmentMapping[h.size]);
+    ssize_t mbytes = h.size * sizeof(SegmentMapping);
+    if (index->pread(uuid.data(), ubytes, sizeof(h)) != (ssize_t)ubytes ||
+        index->pread(mappings.get(), mbytes, sizeof(h) + ubytes) != mbytes)
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read merged index");
+    for (size_t i = 0; i < h.size; i++) {
+        if (mappings[i].tag >= n)
+            LOG_ERROR_RETURN(EINVAL, nullptr, "invalid layer ` of mapping `",
+                             (uint32_t)mappings[i].tag, i);
+    }
+    auto pmi = create_memory_index(mappings.get(), h.size, 0, UINT64_MAX, true, h.vsize);
+    if (!pmi)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid mappings of merged index");
+    if (h.size)
+        mappings.release();
+
+    auto rst = new LSMTReadOnlyFile;
+    rst->m_index = pmi;
+    rst->m_files.assign(files, files + n);
+    // top first, as they are merged
+    std::reverse(rst->m_files.begin(), rst->m_files.end());
+    rst->m_uuid = move(uuid);
+    rst->m_vsize = h.vsize;
+    rst->m_file_ownership = ownership;
+    LOG_INFO("open ` layers with merged index, size: `", n, h.size);
+    return rst;
+}
+
+int get_layer_uuid(IFile *file, UUID &uuid) {
+    HeaderTrailer ht;
+    if (!file || load_layer_header(file, ht) != 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to read the header of layer");
+    uuid.clear();
+    uuid.parse(ht.uuid);
+    return 0;
+}
+
 int merge_files_ro(vector<IFile *> files, const CommitArgs &args) {
     uint64_t vsize;
     vector<UUID> files_uuid(files.size());
@@ -1792,15 +3003,14 @@ IFileRW *stack_files(IFileRW *upper_layer, IFileRO *lower_layers, bool ownership
 
 IMemoryIndex *open_file_index(IFile *file) {
     HeaderTrailer ht;
-    auto p = do_load_index(file, &ht, true);
-    if (!p) {
+    WideSegmentMapping *wide = nullptr;
+    auto p = do_load_index(file, &ht, true, 0, nullptr, &wide);
+    if (!p && !wide) {
         LOG_ERROR_RETURN(0, nullptr, "failed to load index");
     }
 
-    auto pi = create_memory_index(p, ht.index_size, HeaderTrailer::SPACE / ALIGNMENT,
-                                  ht.index_offset / ALIGNMENT, true, ht.virtual_size);
+    auto pi = create_layer_index(p, wide, ht, HeaderTrailer::SPACE / ALIGNMENT, ht.virtual_size);
     if (!pi) {
-        delete[] p;
         LOG_ERROR_RETURN(0, nullptr, "failed to create memory index");
     }
     return pi;
@@ -1832,4 +3042,36 @@ int is_lsmt(IFile *file) {
     return 0;
 }
 
+int warmup_index(IFile *file) {
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    auto pht = verify_ht(file, buf);
+    if (pht == nullptr)
+        return -1;
+    if (!pht->is_data_file())
+        return 0;
+    struct stat st;
+    if (file->fstat(&st) < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to stat file.");
+    pht = verify_ht(file, buf, true, st.st_size);
+    if (pht == nullptr)
+        return -1;
+    // the index is between its offset and the trailer, whatever its layout
+    off_t begin = pht->index_offset, end = st.st_size - HeaderTrailer::SPACE;
+    if (begin <= 0 || begin >= end)
+        return 0;
+    const size_t BATCH = 1024UL * 1024;
+    void *ibuf = nullptr;
+    posix_memalign(&ibuf, ALIGNMENT4K, BATCH);
+    if (ibuf == nullptr)
+        LOG_ERRNO_RETURN(0, -1, "failed to allocate buffer.");
+    DEFER(free(ibuf));
+    for (auto offset = begin; offset < end; offset += BATCH) {
+        auto count = std::min((off_t)BATCH, end - offset);
+        if (file->pread(ibuf, count, offset) < count)
+            LOG_ERRNO_RETURN(0, -1, "failed to read index at `.", offset);
+    }
+    LOG_DEBUG("warm up index of `, ` bytes", file, end - begin);
+    return 0;
+}
+
 } // namespace LSMT
@@ -29,6 +29,7 @@ IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> Co
 #include <photon/fs/filesystem.h>
 #include <photon/fs/virtual-file.h>
 #include <photon/common/uuid.h>
+#include <photon/common/callback.h>
 #include "index.h"
 
 namespace LSMT {
@@ -41,6 +42,10 @@ public:
     // set MAX_IO_SIZE of per read/write operation.
     virtual int set_max_io_size(size_t) = 0;
     virtual size_t get_max_io_size() = 0;
+    // set max # of concurrent sub-reads of a read spanning multiple mappings,
+    // issued to the layers on photon threads; 1 (default) issues them one by one.
+    virtual int set_max_io_concurrency(size_t) = 0;
+    virtual size_t get_max_io_concurrency() = 0;
 
     virtual IMemoryIndex *index() const = 0;
 
@@ -56,6 +61,22 @@ struct CommitArgs {
     size_t tag_len = 0;       // commit_msg length
     UUID::String uuid;        // set uuid when commit
     UUID::String parent_uuid; // set parent uuid when commit
+    size_t io_buffer_size = 1024 * 1024; // size of the buffer of each worker copying data
+    int io_workers = 4;                  // # of workers copying data concurrently
+    bool zero_detect = false;            // save all-zero 4K blocks as zeroed mappings
+    // pad the data to 4K and write the index with fences and a checksum in the
+    // trailer, so that it's loaded without parsing or checking every mapping
+    bool fenced_index = false;
+    // write the index in the wide format, whose entries are not limited in length,
+    // which is readable only by versions supporting HeaderTrailer::LSMT_SUB_V2
+    bool wide_index = false;
+    // the layers the result is to be stacked on, if given, 4K blocks equal to
+    // their content at the same offset are left unmapped rather than copied
+    photon::fs::IFile *dedup_base = nullptr;
+    // fds of the data file of a sparse layer and of `as` if it is a local
+    // file written as is, to copy the data by copy_file_range(2) in the
+    // kernel, reflinked where the filesystem supports it
+    int data_fd = -1, as_fd = -1;
     size_t get_tag_len() const {
         if (tag_len == 0 && user_tag != nullptr) {
             return strlen(user_tag);
@@ -94,6 +115,27 @@ public:
         uint64_t valid_data_size = -1; // size of valid data (excluding garbage)
     };
     virtual DataStat data_stat() const = 0;
+
+    // online garbage collection of the top RW layer: the live data is copied
+    // into a pair of fresh files in background, while I/O keeps flowing, and
+    // then the fresh files take over the old ones
+    struct GCArgs {
+        photon::fs::IFile *fdata = nullptr;  // fresh (empty) data file
+        photon::fs::IFile *findex = nullptr; // fresh (empty) index file
+        // gc is skipped unless the garbage takes this ratio of the data file
+        double garbage_ratio = 0.5;
+        // bytes per second of copying in background, 0 for unlimited
+        uint64_t rate_limit = 0;
+        // invoked with the old files, with writes blocked, right after the fresh
+        // files took over, e.g. to rename the fresh files as the old ones;
+        // the old files are deleted afterwards if the RW layer owns its files
+        Delegate<int, photon::fs::IFile * /* old fdata */, photon::fs::IFile * /* old findex */>
+            on_swap;
+    };
+
+    // the fresh files are owned by the RW layer after swapping, if it owns the
+    // old ones; return 0 for success, 1 for skipped, -1 otherwise
+    virtual int gc(const GCArgs &args) = 0;
 };
 
 // create a new writable LSMT file constitued by a data file and an index file,
@@ -151,6 +193,46 @@ extern "C" IFileRO *open_file_ro(photon::fs::IFile *file, bool ownership = false
 // thus they will be destructed automatically.
 extern "C" IFileRO *open_files_ro(photon::fs::IFile **files, size_t n, bool ownership = false);
 
+// save the merged index of `file`, opened by `open_files_ro()`, to `out`, so that
+// the same chain of layers can be opened by `open_files_ro_with_index()`
+extern "C" int save_merged_index(IFileRO *file, photon::fs::IFile *out);
+
+// same as `open_files_ro()`, but with the merged index saved in `index` instead
+// of loading those of the layers, whose files are not accessed until read
+extern "C" IFileRO *open_files_ro_with_index(photon::fs::IFile **files, size_t n,
+                                             photon::fs::IFile *index, bool ownership = false);
+
+// reads the UUID of the single layer `file` from its header, as `get_uuid()`
+// of the layer opened by `open_files_ro()` or `open_files_ro_with_index()`
+extern "C" int get_layer_uuid(photon::fs::IFile *file, UUID &uuid);
+
+// merged indexes of layers opened by `open_files_ro()` are shared by files stacked
+// on the same chain of layer UUIDs, and a chain extending a cached one only merges
+// the extra layers; merged indexes no longer in use are kept until their total
+// size exceeds `capacity` bytes. 0 disables the cache, default is 256MB.
+// Chains sharing only some base layers get merged indexes of their own, but the
+// indexes of those layers are reused while loading if they are still in use by
+// files opened with `open_file_ro()` (see `set_layer_index_sharing()`).
+extern "C" void set_merged_index_cache_capacity(size_t capacity);
+
+// indexes of sealed layers opened by `open_file_ro()` or `open_warpfile_ro()` are
+// shared by all the files opened on the same layer UUID; enabled by default.
+extern "C" void set_layer_index_sharing(bool enable);
+
+// the writable indexes of RW layers created or opened afterwards by `create_file_rw()`
+// or `open_file_rw()` allocate their nodes from a pool of slabs instead of the heap
+// (see `create_pooled_memory_index0()`), which suits heavily written layers;
+// it's an in-memory choice, not recorded in the layer. Disabled by default.
+extern "C" void set_pooled_index0(bool enable);
+
+struct IndexSharingStats {
+    uint64_t layer_indexes = 0;  // # of shared single-layer indexes
+    uint64_t merged_indexes = 0; // # of cached merged indexes
+    uint64_t bytes = 0;          // memory held by the indexes above
+    uint64_t saved_bytes = 0;    // memory saved compared with a private copy per file
+};
+IndexSharingStats get_index_sharing_stats();
+
 extern "C" IFileRW *create_warpfile(WarpFileArgs &args, bool ownership = false);
 
 extern "C" IFileRW *open_warpfile_rw(photon::fs::IFile *findex, photon::fs::IFile *fsmeta_file,
@@ -175,4 +257,8 @@ IMemoryIndex *open_file_index(photon::fs::IFile *file);
 IFileRO *open_files_with_merged_index(photon::fs::IFile **src_files, size_t n, IMemoryIndex *index,
                                       bool ownership = false);
 int is_lsmt(photon::fs::IFile *file);
+
+// reads the header, trailer and index of a sealed layer without loading them,
+// so that they are in the cache beneath `file` when the layer is opened
+int warmup_index(photon::fs::IFile *file);
 } // namespace LSMT
@@ -18,7 +18,9 @@
 #include <vector>
 #include <set>
 #include <algorithm>
+#include <cstring>
 #include <memory>
+#include <mutex>
 #include <photon/common/alog.h>
 #include <photon/fs/filesystem.h>
 #include <photon/common/utility.h>
@@ -99,6 +101,8 @@ public:
 
     template <typename IT>
     void assign(IT begin, IT end) {
+        // the buffer is owned by `mapping` from now on
+        ownership = false;
         mapping.assign(begin, end);
         pbegin = &mapping[0];
         pend = pbegin + mapping.size();
@@ -126,6 +130,35 @@ public:
         return m;
     }
 
+    // lower_bound() of `s` within [it, pend), by galloping forward from `it`,
+    // which is cheap when `s` is close to the previous one
+    const SegmentMapping *gallop(const SegmentMapping *it, const Segment &s) const {
+        size_t step = 1;
+        while (step <= (size_t)(pend - it) && (it + step - 1)->end() <= s.offset) {
+            it += step;
+            step <<= 1;
+        }
+        return std::lower_bound(it, it + std::min(step, (size_t)(pend - it)), s);
+    }
+
+    virtual size_t lookup_batch(const Segment *s, size_t nsegs, /* OUT */ SegmentMapping *pm,
+                                size_t n, /* OUT */ size_t *counts) const override {
+        auto lb = pbegin;
+        size_t i = 0;
+        for (; i < nsegs && n; ++i) {
+            counts[i] = 0;
+            if (s[i].length == 0)
+                continue;
+            lb = gallop(lb, s[i]);
+            auto m = copy_n(lb, pend, s[i].end(), pm, n);
+            trim_edge_mappings(pm, m, s[i]);
+            counts[i] = m;
+            pm += m;
+            n -= m;
+        }
+        return i;
+    }
+
     virtual SegmentMapping front() const override {
         return (pbegin != pend) ? *pbegin : SegmentMapping::invalid_mapping();
     }
@@ -235,10 +268,297 @@ public:
     }
 };
 
+// A read-only index that keeps, besides the sorted mapping array, a copy of the
+// search keys (end of each mapping) in Eytzinger (BFS) order. Descending the
+// implicit tree touches consecutive cache lines, and the children of the next
+// few levels can be prefetched, so a lookup costs far less cache misses than
+// binary searching the 16-byte packed mappings.
+class EytzingerIndex : public Index {
+public:
+    // # of keys in a cache line
+    static const size_t KEYS_PER_LINE = 64 / sizeof(uint64_t);
+    vector<uint64_t> m_keys; // 1-based, m_keys[0] is unused
+    vector<uint32_t> m_rank; // position of m_keys[k] in the sorted mapping array
+
+    EytzingerIndex(const SegmentMapping *pmappings = nullptr, size_t n = 0, bool ownership = true,
+                   uint64_t vsize = 0)
+        : Index(pmappings, n, ownership, vsize) {
+        build_keys();
+    }
+    EytzingerIndex(vector<SegmentMapping> &&m, uint64_t vsize = 0) : Index(std::move(m), vsize) {
+        build_keys();
+    }
+
+    void build_keys() {
+        auto n = size();
+        m_keys.resize(n + 1);
+        m_rank.resize(n + 1);
+        size_t i = 0;
+        do_build(i, 1);
+        assert(i == n);
+        LOG_DEBUG("create eytzinger index, size: `", n);
+    }
+
+    void do_build(size_t &i, size_t k) {
+        if (k > size())
+            return;
+        do_build(i, 2 * k);
+        m_keys[k] = pbegin[i].end();
+        m_rank[k] = i++;
+        do_build(i, 2 * k + 1);
+    }
+
+    // the first mapping whose end() is greater than `offset`,
+    // equivalent to std::lower_bound(pbegin, pend, Segment{offset, 1})
+    const SegmentMapping *search(uint64_t offset) const {
+        auto n = size();
+        auto keys = &m_keys[0];
+        size_t k = 1;
+        while (k <= n) {
+            __builtin_prefetch(keys + KEYS_PER_LINE * k);
+            k = 2 * k + (keys[k] <= offset);
+        }
+        // cancel the trailing right turns plus one left turn
+        k >>= __builtin_ffsll(~k);
+        return k ? pbegin + m_rank[k] : pend;
+    }
+
+    virtual size_t lookup(Segment s, /* OUT */ SegmentMapping *pm, size_t n) const override {
+        if (s.length == 0)
+            return 0;
+        auto lb = search(s.offset);
+        auto m = copy_n(lb, pend, s.end(), pm, n);
+        trim_edge_mappings(pm, m, s);
+        return m;
+    }
+};
+
+static IndexLayout g_index_layout = IndexLayout::Flat;
+
+void set_index_layout(IndexLayout layout) {
+    LOG_INFO("set layout of read-only index: `", (int)layout);
+    g_index_layout = layout;
+}
+
+static bool use_eytzinger(size_t n) {
+    return g_index_layout == IndexLayout::Eytzinger && n > 0 && n < UINT32_MAX;
+}
+
+// A read-only index sharing the mapping array of another (immutable) index,
+// which is kept alive as long as this one.
+class SharedIndex : public Index {
+public:
+    shared_ptr<const IMemoryIndex> m_holder;
+
+    SharedIndex(shared_ptr<const IMemoryIndex> index)
+        : Index(index->buffer(), index->size(), false, index->vsize()), m_holder(index) {
+        alloc_blk = index->block_count();
+    }
+
+    virtual size_t lookup(Segment s, /* OUT */ SegmentMapping *pm, size_t n) const override {
+        return m_holder->lookup(s, pm, n);
+    }
+
+    int increase_tag(int delta) override {
+        LOG_ERROR_RETURN(EPERM, -1, "can not change tag of a shared index");
+    }
+};
+
+static WideSegmentMapping to_wide(const SegmentMapping &m) {
+    WideSegmentMapping w;
+    memset(&w, 0, sizeof(w));
+    w.offset = m.offset;
+    w.length = m.length;
+    w.moffset = m.moffset;
+    w.zeroed = m.zeroed;
+    w.tag = m.tag;
+    return w;
+}
+
+static const WideSegmentMapping *wide_lower_bound(const WideSegmentMapping *begin,
+                                                  const WideSegmentMapping *end, uint64_t offset) {
+    return std::lower_bound(begin, end, offset, [](const WideSegmentMapping &w, uint64_t x) {
+        return w.end() <= x;
+    });
+}
+
+// A read-only index of wide entries, whose lengths are not limited by
+// Segment::MAX_LENGTH, so a large sequential layer costs a few entries rather
+// than one per 8MB. Lookups cut the entries into mappings on the fly, while
+// buffer() expands them all, on its first call, for the callers that need the
+// whole index as an array of mappings. The entries may be shared with another
+// WideIndex, which is kept alive as long as this one.
+class WideIndex : public IMemoryIndex {
+public:
+    vector<WideSegmentMapping> m_wide;
+    const WideSegmentMapping *pbegin = nullptr;
+    const WideSegmentMapping *pend = nullptr;
+    shared_ptr<const IMemoryIndex> m_holder;
+    size_t m_count = 0; // # of mappings expanded from the entries
+    uint64_t alloc_blk = 0;
+    uint64_t virtual_size = 0;
+    mutable std::once_flag m_expand_once;
+    mutable unique_ptr<SegmentMapping[]> m_expanded;
+
+    WideIndex(vector<WideSegmentMapping> &&wide, uint64_t vsize)
+        : m_wide(std::move(wide)), virtual_size(vsize) {
+        pbegin = m_wide.data();
+        pend = pbegin + m_wide.size();
+        m_count = expand_wide_index(pbegin, m_wide.size(), nullptr);
+        for (auto &w : m_wide)
+            alloc_blk += w.length * (!w.zeroed);
+    }
+    WideIndex(shared_ptr<const IMemoryIndex> index) : m_holder(std::move(index)) {
+        auto w = (const WideIndex *)m_holder.get();
+        pbegin = w->pbegin;
+        pend = w->pend;
+        m_count = w->m_count;
+        alloc_blk = w->alloc_blk;
+        virtual_size = w->virtual_size;
+    }
+
+    virtual size_t size() const override {
+        return m_count;
+    }
+
+    virtual const SegmentMapping *buffer() const override {
+        if (m_holder)
+            return m_holder->buffer();
+        std::call_once(m_expand_once, [this] {
+            m_expanded.reset(new SegmentMapping[m_count]);
+            expand_wide_index(pbegin, pend - pbegin, m_expanded.get());
+        });
+        return m_expanded.get();
+    }
+
+    // as `s` is not longer than Segment::MAX_LENGTH, each entry overlapping
+    // with it results in exactly one mapping
+    virtual size_t lookup(Segment s, /* OUT */ SegmentMapping *pm, size_t n) const override {
+        if (s.length == 0)
+            return 0;
+        size_t m = 0;
+        for (auto it = wide_lower_bound(pbegin, pend, s.offset);
+             it != pend && it->offset < s.end() && m < n; ++it)
+            pm[m++] = it->slice(s.offset, s.end());
+        return m;
+    }
+
+    virtual SegmentMapping front() const override {
+        if (pbegin == pend)
+            return SegmentMapping::invalid_mapping();
+        return pbegin->slice(pbegin->offset, pbegin->offset + Segment::MAX_LENGTH);
+    }
+    virtual SegmentMapping back() const override {
+        if (pbegin == pend)
+            return SegmentMapping::invalid_mapping();
+        auto &w = *(pend - 1);
+        auto k = (w.length - 1) / Segment::MAX_LENGTH;
+        return w.slice(w.offset + (uint64_t)k * Segment::MAX_LENGTH, w.end());
+    }
+
+    int increase_tag(int delta) override {
+        if (m_holder)
+            LOG_ERROR_RETURN(EPERM, -1, "can not change tag of a shared index");
+        for (auto &w : m_wide)
+            w.tag += delta;
+        if (m_expanded)
+            for (auto &m : ptr_array(m_expanded.get(), m_count))
+                m.tag += delta;
+        return 0;
+    }
+
+    virtual uint64_t block_count() const override {
+        return alloc_blk;
+    }
+
+    uint64_t vsize() const override {
+        return virtual_size;
+    }
+};
+
+static const WideIndex *as_wide(const IMemoryIndex *index) {
+    return dynamic_cast<const WideIndex *>(index);
+}
+
+// A pool of fixed-size nodes carved out of large slabs and recycled through a
+// free list, so that the tree nodes of Index0 don't cost a malloc() per insertion,
+// and heavily written RW layers don't fragment the heap. Nodes of other sizes
+// (if any) fall back to the global allocator. Slabs are freed with the pool.
+class NodePool {
+public:
+    static const size_t SLAB_SIZE = 64 * 1024;
+    size_t m_node_size = 0;
+    void *m_free = nullptr;
+    char *m_ptr = nullptr, *m_end = nullptr;
+    vector<void *> m_slabs;
+
+    ~NodePool() {
+        for (auto p : m_slabs)
+            free(p);
+    }
+    void *alloc(size_t size) {
+        if (m_node_size == 0)
+            m_node_size = (max(size, sizeof(void *)) + 7) / 8 * 8;
+        if (size > m_node_size)
+            return ::operator new(size);
+        if (m_free) {
+            auto p = m_free;
+            m_free = *(void **)p;
+            return p;
+        }
+        if (m_ptr + m_node_size > m_end) {
+            auto slab = (char *)malloc(SLAB_SIZE);
+            if (!slab)
+                throw std::bad_alloc();
+            m_slabs.push_back(slab);
+            m_ptr = slab;
+            m_end = slab + SLAB_SIZE;
+        }
+        auto p = m_ptr;
+        m_ptr += m_node_size;
+        return p;
+    }
+    void dealloc(void *p, size_t size) {
+        if (size > m_node_size)
+            return ::operator delete(p);
+        *(void **)p = m_free;
+        m_free = p;
+    }
+};
+
+template <typename T>
+struct PoolAllocator {
+    typedef T value_type;
+    shared_ptr<NodePool> pool;
+
+    PoolAllocator(shared_ptr<NodePool> pool = nullptr) : pool(std::move(pool)) {
+    }
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &x) : pool(x.pool) {
+    }
+    T *allocate(size_t n) {
+        if (pool && n == 1)
+            return (T *)pool->alloc(sizeof(T));
+        return (T *)::operator new(n * sizeof(T));
+    }
+    void deallocate(T *p, size_t n) {
+        if (pool && n == 1)
+            return pool->dealloc(p, sizeof(T));
+        ::operator delete(p);
+    }
+    bool operator==(const PoolAllocator &x) const {
+        return pool == x.pool;
+    }
+    bool operator!=(const PoolAllocator &x) const {
+        return pool != x.pool;
+    }
+};
+
 class Index0 : public IComboIndex {
 public:
-    set<SegmentMapping> mapping;
-    typedef set<SegmentMapping>::iterator iterator;
+    typedef set<SegmentMapping, less<SegmentMapping>, PoolAllocator<SegmentMapping>> mapping_set;
+    mapping_set mapping;
+    typedef mapping_set::iterator iterator;
 
     struct block_usage {
         uint64_t m_alloc = 0;
@@ -254,12 +574,18 @@ public:
         }
     } alloc_blk;
 
-    Index0(const SegmentMapping *pmappings = nullptr, size_t n = 0) {
+    Index0(const SegmentMapping *pmappings = nullptr, size_t n = 0, bool pooled = false)
+        : mapping(less<SegmentMapping>(),
+                  PoolAllocator<SegmentMapping>(pooled ? make_shared<NodePool>() : nullptr)) {
         if (pmappings == nullptr)
             return;
         for (size_t i = 0; i < n; ++i)
             insert(pmappings[i]);
     }
+    // whether the nodes are allocated from a NodePool
+    bool pooled() const {
+        return mapping.get_allocator().pool != nullptr;
+    }
     // number of segments in the index
     virtual size_t size() const override {
         return mapping.size();
@@ -361,6 +687,14 @@ public:
         return rst;
     }
 
+    virtual void relocate(uint8_t tag, const SegmentMapping *table, size_t n) override {
+        // moffset is not a part of the key, so it's safe to update in place
+        for (auto &x : mapping) {
+            if (x.tag == tag && !x.zeroed)
+                relocate_mapping((SegmentMapping &)x, table, n);
+        }
+    }
+
     virtual uint64_t block_count() const override {
         return alloc_blk.m_alloc;
     }
@@ -402,12 +736,15 @@ static void merge_indexes(uint8_t level, vector<SegmentMapping> &mapping, const
 class ComboIndex : public Index0 {
 public:
     Index0 *m_index0{nullptr};
-    Index *m_backing_index{nullptr};
+    IMemoryIndex *m_backing_index{nullptr};
     bool m_ownership;
 
-    ComboIndex(Index0 *index0, const Index *index, uint8_t ro_layers_count, bool ownership) {
+    // the mappings of `index0` are copied into a pool of the combo's own, if it's pooled
+    ComboIndex(Index0 *index0, const IMemoryIndex *index, uint8_t ro_layers_count,
+               bool ownership)
+        : Index0(nullptr, 0, index0->pooled()) {
         m_index0 = index0;
-        m_backing_index = const_cast<Index *>(index);
+        m_backing_index = const_cast<IMemoryIndex *>(index);
         mapping = index0->mapping;
         m_ownership = ownership;
 
@@ -462,7 +799,7 @@ public:
     }
 
     virtual int backing_index(const IMemoryIndex *bi) override {
-        if (!bi || !bi->buffer()) {
+        if (!bi || (!as_wide(bi) && !bi->buffer())) {
             errno = EINVAL;
             LOG_ERROR("combo index can NOT be created with IMemoryIndex0!");
             return -1;
@@ -471,7 +808,7 @@ public:
             delete m_backing_index;
             m_backing_index = nullptr;
         }
-        m_backing_index = (Index *)bi;
+        m_backing_index = (IMemoryIndex *)bi;
         return 0;
     }
 
@@ -501,7 +838,8 @@ public:
 
     virtual Index *rebuild_backing_index(Index *highlevel_idx, size_t max_level) {
         vector<SegmentMapping> mappings;
-        const Index *indexes[2] = {highlevel_idx, const_cast<Index *>(m_backing_index)};
+        Index backing(m_backing_index->buffer(), m_backing_index->size(), false);
+        const Index *indexes[2] = {highlevel_idx, &backing};
         merge_indexes(0, mappings, indexes, 2, 0, UINT64_MAX, false, max_level);
         return new Index(std::move(mappings));
     }
@@ -541,17 +879,55 @@ static bool verify_mapping_moffset(const SegmentMapping *pmappings, size_t n,
     return true;
 }
 
+static bool verify_wide_mappings(const WideSegmentMapping *pwide, size_t n,
+                                 uint64_t moffset_begin, uint64_t moffset_end) {
+    for (size_t i = 0; i < n; ++i) {
+        auto &w = pwide[i];
+        if (w.length == 0 || (i + 1 < n && w.end() > pwide[i + 1].offset))
+            LOG_ERROR_RETURN(0, false, "incorrect wide segment mappings: empty or disordered");
+        if (!within(w.moffset, w.mend(), moffset_begin, moffset_end, w.zeroed))
+            LOG_ERROR_RETURN(0, false,
+                             "incorrect wide segment mappings [ `, ` ] !within [ `, ` ]: "
+                             "mapped offset out of range",
+                             w.moffset, w.mend(), moffset_begin, moffset_end);
+    }
+    return true;
+}
+
 IMemoryIndex0 *create_memory_index0(const SegmentMapping *pmappings, size_t n,
                                     uint64_t moffset_begin, uint64_t moffset_end) {
     auto ok = verify_mapping_moffset(pmappings, n, moffset_begin, moffset_end);
     return ok ? new Index0(pmappings, n) : nullptr;
 }
 
+IMemoryIndex0 *create_pooled_memory_index0(const SegmentMapping *pmappings, size_t n,
+                                           uint64_t moffset_begin, uint64_t moffset_end) {
+    auto ok = verify_mapping_moffset(pmappings, n, moffset_begin, moffset_end);
+    return ok ? new Index0(pmappings, n, true) : nullptr;
+}
+
 IMemoryIndex *create_memory_index(const SegmentMapping *pmappings, size_t n, uint64_t moffset_begin,
                                   uint64_t moffset_end, bool ownership, uint64_t vsize) {
     auto ok1 = verify_mapping_order(pmappings, n);
     auto ok2 = verify_mapping_moffset(pmappings, n, moffset_begin, moffset_end);
-    return (ok1 && ok2) ? new Index(pmappings, n, ownership, vsize) : nullptr;
+    if (!ok1 || !ok2)
+        return nullptr;
+    return create_trusted_memory_index(pmappings, n, ownership, vsize);
+}
+
+IMemoryIndex *create_trusted_memory_index(const SegmentMapping *pmappings, size_t n,
+                                          bool ownership, uint64_t vsize) {
+    if (use_eytzinger(n))
+        return new EytzingerIndex(pmappings, n, ownership, vsize);
+    return new Index(pmappings, n, ownership, vsize);
+}
+
+IMemoryIndex *create_wide_memory_index(const WideSegmentMapping *pwide, size_t n,
+                                      uint64_t moffset_begin, uint64_t moffset_end,
+                                      uint64_t vsize) {
+    if (!verify_wide_mappings(pwide, n, moffset_begin, moffset_end))
+        return nullptr;
+    return new WideIndex(vector<WideSegmentMapping>(pwide, pwide + n), vsize);
 }
 
 IMemoryIndex *create_level_index(const SegmentMapping *pmappings, size_t n, uint64_t moffset_begin,
@@ -619,8 +995,7 @@ IComboIndex *create_combo_index(IMemoryIndex0 *index0, const IMemoryIndex *index
         LOG_ERROR_RETURN(EINVAL, nullptr, "invalid argument(s)");
 
     auto i0 = (Index0 *)index0;
-    auto i1 = (Index *)index;
-    return new ComboIndex(i0, i1, ro_index_count, ownership);
+    return new ComboIndex(i0, index, ro_index_count, ownership);
 }
 
 size_t compress_raw_index(SegmentMapping *mapping, size_t n) {
@@ -663,6 +1038,161 @@ size_t compress_raw_index_predict(const SegmentMapping *mapping, size_t n) {
     return i;
 }
 
+size_t compress_raw_index_wide(const SegmentMapping *mapping, size_t n,
+                               WideSegmentMapping *out) {
+    size_t i = 0;
+    for (size_t j = 0; j < n; ++j) {
+        auto &m = mapping[j];
+        if (i > 0 && out[i - 1].end() == m.offset && out[i - 1].mend() == m.moffset &&
+            out[i - 1].zeroed == m.zeroed && out[i - 1].tag == m.tag &&
+            (uint64_t)out[i - 1].length + m.length <= UINT32_MAX) {
+            out[i - 1].length += m.length;
+        } else {
+            out[i++] = to_wide(m);
+        }
+    }
+    LOG_INFO("index size compressed from ", n, " to ", i, " wide entries");
+    return i;
+}
+
+size_t expand_wide_index(const WideSegmentMapping *wide, size_t n, SegmentMapping *out) {
+    size_t k = 0;
+    for (size_t i = 0; i < n; ++i) {
+        for (uint64_t offset = wide[i].offset; offset < wide[i].end();
+             offset += Segment::MAX_LENGTH) {
+            if (out)
+                out[k] = wide[i].slice(offset, offset + Segment::MAX_LENGTH);
+            k++;
+        }
+    }
+    return k;
+}
+
+struct WideRange {
+    const WideSegmentMapping *begin, *end;
+};
+
+// the entries of `index`, or its mappings converted into `tmp` if it's not a WideIndex
+static WideRange wide_range(const IMemoryIndex *index, vector<WideSegmentMapping> &tmp) {
+    if (auto w = as_wide(index))
+        return {w->pbegin, w->pend};
+    auto p = index->buffer();
+    tmp.resize(index->size());
+    for (size_t i = 0; i < tmp.size(); ++i)
+        tmp[i] = to_wide(p[i]);
+    return {tmp.data(), tmp.data() + tmp.size()};
+}
+
+// append the part of `w` within [begin, end) to `out` with `tag`, in which it's
+// merged into the last entry if they are contiguous
+static void push_wide(vector<WideSegmentMapping> &out, WideSegmentMapping w, uint64_t begin,
+                      uint64_t end, uint8_t tag) {
+    if (w.offset < begin) {
+        auto delta = begin - w.offset;
+        w.offset = begin;
+        w.length -= delta;
+        w.moffset += (!w.zeroed ? delta : 0);
+    }
+    if (w.end() > end)
+        w.length = (uint32_t)(end - w.offset);
+    w.tag = tag;
+    if (!out.empty()) {
+        auto &b = out.back();
+        if (b.end() == w.offset && b.mend() == w.moffset && b.zeroed == w.zeroed &&
+            b.tag == w.tag && (uint64_t)b.length + w.length <= UINT32_MAX) {
+            b.length += w.length;
+            return;
+        }
+    }
+    out.push_back(w);
+}
+
+// the same as merge_indexes() with `change_tag`, but of wide entries
+static void merge_wide_indexes(uint8_t level, vector<WideSegmentMapping> &out,
+                               const WideRange *pranges, size_t n, uint64_t begin,
+                               uint64_t end) {
+    if (n == 0 || begin >= end)
+        return;
+    auto &r = pranges[0];
+    for (auto it = wide_lower_bound(r.begin, r.end, begin); it != r.end && it->offset < end;
+         ++it) {
+        if (it->offset > begin)
+            merge_wide_indexes(level + 1, out, pranges + 1, n - 1, begin, it->offset);
+        push_wide(out, *it, begin, end, level);
+        begin = it->end();
+    }
+    if (begin < end)
+        merge_wide_indexes(level + 1, out, pranges + 1, n - 1, begin, end);
+}
+
+static IMemoryIndex *merge_wide_indexes_over(const IMemoryIndex *upper,
+                                             const IMemoryIndex *lower,
+                                             uint8_t lower_tag_delta) {
+    vector<WideSegmentMapping> tu, tl, wide;
+    auto u = wide_range(upper, tu);
+    auto l = wide_range(lower, tl);
+    wide.reserve((u.end - u.begin) + (l.end - l.begin));
+    auto append_lower = [&](uint64_t begin, uint64_t end) {
+        for (auto it = wide_lower_bound(l.begin, l.end, begin); it != l.end && it->offset < end;
+             ++it)
+            push_wide(wide, *it, begin, end, it->tag + lower_tag_delta);
+    };
+    uint64_t begin = 0;
+    for (auto it = u.begin; it != u.end; ++it) {
+        if (it->offset > begin)
+            append_lower(begin, it->offset);
+        push_wide(wide, *it, 0, UINT64_MAX, it->tag);
+        begin = it->end();
+    }
+    append_lower(begin, UINT64_MAX);
+    auto vsize = upper->vsize() ? upper->vsize() : lower->vsize();
+    return new WideIndex(std::move(wide), vsize);
+}
+
+IMemoryIndex *merge_memory_indexes_over(const IMemoryIndex *upper, const IMemoryIndex *lower,
+                                        uint8_t lower_tag_delta) {
+    if (!upper || !lower)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid argument(s)");
+    if (as_wide(upper) || as_wide(lower))
+        return merge_wide_indexes_over(upper, lower, lower_tag_delta);
+
+    auto pu = (const Index *)upper;
+    auto pl = (const Index *)lower;
+    vector<SegmentMapping> mapping;
+    mapping.reserve(pu->size() + pl->size());
+    auto append_lower = [&](uint64_t begin, uint64_t end) {
+        for (auto it = pl->lower_bound(begin); it != pl->end() && it->offset < end; ++it) {
+            mapping.push_back(*it);
+            auto &m = mapping.back();
+            if (m.offset < begin)
+                m.forward_offset_to(begin);
+            if (m.end() > end)
+                m.backward_end_to(end);
+            m.tag += lower_tag_delta;
+        }
+    };
+    uint64_t begin = 0;
+    for (auto &m : ptr_array(pu->buffer(), pu->size())) {
+        if (m.offset > begin)
+            append_lower(begin, m.offset);
+        mapping.push_back(m);
+        begin = m.end();
+    }
+    append_lower(begin, UINT64_MAX);
+    auto vsize = upper->vsize() ? upper->vsize() : lower->vsize();
+    if (use_eytzinger(mapping.size()))
+        return new EytzingerIndex(std::move(mapping), vsize);
+    return new Index(std::move(mapping), vsize);
+}
+
+IMemoryIndex *create_shared_index(std::shared_ptr<const IMemoryIndex> index) {
+    if (index && as_wide(index.get()))
+        return new WideIndex(std::move(index));
+    if (!index || (index->size() && !index->buffer()))
+        LOG_ERROR_RETURN(EINVAL, nullptr, "only a read-only index can be shared");
+    return new SharedIndex(std::move(index));
+}
+
 IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, size_t n) {
     if (n > 255) {
         LOG_ERROR("too many indexes to merge, 255 at most!");
@@ -671,10 +1201,22 @@ IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, size_t n) {
     if (n == 0 || pindexes == nullptr)
         return nullptr;
 
+    if (std::any_of(pindexes, pindexes + n, as_wide)) {
+        vector<vector<WideSegmentMapping>> tmp(n);
+        vector<WideRange> ranges;
+        for (size_t i = 0; i < n; ++i)
+            ranges.push_back(wide_range(pindexes[i], tmp[i]));
+        vector<WideSegmentMapping> wide;
+        merge_wide_indexes(0, wide, ranges.data(), n, 0, UINT64_MAX);
+        return new WideIndex(std::move(wide), pindexes[0]->vsize());
+    }
+
     vector<SegmentMapping> mapping;
     auto pi = (const Index **)pindexes;
     mapping.reserve(pi[0]->size());
     merge_indexes(0, mapping, pi, n, 0, UINT64_MAX);
+    if (use_eytzinger(mapping.size()))
+        return new EytzingerIndex(std::move(mapping), pindexes[0]->vsize());
     return new Index(std::move(mapping), pindexes[0]->vsize());
 }
 } // namespace LSMT
@@ -20,6 +20,8 @@ VirualReadOnly -> IFileRO -> IFileRW -> LSMTReadOnlyFile -> LSMTFile
 IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> ComboIndex
          |
          | -> Index ( vector<SegmentMap> )
+         |
+         | -> WideIndex ( vector<WideSegmentMap> )
 */
 
 #pragma once
@@ -27,6 +29,9 @@ IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> Co
 #include <cstddef>
 #include <assert.h>
 #include <sys/types.h>
+#include <memory>
+#include <algorithm>
+#include "../cpu_account.h"
 
 namespace LSMT {
 struct Segment {          // 48 + 18 == 64
@@ -84,6 +89,37 @@ struct SegmentMapping : public Segment { // 64 + 55 + 9 == 128
     }
 } __attribute__((packed));
 
+// index entry of the wide format (see HeaderTrailer::LSMT_SUB_V2), whose length is
+// not capped by Segment::MAX_LENGTH, so that a large contiguous extent of a sealed
+// layer is recorded by a single entry, both on disk and in a WideIndex
+struct WideSegmentMapping { // 64 + 64 + 64 == 192
+    uint64_t offset : 50;
+    uint64_t zeroed : 1;
+    uint64_t reserved0 : 13;
+    uint64_t moffset : 55;
+    uint64_t tag : 8;
+    uint64_t reserved1 : 1;
+    uint32_t length;
+    uint32_t reserved2;
+
+    uint64_t end() const {
+        return offset + length;
+    }
+    uint64_t mend() const {
+        return (zeroed ? moffset : moffset + length);
+    }
+    // the part of this entry within [begin, end), which must not be longer than
+    // Segment::MAX_LENGTH, as a SegmentMapping
+    SegmentMapping slice(uint64_t begin, uint64_t end) const {
+        auto b = std::max(begin, (uint64_t)offset);
+        auto e = std::min(end, this->end());
+        SegmentMapping m(b, (uint32_t)(e - b), zeroed ? moffset : moffset + (b - offset), tag);
+        m.zeroed = zeroed;
+        return m;
+    }
+} __attribute__((packed));
+static_assert(sizeof(WideSegmentMapping) == 24, "wide index entry is 24 bytes");
+
 struct RemoteMapping {
     off_t offset;
     uint32_t count;
@@ -117,6 +153,21 @@ public:
         return lookup(s, pm, N);
     }
 
+    // look up mappings within multiple segments `s[0..nsegs]`, which must be sorted and
+    // disjoint, in a single pass over the index if possible; found mappings are stored
+    // segment by segment in pm[0..n], with # of those of `s[i]` stored in `counts[i]`;
+    // returns # of segments looked up, the last of which may be cut short by `n`.
+    virtual size_t lookup_batch(const Segment *s, size_t nsegs, /* OUT */ SegmentMapping *pm,
+                                size_t n, /* OUT */ size_t *counts) const {
+        size_t i = 0;
+        for (; i < nsegs && n; ++i) {
+            counts[i] = lookup(s[i], pm, n);
+            pm += counts[i];
+            n -= counts[i];
+        }
+        return i;
+    }
+
     // returns the first and last mapping in the index
     // the there's no one, return an invalid mapping: [INVALID_OFFSET, 0) ==> 0
     virtual SegmentMapping front() const = 0;
@@ -140,8 +191,29 @@ public:
     // memory allocation is aligned to the `alignment`
     virtual SegmentMapping *dump(size_t alignment = 0) const = 0;
     virtual IMemoryIndex *make_read_only_index() const = 0;
+
+    // move the mapped offsets of the (non-zeroed) mappings with `tag`, according
+    // to `table`, which see relocate_mapping()
+    virtual void relocate(uint8_t tag, const SegmentMapping *table, size_t n) = 0;
 };
 
+// relocate `m` by `table`, an array of extents sorted by `offset`, each of which
+// moves the data at [offset, offset + length) of a file to `moffset`;
+// return false if `m` doesn't lie in any extent
+inline bool relocate_mapping(SegmentMapping &m, const SegmentMapping *table, size_t n) {
+    uint64_t mo = m.moffset;
+    auto it = std::upper_bound(table, table + n, mo, [](uint64_t x, const SegmentMapping &t) {
+        return x < t.offset;
+    });
+    if (it == table)
+        return false;
+    --it;
+    if (mo + m.length > it->end())
+        return false;
+    m.moffset = it->moffset + (mo - it->offset);
+    return true;
+}
+
 class IComboIndex : public IMemoryIndex0 {
 public:
     // backing index must NOT be IMemoryIndex0!
@@ -164,6 +236,13 @@ inline IMemoryIndex0 *create_memory_index0() {
     return create_memory_index0(nullptr, 0, 0, UINT64_MAX);
 }
 
+// same as create_memory_index0(), but the index allocates its nodes from a private
+// pool of slabs, instead of a malloc() per node, which is preferable for heavily
+// written layers as it doesn't fragment the heap
+extern "C" IMemoryIndex0 *create_pooled_memory_index0(const SegmentMapping *pmappings,
+                                                      std::size_t n, uint64_t moffset_begin,
+                                                      uint64_t moffset_end);
+
 // create a read-only memory index from an array of mappings;
 // the mappings should have been sorted and should not intersect with each other!!
 // the array buffer must remain valid as long as the index is valid, if copy_mode = 0 or 1.
@@ -173,11 +252,51 @@ extern "C" IMemoryIndex *create_memory_index(const SegmentMapping *pmappings, st
                                              uint64_t moffset_begin, uint64_t moffset_end,
                                              bool ownership = true, uint64_t vsize = 0);
 
+// as create_memory_index(), for mappings known to be sorted and within range,
+// e.g. those of a fenced index whose checksum matched, which are not checked again
+extern "C" IMemoryIndex *create_trusted_memory_index(const SegmentMapping *pmappings,
+                                                     std::size_t n, bool ownership = true,
+                                                     uint64_t vsize = 0);
+
+// create a read-only memory index keeping wide entries as they are, which are
+// sorted and not intersecting; lookups return mappings cut by Segment::MAX_LENGTH,
+// and buffer() expands the entries into such mappings only when it's called.
+// the array is copied, so it may be freed immediately after the function returns.
+// the mapped offset must be within [moffset_begin, moffset_end)
+extern "C" IMemoryIndex *create_wide_memory_index(const WideSegmentMapping *pwide,
+                                                  std::size_t n, uint64_t moffset_begin,
+                                                  uint64_t moffset_end, uint64_t vsize = 0);
+
+// layout of the search keys of read-only indexes
+enum class IndexLayout : uint8_t {
+    Flat = 0,      // binary search over the sorted mapping array
+    Eytzinger = 1, // an extra copy of keys in Eytzinger (BFS) order, cache-friendly for large index
+};
+
+// set the layout of read-only indexes created afterwards by
+// create_memory_index() and merge_memory_indexes(), default is Flat
+extern "C" void set_index_layout(IndexLayout layout);
+
 // merge multiple indexes into a single one index
 // the `tag` field of each element in the result is subscript of `pindexes`:
-// after creation, the sources can be safely destoryed
+// after creation, the sources can be safely destoryed;
+// if any of the sources is a wide index, so is the result
 extern "C" IMemoryIndex *merge_memory_indexes(const IMemoryIndex **pindexes, std::size_t n);
 
+// merge a read-only index `upper` over another one `lower`, i.e. the holes of `upper`
+// are filled with mappings from `lower`; tags of `upper` are kept, and tags of
+// mappings from `lower` are increased by `lower_tag_delta`.
+// after creation, the sources can be safely destoryed;
+// if either of the sources is a wide index, so is the result
+extern "C" IMemoryIndex *merge_memory_indexes_over(const IMemoryIndex *upper,
+                                                   const IMemoryIndex *lower,
+                                                   uint8_t lower_tag_delta);
+
+// create a read-only index sharing the mapping array of `index` without copying,
+// `index` is kept alive until the created index is destroyed.
+// the shared mappings are immutable, so increase_tag() fails with EPERM.
+IMemoryIndex *create_shared_index(std::shared_ptr<const IMemoryIndex> index);
+
 // combine an index0 and an index into a combo, which, when looked-up, behaves as if they
 // were one single index; inserting into a combo effectively inserting into the index0 part;
 // the mapped offset must be within [moffset_begin, moffset_end)
@@ -189,13 +308,26 @@ extern "C" IComboIndex *create_combo_index(IMemoryIndex0 *index0, const IMemoryI
 extern "C" std::size_t compress_raw_index(SegmentMapping *mapping, std::size_t n);
 extern "C" std::size_t compress_raw_index_predict(const SegmentMapping *mapping, std::size_t n);
 
+// compress a sorted raw index array into wide entries in `out` (of at least `n`
+// elements), returning # of the entries
+extern "C" std::size_t compress_raw_index_wide(const SegmentMapping *mapping, std::size_t n,
+                                               WideSegmentMapping *out);
+// expand wide entries into mappings in `out`, or only count them if `out` is
+// nullptr, returning # of the mappings
+extern "C" std::size_t expand_wide_index(const WideSegmentMapping *wide, std::size_t n,
+                                         SegmentMapping *out);
+
 // lookup `idx` with `s`, and visit each segments via callbacks
 template <typename CB1, typename CB2>
 inline int foreach_segments(IMemoryIndex *idx, Segment s, CB1 cb_zero, CB2 cb_data) {
     const size_t NMAPPING = 16;
     SegmentMapping mappings[NMAPPING];
     while (true) {
-        auto n = idx->lookup(s, mappings, NMAPPING);
+        size_t n;
+        {
+            CpuAccount::Scope _cpu(CpuAccount::LOOKUP);
+            n = idx->lookup(s, mappings, NMAPPING);
+        }
         for (size_t i = 0; i < n; ++i) {
             auto &m = mappings[i];
             if (s.offset < m.offset) {
@@ -219,4 +351,69 @@ inline int foreach_segments(IMemoryIndex *idx, Segment s, CB1 cb_zero, CB2 cb_da
         cb_zero(s);
     return 0;
 }
+
+// lookup `idx` with sorted and disjoint segments `segs[0..nsegs]` in batches,
+// and visit each segments via callbacks, in the same way as above
+template <typename CB1, typename CB2>
+inline int foreach_segments(IMemoryIndex *idx, const Segment *segs, size_t nsegs, CB1 cb_zero,
+                            CB2 cb_data) {
+    const size_t NMAPPING = 64, NSEGS = 16;
+    SegmentMapping mappings[NMAPPING];
+    Segment batch[NSEGS];
+    size_t counts[NSEGS];
+    size_t i = 0;
+    Segment head = nsegs ? segs[0] : Segment{0, 0}; // the rest of segs[i] to look up
+    while (i < nsegs) {
+        auto nb = std::min(NSEGS, nsegs - i);
+        batch[0] = head;
+        for (size_t j = 1; j < nb; ++j)
+            batch[j] = segs[i + j];
+        size_t k;
+        {
+            CpuAccount::Scope _cpu(CpuAccount::LOOKUP);
+            k = idx->lookup_batch(batch, nb, mappings, NMAPPING, counts);
+        }
+        size_t total = 0;
+        for (size_t j = 0; j < k; ++j)
+            total += counts[j];
+        auto pm = mappings;
+        bool cut = false;
+        for (size_t j = 0; j < k; ++j) {
+            auto &s = batch[j];
+            for (size_t c = 0; c < counts[j]; ++c) {
+                auto &m = *pm++;
+                if (s.offset < m.offset) {
+                    Segment mm{s.offset, (uint32_t)(m.offset - s.offset)};
+                    // hole
+                    int ret = cb_zero(mm);
+                    if (ret < 0)
+                        return ret;
+                }
+                // zeroe block
+                int ret = (m.zeroed) ? cb_zero(m) : cb_data(m);
+                if (ret < 0)
+                    return ret;
+                s.forward_offset_to(m.end());
+            }
+            if (j == k - 1 && total == NMAPPING) {
+                // the mappings may have been cut short, to be continued
+                head = s;
+                i += j;
+                cut = true;
+                break;
+            }
+            if (s.length > 0) {
+                int ret = cb_zero(s);
+                if (ret < 0)
+                    return ret;
+            }
+        }
+        if (!cut) {
+            i += k;
+            if (i < nsegs)
+                head = segs[i];
+        }
+    }
+    return 0;
+}
 } // namespace LSMT
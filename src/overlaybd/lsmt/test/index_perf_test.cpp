@@ -0,0 +1,223 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// Micro-benchmarks of the LSMT index, reporting ns/op and, where perf events
+// are permitted, last level cache misses per op. Indexes are built from:
+//   - seq: sequential 128K writes
+//   - rand: random 4K overwrites
+//   - merged: --layers rand layers merged into one
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <photon/common/alog.h>
+#include "../index.h"
+
+DEFINE_bool(ut_pass, false, "pass unit test directly. This suite is only for manual test");
+DEFINE_uint64(writes, 1000000, "# of writes building each index");
+DEFINE_uint64(vsize_gb, 64, "virtual size of the indexed space in GB");
+DEFINE_uint32(layers, 50, "# of layers merged");
+DEFINE_uint64(lookups, 2000000, "# of lookups of each benchmark");
+DEFINE_uint32(seed, 1, "seed of the writes and lookups");
+
+using namespace LSMT;
+
+static const uint64_t SECTOR = 512;
+
+// counts last level cache misses of this thread, if allowed by perf_event_paranoid
+class CacheMisses {
+public:
+    CacheMisses() {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        m_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    ~CacheMisses() {
+        if (m_fd >= 0)
+            close(m_fd);
+    }
+    bool available() const {
+        return m_fd >= 0;
+    }
+    void start() {
+        if (m_fd < 0)
+            return;
+        ioctl(m_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(m_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    uint64_t stop() {
+        uint64_t n = 0;
+        if (m_fd < 0)
+            return 0;
+        ioctl(m_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(m_fd, &n, sizeof(n)) != sizeof(n))
+            n = 0;
+        return n;
+    }
+
+private:
+    int m_fd;
+};
+
+static CacheMisses *misses;
+
+template <typename F>
+static void bench(const char *name, uint64_t ops, F &&f) {
+    misses->start();
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    auto n = misses->stop();
+    if (misses->available())
+        printf("%-36s %10.1f ns/op %8.2f cache-misses/op\n", name, elapsed.count() / ops,
+               (double)n / ops);
+    else
+        printf("%-36s %10.1f ns/op\n", name, elapsed.count() / ops);
+}
+
+static uint64_t vsectors() {
+    return (FLAGS_vsize_gb << 30) / SECTOR;
+}
+
+static IMemoryIndex0 *build_seq() {
+    auto index = create_memory_index0();
+    uint64_t length = 128 * 1024 / SECTOR, moffset = 0;
+    for (uint64_t i = 0; i < FLAGS_writes; i++) {
+        index->insert(SegmentMapping((i * length) % vsectors(), length, moffset));
+        moffset += length;
+    }
+    return index;
+}
+
+static IMemoryIndex0 *build_rand(std::mt19937_64 &rng) {
+    auto index = create_memory_index0();
+    uint64_t length = 4096 / SECTOR, moffset = 0;
+    for (uint64_t i = 0; i < FLAGS_writes; i++) {
+        index->insert(SegmentMapping(rng() % (vsectors() / length) * length, length, moffset));
+        moffset += length;
+    }
+    return index;
+}
+
+// in the layout set by set_index_layout()
+static IMemoryIndex *read_only(const IMemoryIndex0 *index0) {
+    return create_memory_index(index0->dump(), index0->size(), 0, UINT64_MAX, true);
+}
+
+static void bench_lookups(const char *name, const IMemoryIndex *index, uint64_t length) {
+    std::mt19937_64 rng(FLAGS_seed);
+    std::vector<Segment> segs(FLAGS_lookups);
+    for (auto &s : segs)
+        s = Segment{rng() % (vsectors() - length), (uint32_t)length};
+    size_t found = 0;
+    bench(name, segs.size(), [&]() {
+        SegmentMapping pm[64];
+        for (auto &s : segs)
+            found += index->lookup(s, pm, 64);
+    });
+    // keeps the lookups from being optimized out
+    if (found == (size_t)-1)
+        printf("unreachable\n");
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    log_output_level = ALOG_INFO;
+    if (FLAGS_ut_pass) {
+        LOG_INFO("pass unit test");
+        return 0;
+    }
+    // dump() logs in info level
+    log_output_level = ALOG_WARN;
+    CacheMisses cm;
+    misses = &cm;
+    if (!cm.available())
+        printf("cache misses are not counted, see /proc/sys/kernel/perf_event_paranoid\n");
+
+    std::mt19937_64 rng(FLAGS_seed);
+    std::unique_ptr<IMemoryIndex0> seq0, rand0;
+    bench("index0 insert seq 128K", FLAGS_writes, [&]() { seq0.reset(build_seq()); });
+    bench("index0 insert rand 4K", FLAGS_writes, [&]() { rand0.reset(build_rand(rng)); });
+    printf("mappings: seq %zu, rand %zu\n", seq0->size(), rand0->size());
+
+    for (auto p : {std::make_pair("seq", seq0.get()), std::make_pair("rand", rand0.get())}) {
+        std::unique_ptr<SegmentMapping[]> raw(p.second->dump());
+        auto n = p.second->size();
+        size_t compressed = 0;
+        auto name = std::string("compress_raw_index ") + p.first;
+        bench(name.c_str(), n, [&]() { compressed = compress_raw_index(raw.get(), n); });
+        printf("  %zu -> %zu mappings\n", n, compressed);
+    }
+
+    std::vector<std::unique_ptr<IMemoryIndex>> layers;
+    for (uint32_t i = 0; i < FLAGS_layers; i++) {
+        std::unique_ptr<IMemoryIndex0> index0(build_rand(rng));
+        layers.emplace_back(read_only(index0.get()));
+    }
+    std::vector<const IMemoryIndex *> pindexes;
+    uint64_t total = 0;
+    for (auto &l : layers) {
+        pindexes.push_back(l.get());
+        total += l->size();
+    }
+
+    for (auto layout : {IndexLayout::Flat, IndexLayout::Eytzinger}) {
+        set_index_layout(layout);
+        auto lname = layout == IndexLayout::Flat ? "flat" : "eytzinger";
+        std::unique_ptr<IMemoryIndex> seq(read_only(seq0.get()));
+        std::unique_ptr<IMemoryIndex> rand(read_only(rand0.get()));
+        std::unique_ptr<IMemoryIndex> merged;
+        auto name = std::string("merge ") + std::to_string(FLAGS_layers) + " layers " + lname;
+        bench(name.c_str(), total, [&]() {
+            merged.reset(merge_memory_indexes(pindexes.data(), pindexes.size()));
+        });
+        printf("  %lu -> %zu mappings\n", total, merged->size());
+
+        for (auto p : {std::make_pair("seq", seq.get()), std::make_pair("rand", rand.get()),
+                       std::make_pair("merged", merged.get())}) {
+            for (uint64_t length : {4096 / SECTOR, 128 * 1024 / SECTOR}) {
+                auto name = std::string("lookup ") + p.first + " " + lname + " " +
+                            std::to_string(length * SECTOR / 1024) + "K";
+                bench_lookups(name.c_str(), p.second, length);
+            }
+        }
+
+        // the RW layer of a running container: recent writes over the merged lowers
+        std::unique_ptr<IMemoryIndex0> index0(build_rand(rng));
+        std::unique_ptr<IComboIndex> combo(
+            create_combo_index(index0.get(), merged.get(), FLAGS_layers, false));
+        for (uint64_t length : {4096 / SECTOR, 128 * 1024 / SECTOR}) {
+            auto name = std::string("lookup combo ") + lname + " " +
+                        std::to_string(length * SECTOR / 1024) + "K";
+            bench_lookups(name.c_str(), combo.get(), length);
+        }
+    }
+    return 0;
+}
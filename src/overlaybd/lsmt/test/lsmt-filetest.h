@@ -454,7 +454,7 @@ public:
     }
 
     IFile *create_commit_layer(int i = 0, int io_engine = 0, bool compress = false,
-                               bool verify = false, bool sparse = false) {
+                               bool verify = false, bool sparse = false, bool fenced = false) {
         auto file = create_a_layer(sparse);
         IFile *as = nullptr;
         IFile *dst = nullptr;
@@ -480,6 +480,7 @@ public:
         char msg[1024]{};
         args.user_tag = msg;
         args.tag_len = 1024;
+        args.fenced_index = fenced;
         if (file->commit(args) != 0) {
             memset(msg, 1, 256);
             args.tag_len = 256;
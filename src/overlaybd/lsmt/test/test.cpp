@@ -31,6 +31,7 @@ IMemoryIndex -> IMemoryIndex0 -> IComboIndex -> Index0 ( set<SegmentMap> ) -> Co
 #include <sys/types.h>
 #include <unistd.h>
 #include <string.h>
+#include <chrono>
 
 #define USE_PTH true // use pthread
 
@@ -78,6 +79,77 @@ TEST(Index, lookup) {
     lookup_test<LevelIndex>(mapping, {16, 10}, {{16, 4, 56}});
     lookup_test<LevelIndex>(mapping, LEN(mapping), {26, 10}, nullptr, 0);
     lookup_test<LevelIndex>(mapping, {6, 100}, {{6, 4, 6}, {10, 10, 50}, {100, 6, 20}});
+
+    lookup_test<EytzingerIndex>(mapping, {5, 10}, {{5, 5, 5}, {10, 5, 50}});
+    lookup_test<EytzingerIndex>(mapping, {16, 10}, {{16, 4, 56}});
+    lookup_test<EytzingerIndex>(mapping, LEN(mapping), {26, 10}, nullptr, 0);
+    lookup_test<EytzingerIndex>(mapping, {6, 100}, {{6, 4, 6}, {10, 10, 50}, {100, 6, 20}});
+    lookup_test<EytzingerIndex>(mapping, LEN(mapping), {200, 10}, nullptr, 0);
+}
+
+TEST(Index, lookup_batch) {
+    const static SegmentMapping mapping[] = {{0, 10, 0}, {10, 10, 50}, {100, 10, 20}};
+    const static Segment segs[] = {{5, 10}, {16, 10}, {26, 10}, {40, 0}, {90, 100}};
+    const static SegmentMapping stdrst[] = {{5, 5, 5}, {10, 5, 50}, {16, 4, 56}, {100, 10, 20}};
+    const size_t stdcnt[] = {2, 1, 0, 0, 1};
+    Index idx(mapping, LEN(mapping), false);
+    unique_ptr<IMemoryIndex0> idx0(create_memory_index0(mapping, LEN(mapping), 0, UINT64_MAX));
+    for (IMemoryIndex *pi : {(IMemoryIndex *)&idx, (IMemoryIndex *)idx0.get()}) {
+        SegmentMapping pm[16];
+        size_t counts[LEN(segs)];
+        ASSERT_EQ(pi->lookup_batch(segs, LEN(segs), pm, LEN(pm), counts), LEN(segs));
+        EXPECT_EQ(memcmp(counts, stdcnt, sizeof(counts)), 0);
+        EXPECT_EQ(memcmp(pm, stdrst, sizeof(stdrst)), 0);
+        // cut short by the capacity
+        EXPECT_EQ(pi->lookup_batch(segs, LEN(segs), pm, 2, counts), 1UL);
+        EXPECT_EQ(pi->lookup_batch(segs, LEN(segs), pm, 3, counts), 2UL);
+        EXPECT_EQ(counts[1], 1UL);
+    }
+
+    // foreach_segments() in batches visits the same as segment by segment
+    vector<Segment> reqs;
+    for (uint64_t off = 0; off < 200; off += 7)
+        reqs.push_back({off, 5});
+    vector<SegmentMapping> r0, r1;
+    auto cb_zero = [](vector<SegmentMapping> &r, const Segment &m) {
+        r.push_back({m.offset, m.length, 0});
+        r.back().discard();
+        return 0;
+    };
+    for (auto &s : reqs)
+        foreach_segments(
+            &idx, s, [&](const Segment &m) { return cb_zero(r0, m); },
+            [&](const SegmentMapping &m) {
+                r0.push_back(m);
+                return 0;
+            });
+    foreach_segments(
+        &idx, reqs.data(), reqs.size(), [&](const Segment &m) { return cb_zero(r1, m); },
+        [&](const SegmentMapping &m) {
+            r1.push_back(m);
+            return 0;
+        });
+    ASSERT_EQ(r0.size(), r1.size());
+    EXPECT_EQ(memcmp(r0.data(), r1.data(), r0.size() * sizeof(SegmentMapping)), 0);
+}
+
+TEST(Index, cpu_account) {
+    const static SegmentMapping mapping[] = {{0, 10, 0}, {10, 10, 50}, {100, 10, 20}};
+    Index idx(mapping, LEN(mapping), false);
+    auto &slot = CpuAccount::slot();
+    auto calls = slot.calls[CpuAccount::LOOKUP].load();
+    auto lookup = [&]() {
+        foreach_segments(
+            &idx, Segment{0, 200}, [](const Segment &) { return 0; },
+            [](const SegmentMapping &) { return 0; });
+    };
+    // nothing is counted until enabled
+    lookup();
+    EXPECT_EQ(calls, slot.calls[CpuAccount::LOOKUP].load());
+    CpuAccount::enable(true);
+    DEFER(CpuAccount::enable(false));
+    lookup();
+    EXPECT_EQ(calls + 1, slot.calls[CpuAccount::LOOKUP].load());
 }
 
 const static SegmentMapping mapping0[] = {{0, 20, 0},    {10, 15, 50},    {30, 100, 20}, {5, 10, 3},
@@ -210,6 +282,48 @@ TEST(Perf, Index0_randwrite1M) {
     ASSERT_EQ(index_size, idx0->block_count());
 }
 
+TEST(Perf, Index0_pooled_randwrite1M) {
+    vector<SegmentMapping> writes(1000 * 1000);
+    for (size_t i = 0; i < writes.size(); ++i)
+        writes[i] = {RAND_RANGE, (uint64_t)i};
+    unique_ptr<IMemoryIndex0> plain(create_memory_index0());
+    unique_ptr<IMemoryIndex0> pooled(create_pooled_memory_index0(nullptr, 0, 0, 0));
+    for (auto idx : {plain.get(), pooled.get()}) {
+        auto start = chrono::steady_clock::now();
+        for (auto &m : writes)
+            idx->insert(m);
+        auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+        cout << (idx == plain.get() ? "plain" : "pooled") << " index0: " << idx->size()
+             << " elements, " << us.count() << "us" << endl;
+    }
+    ASSERT_EQ(plain->size(), pooled->size());
+    ASSERT_EQ(plain->block_count(), pooled->block_count());
+    unique_ptr<SegmentMapping[]> p0(plain->dump()), p1(pooled->dump());
+    EXPECT_EQ(memcmp(p0.get(), p1.get(), plain->size() * sizeof(SegmentMapping)), 0);
+}
+
+TEST(Index0, pooled_combo) {
+    unique_ptr<IMemoryIndex0> plain(create_memory_index0());
+    auto pooled = create_pooled_memory_index0(nullptr, 0, 0, 0);
+    pooled->insert(SegmentMapping(10, 10, 100));
+    EXPECT_FALSE(((Index0 *)plain.get())->pooled());
+    EXPECT_TRUE(((Index0 *)pooled)->pooled());
+    const static SegmentMapping mapping[] = {{0, 30, 1000}};
+    auto ro = create_memory_index(mapping, LEN(mapping), 0, UINT64_MAX, false);
+    unique_ptr<IComboIndex> ci(create_combo_index(pooled, ro, 1, true));
+    // the combo takes over the mappings of the pooled index0 in a pool of its own
+    EXPECT_TRUE(((ComboIndex *)ci.get())->pooled());
+    EXPECT_NE(((ComboIndex *)ci.get())->mapping.get_allocator(),
+              ((Index0 *)pooled)->mapping.get_allocator());
+    ci->insert(SegmentMapping(15, 10, 200, 1));
+    SegmentMapping pm[4];
+    ASSERT_EQ(ci->lookup(Segment{0, 30}, pm, LEN(pm)), 4UL);
+    EXPECT_EQ(pm[0], SegmentMapping(0, 10, 1000));
+    EXPECT_EQ(pm[1], SegmentMapping(10, 5, 100, 1));
+    EXPECT_EQ(pm[2], SegmentMapping(15, 10, 200, 1));
+    EXPECT_EQ(pm[3], SegmentMapping(25, 5, 1025));
+}
+
 void test_randread1M(IMemoryIndex *idx) {
     // SegmentMapping pm[10];
     for (int i = 0; i < 1000 * 1000; ++i) {
@@ -233,6 +347,45 @@ TEST(Perf, Index1_randread1M) {
     delete[] p;
 }
 
+TEST(Perf, IndexLayout_randread1M) {
+    // build a large merged index from several layers of random writes
+    const int NLAYERS = 8;
+    vector<unique_ptr<IMemoryIndex>> layers;
+    for (int k = 0; k < NLAYERS; ++k) {
+        unique_ptr<IMemoryIndex0> i0(create_memory_index0());
+        for (int i = 0; i < 200000; ++i)
+            i0->insert({RAND_RANGE, (uint64_t)i});
+        layers.emplace_back(i0->make_read_only_index());
+    }
+    auto pi = (const IMemoryIndex **)&layers[0];
+    unique_ptr<IMemoryIndex> flat(merge_memory_indexes(pi, NLAYERS));
+    set_index_layout(IndexLayout::Eytzinger);
+    unique_ptr<IMemoryIndex> eytz(merge_memory_indexes(pi, NLAYERS));
+    set_index_layout(IndexLayout::Flat);
+    ASSERT_EQ(flat->size(), eytz->size());
+    cout << flat->size() << " mappings in the merged index" << endl;
+
+    vector<Segment> reqs(1000 * 1000);
+    for (auto &s : reqs)
+        s = Segment{RAND_RANGE};
+    SegmentMapping pm0[16], pm1[16];
+    for (size_t i = 0; i < 10000; ++i) {
+        auto n0 = flat->lookup(reqs[i], pm0, LEN(pm0));
+        auto n1 = eytz->lookup(reqs[i], pm1, LEN(pm1));
+        ASSERT_EQ(n0, n1);
+        EXPECT_EQ(memcmp(pm0, pm1, n0 * sizeof(pm0[0])), 0);
+    }
+    for (auto idx : {flat.get(), eytz.get()}) {
+        size_t total = 0;
+        auto start = chrono::steady_clock::now();
+        for (auto &s : reqs)
+            total += idx->lookup(s, pm0, LEN(pm0));
+        auto us = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start);
+        cout << (idx == flat.get() ? "flat" : "eytzinger") << " layout: " << reqs.size()
+             << " lookups in " << us.count() << "us, " << total << " mappings found" << endl;
+    }
+}
+
 void test_combo(const IMemoryIndex *indexes[], size_t ni, const SegmentMapping stdrst[],
                 size_t nrst) {
     auto i0 = create_memory_index0(indexes[0]->buffer(), indexes[0]->size(), 0, 1000000);
@@ -353,6 +506,118 @@ TEST(Index, compress) {
     test_compress({{5, 5, 0}, {10, 10, 5, 3}, {20, 10, 15, 3}, {30, 10, 20}},
                   {{5, 5, 0}, {10, 20, 5, 3}, {30, 10, 20}});
 }
+
+// (moffset, tag) of each sector of `s` by the mappings looked up from `index`,
+// where moffset is -1 for holes, and -2 for zeroed mappings
+static vector<pair<int64_t, int>> lookup_sectors(const IMemoryIndex *index, Segment s) {
+    vector<pair<int64_t, int>> r(s.length, {-1, 0});
+    SegmentMapping pm[64];
+    auto n = index->lookup(s, pm, LEN(pm));
+    for (auto &m : ptr_array(pm, n)) {
+        EXPECT_LE(m.length, (uint32_t)Segment::MAX_LENGTH);
+        for (auto i = m.offset; i < m.end(); ++i)
+            r[i - s.offset] = {m.zeroed ? -2 : (int64_t)(m.moffset + i - m.offset), m.tag};
+    }
+    return r;
+}
+
+static void expect_same_lookups(const IMemoryIndex *a, const IMemoryIndex *b, uint64_t end) {
+    for (uint32_t length : {1U, 100U, Segment::MAX_LENGTH})
+        for (uint64_t offset = 0; offset < end; offset += 97)
+            EXPECT_EQ(lookup_sectors(a, {offset, length}), lookup_sectors(b, {offset, length}));
+}
+
+TEST(Index, wide_index) {
+    // 3 contiguous mappings at MAX_LENGTH, followed by a zeroed one and a gap
+    const uint32_t L = Segment::MAX_LENGTH;
+    vector<SegmentMapping> ms{{0, L, 8}, {L, L, 8 + L}, {2 * L, 5, 8 + 2 * L},
+                              {2 * L + 5, 10, 0}, {3 * L, 7, 100000}};
+    ms[3].zeroed = 1;
+    vector<WideSegmentMapping> wide(ms.size());
+    auto nwide = compress_raw_index_wide(ms.data(), ms.size(), wide.data());
+    ASSERT_EQ(nwide, 3UL);
+    EXPECT_EQ(wide[0].length, 2 * L + 5);
+    auto n = expand_wide_index(wide.data(), nwide, nullptr);
+    ASSERT_EQ(n, ms.size());
+    vector<SegmentMapping> ms2(n);
+    expand_wide_index(wide.data(), nwide, ms2.data());
+    EXPECT_EQ(memcmp(ms.data(), ms2.data(), n * sizeof(SegmentMapping)), 0);
+
+    // kept wide in memory, while behaving as the index of the mappings
+    unique_ptr<IMemoryIndex> wi(create_wide_memory_index(wide.data(), nwide, 0, UINT64_MAX));
+    ASSERT_NE(wi, nullptr);
+    EXPECT_EQ(as_wide(wi.get())->m_wide.size(), 3UL);
+    Index idx(ms.data(), ms.size(), false);
+    EXPECT_EQ(wi->size(), ms.size());
+    EXPECT_EQ(wi->block_count(), 2UL * L + 5 + 7);
+    EXPECT_EQ(wi->front(), ms.front());
+    EXPECT_EQ(wi->back(), ms.back());
+    expect_same_lookups(wi.get(), &idx, 3 * L + 20);
+    SegmentMapping pm[2];
+    EXPECT_EQ(wi->lookup(Segment{L - 10, 30}, pm, 1), 1UL);
+    EXPECT_EQ(pm[0], SegmentMapping(L - 10, 30, 8 + L - 10));
+    EXPECT_EQ(memcmp(wi->buffer(), ms.data(), n * sizeof(SegmentMapping)), 0);
+    unique_ptr<IMemoryIndex> shared(create_shared_index(shared_ptr<IMemoryIndex>(wi.release())));
+    ASSERT_NE(as_wide(shared.get()), nullptr);
+    expect_same_lookups(shared.get(), &idx, 3 * L + 20);
+    EXPECT_EQ(shared->increase_tag(1), -1);
+
+    // disordered, or mapped out of range
+    swap(wide[0], wide[1]);
+    EXPECT_EQ(create_wide_memory_index(wide.data(), nwide, 0, UINT64_MAX), nullptr);
+    swap(wide[0], wide[1]);
+    EXPECT_EQ(create_wide_memory_index(wide.data(), nwide, 0, 100000), nullptr);
+}
+
+TEST(Index, merge_wide) {
+    const uint32_t L = Segment::MAX_LENGTH;
+    const static SegmentMapping mapping0[] = {{5, 5, 0}, {10, 10, 50}, {100, L, 20},
+                                              {100 + L, L, 20 + L}, {100 + 2 * L, 10, 20 + 2 * L}};
+    const static SegmentMapping mapping1[] = {{0, 1, 7},    {2, 4, 5},    {15, 10, 22},
+                                              {30, 15, 89}, {87, 50, 32}, {150, 10, 84}};
+    const static SegmentMapping mapping2[] = {
+        {1, 3, 134}, {8, 4, 873}, {18, 72, 320}, {100, 100, 4893}, {1000, 1000, 39823}};
+    const static SegmentMapping mapping3[] = {{23, 10, 0},   {65, 10, 50},    {89, 10, 20},
+                                              {230, L, 432}, {230 + L, L, 432 + L}};
+
+    Index idx0(mapping0, LEN(mapping0), false);
+    Index idx1(mapping1, LEN(mapping1), false);
+    Index idx2(mapping2, LEN(mapping2), false);
+    Index idx3(mapping3, LEN(mapping3), false);
+    WideSegmentMapping w0[LEN(mapping0)], w3[LEN(mapping3)];
+    auto n0 = compress_raw_index_wide(mapping0, LEN(mapping0), w0);
+    auto n3 = compress_raw_index_wide(mapping3, LEN(mapping3), w3);
+    unique_ptr<IMemoryIndex> wide0(create_wide_memory_index(w0, n0, 0, UINT64_MAX));
+    unique_ptr<IMemoryIndex> wide3(create_wide_memory_index(w3, n3, 0, UINT64_MAX));
+    const uint64_t end = 300 + 2 * L;
+
+    const IMemoryIndex *narrow[] = {&idx0, &idx1, &idx2, &idx3};
+    const IMemoryIndex *mixed[] = {wide0.get(), &idx1, &idx2, wide3.get()};
+    unique_ptr<IMemoryIndex> mn(merge_memory_indexes(narrow, 4));
+    unique_ptr<IMemoryIndex> mw(merge_memory_indexes(mixed, 4));
+    ASSERT_NE(as_wide(mw.get()), nullptr);
+    EXPECT_LT(as_wide(mw.get())->m_wide.size(), mn->size());
+    EXPECT_EQ(mw->block_count(), mn->block_count());
+    expect_same_lookups(mw.get(), mn.get(), end);
+
+    // over a wide lower index, and a narrow one
+    unique_ptr<IMemoryIndex> upper(merge_memory_indexes(narrow + 1, 2));
+    unique_ptr<IMemoryIndex> lower(merge_memory_indexes(narrow + 3, 1));
+    unique_ptr<IMemoryIndex> on(merge_memory_indexes_over(upper.get(), lower.get(), 2));
+    unique_ptr<IMemoryIndex> ow(merge_memory_indexes_over(upper.get(), wide3.get(), 2));
+    ASSERT_NE(as_wide(ow.get()), nullptr);
+    expect_same_lookups(ow.get(), on.get(), end);
+
+    // as the backing index of a combo
+    auto ci = create_combo_index(create_memory_index0(), mw.release(), 4, true);
+    unique_ptr<IMemoryIndex> _ci(ci);
+    ci->insert(SegmentMapping(120, 10, 7777, 4));
+    SegmentMapping pm[4];
+    ASSERT_EQ(ci->lookup(Segment{110, 30}, pm, LEN(pm)), 3UL);
+    EXPECT_EQ(pm[0], SegmentMapping(110, 10, 30));
+    EXPECT_EQ(pm[1], SegmentMapping(120, 10, 7777, 4));
+    EXPECT_EQ(pm[2], SegmentMapping(130, 10, 50));
+}
 // #endif
 
 struct ThreadArgs {
@@ -604,6 +869,347 @@ TEST_F(FileTest3, stack_files) {
     delete file;
 }
 
+TEST_F(FileTest3, fenced_index) {
+    CleanUp();
+    ALIGNED_MEM(buf, HeaderTrailer::SPACE, ALIGNMENT4K);
+    {   // fencing is opt-in
+        unique_ptr<IFile> plain(create_commit_layer());
+        auto pht = verify_ht(plain.get(), buf, true);
+        ASSERT_NE(pht, nullptr);
+        EXPECT_FALSE(pht->has_fenced_index());
+    }
+    auto file = create_commit_layer(0, 0, false, false, false, true);
+    DEFER(delete file);
+    auto pht = verify_ht(file, buf, true);
+    ASSERT_NE(pht, nullptr);
+    EXPECT_TRUE(pht->has_fenced_index());
+    EXPECT_EQ(pht->index_offset % ALIGNMENT4K, 0UL);
+    HeaderTrailer ht;
+    unique_ptr<SegmentMapping[]> p(do_load_index(file, &ht, true));
+    ASSERT_NE(p, nullptr);
+    EXPECT_EQ(ht.index_size, pht->index_count);
+    EXPECT_TRUE(pht->check_fences(p.get(), ht.index_size));
+    for (size_t i = 1; i < ht.index_size; ++i) {
+        EXPECT_LE(p[i - 1].end(), p[i].offset);
+        EXPECT_EQ(p[i].tag, 0);
+    }
+    if (pht->nfences > 1) {
+        pht->fences[1]++;
+        EXPECT_FALSE(pht->check_fences(p.get(), ht.index_size));
+        pht->fences[1]--;
+    }
+    p[0].tag++;
+    EXPECT_FALSE(pht->check_fences(p.get(), ht.index_size));
+    p[0].tag--;
+    unique_ptr<IFileRO> ro(::open_file_ro(file));
+    verify_file(ro.get());
+}
+
+TEST_F(FileTest3, commit_wide_index) {
+    CleanUp();
+    unique_ptr<IFileRW> file(create_file_rw());
+    // sequentially written, mergeable beyond Segment::MAX_LENGTH
+    ALIGNED_MEM4K(buf, 1 << 20);
+    for (off_t offset = 0; offset < (off_t)vsize; offset += (1 << 20)) {
+        for (int i = 0; i < (1 << 20); ++i)
+            buf[i] = rand() % 256;
+        fcheck->pwrite(buf, 1 << 20, offset);
+        ASSERT_EQ(file->pwrite(buf, 1 << 20, offset), 1 << 20);
+    }
+    auto fcommit = lfs->open(layer_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    CommitArgs args(fcommit);
+    args.wide_index = true;
+    ASSERT_EQ(file->commit(args), 0);
+    file.reset();
+    fcommit->close();
+    delete fcommit;
+    {
+        unique_ptr<IFileRO> ro(open_file_ro(layer_name.back().c_str()));
+        ASSERT_NE(ro, nullptr);
+        auto wide = as_wide(ro->index());
+        ASSERT_NE(wide, nullptr);
+        EXPECT_EQ(wide->m_wide.size(), 1UL);
+        EXPECT_EQ(ro->index()->size(), (vsize / ALIGNMENT + Segment::MAX_LENGTH - 1) /
+                                           Segment::MAX_LENGTH);
+        verify_file(ro.get());
+    }
+
+    // stacked under a layer of random writes, which is merged into a wide index
+    files[0] = lfs->open(layer_name.back().c_str(), O_RDONLY);
+    files[1] = create_commit_layer();
+    unique_ptr<IFileRO> lower(open_files_ro(files, 2, true));
+    ASSERT_NE(as_wide(lower->index()), nullptr);
+    verify_file(lower.get());
+    auto upper = create_file_rw();
+    unique_ptr<IFileRW> stacked(stack_files(upper, lower.release(), true, false));
+    randwrite(stacked.get(), FLAGS_nwrites);
+    verify_file(stacked.get());
+}
+
+TEST_F(FileTest3, parallel_read) {
+    CleanUp();
+    for (int i = 0; i < FLAGS_layers; ++i) {
+        files[i] = create_commit_layer(0, ut_io_engine);
+    }
+    unique_ptr<IFileRO> lower(open_files_ro(files, FLAGS_layers));
+    EXPECT_EQ(lower->set_max_io_concurrency(0), -1);
+    EXPECT_EQ(lower->get_max_io_concurrency(), 1UL);
+    ASSERT_EQ(lower->set_max_io_concurrency(4), 0);
+    verify_file(lower.get());
+    auto ro = (LSMTReadOnlyFile *)lower.get();
+    EXPECT_GT(ro->lsmt_parallel_cnt, 0U);
+    EXPECT_GE(ro->lsmt_io_cnt, ro->lsmt_req_cnt);
+}
+
+TEST_F(FileTest3, commit_zero_detect) {
+    CleanUp();
+    unique_ptr<IFileRW> file(create_file_rw());
+    ALIGNED_MEM4K(buf, 64 * 1024);
+    // data, zeros, data in a single mapping
+    memset(buf, 0xaa, 64 * 1024);
+    memset(buf + 16 * 1024, 0, 32 * 1024);
+    ASSERT_EQ(file->pwrite(buf, 64 * 1024, 0), 64 * 1024);
+    auto fcommit = lfs->open(layer_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    CommitArgs args(fcommit);
+    args.io_workers = 3;
+    args.io_buffer_size = 8 * 1024;
+    args.zero_detect = true;
+    ASSERT_EQ(file->commit(args), 0);
+    fcommit->close();
+    unique_ptr<IFileRO> ro(::open_file_ro(fcommit, true));
+    size_t nzeroed = 0;
+    for (auto &m : ptr_array(ro->index()->buffer(), ro->index()->size()))
+        nzeroed += m.zeroed;
+    EXPECT_EQ(nzeroed, 1UL);
+    ALIGNED_MEM4K(rbuf, 64 * 1024);
+    ASSERT_EQ(ro->pread(rbuf, 64 * 1024, 0), 64 * 1024);
+    EXPECT_EQ(memcmp(buf, rbuf, 64 * 1024), 0);
+}
+
+TEST_F(FileTest3, combined_writes) {
+    CleanUp();
+    unique_ptr<IFileRW> file(create_file_rw());
+    const int N = 100;
+    auto verify = [&](IFileRW *f) {
+        ALIGNED_MEM4K(buf, 4096);
+        for (int i = 0; i < N; i++) {
+            ASSERT_EQ(f->pread(buf, 4096, (N - i) * 8192), 4096);
+            EXPECT_EQ(buf[0], (char)i);
+            EXPECT_EQ(buf[4095], (char)i);
+        }
+    };
+    // concurrent writes, appended in batches
+    vector<photon::join_handle *> ths;
+    for (int i = 0; i < N; i++) {
+        ths.push_back(photon::thread_enable_join(photon::thread_create11([&, i]() {
+            ALIGNED_MEM4K(buf, 4096);
+            memset(buf, i, 4096);
+            EXPECT_EQ(file->pwrite(buf, 4096, (N - i) * 8192), 4096);
+        })));
+    }
+    for (auto th : ths)
+        photon::thread_join(th);
+    EXPECT_EQ(file->index()->size(), (size_t)N);
+    verify(file.get());
+    // and their mappings are all in the index file
+    file.reset();
+    file.reset(open_file_rw());
+    ASSERT_NE(file, nullptr);
+    EXPECT_EQ(file->index()->size(), (size_t)N);
+    verify(file.get());
+}
+
+TEST_F(FileTest3, commit_dedup) {
+    CleanUp();
+    ALIGNED_MEM4K(buf, 80 * 1024);
+    memset(buf, 0xaa, 64 * 1024);
+    unique_ptr<IFileRW> file(create_file_rw());
+    ASSERT_EQ(file->pwrite(buf, 64 * 1024, 0), 64 * 1024);
+    auto lower_name = layer_name.back();
+    auto fcommit = lfs->open(lower_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    CommitArgs args(fcommit);
+    ASSERT_EQ(file->commit(args), 0);
+    delete fcommit;
+    unique_ptr<IFileRO> lower(open_file_ro(lower_name.c_str()));
+    ASSERT_NE(lower, nullptr);
+
+    // equal, different, equal, zeros over data, and zeros over nothing
+    memset(buf + 16 * 1024, 0xbb, 16 * 1024);
+    memset(buf + 48 * 1024, 0, 32 * 1024);
+    file.reset(create_file_rw());
+    ASSERT_EQ(file->pwrite(buf, 80 * 1024, 0), 80 * 1024);
+    auto upper_name = layer_name.back();
+    fcommit = lfs->open(upper_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    CommitArgs args1(fcommit);
+    args1.io_buffer_size = 8 * 1024;
+    args1.dedup_base = lower.get();
+    ASSERT_EQ(file->commit(args1), 0);
+    delete fcommit;
+
+    unique_ptr<IFileRO> upper(open_file_ro(upper_name.c_str()));
+    ASSERT_NE(upper, nullptr);
+    auto index = upper->index();
+    ASSERT_EQ(index->size(), 2UL);
+    EXPECT_EQ(index->buffer()[0].offset, 16 * 1024 / ALIGNMENT);
+    EXPECT_FALSE(index->buffer()[0].zeroed);
+    EXPECT_EQ(index->buffer()[1].offset, 48 * 1024 / ALIGNMENT);
+    EXPECT_TRUE(index->buffer()[1].zeroed);
+    upper.reset();
+
+    IFile *files[] = {lfs->open(lower_name.c_str(), O_RDONLY),
+                      lfs->open(upper_name.c_str(), O_RDONLY)};
+    unique_ptr<IFileRO> stacked(::open_files_ro(files, 2, true));
+    ASSERT_NE(stacked, nullptr);
+    ALIGNED_MEM4K(rbuf, 80 * 1024);
+    ASSERT_EQ(stacked->pread(rbuf, 80 * 1024, 0), 80 * 1024);
+    EXPECT_EQ(memcmp(buf, rbuf, 80 * 1024), 0);
+}
+
+TEST_F(FileTest3, online_gc) {
+    CleanUp();
+    unique_ptr<IFileRW> file(create_file_rw());
+    randwrite(file.get(), FLAGS_nwrites);
+    randwrite(file.get(), FLAGS_nwrites);
+    auto before = file->data_stat();
+    auto fn_gc_data = "gc_data.lsmt", fn_gc_index = "gc_index.lsmt";
+    DEFER(lfs->unlink(fn_gc_data));
+    DEFER(lfs->unlink(fn_gc_index));
+    IFileRW::GCArgs args;
+    args.fdata = lfs->open(fn_gc_data, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    args.findex = lfs->open(fn_gc_index, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    args.garbage_ratio = 1.0;
+    EXPECT_EQ(file->gc(args), 1);
+    args.garbage_ratio = 0;
+    ASSERT_EQ(file->gc(args), 0);
+    auto after = file->data_stat();
+    EXPECT_LT(after.total_data_size, before.total_data_size);
+    EXPECT_EQ(after.valid_data_size, before.valid_data_size);
+    verify_file(file.get());
+
+    // keeps working on the new files, and reopens from them
+    randwrite(file.get(), FLAGS_nwrites);
+    verify_file(file.get());
+    file.reset();
+    auto fdata = lfs->open(fn_gc_data, O_RDWR | O_APPEND, S_IRWXU);
+    auto findex = lfs->open(fn_gc_index, O_RDWR | O_APPEND, S_IRWXU);
+    file.reset(LSMT::open_file_rw(fdata, findex, true));
+    ASSERT_NE(file, nullptr);
+    verify_file(file.get());
+}
+
+TEST_F(FileTest3, merged_index_cache) {
+    CleanUp();
+    const int N = 3;
+    for (int i = 0; i < N; ++i) {
+        files[i] = create_ro_layer();
+    }
+    set_merged_index_cache_capacity(0);
+    unique_ptr<IFileRO> plain(open_files_ro(files, N));
+    set_merged_index_cache_capacity(256UL << 20);
+    unique_ptr<IFileRO> base(open_files_ro(files, N - 1));
+    // merged over the cached index of the lower N - 1 layers
+    unique_ptr<IFileRO> full(open_files_ro(files, N));
+    // served by the cached index of all the N layers
+    unique_ptr<IFileRO> again(open_files_ro(files, N));
+    ASSERT_EQ(plain->index()->size(), full->index()->size());
+    ASSERT_EQ(plain->index()->size(), again->index()->size());
+    EXPECT_EQ(memcmp(plain->index()->buffer(), full->index()->buffer(),
+                     plain->index()->size() * sizeof(SegmentMapping)),
+              0);
+    EXPECT_EQ(full->index()->buffer(), again->index()->buffer());
+    verify_file(full.get());
+    verify_file(again.get());
+    for (int i = 0; i < N; ++i) {
+        UUID u0, u1;
+        plain->get_uuid(u0, i);
+        again->get_uuid(u1, i);
+        EXPECT_EQ(u0, u1);
+    }
+}
+
+TEST_F(FileTest3, saved_merged_index) {
+    CleanUp();
+    const int N = 3;
+    for (int i = 0; i < N; ++i) {
+        files[i] = create_ro_layer();
+    }
+    const char *fn_index = "saved_merged.index";
+    DEFER(lfs->unlink(fn_index));
+    unique_ptr<IFileRO> merged(open_files_ro(files, N));
+    unique_ptr<IFile> findex(lfs->open(fn_index, O_RDWR | O_CREAT | O_TRUNC, S_IRWXU));
+    ASSERT_EQ(save_merged_index(merged.get(), findex.get()), 0);
+    EXPECT_EQ(open_files_ro_with_index(files, N - 1, findex.get()), nullptr);
+    unique_ptr<IFileRO> loaded(open_files_ro_with_index(files, N, findex.get()));
+    ASSERT_NE(loaded, nullptr);
+    ASSERT_EQ(merged->index()->size(), loaded->index()->size());
+    EXPECT_EQ(memcmp(merged->index()->buffer(), loaded->index()->buffer(),
+                     merged->index()->size() * sizeof(SegmentMapping)),
+              0);
+    for (int i = 0; i < N; ++i) {
+        UUID u0, u1, u2;
+        merged->get_uuid(u0, i);
+        loaded->get_uuid(u1, i);
+        EXPECT_EQ(u0, u1);
+        // as read from the layer itself, bottom first
+        ASSERT_EQ(get_layer_uuid(files[N - 1 - i], u2), 0);
+        EXPECT_EQ(u0, u2);
+    }
+    verify_file(loaded.get());
+}
+
+TEST_F(FileTest3, layer_index_sharing) {
+    CleanUp();
+    auto layer = create_ro_layer();
+    delete layer;
+    auto fn = data_name.back().c_str();
+    auto st0 = get_index_sharing_stats();
+    unique_ptr<IFileRO> f1(open_file_ro(fn));
+    unique_ptr<IFileRO> f2(open_file_ro(fn));
+    ASSERT_EQ(f1->index()->size(), f2->index()->size());
+    EXPECT_EQ(f1->index()->buffer(), f2->index()->buffer());
+    auto st1 = get_index_sharing_stats();
+    auto bytes = f1->index()->size() * sizeof(SegmentMapping);
+    EXPECT_EQ(st1.layer_indexes, st0.layer_indexes + 1);
+    EXPECT_EQ(st1.saved_bytes, st0.saved_bytes + bytes);
+    verify_file(f2.get());
+    f1.reset();
+    verify_file(f2.get());
+    f2.reset();
+    EXPECT_EQ(get_index_sharing_stats().layer_indexes, st0.layer_indexes);
+
+    set_layer_index_sharing(false);
+    unique_ptr<IFileRO> f3(open_file_ro(fn));
+    unique_ptr<IFileRO> f4(open_file_ro(fn));
+    EXPECT_NE(f3->index()->buffer(), f4->index()->buffer());
+    set_layer_index_sharing(true);
+}
+
+TEST_F(FileTest3, chain_shares_layer_index) {
+    CleanUp();
+    const int N = 3;
+    for (int i = 0; i < N; ++i) {
+        files[i] = create_ro_layer();
+    }
+    set_layer_index_sharing(false);
+    set_merged_index_cache_capacity(0);
+    unique_ptr<IFileRO> plain(open_files_ro(files, N));
+    set_layer_index_sharing(true);
+    // the bottom layer is kept alive by a file opened on it alone
+    unique_ptr<IFileRO> bottom(open_file_ro(data_name[0].c_str()));
+    auto st0 = get_index_sharing_stats();
+    unique_ptr<IFileRO> chain(open_files_ro(files, N));
+    set_merged_index_cache_capacity(256UL << 20);
+    unique_ptr<IFileRO> cached(open_files_ro(files, N));
+    EXPECT_EQ(get_index_sharing_stats().layer_indexes, st0.layer_indexes);
+    for (auto f : {chain.get(), cached.get()}) {
+        ASSERT_EQ(plain->index()->size(), f->index()->size());
+        EXPECT_EQ(memcmp(plain->index()->buffer(), f->index()->buffer(),
+                         plain->index()->size() * sizeof(SegmentMapping)),
+                  0);
+        verify_file(f);
+    }
+}
+
 TEST_F(FileTest3, sparsefile_close_seal) {
     CleanUp();
     cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
@@ -621,6 +1227,23 @@ TEST_F(FileTest3, sparsefile_close_seal) {
     delete file;
 }
 
+TEST_F(FileTest3, sparsefile_commit_copy_range) {
+    CleanUp();
+    unique_ptr<IFileRW> file(create_a_layer(true));
+    auto path = "/tmp/" + layer_name.back();
+    auto fcommit = lfs->open(layer_name.back().c_str(), O_RDWR | O_CREAT | O_TRUNC, S_IRWXU);
+    CommitArgs args(fcommit);
+    args.data_fd = ::open(("/tmp/" + data_name.back()).c_str(), O_RDONLY);
+    args.as_fd = ::open(path.c_str(), O_WRONLY);
+    ASSERT_GE(args.data_fd, 0);
+    ASSERT_GE(args.as_fd, 0);
+    DEFER(::close(args.data_fd));
+    DEFER(::close(args.as_fd));
+    ASSERT_EQ(file->commit(args), 0);
+    delete fcommit;
+    verify_file(layer_name.back().c_str());
+}
+
 TEST_F(FileTest3, stack_sparsefiles) {
     CleanUp();
     cout << "generating " << FLAGS_layers << " RO layers by randwrite()" << endl;
@@ -926,6 +1549,40 @@ TEST_F(WarpFileTest, stack_files) {
     fcheck = nullptr;
 }
 
+TEST_F(WarpFileTest, coalesced_read) {
+    CleanUp();
+    log_output_level = FLAGS_log_level;
+    const size_t LEN = 26 << 20, META = 1 << 20;
+    vector<char> data(LEN), expected(LEN);
+    auto buf = data.data();
+    for (size_t i = 0; i < LEN; i++)
+        buf[i] = rand() & 0xff;
+    fcheck->pwrite(buf, LEN, 0);
+    auto file = create_warpfile_rw(ut_io_engine);
+    RemoteMapping lba;
+    lba.count = LEN;
+    lba.offset = 0;
+    lba.roffset = 0;
+    file->ioctl(IFileRW::RemoteData, lba);
+    memset(buf, 0x5a, 4096);
+    file->pwrite(buf, 4096, META);
+    fcheck->pwrite(buf, 4096, META);
+
+    auto ro = (LSMTWarpFileRO *)create_commit_warpfile(file);
+    EXPECT_NE(ro->m_fsmeta, nullptr);
+    fcheck->pread(expected.data(), LEN, 0);
+    EXPECT_EQ(ro->pread(buf, LEN, 0), (ssize_t)LEN);
+    EXPECT_EQ(memcmp(buf, expected.data(), LEN), 0);
+    EXPECT_EQ(ro->lsmt_fsmeta_hits, 1u);
+    // the remote data after the fs meta are in several mappings of adjacent
+    // moffsets, read at once
+    EXPECT_GE(ro->lsmt_coalesced, 3u);
+    EXPECT_EQ(ro->lsmt_io_cnt, 2u);
+    verify_file(ro);
+    delete ro;
+    fcheck = nullptr;
+}
+
 TEST_F(WarpFileTest, commit_without_uuid) {
     CleanUp();
     UUID uu;
@@ -956,6 +1613,77 @@ TEST_F(WarpFileTest, commit_with_uuid) {
     EXPECT_EQ(uu, uu_commit);
 }
 
+struct CountingTask {
+    int *n;
+    int operator()() {
+        (*n)++;
+        return 0;
+    }
+};
+
+TEST(FanOut, group) {
+    // at most `concurrency` sub-requests at a time, the waiting thread included
+    int running = 0, peak = 0, done = 0;
+    {
+        FanOut::Group<> group(3);
+        for (int i = 0; i < 10; i++) {
+            group.submit([&]() {
+                peak = std::max(peak, ++running);
+                photon::thread_usleep(1000);
+                running--;
+                done++;
+                return 0;
+            });
+        }
+        EXPECT_EQ(0, group.wait());
+        EXPECT_EQ(2UL, group.threads());
+    }
+    EXPECT_EQ(10, done);
+    EXPECT_EQ(3, peak);
+
+    // the ones queued are dropped once one fails, which sets errno
+    done = 0;
+    FanOut::Group<> group(2);
+    group.submit([&]() {
+        photon::thread_usleep(1000);
+        errno = ENOENT;
+        return -1;
+    });
+    for (int i = 0; i < 10; i++) {
+        group.submit([&]() {
+            photon::thread_usleep(10 * 1000);
+            done++;
+            return 0;
+        });
+    }
+    EXPECT_EQ(-1, group.wait());
+    EXPECT_EQ(ENOENT, errno);
+    // the one taken by the thread when it failed
+    EXPECT_EQ(1, done);
+    group.submit([&]() {
+        done++;
+        return 0;
+    });
+    EXPECT_EQ(-1, group.wait());
+    EXPECT_EQ(1, done);
+
+    // EIO if it fails without errno; tasks of their own type, run in place
+    FanOut::Group<> eio(1);
+    eio.submit([]() {
+        errno = 0;
+        return -1;
+    });
+    EXPECT_EQ(-1, eio.wait());
+    EXPECT_EQ(EIO, errno);
+    int n = 0;
+    FanOut::Group<CountingTask> counting(1);
+    for (int i = 0; i < 5; i++)
+        counting.submit({&n});
+    EXPECT_EQ(0, counting.wait());
+    EXPECT_EQ(5, n);
+    EXPECT_EQ(0UL, counting.threads());
+}
+
 int main(int argc, char **argv) {
 
     auto seed = 154574045;
@@ -0,0 +1,114 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <photon/common/string_view.h>
+
+// peers serve blocks at this uri, naming the blob digest in the header
+static const char kPeerUriPrefix[] = "/overlaybd/peer";
+static const char kPeerBlobHeader[] = "X-Overlaybd-Blob";
+// and the token shared by the peers, as "Authorization: Bearer <token>"
+static const char kPeerBearer[] = "Bearer ";
+
+// Consistent-hash ownership of blob blocks across a set of peers. Every
+// node builds the ring from the same peer list, so they all agree on the
+// owner of a block without talking to each other; a node joining or
+// leaving moves only the blocks of its own arcs.
+class PeerRing {
+public:
+    static const int kVirtualNodes = 64;
+
+    PeerRing() = default;
+    PeerRing(std::string_view self, const std::vector<std::string> &peers) : m_self(self) {
+        for (auto &p : peers) {
+            for (int i = 0; i < kVirtualNodes; i++) {
+                m_ring.emplace(hash(p, i), p);
+            }
+        }
+    }
+
+    bool empty() const {
+        return m_ring.empty();
+    }
+
+    const std::string &self() const {
+        return m_self;
+    }
+
+    // the peer owning block `index` of `blob`, where `blob` is the digest,
+    // so that every repository sharing a layer maps it to the same owner
+    const std::string &owner(std::string_view blob, uint64_t index) const {
+        auto it = m_ring.lower_bound(hash(blob, index));
+        if (it == m_ring.end())
+            it = m_ring.begin();
+        return it->second;
+    }
+
+    bool owned(std::string_view blob, uint64_t index) const {
+        return !empty() && owner(blob, index) == m_self;
+    }
+
+    // std::hash is not guaranteed to agree across builds, use FNV-1a
+    static uint64_t hash(std::string_view s, uint64_t seed) {
+        uint64_t h = 14695981039346656037ULL;
+        for (auto c : s) {
+            h = (h ^ (uint8_t)c) * 1099511628211ULL;
+        }
+        for (int i = 0; i < 8; i++) {
+            h = (h ^ ((seed >> (i * 8)) & 0xff)) * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static std::string_view blob_digest(std::string_view url) {
+        auto pos = url.rfind('/');
+        return pos == std::string_view::npos ? url : url.substr(pos + 1);
+    }
+
+    // "sha256:" followed by 64 lowercase hex digits
+    static bool valid_digest(std::string_view digest) {
+        static const char prefix[] = "sha256:";
+        const size_t plen = sizeof(prefix) - 1;
+        if (digest.size() != plen + 64 || digest.substr(0, plen) != prefix)
+            return false;
+        for (auto c : digest.substr(plen)) {
+            if (!(c >= '0' && c <= '9') && !(c >= 'a' && c <= 'f'))
+                return false;
+        }
+        return true;
+    }
+
+    // whether the Authorization header `auth` carries `token`, compared in a
+    // time that doesn't depend on where they differ; never for an empty one
+    static bool authorized(std::string_view auth, std::string_view token) {
+        const size_t plen = sizeof(kPeerBearer) - 1;
+        if (token.empty() || auth.size() != plen + token.size() ||
+            auth.substr(0, plen) != kPeerBearer)
+            return false;
+        unsigned char diff = 0;
+        for (size_t i = 0; i < token.size(); i++)
+            diff |= auth[plen + i] ^ token[i];
+        return diff == 0;
+    }
+
+private:
+    std::string m_self;
+    std::map<uint64_t, std::string> m_ring;
+};
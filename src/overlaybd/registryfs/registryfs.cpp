@@ -213,12 +213,19 @@ public:
             token = m_scope_token.acquire(scope, [&]() -> estring * {
                 estring *token = new estring();
                 auto ret = m_callback(url);
-                if (!authenticate(authurl.c_str(), ret.first, ret.second, token, tmo.timeout())) {
-                    code = 401;
-                    delete token;
-                    return nullptr;
+                if (authenticate(authurl.c_str(), ret.first, ret.second, token, tmo.timeout()))
+                    return token;
+                if (m_auth_failed) {
+                    // the credential may have been kept after it was changed
+                    m_auth_failed(url);
+                    ret = m_callback(url);
+                    if (authenticate(authurl.c_str(), ret.first, ret.second, token,
+                                     tmo.timeout()))
+                        return token;
                 }
-                return token;
+                code = 401;
+                delete token;
+                return nullptr;
             });
             if (token == nullptr)
                 LOG_ERROR_RETURN(0, nullptr, "Failed to get token");
@@ -259,10 +266,16 @@ public:
         return 0;
     }
 
+    virtual int setAuthFailedCallback(Delegate<void, const char *> callback) override {
+        m_auth_failed = callback;
+        return 0;
+    }
+
 protected:
     using CURLPool = IdentityPool<photon::net::cURL, 4>;
     CURLPool m_curl_pool;
     PasswordCB m_callback;
+    Delegate<void, const char *> m_auth_failed;
     estring m_accelerate;
     estring m_caFile;
     uint64_t m_timeout;
@@ -15,14 +15,70 @@
 */
 
 #pragma once
+#include <errno.h>
 #include <stdint.h>
 #include <string>
+#include <vector>
 #include <photon/common/callback.h>
 #include <photon/fs/filesystem.h>
 
 class RegistryFS : public photon::fs::IFileSystem {
 public:
     virtual int setAccelerateAddress(const char* addr = "") = 0;
+
+    // limits the concurrent blob requests to each host, so that they share
+    // a bounded set of keep-alive connections; 0 means no limit
+    virtual int setMaxConnsPerHost(uint32_t n) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // merges the reads of a blob that arrive within `window_us` and are at
+    // most `max_gap` bytes apart into one request; 0 window disables it
+    virtual int setReadCoalescing(uint64_t window_us, size_t max_gap) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // fetches ranges of at least 2 * `stripe_size` by parallel sub-range
+    // requests (0 disables it), and if `hedge`, duplicates a request that
+    // takes longer than the recent p95 latency
+    virtual int setRangeSplitting(size_t stripe_size, bool hedge) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // fetches blocks of `block_size` bytes from their owner among `peers`
+    // ("host:port", `self` included), authorized by `token`, falling back to
+    // the registry if the owner fails or hasn't cached them yet; only blobs
+    // that are zfiles with checksummed blocks are read from peers
+    virtual int setPeers(const char *self, const std::vector<std::string> &peers,
+                         size_t block_size, const char *token) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // opens `conns` keep-alive connections to the host serving the blob at
+    // `path` in the background, so that the first reads of it skip the
+    // handshakes; a host is warmed up at most once a minute
+    virtual int warmup(const char *path, uint32_t conns) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // `callback` is told the url whose credential the registry rejected,
+    // before the credential is asked for once more, so that a cached one is
+    // resolved again
+    virtual int setAuthFailedCallback(Delegate<void, const char *> callback) {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    // latency histograms, errors and breaker states of the hosts serving
+    // blobs, in the Prometheus text format
+    virtual std::string endpointMetrics() {
+        return "";
+    }
 };
 
 using PasswordCB = Delegate<std::pair<std::string, std::string>, const char *>;
@@ -40,6 +96,8 @@ photon::fs::IFileSystem *new_registryfs_v2(PasswordCB callback,
                                            const char *cert_file = nullptr,
                                            const char *key_file = nullptr);
 
+// `lfile` keeps a local copy of the uploaded blob; pass nullptr to
+// stream the upload from memory without one.
 photon::fs::IFile* new_registry_uploader(photon::fs::IFile *lfile,
                                          std::string &upload_url,
                                          std::string &username, std::string &password,
@@ -14,11 +14,20 @@
    limitations under the License.
 */
 #include "registryfs.h"
+#include "peer_ring.h"
+#include "../fan_out.h"
+#include "../zfile/zfile.h"
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <ctime>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <unordered_map>
@@ -53,6 +62,7 @@ static const estring kAuthHeaderKey = "Authorization";
 static const estring kBearerAuthPrefix = "Bearer ";
 static const uint64_t kMinimalTokenLife = 30L * 1000 * 1000; // token lives atleast 30s
 static const uint64_t kMinimalAUrlLife = 300L * 1000 * 1000; // actual_url lives atleast 300s
+static const uint64_t kUrlRefreshBackoff = 5L * 1000 * 1000;
 static const uint64_t kMinimalMetaLife = 300L * 1000 * 1000; // actual_url lives atleast 300s
 
 using HTTP_OP = photon::net::http::Client::OperationOnStack<64 * 1024 - 1>;
@@ -84,6 +94,130 @@ struct UrlInfo {
     estring info;
 };
 
+// seconds until a pre-signed url expires, by its `Expires` (OSS, S3 v2) or
+// `X-Amz-Date` and `X-Amz-Expires` (S3 v4) parameters; -1 if it's unknown
+static int64_t signed_url_ttl(estring_view url) {
+    auto param = [&](const char *key) -> std::string {
+        auto qs = url.find('?');
+        if (qs == estring_view::npos)
+            return "";
+        for (auto kv : estring_view(url.substr(qs + 1)).split('&')) {
+            auto pos = kv.find('=');
+            if (pos != estring_view::npos && kv.substr(0, pos) == key)
+                return std::string(kv.substr(pos + 1));
+        }
+        return "";
+    };
+    auto now = time(nullptr);
+    auto expires = param("Expires");
+    if (!expires.empty())
+        return atoll(expires.c_str()) - now;
+    auto date = param("X-Amz-Date"), ttl = param("X-Amz-Expires");
+    if (!date.empty() && !ttl.empty()) {
+        struct tm tm = {};
+        if (strptime(date.c_str(), "%Y%m%dT%H%M%SZ", &tm) == nullptr)
+            return -1;
+        return timegm(&tm) + atoll(ttl.c_str()) - now;
+    }
+    return -1;
+}
+
+// host of an url, e.g. "registry.example.com:443" of "https://registry.example.com:443/v2/..."
+static estring_view url_host(estring_view url) {
+    auto pos = url.find("://");
+    if (pos != estring_view::npos)
+        url = url.substr(pos + 3);
+    return url.substr(0, url.find_first_of("/?"));
+}
+
+// a request slot of a host, released when the response is consumed
+struct HostSlot {
+    photon::semaphore *sem = nullptr;
+    ~HostSlot() {
+        if (sem)
+            sem->signal(1);
+    }
+};
+
+// Latency and errors of a host serving blobs: the registry, a storage it
+// redirects to, the accelerator or a peer. Consecutive failures open its
+// breaker; after a cool-down, one request per cool-down probes it again,
+// and a success closes it.
+struct Endpoint {
+    static const uint32_t kBreakerFailures = 5;
+    static const uint64_t kBreakerCooldown = 10UL * 1000 * 1000;
+    // upper bounds of the latency histogram, in us
+    static constexpr uint64_t kBuckets[] = {1000,   5000,    10000,   50000,
+                                             100000, 500000, 1000000, 5000000};
+    static const int kNumBuckets = sizeof(kBuckets) / sizeof(kBuckets[0]);
+
+    std::mutex mtx;
+    uint64_t hist[kNumBuckets + 1] = {0};
+    uint64_t count = 0, sum = 0, errors = 0;
+    uint32_t failures = 0;
+    uint64_t open_until = 0;
+
+    bool allow() {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (failures < kBreakerFailures)
+            return true;
+        if (photon::now < open_until)
+            return false;
+        open_until = photon::now + kBreakerCooldown;
+        return true;
+    }
+
+    void record(estring_view host, bool ok, uint64_t latency) {
+        std::lock_guard<std::mutex> lock(mtx);
+        int i = 0;
+        while (i < kNumBuckets && latency > kBuckets[i])
+            i++;
+        hist[i]++;
+        count++;
+        sum += latency;
+        if (ok) {
+            if (failures >= kBreakerFailures)
+                LOG_INFO("endpoint ` recovered", host);
+            failures = 0;
+            return;
+        }
+        errors++;
+        if (++failures == kBreakerFailures) {
+            LOG_WARN("endpoint ` failed ` times in a row, open its breaker", host, failures);
+            open_until = photon::now + kBreakerCooldown;
+        }
+    }
+
+    void render(estring_view host, std::string &out) {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto label = estring().appends("endpoint=\"", host, "\"");
+        uint64_t n = 0;
+        for (int i = 0; i <= kNumBuckets; i++) {
+            n += hist[i];
+            auto le = i < kNumBuckets ? std::to_string(kBuckets[i]) : std::string("+Inf");
+            out.append(estring().appends("OverlayBD_Registry_Endpoint_Latency_bucket{", label,
+                                         ",le=\"", le, "\"} ", std::to_string(n), "\n"));
+        }
+        out.append(estring().appends("OverlayBD_Registry_Endpoint_Latency_sum{", label, "} ",
+                                     std::to_string(sum), "\n"));
+        out.append(estring().appends("OverlayBD_Registry_Endpoint_Latency_count{", label, "} ",
+                                     std::to_string(count), "\n"));
+    }
+
+    // # of errors, and whether the breaker is open
+    std::pair<uint64_t, bool> state() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return {errors, failures >= kBreakerFailures};
+    }
+};
+
+constexpr uint64_t Endpoint::kBuckets[];
+
+// throttling and server errors count against an endpoint, other statuses don't
+static bool endpoint_healthy(long code) {
+    return code > 0 && code < 500 && code != 429;
+}
+
 class RegistryFSImpl_v2 : public RegistryFS {
 public:
     UNIMPLEMENTED_POINTER(IFile *creat(const char *, mode_t) override);
@@ -119,37 +253,57 @@ public:
                       photon::net::TLSContext *ctx)
         : m_callback(callback), m_caFile(caFile), m_timeout(timeout), m_tls_ctx(ctx),
           m_meta_size(kMinimalMetaLife), m_scope_token(kMinimalTokenLife),
-          m_url_info(kMinimalAUrlLife) {
+          m_repo_challenge(kMinimalTokenLife) {
 
         m_client = nullptr;
         this->refresh_client();
     }
 
     ~RegistryFSImpl_v2() {
+        while (m_refreshing.load() > 0 || m_warming.load() > 0)
+            photon::thread_usleep(1000);
         if (m_client) delete m_client;
         if (m_tls_ctx) delete m_tls_ctx;
     }
 
-    long get_data(const estring &url, off_t offset, size_t count, uint64_t timeout, HTTP_OP &op) {
+    // `slot` must outlive the read of op.resp, it's where the connection is busy
+    long get_data(const estring &url, off_t offset, size_t count, uint64_t timeout, HTTP_OP &op,
+                  HostSlot *slot = nullptr) {
         Timeout tmo(timeout);
         long ret = 0;
-        UrlInfo *actual_info = m_url_info.acquire(url, [&]() -> UrlInfo * {
-            return get_actual_url(url, tmo.timeout(), ret);
-        });
-
+        auto actual_info = resolve_url(url, tmo.timeout(), ret);
         if (actual_info == nullptr)
             return ret;
 
+        if (actual_info->mode == UrlMode::Redirect &&
+            !endpoint(url_host(actual_info->info))->allow()) {
+            // the storage is failing, ask the registry where the blob is again
+            LOG_WARN("redirect target of ` is failing, resolve it again", url);
+            invalidate_url(url);
+            actual_info = resolve_url(url, tmo.timeout(), ret);
+            if (actual_info == nullptr)
+                return ret;
+        }
         estring *actual_url = (estring*)&url;
         if (actual_info->mode == UrlMode::Redirect)
             actual_url = &actual_info->info;
-        // use p2p proxy
+        // use p2p proxy, unless it's failing
         estring accelerate_url;
-        if (m_accelerate.size() > 0) {
+        if (m_accelerate.size() > 0 && endpoint(url_host(m_accelerate))->allow()) {
             accelerate_url = estring().appends(m_accelerate, "/", *actual_url);
             actual_url = &accelerate_url;
             LOG_DEBUG("p2p_url: `", *actual_url);
         }
+        auto host = url_host(*actual_url);
+        auto ep = endpoint(host);
+
+        if (slot && m_max_conns_per_host) {
+            slot->sem = host_slots(url_host(*actual_url));
+            if (slot->sem->wait(1, tmo.timeout()) < 0) {
+                slot->sem = nullptr;
+                LOG_ERROR_RETURN(ETIMEDOUT, -1, "timed out waiting for a connection ", VALUE(url));
+            }
+        }
 
         op.req.reset(Verb::GET, *actual_url);
         // set token if needed
@@ -160,17 +314,116 @@ public:
         op.set_enable_proxy(m_client->has_proxy());
         op.retry = 0;
         op.timeout = tmo.timeout();
+        auto begin = photon::now;
         m_client->call(&op);
         ret = op.status_code;
+        ep->record(host, endpoint_healthy(ret), photon::now - begin);
         if (ret == 200 || ret == 206) {
-            m_url_info.release(url);
             return ret;
         }
 
-        m_url_info.release(url, true);
+        invalidate_url(url);
         LOG_ERROR_RETURN(0, ret, "Failed to fetch data ", VALUE(url), VALUE(op.status_code), VALUE(ret));
     }
 
+    // Resolved urls of the blobs. A url still in use is resolved again in the
+    // background before it expires, so that steady-state reads go straight
+    // to the storage, without the auth and redirect round trips.
+    struct ResolvedUrl {
+        std::shared_ptr<UrlInfo> info;
+        uint64_t expire = 0, refresh_at = 0, last_used = 0;
+        bool refreshing = false;
+        photon::mutex resolve_lock; // one resolution at a time
+    };
+
+    struct AuthChallenge {
+        estring authurl, scope;
+    };
+
+    // ".../v2/<name>/blobs/<digest>" -> ".../v2/<name>"
+    static estring repository_of(const estring &url) {
+        auto pos = url.rfind("/blobs/");
+        return pos == estring::npos ? url : estring(url.substr(0, pos));
+    }
+
+    std::shared_ptr<UrlInfo> resolve_url(const estring &url, uint64_t timeout, long &code) {
+        ResolvedUrl *e;
+        {
+            std::lock_guard<std::mutex> lock(m_resolved_mtx);
+            auto &p = m_resolved[url];
+            if (!p)
+                p.reset(new ResolvedUrl);
+            e = p.get();
+            if (photon::now < e->expire) {
+                e->last_used = photon::now;
+                if (!e->refreshing && photon::now >= e->refresh_at) {
+                    e->refreshing = true;
+                    m_refreshing++;
+                    photon::thread_create11(&RegistryFSImpl_v2::refresh_url, this, url, e);
+                }
+                return e->info;
+            }
+        }
+        photon::scoped_lock l(e->resolve_lock);
+        {
+            // resolved by another reader meanwhile
+            std::lock_guard<std::mutex> lock(m_resolved_mtx);
+            if (photon::now < e->expire)
+                return e->info;
+        }
+        auto info = get_actual_url(url, timeout, code);
+        if (info == nullptr)
+            return nullptr;
+        std::lock_guard<std::mutex> lock(m_resolved_mtx);
+        set_resolved(e, info);
+        e->last_used = photon::now;
+        return e->info;
+    }
+
+    void refresh_url(estring url, ResolvedUrl *e) {
+        DEFER(m_refreshing--);
+        {
+            std::lock_guard<std::mutex> lock(m_resolved_mtx);
+            if (photon::now - e->last_used > kMinimalAUrlLife) {
+                // not read for a while, let it expire
+                e->refreshing = false;
+                return;
+            }
+        }
+        photon::scoped_lock l(e->resolve_lock);
+        long code = 0;
+        auto info = get_actual_url(url, m_timeout, code);
+        std::lock_guard<std::mutex> lock(m_resolved_mtx);
+        e->refreshing = false;
+        if (info == nullptr) {
+            LOG_WARN("failed to refresh url, retry later ", VALUE(url), VALUE(code));
+            e->refresh_at = photon::now + kUrlRefreshBackoff;
+            return;
+        }
+        LOG_DEBUG("url refreshed ", VALUE(url));
+        set_resolved(e, info);
+    }
+
+    // with m_resolved_mtx held
+    void set_resolved(ResolvedUrl *e, UrlInfo *info) {
+        uint64_t life = kMinimalAUrlLife;
+        if (info->mode == UrlMode::Redirect) {
+            auto ttl = signed_url_ttl(info->info);
+            if (ttl >= 0)
+                life = std::min(life, (uint64_t)std::max(ttl - 30, (int64_t)1) * 1000 * 1000);
+        }
+        e->info.reset(info);
+        e->expire = photon::now + life;
+        e->refresh_at = photon::now + life * 4 / 5;
+    }
+
+    void invalidate_url(const estring &url) {
+        std::lock_guard<std::mutex> lock(m_resolved_mtx);
+        auto it = m_resolved.find(url);
+        if (it != m_resolved.end())
+            it->second->expire = 0;
+    }
+
     int stat(const char *path, struct stat *buf) override {
         auto ctor = [&]() -> size_t * {
             auto file = open(path, 0);
@@ -197,8 +450,24 @@ public:
         Timeout tmo(timeout);
         estring authurl, scope;
         estring *token = nullptr;
-        if (get_scope_auth(url, &authurl, &scope, tmo.timeout()) < 0)
+        // the auth challenge is the same for all blobs of a repository, so
+        // images opened together share one challenge round trip
+        auto repo = repository_of(url);
+        auto challenge = m_repo_challenge.acquire(repo, [&]() -> AuthChallenge * {
+            auto c = new AuthChallenge;
+            if (get_scope_auth(url, &c->authurl, &c->scope, tmo.timeout()) < 0) {
+                delete c;
+                return nullptr;
+            }
+            return c;
+        });
+        if (challenge == nullptr)
             return nullptr;
+        authurl = challenge->authurl;
+        scope = challenge->scope;
+        // dropped unless the url is resolved with it
+        bool challenge_failed = true;
+        DEFER(m_repo_challenge.release(repo, challenge_failed));
 
         if (!scope.empty()) {
             token = m_scope_token.acquire(scope, [&]() -> estring * {
@@ -232,6 +501,7 @@ public:
             auto location = op.resp.headers["Location"];
             if (!scope.empty())
                 m_scope_token.release(scope);
+            challenge_failed = false;
             return new UrlInfo{UrlMode::Redirect, location};
         }
         if (code == 200) {
@@ -240,6 +510,7 @@ public:
                 info->info = kBearerAuthPrefix + *token;
             if (!scope.empty())
                 m_scope_token.release(scope);
+            challenge_failed = false;
             return info;
         }
 
@@ -254,6 +525,130 @@ public:
         return 0;
     }
 
+    virtual int setMaxConnsPerHost(uint32_t n) override {
+        m_max_conns_per_host = n;
+        return 0;
+    }
+
+    virtual int setAuthFailedCallback(Delegate<void, const char *> callback) override {
+        m_auth_failed = callback;
+        return 0;
+    }
+
+    virtual int setReadCoalescing(uint64_t window_us, size_t max_gap) override {
+        m_coalesce_window_us = window_us;
+        m_coalesce_gap = max_gap;
+        return 0;
+    }
+
+    // reads of a blob issued within the window are merged into one GET,
+    // if they are at most `m_coalesce_gap` bytes apart
+    uint64_t m_coalesce_window_us = 0;
+    size_t m_coalesce_gap = 0;
+
+    virtual int setRangeSplitting(size_t stripe_size, bool hedge) override {
+        m_stripe_size = stripe_size;
+        m_hedge = hedge;
+        return 0;
+    }
+
+    // ranges of at least 2 stripes are fetched by parallel sub-range GETs
+    size_t m_stripe_size = 0;
+    bool m_hedge = false;
+
+    virtual int setPeers(const char *self, const std::vector<std::string> &peers,
+                         size_t block_size, const char *token) override {
+        if (block_size == 0)
+            LOG_ERROR_RETURN(EINVAL, -1, "invalid peer block size ", VALUE(block_size));
+        if (!token || !*token)
+            LOG_ERROR_RETURN(EINVAL, -1, "fetching blocks from peers needs a token");
+        m_peers = PeerRing(self, peers);
+        m_peer_block = block_size;
+        m_peer_auth = estring().appends(kPeerBearer, token);
+        return 0;
+    }
+
+    // blocks of `m_peer_block` bytes are fetched from their owner peer
+    PeerRing m_peers;
+    size_t m_peer_block = 0;
+    std::string m_peer_auth;
+
+    static const uint64_t kWarmupInterval = 60UL * 1000 * 1000;
+
+    virtual int warmup(const char *path, uint32_t conns) override {
+        if (conns == 0)
+            return 0;
+        m_warming++;
+        photon::thread_create11(&RegistryFSImpl_v2::warm_connections, this,
+                                estring(path[0] == '/' ? path + 1 : path), conns);
+        return 0;
+    }
+
+    // concurrent 1-byte GETs, each holding a connection of the pool
+    void warm_connections(estring url, uint32_t conns) {
+        DEFER(m_warming--);
+        long code = 0;
+        auto info = resolve_url(url, m_timeout, code);
+        if (info == nullptr)
+            LOG_ERROR_RETURN(0, , "failed to resolve url to warm up ", VALUE(url), VALUE(code));
+        std::string host(url_host(info->mode == UrlMode::Redirect ? info->info : url));
+        {
+            std::lock_guard<std::mutex> lock(m_warmed_mtx);
+            auto &last = m_warmed[host];
+            if (last && photon::now < last + kWarmupInterval)
+                return;
+            last = photon::now;
+        }
+        LOG_INFO("warm up ` connections to `", conns, host);
+        photon::semaphore done;
+        for (uint32_t i = 0; i < conns; i++) {
+            photon::thread_create11([&]() {
+                HTTP_OP op;
+                auto ret = get_data(url, 0, 1, m_timeout, op);
+                char c;
+                if (ret == 200 || ret == 206)
+                    op.resp.read(&c, 1);
+                done.signal(1);
+            });
+        }
+        done.wait(conns);
+    }
+
+    std::mutex m_warmed_mtx;
+    std::unordered_map<std::string, uint64_t> m_warmed;
+    std::atomic<int> m_warming{0};
+
+    static const size_t kLatencySamples = 256;
+    static const uint64_t kMinHedgeDelay = 10 * 1000;
+
+    void record_latency(uint64_t us) {
+        if (!m_hedge)
+            return;
+        std::lock_guard<std::mutex> lock(m_latency_mtx);
+        m_latency[m_latency_pos++ % kLatencySamples] = us;
+    }
+
+    // p95 of the recent latencies, or 0 (no hedging) before there are enough
+    uint64_t hedge_delay() {
+        if (!m_hedge)
+            return 0;
+        std::vector<uint64_t> samples;
+        {
+            std::lock_guard<std::mutex> lock(m_latency_mtx);
+            if (m_latency_pos < kLatencySamples / 8)
+                return 0;
+            auto n = std::min(m_latency_pos, kLatencySamples);
+            samples.assign(m_latency, m_latency + n);
+        }
+        auto p95 = samples.begin() + samples.size() * 95 / 100;
+        std::nth_element(samples.begin(), p95, samples.end());
+        return std::max(*p95, kMinHedgeDelay);
+    }
+
+    std::mutex m_latency_mtx;
+    uint64_t m_latency[kLatencySamples] = {0};
+    size_t m_latency_pos = 0;
+
     photon::net::http::Client* get_client() {
         return m_client;
     }
@@ -279,8 +674,39 @@ public:
         return 0;
     }
 
+    Endpoint *endpoint(estring_view host) {
+        std::lock_guard<std::mutex> lock(m_endpoints_mtx);
+        auto &ep = m_endpoints[std::string(host)];
+        if (!ep)
+            ep.reset(new Endpoint);
+        return ep.get();
+    }
+
+    virtual std::string endpointMetrics() override {
+        std::string out;
+        std::lock_guard<std::mutex> lock(m_endpoints_mtx);
+        if (m_endpoints.empty())
+            return out;
+        out.append("# HELP OverlayBD_Registry_Endpoint_Latency time to response of blob requests "
+                   "in us, by endpoint\n# TYPE OverlayBD_Registry_Endpoint_Latency histogram\n");
+        for (auto &x : m_endpoints)
+            x.second->render(x.first, out);
+        out.append("# HELP OverlayBD_Registry_Endpoint_Errors failed blob requests, by endpoint\n"
+                   "# TYPE OverlayBD_Registry_Endpoint_Errors counter\n");
+        for (auto &x : m_endpoints)
+            out.append(estring().appends("OverlayBD_Registry_Endpoint_Errors{endpoint=\"", x.first,
+                                         "\"} ", std::to_string(x.second->state().first), "\n"));
+        out.append("# HELP OverlayBD_Registry_Endpoint_Open whether the breaker of the endpoint "
+                   "is open\n# TYPE OverlayBD_Registry_Endpoint_Open gauge\n");
+        for (auto &x : m_endpoints)
+            out.append(estring().appends("OverlayBD_Registry_Endpoint_Open{endpoint=\"", x.first,
+                                         "\"} ", x.second->state().second ? "1" : "0", "\n"));
+        return out;
+    }
+
 protected:
     PasswordCB m_callback;
+    Delegate<void, const char *> m_auth_failed;
     estring m_accelerate;
     estring m_caFile;
     uint64_t m_timeout;
@@ -288,7 +714,23 @@ protected:
     photon::net::http::Client *m_client;
     ObjectCache<estring, size_t *> m_meta_size;
     ObjectCache<estring, estring *> m_scope_token;
-    ObjectCache<estring, UrlInfo *> m_url_info;
+    ObjectCache<estring, AuthChallenge *> m_repo_challenge;
+    std::mutex m_resolved_mtx;
+    std::unordered_map<std::string, std::unique_ptr<ResolvedUrl>> m_resolved;
+    std::atomic<int> m_refreshing{0};
+    uint32_t m_max_conns_per_host = 0;
+    std::mutex m_host_slots_mtx;
+    std::mutex m_endpoints_mtx;
+    std::unordered_map<std::string, std::unique_ptr<Endpoint>> m_endpoints;
+    std::unordered_map<std::string, std::unique_ptr<photon::semaphore>> m_host_slots;
+
+    photon::semaphore *host_slots(estring_view host) {
+        std::lock_guard<std::mutex> lock(m_host_slots_mtx);
+        auto &sem = m_host_slots[std::string(host)];
+        if (!sem)
+            sem.reset(new photon::semaphore(m_max_conns_per_host));
+        return sem.get();
+    }
 
     int get_scope_auth(const estring &url, estring *authurl, estring *scope, uint64_t timeout,
                        bool push = false) {
@@ -348,14 +790,22 @@ protected:
     }
 
     int get_token(const estring &url, const estring &authurl, estring &token, uint64_t timeout) {
+        Timeout tmo(timeout);
         auto ret = m_callback(url.data());
-        if (!authenticate(authurl, ret.first, ret.second, &token, timeout)) {
-            token = "";
-            return -1;
+        if (authenticate(authurl, ret.first, ret.second, &token, tmo.timeout()))
+            return 0;
+        if (m_auth_failed) {
+            // the credential may have been kept after it was changed
+            m_auth_failed(url.data());
+            ret = m_callback(url.data());
+            if (authenticate(authurl, ret.first, ret.second, &token, tmo.timeout()))
+                return 0;
         }
-        return 0;
+        token = "";
+        return -1;
     }
 
+
     bool authenticate(const estring &authurl, std::string &username, std::string &password,
                       estring *token, uint64_t timeout) {
         Timeout tmo(timeout);
@@ -391,6 +841,11 @@ public:
     uint64_t m_timeout = -1;
     size_t m_filesize = 0;
 
+    struct PendingRead;
+    photon::mutex m_pending_mtx;
+    std::vector<PendingRead *> m_pending;
+    bool m_collecting = false;
+
     RegistryFileImpl_v2(const char *url, RegistryFSImpl_v2 *fs, uint64_t timeout)
         : m_fs(fs), m_timeout(timeout) {
         m_url = url[0] == '/' ? url + 1 : url;
@@ -408,6 +863,217 @@ public:
                 return -1;
             m_filesize = stat.st_size;
         }
+        if (!m_fs->m_peers.empty() && peer_readable())
+            return peer_preadv(iov, iovcnt, offset);
+        return registry_preadv(iov, iovcnt, offset);
+    }
+
+    // 1 if the blob may be read from peers, 0 if not, -1 unknown yet
+    int m_peer_readable = -1;
+
+    // Only zfiles whose blocks carry checksums, which the zfile over the
+    // cache verifies as it reads them, so that a block corrupted or stale
+    // on a peer is detected. The header saying so is read from the registry,
+    // and so is block 0 holding it; the trailer and the jump table carry
+    // checksums of their own.
+    bool peer_readable() {
+        if (m_peer_readable >= 0)
+            return m_peer_readable;
+        char header[ZFile::HEADER_SPACE];
+        if (m_filesize < sizeof(header)) {
+            m_peer_readable = 0;
+            return false;
+        }
+        struct iovec iov { header, sizeof(header) };
+        if (registry_preadv(&iov, 1, 0) != (ssize_t)sizeof(header))
+            return false;
+        m_peer_readable = ZFile::zfile_checksummed(header, sizeof(header));
+        if (!m_peer_readable)
+            LOG_INFO("blob is not a zfile with checksummed blocks, not read from peers ",
+                     VALUE(m_url));
+        return m_peer_readable;
+    }
+
+    ssize_t registry_preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+        iovector_view view((struct iovec*)iov, iovcnt);
+        if (m_fs->m_coalesce_window_us == 0 || view.sum() >= kMaxCoalescedSize)
+            return fetch(iov, iovcnt, offset);
+        return coalesced_preadv(iov, iovcnt, offset, view.sum());
+    }
+
+    // reads block by block, each from its owner peer, or from the registry
+    // if this node owns it or the owner fails
+    ssize_t peer_preadv(const struct iovec *iov, int iovcnt, off_t offset) {
+        iovector_view view((struct iovec*)iov, iovcnt);
+        size_t count = view.sum();
+        if (offset + count > m_filesize)
+            count = offset < (off_t)m_filesize ? m_filesize - offset : 0;
+        auto &ring = m_fs->m_peers;
+        auto bs = m_fs->m_peer_block;
+        auto digest = PeerRing::blob_digest(m_url);
+        size_t done = 0;
+        while (done < count) {
+            off_t pos = offset + done;
+            auto index = pos / bs;
+            auto len = std::min(count - done, (index + 1) * bs - pos);
+            std::vector<struct iovec> sub;
+            sub_iov(iov, iovcnt, done, len, sub);
+            ssize_t ret = -1;
+            auto &owner = ring.owner(digest, index);
+            if (index > 0 && owner != ring.self() && PeerRing::valid_digest(digest)) {
+                ret = fetch_from_peer(owner, digest, sub.data(), sub.size(), pos, len);
+                if (ret != (ssize_t)len)
+                    LOG_WARN("failed to fetch block from peer, fall back to registry ", VALUE(owner),
+                             VALUE(m_url), VALUE(pos));
+            }
+            if (ret != (ssize_t)len)
+                ret = registry_preadv(sub.data(), sub.size(), pos);
+            if (ret < 0)
+                return -1;
+            done += ret;
+            if (ret < (ssize_t)len)
+                break;
+        }
+        return done;
+    }
+
+    ssize_t fetch_from_peer(const std::string &peer, std::string_view digest,
+                            const struct iovec *iov, int iovcnt, off_t offset, size_t count) {
+        auto ep = m_fs->endpoint(peer);
+        if (!ep->allow())
+            LOG_ERROR_RETURN(EIO, -1, "peer ` is failing, skip it", peer);
+        Timeout tmo(m_timeout);
+        HTTP_OP op(m_fs->get_client(), Verb::GET,
+                   estring().appends("http://", peer, kPeerUriPrefix));
+        op.req.headers.insert(kPeerBlobHeader, digest);
+        op.req.headers.insert("Authorization", m_fs->m_peer_auth);
+        op.req.headers.range(offset, offset + count - 1);
+        op.set_enable_proxy(false);
+        op.retry = 0;
+        op.timeout = tmo.timeout();
+        auto begin = photon::now;
+        m_fs->get_client()->call(&op);
+        // a refused (421) or uncached (404) block is not the peer's fault
+        ep->record(peer, op.status_code == 206 || op.status_code == 421 || op.status_code == 404,
+                   photon::now - begin);
+        if (op.status_code != 206)
+            LOG_ERROR_RETURN(EIO, -1, "peer refused block ", VALUE(peer), VALUE(op.status_code));
+        return op.resp.readv(iov, iovcnt);
+    }
+
+    // fetches a range, striped into parallel sub-range GETs if it's large
+    ssize_t fetch(const struct iovec *iov, int iovcnt, off_t offset) {
+        iovector_view view((struct iovec*)iov, iovcnt);
+        size_t count = view.sum();
+        if (offset + count > m_filesize)
+            count = offset < (off_t)m_filesize ? m_filesize - offset : 0;
+        auto stripe = m_fs->m_stripe_size;
+        if (stripe == 0 || count < 2 * stripe)
+            return fetch_hedged(iov, iovcnt, offset);
+
+        auto n = (count + stripe - 1) / stripe;
+        std::vector<std::vector<struct iovec>> iovs(n);
+        std::vector<ssize_t> rets(n);
+        FanOut::Group<> group(kFetchConcurrency);
+        for (size_t i = 0; i < n; i++) {
+            auto len = std::min(stripe, count - i * stripe);
+            sub_iov(iov, iovcnt, i * stripe, len, iovs[i]);
+            group.submit([&, i]() {
+                rets[i] = fetch_hedged(iovs[i].data(), iovs[i].size(), offset + i * stripe);
+                return rets[i] < 0 ? -1 : 0;
+            });
+        }
+        if (group.wait() < 0)
+            LOG_ERROR_RETURN(EIO, -1, "failed to fetch striped range ", VALUE(m_url),
+                             VALUE(offset), VALUE(count));
+        ssize_t ret = 0;
+        for (auto r : rets)
+            ret += r;
+        return ret;
+    }
+
+    // [off, off + len) of `iov` as an iovec array
+    static void sub_iov(const struct iovec *iov, int iovcnt, size_t off, size_t len,
+                        std::vector<struct iovec> &out) {
+        for (int i = 0; i < iovcnt && len > 0; i++) {
+            if (off >= iov[i].iov_len) {
+                off -= iov[i].iov_len;
+                continue;
+            }
+            auto n = std::min(len, iov[i].iov_len - off);
+            out.push_back({(char *)iov[i].iov_base + off, n});
+            off = 0;
+            len -= n;
+        }
+    }
+
+    struct Attempt {
+        photon::thread *th = nullptr;
+        photon::join_handle *jh = nullptr;
+        ssize_t ret = -1;
+        int err = 0;
+        bool done = false, cancelled = false;
+    };
+
+    // Fires a duplicate GET, into a buffer of its own, if the first one
+    // doesn't finish within the p95 latency, and takes whichever succeeds
+    // first; the other one is interrupted.
+    ssize_t fetch_hedged(const struct iovec *iov, int iovcnt, off_t offset) {
+        auto delay = m_fs->hedge_delay();
+        if (delay == 0)
+            return fetch_range(iov, iovcnt, offset);
+
+        iovector_view view((struct iovec*)iov, iovcnt);
+        auto count = view.sum();
+        photon::semaphore sem;
+        Attempt first, second;
+        std::unique_ptr<char[]> buf;
+        struct iovec hedge_iov;
+        auto start = [&](Attempt &a, const struct iovec *v, int vcnt) {
+            a.th = photon::thread_create11([&, v, vcnt]() {
+                a.ret = fetch_range(v, vcnt, offset, &a.cancelled);
+                a.err = errno;
+                a.done = true;
+                sem.signal(1);
+            });
+            a.jh = photon::thread_enable_join(a.th);
+        };
+        auto cancel = [&](Attempt &a) {
+            if (a.jh && !a.done) {
+                a.cancelled = true;
+                photon::thread_interrupt(a.th, ECANCELED);
+            }
+        };
+
+        start(first, iov, iovcnt);
+        if (sem.wait(1, delay) < 0) {
+            LOG_DEBUG("hedging slow request ", VALUE(m_url), VALUE(offset), VALUE(delay));
+            buf.reset(new char[count]);
+            hedge_iov = {buf.get(), count};
+            start(second, &hedge_iov, 1);
+            sem.wait(1);
+            // the first to finish failed, wait for the other
+            if (!(first.done && first.ret >= 0) && !(second.done && second.ret >= 0))
+                sem.wait(1);
+        }
+        bool hedge_won = second.done && second.ret >= 0 && !(first.done && first.ret >= 0);
+        cancel(hedge_won ? first : second);
+        for (auto a : {&first, &second}) {
+            if (a->jh)
+                photon::thread_join(a->jh);
+        }
+        if (hedge_won) {
+            LOG_DEBUG("hedged request won ", VALUE(m_url), VALUE(offset));
+            view.memcpy_from(buf.get(), second.ret);
+            return second.ret;
+        }
+        errno = first.err;
+        return first.ret;
+    }
+
+    // a single range GET, with retries unless `cancelled`
+    ssize_t fetch_range(const struct iovec *iov, int iovcnt, off_t offset,
+                        const bool *cancelled = nullptr) {
         auto filesize = m_filesize;
         int retry = 3;
         Timeout tmo(m_timeout);
@@ -419,10 +1085,15 @@ public:
             count = filesize - offset;
         LOG_DEBUG("pulling blob from registry: ", VALUE(m_url), VALUE(offset), VALUE(count));
 
+        auto begin = photon::now;
+        HostSlot slot;
         HTTP_OP op;
-        auto code = m_fs->get_data(m_url, offset, count, tmo.timeout(), op);
+        auto code = m_fs->get_data(m_url, offset, count, tmo.timeout(), op, &slot);
         if (code != 200 && code != 206) {
             ERRNO eno;
+            if (cancelled && *cancelled) {
+                LOG_ERROR_RETURN(ECANCELED, -1, "request cancelled ", VALUE(m_url), VALUE(offset));
+            }
             if (tmo.expire() < photon::now) {
                 LOG_ERROR_RETURN(ETIMEDOUT, -1, "timed out in preadv ", VALUE(m_url), VALUE(offset));
             }
@@ -436,7 +1107,122 @@ public:
                                  VALUE(offset));
             }
         }
-        return op.resp.readv(iov, iovcnt);
+        auto ret = op.resp.readv(iov, iovcnt);
+        if (ret == (ssize_t)count)
+            m_fs->record_latency(photon::now - begin);
+        return ret;
+    }
+
+    static const size_t kMaxCoalescedSize = 4UL * 1024 * 1024;
+    // max GETs in flight for the stripes of a range, or the runs of a batch
+    static const size_t kFetchConcurrency = 8;
+
+    struct PendingRead {
+        const struct iovec *iov;
+        int iovcnt;
+        off_t offset;
+        size_t count;
+        ssize_t ret = 0;
+        int err = 0;
+        photon::semaphore done;
+    };
+
+    // The first reader of a window collects the reads arriving during it,
+    // then fetches each run of nearby reads with one GET and hands every
+    // reader its part.
+    ssize_t coalesced_preadv(const struct iovec *iov, int iovcnt, off_t offset, size_t count) {
+        PendingRead me{iov, iovcnt, offset, count};
+        bool leader;
+        {
+            photon::scoped_lock lock(m_pending_mtx);
+            m_pending.push_back(&me);
+            leader = !m_collecting;
+            m_collecting = true;
+        }
+        if (!leader) {
+            me.done.wait(1);
+            errno = me.err;
+            return me.ret;
+        }
+        photon::thread_usleep(m_fs->m_coalesce_window_us);
+        std::vector<PendingRead *> batch;
+        {
+            photon::scoped_lock lock(m_pending_mtx);
+            batch.swap(m_pending);
+            m_collecting = false;
+        }
+        std::sort(batch.begin(), batch.end(),
+                  [](PendingRead *a, PendingRead *b) { return a->offset < b->offset; });
+
+        FanOut::Group<> group(kFetchConcurrency);
+        std::vector<PendingRead *> mine;
+        size_t i = 0;
+        while (i < batch.size()) {
+            auto j = i + 1;
+            off_t end = batch[i]->offset + batch[i]->count;
+            while (j < batch.size() && batch[j]->offset <= end + (off_t)m_fs->m_coalesce_gap &&
+                   std::max(end, (off_t)(batch[j]->offset + batch[j]->count)) -
+                           batch[i]->offset <= (off_t)kMaxCoalescedSize) {
+                end = std::max(end, (off_t)(batch[j]->offset + batch[j]->count));
+                j++;
+            }
+            // the run containing the leader is fetched by itself, the others in parallel
+            std::vector<PendingRead *> run(batch.begin() + i, batch.begin() + j);
+            if (std::find(run.begin(), run.end(), &me) != run.end()) {
+                mine = std::move(run);
+            } else {
+                group.submit([this, run]() {
+                    fetch_run(run, nullptr);
+                    return 0;
+                });
+            }
+            i = j;
+        }
+        fetch_run(mine, &me);
+        group.wait();
+        errno = me.err;
+        return me.ret;
+    }
+
+    // completes the reads of `run` (sorted by offset) with a single GET
+    void fetch_run(std::vector<PendingRead *> run, PendingRead *self) {
+        auto complete = [&](PendingRead *r) {
+            if (r != self)
+                r->done.signal(1);
+        };
+        if (run.size() == 1) {
+            auto r = run.front();
+            r->ret = fetch(r->iov, r->iovcnt, r->offset);
+            r->err = errno;
+            complete(r);
+            return;
+        }
+        off_t start = run.front()->offset, end = start;
+        for (auto r : run)
+            end = std::max(end, (off_t)(r->offset + r->count));
+        end = std::min(end, (off_t)m_filesize);
+        if (end <= start) {
+            for (auto r : run)
+                complete(r);
+            return;
+        }
+        LOG_DEBUG("coalesced ` reads of ", run.size(), VALUE(m_url), VALUE(start), VALUE(end));
+        std::unique_ptr<char[]> buf(new char[end - start]);
+        struct iovec v{buf.get(), (size_t)(end - start)};
+        auto n = fetch(&v, 1, start);
+        auto err = errno;
+        for (auto r : run) {
+            if (n < 0) {
+                r->ret = -1;
+                r->err = err;
+            } else {
+                auto avail = std::max((off_t)0, start + n - r->offset);
+                auto len = std::min((size_t)avail, r->count);
+                iovector_view view((struct iovec *)r->iov, r->iovcnt);
+                r->ret = view.memcpy_from(buf.get() + (r->offset - start), len);
+            }
+            complete(r);
+        }
     }
 
     int64_t get_length(uint64_t timeout = -1) {
@@ -499,23 +1285,38 @@ IFileSystem *new_registryfs_v2(PasswordCB callback, const char *caFile, uint64_t
     return new RegistryFSImpl_v2(callback, caFile ? caFile : "", timeout, ctx);
 }
 
+// Uploads what is written to it as a registry blob. Data is staged in
+// `lfile` and read back by the upload thread; without `lfile`, the
+// upload streams from memory instead, keeping at most two chunks of
+// `upload_bs` bytes buffered. A streaming upload can not restart from
+// the beginning once a chunk is sent, so a failed chunk is retried in
+// place. The sha256 of the blob is computed by a thread of its own,
+// reading the data back alongside the upload.
 class RegistryUploader : public VirtualFile {
 public:
-    photon::semaphore m_sem, m_init_sem;
+    static const int MAX_STREAM_CHUNKS = 2;
+    photon::semaphore m_sem, m_init_sem, m_space_sem;
     SHA256_CTX m_sha256_ctx = {0};
     std::string m_sha256sum;
-    std::thread m_upload_th;
+    std::thread m_upload_th, m_hash_th;
+    photon::semaphore m_hash_sem;
+    std::atomic<off_t> m_hashed_pos{0}, m_uploaded_pos{0}, m_write_pos{0};
+    bool m_write_done = false;
     IFile *m_local_file;
     estring m_origin_upload_url, m_upload_url;
     ssize_t m_upload_chunk_size = 128 * 1024 * 1024;
     void *m_upload_buf;
-    off_t m_upload_pos = 0, m_write_pos = 0;
+    off_t m_upload_pos = 0;
     bool m_finished = false, m_failed = false;
     RegistryFSImpl_v2 *m_upload_fs;
     uint64_t m_http_client_ts = 0;
     std::string m_username, m_password;
     uint64_t m_timeout = -1;
     estring m_token;
+    // in-memory chunks covering [m_stream_base, m_write_pos), streaming only
+    std::mutex m_stream_mtx;
+    std::deque<char *> m_stream_chunks;
+    off_t m_stream_base = 0;
 
     RegistryUploader(IFile *lfile, std::string &upload_url, std::string &username,
                      std::string &password, uint64_t timeout, ssize_t upload_bs,
@@ -535,10 +1336,22 @@ public:
             m_upload_th.join();
             return -1;
         }
+        m_hash_th = std::thread(&RegistryUploader::hash_thread, this);
         return 0;
     }
 
     ~RegistryUploader() {
+        if (m_hash_th.joinable()) {
+            m_write_done = true;
+            m_hash_sem.signal(1);
+            m_hash_th.join();
+        }
+        for (auto c : m_stream_chunks)
+            free(c);
+    }
+
+    bool streaming() const {
+        return m_local_file == nullptr;
     }
 
     int fsync() override {
@@ -546,6 +1359,15 @@ public:
             m_upload_th.join();
             return -1;
         }
+        m_write_done = true;
+        m_hash_sem.signal(1);
+        m_hash_th.join();
+        if (m_failed) {
+            m_finished = true;
+            m_sem.signal(1);
+            m_upload_th.join();
+            return -1;
+        }
         // calc sha256 result
         unsigned char sha[32];
         SHA256_Final(sha, &m_sha256_ctx);
@@ -573,6 +1395,11 @@ public:
         return nullptr;
     }
     virtual int fstat(struct stat *buf) override {
+        if (streaming()) {
+            memset(buf, 0, sizeof(*buf));
+            buf->st_size = m_write_pos;
+            return 0;
+        }
         return m_local_file->fstat(buf);
     }
 
@@ -584,22 +1411,155 @@ public:
         if (m_failed) {
             LOG_ERROR_RETURN(EINVAL, -1, "already failed");
         }
+        if (streaming())
+            return stream_write(buf, count);
         auto rc = m_local_file->write(buf, count);
         if (rc < 0) {
             LOG_ERRNO_RETURN(0, -1, "failed to write local file", VALUE(rc));
         }
-        if (rc > 0 && SHA256_Update(&m_sha256_ctx, buf, rc) < 0) {
-            LOG_ERRNO_RETURN(0, -1, "sha256 calculate error");
-        }
-        m_write_pos += rc;
-        m_sem.signal(1);
+        written(rc);
         return rc;
     }
 
+    // make the data written visible to the upload thread and the hash thread
+    void written(size_t count) {
+        m_write_pos += count;
+        m_sem.signal(1);
+        m_hash_sem.signal(1);
+    }
+
     ssize_t pwrite(const void *buf, size_t count, off_t offset) override {
         LOG_ERROR_RETURN(EINVAL, -1, "pwrite is not supported");
     }
 
+    off_t stream_base() {
+        std::lock_guard<std::mutex> lock(m_stream_mtx);
+        return m_stream_base;
+    }
+
+    // the data is published chunk by chunk, so that the full chunks are uploaded,
+    // hashed and released while the rest of a large write is still buffered
+    ssize_t stream_write(const void *buf, size_t count) {
+        auto p = (const char *)buf;
+        size_t done = 0;
+        while (done < count) {
+            auto in_chunk = (m_write_pos - stream_base()) % m_upload_chunk_size;
+            if (in_chunk == 0) {
+                // the last chunk is full, wait until the upload and the hash of
+                // the oldest one are done, which frees it
+                while (!m_failed) {
+                    std::unique_lock<std::mutex> lock(m_stream_mtx);
+                    if (m_stream_chunks.size() < (size_t)MAX_STREAM_CHUNKS)
+                        break;
+                    lock.unlock();
+                    m_space_sem.wait(1);
+                }
+                if (m_failed)
+                    LOG_ERROR_RETURN(EIO, -1, "upload failed");
+                auto chunk = (char *)malloc(m_upload_chunk_size);
+                if (!chunk)
+                    LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate upload chunk");
+                std::lock_guard<std::mutex> lock(m_stream_mtx);
+                m_stream_chunks.push_back(chunk);
+            }
+            auto n = std::min(count - done, (size_t)(m_upload_chunk_size - in_chunk));
+            char *chunk;
+            {
+                std::lock_guard<std::mutex> lock(m_stream_mtx);
+                chunk = m_stream_chunks.back();
+            }
+            memcpy(chunk + in_chunk, p + done, n);
+            done += n;
+            written(n);
+        }
+        return count;
+    }
+
+    // read back data to upload, from either the local file or the memory chunks
+    ssize_t read_data(void *buf, size_t count, off_t offset) {
+        if (!streaming())
+            return m_local_file->pread(buf, count, offset);
+        std::lock_guard<std::mutex> lock(m_stream_mtx);
+        if (offset < m_stream_base)
+            LOG_ERROR_RETURN(ESPIPE, -1, "data already released", VALUE(offset), VALUE(m_stream_base));
+        auto p = (char *)buf;
+        size_t done = 0;
+        while (done < count) {
+            auto pos = offset + done - m_stream_base;
+            auto i = pos / m_upload_chunk_size;
+            if (i >= m_stream_chunks.size())
+                break;
+            auto in_chunk = pos % m_upload_chunk_size;
+            auto n = std::min(count - done, (size_t)(m_upload_chunk_size - in_chunk));
+            memcpy(p + done, m_stream_chunks[i] + in_chunk, n);
+            done += n;
+        }
+        return done;
+    }
+
+    // free the memory chunks that are completely uploaded and hashed
+    void release_data() {
+        if (!streaming())
+            return;
+        int n = 0;
+        {
+            auto done = std::min(m_uploaded_pos.load(), m_hashed_pos.load());
+            std::lock_guard<std::mutex> lock(m_stream_mtx);
+            while (!m_stream_chunks.empty() &&
+                   m_stream_base + m_upload_chunk_size <= done) {
+                free(m_stream_chunks.front());
+                m_stream_chunks.pop_front();
+                m_stream_base += m_upload_chunk_size;
+                n++;
+            }
+        }
+        if (n)
+            m_space_sem.signal(n);
+    }
+
+    // upload [m_upload_pos, m_upload_pos + size); a streaming upload
+    // retries the chunk in place, as it can not be restarted
+    off_t upload_next(size_t size) {
+        auto pos = upload_chunk(m_upload_pos, size, "");
+        for (int i = 0; pos < 0 && streaming() && i < 3; i++) {
+            LOG_ERROR("failed to upload chunk, retry in place ", VALUE(m_upload_pos));
+            pos = upload_chunk(m_upload_pos, size, "");
+        }
+        if (pos >= 0) {
+            m_uploaded_pos = pos;
+            release_data();
+        }
+        return pos;
+    }
+
+    int hash_thread() {
+        photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE);
+        DEFER(photon::fini());
+        const size_t block = 1024 * 1024;
+        std::unique_ptr<char[]> buf(new char[block]);
+        while (!m_failed) {
+            bool done = m_write_done;
+            off_t end = m_write_pos, pos = m_hashed_pos;
+            if (pos >= end) {
+                if (done)
+                    return 0;
+                m_hash_sem.wait(1);
+                continue;
+            }
+            auto n = std::min((size_t)(end - pos), block);
+            if (read_data(buf.get(), n, pos) != (ssize_t)n ||
+                SHA256_Update(&m_sha256_ctx, buf.get(), n) != 1) {
+                m_failed = true;
+                m_sem.signal(1);
+                m_space_sem.signal(MAX_STREAM_CHUNKS);
+                LOG_ERRNO_RETURN(0, -1, "failed to calculate sha256", VALUE(pos), VALUE(n));
+            }
+            m_hashed_pos = pos + n;
+            release_data();
+        }
+        return -1;
+    }
+
     std::pair<std::string, std::string> load_auth(const char *remote_path) {
         return std::make_pair(m_username, m_password);
     }
@@ -638,7 +1598,7 @@ public:
                 ssize_t cnt = 1024 * 1024;
                 if ((off_t)(start + cnt) > (off_t)(offset + count))
                     cnt = offset + count - start;
-                auto rc = m_local_file->pread(m_upload_buf, cnt, start);
+                auto rc = read_data(m_upload_buf, cnt, start);
                 if (rc != cnt) {
                     LOG_ERRNO_RETURN(0, -1, "failed to read file", VALUE(rc), VALUE(cnt));
                 }
@@ -700,6 +1660,11 @@ public:
         DEFER(free(m_upload_buf));
         int retry = 3;
     again:
+        if (streaming() && stream_base() > 0) {
+            m_failed = true;
+            LOG_ERROR("streaming upload can not restart from ", stream_base());
+            goto fail;
+        }
         m_upload_pos = 0;
         if (init_upload() < 0) {
             if (retry--) {
@@ -714,7 +1679,7 @@ public:
         while (!m_finished && !m_failed) {
             m_sem.wait(1);
             while (m_write_pos > m_upload_pos + m_upload_chunk_size) {
-                m_upload_pos = upload_chunk(m_upload_pos, m_upload_chunk_size, "");
+                m_upload_pos = upload_next(m_upload_chunk_size);
                 if (m_upload_pos < 0) {
                     if (retry--) {
                         LOG_ERROR("failed to upload chunk, retry");
@@ -731,7 +1696,7 @@ public:
             auto size = m_write_pos - m_upload_pos;
             if (size > m_upload_chunk_size)
                 size = m_upload_chunk_size;
-            m_upload_pos = upload_chunk(m_upload_pos, size, "");
+            m_upload_pos = upload_next(size);
             if (m_upload_pos < 0) {
                 if (retry--) {
                     LOG_ERROR("failed to upload chunk, retry");
@@ -742,6 +1707,8 @@ public:
             }
         }
 
+        if (m_failed)
+            goto fail;
         // send complete
         m_upload_pos = upload_chunk(m_upload_pos, 0, m_sha256sum);
         if (m_upload_pos < 0) {
@@ -757,6 +1724,8 @@ public:
         return 0;
 
     fail:
+        // wake up a writer waiting for memory chunks
+        m_space_sem.signal(MAX_STREAM_CHUNKS);
         LOG_ERROR("file upload failed");
         return -1;
     }
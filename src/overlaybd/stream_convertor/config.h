@@ -38,6 +38,14 @@ struct GlobalConfigPara : public App::ConfigGroup  {
     APPCFG_PARA(reusePort, bool, true);
 
     APPCFG_PARA(workDir, std::string, "/tmp/stream_conv");
+    // vcpus the tasks run on, 0 for the one accepting them
+    APPCFG_PARA(workerThreads, uint32_t, 0);
+    APPCFG_PARA(maxTasks, uint32_t, 8);
+    // tasks waiting for admission, beyond which they're rejected
+    APPCFG_PARA(maxQueuedTasks, uint32_t, 64);
+    // memory reserved by a task, half of it buffering the request body
+    APPCFG_PARA(taskMemoryMB, uint32_t, 8);
+    APPCFG_PARA(memoryLimitMB, uint32_t, 256);
     //APPCFG_PARA(ServerConfig, ServerConfigPara);
     APPCFG_PARA(logConfig, LogConfigPara);
 };
@@ -7,13 +7,16 @@
 #include <photon/net/http/server.h>
 #include <photon/fs/localfs.h>
 #include <photon/thread/thread11.h>
+#include <photon/thread/workerpool.h>
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/common/alog-audit.h>
 #include <photon/common/string_view.h>
 #include <photon/photon.h>
 #include <photon/io/signal.h>
+#include <atomic>
 #include <chrono>
+#include <memory>
 #include <unistd.h>
 #include "config.h"
 #include "../gzip/gz.h"
@@ -30,11 +33,123 @@ using namespace std;
 using namespace photon;
 using namespace photon::net;
 
+// A bounded buffer of a request body, between the thread receiving it and
+// the one decoding it. The receiver stops reading the socket while it's
+// full, so a slow decoder slows the client down through flow control rather
+// than the body piling up in memory.
+class BodyPipe : public IStream {
+public:
+    explicit BodyPipe(size_t capacity) : m_buf(new char[capacity]), m_cap(capacity) {
+    }
+
+    virtual ssize_t write(const void *buf, size_t count) override {
+        size_t n = 0;
+        photon::scoped_lock lock(m_mtx);
+        while (n < count) {
+            while (m_len == m_cap && !m_closed)
+                m_cv.wait(lock);
+            if (m_closed)
+                LOG_ERROR_RETURN(EPIPE, -1, "body pipe closed by the decoder");
+            auto tail = (m_head + m_len) % m_cap;
+            auto len = std::min(count - n, std::min(m_cap - m_len, m_cap - tail));
+            memcpy(m_buf.get() + tail, (const char *)buf + n, len);
+            m_len += len;
+            n += len;
+            m_cv.notify_all();
+        }
+        return n;
+    }
+
+    virtual ssize_t read(void *buf, size_t count) override {
+        photon::scoped_lock lock(m_mtx);
+        while (m_len == 0 && !m_eof && !m_closed)
+            m_cv.wait(lock);
+        if (m_len == 0) {
+            if (m_err)
+                LOG_ERROR_RETURN(m_err, -1, "failed to receive request body");
+            return 0;
+        }
+        auto len = std::min(count, std::min(m_len, m_cap - m_head));
+        memcpy(buf, m_buf.get() + m_head, len);
+        m_head = (m_head + len) % m_cap;
+        m_len -= len;
+        m_cv.notify_all();
+        return len;
+    }
+
+    // the end of the body, or the error receiving it
+    void finish(int err) {
+        photon::scoped_lock lock(m_mtx);
+        m_eof = true;
+        m_err = err;
+        m_cv.notify_all();
+    }
+
+    // the decoder is done, the receiver stops
+    virtual int close() override {
+        photon::scoped_lock lock(m_mtx);
+        m_closed = true;
+        m_cv.notify_all();
+        return 0;
+    }
+
+    UNIMPLEMENTED(ssize_t readv(const struct iovec *iov, int iovcnt) override);
+    UNIMPLEMENTED(ssize_t writev(const struct iovec *iov, int iovcnt) override);
+
+private:
+    std::unique_ptr<char[]> m_buf;
+    size_t m_cap, m_head = 0, m_len = 0;
+    bool m_eof = false, m_closed = false;
+    int m_err = 0;
+    photon::mutex m_mtx;
+    photon::condition_variable m_cv;
+};
+
+// Admits up to `max_tasks` tasks at a time, within `memory_limit` of the
+// memory they reserve, and queues up to `max_queued` more; the rest are
+// rejected rather than left to pile up.
+class TaskLimiter {
+public:
+    TaskLimiter(uint32_t max_tasks, uint32_t max_queued, uint64_t memory_limit)
+        : m_slots(std::max(1u, max_tasks)), m_memory(memory_limit), m_limit(memory_limit),
+          m_max_queued(max_queued) {
+    }
+
+    // reserves `budget` bytes, clamped to the limit, returns the amount
+    // reserved, or 0 with EBUSY if the queue is full
+    uint64_t acquire(uint64_t budget) {
+        budget = std::max(std::min(budget, m_limit), (uint64_t)1);
+        if (m_queued.fetch_add(1) >= m_max_queued) {
+            m_queued--;
+            LOG_ERROR_RETURN(EBUSY, 0, "` tasks queued already", m_max_queued);
+        }
+        m_slots.wait(1);
+        m_memory.wait(budget);
+        m_queued--;
+        return budget;
+    }
+
+    void release(uint64_t budget) {
+        m_memory.signal(budget);
+        m_slots.signal(1);
+    }
+
+private:
+    photon::semaphore m_slots, m_memory;
+    uint64_t m_limit;
+    uint32_t m_max_queued;
+    std::atomic<uint32_t> m_queued{0};
+};
+
 class StreamConvertor {
 public:
     StreamConvertor(App::AppConfig &config) {
         workdir = config.globalConfig().workDir();
         serv_addr = config.globalConfig().udsAddr();
+        task_memory = config.globalConfig().taskMemoryMB() * 1024UL * 1024;
+        uint64_t memory_limit = config.globalConfig().memoryLimitMB() * 1024UL * 1024;
+        m_limiter.reset(new TaskLimiter(config.globalConfig().maxTasks(),
+                                        config.globalConfig().maxQueuedTasks(), memory_limit));
     }
 
     struct Task {
@@ -45,7 +160,7 @@ public:
             task_id = std::to_string(us) + "." + std::to_string(rand() % 1000000);
         }
         string task_id;
-        int status;
+        int status = 0;
         string msg;
     };
 
@@ -74,14 +189,61 @@ public:
             return 0;
         }
         string msg = string("{\"code\": 0, \"message\":") + uuid + "\"\"}\n";
-        if (do_task(&req, t) != 0){
+        if (run_task(&req, t) != 0){
             msg = "failed";
+            if (t.status == 503) {
+                // the body is left unread, don't drain it to reuse the connection
+                resp.set_result(503);
+                resp.keep_alive(false);
+                msg = "{\"code\": -1, \"message\": \"" + t.msg + "\"}\n";
+            }
         }
         resp.headers.content_length(msg.size());
         resp.write((void*)msg.data(), msg.size());
         return 0;
     }
 
+    // receives the body of `sock` into `pipe` until its end
+    static void receive_body(IStream *sock, BodyPipe *pipe) {
+        const size_t CHUNK = 64 * 1024;
+        std::unique_ptr<char[]> buf(new char[CHUNK]);
+        while (true) {
+            auto n = sock->read(buf.get(), CHUNK);
+            if (n <= 0) {
+                pipe->finish(n < 0 ? (errno ? errno : EIO) : 0);
+                return;
+            }
+            if (pipe->write(buf.get(), n) != n)
+                return;
+        }
+    }
+
+    // Runs a task once it's admitted, on a worker vcpu if there are any, with
+    // the body received on a thread of its own so that the network and the
+    // decoding overlap.
+    int run_task(IStream *sock, Task &t) {
+        auto budget = m_limiter->acquire(task_memory);
+        if (budget == 0) {
+            t.status = 503;
+            t.msg = "too many tasks";
+            return -1;
+        }
+        DEFER(m_limiter->release(budget));
+        auto home = photon::get_vcpu();
+        if (m_pool) {
+            m_pool->thread_migrate(photon::CURRENT);
+        }
+        DEFER(if (m_pool) photon::thread_migrate(photon::CURRENT, home));
+
+        BodyPipe pipe(std::max(budget / 2, 64UL * 1024));
+        auto receiver = photon::thread_enable_join(
+            photon::thread_create11(&StreamConvertor::receive_body, sock, &pipe));
+        auto ret = do_task(&pipe, t);
+        pipe.close();
+        photon::thread_join(receiver);
+        return ret;
+    }
+
     int do_task(IStream *sock, Task &t) {
 
         struct stat st;
@@ -125,7 +287,7 @@ public:
     void serve(photon::net::ISocketStream *sock) {
 
         Task t;
-        auto ret = do_task(sock, t);
+        auto ret = run_task(sock, t);
         if (ret != 0) {
             sock->close();
         }
@@ -154,6 +316,12 @@ public:
         }
 
         m_fs = photon::fs::new_localfs_adaptor(workdir.c_str());
+        auto nworkers = gconfig.globalConfig().workerThreads();
+        if (nworkers > 0) {
+            m_pool = new photon::WorkPool(nworkers, photon::INIT_EVENT_DEFAULT,
+                                          photon::INIT_IO_NONE, -1);
+            LOG_INFO("run tasks on ` worker vcpus", nworkers);
+        }
         auto uds_handler = [&](photon::net::ISocketStream *s) -> int {
             LOG_INFO("Accept UDS");
             this->serve(s);
@@ -195,10 +363,14 @@ public:
             delete m_tcp_serv;
             delete m_http_serv;
         }
+        delete m_pool;
         return 0;
     }
 
     photon::fs::IFileSystem *m_fs = nullptr;
+    photon::WorkPool *m_pool = nullptr;
+    std::unique_ptr<TaskLimiter> m_limiter;
+    uint64_t task_memory;
     photon::net::ISocketServer *m_uds_serv = nullptr, *m_tcp_serv = nullptr;
     photon::net::http::HTTPServer *m_http_serv = nullptr;
 
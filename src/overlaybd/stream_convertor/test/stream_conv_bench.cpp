@@ -0,0 +1,118 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/fs/localfs.h>
+#include <photon/net/http/client.h>
+#include <photon/thread/thread11.h>
+
+// Posts a gzip'ed tar to a running overlaybd-streamConv by `concurrency`
+// clients at a time, and reports the throughput and latency of the tasks.
+
+DEFINE_bool(ut_pass, false, "pass unit test directly. This suite is only for manual test");
+DEFINE_string(url, "http://127.0.0.1:9101/generateMeta", "address of the convertor");
+DEFINE_string(file, "", "the .tar.gz to post");
+DEFINE_uint64(concurrency, 8, "clients posting at a time");
+DEFINE_uint64(requests, 64, "tasks in all");
+
+using namespace photon::net::http;
+using HTTP_OP = Client::OperationOnStack<64 * 1024 - 1>;
+
+static int post(Client *client, photon::fs::IFile *file, size_t size) {
+    HTTP_OP op(client, Verb::POST, FLAGS_url);
+    op.req.headers.content_length(size);
+    op.req.headers.insert("Content-Type", "application/octet-stream");
+    op.body_writer = [&](Request *req) -> ssize_t {
+        char buf[64 * 1024];
+        size_t sent = 0;
+        while (sent < size) {
+            auto n = file->pread(buf, std::min(sizeof(buf), size - sent), sent);
+            if (n <= 0 || req->write(buf, n) != n) {
+                LOG_ERRNO_RETURN(0, -1, "failed to send body at offset `", sent);
+            }
+            sent += n;
+        }
+        return sent;
+    };
+    op.call();
+    return op.status_code;
+}
+
+int main(int argc, char *argv[]) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    log_output_level = ALOG_INFO;
+    if (FLAGS_ut_pass) {
+        LOG_INFO("pass unit test");
+        return 0;
+    }
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER(photon::fini());
+
+    auto file = photon::fs::open_localfile_adaptor(FLAGS_file.c_str(), O_RDONLY);
+    if (!file) {
+        LOG_ERRNO_RETURN(0, -1, "failed to open `", FLAGS_file);
+    }
+    DEFER(delete file);
+    struct stat st;
+    file->fstat(&st);
+
+    std::vector<uint64_t> latency;
+    uint64_t next = 0, failed = 0, busy = 0;
+    photon::semaphore done;
+    auto begin = photon::now;
+    for (uint64_t i = 0; i < FLAGS_concurrency; i++) {
+        photon::thread_create11([&]() {
+            auto client = new_http_client();
+            DEFER(delete client);
+            while (next < FLAGS_requests) {
+                next++;
+                auto start = photon::now;
+                auto code = post(client, file, st.st_size);
+                if (code == 200) {
+                    latency.push_back(photon::now - start);
+                } else if (code == 503) {
+                    busy++;
+                } else {
+                    failed++;
+                }
+            }
+            done.signal(1);
+        });
+    }
+    done.wait(FLAGS_concurrency);
+    auto elapsed = photon::now - begin;
+
+    std::sort(latency.begin(), latency.end());
+    auto pct = [&](double p) {
+        return latency.empty() ? 0 : latency[std::min(latency.size() - 1,
+                                                      (size_t)(latency.size() * p))] / 1000;
+    };
+    LOG_INFO("` tasks done, ` rejected as busy, ` failed in `ms", latency.size(), busy, failed,
+             elapsed / 1000);
+    LOG_INFO("throughput: ` MB/s, ` tasks/s, latency p50: `ms, p99: `ms",
+             (double)st.st_size * latency.size() / elapsed, latency.size() * 1e6 / elapsed,
+             pct(0.5), pct(0.99));
+    return failed ? -1 : 0;
+}
@@ -23,6 +23,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <utime.h>
+#include <algorithm>
 #include <set>
 #include <string>
 #include <photon/fs/path.h>
@@ -33,6 +34,7 @@
 #include <photon/fs/fiemap.h>
 #include "../lsmt/file.h"
 #include "../lsmt/index.h"
+#include "tar_index.h"
 
 int UnTar::set_file_perms(const char *filename) {
     mode_t mode = header.get_mode();
@@ -101,9 +103,11 @@ int UnTar::set_file_perms(const char *filename) {
     return 0;
 }
 
-ssize_t UnTar::dump_tar_headers(photon::fs::IFile *as) {
+ssize_t UnTar::dump_tar_headers(photon::fs::IFile *as, photon::fs::IFile *index_as) {
     ssize_t count = 0;
+    TarIndexBuilder index;
     while (true) {
+        off_t header_offset = index_as ? file->lseek(0, SEEK_CUR) : 0;
         auto next = read_header(as);
         if (next == -1) {
             return -1;
@@ -111,11 +115,28 @@ ssize_t UnTar::dump_tar_headers(photon::fs::IFile *as) {
             break;
         }
         count++;
+        if (index_as) {
+            auto name = get_pathname();
+            if (name == nullptr) {
+                LOG_ERRNO_RETURN(0, -1, "get filename failed");
+            }
+            TarIndexEntry e;
+            memset(&e, 0, sizeof(e));
+            e.header_offset = header_offset;
+            e.data_offset = file->lseek(0, SEEK_CUR);
+            e.size = TH_ISREG(header) ? get_size() : 0;
+            e.mode = header.get_mode();
+            e.typeflag = TH_ISREG(header) ? REGTYPE : header.typeflag;
+            index.add(name, e);
+        }
         if (TH_ISREG(header)) {
             auto size = get_size();
             file->lseek(((size + T_BLOCKSIZE - 1) / T_BLOCKSIZE) * T_BLOCKSIZE, SEEK_CUR); // skip size
         }
     }
+    if (index_as && index.save(index_as) != 0) {
+        return -1;
+    }
     return count;
 }
 
@@ -123,12 +144,29 @@ int UnTar::extract_all() {
     int i, count = 0;
     unpackedPaths.clear();
     dirs.clear();
+    plan.clear();
+    if (BIT_ISSET(options, TAR_PRUNE) && !BIT_ISSET(options, TAR_NOOVERWRITE) && prune() < 0) {
+        return -1;
+    }
 
+    size_t ord = 0;
     while ((i = read_header()) == 0) {
+        auto todo = ord < plan.size() ? plan[ord] : EXTRACT;
+        ord++;
         auto name = get_pathname(); // cleaned name
         if (name == nullptr) {
             LOG_ERRNO_RETURN(0, -1, "get filename failed");
         }
+        if (todo != EXTRACT) {
+            // whiteouts removed up front still create their parent dir
+            if (todo == WHITEOUT_DONE && mkdir_hier(photon::fs::Path(name).dirname()) < 0) {
+                LOG_ERRNO_RETURN(0, -1, "mkdir failed, filename `", name);
+            }
+            if (TH_ISREG(header) && !from_tar_idx) {
+                file->lseek(((get_size() + T_BLOCKSIZE - 1) / T_BLOCKSIZE) * T_BLOCKSIZE, SEEK_CUR);
+            }
+            continue;
+        }
         if (strcmp(name, "/") == 0) {
             LOG_WARN("file '/' ignored: resolved to root");
             continue;
@@ -279,6 +317,39 @@ int UnTar::extract_regfile_meta_only(const char *filename) {
     return 0;
 }
 
+static bool is_zero(const char *buf, size_t count) {
+    return count == 0 || (buf[0] == 0 && memcmp(buf, buf + 1, count - 1) == 0);
+}
+
+// writes the runs of non-zero blocks of `buf` only, the zero-filled blocks of
+// a newly created file are left as holes, which read as zeros
+static int write_sparse(photon::fs::IFile *fout, const char *buf, size_t count, off_t pos,
+                        size_t blocksize, off_t &written_end) {
+    size_t run = 0, i = 0;
+    while (i < count) {
+        auto n = std::min(blocksize, count - i);
+        if (!is_zero(buf + i, n)) {
+            i += n;
+            continue;
+        }
+        if (i > run) {
+            if (fout->pwrite(buf + run, i - run, pos + run) != (ssize_t)(i - run)) {
+                return -1;
+            }
+            written_end = pos + i;
+        }
+        i += n;
+        run = i;
+    }
+    if (count > run) {
+        if (fout->pwrite(buf + run, count - run, pos + run) != (ssize_t)(count - run)) {
+            return -1;
+        }
+        written_end = pos + count;
+    }
+    return 0;
+}
+
 int UnTar::extract_regfile(const char *filename) {
     if (meta_only) {
         return extract_regfile_meta_only(filename);
@@ -294,7 +365,7 @@ int UnTar::extract_regfile(const char *filename) {
     DEFER({ delete fout; });
 
     char buf[1024 * 1024];
-    off_t pos = 0;
+    off_t pos = 0, written_end = 0;
     size_t left = size;
     while (left > 0) {
         size_t rsz;
@@ -308,13 +379,17 @@ int UnTar::extract_regfile(const char *filename) {
             LOG_ERRNO_RETURN(0, -1, "failed to read block");
         }
         size_t wsz = (left < rsz) ? left : rsz;
-        if (fout->pwrite(buf, wsz, pos) != (ssize_t)wsz) {
+        if (write_sparse(fout, buf, wsz, pos, fs_blocksize, written_end) != 0) {
             LOG_ERRNO_RETURN(0, -1, "failed to write file");
         }
         pos += wsz;
         left -= wsz;
         // LOG_DEBUG(VALUE(rsz), VALUE(wsz), VALUE(pos), VALUE(left));
     }
+    // the trailing hole
+    if (written_end < (off_t)size && fout->ftruncate(size) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to truncate file to `", size);
+    }
     return 0;
 }
 
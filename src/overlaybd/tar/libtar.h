@@ -31,6 +31,7 @@
 #include <string>
 #include <list>
 #include <map>
+#include "path_set.h"
 
 #define T_BLOCKSIZE     512
 #define T_NAMELEN       100
@@ -198,8 +199,9 @@ public:
         }
 
     int extract_all();
-    // return number of objects in this tarfile
-    ssize_t dump_tar_headers(photon::fs::IFile* file);
+    // return number of objects in this tarfile, writing a TarIndex of them
+    // to `index` too if given
+    ssize_t dump_tar_headers(photon::fs::IFile* file, photon::fs::IFile* index = nullptr);
 
 private:
     photon::fs::IFileSystem *fs = nullptr; // target
@@ -207,8 +209,11 @@ private:
     photon::fs::IFile *fs_base_file = nullptr;
     bool meta_only = false;
     bool from_tar_idx = false;
-    std::set<std::string> unpackedPaths;
+    PathSet unpackedPaths;
     std::list<std::pair<std::string, int>> dirs; // <path, utime>
+    // what to do with each entry in turn, by its ordinal, with TAR_PRUNE
+    enum : char { EXTRACT = 0, OVERWRITTEN, WHITEOUT_DONE };
+    std::vector<char> plan;
 
     int extract_file(const char *filename);
     int extract_regfile(const char *filename);
@@ -221,6 +226,8 @@ private:
     int set_file_perms(const char *filename);
     int convert_whiteout(const char *filename);
 
+    int prune();
+    int remove_whiteouts(const std::vector<std::pair<std::string, bool>> &targets);
     int mkdir_hier(const std::string_view &dir);
     int remove_all(const std::string &path, bool rmdir = true);
 };
@@ -234,6 +241,7 @@ private:
 #define TAR_CHECK_VERSION 32  /* check version in file header */
 #define TAR_IGNORE_CRC    64  /* ignore CRC in file header */
 #define TAR_CHECK_EUID   128  /* check effective uid of calling process */
+#define TAR_PRUNE        256  /* scan headers first, skip overwritten entries */
 
 #define BIT_ISSET(bitmask, bit) ((bitmask) & (bit))
 
@@ -0,0 +1,74 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <string.h>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+#include <photon/common/string_view.h>
+
+// A set of the paths unpacked from a layer. The paths are copied into large
+// arena blocks and hashed by views of them, rather than a tree node and a
+// string allocation each as in std::set, which adds up with the hundreds of
+// thousands of files of a big layer.
+class PathSet {
+public:
+    void insert(std::string_view path) {
+        if (contains(path))
+            return;
+        m_set.insert(copy(path));
+    }
+
+    bool contains(std::string_view path) const {
+        return m_set.count(path) != 0;
+    }
+
+    size_t size() const {
+        return m_set.size();
+    }
+
+    void clear() {
+        m_set.clear();
+        m_blocks.clear();
+        m_used = BLOCK_SIZE;
+    }
+
+private:
+    static const size_t BLOCK_SIZE = 256 * 1024;
+
+    std::string_view copy(std::string_view path) {
+        if (path.size() > BLOCK_SIZE) {
+            // a block of its own, keeping the current one open
+            m_blocks.emplace(m_blocks.begin(), new char[path.size()]);
+            memcpy(m_blocks.front().get(), path.data(), path.size());
+            return std::string_view(m_blocks.front().get(), path.size());
+        }
+        if (m_used + path.size() > BLOCK_SIZE) {
+            m_blocks.emplace_back(new char[BLOCK_SIZE]);
+            m_used = 0;
+        }
+        auto p = m_blocks.back().get() + m_used;
+        memcpy(p, path.data(), path.size());
+        m_used += path.size();
+        return std::string_view(p, path.size());
+    }
+
+    std::vector<std::unique_ptr<char[]>> m_blocks;
+    size_t m_used = BLOCK_SIZE;
+    std::unordered_set<std::string_view> m_set;
+};
@@ -0,0 +1,180 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "tar_index.h"
+#include <string.h>
+#include <tar.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <memory>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/checksum/crc32c.h>
+#include <photon/fs/virtual-file.h>
+
+using namespace photon::fs;
+
+// FNV-1a, which is stable across builds unlike std::hash
+uint64_t TarIndex::hash(std::string_view path) {
+    uint64_t h = 14695981039346656037ULL;
+    for (auto c : path) {
+        h = (h ^ (uint8_t)c) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void TarIndexBuilder::add(std::string_view path, const TarIndexEntry &entry) {
+    auto e = entry;
+    e.hash = TarIndex::hash(path);
+    e.name_offset = m_names.size();
+    e.name_len = path.size();
+    m_names.append(path.data(), path.size());
+    auto it = m_pos.find(std::string(path));
+    if (it != m_pos.end()) {
+        m_entries[it->second] = e;
+    } else {
+        m_pos.emplace(std::string(path), m_entries.size());
+        m_entries.push_back(e);
+    }
+}
+
+int TarIndexBuilder::save(IFile *as) {
+    auto name = [&](const TarIndexEntry &e) {
+        return std::string_view(m_names.data() + e.name_offset, e.name_len);
+    };
+    std::sort(m_entries.begin(), m_entries.end(),
+              [&](const TarIndexEntry &a, const TarIndexEntry &b) {
+                  return a.hash != b.hash ? a.hash < b.hash : name(a) < name(b);
+              });
+    // the replaced paths are left out
+    std::string names;
+    for (auto &e : m_entries) {
+        auto n = name(e);
+        e.name_offset = names.size();
+        names.append(n.data(), n.size());
+    }
+
+    TarIndexHeader h;
+    memset(&h, 0, sizeof(h));
+    strncpy(h.magic, TAR_INDEX_MAGIC, sizeof(h.magic));
+    h.version = TAR_INDEX_VERSION;
+    h.entry_size = sizeof(TarIndexEntry);
+    h.count = m_entries.size();
+    h.names_len = names.size();
+    auto entries_len = m_entries.size() * sizeof(TarIndexEntry);
+    h.crc = crc32c_extend(names.data(), names.size(), crc32c(m_entries.data(), entries_len));
+    if (as->pwrite(&h, sizeof(h), 0) != sizeof(h) ||
+        as->pwrite(m_entries.data(), entries_len, sizeof(h)) != (ssize_t)entries_len ||
+        as->pwrite(names.data(), names.size(), sizeof(h) + entries_len) != (ssize_t)names.size()) {
+        LOG_ERRNO_RETURN(0, -1, "failed to write tar index");
+    }
+    LOG_INFO("saved tar index, ` entries", m_entries.size());
+    return 0;
+}
+
+TarIndex *TarIndex::load(IFile *file) {
+    TarIndexHeader h;
+    if (file->pread(&h, sizeof(h), 0) != sizeof(h)) {
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read tar index header");
+    }
+    if (strncmp(h.magic, TAR_INDEX_MAGIC, sizeof(h.magic)) != 0 || h.version != TAR_INDEX_VERSION ||
+        h.entry_size != sizeof(TarIndexEntry)) {
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid tar index header, version: `, entry size: `",
+                         h.version, h.entry_size);
+    }
+    std::unique_ptr<TarIndex> idx(new TarIndex);
+    auto entries_len = h.count * sizeof(TarIndexEntry);
+    idx->m_entries.resize(h.count);
+    idx->m_names.resize(h.names_len);
+    if (file->pread(idx->m_entries.data(), entries_len, sizeof(h)) != (ssize_t)entries_len ||
+        file->pread(&idx->m_names[0], h.names_len, sizeof(h) + entries_len) != (ssize_t)h.names_len) {
+        LOG_ERRNO_RETURN(0, nullptr, "failed to read tar index");
+    }
+    auto crc = crc32c_extend(idx->m_names.data(), h.names_len, crc32c(idx->m_entries.data(), entries_len));
+    if (crc != h.crc) {
+        LOG_ERROR_RETURN(EINVAL, nullptr, "tar index crc mismatch");
+    }
+    for (auto &e : idx->m_entries) {
+        if ((uint64_t)e.name_offset + e.name_len > h.names_len) {
+            LOG_ERROR_RETURN(EINVAL, nullptr, "invalid path of tar index entry");
+        }
+    }
+    return idx.release();
+}
+
+const TarIndexEntry *TarIndex::find(std::string_view path) const {
+    auto h = hash(path);
+    auto it = std::lower_bound(m_entries.begin(), m_entries.end(), h,
+                               [](const TarIndexEntry &e, uint64_t h) { return e.hash < h; });
+    for (; it != m_entries.end() && it->hash == h; ++it) {
+        if (name(*it) == path) {
+            return &*it;
+        }
+    }
+    return nullptr;
+}
+
+class TarMemberFile : public VirtualReadOnlyFile {
+public:
+    TarMemberFile(IFile *tar, const TarIndexEntry &entry) : m_tar(tar), m_entry(entry) {
+    }
+
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        if (offset < 0) {
+            LOG_ERRNO_RETURN(EINVAL, -1, "invalid offset: ` < 0", offset);
+        }
+        if ((uint64_t)offset >= m_entry.size) {
+            return 0;
+        }
+        count = std::min(count, (size_t)(m_entry.size - offset));
+        return m_tar->pread(buf, count, m_entry.data_offset + offset);
+    }
+
+    virtual int fstat(struct stat *buf) override {
+        if (m_tar->fstat(buf) != 0) {
+            return -1;
+        }
+        buf->st_size = m_entry.size;
+        buf->st_mode = S_IFREG | (m_entry.mode & 07777);
+        return 0;
+    }
+
+    virtual IFileSystem *filesystem() override {
+        return nullptr;
+    }
+    virtual int close() override {
+        return 0;
+    }
+
+    UNIMPLEMENTED(ssize_t read(void *buf, size_t count));
+    UNIMPLEMENTED(ssize_t readv(const struct iovec *iov, int iovcnt));
+    UNIMPLEMENTED(off_t lseek(off_t offset, int whence));
+
+private:
+    IFile *m_tar;
+    TarIndexEntry m_entry;
+};
+
+IFile *TarIndex::open(IFile *tar, std::string_view path) const {
+    auto e = find(path);
+    if (e == nullptr) {
+        LOG_ERROR_RETURN(ENOENT, nullptr, "` is not in the tar index", std::string(path));
+    }
+    if (e->typeflag != REGTYPE) {
+        LOG_ERROR_RETURN(EINVAL, nullptr, "` is not a regular file", std::string(path));
+    }
+    return new TarMemberFile(tar, *e);
+}
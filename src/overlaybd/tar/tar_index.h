@@ -0,0 +1,95 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <photon/common/string_view.h>
+#include <photon/fs/filesystem.h>
+
+// A binary index of the entries of a tar, sorted by the hash of their paths,
+// so that a member is found in O(log n) without scanning the tar. The file
+// is a TarIndexHeader, the entries, then the paths they point to.
+
+#define TAR_INDEX_MAGIC "tarindx"
+#define TAR_INDEX_VERSION 1
+
+struct TarIndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entry_size;
+    uint64_t count;
+    uint64_t names_len;
+    uint32_t crc; // crc32c of the entries and the paths
+    char reserved[28];
+} __attribute__((packed));
+
+struct TarIndexEntry {
+    uint64_t hash;          // of the path
+    uint64_t header_offset; // of the first header block of the entry in the tar
+    uint64_t data_offset;   // of the data in the tar
+    uint64_t size;
+    uint32_t name_offset;   // of the path in the path area
+    uint32_t name_len;
+    uint32_t mode;
+    char typeflag;          // REGTYPE for all the regular files
+    char reserved[3];
+} __attribute__((packed));
+
+// collects the entries as the tar is scanned; a path added again replaces
+// the entry before, as it would when the tar is extracted
+class TarIndexBuilder {
+public:
+    void add(std::string_view path, const TarIndexEntry &entry);
+    size_t size() const {
+        return m_entries.size();
+    }
+    int save(photon::fs::IFile *as);
+
+private:
+    std::vector<TarIndexEntry> m_entries;
+    std::string m_names;
+    std::unordered_map<std::string, size_t> m_pos;
+};
+
+class TarIndex {
+public:
+    // loads the whole index of `file`, nullptr if it's not a valid one
+    static TarIndex *load(photon::fs::IFile *file);
+
+    static uint64_t hash(std::string_view path);
+
+    // the entry of `path`, cleaned as the tar headers are, or nullptr
+    const TarIndexEntry *find(std::string_view path) const;
+
+    size_t size() const {
+        return m_entries.size();
+    }
+
+    // a read-only file of the data of `path` in `tar`
+    photon::fs::IFile *open(photon::fs::IFile *tar, std::string_view path) const;
+
+private:
+    std::vector<TarIndexEntry> m_entries;
+    std::string m_names;
+
+    std::string_view name(const TarIndexEntry &e) const {
+        return std::string_view(m_names.data() + e.name_offset, e.name_len);
+    }
+};
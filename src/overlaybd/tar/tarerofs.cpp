@@ -10,8 +10,15 @@
 #include <unistd.h>
 #include <cstdio>
 #include <utime.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <photon/fs/localfs.h>
 #include <photon/fs/path.h>
 #include <photon/common/string_view.h>
@@ -27,6 +34,181 @@
 
 #define LSMT_ALIGNMENT 512
 
+namespace {
+
+const size_t STREAM_CHUNK = 1024 * 1024;
+const size_t STREAM_DEPTH = 8;
+
+typedef std::shared_ptr<std::vector<char>> Chunk;
+
+// a bounded queue of the chunks of the tar stream, between two stages
+class ChunkQueue {
+public:
+    void push(Chunk chunk) {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [&]() { return m_queue.size() < STREAM_DEPTH; });
+        m_queue.push_back(std::move(chunk));
+        m_cv.notify_all();
+    }
+
+    // nullptr once closed and drained
+    Chunk pop() {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        m_cv.wait(lock, [&]() { return !m_queue.empty() || m_closed; });
+        if (m_queue.empty())
+            return nullptr;
+        auto chunk = std::move(m_queue.front());
+        m_queue.pop_front();
+        m_cv.notify_all();
+        return chunk;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_closed = true;
+        m_cv.notify_all();
+    }
+
+private:
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    std::deque<Chunk> m_queue;
+    bool m_closed = false;
+};
+
+// reads the tar at increasing offsets; the extents of the map overlap in their
+// last blocks only, the tail of a file and the head of the next one, so the
+// last block read is kept rather than seeking back, which restarts a gzip stream
+class TarReader {
+public:
+    explicit TarReader(photon::fs::IFile *file) : m_file(file) {
+    }
+
+    // zeros past the end of the tar
+    int read_at(char *buf, size_t count, off_t offset) {
+        size_t done = 0;
+        if (offset < m_tail_off || offset > m_pos) {
+            if (m_file->lseek(offset, SEEK_SET) != offset)
+                LOG_ERRNO_RETURN(0, -1, "failed to seek tar to `", offset);
+            m_pos = m_tail_off = offset;
+            m_tail.clear();
+        } else if (offset < m_pos) {
+            done = std::min<size_t>(count, m_pos - offset);
+            memcpy(buf, m_tail.data() + (offset - m_tail_off), done);
+        }
+        if (done == count)
+            return 0;
+        while (done < count) {
+            auto ret = m_file->read(buf + done, count - done);
+            if (ret < 0)
+                LOG_ERRNO_RETURN(0, -1, "failed to read tar at `", m_pos);
+            if (ret == 0) {
+                memset(buf + done, 0, count - done);
+                break;
+            }
+            done += ret;
+            m_pos += ret;
+        }
+        off_t end = std::min<off_t>(offset + count, m_pos);
+        off_t begin = std::max<off_t>(offset, end - TAREROFS_BLOCK_SIZE);
+        m_tail.assign(buf + (begin - offset), buf + (end - offset));
+        m_tail_off = begin;
+        return 0;
+    }
+
+private:
+    photon::fs::IFile *m_file;
+    off_t m_pos = 0;
+    off_t m_tail_off = 0;
+    std::vector<char> m_tail;
+};
+
+} // namespace
+
+// The tar stream is read from the source (inflating it if it's gzip'ed) here,
+// written to mkfs.erofs, which parses it and emits the metadata in a process
+// of its own, and passed to the stream hook, each on a thread of its own, so
+// that a big layer is converted at the pace of the slowest stage rather than
+// of all of them in a row.
+int TarErofs::feed_mkfs(FILE *fp) {
+    ChunkQueue to_mkfs, to_hook;
+    std::atomic<bool> failed{false};
+    std::thread writer([&]() {
+        while (auto chunk = to_mkfs.pop()) {
+            // keep draining, so that the reader doesn't wait for us
+            if (!failed && fwrite(chunk->data(), chunk->size(), 1, fp) != 1) {
+                LOG_ERROR("failed to write tar stream to mkfs.erofs");
+                failed = true;
+            }
+        }
+    });
+    std::thread hook;
+    if (stream_hook) {
+        hook = std::thread([&]() {
+            while (auto chunk = to_hook.pop()) {
+                stream_hook(chunk->data(), chunk->size());
+            }
+        });
+    }
+
+    ssize_t read = 0;
+    while (!failed) {
+        auto chunk = std::make_shared<std::vector<char>>(STREAM_CHUNK);
+        read = file->read(chunk->data(), chunk->size());
+        if (read <= 0)
+            break;
+        chunk->resize(read);
+        if (stream_hook)
+            to_hook.push(chunk);
+        to_mkfs.push(std::move(chunk));
+    }
+    to_mkfs.close();
+    to_hook.close();
+    writer.join();
+    if (hook.joinable())
+        hook.join();
+    if (read < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to read tar stream");
+    return failed ? -1 : 0;
+}
+
+// The extents are copied in the order of the tar, one after another, and an
+// extent sharing the data of the previous one, e.g. of a hard link, shares
+// its copy too.
+int TarErofs::copy_aligned(std::vector<Extent> &extents) {
+    std::vector<Extent *> order;
+    for (auto &e : extents)
+        order.push_back(&e);
+    std::stable_sort(order.begin(), order.end(),
+                     [](const Extent *a, const Extent *b) { return a->toff < b->toff; });
+    if (file->lseek(0, SEEK_SET) != 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to rewind tar, which is read again for aligned data");
+    TarReader reader(file);
+    std::vector<char> buf(STREAM_CHUNK);
+    uint64_t cursor = 0, prev_toff = UINT64_MAX, prev_aligned = 0;
+    uint32_t prev_nblocks = 0;
+    for (auto e : order) {
+        if (e->toff == prev_toff && e->nblocks <= prev_nblocks) {
+            e->toff = prev_aligned;
+            continue;
+        }
+        uint64_t count = (uint64_t)e->nblocks * TAREROFS_BLOCK_SIZE;
+        for (uint64_t done = 0; done < count; done += buf.size()) {
+            auto n = std::min<uint64_t>(buf.size(), count - done);
+            if (reader.read_at(buf.data(), n, e->toff + done) < 0)
+                return -1;
+            if (aligned_target->pwrite(buf.data(), n, cursor + done) != (ssize_t)n)
+                LOG_ERRNO_RETURN(0, -1, "failed to write aligned data at `", cursor + done);
+        }
+        prev_toff = e->toff;
+        prev_nblocks = e->nblocks;
+        prev_aligned = e->toff = cursor;
+        cursor += count;
+    }
+    LOG_INFO("copied ` extents of file data to ` bytes of aligned target", extents.size(), cursor);
+    return 0;
+}
+
 int TarErofs::extract_all() {
     ssize_t read;
     struct stat st;
@@ -84,12 +266,7 @@ int TarErofs::extract_all() {
          return -1;
     }
 
-    while ((read = file->read(buf, sizeof(buf))) > 0) {
-        if (fwrite(buf, read, 1, fp) != 1) {
-            read = -1;
-            break;
-        }
-    }
+    read = feed_mkfs(fp);
     status = pclose(fp);
 
     if (!first_layer)
@@ -124,16 +301,23 @@ int TarErofs::extract_all() {
        LOG_ERROR("unable to get upper.map, ignored");
        return -1;
     }
+    std::vector<Extent> extents;
     while (fscanf(fp, "%" PRIx64" %x %" PRIx64 "\n", &blkaddr, &nblocks, &toff) >= 3) {
+        extents.push_back({blkaddr, nblocks, toff});
+    }
+    fclose(fp);
+    if (aligned_target && copy_aligned(extents) < 0) {
+        LOG_ERROR_RETURN(0, -1, "failed to copy file data to aligned target");
+    }
+    for (auto &e : extents) {
         LSMT::RemoteMapping lba;
-        lba.offset = blkaddr * TAREROFS_BLOCK_SIZE;
-        lba.count = nblocks * TAREROFS_BLOCK_SIZE;
-        lba.roffset = toff;
+        lba.offset = e.blkaddr * TAREROFS_BLOCK_SIZE;
+        lba.count = e.nblocks * TAREROFS_BLOCK_SIZE;
+        lba.roffset = e.toff;
         int nwrite = fout->ioctl(LSMT::IFileRW::RemoteData, lba);
         if ((unsigned) nwrite != lba.count) {
             LOG_ERRNO_RETURN(0, -1, "failed to write lba");
         }
     }
-    fclose(fp);
     return 0;
 }
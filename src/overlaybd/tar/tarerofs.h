@@ -15,6 +15,7 @@
 #include <set>
 #include <vector>
 #include <string>
+#include <functional>
 #include <list>
 #include <map>
 
@@ -26,12 +27,37 @@ public:
 
     int extract_all();
 
+    // `hook` is called with the tar stream as it's fed to mkfs.erofs, on a
+    // thread of its own, e.g. to digest the layer
+    void set_stream_hook(std::function<void(const char *, size_t)> hook) {
+        stream_hook = std::move(hook);
+    }
+
+    // copies the file data to `target` at 4K aligned offsets and maps the
+    // blocks there instead of to the offsets in the tar, which are 512B
+    // aligned only, so that a block read of the layer is a single aligned
+    // read of the target; the source is read again for it, so it must be
+    // seekable (a tar or gzip file, not a pipe)
+    void set_aligned_target(photon::fs::IFile *target) {
+        aligned_target = target;
+    }
+
 private:
     photon::fs::IFile *file = nullptr;     // source
     photon::fs::IFile *fout = nullptr; // target
     photon::fs::IFile *fs_base_file = nullptr;
     bool meta_only;
     bool first_layer;
-    std::set<std::string> unpackedPaths;
     std::list<std::pair<std::string, int>> dirs; // <path, utime>
+    std::function<void(const char *, size_t)> stream_hook;
+    photon::fs::IFile *aligned_target = nullptr;
+
+    struct Extent {
+        uint64_t blkaddr;
+        uint32_t nblocks;
+        uint64_t toff;
+    };
+
+    int feed_mkfs(FILE *fp);
+    int copy_aligned(std::vector<Extent> &extents);
 };
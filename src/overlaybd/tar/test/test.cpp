@@ -26,6 +26,7 @@
 #include "../../gzindex/gzfile.h"
 #include "../../lsmt/file.h"
 #include "../libtar.h"
+#include "../tar_index.h"
 #include "../tar_file.cpp"
 #include "../../gzip/gz.h"
 #include "../../../tools/sha256file.h"
@@ -175,6 +176,72 @@ TEST_F(TarTest, untar) {
     delete tar;
 }
 
+TEST_F(TarTest, untar_sparse) {
+    // zero-filled blocks at the head, in the middle and at the tail
+    std::vector<char> data(10 * 4096 + 100, 0);
+    for (size_t i = 2 * 4096; i < 5 * 4096 + 17; i++) {
+        data[i] = 'a' + i % 26;
+    }
+    data[8 * 4096 + 1] = 'z';
+    ASSERT_EQ(0, system(("mkdir -p " + workdir + "/sparse_src").c_str()));
+    auto src = fs->open("sparse_src/data", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ASSERT_NE(nullptr, src);
+    ASSERT_EQ((ssize_t)data.size(), src->pwrite(data.data(), data.size(), 0));
+    delete src;
+    ASSERT_EQ(0, system(("tar -C " + workdir + "/sparse_src -cf " + workdir + "/sparse.tar data").c_str()));
+
+    auto tarf = fs->open("sparse.tar", O_RDONLY, 0666);
+    ASSERT_NE(nullptr, tarf);
+    DEFER(delete tarf);
+    fs->mkdir("sparse_dst", 0755);
+    auto target = photon::fs::new_subfs(fs, "sparse_dst", false);
+    ASSERT_NE(nullptr, target);
+    DEFER(delete target);
+    auto tar = new UnTar(tarf, target, 0);
+    EXPECT_EQ(0, tar->extract_all());
+    delete tar;
+
+    auto dst = target->open("data", O_RDONLY);
+    ASSERT_NE(nullptr, dst);
+    DEFER(delete dst);
+    struct stat st;
+    ASSERT_EQ(0, dst->fstat(&st));
+    EXPECT_EQ((off_t)data.size(), st.st_size);
+    std::vector<char> out(data.size());
+    ASSERT_EQ((ssize_t)data.size(), dst->pread(out.data(), out.size(), 0));
+    EXPECT_EQ(0, memcmp(data.data(), out.data(), data.size()));
+}
+
+TEST_F(TarTest, untar_prune) {
+    auto sh = [&](const std::string &cmd) { return system(("cd " + workdir + " && " + cmd).c_str()); };
+    ASSERT_EQ(0, sh("rm -rf prune_* && mkdir -p prune_lower/gone prune_lower/opq prune_src/opq prune_src2"));
+    ASSERT_EQ(0, sh("echo x > prune_lower/gone/x && echo y > prune_lower/opq/y && echo k > prune_lower/keep"));
+    // f and h1 are overwritten by the appended ones, h1 is linked to before
+    ASSERT_EQ(0, sh("cd prune_src && touch .wh.gone opq/.wh..wh..opq && echo z > opq/z && "
+                    "echo f1 > f && echo h1 > h1 && ln h1 hl"));
+    ASSERT_EQ(0, sh("echo f2 > prune_src2/f && echo h2 > prune_src2/h1"));
+    ASSERT_EQ(0, sh("tar -C prune_src -cf prune.tar .wh.gone opq f h1 hl && "
+                    "tar -C prune_src2 -rf prune.tar f h1"));
+    ASSERT_EQ(0, sh("cp -a prune_lower prune_plain && cp -a prune_lower prune_pruned"));
+
+    for (auto opt : {0, TAR_PRUNE}) {
+        auto tarf = fs->open("prune.tar", O_RDONLY, 0666);
+        ASSERT_NE(nullptr, tarf);
+        DEFER(delete tarf);
+        auto target = photon::fs::new_subfs(fs, opt ? "prune_pruned" : "prune_plain", false);
+        ASSERT_NE(nullptr, target);
+        DEFER(delete target);
+        auto tar = new UnTar(tarf, target, opt);
+        EXPECT_EQ(0, tar->extract_all());
+        delete tar;
+    }
+    EXPECT_EQ(0, sh("diff -r prune_plain prune_pruned"));
+    EXPECT_NE(0, sh("test -e prune_pruned/gone"));
+    EXPECT_NE(0, sh("test -e prune_pruned/opq/y"));
+    EXPECT_EQ(0, sh("test -e prune_pruned/keep && test -e prune_pruned/opq/z"));
+    EXPECT_EQ(0, sh("grep -q f2 prune_pruned/f && grep -q h2 prune_pruned/h1 && grep -q h1 prune_pruned/hl"));
+}
+
 TEST_F(TarTest, tar_meta) {
     // set_log_output_level(0);
     ASSERT_EQ(0, download_decomp("https://dadi-shared.oss-cn-beijing.aliyuncs.com/go1.17.6.linux-amd64.tar.gz"));
@@ -218,6 +285,50 @@ TEST_F(TarTest, tar_meta) {
 
 }
 
+TEST_F(TarTest, tar_index) {
+    ASSERT_EQ(0, system(("mkdir -p " + workdir + "/index_src/dir && cd " + workdir +
+                         "/index_src && for i in $(seq 1 200); do head -c $((i * 97)) /dev/urandom > dir/f$i; done && "
+                         "echo old > dir/f7 && ln -sf f1 dir/link && tar -cf ../index.tar dir && "
+                         "echo new > dir/f7 && tar -rf ../index.tar dir/f7").c_str()));
+    auto tarf = fs->open("index.tar", O_RDONLY, 0666);
+    ASSERT_NE(nullptr, tarf);
+    DEFER(delete tarf);
+    auto meta = fs->open("index.tar.meta", O_TRUNC | O_CREAT | O_RDWR, 0644);
+    auto index_file = fs->open("index.tar.index", O_TRUNC | O_CREAT | O_RDWR, 0644);
+    ASSERT_NE(nullptr, meta);
+    ASSERT_NE(nullptr, index_file);
+    DEFER(delete meta);
+    DEFER(delete index_file);
+    auto tar = new UnTar(tarf, nullptr, 0);
+    EXPECT_EQ(203, tar->dump_tar_headers(meta, index_file));
+    delete tar;
+
+    std::unique_ptr<TarIndex> index(TarIndex::load(index_file));
+    ASSERT_NE(nullptr, index);
+    // dir, 200 files and a link, with f7 replaced
+    EXPECT_EQ(202UL, index->size());
+    EXPECT_EQ(nullptr, index->find("dir/f0"));
+    EXPECT_EQ(nullptr, index->open(tarf, "dir/link"));
+    ASSERT_NE(nullptr, index->find("dir/link"));
+    EXPECT_EQ(SYMTYPE, index->find("dir/link")->typeflag);
+
+    char buf[200 * 97], expected[200 * 97];
+    for (int i = 1; i <= 200; i++) {
+        auto fn = "dir/f" + std::to_string(i);
+        std::unique_ptr<photon::fs::IFile> member(index->open(tarf, fn));
+        ASSERT_NE(nullptr, member);
+        auto src = fs->open(("index_src/" + fn).c_str(), O_RDONLY);
+        ASSERT_NE(nullptr, src);
+        auto n = src->pread(expected, sizeof(expected), 0);
+        delete src;
+        struct stat st;
+        ASSERT_EQ(0, member->fstat(&st));
+        EXPECT_EQ(n, st.st_size);
+        EXPECT_EQ(n, member->pread(buf, sizeof(buf), 0));
+        EXPECT_EQ(0, memcmp(buf, expected, n));
+    }
+}
+
 TEST_F(TarTest, stream) {
     set_log_output_level(1);
     std::string fn_test_tgz = "go1.17.6.linux-amd64.tar.gz";
@@ -372,6 +483,28 @@ TEST_F(TarTest, tar_header_check) {
     EXPECT_EQ(FILE_SIZE, ret);
 }
 
+TEST(PathSetTest, insert) {
+    PathSet paths;
+    std::vector<std::string> names;
+    for (int i = 0; i < 100000; i++) {
+        names.push_back("/usr/lib/node_modules/pkg" + std::to_string(i) + "/index.js");
+    }
+    names.push_back(std::string(300 * 1024, 'x'));
+    for (auto &n : names) {
+        paths.insert(n);
+    }
+    paths.insert(names[0]);
+    EXPECT_EQ(names.size(), paths.size());
+    for (auto &n : names) {
+        EXPECT_TRUE(paths.contains(n));
+    }
+    EXPECT_FALSE(paths.contains("/usr/lib/node_modules/pkg100000/index.js"));
+    EXPECT_FALSE(paths.contains("/usr/lib/node_modules/pkg1"));
+    paths.clear();
+    EXPECT_EQ(0UL, paths.size());
+    EXPECT_FALSE(paths.contains(names[0]));
+}
+
 TEST(CleanNameTest, clean_name) {
     char name[256] = {0};
     char *cname;
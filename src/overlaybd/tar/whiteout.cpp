@@ -8,6 +8,7 @@
 #include <dirent.h>
 #include <string>
 #include <set>
+#include <unordered_map>
 #include <photon/fs/path.h>
 #include <photon/fs/filesystem.h>
 #include <photon/common/alog.h>
@@ -53,7 +54,7 @@ int UnTar::remove_all(const std::string &path, bool rmdir) {
     struct stat statBuf;
     if (fs->lstat(path.c_str(), &statBuf) == 0) { // get stat
         if (S_ISDIR(statBuf.st_mode) == 0) {      // not dir
-            if (unpackedPaths.find(path) == unpackedPaths.end()) {
+            if (!unpackedPaths.contains(path)) {
                 fs->unlink(path.c_str());
             }
             return 0;
@@ -75,7 +76,7 @@ int UnTar::remove_all(const std::string &path, bool rmdir) {
     }
 
     fs->closedir(dirs);
-    if (rmdir && unpackedPaths.find(path) == unpackedPaths.end()) {
+    if (rmdir && !unpackedPaths.contains(path)) {
         fs->rmdir(path.c_str());
     }
 
@@ -106,3 +107,139 @@ int UnTar::convert_whiteout(const char *filename) {
     }
     return 0;
 }
+
+// Scans the headers of the whole tar before it's extracted, so that
+//  - an entry overwritten by a later one of the same path is left out, if
+//    neither is a dir (replacing a dir removes what's under it, which the
+//    entry left out would have done) and no hardlink to it comes between;
+//  - the whiteouts are applied all up front, those under the target of
+//    another one left out, unless an entry of this layer they'd have left
+//    alone comes before them, as whiteouts don't remove the entries of their
+//    own layer.
+// The tar is rewound for the extraction; if it can't be, nothing's pruned.
+int UnTar::prune() {
+    if (file->lseek(0, SEEK_SET) != 0) {
+        LOG_WARN("tar is not seekable, extract it without pruning");
+        return 0;
+    }
+    struct Holder {
+        size_t ord;
+        bool pinned;
+    };
+    std::unordered_map<std::string, Holder> holders; // of the non-dir paths
+    // the paths of the entries and hardlink targets so far, and their parents
+    PathSet touched, parents;
+    auto touch = [&](const std::string &path) {
+        touched.insert(path);
+        for (auto pos = path.rfind('/'); pos != std::string::npos && pos > 0;
+             pos = path.rfind('/', pos - 1)) {
+            parents.insert(std::string_view(path.data(), pos));
+        }
+    };
+    std::vector<std::pair<std::string, bool>> whiteouts; // <target, opaque>
+    size_t overwritten = 0;
+    int i;
+    while ((i = read_header()) == 0) {
+        auto ord = plan.size();
+        plan.push_back(EXTRACT);
+        auto name = get_pathname();
+        if (name == nullptr) {
+            LOG_ERRNO_RETURN(0, -1, "get filename failed");
+        }
+        if (TH_ISREG(header) && !from_tar_idx) {
+            file->lseek(((get_size() + T_BLOCKSIZE - 1) / T_BLOCKSIZE) * T_BLOCKSIZE, SEEK_CUR);
+        }
+        std::string path(name);
+        if (path == "/") {
+            continue;
+        }
+
+        photon::fs::Path p(name);
+        auto base = p.basename();
+        bool opaque = base == whiteoutOpaqueDir;
+        if (opaque || base.substr(0, whiteoutPrefix.size()) == whiteoutPrefix) {
+            auto dir = std::string(p.dirname());
+            auto target = opaque ? remove_last_slash(dir)
+                                 : dir + std::string(base.substr(whiteoutPrefix.size()));
+            if (target.empty() || parents.contains(target) ||
+                (!opaque && touched.contains(target))) {
+                // in its turn, it may remove what the entries left out
+                // before it would have kept
+                for (auto &h : holders) {
+                    h.second.pinned = true;
+                }
+            } else {
+                whiteouts.emplace_back(target, opaque);
+                plan[ord] = WHITEOUT_DONE;
+            }
+            continue;
+        }
+
+        auto it = holders.find(path);
+        if (it != holders.end()) {
+            if (!TH_ISDIR(header) && !it->second.pinned) {
+                plan[it->second.ord] = OVERWRITTEN;
+                overwritten++;
+            }
+            holders.erase(it);
+        }
+        if (!TH_ISDIR(header)) {
+            holders.emplace(path, Holder{ord, false});
+        }
+        if (TH_ISLNK(header)) {
+            std::string target(get_linkname());
+            auto lt = holders.find(target);
+            if (lt != holders.end()) {
+                lt->second.pinned = true;
+            }
+            touch(target);
+        }
+        touch(path);
+    }
+    if (i != 1) {
+        LOG_ERROR_RETURN(0, -1, "failed to scan tar headers");
+    }
+    if (remove_whiteouts(whiteouts) != 0) {
+        return -1;
+    }
+    if (file->lseek(0, SEEK_SET) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to rewind tar");
+    }
+    LOG_INFO("pruned: ` of ` entries overwritten, ` whiteouts applied up front", overwritten,
+             plan.size(), whiteouts.size());
+    return 0;
+}
+
+// removes the targets of `whiteouts` <target, opaque> in the order of their
+// paths, leaving out those under the target of another one
+int UnTar::remove_whiteouts(const std::vector<std::pair<std::string, bool>> &whiteouts) {
+    std::set<std::pair<std::string, bool>> targets(whiteouts.begin(), whiteouts.end());
+    auto covered = [&](const std::string &path, bool opaque) {
+        // the dir is removed as a whole
+        if (opaque && targets.count({path, false})) {
+            return true;
+        }
+        for (auto pos = path.rfind('/'); pos != std::string::npos && pos > 0;
+             pos = path.rfind('/', pos - 1)) {
+            auto parent = path.substr(0, pos);
+            if (targets.count({parent, false}) || targets.count({parent, true})) {
+                return true;
+            }
+        }
+        return false;
+    };
+    for (auto &t : targets) {
+        if (covered(t.first, t.second)) {
+            continue;
+        }
+        struct stat buf;
+        if (fs->lstat(t.first.c_str(), &buf) != 0) {
+            if (errno == ENOENT) {
+                continue;
+            }
+            LOG_ERRNO_RETURN(0, -1, "failed to lstat `", t.first);
+        }
+        remove_all(t.first, !t.second);
+    }
+    return 0;
+}
@@ -20,8 +20,13 @@
 #include <photon/common/alog.h>
 #include <memory>
 #include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
 #include <zstd.h>
+#include <zdict.h>
 #include <sys/fcntl.h>
+#include <sys/stat.h>
 #include "photon/fs/filesystem.h"
 
 #ifdef ENABLE_QAT
@@ -66,6 +71,15 @@ public:
         return 1;
     }
 
+    // batches larger than nbatch() are also accepted, e.g. by parallel
+    // decompression, which processes them block by block
+    void reserve_batch(size_t n) {
+        if (compressed_data.size() < n) {
+            compressed_data.resize(n);
+            uncompressed_data.resize(n);
+        }
+    }
+
     virtual int do_compress(size_t *src_chunk_len /* uncompressed length per block */,
                             size_t *dst_chunk_len, size_t dst_buffer_capacity, size_t nblock) = 0;
 
@@ -89,6 +103,7 @@ public:
         if (dst_buffer_capacity / n < max_dst_size) {
             LOG_ERROR_RETURN(ENOBUFS, -1, "dst_len should be greater than `", max_dst_size - 1);
         }
+        reserve_batch(n);
         off_t src_offset = 0, dst_offset = 0;
         for (size_t i = 0; i < n; i++) {
             uncompressed_data[i] = ((unsigned char *)src + src_offset);
@@ -117,6 +132,7 @@ public:
                              "dst_len (`) should be greater than compressed block size `",
                              dst_buffer_capacity / n, src_blk_size);
         }
+        reserve_batch(n);
         off_t src_offset = 0, dst_offset = 0;
         for (size_t i = 0; i < n; i++) {
             compressed_data[i] = ((unsigned char *)src + src_offset);
@@ -198,12 +214,16 @@ public:
         int ret = 0;
 #ifdef ENABLE_QAT
         if (qat_enable) {
-            ret = LZ4_compress_qat(pQat, &raw_data[0], src_chunk_len, &compressed_data[0],
-                                   dst_chunk_len, n);
-            if (ret < 0) {
+            for (size_t i = 0; i < nblock; i++)
+                dst_chunk_len[i] = dst_buffer_capacity / nblock;
+            ret = LZ4_compress_qat(pQat, &uncompressed_data[0], src_chunk_len, &compressed_data[0],
+                                   dst_chunk_len, nblock);
+            if (ret == 0)
+                return 0;
+            if (ret != -EBUSY) {
                 LOG_ERROR_RETURN(EFAULT, -1, "LZ4 compress data failed. (retcode: `).", ret);
             }
-            return ret;
+            // the device queue is full, compress by cpu
         }
 #endif
         for (size_t i = 0; i < nblock; i++) {
@@ -230,12 +250,16 @@ public:
         int ret = 0;
 #ifdef ENABLE_QAT
         if (qat_enable) {
+            for (size_t i = 0; i < n; i++)
+                dst_chunk_len[i] = dst_buffer_capacity / n;
             ret = LZ4_decompress_qat(pQat, &compressed_data[0], src_chunk_len,
                                      &uncompressed_data[0], dst_chunk_len, n);
-            if (ret < 0) {
+            if (ret == 0)
+                return 0;
+            if (ret != -EBUSY) {
                 LOG_ERROR_RETURN(EFAULT, -1, "LZ4 decompress data failed. (retcode: `).", ret);
             }
-            return ret;
+            // the device queue is full, decompress by cpu
         }
 #endif
         for (size_t i = 0; i < n; i++) {
@@ -259,8 +283,48 @@ public:
 class Compressor_zstd : public BaseCompressor {
 public:
     static const int cLevel = 3;
+    int m_level = cLevel;
+
+    // the dictionary stored in the zfile, if any
+    ZSTD_CCtx *m_cctx = nullptr;
+    ZSTD_DCtx *m_dctx = nullptr;
+    ZSTD_CDict *m_cdict = nullptr;
+    ZSTD_DDict *m_ddict = nullptr;
 
     ~Compressor_zstd() {
+        ZSTD_freeCDict(m_cdict);
+        ZSTD_freeDDict(m_ddict);
+        ZSTD_freeCCtx(m_cctx);
+        ZSTD_freeDCtx(m_dctx);
+    }
+
+    int load_dict(const CompressArgs *args) {
+        auto size = args->opt.dict_size;
+        if (size == 0) {
+            LOG_ERROR_RETURN(EINVAL, -1, "dictionary is enabled but its size is 0");
+        }
+        const unsigned char *dict = args->dict_buf.get();
+        std::unique_ptr<unsigned char[]> buf;
+        if (dict == nullptr) {
+            if (args->fdict == nullptr) {
+                LOG_ERROR_RETURN(EINVAL, -1, "dictionary is enabled but not given");
+            }
+            buf.reset(new unsigned char[size]);
+            if (args->fdict->pread(buf.get(), size, 0) != (ssize_t)size) {
+                LOG_ERRNO_RETURN(0, -1, "failed to read dictionary");
+            }
+            dict = buf.get();
+        }
+        // both of the digested dictionaries keep their own copies
+        m_cdict = ZSTD_createCDict(dict, size, m_level);
+        m_ddict = ZSTD_createDDict(dict, size);
+        m_cctx = ZSTD_createCCtx();
+        m_dctx = ZSTD_createDCtx();
+        if (!m_cdict || !m_ddict || !m_cctx || !m_dctx) {
+            LOG_ERROR_RETURN(ENOMEM, -1, "failed to create ZSTD dictionary (size: `)", size);
+        }
+        LOG_INFO("ZSTD dictionary loaded (size: `, id: `)", size, ZSTD_getDictID_fromDDict(m_ddict));
+        return 0;
     }
 
     virtual int init(const CompressArgs *args) override {
@@ -273,6 +337,11 @@ public:
                              "Compression type invalid.(expected: CompressionOptions::ZSTD)");
         }
         max_dst_size = ZSTD_compressBound(src_blk_size);
+        if (opt->level)
+            m_level = opt->level;
+        if (opt->use_dict && load_dict(args) != 0) {
+            return -1;
+        }
         return 0;
     }
 
@@ -281,7 +350,9 @@ public:
         if (dst_len < max_dst_size) {
             LOG_ERROR_RETURN(ENOBUFS, -1, "dst_len should be greater than `", max_dst_size - 1);
         }
-        size_t cSize = ZSTD_compress(dst, dst_len, src, src_len, cLevel);
+        size_t cSize = m_cdict ? ZSTD_compress_usingCDict(m_cctx, dst, dst_len, src, src_len,
+                                                          m_cdict)
+                               : ZSTD_compress(dst, dst_len, src, src_len, m_level);
         if (ZSTD_isError(cSize)) {
             LOG_ERROR_RETURN(0, -1, "compress error: `", ZSTD_getErrorName(cSize));
         }
@@ -310,17 +381,12 @@ public:
 
         int ret = 0;
         for (size_t i = 0; i < nblock; i++) {
-            ret = decompress((const unsigned char *)uncompressed_data[i], src_chunk_len[i],
-                             compressed_data[i], dst_buffer_capacity / nblock);
+            ret = decompress((const unsigned char *)compressed_data[i], src_chunk_len[i],
+                             uncompressed_data[i], dst_buffer_capacity / nblock);
 
             dst_chunk_len[i] = ret;
-            if (ret < 0) {
-                LOG_ERROR_RETURN(EFAULT, -1, "LZ4 compress data failed. (retcode: `).", ret);
-            }
-            if (ret == 0) {
-                LOG_ERROR_RETURN(
-                    EFAULT, -1,
-                    "Compression worked, but was stopped because the *dst couldn't hold all the information.");
+            if (ret <= 0) {
+                LOG_ERROR_RETURN(EFAULT, -1, "ZSTD decompress data failed. (retcode: `).", ret);
             }
         }
         return 0;
@@ -333,7 +399,9 @@ public:
                              dst_len, src_blk_size);
         }
 
-        size_t ret = ZSTD_decompress(dst, dst_len, src, src_len);
+        size_t ret = m_ddict ? ZSTD_decompress_usingDDict(m_dctx, dst, dst_len, src, src_len,
+                                                          m_ddict)
+                             : ZSTD_decompress(dst, dst_len, src, src_len);
         if (ZSTD_isError(ret)) {
             LOG_ERROR_RETURN(0, -1, "decompress error: `", ZSTD_getErrorName(ret));
         }
@@ -341,10 +409,134 @@ public:
     }
 };
 
+// picks the codec per block: a block is stored as is if LZ4 can't save 1/8 of it,
+// otherwise it's compressed by ZSTD if that saves another 1/8 over LZ4, or by LZ4;
+// the 1st byte of each compressed block tells the codec
+class Compressor_adaptive : public BaseCompressor {
+public:
+    static const uint8_t STORED = 0;
+    static const uint8_t LZ4 = 1;
+    static const uint8_t ZSTD = 2;
+
+    LZ4Compressor m_lz4;
+    Compressor_zstd m_zstd;
+    std::unique_ptr<unsigned char[]> m_zbuf; // ZSTD output, to compare with LZ4's
+    uint64_t m_nblocks[3] = {0};
+
+    ~Compressor_adaptive() {
+        if (m_nblocks[STORED] + m_nblocks[LZ4] + m_nblocks[ZSTD])
+            LOG_INFO("adaptive compression done. (stored: `, lz4: `, zstd: `)",
+                     m_nblocks[STORED], m_nblocks[LZ4], m_nblocks[ZSTD]);
+    }
+
+    virtual int init(const CompressArgs *args) override {
+        if (BaseCompressor::init(args) != 0) {
+            LOG_ERROR_RETURN(EINVAL, -1, "BaseCompressor init failed");
+        }
+        if (args->opt.algo != CompressOptions::ADAPTIVE) {
+            LOG_ERROR_RETURN(EINVAL, -1,
+                             "Compression type invalid.(expected: CompressionOptions::ADAPTIVE)");
+        }
+        CompressOptions opt = args->opt;
+        opt.algo = CompressOptions::LZ4;
+        opt.use_dict = 0;
+        CompressArgs lz4_args(opt);
+        if (m_lz4.init(&lz4_args) != 0) {
+            return -1;
+        }
+        // the dictionary, if any, is for ZSTD
+        opt.algo = CompressOptions::ZSTD;
+        opt.use_dict = args->opt.use_dict;
+        unsigned char *dict = nullptr;
+        if (args->dict_buf) {
+            dict = new unsigned char[opt.dict_size];
+            memcpy(dict, args->dict_buf.get(), opt.dict_size);
+        }
+        CompressArgs zstd_args(opt, args->fdict, dict);
+        zstd_args.opt.use_dict = opt.use_dict;
+        if (m_zstd.init(&zstd_args) != 0) {
+            return -1;
+        }
+        m_zbuf.reset(new unsigned char[m_zstd.max_dst_size]);
+        max_dst_size = 1 + std::max({m_lz4.max_dst_size, m_zstd.max_dst_size, src_blk_size});
+        return 0;
+    }
+
+    virtual int do_compress(size_t *src_chunk_len, size_t *dst_chunk_len,
+                            size_t dst_buffer_capacity, size_t nblock) override {
+        for (size_t i = 0; i < nblock; i++) {
+            auto src = uncompressed_data[i];
+            auto dst = compressed_data[i];
+            auto n = src_chunk_len[i];
+            auto ret = m_lz4.compress(src, n, dst + 1, dst_buffer_capacity / nblock - 1);
+            if (ret < 0) {
+                LOG_ERROR_RETURN(EFAULT, -1, "LZ4 compress data failed. (retcode: `).", ret);
+            }
+            if ((size_t)ret * 8 >= n * 7) {
+                dst[0] = STORED;
+                memcpy(dst + 1, src, n);
+                ret = n;
+            } else {
+                dst[0] = LZ4;
+                auto zret = m_zstd.compress(src, n, m_zbuf.get(), m_zstd.max_dst_size);
+                if (zret > 0 && zret * 8 <= ret * 7) {
+                    dst[0] = ZSTD;
+                    memcpy(dst + 1, m_zbuf.get(), zret);
+                    ret = zret;
+                }
+            }
+            m_nblocks[dst[0]]++;
+            dst_chunk_len[i] = ret + 1;
+        }
+        return 0;
+    }
+
+    virtual int do_decompress(size_t *src_chunk_len, size_t *dst_chunk_len,
+                              size_t dst_buffer_capacity, size_t nblock) override {
+        for (size_t i = 0; i < nblock; i++) {
+            auto src = compressed_data[i];
+            auto dst = uncompressed_data[i];
+            auto len = src_chunk_len[i];
+            auto cap = dst_buffer_capacity / nblock;
+            if (len < 2) {
+                LOG_ERROR_RETURN(EFAULT, -1, "invalid compressed block size `", len);
+            }
+            int ret = -1;
+            switch (src[0]) {
+            case STORED:
+                if (len - 1 > cap) {
+                    LOG_ERROR_RETURN(EFAULT, -1, "stored block is larger than ` bytes", cap);
+                }
+                memcpy(dst, src + 1, len - 1);
+                ret = len - 1;
+                break;
+            case LZ4:
+                ret = m_lz4.decompress(src + 1, len - 1, dst, cap);
+                break;
+            case ZSTD:
+                ret = m_zstd.decompress(src + 1, len - 1, dst, cap);
+                break;
+            default:
+                LOG_ERROR_RETURN(EFAULT, -1, "unknown codec ` of block", (int)src[0]);
+            }
+            if (ret <= 0) {
+                LOG_ERROR_RETURN(EFAULT, -1, "adaptive decompress data failed. (codec: `).",
+                                 (int)src[0]);
+            }
+            dst_chunk_len[i] = ret;
+        }
+        return 0;
+    }
+};
+
 ICompressor *create_compressor(const CompressArgs *args) {
     ICompressor *rst = nullptr;
     int init_flg = 0;
     const CompressOptions &opt = args->opt;
+    if (opt.use_dict && opt.algo != CompressOptions::ZSTD &&
+        opt.algo != CompressOptions::ADAPTIVE) {
+        LOG_ERROR_RETURN(EINVAL, nullptr, "dictionary is only supported by ZSTD.");
+    }
     switch (opt.algo) {
 
     case CompressOptions::LZ4:
@@ -361,6 +553,13 @@ ICompressor *create_compressor(const CompressArgs *args) {
             init_flg = ((Compressor_zstd *)rst)->init(args);
         }
         break;
+    case CompressOptions::ADAPTIVE:
+        rst = new Compressor_adaptive;
+        LOG_INFO("ZFileObject using adaptive algorithm");
+        if (rst != nullptr) {
+            init_flg = ((Compressor_adaptive *)rst)->init(args);
+        }
+        break;
     default:
         LOG_ERROR_RETURN(EINVAL, nullptr, "invalid CompressionOptions.");
     }
@@ -371,4 +570,33 @@ ICompressor *create_compressor(const CompressArgs *args) {
     return rst;
 }
 
+ssize_t zfile_train_dict(photon::fs::IFile *src, uint32_t block_size, unsigned char *dict,
+                         size_t dict_size) {
+    struct stat st;
+    if (src->fstat(&st) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to stat source file");
+    }
+    // about 100x of the dictionary is sampled, evenly from the source file
+    size_t nblocks = st.st_size / block_size;
+    size_t nsamples = std::min(nblocks, dict_size * 100 / block_size + 1);
+    if (nsamples == 0) {
+        LOG_ERROR_RETURN(EINVAL, -1, "source file is too small to train dictionary");
+    }
+    std::unique_ptr<unsigned char[]> samples(new unsigned char[nsamples * block_size]);
+    std::vector<size_t> sample_sizes(nsamples, block_size);
+    for (size_t i = 0; i < nsamples; i++) {
+        off_t offset = (nblocks * i / nsamples) * block_size;
+        if (src->pread(samples.get() + i * block_size, block_size, offset) != (ssize_t)block_size) {
+            LOG_ERRNO_RETURN(0, -1, "failed to read sample at offset `", offset);
+        }
+    }
+    auto ret = ZDICT_trainFromBuffer(dict, dict_size, samples.get(), sample_sizes.data(),
+                                     nsamples);
+    if (ZDICT_isError(ret)) {
+        LOG_ERROR_RETURN(EINVAL, -1, "failed to train dictionary: `", ZDICT_getErrorName(ret));
+    }
+    LOG_INFO("trained dictionary of ` bytes from ` samples", ret, nsamples);
+    return ret;
+}
+
 }; // namespace ZFile
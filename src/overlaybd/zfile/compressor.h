@@ -19,6 +19,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstdint>
+#include <sys/types.h>
 #include <memory>
 
 namespace photon {
@@ -35,11 +36,12 @@ public:
     const static uint8_t MINI_LZO = 0;
     const static uint8_t LZ4 = 1;
     const static uint8_t ZSTD = 2;
+    const static uint8_t ADAPTIVE = 3; // stored, LZ4 or ZSTD, chosen per block
     const static uint32_t DEFAULT_BLOCK_SIZE = 4096; // 8192;//32768;
 
     uint32_t block_size = DEFAULT_BLOCK_SIZE;
     uint8_t algo = LZ4; // algorithm
-    uint8_t level = 0;  // compress level
+    uint8_t level = 0;  // compress level (of ZSTD), 0 for default
     uint8_t use_dict = 0;
     uint8_t __padding_0 = 0;
     uint32_t reserved = 0;
@@ -61,6 +63,9 @@ public:
     CompressOptions opt;
     bool overwrite_header;
     int workers;
+    // blocks of all zeros are left out of the data, with a length of 0 in the
+    // jump table, and filled in by the reader; not readable by older versions
+    bool skip_zero_blocks = false;
 
     CompressArgs(const CompressOptions &opt, photon::fs::IFile *dict = nullptr,
                  unsigned char *dict_buf = nullptr, bool overwrite_header = false, int workers = 1)
@@ -100,6 +105,11 @@ public:
 };
 
 extern "C" ICompressor *create_compressor(const CompressArgs *args);
+
+// train a ZSTD dictionary of at most `dict_size` bytes from blocks sampled
+// evenly from `src`; return the size of the dictionary, or -1 on error.
+extern "C" ssize_t zfile_train_dict(photon::fs::IFile *src, uint32_t block_size,
+                                    unsigned char *dict, size_t dict_size);
 } // namespace ZFile
 
 #endif
\ No newline at end of file
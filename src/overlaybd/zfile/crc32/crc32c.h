@@ -27,9 +27,13 @@ extern uint32_t crc32c(const std::string &text);
 extern uint32_t crc32c_extend(const void *data, size_t nbytes, uint32_t crc);
 extern uint32_t crc32c_extend(const std::string &text, uint32_t crc);
 
+// name of the implementation selected for the running cpu
+extern const char *crc32c_impl();
+
 namespace testing {
 extern uint32_t crc32c_slow(const void *data, size_t nbytes, uint32_t crc);
 extern uint32_t crc32c_fast(const void *data, size_t nbytes, uint32_t crc);
+extern uint32_t crc32c_fast_3way(const void *data, size_t nbytes, uint32_t crc);
 } // namespace testing
 
 } // namespace crc32
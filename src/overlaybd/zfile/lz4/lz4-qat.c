@@ -27,7 +27,9 @@ LZ4LIB_API int LZ4_compress_qat(LZ4_qat_param *pQat, const unsigned char *const
     int32_t status = 0;
     for (size_t i = 0; i < n; i++) {
         int ret = LZ4_compress_default((const char *)raw_data[i], (char *)compressed_data[i],
-                                        src_chunk_len[i], 4096);
+                                        src_chunk_len[i], dst_chunk_len[i]);
+        if (ret <= 0)
+            return -1;
         dst_chunk_len[i] = ret;
     }
     return status;
@@ -39,7 +41,9 @@ LZ4LIB_API int LZ4_decompress_qat(LZ4_qat_param *pQat, const unsigned char *cons
     int32_t status = 0;
     for (size_t i = 0; i < n; i++) {
         int ret = LZ4_decompress_safe((const char *)raw_data[i], (char *)decompressed_data[i],
-                                        src_chunk_len[i], 4096);
+                                        src_chunk_len[i], dst_chunk_len[i]);
+        if (ret <= 0)
+            return -1;
         dst_chunk_len[i] = ret;
     }
     return status;
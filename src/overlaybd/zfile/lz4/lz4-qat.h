@@ -82,6 +82,10 @@ struct _LZ4_qat_param {
    LZ4_MAX_INPUT_SIZE. dstCapacity : size of buffer 'dst' (which must be already allocated) return
    : the number of bytes written into buffer 'dst' (necessarily <= dstCapacity)
                   or 0 if compression fails */
+/* The batch functions below take the capacity of each destination chunk in
+   dst_chunk_len[], and save the lengths of the results there. They return 0 on
+   success, -EBUSY if the device queue is full and nothing is submitted (the
+   caller falls back to cpu), or another negative value on error. */
 LZ4LIB_API int LZ4_compress_qat(LZ4_qat_param *pQat, const unsigned char *const raw_data[],
                                 size_t src_chunk_len[], unsigned char *compressed_data[],
                                 size_t dst_chunk_len[], size_t n);
@@ -227,6 +227,461 @@ TEST_F(ZFileTest, validation_check) {
     EXPECT_NE(zfile_validation_check(fdst.get()), 0);
 }
 
+TEST_F(ZFileTest, multithread_decompress) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    auto fn_dec = "verify.data.0";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), write_times);
+    struct stat st;
+    ASSERT_EQ(fsrc->fstat(&st), 0);
+    unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    unique_ptr<IFile> fdec(lfs->open(fn_dec, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fdst, nullptr);
+    ASSERT_NE(fdec, nullptr);
+    CompressOptions opt;
+    opt.algo = CompressOptions::ZSTD;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+
+    EXPECT_EQ(zfile_decompress(fdst.get(), fdec.get(), 4), 0);
+    struct stat st_dec;
+    ASSERT_EQ(fdec->fstat(&st_dec), 0);
+    EXPECT_EQ(st_dec.st_size, st.st_size);
+    char data0[16384], data1[16384];
+    for (off_t i = 0; i < st.st_size; i += sizeof(data0)) {
+        auto n = fsrc->pread(data0, sizeof(data0), i);
+        ASSERT_EQ(fdec->pread(data1, sizeof(data1), i), n);
+        ASSERT_EQ(memcmp(data0, data1, n), 0);
+    }
+
+    EXPECT_EQ(zfile_validation_check(fdst.get(), 4), 0);
+    char error_data[8192]{};
+    fdst->pwrite(error_data, 8192, 8192);
+    EXPECT_NE(zfile_validation_check(fdst.get(), 4), 0);
+}
+
+TEST_F(ZFileTest, block_cache) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), 256);
+    unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fdst, nullptr);
+    CompressOptions opt;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+    zfile_set_block_cache(1 << 20);
+    DEFER(zfile_set_block_cache(0));
+    unique_ptr<IFile> fzfile(zfile_open_ro(fdst.get(), opt.verify));
+    ASSERT_NE(fzfile, nullptr);
+    auto st0 = zfile_block_cache_stats();
+    // sub-block reads, twice each, the second of which hits the cache
+    for (int round = 0; round < 2; round++) {
+        for (off_t offset = 512; offset < (1 << 20); offset += 64 * 1024) {
+            char data0[1024], data1[1024];
+            fsrc->pread(data0, sizeof(data0), offset);
+            ASSERT_EQ(fzfile->pread(data1, sizeof(data1), offset), (ssize_t)sizeof(data1));
+            ASSERT_EQ(memcmp(data0, data1, sizeof(data0)), 0);
+        }
+    }
+    auto st1 = zfile_block_cache_stats();
+    EXPECT_EQ(st1.misses - st0.misses, 16UL);
+    EXPECT_EQ(st1.hits - st0.hits, 16UL);
+    EXPECT_GT(st1.bytes, 0UL);
+    EXPECT_LE(st1.bytes, 1UL << 20);
+    seqread(fsrc.get(), fzfile.get());
+}
+
+// tells the generation of its data, as a file cache does
+class GenerationFile : public ForwardFile {
+public:
+    uint64_t gen = 0;
+    bool drop_on_read = false; // as if dropped and refilled while being read
+    explicit GenerationFile(IFile *file) : ForwardFile(file) {
+    }
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        auto ret = m_file->pread(buf, count, offset);
+        if (drop_on_read)
+            gen++;
+        return ret;
+    }
+    int vioctl(int request, va_list args) override {
+        if (request == IOCTL_GET_GENERATION) {
+            *va_arg(args, uint64_t *) = gen;
+            return 0;
+        }
+        return m_file->vioctl(request, args);
+    }
+    // the reload of a block failing its checksum drops it
+    int fallocate(int mode, off_t offset, off_t len) override {
+        gen++;
+        return 0;
+    }
+};
+
+TEST_F(ZFileTest, trust_verified) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), 16);
+    unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fdst, nullptr);
+    CompressOptions opt;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+    GenerationFile gfile(fdst.get());
+    unique_ptr<IFile> fzfile(zfile_open_ro(&gfile, opt.verify));
+    ASSERT_NE(fzfile, nullptr);
+    auto zf = (CompressionFile *)fzfile.get();
+    auto bs = opt.block_size;
+    std::vector<char> data0(bs), data1(bs);
+    ASSERT_EQ(fsrc->pread(data0.data(), bs, 0), (ssize_t)bs);
+    // flips the checksum of block 0
+    auto crc_offset = zf->m_jump_table[1] - sizeof(uint32_t);
+    auto flip_crc = [&]() {
+        uint32_t crc;
+        ASSERT_EQ(fdst->pread(&crc, sizeof(crc), crc_offset), (ssize_t)sizeof(crc));
+        crc = ~crc;
+        ASSERT_EQ(fdst->pwrite(&crc, sizeof(crc), crc_offset), (ssize_t)sizeof(crc));
+    };
+    auto read_block = [&]() {
+        return fzfile->pread(data1.data(), bs, 0);
+    };
+
+    // verified by the first read, trusted by the next ones
+    ASSERT_EQ(read_block(), (ssize_t)bs);
+    flip_crc();
+    EXPECT_EQ(read_block(), (ssize_t)bs);
+    EXPECT_EQ(memcmp(data0.data(), data1.data(), bs), 0);
+    // unless sampled to be verified again
+    zfile_set_verify_sampling(1);
+    EXPECT_EQ(read_block(), -1);
+    zfile_set_verify_sampling(0);
+
+    // or the data has been dropped since
+    flip_crc();
+    ASSERT_EQ(read_block(), (ssize_t)bs);
+    flip_crc();
+    EXPECT_EQ(read_block(), (ssize_t)bs);
+    gfile.gen++;
+    EXPECT_EQ(read_block(), -1);
+    flip_crc();
+    EXPECT_EQ(read_block(), (ssize_t)bs);
+
+    // not marked verified if dropped while it was read, as what's verified isn't what's
+    // cached then
+    gfile.gen++;
+    gfile.drop_on_read = true;
+    ASSERT_EQ(read_block(), (ssize_t)bs);
+    gfile.drop_on_read = false;
+    flip_crc();
+    EXPECT_EQ(read_block(), -1);
+    flip_crc();
+
+    // nor by parallel decompression
+    zfile_set_decompress_threads(3);
+    DEFER(zfile_set_decompress_threads(0));
+    std::vector<char> large(128 * 1024);
+    gfile.gen++;
+    gfile.drop_on_read = true;
+    ASSERT_EQ(fzfile->pread(large.data(), large.size(), 0), (ssize_t)large.size());
+    gfile.drop_on_read = false;
+    flip_crc();
+    EXPECT_EQ(fzfile->pread(large.data(), large.size(), 0), -1);
+    flip_crc();
+}
+
+TEST_F(ZFileTest, base_layer_per_image) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), 64);
+    unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fdst, nullptr);
+    CompressOptions opt;
+    opt.algo = CompressOptions::ZSTD;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+
+    // opened by each image on it, as their devices may run on different vcpus: they
+    // share the jump table, but not the decompressors
+    unique_ptr<IFile> f0(zfile_open_ro(fdst.get(), true));
+    unique_ptr<IFile> f1(zfile_open_ro(fdst.get(), true));
+    ASSERT_NE(f0, nullptr);
+    ASSERT_NE(f1, nullptr);
+    auto z0 = (CompressionFile *)f0.get(), z1 = (CompressionFile *)f1.get();
+    EXPECT_EQ(z0->m_jump_table.m_data, z1->m_jump_table.m_data);
+    EXPECT_NE(z0->m_compressor.get(), z1->m_compressor.get());
+
+    struct stat st;
+    ASSERT_EQ(fsrc->fstat(&st), 0);
+    std::atomic<int> mismatches{0};
+    auto reader = [&](IFile *file, unsigned seed) {
+        photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_NONE);
+        DEFER(photon::fini());
+        char data0[8192], data1[8192];
+        for (int i = 0; i < 200; i++) {
+            off_t offset = rand_r(&seed) % (st.st_size - sizeof(data0));
+            if (fsrc->pread(data0, sizeof(data0), offset) != (ssize_t)sizeof(data0) ||
+                file->pread(data1, sizeof(data1), offset) != (ssize_t)sizeof(data1) ||
+                memcmp(data0, data1, sizeof(data0)) != 0)
+                mismatches++;
+        }
+    };
+    std::thread t0(reader, f0.get(), 1), t1(reader, f1.get(), 2);
+    t0.join();
+    t1.join();
+    EXPECT_EQ(mismatches.load(), 0);
+}
+
+TEST_F(ZFileTest, parallel_decompress) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), 256);
+    zfile_set_decompress_threads(3);
+    DEFER(zfile_set_decompress_threads(0));
+    for (auto algo : {CompressOptions::LZ4, CompressOptions::ZSTD}) {
+        for (int verify = 0; verify < 2; verify++) {
+            unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+            ASSERT_NE(fdst, nullptr);
+            CompressOptions opt;
+            opt.algo = algo;
+            opt.verify = verify;
+            CompressArgs args(opt);
+            ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+            unique_ptr<IFile> fzfile(zfile_open_ro(fdst.get(), opt.verify));
+            ASSERT_NE(fzfile, nullptr);
+            // both aligned and unaligned large reads
+            static char data0[1 << 20], data1[1 << 20];
+            for (off_t offset : {0L, 4096L, 12345L, 3L << 20}) {
+                auto ret = fsrc->pread(data0, sizeof(data0), offset);
+                ASSERT_GT(ret, 0);
+                ASSERT_EQ(fzfile->pread(data1, ret, offset), ret);
+                ASSERT_EQ(memcmp(data0, data1, ret), 0);
+            }
+        }
+    }
+}
+
+TEST_F(ZFileTest, zero_blocks) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    // 64K of data and 64K of zeros in turn, and a partial block of zeros at the end
+    const size_t size = (2 << 20) + 1000;
+    vector<char> data(size, 0);
+    for (size_t i = 0; i < (2 << 20); i += 128 * 1024) {
+        for (size_t j = 0; j < 64 * 1024; j++)
+            data[i + j] = rand() % 4 + 1;
+    }
+    ASSERT_EQ(fsrc->pwrite(data.data(), size, 0), (ssize_t)size);
+    zfile_set_decompress_threads(3);
+    DEFER(zfile_set_decompress_threads(0));
+    for (int builder = 0; builder < 3; builder++) {
+        unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+        ASSERT_NE(fdst, nullptr);
+        CompressOptions opt;
+        opt.verify = 1;
+        CompressArgs args(opt);
+        args.skip_zero_blocks = true;
+        if (builder == 0) {
+            fsrc->lseek(0, SEEK_SET);
+            ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+        } else {
+            // the single and the multi-processor builders
+            args.workers = builder == 1 ? 1 : 4;
+            unique_ptr<IFile> zb(new_zfile_builder(fdst.get(), &args, false));
+            ASSERT_NE(zb, nullptr);
+            for (size_t i = 0; i < size; i += 3000) {
+                auto n = min<size_t>(3000, size - i);
+                ASSERT_EQ(zb->write(data.data() + i, n), (ssize_t)n);
+            }
+            ASSERT_EQ(zb->close(), 0);
+        }
+        struct stat st;
+        ASSERT_EQ(fdst->fstat(&st), 0);
+        // no data of the zero blocks, half of the source
+        EXPECT_LT(st.st_size, (off_t)(1 << 20));
+        unique_ptr<IFile> fzfile(zfile_open_ro(fdst.get(), true));
+        ASSERT_NE(fzfile, nullptr);
+        vector<char> buf(size);
+        // serial and parallel, across the boundaries of data and zeros
+        for (off_t offset : {0L, 4096L, 60000L, 65536L, 200000L, (2L << 20) - 4096}) {
+            for (size_t count : {1000UL, 8192UL, 100000UL, 1UL << 20}) {
+                auto n = min<size_t>(count, size - offset);
+                memset(buf.data(), 0xff, n);
+                ASSERT_EQ(fzfile->pread(buf.data(), n, offset), (ssize_t)n);
+                ASSERT_EQ(memcmp(buf.data(), data.data() + offset, n), 0);
+            }
+        }
+        EXPECT_EQ(zfile_validation_check(fdst.get()), 0);
+    }
+}
+
+TEST_F(ZFileTest, preadv) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), 64);
+    unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fdst, nullptr);
+    CompressOptions opt;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+    unique_ptr<IFile> fzfile(zfile_open_ro(fdst.get(), opt.verify));
+    ASSERT_NE(fzfile, nullptr);
+    // iovecs either lined up with the blocks, or splitting them, serially and
+    // in parallel for the large ones
+    static char data0[256 * 1024], data1[256 * 1024];
+    for (int threads : {0, 3}) {
+        zfile_set_decompress_threads(threads);
+        DEFER(zfile_set_decompress_threads(0));
+        for (auto lens : {std::vector<size_t>{4096, 8192, 65536, 4096},
+                          std::vector<size_t>{1000, 0, 7192, 60000, 512, 33},
+                          std::vector<size_t>{65536, 3000, 61000, 67072}}) {
+            for (off_t offset : {0L, 4096L, 777L}) {
+                std::vector<struct iovec> iov;
+                size_t count = 0;
+                for (auto len : lens) {
+                    iov.push_back({data1 + count, len});
+                    count += len;
+                }
+                memset(data1, 0, count);
+                ASSERT_EQ(fsrc->pread(data0, count, offset), (ssize_t)count);
+                ASSERT_EQ(fzfile->preadv(iov.data(), iov.size(), offset), (ssize_t)count);
+                ASSERT_EQ(memcmp(data0, data1, count), 0);
+            }
+        }
+    }
+}
+
+TEST_F(ZFileTest, zstd_dict) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    // small records sharing most of their content, like file system metadata
+    std::string data;
+    while (data.size() < (4 << 20)) {
+        char line[128];
+        auto n = snprintf(line, sizeof(line),
+                          "{\"id\": %d, \"name\": \"file-%x\", \"mode\": %o}\n", rand(),
+                          rand(), rand() & 0777);
+        data.append(line, n);
+    }
+    data.resize(4 << 20);
+    ASSERT_EQ(fsrc->pwrite(data.data(), data.size(), 0), (ssize_t)data.size());
+    size_t zsize[2];
+    for (int use_dict = 0; use_dict < 2; use_dict++) {
+        unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+        ASSERT_NE(fdst, nullptr);
+        CompressOptions opt;
+        opt.algo = CompressOptions::ZSTD;
+        opt.verify = 1;
+        opt.dict_size = use_dict ? 16 * 1024 : 0;
+        CompressArgs args(opt);
+        ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+        struct stat st;
+        fdst->fstat(&st);
+        zsize[use_dict] = st.st_size;
+        unique_ptr<IFile> fzfile(zfile_open_ro(fdst.get(), opt.verify));
+        ASSERT_NE(fzfile, nullptr);
+        auto &ht = ((CompressionFile *)fzfile.get())->m_ht;
+        EXPECT_EQ(ht.opt.use_dict, use_dict);
+        if (use_dict) {
+            EXPECT_GT(ht.opt.dict_size, 0u);
+            EXPECT_LE(ht.opt.dict_size, 16u * 1024);
+        }
+        seqread(fsrc.get(), fzfile.get());
+    }
+    LOG_INFO("zfile size without dictionary: `, with dictionary: `", zsize[0], zsize[1]);
+    EXPECT_LT(zsize[1], zsize[0]);
+}
+
+TEST_F(ZFileTest, adaptive) {
+    CompressOptions opt;
+    opt.algo = CompressOptions::ADAPTIVE;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    unique_ptr<ICompressor> compressor(create_compressor(&args));
+    ASSERT_NE(compressor, nullptr);
+    // random data is stored as is, others compressed
+    unsigned char raw[4096], dst[8192], out[4096];
+    for (auto &c : raw)
+        c = rand();
+    auto ret = compressor->compress(raw, sizeof(raw), dst, sizeof(dst));
+    ASSERT_EQ(ret, (int)sizeof(raw) + 1);
+    EXPECT_EQ(dst[0], Compressor_adaptive::STORED);
+    ASSERT_EQ(compressor->decompress(dst, ret, out, sizeof(out)), (int)sizeof(out));
+    EXPECT_EQ(memcmp(raw, out, sizeof(raw)), 0);
+    memset(raw + 1024, 0, sizeof(raw) - 1024);
+    ret = compressor->compress(raw, sizeof(raw), dst, sizeof(dst));
+    ASSERT_GT(ret, 0);
+    EXPECT_LT(ret, 2048);
+    EXPECT_NE(dst[0], Compressor_adaptive::STORED);
+    ASSERT_EQ(compressor->decompress(dst, ret, out, sizeof(out)), (int)sizeof(out));
+    EXPECT_EQ(memcmp(raw, out, sizeof(raw)), 0);
+
+    // a file mixing them
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), 64);
+    for (auto &c : raw)
+        c = rand();
+    for (off_t offset = 0; offset < (1 << 20); offset += 64 * 1024)
+        fsrc->pwrite(raw, sizeof(raw), offset);
+    unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fdst, nullptr);
+    ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+    unique_ptr<IFile> fzfile(zfile_open_ro(fdst.get(), opt.verify));
+    ASSERT_NE(fzfile, nullptr);
+    seqread(fsrc.get(), fzfile.get());
+}
+
+TEST_F(ZFileTest, shared_jump_table) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), 64);
+    unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fdst, nullptr);
+    CompressOptions opt;
+    opt.verify = 1;
+    CompressArgs args(opt);
+    ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+    unique_ptr<IFile> fz1(zfile_open_ro(fdst.get(), opt.verify));
+    unique_ptr<IFile> fz2(zfile_open_ro(fdst.get(), opt.verify));
+    ASSERT_NE(fz1, nullptr);
+    ASSERT_NE(fz2, nullptr);
+    auto &jt1 = ((CompressionFile *)fz1.get())->m_jump_table;
+    auto &jt2 = ((CompressionFile *)fz2.get())->m_jump_table;
+    EXPECT_EQ(jt1.m_data, jt2.m_data);
+    seqread(fsrc.get(), fz2.get());
+    auto data = jt1.m_data;
+    fz1.reset();
+    fz2.reset();
+    EXPECT_EQ(data.use_count(), 1);
+    data.reset();
+    EXPECT_TRUE(CompressionFile::JumpTable::registry().empty());
+}
+
 TEST_F(ZFileTest, ht_check) {
     // log_output_level = 1;
     auto fn_src = "verify.data";
@@ -259,6 +714,34 @@ TEST_F(ZFileTest, ht_check) {
     EXPECT_EQ(is_zfile(dst), -1);
 }
 
+TEST_F(ZFileTest, checksummed) {
+    auto fn_src = "verify.data";
+    auto fn_zfile = "verify.zfile";
+    unique_ptr<IFile> fsrc(lfs->open(fn_src, O_CREAT | O_TRUNC | O_RDWR, 0644));
+    ASSERT_NE(fsrc, nullptr);
+    randwrite(fsrc.get(), 64);
+    char header[HEADER_SPACE];
+    EXPECT_EQ(zfile_checksummed(header, 0), 0);
+    ASSERT_EQ(fsrc->pread(header, HEADER_SPACE, 0), (ssize_t)HEADER_SPACE);
+    EXPECT_EQ(zfile_checksummed(header, HEADER_SPACE), 0);
+    for (auto verify = 0; verify <= 1; verify++) {
+        unique_ptr<IFile> fdst(lfs->open(fn_zfile, O_CREAT | O_TRUNC | O_RDWR, 0644));
+        ASSERT_NE(fdst, nullptr);
+        CompressOptions opt;
+        opt.algo = CompressOptions::LZ4;
+        opt.verify = verify;
+        CompressArgs args(opt);
+        fsrc->lseek(0, SEEK_SET);
+        ASSERT_EQ(zfile_compress(fsrc.get(), fdst.get(), &args), 0);
+        ASSERT_EQ(fdst->pread(header, HEADER_SPACE, 0), (ssize_t)HEADER_SPACE);
+        EXPECT_EQ(zfile_checksummed(header, HEADER_SPACE), verify);
+        EXPECT_EQ(zfile_checksummed(header, HEADER_SPACE - 1), 0);
+        // a header not matching its digest
+        header[400] ^= 1;
+        EXPECT_EQ(zfile_checksummed(header, HEADER_SPACE), 0);
+    }
+}
+
 TEST_F(ZFileTest, dsa) {
     const int buf_size = 1024;
     const int crc_count = 3000;
@@ -277,6 +760,22 @@ TEST_F(ZFileTest, dsa) {
     ASSERT_EQ(ret, 0);
 }
 
+TEST_F(ZFileTest, crc32c_3way) {
+    std::vector<unsigned char> buf(100 * 1024);
+    for (auto &c : buf)
+        c = rand();
+    // both lengths shorter than a round and spanning the long and short rounds
+    for (auto i = 0; i < 1000; i++) {
+        size_t offset = rand() % 64;
+        size_t len = rand() % (i < 500 ? 2048 : buf.size() - offset);
+        uint32_t seed = rand();
+        auto crc = crc32::testing::crc32c_slow(&buf[offset], len, seed);
+        ASSERT_EQ(crc32::testing::crc32c_fast_3way(&buf[offset], len, seed), crc);
+        ASSERT_EQ(crc32::crc32c_extend(&buf[offset], len, seed), crc);
+    }
+    LOG_INFO("crc32c implementation: `", crc32::crc32c_impl());
+}
+
 TEST_F(ZFileTest, verify_builder) {
     auto fn_src = "verify.data";
     auto fn_zfile = "verify.zfile";
@@ -0,0 +1,157 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <photon/photon.h>
+#include <photon/common/alog.h>
+#include <photon/fs/virtual-file.h>
+#include "../zfile.h"
+#include "../crc32/crc32c.h"
+
+DEFINE_bool(ut_pass, false, "pass unit test directly. This suite is only for manual test");
+DEFINE_string(bench, "builder,crc", "benchmarks to run, of builder and crc");
+DEFINE_uint64(data_size_mb, 256, "size of the data to compress in MB");
+DEFINE_uint32(block_size, 4096, "block size of zfile");
+DEFINE_string(algorithm, "lz4", "lz4, zstd or adaptive");
+DEFINE_bool(verify, true, "append checksum to blocks");
+DEFINE_int32(max_threads, 32, "builder scaling is measured for 1, 2, 4 ... max_threads");
+DEFINE_uint64(write_size, 1024 * 1024, "size of each write to the builder");
+
+using namespace photon::fs;
+
+// discards the compressed data, so that compression is measured only
+class SinkFile : public VirtualReadOnlyFile {
+public:
+    size_t written = 0;
+
+    virtual ssize_t write(const void *buf, size_t count) override {
+        written += count;
+        return count;
+    }
+    virtual ssize_t pwrite(const void *buf, size_t count, off_t offset) override {
+        return count;
+    }
+
+    UNIMPLEMENTED_POINTER(IFileSystem *filesystem() override);
+    UNIMPLEMENTED(int fstat(struct stat *buf) override);
+};
+
+// text-like data, compressible to about 1/3 by LZ4
+static std::vector<char> make_data(size_t size) {
+    std::vector<char> data;
+    data.reserve(size + 128);
+    while (data.size() < size) {
+        char line[128];
+        auto n = snprintf(line, sizeof(line), "%08x %s %d\n", rand(),
+                          "/usr/lib/x86_64-linux-gnu/libfoo.so", rand() % 1000);
+        data.insert(data.end(), line, line + n);
+    }
+    data.resize(size);
+    return data;
+}
+
+static int bench_builder(const std::vector<char> &data, const ZFile::CompressOptions &opt,
+                         int workers) {
+    ZFile::CompressArgs args(opt);
+    args.workers = workers;
+    SinkFile sink;
+    auto start = std::chrono::steady_clock::now();
+    std::unique_ptr<IFile> builder(ZFile::new_zfile_builder(&sink, &args, false));
+    if (!builder) {
+        LOG_ERRNO_RETURN(0, -1, "failed to create zfile builder");
+    }
+    for (size_t offset = 0; offset < data.size(); offset += FLAGS_write_size) {
+        auto len = std::min(FLAGS_write_size, data.size() - offset);
+        if (builder->write(&data[offset], len) != (ssize_t)len) {
+            LOG_ERRNO_RETURN(0, -1, "failed to write to zfile builder");
+        }
+    }
+    if (builder->close() != 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to close zfile builder");
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    printf("workers: %3d, time: %.3fs, throughput: %.1fMB/s, ratio: %zu%%\n", workers,
+           elapsed.count(), data.size() / elapsed.count() / 1024 / 1024,
+           sink.written * 100 / data.size());
+    return 0;
+}
+
+static void bench_crc(const std::vector<char> &data) {
+    struct {
+        const char *name;
+        uint32_t (*func)(const void *, size_t, uint32_t);
+    } impls[] = {
+        {"software", &crc32::testing::crc32c_slow},
+        {"hardware", &crc32::testing::crc32c_fast},
+        {"hardware-3way", &crc32::testing::crc32c_fast_3way},
+        {crc32::crc32c_impl(), &crc32::crc32c_extend},
+    };
+    printf("crc32c selected: %s\n", crc32::crc32c_impl());
+    for (size_t size : {512, 4096, 65536, 1024 * 1024}) {
+        for (auto &impl : impls) {
+            // about 1GB for each
+            size_t n = std::max((size_t)1, (1UL << 30) / size), len = 0;
+            uint32_t crc = 0;
+            auto start = std::chrono::steady_clock::now();
+            for (size_t i = 0; i < n; i++) {
+                auto offset = (i * size) % (data.size() - size + 1);
+                crc = impl.func(&data[offset], size, crc);
+                len += size;
+            }
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            printf("crc32c %-16s size: %7zu, throughput: %.2fGB/s (crc: %08x)\n", impl.name,
+                   size, len / elapsed.count() / (1 << 30), crc);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    log_output_level = ALOG_INFO;
+    if (FLAGS_ut_pass) {
+        LOG_INFO("pass unit test");
+        return 0;
+    }
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER(photon::fini());
+
+    ZFile::CompressOptions opt;
+    opt.block_size = FLAGS_block_size;
+    opt.verify = FLAGS_verify;
+    if (FLAGS_algorithm == "zstd") {
+        opt.algo = ZFile::CompressOptions::ZSTD;
+    } else if (FLAGS_algorithm == "adaptive") {
+        opt.algo = ZFile::CompressOptions::ADAPTIVE;
+    }
+    auto data = make_data(FLAGS_data_size_mb << 20);
+    if (FLAGS_bench.find("crc") != std::string::npos) {
+        bench_crc(data);
+    }
+    if (FLAGS_bench.find("builder") != std::string::npos) {
+        // builders log too much in info level
+        log_output_level = ALOG_WARN;
+        for (int workers = 1; workers <= FLAGS_max_threads; workers *= 2) {
+            if (bench_builder(data, opt, workers) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
@@ -31,8 +31,15 @@
 #include <photon/thread/thread.h>
 #include "crc32/crc32c.h"
 #include "compressor.h"
+#include "../cpu_account.h"
+#include "../buffer_pool.h"
+#include "../cache/cache.h"
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <list>
+#include <deque>
+#include <unordered_map>
 
 using namespace photon::fs;
 
@@ -52,8 +59,231 @@ const static uint8_t FLAG_VALID_TRUE = 1;
 const static uint8_t FLAG_VALID_CRC_CHECK = 2;
 
 inline uint32_t crc32c_salt(void *buf, size_t size) {
+    CpuAccount::Scope _cpu(CpuAccount::CRC32C);
     return crc32::crc32c_extend(buf, size, NOI_WELL_KNOWN_PRIME);
 }
+
+// OR-ing words 64B at a time lets the compiler vectorize the loop, while still
+// returning early on non-zero data
+static bool is_zero_block(const unsigned char *buf, size_t n) {
+    auto p = (const uint64_t *)buf;
+    size_t i = 0, words = n / sizeof(uint64_t);
+    for (; i + 8 <= words; i += 8) {
+        uint64_t x = 0;
+        for (size_t j = 0; j < 8; ++j)
+            x |= p[i + j];
+        if (x)
+            return false;
+    }
+    for (i *= sizeof(uint64_t); i < n; i++) {
+        if (buf[i])
+            return false;
+    }
+    return true;
+}
+// A sharded LRU of decompressed blocks, shared by all the CompressionFiles, keyed by
+// an id of the file and the index of the block. The entries of a closed file are
+// simply aged out. Reads may come from different vcpus, so the shards are guarded
+// by std::mutex, which is never held across a yield.
+class BlockCache {
+public:
+    static const size_t NSHARDS = 16;
+
+    struct Key {
+        uint64_t file_id, block;
+        bool operator==(const Key &rhs) const {
+            return file_id == rhs.file_id && block == rhs.block;
+        }
+    };
+    struct KeyHash {
+        size_t operator()(const Key &k) const {
+            return std::hash<uint64_t>()(k.file_id * NOI_WELL_KNOWN_PRIME + k.block);
+        }
+    };
+    struct Entry {
+        Key key;
+        std::vector<unsigned char> data;
+    };
+    struct Shard {
+        std::mutex mtx;
+        std::list<Entry> lru; // most recently used at front
+        std::unordered_map<Key, std::list<Entry>::iterator, KeyHash> map;
+        size_t bytes = 0;
+    } m_shards[NSHARDS];
+
+    std::atomic<size_t> m_capacity{0}; // in bytes, 0 for disabled
+    std::atomic<uint64_t> m_hits{0}, m_misses{0}, m_next_file_id{1};
+
+    Shard &shard(const Key &k) {
+        return m_shards[KeyHash()(k) % NSHARDS];
+    }
+
+    bool enabled() const {
+        return m_capacity.load(std::memory_order_relaxed) > 0;
+    }
+
+    // copy [offset, offset + count) of the block to `buf` if it's cached
+    bool get(uint64_t file_id, uint64_t block, void *buf, size_t offset, size_t count) {
+        Key k{file_id, block};
+        auto &s = shard(k);
+        {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            auto it = s.map.find(k);
+            if (it != s.map.end() && offset + count <= it->second->data.size()) {
+                s.lru.splice(s.lru.begin(), s.lru, it->second);
+                memcpy(buf, it->second->data.data() + offset, count);
+                m_hits++;
+                return true;
+            }
+        }
+        m_misses++;
+        return false;
+    }
+
+    void put(uint64_t file_id, uint64_t block, const void *buf, size_t count) {
+        auto cap = m_capacity.load(std::memory_order_relaxed) / NSHARDS;
+        if (count > cap)
+            return;
+        Key k{file_id, block};
+        auto &s = shard(k);
+        std::lock_guard<std::mutex> lock(s.mtx);
+        if (s.map.count(k))
+            return;
+        s.lru.push_front(Entry{k, std::vector<unsigned char>((const unsigned char *)buf,
+                                                             (const unsigned char *)buf + count)});
+        s.map[k] = s.lru.begin();
+        s.bytes += count;
+        evict(s, cap);
+    }
+
+    void evict(Shard &s, size_t cap) {
+        while (s.bytes > cap && !s.lru.empty()) {
+            auto &e = s.lru.back();
+            s.bytes -= e.data.size();
+            s.map.erase(e.key);
+            s.lru.pop_back();
+        }
+    }
+
+    void set_capacity(size_t capacity) {
+        m_capacity = capacity;
+        for (auto &s : m_shards) {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            evict(s, capacity / NSHARDS);
+        }
+    }
+
+    BlockCacheStats stats() {
+        BlockCacheStats st;
+        st.hits = m_hits;
+        st.misses = m_misses;
+        st.capacity = m_capacity;
+        for (auto &s : m_shards) {
+            std::lock_guard<std::mutex> lock(s.mtx);
+            st.bytes += s.bytes;
+            st.blocks += s.map.size();
+        }
+        return st;
+    }
+};
+
+static BlockCache block_cache;
+
+void zfile_set_block_cache(size_t capacity) {
+    LOG_INFO("set capacity of zfile block cache: `", capacity);
+    block_cache.set_capacity(capacity);
+}
+
+BlockCacheStats zfile_block_cache_stats() {
+    return block_cache.stats();
+}
+
+// A pool of threads decompressing the blocks of large reads, so that a single
+// read can use more than one core. Each thread runs its own photon environment,
+// as ZFileBuilderMP does, so the caller can wait on a photon::semaphore.
+class DecompressPool {
+public:
+    typedef void (*Func)(void *);
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mtx;
+    std::deque<std::pair<Func, void *>> m_tasks;
+    photon::semaphore m_sem{0};
+    bool m_stop = false;
+
+    ~DecompressPool() {
+        stop();
+    }
+
+    size_t size() const {
+        return m_threads.size();
+    }
+
+    void start(int nthreads) {
+        for (int i = 0; i < nthreads; i++) {
+            m_threads.emplace_back([this] {
+                photon::init(photon::INIT_EVENT_EPOLL, photon::INIT_IO_NONE);
+                DEFER(photon::fini());
+                while (true) {
+                    m_sem.wait(1);
+                    std::pair<Func, void *> task;
+                    {
+                        std::lock_guard<std::mutex> lock(m_mtx);
+                        if (m_tasks.empty()) {
+                            if (m_stop)
+                                break;
+                            continue;
+                        }
+                        task = m_tasks.front();
+                        m_tasks.pop_front();
+                    }
+                    task.first(task.second);
+                }
+            });
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_stop = true;
+        }
+        m_sem.signal(m_threads.size());
+        for (auto &th : m_threads)
+            th.join();
+        m_threads.clear();
+        m_stop = false;
+    }
+
+    void submit(Func fn, void *arg) {
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            m_tasks.emplace_back(fn, arg);
+        }
+        m_sem.signal(1);
+    }
+};
+
+static DecompressPool decompress_pool;
+// reads shorter than this are decompressed by the calling thread
+const static size_t PARALLEL_READ_MIN = 128 * 1024;
+const static size_t PARALLEL_BLOCKS_MIN = 8; // min # of blocks of a task
+
+void zfile_set_decompress_threads(int nthreads) {
+    LOG_INFO("set # of zfile decompression threads: `", nthreads);
+    decompress_pool.stop();
+    if (nthreads > 0)
+        decompress_pool.start(nthreads);
+}
+
+// 1 in n reads of the blocks verified is verified again, 0 for none
+static std::atomic<uint32_t> verify_sampling{0};
+
+void zfile_set_verify_sampling(uint32_t n) {
+    LOG_INFO("set zfile verify sampling: 1 in `", n);
+    verify_sampling = n;
+}
+
 /* ZFile Format:
     | Header (512B) | dict (optional) | compressed block 0 [checksum0] | compressed block 1
    [checksum1] | ... | compressed block N [checksumN] | jmp_table(index) | Trailer (512 B)|
@@ -91,6 +321,7 @@ public:
         static const uint32_t FLAG_SHIFT_HEADER_OVERWRITE = 3; // overwrite trailer info to header
         static const uint32_t FLAG_SHIFT_CALC_DIGEST = 4; // caculate digest for zfile header/trailer and jumptable
         static const uint32_t FLAG_SHIFT_IDX_COMP = 5; // compress zfile index(jumptable)
+        static const uint32_t FLAG_SHIFT_ZERO_BLOCKS = 6; // blocks of zeros stored as length 0
 
         uint32_t get_flag_bit(uint32_t shift) const {
             return flags & (1 << shift);
@@ -164,6 +395,10 @@ public:
             set_flag_bit(FLAG_SHIFT_IDX_COMP);
         }
 
+        void set_zero_blocks() {
+            set_flag_bit(FLAG_SHIFT_ZERO_BLOCKS);
+        }
+
         void set_compress_option(const CompressOptions &opt) {
             this->opt = opt;
         }
@@ -183,28 +418,57 @@ public:
     struct JumpTable {
         typedef uint16_t uinttype;
         static const uinttype uinttype_max = UINT16_MAX;
-        int group_size;
 
-        std::vector<uint64_t> partial_offset;
-        std::vector<uinttype> deltas; // partial sum in each page;
+        // immutable once built, and shared by the files of the same index
+        struct Data {
+            int group_size;
+            std::vector<uint64_t> partial_offset;
+            std::vector<uinttype> deltas; // partial sum in each page;
+
+            off_t operator[](size_t idx) const {
+                // return BASE  + deltas[ idx % (page_size) ]
+                off_t part_idx = idx / group_size;
+                off_t inner_idx = idx & (group_size - 1);
+                auto part_offset = partial_offset[part_idx];
+                if (inner_idx) {
+                    return part_offset + deltas[idx];
+                }
+                return part_offset;
+            }
+
+            size_t memory_size() const {
+                return deltas.size() * sizeof(deltas[0]) +
+                       partial_offset.size() * sizeof(partial_offset[0]);
+            }
 
-        off_t operator[](size_t idx) const {
-            // return BASE  + deltas[ idx % (page_size) ]
-            off_t part_idx = idx / group_size;
-            off_t inner_idx = idx & (group_size - 1);
-            auto part_offset = partial_offset[part_idx];
-            if (inner_idx) {
-                return part_offset + deltas[idx];
+            // whether it's built from `ibuf`
+            bool match(const uint32_t *ibuf, size_t n, off_t offset_begin) const {
+                if (deltas.size() != n + 1 || (off_t)partial_offset[0] != offset_begin)
+                    return false;
+                auto offset = offset_begin;
+                for (size_t i = 0; i < n; i++) {
+                    offset += ibuf[i];
+                    if ((*this)[i + 1] != offset)
+                        return false;
+                }
+                return true;
             }
-            return part_offset;
+        };
+        std::shared_ptr<const Data> m_data;
+
+        off_t operator[](size_t idx) const {
+            return (*m_data)[idx];
         }
 
         size_t size() const {
-            return deltas.size();
+            return m_data->deltas.size();
         }
 
-        int build(const uint32_t *ibuf, size_t n, off_t offset_begin, uint32_t block_size,
-                  bool enable_crc) {
+        static int build(Data *data, const uint32_t *ibuf, size_t n, off_t offset_begin,
+                         uint32_t block_size, bool enable_crc) {
+            auto &partial_offset = data->partial_offset;
+            auto &deltas = data->deltas;
+            auto &group_size = data->group_size;
             partial_offset.clear();
             deltas.clear();
             group_size = (uinttype_max + 1) / block_size;
@@ -231,12 +495,72 @@ public:
                 deltas.push_back(deltas[i - 1] + ibuf[i - 1]);
             }
             LOG_INFO("create jump table done. {part_count: `, deltas_count: `, size: `}",
-                     partial_offset.size(), deltas.size(),
-                     deltas.size() * sizeof(deltas[0]) +
-                         partial_offset.size() * sizeof(partial_offset[0]));
+                     partial_offset.size(), deltas.size(), data->memory_size());
             return 0;
         }
 
+        // reuse the table of another opened file of the same index, if any; e.g.
+        // a layer shared by images, or opened again by another device
+        int build(const uint32_t *ibuf, size_t n, off_t offset_begin, uint32_t block_size,
+                  bool enable_crc, uint32_t index_crc) {
+            Key key{index_crc, block_size, n, (uint64_t)offset_begin};
+            auto data = lookup(key);
+            if (data && data->match(ibuf, n, offset_begin)) {
+                LOG_INFO("share jump table of ` bytes", data->memory_size());
+                m_data = std::move(data);
+                return 0;
+            }
+            auto new_data = std::shared_ptr<Data>(new Data, [key](Data *d) {
+                release(key);
+                delete d;
+            });
+            if (build(new_data.get(), ibuf, n, offset_begin, block_size, enable_crc) != 0)
+                return -1;
+            insert(key, new_data);
+            m_data = std::move(new_data);
+            return 0;
+        }
+
+        struct Key {
+            uint32_t index_crc, block_size;
+            uint64_t n, offset_begin;
+            bool operator==(const Key &rhs) const {
+                return index_crc == rhs.index_crc && block_size == rhs.block_size &&
+                       n == rhs.n && offset_begin == rhs.offset_begin;
+            }
+        };
+        struct KeyHash {
+            size_t operator()(const Key &k) const {
+                return std::hash<uint64_t>()(((uint64_t)k.index_crc << 32) ^ k.n) ^
+                       (k.offset_begin << 17) ^ k.block_size;
+            }
+        };
+        typedef std::unordered_map<Key, std::weak_ptr<const Data>, KeyHash> Registry;
+        static std::mutex &registry_mutex() {
+            static std::mutex mtx;
+            return mtx;
+        }
+        static Registry &registry() {
+            static Registry reg;
+            return reg;
+        }
+        static std::shared_ptr<const Data> lookup(const Key &key) {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            auto it = registry().find(key);
+            return it == registry().end() ? nullptr : it->second.lock();
+        }
+        static void insert(const Key &key, const std::shared_ptr<const Data> &data) {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            auto &entry = registry()[key];
+            if (entry.expired())
+                entry = data;
+        }
+        static void release(const Key &key) {
+            std::lock_guard<std::mutex> lock(registry_mutex());
+            auto it = registry().find(key);
+            if (it != registry().end() && it->second.expired())
+                registry().erase(it);
+        }
     } m_jump_table;
 
     HeaderTrailer m_ht;
@@ -244,9 +568,29 @@ public:
     std::unique_ptr<ICompressor> m_compressor;
     bool m_ownership = false;
     uint8_t valid = FLAG_VALID_TRUE;
+    uint64_t m_cache_id = block_cache.m_next_file_id++;
+    // spare compressors for parallel decompression, as they are not thread-safe
+    std::vector<std::unique_ptr<ICompressor>> m_spare_compressors;
+    std::unique_ptr<unsigned char[]> m_dict; // dictionary stored after the header
+    // a bit per block whose checksum passed, trusted while the generation of the
+    // cache under m_file stays m_verified_gen, see trust_verified()
+    std::unique_ptr<std::atomic<uint64_t>[]> m_verified;
+    size_t m_verified_words = 0;
+    std::atomic<uint64_t> m_verified_gen{0};
+    std::atomic<uint64_t> m_verified_hits{0};
 
     CompressionFile(IFile *file, bool ownership) : m_file(file), m_ownership(ownership){};
 
+    ICompressor *new_compressor() {
+        unsigned char *dict = nullptr;
+        if (m_dict) {
+            dict = new unsigned char[m_ht.opt.dict_size];
+            memcpy(dict, m_dict.get(), m_ht.opt.dict_size);
+        }
+        CompressArgs args(m_ht.opt, nullptr, dict);
+        return create_compressor(&args);
+    }
+
     ~CompressionFile() {
         if (m_ownership) {
             delete m_file;
@@ -259,6 +603,47 @@ public:
         return 0;
     }
 
+    void init_verified() {
+        // the jump table has an entry per block, and one past the last
+        m_verified_words = (m_jump_table.size() + 63) / 64;
+        m_verified.reset(new std::atomic<uint64_t>[m_verified_words]());
+    }
+
+    // whether the blocks verified are to be trusted, i.e. the cache under
+    // m_file tells its generation, and its data they were verified by hasn't
+    // been dropped since; if it has, they're forgotten. The data read before
+    // the call is covered, and `gen` is set to the generation. A block is
+    // marked verified only if the generation sampled before its data was read
+    // is the same once it's checked, or the mark could cover a refill of it
+    // that's never been checked.
+    bool trust_verified(uint64_t *gen) {
+        uint64_t g;
+        if (!m_verified || valid != FLAG_VALID_TRUE ||
+            m_file->ioctl(IOCTL_GET_GENERATION, &g) != 0)
+            return false;
+        if (g != m_verified_gen.load(std::memory_order_relaxed)) {
+            for (size_t i = 0; i < m_verified_words; i++)
+                m_verified[i].store(0, std::memory_order_relaxed);
+            m_verified_gen.store(g, std::memory_order_relaxed);
+        }
+        if (gen)
+            *gen = g;
+        return true;
+    }
+
+    // whether the checksum of block `idx` can be skipped, but for the reads
+    // sampled to be verified again
+    bool verified(size_t idx) {
+        if (!(m_verified[idx / 64].load(std::memory_order_relaxed) & (1UL << (idx % 64))))
+            return false;
+        auto n = verify_sampling.load(std::memory_order_relaxed);
+        return n == 0 || (m_verified_hits.fetch_add(1, std::memory_order_relaxed) + 1) % n;
+    }
+
+    void set_verified(size_t idx) {
+        m_verified[idx / 64].fetch_or(1UL << (idx % 64), std::memory_order_relaxed);
+    }
+
     virtual int fstat(struct stat *buf) override {
         auto ret = m_file->fstat(buf);
         if (ret != 0)
@@ -332,8 +717,10 @@ public:
             return m_block_size;
         }
 
+        // 0 for a block of zeros, which has no data
         __attribute__((always_inline)) size_t compressed_size() const {
-            return get_blocks_length(m_idx, m_idx + 1) - (m_verify ? sizeof(uint32_t) : 0);
+            auto len = get_blocks_length(m_idx, m_idx + 1);
+            return len ? len - (m_verify ? sizeof(uint32_t) : 0) : 0;
         }
 
         __attribute__((always_inline)) uint32_t crc32_code() const {
@@ -370,7 +757,7 @@ public:
 
             int get_current_block() {
                 m_reader->m_buf_offset = m_reader->get_buf_offset(m_reader->m_idx);
-                if ((size_t)(m_reader->m_buf_offset) >= sizeof(m_buf)) {
+                if ((size_t)(m_reader->m_buf_offset) > sizeof(m_buf)) {
                     m_reader->m_eno = ERANGE;
                     LOG_ERRNO_RETURN(0, -1, "get inner buffer offset failed.");
                 }
@@ -454,6 +841,171 @@ public:
         unsigned char m_buf[MAX_READ_SIZE]; //{};
     };
 
+    // decompress a range of blocks, whose compressed data is at `src`, into `dst`
+    struct DecompressTask {
+        const CompressionFile *zfile;
+        ICompressor *compressor;
+        size_t begin, end; // block index
+        unsigned char *src;
+        unsigned char *dst;
+        photon::semaphore *done;
+        int result;
+        const uint8_t *trusted; // blocks whose checksums are skipped, may be null
+
+        int run() {
+            auto &jt = zfile->m_jump_table;
+            auto bs = zfile->m_ht.opt.block_size;
+            auto verify = zfile->m_ht.opt.verify;
+            auto n = end - begin;
+            std::vector<size_t> src_len(n), dst_len(n);
+            for (size_t i = 0; i < n; i++) {
+                auto len = jt[begin + i + 1] - jt[begin + i];
+                src_len[i] = len ? len - (verify ? sizeof(uint32_t) : 0) : 0;
+            }
+            if (verify) {
+                // check the blocks, and pack them without the checksums in between, so
+                // that they are decompressed in a single batch as well
+                auto p = src, q = src;
+                for (size_t i = 0; i < n; i++) {
+                    if (src_len[i] == 0)
+                        continue;
+                    if (!(trusted && trusted[i]) &&
+                        crc32c_salt((void *)p, src_len[i]) != *(uint32_t *)(p + src_len[i]))
+                        LOG_ERROR_RETURN(ECHECKSUM, -1, "checksum failed (block: `)", begin + i);
+                    if (p != q)
+                        memmove(q, p, src_len[i]);
+                    p += src_len[i] + sizeof(uint32_t);
+                    q += src_len[i];
+                }
+            }
+            // blocks of zeros split the batch
+            auto p = src;
+            for (size_t i = 0; i < n;) {
+                if (src_len[i] == 0) {
+                    memset(dst + i * bs, 0, bs);
+                    dst_len[i++] = bs;
+                    continue;
+                }
+                auto j = i;
+                size_t len = 0;
+                for (; j < n && src_len[j]; j++)
+                    len += src_len[j];
+                int ret;
+                {
+                    CpuAccount::Scope _cpu(CpuAccount::DECOMPRESS);
+                    ret = compressor->decompress_batch(p, &src_len[i], dst + i * bs, (j - i) * bs,
+                                                       &dst_len[i], j - i);
+                }
+                if (ret != 0)
+                    return -1;
+                p += len;
+                i = j;
+            }
+            for (size_t i = 0; i + 1 < n; i++) {
+                if (dst_len[i] != bs)
+                    LOG_ERROR_RETURN(EIO, -1, "unexpected size of block `: `", begin + i,
+                                     dst_len[i]);
+            }
+            return 0;
+        }
+
+        static void entry(void *arg) {
+            auto task = (DecompressTask *)arg;
+            task->result = task->run();
+            task->done->signal(1);
+        }
+    };
+
+    // read the compressed data of all the blocks at once, and decompress them in
+    // batches, by the pool and the calling thread; so that an accelerator behind the
+    // compressor gets the blocks of a read at once; failures are left to pread()
+    // and preadv(), the data of which bounces through a buffer unless it's a single
+    // iovec of whole blocks
+    ssize_t parallel_preadv(const struct iovec *iov, int iovcnt, size_t count, off_t offset) {
+        size_t bs = m_ht.opt.block_size;
+        size_t begin = offset / bs, end = (offset + count - 1) / bs + 1;
+        auto nblocks = end - begin;
+        off_t cbegin = m_jump_table[begin];
+        size_t clen = m_jump_table[end] - cbegin;
+        auto cbuf = BufferPool::buffer<unsigned char>(clen);
+        if (!cbuf)
+            LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate ` bytes", clen);
+        // sampled before the data is read, as the blocks are marked verified only if
+        // nothing has been dropped from the cache since, see trust_verified()
+        uint64_t gen0, gen1;
+        bool trust = m_ht.opt.verify && trust_verified(&gen0);
+        if (m_file->pread(cbuf.get(), clen, cbegin) != (ssize_t)clen)
+            LOG_ERRNO_RETURN(0, -1, "read compressed blocks failed. (offset: `, len: `)", cbegin,
+                             clen);
+        // decompress right into the buffer if it's made of whole blocks
+        BufferPool::Buffer<unsigned char> tmp;
+        auto dst = (unsigned char *)iov[0].iov_base;
+        if (iovcnt > 1 || offset % bs || count % bs) {
+            tmp = BufferPool::buffer<unsigned char>(nblocks * bs);
+            if (!tmp)
+                LOG_ERROR_RETURN(ENOMEM, -1, "failed to allocate ` bytes", nblocks * bs);
+            dst = tmp.get();
+        }
+        auto ntasks = std::min(decompress_pool.size() + 1, nblocks / PARALLEL_BLOCKS_MIN);
+        ntasks = std::max(ntasks, (size_t)1);
+        while (m_spare_compressors.size() < ntasks - 1) {
+            auto c = new_compressor();
+            if (!c)
+                LOG_ERRNO_RETURN(0, -1, "failed to create compressor");
+            m_spare_compressors.emplace_back(c);
+        }
+        // the spare compressors are taken by this read until it's done
+        std::vector<std::unique_ptr<ICompressor>> compressors;
+        for (size_t i = 0; i < ntasks - 1; i++) {
+            compressors.emplace_back(std::move(m_spare_compressors.back()));
+            m_spare_compressors.pop_back();
+        }
+        DEFER({
+            for (auto &c : compressors)
+                m_spare_compressors.emplace_back(std::move(c));
+        });
+        // the checksums of the blocks verified before are skipped, unless they're
+        // forgotten as the data has been dropped meanwhile
+        trust = trust && trust_verified(&gen1);
+        std::vector<uint8_t> trusted;
+        if (trust) {
+            trusted.resize(nblocks);
+            for (size_t i = 0; i < nblocks; i++)
+                trusted[i] = verified(begin + i);
+        }
+        photon::semaphore done(0);
+        std::vector<DecompressTask> tasks(ntasks);
+        for (size_t i = 0; i < ntasks; i++) {
+            auto b = begin + nblocks * i / ntasks, e = begin + nblocks * (i + 1) / ntasks;
+            tasks[i] = {this, i ? compressors[i - 1].get() : m_compressor.get(), b, e,
+                        cbuf.get() + (m_jump_table[b] - cbegin), dst + (b - begin) * bs, &done, 0,
+                        trust ? trusted.data() + (b - begin) : nullptr};
+            if (i)
+                decompress_pool.submit(&DecompressTask::entry, &tasks[i]);
+        }
+        int result = tasks[0].run();
+        done.wait(ntasks - 1);
+        for (auto &t : tasks)
+            result = std::min(result, t.result);
+        if (result < 0)
+            return -1;
+        // unless the data has been dropped from the cache since it was read
+        if (trust && trust_verified(&gen1) && gen1 == gen0) {
+            for (size_t i = begin; i < end; i++)
+                set_verified(i);
+        }
+        if (tmp)
+            IOVCursor(iov, iovcnt).copy_from(tmp.get() + offset % bs, count);
+        return count;
+    }
+
+    // whether a read of `cnt` bytes is worth parallel_preadv()
+    bool parallel(size_t cnt, bool single_block) {
+        return valid == FLAG_VALID_TRUE &&
+               ((decompress_pool.size() > 0 && cnt >= PARALLEL_READ_MIN) ||
+                (m_compressor->nbatch() > 1 && !single_block));
+    }
+
     virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
 
         if (m_ht.opt.block_size > MAX_READ_SIZE) {
@@ -471,18 +1023,155 @@ public:
                      m_ht.original_file_size);
             return 0;
         }
+        // blocks partially read are kept in the block cache, as they are likely to be
+        // read again, e.g. ext4 metadata
+        bool use_cache = buf && valid == FLAG_VALID_TRUE && block_cache.enabled();
+        auto bs = m_ht.opt.block_size;
+        bool single_block = offset / bs == (offset + cnt - 1) / bs;
+        if (use_cache && single_block && (size_t)cnt < bs &&
+            block_cache.get(m_cache_id, offset / bs, buf, offset % bs, cnt))
+            return cnt;
+        struct iovec iov {buf, (size_t)cnt};
+        if (buf && parallel(cnt, single_block)) {
+            if (parallel_preadv(&iov, 1, cnt, offset) == cnt)
+                return cnt;
+            LOG_WARN("parallel decompression failed, retry serially {offset: `, count: `}", offset,
+                     cnt);
+        }
+        return read_blocks(&iov, 1, cnt, offset, use_cache && !single_block);
+    }
+
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        if (iovcnt == 1)
+            return pread(iov[0].iov_base, iov[0].iov_len, offset);
+        if (m_ht.opt.block_size > MAX_READ_SIZE) {
+            LOG_ERROR_RETURN(ENOMEM, -1, "block_size: ` > MAX_READ_SIZE (`)", m_ht.opt.block_size,
+                             MAX_READ_SIZE);
+        }
+        ssize_t cnt = 0;
+        for (int i = 0; i < iovcnt; i++)
+            cnt += iov[i].iov_len;
+        if (offset + cnt > (ssize_t)m_ht.original_file_size) {
+            LOG_WARN("the read range exceeds raw_file_size.(`>`)", cnt + offset,
+                     m_ht.original_file_size);
+            cnt = m_ht.original_file_size - offset;
+        }
+        if (cnt <= 0) {
+            LOG_WARN("the read offset exceeds raw_file_size.(`>`)", offset,
+                     m_ht.original_file_size);
+            return 0;
+        }
+        auto bs = m_ht.opt.block_size;
+        if (parallel(cnt, offset / bs == (offset + cnt - 1) / bs)) {
+            if (parallel_preadv(iov, iovcnt, cnt, offset) == cnt)
+                return cnt;
+            LOG_WARN("parallel decompression failed, retry serially {offset: `, count: `}", offset,
+                     cnt);
+        }
+        bool use_cache = valid == FLAG_VALID_TRUE && block_cache.enabled();
+        return read_blocks(iov, iovcnt, cnt, offset, use_cache);
+    }
+
+    // position in the caller's scatter list, which read_blocks() fills
+    struct IOVCursor {
+        const struct iovec *iov;
+        int iovcnt;
+        int idx = 0;
+        size_t off = 0;
+
+        IOVCursor(const struct iovec *iov, int iovcnt) : iov(iov), iovcnt(iovcnt) {
+        }
+        // the buffer at the cursor if it has `len` contiguous bytes, or nullptr
+        unsigned char *contiguous(size_t len) {
+            while (idx < iovcnt && off == iov[idx].iov_len) {
+                idx++;
+                off = 0;
+            }
+            if (idx < iovcnt && iov[idx].iov_len - off >= len)
+                return (unsigned char *)iov[idx].iov_base + off;
+            return nullptr;
+        }
+        void advance(size_t len) {
+            while (len) {
+                auto n = std::min(len, iov[idx].iov_len - off);
+                off += n;
+                len -= n;
+                if (off == iov[idx].iov_len) {
+                    idx++;
+                    off = 0;
+                }
+            }
+        }
+        void copy_from(const unsigned char *src, size_t len) {
+            while (len) {
+                if (off == iov[idx].iov_len) {
+                    idx++;
+                    off = 0;
+                    continue;
+                }
+                auto n = std::min(len, iov[idx].iov_len - off);
+                memcpy((unsigned char *)iov[idx].iov_base + off, src, n);
+                src += n;
+                len -= n;
+                advance(n);
+            }
+        }
+    };
+
+    // read [offset, offset + cnt) into the scatter list; whole blocks that fit in a
+    // single iovec are decompressed in place, others bounce through a block buffer;
+    // a null iov_base of a single iovec reads the compressed data only, for prefetch
+    ssize_t read_blocks(const struct iovec *iov, int iovcnt, size_t cnt, off_t offset,
+                        bool lookup_cache) {
+        bool prefetch = iovcnt == 1 && iov[0].iov_base == nullptr;
+        bool use_cache = !prefetch && valid == FLAG_VALID_TRUE && block_cache.enabled();
+        auto bs = m_ht.opt.block_size;
+        IOVCursor cur(iov, iovcnt);
         ssize_t readn = 0; // final will equal to count
         unsigned char raw[MAX_READ_SIZE];
+        // sampled before the data is read, as the blocks are marked verified only if
+        // nothing has been dropped from the cache since, see trust_verified()
+        uint64_t gen0 = 0;
+        bool trust0 = !prefetch && m_ht.opt.verify && trust_verified(&gen0);
         BlockReader br(this, offset, cnt);
         for (auto &block : br) {
-            if (buf == nullptr) {
+            if (prefetch) {
                 // used for prefetch; no copy, no decompress;
                 readn += block.cp_len;
                 continue;
             }
+            auto blk_idx = block.m_reader->m_idx;
+            auto dst = cur.contiguous(block.cp_len);
+            if (block.compressed_size == 0) {
+                if (valid == FLAG_VALID_CRC_CHECK) {
+                    cur.advance(block.cp_len);
+                } else if (dst) {
+                    memset(dst, 0, block.cp_len);
+                    cur.advance(block.cp_len);
+                } else {
+                    memset(raw, 0, block.cp_len);
+                    cur.copy_from(raw, block.cp_len);
+                }
+                readn += block.cp_len;
+                continue;
+            }
+            if (lookup_cache && block.cp_len != bs &&
+                block_cache.get(m_cache_id, blk_idx, dst ? dst : raw, block.cp_begin,
+                                block.cp_len)) {
+                if (dst)
+                    cur.advance(block.cp_len);
+                else
+                    cur.copy_from(raw, block.cp_len);
+                readn += block.cp_len;
+                continue;
+            }
             int retry = 3;
         again:
-            if (m_ht.opt.verify) {
+            // the block is in the buffer, so the bits are forgotten if it has been
+            // dropped since it was read; a reload was read after gen0 as well
+            uint64_t gen;
+            bool trust = trust0 && trust_verified(&gen);
+            if (m_ht.opt.verify && !(trust && verified(blk_idx))) {
                 auto c = crc32c_salt((void *)block.buffer(), block.compressed_size);
                 if (c != block.crc32_code()) {
                     if ((valid == FLAG_VALID_TRUE) && (retry--)) {
@@ -503,21 +1192,35 @@ public:
                             block.m_reader->m_buf_offset, block.compressed_size);
                     }
                 }
+                if (trust && gen == gen0)
+                    set_verified(blk_idx);
             }
             if (valid == FLAG_VALID_CRC_CHECK) {
                 LOG_DEBUG("only check crc32 and skip decompression.");
+                cur.advance(block.cp_len);
                 readn += block.cp_len;
                 continue;
             }
             int dret = -1;
-            if (block.cp_len == m_ht.opt.block_size) {
-                dret = m_compressor->decompress(block.buffer(), block.compressed_size,
-                                                (unsigned char *)buf, m_ht.opt.block_size);
-            } else {
-                dret = m_compressor->decompress(block.buffer(), block.compressed_size, raw,
-                                                m_ht.opt.block_size);
+            if (block.cp_len == m_ht.opt.block_size && dst) {
+                {
+                    CpuAccount::Scope _cpu(CpuAccount::DECOMPRESS);
+                    dret = m_compressor->decompress(block.buffer(), block.compressed_size, dst,
+                                                    m_ht.opt.block_size);
+                }
                 if (dret != -1)
-                    memcpy(buf, raw + block.cp_begin, block.cp_len);
+                    cur.advance(block.cp_len);
+            } else {
+                {
+                    CpuAccount::Scope _cpu(CpuAccount::DECOMPRESS);
+                    dret = m_compressor->decompress(block.buffer(), block.compressed_size, raw,
+                                                    m_ht.opt.block_size);
+                }
+                if (dret != -1) {
+                    cur.copy_from(raw + block.cp_begin, block.cp_len);
+                    if (use_cache && block.cp_len != bs)
+                        block_cache.put(m_cache_id, blk_idx, raw, dret);
+                }
             }
             if (dret == -1) {
                 if (retry--) {
@@ -534,7 +1237,6 @@ public:
                                  block.m_reader->m_buf_offset, block.compressed_size);
             }
             readn += block.cp_len;
-            buf = (unsigned char *)buf + block.cp_len;
         }
         if (br.m_eno != 0) {
             LOG_ERRNO_RETURN(br.m_eno, -1, "read compressed data failed.");
@@ -546,6 +1248,29 @@ public:
 static int write_header_trailer(IFile *file, bool is_header, bool is_sealed, bool is_data_file,
                                 CompressionFile::HeaderTrailer *pht, off_t offset = -1);
 
+// write the dictionary, if any, right after the header
+static int write_dict(IFile *file, const CompressArgs *args) {
+    auto &opt = args->opt;
+    if (!opt.use_dict) {
+        if (opt.dict_size)
+            LOG_ERROR_RETURN(EINVAL, -1, "dict_size is ` but no dictionary is given",
+                             opt.dict_size);
+        return 0;
+    }
+    const unsigned char *dict = args->dict_buf.get();
+    std::unique_ptr<unsigned char[]> buf;
+    if (dict == nullptr) {
+        buf.reset(new unsigned char[opt.dict_size]);
+        if (args->fdict->pread(buf.get(), opt.dict_size, 0) != (ssize_t)opt.dict_size)
+            LOG_ERRNO_RETURN(0, -1, "failed to read dictionary");
+        dict = buf.get();
+    }
+    LOG_INFO("write dictionary (size: `)", opt.dict_size);
+    if (file->write(dict, opt.dict_size) != (ssize_t)opt.dict_size)
+        LOG_ERRNO_RETURN(0, -1, "failed to write dictionary");
+    return 0;
+}
+
 ssize_t compress_data(ICompressor *compressor, const unsigned char *buf, size_t count,
                       unsigned char *dest_buf, size_t dest_len, bool gen_crc) {
 
@@ -588,14 +1313,17 @@ public:
         }
         auto pht = new (m_ht)(CompressionFile::HeaderTrailer);
         pht->set_compress_option(m_opt);
+        if (m_args->skip_zero_blocks)
+            pht->set_zero_blocks();
         LOG_INFO("write header.");
         auto ret = write_header_trailer(m_dest, true, false, true, pht);
         if (ret < 0) {
             LOG_ERRNO_RETURN(0, -1, "failed to write header");
         }
-        moffset =
-            CompressionFile::HeaderTrailer::SPACE + 0; // opt.dict_size;
-                                                       // currently dictionary is not supported.
+        if (write_dict(m_dest, m_args) != 0) {
+            return -1;
+        }
+        moffset = CompressionFile::HeaderTrailer::SPACE + m_opt.dict_size;
         m_buf_size = m_opt.block_size + BUF_SIZE;
         compressed_data = new unsigned char[m_buf_size];
         reserved_buf = new unsigned char[m_buf_size];
@@ -603,6 +1331,10 @@ public:
     }
 
     int write_buffer(const unsigned char *buf, size_t count) {
+        if (m_args->skip_zero_blocks && is_zero_block(buf, count)) {
+            m_block_len.push_back(0);
+            return 0;
+        }
         auto compressed_len =
             compress_data(m_compressor, buf, count, compressed_data, m_buf_size, m_opt.verify);
         if (compressed_len <= 0) {
@@ -713,9 +1445,13 @@ public:
     UNIMPLEMENTED(int fstat(struct stat *buf) override);
 };
 
-// multi-processor supported zfile builder
+// multi-processor supported zfile builder, as a pipeline: the caller fills chunks of
+// blocks, `workers` threads compress them, and a photon thread writes them out in
+// order, a chunk per write; the chunks are pooled in a ring
 class ZFileBuilderMP : public ZFileBuilderBase {
 public:
+    const static size_t CHUNK_SIZE = 256 * 1024; // raw data of a chunk
+
     ZFileBuilderMP(IFile *file, const CompressArgs *args, bool ownership)
         : m_dest(file), m_args(args), m_ownership(ownership) {
         m_workers = args->workers;
@@ -724,115 +1460,165 @@ public:
                  m_opt.block_size, m_opt.algo, m_opt.verify, m_workers);
     }
 
-    class WorkerCtx {
-    public:
-        int id;
-        bool writable = false;
-        unsigned char* ibuf = nullptr;
-        unsigned char* obuf = nullptr;
-        size_t size;
-        size_t buf_size;
-        photon::semaphore writable_sem;
-        photon::semaphore compress_sem;
-        photon::semaphore write_sem;
+    struct Chunk {
+        std::unique_ptr<unsigned char[]> ibuf, obuf;
+        size_t size = 0;  // raw data
+        size_t osize = 0; // compressed data
+        std::vector<uint32_t> block_len;
+        photon::semaphore done; // compressed
         int result = 0;
-
-        WorkerCtx(int id, size_t buf_size)
-            : id(id), buf_size(buf_size), writable_sem(1), compress_sem(0), write_sem(0) {
-            ibuf = new unsigned char[buf_size];
-            obuf = new unsigned char[buf_size];
-        }
-
-        ~WorkerCtx() {
-            delete ibuf;
-            delete obuf;
-        }
-        void start_compress(int isize) {
-            writable = false;
-            size = isize;
-            compress_sem.signal(1);
-        }
     };
 
     int init() {
         auto pht = new (m_ht)(CompressionFile::HeaderTrailer);
         pht->set_compress_option(m_opt);
+        if (m_args->skip_zero_blocks)
+            pht->set_zero_blocks();
         LOG_INFO("write header.");
         auto ret = write_header_trailer(m_dest, true, false, true, pht);
         if (ret < 0) {
             LOG_ERRNO_RETURN(0, -1, "failed to write header");
         }
-        moffset =
-            CompressionFile::HeaderTrailer::SPACE + 0; // opt.dict_size;
-                                                       // currently dictionary is not supported.
+        if (write_dict(m_dest, m_args) != 0) {
+            return -1;
+        }
+        moffset = CompressionFile::HeaderTrailer::SPACE + m_opt.dict_size;
         m_buf_size = m_opt.block_size + BUF_SIZE;
-        cur_id = 0;
-        for (int i = 0; i < m_workers; i++)
-            workers.emplace_back(new WorkerCtx(i, m_buf_size));
-
+        m_chunk_blocks = std::max(CHUNK_SIZE / m_opt.block_size, (size_t)1);
+        for (int i = 0; i < m_workers; i++) {
+            auto compressor = create_compressor(m_args);
+            if (compressor == nullptr) {
+                LOG_ERRNO_RETURN(0, -1, "failed to create compressor");
+            }
+            m_compressors.emplace_back(compressor);
+        }
+        // enough chunks for every worker to have one in hand and one queued
+        for (int i = 0; i < 2 * m_workers; i++) {
+            auto chunk = new Chunk;
+            chunk->ibuf.reset(new unsigned char[m_chunk_blocks * m_opt.block_size]);
+            chunk->obuf.reset(new unsigned char[m_chunk_blocks * m_buf_size]);
+            chunk->block_len.reserve(m_chunk_blocks);
+            m_chunks.emplace_back(chunk);
+        }
+        m_free.signal(m_chunks.size());
         for (int i = 0; i < m_workers; i++) {
-            ths.emplace_back([&, id=i] {
+            ths.emplace_back([&, id = i] {
                 photon::init(photon::INIT_EVENT_EPOLL, photon::INIT_IO_NONE);
                 DEFER(photon::fini());
-
-                auto ctx = workers[id];
-                auto next_ctx = workers[(id+1)%m_workers];
-                auto compressor = create_compressor(m_args);
-                if (compressor == nullptr) {
-                    ctx->result = -1;
-                    LOG_ERRNO_RETURN(0, -1, "failed to create compressor");
-                }
-                DEFER(delete compressor);
-
+                auto compressor = m_compressors[id].get();
                 while (true) {
-                    ctx->compress_sem.wait(1);
-                    if (m_stop_flag && ctx->size == 0) {
-                        break;
-                    }
-                    auto compressed_size =
-                        compress_data(compressor, ctx->ibuf, ctx->size, ctx->obuf, ctx->buf_size, m_opt.verify);
-                    if (compressed_size < 0) {
-                        ctx->result = -1;
-                        LOG_ERRNO_RETURN(EIO, -1, "failed to compress");
+                    m_task_sem.wait(1);
+                    Chunk *chunk;
+                    {
+                        std::lock_guard<std::mutex> lock(m_task_mtx);
+                        chunk = m_tasks.front();
+                        m_tasks.pop_front();
                     }
-
-                    ctx->size = 0;
-                    // ibuf is ready to write
-                    ctx->writable_sem.signal(1);
-
-                    ctx->write_sem.wait(1);
-                    moffset += compressed_size;
-                    m_block_len.push_back(compressed_size);
-                    if (m_dest->write(ctx->obuf, compressed_size) != compressed_size) {
-                        ctx->result = -1;
-                        LOG_ERRNO_RETURN(0, -1, "failed to write compressed data");
-                    }
-                    next_ctx->write_sem.signal(1);
+                    if (chunk == nullptr)
+                        break;
+                    compress_chunk(compressor, chunk);
+                    chunk->done.signal(1);
                 }
-                return 0;
             });
         }
-
-        workers[0]->write_sem.signal(1);
+        m_writer = photon::thread_enable_join(photon::thread_create(&do_write_chunks, this));
         return 0;
     }
 
-    int fini() {
-        if (reserved_size) {
-            workers[cur_id]->start_compress(reserved_size);
+    void compress_chunk(ICompressor *compressor, Chunk *chunk) {
+        chunk->osize = 0;
+        chunk->block_len.clear();
+        chunk->result = 0;
+        for (size_t offset = 0; offset < chunk->size; offset += m_opt.block_size) {
+            auto len = std::min((size_t)m_opt.block_size, chunk->size - offset);
+            if (m_args->skip_zero_blocks && is_zero_block(chunk->ibuf.get() + offset, len)) {
+                chunk->block_len.push_back(0);
+                continue;
+            }
+            auto compressed_size =
+                compress_data(compressor, chunk->ibuf.get() + offset, len,
+                              chunk->obuf.get() + chunk->osize, m_buf_size, m_opt.verify);
+            if (compressed_size <= 0) {
+                chunk->result = -1;
+                LOG_ERROR("failed to compress");
+                return;
+            }
+            chunk->block_len.push_back(compressed_size);
+            chunk->osize += compressed_size;
         }
+    }
 
-        // wait for workers
-        m_stop_flag = true;
-        for (int i = 0; i < m_workers; i++)
-            workers[i]->compress_sem.signal(1);
-        for (auto &th : ths) {
-            th.join();
+    static void *do_write_chunks(void *arg) {
+        ((ZFileBuilderMP *)arg)->write_chunks();
+        return nullptr;
+    }
+
+    // write the chunks in the order of submission, until an extra signal after the last
+    void write_chunks() {
+        for (size_t i = 0;; i++) {
+            m_submit_sem.wait(1);
+            if (i == m_nsubmitted)
+                break;
+            auto chunk = m_chunks[i % m_chunks.size()].get();
+            chunk->done.wait(1);
+            if (chunk->result < 0) {
+                m_result = -1;
+            } else if (m_result == 0) {
+                if (m_dest->write(chunk->obuf.get(), chunk->osize) != (ssize_t)chunk->osize) {
+                    LOG_ERROR("failed to write compressed data: `", ERRNO());
+                    m_result = -1;
+                } else {
+                    m_block_len.insert(m_block_len.end(), chunk->block_len.begin(),
+                                       chunk->block_len.end());
+                    moffset += chunk->osize;
+                }
+            }
+            m_free.signal(1);
         }
-        for (int i = 0; i < m_workers; i++) {
-            if (workers[i]->result < 0) {
-                LOG_ERROR_RETURN(0, -1, "failed to compress data");
+    }
+
+    void submit() {
+        {
+            std::lock_guard<std::mutex> lock(m_task_mtx);
+            m_tasks.push_back(m_cur);
+        }
+        m_task_sem.signal(1);
+        m_nsubmitted++;
+        m_submit_sem.signal(1);
+        m_cur = nullptr;
+    }
+
+    int stop() {
+        if (m_cur) {
+            if (m_cur->size)
+                submit();
+            else
+                m_free.signal(1);
+            m_cur = nullptr;
+        }
+        if (m_writer) {
+            m_submit_sem.signal(1);
+            photon::thread_join(m_writer);
+            m_writer = nullptr;
+        }
+        if (!ths.empty()) {
+            {
+                std::lock_guard<std::mutex> lock(m_task_mtx);
+                for (size_t i = 0; i < ths.size(); i++)
+                    m_tasks.push_back(nullptr);
+            }
+            m_task_sem.signal(ths.size());
+            for (auto &th : ths) {
+                th.join();
             }
+            ths.clear();
+        }
+        return m_result;
+    }
+
+    int fini() {
+        if (stop() < 0) {
+            LOG_ERROR_RETURN(0, -1, "failed to compress data");
         }
 
         // compress done
@@ -863,6 +1649,10 @@ public:
         return 0;
     }
 
+    ~ZFileBuilderMP() {
+        stop();
+    }
+
     virtual int close() override {
         if (fini() < 0) {
             return -1;
@@ -873,53 +1663,43 @@ public:
         return 0;
     }
 
-    inline void copy(WorkerCtx *ctx, const void *from, size_t count, off_t offset) {
-        if (!ctx->writable) {
-            ctx->writable_sem.wait(1);
-            ctx->writable = true;
-        }
-        memcpy(ctx->ibuf + offset, from, count);
-    }
-
     virtual ssize_t write(const void *buf, size_t count) override {
+        if (m_result < 0) {
+            LOG_ERROR_RETURN(EIO, -1, "failed to compress or write data before");
+        }
         raw_data_size += count;
         auto expected_ret = count;
-        auto ctx = workers[cur_id];
-
-        if (reserved_size != 0) {
-            if (reserved_size + count < m_opt.block_size) {
-                copy(ctx, buf, count, reserved_size);
-                reserved_size += count;
-                return expected_ret; // save uncompressed buffer and return write count;
-            }
-            auto delta = m_opt.block_size - reserved_size;
-            copy(ctx, buf, delta, reserved_size);
-            buf = (const void *)((const char*)buf + delta);
-            count -= delta;
-
-            ctx->start_compress(reserved_size + delta);
-            cur_id = (cur_id+1)%m_workers;
-            ctx = workers[cur_id];
-            reserved_size = 0;
-        }
-
-        for (off_t i = 0; i < (ssize_t)count; i += m_opt.block_size) {
-            if (i + m_opt.block_size > (ssize_t)count) {
-                copy(ctx, buf+i, count-i, 0);
-                reserved_size = count - i;
-                break;
+        auto chunk_bytes = m_chunk_blocks * m_opt.block_size;
+        while (count) {
+            if (m_cur == nullptr) {
+                m_free.wait(1);
+                m_cur = m_chunks[m_nsubmitted % m_chunks.size()].get();
+                m_cur->size = 0;
             }
-            copy(ctx, buf+i, m_opt.block_size, 0);
-            ctx->start_compress(m_opt.block_size);
-            cur_id = (cur_id+1)%m_workers;
-            ctx = workers[cur_id];
-        }
-        LOG_DEBUG("compressed ` bytes done. reserved: `", expected_ret, reserved_size);
+            auto n = std::min(count, chunk_bytes - m_cur->size);
+            memcpy(m_cur->ibuf.get() + m_cur->size, buf, n);
+            m_cur->size += n;
+            buf = (const unsigned char *)buf + n;
+            count -= n;
+            if (m_cur->size == chunk_bytes)
+                submit();
+        }
+        LOG_DEBUG("compressed ` bytes done.", expected_ret);
         return expected_ret;
     }
 
-    std::vector<WorkerCtx*> workers;
-    bool m_stop_flag = false;
+    std::vector<std::unique_ptr<Chunk>> m_chunks;
+    std::vector<std::unique_ptr<ICompressor>> m_compressors;
+    Chunk *m_cur = nullptr; // being filled
+    size_t m_nsubmitted = 0;
+    size_t m_chunk_blocks = 0;
+    photon::semaphore m_free;       // # of free chunks
+    photon::semaphore m_submit_sem; // # of submitted chunks, for the writer
+    photon::semaphore m_task_sem;   // # of chunks to compress, for the workers
+    std::mutex m_task_mtx;
+    std::deque<Chunk *> m_tasks;
+    photon::join_handle *m_writer = nullptr;
+    int m_result = 0;
     int m_workers;
     IFile *m_dest;
     off_t moffset = 0;
@@ -930,9 +1710,7 @@ public:
     bool m_ownership = false;
     std::vector<uint32_t> m_block_len;
     std::vector<std::thread> ths;
-    size_t reserved_size = 0;
     char m_ht[CompressionFile::HeaderTrailer::SPACE]{};
-    int cur_id;
 
     UNIMPLEMENTED_POINTER(IFileSystem *filesystem() override);
     UNIMPLEMENTED(int fstat(struct stat *buf) override);
@@ -1009,7 +1787,7 @@ bool load_jump_table(IFile *file, CompressionFile::HeaderTrailer *pheader_traile
     }
     ret = jump_table.build(ibuf.get(), pht->index_size,
                            CompressionFile::HeaderTrailer::SPACE + pht->opt.dict_size,
-                           pht->opt.block_size, pht->opt.verify);
+                           pht->opt.block_size, pht->opt.verify, pht->index_crc);
     if (ret != 0) {
         LOG_ERRNO_RETURN(0, false, "failed to build jump table");
     }
@@ -1042,17 +1820,32 @@ again:
         }
         LOG_ERRNO_RETURN(0, nullptr, "failed to load jump table");
     }
-    auto zfile = new CompressionFile(file, ownership);
+    // ownership is taken after it's fully opened
+    auto zfile = new CompressionFile(file, false);
     zfile->m_ht = ht;
     zfile->m_jump_table = std::move(jump_table);
-    CompressArgs args(ht.opt);
+    if (ht.opt.use_dict) {
+        auto size = ht.opt.dict_size;
+        zfile->m_dict.reset(new unsigned char[size]);
+        if (file->pread(zfile->m_dict.get(), size, CompressionFile::HeaderTrailer::SPACE) !=
+            (ssize_t)size) {
+            delete zfile;
+            LOG_ERRNO_RETURN(0, nullptr, "failed to read dictionary (size: `)", size);
+        }
+    }
     ht.opt.verify = ht.opt.verify && verify;
     LOG_INFO("digest: `, compress type: `, bs: `, data_verify: `",
         HEX(ht.digest).width(8), ht.opt.algo, ht.opt.block_size, ht.opt.verify);
 
-    zfile->m_compressor.reset(create_compressor(&args));
+    zfile->m_compressor.reset(zfile->new_compressor());
+    if (!zfile->m_compressor) {
+        delete zfile;
+        LOG_ERRNO_RETURN(0, nullptr, "failed to create compressor");
+    }
     zfile->m_ownership = ownership;
     zfile->valid = FLAG_VALID_TRUE;
+    if (zfile->m_ht.opt.verify)
+        zfile->init_verified();
     return zfile;
 }
 
@@ -1094,6 +1887,27 @@ int zfile_compress(IFile *file, IFile *as, const CompressArgs *args) {
     CompressOptions opt = args->opt;
     LOG_INFO("create compress file. [ block size: `, type: `, enable_checksum: `]", opt.block_size,
              opt.algo, opt.verify);
+    // dict_size without a dictionary asks for one trained from the source
+    std::unique_ptr<CompressArgs> trained;
+    if (opt.dict_size && !opt.use_dict) {
+        std::unique_ptr<unsigned char[]> dict(new unsigned char[opt.dict_size]);
+        auto ret = opt.algo != CompressOptions::ZSTD && opt.algo != CompressOptions::ADAPTIVE
+                       ? -1
+                       : zfile_train_dict(file, opt.block_size, dict.get(), opt.dict_size);
+        opt.dict_size = 0;
+        if (ret > 0) {
+            opt.dict_size = ret;
+            trained.reset(new CompressArgs(opt, nullptr, dict.release(), args->overwrite_header,
+                                           args->workers));
+        } else {
+            LOG_WARN("failed to train dictionary, compress without it");
+            trained.reset(new CompressArgs(opt, nullptr, nullptr, args->overwrite_header,
+                                           args->workers));
+        }
+        trained->skip_zero_blocks = args->skip_zero_blocks;
+        args = trained.get();
+        opt = args->opt;
+    }
     auto compressor = create_compressor(args);
     DEFER(delete compressor);
     if (compressor == nullptr)
@@ -1101,11 +1915,16 @@ int zfile_compress(IFile *file, IFile *as, const CompressArgs *args) {
     char buf[CompressionFile::HeaderTrailer::SPACE] = {};
     auto pht = new (buf) CompressionFile::HeaderTrailer;
     pht->set_compress_option(opt);
+    if (args->skip_zero_blocks)
+        pht->set_zero_blocks();
     LOG_INFO("write header.");
     auto ret = write_header_trailer(as, true, false, true, pht);
     if (ret < 0) {
         LOG_ERRNO_RETURN(0, -1, "failed to write header");
     }
+    if (write_dict(as, args) != 0) {
+        return -1;
+    }
     auto block_size = opt.block_size;
     LOG_INFO("block size: `", block_size);
     auto buf_size = block_size + BUF_SIZE;
@@ -1119,6 +1938,7 @@ int zfile_compress(IFile *file, IFile *as, const CompressArgs *args) {
     auto compressed_data = new unsigned char[nbatch * buf_size];
     DEFER(delete[] compressed_data);
     std::vector<size_t> raw_chunk_len, compressed_len;
+    std::vector<bool> zero(nbatch);
     compressed_len.resize(nbatch);
     raw_chunk_len.resize(nbatch);
     LOG_INFO("compress with start....");
@@ -1141,11 +1961,30 @@ int zfile_compress(IFile *file, IFile *as, const CompressArgs *args) {
             raw_chunk_len[n++] = block_size;
             readn -= block_size;
         }
-        readn = compressor->compress_batch(raw_data, &(raw_chunk_len[0]), compressed_data,
-                                         n * buf_size, &(compressed_len[0]), n);
-        if (readn != 0)
-            return -1;
-        for (off_t j = 0; j < n; j++) {
+        // blocks of zeros are left out of the batch, the others packed in place
+        int m = 0;
+        for (int j = 0; j < n; j++) {
+            zero[j] = args->skip_zero_blocks &&
+                      is_zero_block(raw_data + j * block_size, raw_chunk_len[j]);
+            if (zero[j])
+                continue;
+            if (m != j) {
+                memmove(raw_data + m * block_size, raw_data + j * block_size, raw_chunk_len[j]);
+                raw_chunk_len[m] = raw_chunk_len[j];
+            }
+            m++;
+        }
+        if (m) {
+            readn = compressor->compress_batch(raw_data, &(raw_chunk_len[0]), compressed_data,
+                                               m * buf_size, &(compressed_len[0]), m);
+            if (readn != 0)
+                return -1;
+        }
+        for (off_t i = 0, j = 0; i < n; i++) {
+            if (zero[i]) {
+                block_len.push_back(0);
+                continue;
+            }
             readn = as->write(&compressed_data[j * buf_size], compressed_len[j]);
             if (readn < (ssize_t)compressed_len[j]) {
                 LOG_ERRNO_RETURN(0, -1, "failed to write compressed data.");
@@ -1163,6 +2002,7 @@ int zfile_compress(IFile *file, IFile *as, const CompressArgs *args) {
             }
             block_len.push_back(compressed_len[j]);
             moffset += compressed_len[j];
+            j++;
         }
     }
     uint64_t index_offset = moffset;
@@ -1191,7 +2031,90 @@ int zfile_compress(IFile *file, IFile *as, const CompressArgs *args) {
     return 0;
 }
 
-int zfile_decompress(IFile *src, IFile *dst) {
+// chunks of the original data, taken in turn by the threads of zfile_scan()
+const static size_t SCAN_CHUNK = 1024 * 1024;
+
+struct ScanTask {
+    IFile *src, *dst;
+    bool crc_only;
+    size_t raw_data_size;
+    std::atomic<size_t> next{0};
+    std::atomic<int> eno{0};
+
+    void fail(int e) {
+        int expected = 0;
+        eno.compare_exchange_strong(expected, e ? e : EIO);
+    }
+
+    void run() {
+        photon::init(photon::INIT_EVENT_EPOLL, photon::INIT_IO_NONE);
+        DEFER(photon::fini());
+        // the compressor of a zfile keeps state, so each thread opens its own
+        auto file = (CompressionFile *)zfile_open_ro(src, /*verify = */ true);
+        DEFER(delete file);
+        if (file == nullptr) {
+            fail(errno);
+            LOG_ERROR_RETURN(0, , "failed to open zfile.");
+        }
+        if (crc_only)
+            file->valid = FLAG_VALID_CRC_CHECK;
+        auto buf = std::unique_ptr<unsigned char[]>(new unsigned char[SCAN_CHUNK]);
+        while (eno == 0) {
+            off_t offset = next.fetch_add(1) * SCAN_CHUNK;
+            if (offset >= (off_t)raw_data_size)
+                break;
+            auto len = (ssize_t)std::min(SCAN_CHUNK, raw_data_size - offset);
+            if (file->pread(buf.get(), len, offset) != len) {
+                fail(errno);
+                LOG_ERROR_RETURN(0, , "failed to read blocks of [`, `)", offset, offset + len);
+            }
+            if (dst && dst->pwrite(buf.get(), len, offset) != len) {
+                fail(errno);
+                LOG_ERRNO_RETURN(0, , "failed to write file into dst at `", offset);
+            }
+        }
+    }
+};
+
+// read all the blocks of `src` by `nthreads` threads, decompressed into `dst`,
+// or only checked by the crc
+static int zfile_scan(IFile *src, IFile *dst, bool crc_only, int nthreads) {
+    ScanTask task;
+    {
+        auto file = (CompressionFile *)zfile_open_ro(src, /*verify = */ true);
+        DEFER(delete file);
+        if (file == nullptr) {
+            LOG_ERROR_RETURN(0, -1, "failed to read file.");
+        }
+        if (crc_only && file->m_ht.opt.verify == 0) {
+            LOG_ERROR_RETURN(0, -1, "source file doesn't have checksum.");
+        }
+        if (file->m_ht.opt.block_size > SCAN_CHUNK) {
+            LOG_ERROR_RETURN(EINVAL, -1, "block_size ` > `", file->m_ht.opt.block_size,
+                             SCAN_CHUNK);
+        }
+        task.raw_data_size = file->m_ht.original_file_size;
+    }
+    task.src = src;
+    task.dst = dst;
+    task.crc_only = crc_only;
+    LOG_INFO("` ` bytes by ` threads", crc_only ? "check" : "decompress", task.raw_data_size,
+             nthreads);
+    std::vector<std::thread> ths;
+    for (int i = 0; i < nthreads; i++)
+        ths.emplace_back(&ScanTask::run, &task);
+    for (auto &th : ths)
+        th.join();
+    if (task.eno != 0) {
+        errno = task.eno;
+        return -1;
+    }
+    return 0;
+}
+
+int zfile_decompress(IFile *src, IFile *dst, int nthreads) {
+    if (nthreads > 1)
+        return zfile_scan(src, dst, false, nthreads);
     auto file = (CompressionFile *)zfile_open_ro(src, /*verify = */ true);
     DEFER(delete file);
     if (file == nullptr) {
@@ -1216,7 +2139,9 @@ int zfile_decompress(IFile *src, IFile *dst) {
     return 0;
 }
 
-int zfile_validation_check(IFile *src) {
+int zfile_validation_check(IFile *src, int nthreads) {
+    if (nthreads > 1)
+        return zfile_scan(src, nullptr, true, nthreads);
     auto file = (CompressionFile *)zfile_open_ro(src, /*verify = */ true);
     DEFER(delete file);
     if (file == nullptr) {
@@ -1262,6 +2187,20 @@ int is_zfile(IFile *file) {
     return 1;
 }
 
+int zfile_checksummed(const void *header, size_t size) {
+    static_assert(HEADER_SPACE == CompressionFile::HeaderTrailer::SPACE, "HEADER_SPACE");
+    if (size < HEADER_SPACE)
+        return 0;
+    // is_valid() clears the digest while checking it
+    char buf[HEADER_SPACE];
+    memcpy(buf, header, HEADER_SPACE);
+    auto pht = (CompressionFile::HeaderTrailer *)buf;
+    if (!pht->verify_magic() || !pht->is_header() || !pht->is_data_file() ||
+        !pht->is_digest_enabled() || !pht->is_valid())
+        return 0;
+    return pht->opt.verify ? 1 : 0;
+}
+
 IFile *new_zfile_builder(IFile *file, const CompressArgs *args, bool ownership) {
     ZFileBuilderBase *builder;
     if (args->workers == 1) {
@@ -18,6 +18,7 @@
 #include "compressor.h"
 namespace ZFile {
 const static size_t MAX_READ_SIZE = 65536; // 64K
+const static size_t HEADER_SPACE = 512;    // the header at the beginning of a zfile
 
 extern "C" photon::fs::IFile *zfile_open_ro(photon::fs::IFile *file, bool verify = false,
                                             bool ownership = false);
@@ -25,17 +26,45 @@ extern "C" photon::fs::IFile *zfile_open_ro(photon::fs::IFile *file, bool verify
 extern "C" int zfile_compress(photon::fs::IFile *src_file, photon::fs::IFile *dst_file,
                               const CompressArgs *opt = nullptr);
 
-extern "C" int zfile_decompress(photon::fs::IFile *src_file, photon::fs::IFile *dst_file);
+// with `nthreads` > 1, the blocks are decompressed (or checked) by as many threads,
+// each with a zfile of its own on `src_file`, and written by pwrite() at their
+// offsets, so `src_file` and `dst_file` must support positional I/O from any thread.
+extern "C" int zfile_decompress(photon::fs::IFile *src_file, photon::fs::IFile *dst_file,
+                                int nthreads = 1);
 
-extern "C" int zfile_validation_check(photon::fs::IFile *src_file);
+extern "C" int zfile_validation_check(photon::fs::IFile *src_file, int nthreads = 1);
 
 
 extern "C" photon::fs::IFile *new_zfile_builder(photon::fs::IFile *file,
                                                 const CompressArgs *args = nullptr,
                                                 bool ownership = false);
 
+// set the capacity (in bytes) of the cache of decompressed blocks, which is shared
+// by all the zfiles opened read-only; 0 (default) disables the cache.
+extern "C" void zfile_set_block_cache(size_t capacity);
+
+struct BlockCacheStats {
+    uint64_t hits = 0, misses = 0;
+    uint64_t blocks = 0, bytes = 0, capacity = 0;
+};
+BlockCacheStats zfile_block_cache_stats();
+
+// set # of threads decompressing large reads (at least 128KB) of the zfiles in
+// parallel with the calling thread; 0 (default) decompresses by the calling thread only.
+extern "C" void zfile_set_decompress_threads(int nthreads);
+
+// the blocks of the zfiles opened read-only over a file cache are verified
+// once, and trusted while the cache keeps the data they were verified by; set
+// to verify 1 in `n` reads of those again, 0 (default) for none.
+extern "C" void zfile_set_verify_sampling(uint32_t n);
+
 // return 1 if file object is a zfile.
 // return 0 if file object is a normal file.
 // otherwise return -1.
 extern "C" int is_zfile(photon::fs::IFile *file);
+
+// return 1 if `header` (HEADER_SPACE bytes read from the beginning of a file)
+// is the valid header of a zfile whose blocks carry checksums, verified as
+// they are read by a zfile opened with `verify`; otherwise return 0.
+extern "C" int zfile_checksummed(const void *header, size_t size);
 } // namespace ZFile
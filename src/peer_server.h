@@ -0,0 +1,137 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/utility.h>
+#include <photon/net/http/server.h>
+#include <photon/net/socket.h>
+
+#include "config.h"
+#include "overlaybd/buffer_pool.h"
+#include "overlaybd/cache/pool_store.h"
+#include "overlaybd/registryfs/peer_ring.h"
+
+// Serves the blocks this node owns to its peers, from its file cache only,
+// to requests carrying the token shared by the peers. A block is named by the
+// digest of its blob, never by a url, so a peer can't make this node fetch
+// anything; a block not cached here is refused, and the peer reads it from
+// the registry.
+struct PeerHandler : public photon::net::http::HTTPHandler {
+    FileSystem::ICachePool *pool;
+    PeerRing ring;
+    size_t block_size;
+    std::string token;
+
+    PeerHandler(FileSystem::ICachePool *pool, PeerRing ring, size_t block_size,
+                std::string token)
+        : pool(pool), ring(std::move(ring)), block_size(block_size), token(std::move(token)) {
+    }
+
+    int reply(photon::net::http::Response &resp, int code) {
+        resp.set_result(code);
+        resp.headers.content_length(0);
+        resp.keep_alive(true);
+        return 0;
+    }
+
+    int handle_request(photon::net::http::Request &req, photon::net::http::Response &resp,
+                       std::string_view) override {
+        if (!PeerRing::authorized(req.headers["Authorization"], token))
+            return reply(resp, 401);
+        std::string digest(req.headers[kPeerBlobHeader]);
+        std::string range(req.headers["Range"]);
+        long long begin, end;
+        if (!PeerRing::valid_digest(digest) ||
+            sscanf(range.c_str(), "bytes=%lld-%lld", &begin, &end) != 2 || begin < 0 ||
+            end < begin)
+            return reply(resp, 400);
+        // only blocks that are ours, as the peer would fetch them itself
+        // otherwise; this also keeps peers with stale rings from looping
+        auto index = begin / block_size;
+        if ((uint64_t)end / block_size != index || !ring.owned(digest, index))
+            return reply(resp, 421);
+
+        // the registry cache names a blob by its digest
+        auto store = pool->open("/" + digest, O_RDONLY, 0);
+        if (store == nullptr)
+            return reply(resp, 404);
+        DEFER(store->release());
+        size_t count = end - begin + 1;
+        if (begin + (off_t)count > store->get_actual_size())
+            return reply(resp, 404);
+        auto q = store->queryRefillRange(begin, count);
+        if (q.first < 0 || q.second)
+            return reply(resp, 404);
+        auto buf = BufferPool::buffer(count);
+        auto ret = store->pread(buf.get(), count, begin);
+        if (ret != (ssize_t)count) {
+            LOG_ERRNO_RETURN(0, reply(resp, 500), "failed to read block for peer ", VALUE(digest),
+                             VALUE(begin), VALUE(count));
+        }
+        resp.set_result(206);
+        resp.headers.content_length(count);
+        resp.keep_alive(true);
+        if (resp.write(buf.get(), count) != (ssize_t)count)
+            LOG_ERRNO_RETURN(0, -1, "failed to send block to peer ", VALUE(digest), VALUE(begin));
+        return 0;
+    }
+};
+
+struct PeerServer {
+    photon::net::http::HTTPServer *httpserver = nullptr;
+    photon::net::ISocketServer *tcpserver = nullptr;
+    PeerHandler handler;
+
+    bool ready = false;
+
+    PeerServer(ImageConfigNS::GlobalConfig &config, FileSystem::ICachePool *pool,
+               size_t block_size)
+        : handler(pool, PeerRing(config.p2pConfig().self(), config.p2pConfig().peers()),
+                  block_size, config.p2pConfig().peerToken()) {
+        // the file cache holds the layers of every image, for peers only
+        if (handler.token.empty())
+            LOG_ERROR_RETURN(EINVAL, , "serving blocks to peers needs p2pConfig.peerToken");
+        auto port = config.p2pConfig().peerPort();
+        // the address peers know this node by, unless told otherwise
+        auto addr = config.p2pConfig().peerBindAddress();
+        if (addr.empty())
+            addr = config.p2pConfig().self().substr(0, config.p2pConfig().self().rfind(':'));
+        photon::net::IPAddr ip(addr.c_str());
+        if (ip.undefined())
+            LOG_ERROR_RETURN(EINVAL, , "invalid peer bind address `", addr);
+        tcpserver = photon::net::new_tcp_socket_server();
+        tcpserver->setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+        if (tcpserver->bind(port, ip) < 0)
+            LOG_ERRNO_RETURN(0, , "Failed to bind peer address `:`", addr, port);
+        if (tcpserver->listen() < 0)
+            LOG_ERRNO_RETURN(0, , "Failed to listen peer port `", port);
+        httpserver = photon::net::http::new_http_server();
+        httpserver->add_handler(&handler, false, kPeerUriPrefix);
+        tcpserver->set_handler(httpserver->get_connection_handler());
+        tcpserver->start_loop();
+        ready = true;
+    }
+
+    ~PeerServer() {
+        delete tcpserver;
+        delete httpserver;
+    }
+};
@@ -13,16 +13,20 @@ WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
 See the License for the specific language governing permissions and
 limitations under the License.
 */
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <map>
-#include <queue>
+#include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
 #include "prefetch.h"
+#include "open_timeline.h"
+#include "qos_fs.h"
 #include <photon/common/alog.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/fs/forwardfs.h>
@@ -32,6 +36,20 @@ limitations under the License.
 
 using namespace std;
 
+// the max size of a read of the replay
+static const size_t MAX_IO_SIZE = 1024 * 1024;
+
+// caps the replay threads of all the prefetchers if > 0
+static std::atomic<int> g_max_concurrency{0};
+
+void prefetch_set_max_concurrency(int n) {
+    g_max_concurrency = n;
+}
+
+int prefetch_get_max_concurrency() {
+    return g_max_concurrency;
+}
+
 class PrefetcherImpl;
 
 class PrefetchFile : public ForwardFile_Ownership {
@@ -47,10 +65,13 @@ private:
 
 class PrefetcherImpl : public Prefetcher {
 public:
-    explicit PrefetcherImpl(const string &trace_file_path, int concurrency) : m_concurrency(concurrency) {
+    explicit PrefetcherImpl(const string &trace_file_path, const PrefetchOptions &opts)
+        : m_qos_bucket(opts.qos_bucket), m_timeline(opts.timeline),
+          m_concurrency(opts.concurrency),
+          m_align(opts.align ? opts.align : 1), m_start(photon::now), m_ahead_us(opts.ahead_us),
+          m_ahead_bytes(opts.ahead_bytes), m_min_hit_percent(opts.min_hit_percent) {
         // Detect mode
-        size_t file_size = 0;
-        m_mode = detect_mode(trace_file_path, &file_size);
+        m_mode = detect_mode(trace_file_path);
         m_lock_file_path = trace_file_path + ".lock";
         m_ok_file_path = trace_file_path + ".ok";
         LOG_INFO("Prefetch: run with mode `, trace file is `", m_mode, trace_file_path);
@@ -72,7 +93,7 @@ public:
 
         // Reload if going to replay
         if (m_mode == Mode::Replay) {
-            reload(file_size);
+            reload();
         }
     }
 
@@ -86,15 +107,7 @@ public:
             dump();
 
         } else if (m_mode == Mode::Replay) {
-            m_replay_stopped = true;
-            if (m_replay_thread) {
-                for (auto th : m_replay_threads) {
-                    if (th) {
-                        photon::thread_shutdown((photon::thread *)th);
-                    }
-                }
-                photon::thread_join(m_replay_thread);
-            }
+            stop_replay();
         }
 
         if (m_trace_file != nullptr) {
@@ -110,17 +123,19 @@ public:
         if (m_record_stopped) {
             return;
         }
-        TraceFormat trace = {op, layer_index, count, offset};
+        TraceFormat trace = {op, layer_index, count, offset, photon::now - m_start};
         m_record_array.push_back(trace);
     }
 
     void do_replay() {
+        auto replay_start = photon::now;
         struct timeval start;
         gettimeofday(&start, NULL);
         LOG_INFO("Prefetch: Replay ` records from ` layers, concurrency `",
-                 m_replay_queue.size(), m_src_files.size(), m_concurrency);
+                 m_replay_plan.size(), m_src_files.size(), m_concurrency);
+        // the cap only parks some of them, it never adds threads
         for (int i = 0; i < m_concurrency; ++i) {
-            auto th = photon::thread_create11(&PrefetcherImpl::replay_worker_thread, this);
+            auto th = photon::thread_create11(&PrefetcherImpl::replay_worker_thread, this, i);
             auto join_handle = photon::thread_enable_join(th);
             m_replay_threads.push_back(join_handle);
         }
@@ -132,23 +147,59 @@ public:
         gettimeofday(&end, NULL);
         uint64_t elapsed = 1000000UL * (end.tv_sec - start.tv_sec) + end.tv_usec - start.tv_usec;
         LOG_INFO("Prefetch: Replay done, time cost ` ms", elapsed / 1000);
+        if (m_timeline) {
+            m_timeline->add("prefetch", replay_start);
+            m_timeline->save();
+        }
     }
 
     void replay() override {
         if (m_mode != Mode::Replay) {
             return;
         }
-        if (m_replay_queue.empty() || m_src_files.empty()) {
+        if (m_replay_plan.empty() || m_src_files.empty()) {
             return;
         }
         auto th = photon::thread_create11(&PrefetcherImpl::do_replay, this);
         m_replay_thread = photon::thread_enable_join(th);
     }
 
-    int replay_worker_thread() {
-        while (!m_replay_queue.empty() && !m_replay_stopped) {
-            auto trace = m_replay_queue.front();
-            m_replay_queue.pop();
+    size_t memory_usage() const override {
+        return m_record_array.capacity() * sizeof(TraceFormat) +
+               m_replay_plan.capacity() * sizeof(TraceFormat) +
+               m_replay_bytes.capacity() * sizeof(uint64_t) +
+               m_replay_by_offset.capacity() * sizeof(size_t);
+    }
+
+    size_t shed() override {
+        if (m_mode != Mode::Replay)
+            return 0;
+        auto before = memory_usage();
+        stop_replay();
+        vector<TraceFormat>().swap(m_replay_plan);
+        vector<uint64_t>().swap(m_replay_bytes);
+        vector<size_t>().swap(m_replay_by_offset);
+        m_replay_next = 0;
+        return before - memory_usage();
+    }
+
+    TokenBucket *m_qos_bucket;
+    OpenTimeline *m_timeline;
+
+    int replay_worker_thread(int index) {
+        QosScope qos(IoClass::Prefetch, m_qos_bucket);
+        while (m_replay_next < m_replay_plan.size() && !m_replay_stopped) {
+            auto cap = g_max_concurrency.load(std::memory_order_relaxed);
+            if (cap > 0 && index >= cap) {
+                // parked until the cap is raised, or shut down by stop_replay()
+                photon::thread_usleep(PARK_INTERVAL_US);
+                continue;
+            }
+            auto idx = m_replay_next++;
+            if (wait_for_window(idx) != 0) {
+                break;
+            }
+            auto trace = m_replay_plan[idx];
             auto iter = m_src_files.find(trace.layer_index);
             if (iter == m_src_files.end()) {
                 continue;
@@ -170,25 +221,55 @@ public:
         m_src_files[layer_index] = src_file;
     }
 
+    // Moves the progress of the container on to the access time of the
+    // planned read that a live read of it falls in, for the replay to keep
+    // within the window ahead of it.
+    void track(uint32_t layer_index, off_t offset) {
+        if (!jit() || m_replay_by_offset.empty()) {
+            return;
+        }
+        auto it = std::upper_bound(m_replay_by_offset.begin(), m_replay_by_offset.end(),
+                                   make_pair(layer_index, offset),
+                                   [&](const pair<uint32_t, off_t> &key, size_t i) {
+                                       auto &r = m_replay_plan[i];
+                                       return key < make_pair(r.layer_index, r.offset);
+                                   });
+        if (it == m_replay_by_offset.begin()) {
+            return;
+        }
+        auto &r = m_replay_plan[*--it];
+        if (r.layer_index != layer_index || offset >= r.offset + (off_t)r.count) {
+            return;
+        }
+        if (r.time_us > m_progress) {
+            m_progress = r.time_us;
+            m_progress_cv.notify_all();
+        }
+    }
+
 private:
-    struct TraceFormat {
-        TraceOp op;
-        uint32_t layer_index;
-        size_t count;
-        off_t offset;
-    };
-
-    struct TraceHeader {
-        uint32_t magic = 0;
-        size_t data_size = 0;
-        uint32_t checksum = 0;
-    };
-
-    static const int MAX_IO_SIZE = 1024 * 1024;
-    static const uint32_t TRACE_MAGIC = 3270449184; // CRC32 of `Container Image Trace Format`
+    static const uint64_t PARK_INTERVAL_US = 100 * 1000;
+
+    void stop_replay() {
+        m_replay_stopped = true;
+        if (m_replay_thread) {
+            for (auto th : m_replay_threads) {
+                if (th) {
+                    photon::thread_shutdown((photon::thread *)th);
+                }
+            }
+            photon::thread_join(m_replay_thread);
+            m_replay_thread = nullptr;
+        }
+    }
 
     vector<TraceFormat> m_record_array;
-    queue<TraceFormat> m_replay_queue;
+    vector<TraceFormat> m_replay_plan;
+    size_t m_replay_next = 0;
+    // the bytes of the plan before each read of it, and one past the end
+    vector<uint64_t> m_replay_bytes;
+    // the indexes of the plan in the order of (layer, offset)
+    vector<size_t> m_replay_by_offset;
     map<uint32_t, IFile *> m_src_files;
     vector<photon::join_handle *> m_replay_threads;
     photon::join_handle *m_replay_thread = nullptr;
@@ -201,6 +282,46 @@ private:
     bool m_record_stopped = false;
     bool m_buffer_released = false;
     int m_concurrency;
+    size_t m_align;
+    uint64_t m_start;
+    // the window of just-in-time replay ahead of the container, none if 0
+    uint64_t m_ahead_us, m_ahead_bytes;
+    uint32_t m_min_hit_percent;
+    // the access time in the recording the container has reached
+    uint64_t m_progress = 0;
+    photon::condition_variable m_progress_cv;
+
+    bool jit() const {
+        return m_ahead_us != 0 || m_ahead_bytes != 0;
+    }
+
+    // Waits until read `idx` of the plan is within the window ahead of the
+    // container, which is at the latest access time it has been seen to
+    // reach, or at the time it has been running for, if later, should it not
+    // read what was recorded. Returns -1 if stopped.
+    int wait_for_window(size_t idx) {
+        if (!jit()) {
+            return 0;
+        }
+        auto &r = m_replay_plan[idx];
+        while (!m_replay_stopped) {
+            auto progress = std::max(m_progress, photon::now - m_start);
+            bool ok = m_ahead_us == 0 || r.time_us <= progress + m_ahead_us;
+            if (ok && m_ahead_bytes) {
+                auto reached = std::upper_bound(m_replay_plan.begin(), m_replay_plan.end(), progress,
+                                                [](uint64_t t, const TraceFormat &each) {
+                                                    return t < each.time_us;
+                                                }) - m_replay_plan.begin();
+                ok = m_replay_bytes[idx] <= m_replay_bytes[reached] + m_ahead_bytes;
+            }
+            if (ok) {
+                return 0;
+            }
+            // on the wall clock too
+            m_progress_cv.wait_no_lock(100 * 1000);
+        }
+        return -1;
+    }
 
     int dump() {
         if (m_trace_file == nullptr) {
@@ -219,30 +340,9 @@ private:
         };
         DEFER(close_trace_file());
 
-        TraceHeader hdr = {};
-        hdr.magic = TRACE_MAGIC;
-        hdr.checksum = 0; // calculate and re-write checksum later
-        hdr.data_size = sizeof(TraceFormat) * m_record_array.size();
-
-        ssize_t n_written = m_trace_file->write(&hdr, sizeof(TraceHeader));
-        if (n_written != sizeof(TraceHeader)) {
-            m_trace_file->ftruncate(0);
-            LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write header failed");
-        }
-
-        for (auto &each : m_record_array) {
-            hdr.checksum = crc32::crc32c_extend(&each, sizeof(TraceFormat), hdr.checksum);
-            n_written = m_trace_file->write(&each, sizeof(TraceFormat));
-            if (n_written != sizeof(TraceFormat)) {
-                m_trace_file->ftruncate(0);
-                LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write content failed");
-            }
-        }
-
-        n_written = m_trace_file->pwrite(&hdr, sizeof(TraceHeader), 0);
-        if (n_written != sizeof(TraceHeader)) {
+        if (save_trace(m_trace_file, m_record_array) != 0) {
             m_trace_file->ftruncate(0);
-            LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write header(checksum) failed");
+            return -1;
         }
 
         unlink(m_lock_file_path.c_str());
@@ -256,40 +356,28 @@ private:
         return 0;
     }
 
-    int reload(size_t trace_file_size) {
-        // Reload header
-        TraceHeader hdr = {};
-        ssize_t n_read = m_trace_file->read(&hdr, sizeof(TraceHeader));
-        if (n_read != sizeof(TraceHeader)) {
-            LOG_ERRNO_RETURN(0, -1, "Prefetch: reload header failed");
+    int reload() {
+        vector<TraceFormat> records;
+        if (load_trace(m_trace_file, records, m_min_hit_percent) != 0) {
+            return -1;
         }
-        if (TRACE_MAGIC != hdr.magic) {
-            LOG_ERROR_RETURN(0, -1, "Prefetch: trace magic mismatch");
+        m_replay_plan = plan_replay(records, m_align);
+        m_replay_bytes.assign(1, 0);
+        for (auto &each : m_replay_plan) {
+            m_replay_bytes.push_back(m_replay_bytes.back() + each.count);
         }
-        if (trace_file_size != hdr.data_size + sizeof(TraceHeader)) {
-            LOG_ERROR_RETURN(0, -1, "Prefetch: trace file size mismatch");
-        }
-
-        // Reload content
-        uint32_t checksum = 0;
-        TraceFormat fmt = {};
-        for (size_t i = 0; i < hdr.data_size / sizeof(TraceFormat); ++i) {
-            n_read = m_trace_file->read(&fmt, sizeof(TraceFormat));
-            if (n_read != sizeof(TraceFormat)) {
-                LOG_ERRNO_RETURN(0, -1, "Prefetch: reload content failed");
+        if (jit()) {
+            m_replay_by_offset.resize(m_replay_plan.size());
+            for (size_t i = 0; i < m_replay_plan.size(); i++) {
+                m_replay_by_offset[i] = i;
             }
-            checksum = crc32::crc32c_extend(&fmt, sizeof(TraceFormat), checksum);
-            // Save in memory
-            m_replay_queue.push(fmt);
+            std::sort(m_replay_by_offset.begin(), m_replay_by_offset.end(), [&](size_t a, size_t b) {
+                auto &x = m_replay_plan[a], &y = m_replay_plan[b];
+                return make_pair(x.layer_index, x.offset) < make_pair(y.layer_index, y.offset);
+            });
         }
-
-        if (checksum != hdr.checksum) {
-            queue<TraceFormat> tmp;
-            m_replay_queue.swap(tmp);
-            LOG_ERROR_RETURN(0, -1, "Prefetch: reload checksum error");
-        }
-
-        LOG_INFO("Prefetch: Reload ` records", m_replay_queue.size());
+        LOG_INFO("Prefetch: Reload ` records, ` reads planned", records.size(),
+                 m_replay_plan.size());
         return 0;
     }
 
@@ -315,7 +403,7 @@ private:
 
 LogBuffer &operator<<(LogBuffer &log, const PrefetcherImpl::TraceFormat &f) {
     return log << "Op " << char(f.op) << ", Count " << f.count << ", Offset " << f.offset
-               << ", Layer_index " << f.layer_index;
+               << ", Layer_index " << f.layer_index << ", Time_us " << f.time_us;
 }
 
 PrefetchFile::PrefetchFile(IFile *src_file, uint32_t layer_index, Prefetcher *prefetcher)
@@ -327,6 +415,9 @@ PrefetchFile::PrefetchFile(IFile *src_file, uint32_t layer_index, Prefetcher *pr
 }
 
 ssize_t PrefetchFile::pread(void *buf, size_t count, off_t offset) {
+    if (m_prefetcher->get_mode() == PrefetcherImpl::Mode::Replay) {
+        m_prefetcher->track(m_layer_index, offset);
+    }
     ssize_t n_read = m_file->pread(buf, count, offset);
     if (n_read == (ssize_t)count && m_prefetcher->get_mode() == PrefetcherImpl::Mode::Record) {
         m_prefetcher->record(PrefetcherImpl::TraceOp::READ, m_layer_index, count, offset);
@@ -334,8 +425,169 @@ ssize_t PrefetchFile::pread(void *buf, size_t count, off_t offset) {
     return n_read;
 }
 
-Prefetcher *new_prefetcher(const string &trace_file_path, int concurrency) {
-    return new PrefetcherImpl(trace_file_path, concurrency);
+Prefetcher *new_prefetcher(const string &trace_file_path, const PrefetchOptions &opts) {
+    return new PrefetcherImpl(trace_file_path, opts);
+}
+
+int Prefetcher::load_trace(IFile *file, vector<TraceFormat> &records, uint32_t min_hit_percent,
+                           uint32_t *magic) {
+    TraceHeader hdr = {};
+    if (file->pread(&hdr, sizeof(TraceHeader), 0) != sizeof(TraceHeader)) {
+        LOG_ERRNO_RETURN(0, -1, "Prefetch: reload header failed");
+    }
+    if (TRACE_MAGIC != hdr.magic && TRACE_MAGIC_V2 != hdr.magic && PROFILE_MAGIC != hdr.magic) {
+        LOG_ERROR_RETURN(0, -1, "Prefetch: trace magic mismatch");
+    }
+    struct stat st;
+    if (file->fstat(&st) != 0 || (size_t)st.st_size != hdr.data_size + sizeof(TraceHeader)) {
+        LOG_ERROR_RETURN(0, -1, "Prefetch: trace file size mismatch");
+    }
+    vector<char> data(hdr.data_size);
+    if (file->pread(data.data(), data.size(), sizeof(TraceHeader)) != (ssize_t)data.size()) {
+        LOG_ERRNO_RETURN(0, -1, "Prefetch: reload content failed");
+    }
+    if (crc32::crc32c_extend(data.data(), data.size(), 0) != hdr.checksum) {
+        LOG_ERROR_RETURN(0, -1, "Prefetch: reload checksum error");
+    }
+
+    records.clear();
+    if (magic) {
+        *magic = hdr.magic;
+    }
+    if (hdr.magic == PROFILE_MAGIC) {
+        auto ranges = (const ProfileFormat *)data.data();
+        for (size_t i = 0; i < data.size() / sizeof(ProfileFormat); i++) {
+            auto &r = ranges[i];
+            if ((uint64_t)r.hits * 100 >= (uint64_t)r.runs * min_hit_percent) {
+                records.push_back(
+                    {TraceOp::READ, r.layer_index, r.count, (off_t)r.offset, r.time_us});
+            }
+        }
+        return 0;
+    }
+    // a v1 record is the head of a v2 one, taken as accessed in the order recorded
+    size_t record_size = hdr.magic == TRACE_MAGIC ? TRACE_FORMAT_V1_SIZE : sizeof(TraceFormat);
+    for (size_t i = 0; i < data.size() / record_size; i++) {
+        TraceFormat fmt = {};
+        memcpy(&fmt, data.data() + i * record_size, record_size);
+        if (record_size == TRACE_FORMAT_V1_SIZE) {
+            fmt.time_us = i;
+        }
+        records.push_back(fmt);
+    }
+    return 0;
+}
+
+vector<Prefetcher::TraceFormat> Prefetcher::plan_replay(const vector<TraceFormat> &records,
+                                                        size_t align) {
+    auto max_io = std::max(align, MAX_IO_SIZE / align * align);
+    vector<TraceFormat> reads;
+    for (auto &r : records) {
+        if (r.op != TraceOp::READ || r.count == 0) {
+            continue;
+        }
+        auto begin = r.offset / (off_t)align * (off_t)align;
+        auto end = (r.offset + (off_t)r.count + (off_t)align - 1) / (off_t)align * (off_t)align;
+        reads.push_back({TraceOp::READ, r.layer_index, (size_t)(end - begin), begin, r.time_us});
+    }
+    std::sort(reads.begin(), reads.end(), [](const TraceFormat &a, const TraceFormat &b) {
+        return a.layer_index != b.layer_index ? a.layer_index < b.layer_index
+                                              : a.offset < b.offset;
+    });
+
+    vector<TraceFormat> plan;
+    for (size_t i = 0; i < reads.size();) {
+        // [i, j) is a run of ranges overlapping or adjoining each other
+        auto start = reads[i].offset;
+        auto end = start + (off_t)reads[i].count;
+        size_t j = i + 1;
+        for (; j < reads.size() && reads[j].layer_index == reads[i].layer_index &&
+               reads[j].offset <= end;
+             j++) {
+            end = std::max(end, reads[j].offset + (off_t)reads[j].count);
+        }
+        auto nchunks = (end - start + max_io - 1) / max_io;
+        vector<uint64_t> first(nchunks, UINT64_MAX);
+        for (auto k = i; k < j; k++) {
+            auto from = (reads[k].offset - start) / max_io;
+            auto to = (reads[k].offset + reads[k].count - 1 - start) / max_io;
+            for (auto c = from; c <= to; c++) {
+                first[c] = std::min(first[c], reads[k].time_us);
+            }
+        }
+        for (size_t c = 0; c < (size_t)nchunks; c++) {
+            auto offset = start + (off_t)(c * max_io);
+            auto count = std::min((off_t)max_io, end - offset);
+            plan.push_back({TraceOp::READ, reads[i].layer_index, (size_t)count, offset, first[c]});
+        }
+        i = j;
+    }
+    std::stable_sort(plan.begin(), plan.end(), [](const TraceFormat &a, const TraceFormat &b) {
+        return a.time_us < b.time_us;
+    });
+    return plan;
+}
+
+static int save_records(IFile *file, uint32_t magic, const void *data, size_t size) {
+    Prefetcher::TraceHeader hdr = {};
+    hdr.magic = magic;
+    hdr.data_size = size;
+    hdr.checksum = crc32::crc32c_extend(data, size, 0);
+    if (file->pwrite(&hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+        LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write header failed");
+    }
+    if (file->pwrite(data, size, sizeof(hdr)) != (ssize_t)size) {
+        LOG_ERRNO_RETURN(0, -1, "Prefetch: dump write content failed");
+    }
+    return 0;
+}
+
+int Prefetcher::save_trace(IFile *file, const vector<TraceFormat> &records) {
+    return save_records(file, TRACE_MAGIC_V2, records.data(), records.size() * sizeof(TraceFormat));
+}
+
+int Prefetcher::save_profile(IFile *file, const vector<vector<TraceFormat>> &traces,
+                             size_t align) {
+    // the first access times of each block, one of each run reading it
+    map<pair<uint32_t, uint64_t>, vector<uint64_t>> blocks;
+    for (auto &trace : traces) {
+        map<pair<uint32_t, uint64_t>, uint64_t> first;
+        for (auto &r : trace) {
+            if (r.op != TraceOp::READ || r.count == 0) {
+                continue;
+            }
+            for (uint64_t b = r.offset / align; b <= (r.offset + r.count - 1) / align; b++) {
+                auto it = first.emplace(make_pair(r.layer_index, b), r.time_us).first;
+                it->second = std::min(it->second, r.time_us);
+            }
+        }
+        for (auto &each : first) {
+            blocks[each.first].push_back(each.second);
+        }
+    }
+
+    // the runs of adjoining blocks read as many times make the ranges
+    vector<ProfileFormat> ranges;
+    for (auto &each : blocks) {
+        auto &times = each.second;
+        std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+        uint32_t hits = times.size();
+        auto median = times[times.size() / 2];
+        auto layer = each.first.first;
+        auto offset = each.first.second * align;
+        if (!ranges.empty()) {
+            auto &last = ranges.back();
+            if (last.layer_index == layer && last.hits == hits &&
+                last.offset + last.count == offset) {
+                last.count += align;
+                last.time_us = std::min(last.time_us, median);
+                continue;
+            }
+        }
+        ranges.push_back({layer, hits, (uint32_t)traces.size(), 0, offset, align, median});
+    }
+    LOG_INFO("Prefetch: merge ` traces into ` ranges", traces.size(), ranges.size());
+    return save_records(file, PROFILE_MAGIC, ranges.data(), ranges.size() * sizeof(ProfileFormat));
 }
 
 Prefetcher::Mode Prefetcher::detect_mode(const string &trace_file_path, size_t *file_size) {
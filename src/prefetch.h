@@ -17,8 +17,11 @@ limitations under the License.
 
 #include <cctype>
 #include <string>
+#include <vector>
 #include <photon/fs/filesystem.h>
 
+class OpenTimeline;
+
 using namespace photon::fs;
 /*
  * 1. Prefetcher supports `record` and `replay` operations on a specific container image.
@@ -49,12 +52,73 @@ public:
 
     virtual void replay() = 0;
 
+    // bytes held by the records and the replay plan
+    virtual size_t memory_usage() const = 0;
+
+    // stops replaying and frees the plan, which is optional for the image
+    // to work; returns the bytes freed
+    virtual size_t shed() = 0;
+
     // Prefetch file inherits ForwardFile, and it is the actual caller of `record` method.
     // The source file is supposed to have cache.
     virtual IFile *new_prefetch_file(IFile *src_file, uint32_t layer_index) = 0;
 
     static Mode detect_mode(const std::string &trace_file_path, size_t *file_size = nullptr);
 
+    // A trace file is a TraceHeader, then the records of the accesses, or
+    // the ranges of a profile merged from the traces of many runs.
+    struct TraceFormat {
+        TraceOp op;
+        uint32_t layer_index;
+        size_t count;
+        off_t offset;
+        uint64_t time_us; // of the access since the image was opened, not in v1 traces
+    };
+
+    struct TraceHeader {
+        uint32_t magic = 0;
+        size_t data_size = 0;
+        uint32_t checksum = 0;
+    };
+
+    struct ProfileFormat {
+        uint32_t layer_index;
+        uint32_t hits; // # of the runs accessing the range
+        uint32_t runs; // # of the runs merged
+        uint32_t reserved;
+        uint64_t offset;
+        uint64_t count;
+        uint64_t time_us; // median of the first access times of the runs
+    };
+
+    static const uint32_t TRACE_MAGIC = 3270449184; // CRC32 of `Container Image Trace Format`
+    static const uint32_t TRACE_MAGIC_V2 = 4233965968; // CRC32 of `Container Image Trace Format v2`
+    static const uint32_t PROFILE_MAGIC = 2890469608; // CRC32 of `Container Image Trace Profile`
+    // the size of a record of v1 traces, the fields before `time_us`
+    static const size_t TRACE_FORMAT_V1_SIZE = 24;
+
+    // Loads the records of the trace in `file`. Those of a profile are reads
+    // of the ranges accessed in `min_hit_percent` of the runs at least. The
+    // magic of the trace is stored in `magic` if given.
+    static int load_trace(IFile *file, std::vector<TraceFormat> &records,
+                          uint32_t min_hit_percent = 0, uint32_t *magic = nullptr);
+
+    static int save_trace(IFile *file, const std::vector<TraceFormat> &records);
+
+    // Plans the reads of the replay: the ranges read in `records` are aligned
+    // to `align`, merged per layer where they overlap or adjoin, and cut into
+    // reads of 1MB at most, each of which takes the earliest access time of
+    // the records it covers. The reads are in the order of that time, so the
+    // data needed first comes first.
+    static std::vector<TraceFormat> plan_replay(const std::vector<TraceFormat> &records,
+                                                size_t align);
+
+    // Merges the `traces` of many runs into a profile of their ranges read,
+    // in blocks of `align`, with how many of the runs read each of them and
+    // the median of the times they were first read.
+    static int save_profile(IFile *file, const std::vector<std::vector<TraceFormat>> &traces,
+                            size_t align);
+
     Mode get_mode() const {
         return m_mode;
     }
@@ -63,4 +127,28 @@ protected:
     Mode m_mode;
 };
 
-Prefetcher *new_prefetcher(const std::string &trace_file_path, int concurrency);
+class TokenBucket;
+
+struct PrefetchOptions {
+    int concurrency = 16;
+    // replayed reads are charged to it if given
+    TokenBucket *qos_bucket = nullptr;
+    // replayed reads are aligned to it, which is best the refill size of the cache
+    size_t align = 4096;
+    // with either, the replay keeps no further than that ahead of what the
+    // container reads, rather than running flat out
+    uint64_t ahead_us = 0;
+    uint64_t ahead_bytes = 0;
+    // of a profile, the ranges accessed in this % of the runs at least are replayed
+    uint32_t min_hit_percent = 50;
+    // the replay is added to it as the `prefetch` phase if given
+    OpenTimeline *timeline = nullptr;
+};
+
+Prefetcher *new_prefetcher(const std::string &trace_file_path, const PrefetchOptions &opts);
+
+// caps the replay threads of all the prefetchers at runtime, 0 (default) for
+// no cap. Replays park their threads above the cap, so each one runs at most
+// min(cap, its own concurrency) of them.
+void prefetch_set_max_concurrency(int n);
+int prefetch_get_max_concurrency();
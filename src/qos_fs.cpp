@@ -0,0 +1,258 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "qos_fs.h"
+#include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <photon/common/alog.h>
+#include <photon/fs/forwardfs.h>
+#include <photon/thread/thread.h>
+
+using namespace photon::fs;
+
+uint64_t TokenBucket::take(size_t n, double share) {
+    if (m_rate == 0)
+        return 0;
+    auto rate = std::max(1.0, m_rate * share);
+    std::lock_guard<std::mutex> lock(m_mtx);
+    auto now = photon::now;
+    // idle time is credited up to a second
+    auto from = std::max(m_paid_until, now > 1000000 ? now - 1000000 : 0);
+    m_paid_until = from + (uint64_t)(n * 1000000.0 / rate);
+    return m_paid_until > now ? m_paid_until - now : 0;
+}
+
+namespace {
+
+struct QosTag {
+    IoClass cls = IoClass::Foreground;
+    TokenBucket *image = nullptr;
+};
+
+std::mutex g_tags_mtx;
+std::unordered_map<photon::thread *, QosTag> g_tags;
+
+QosTag current_tag() {
+    std::lock_guard<std::mutex> lock(g_tags_mtx);
+    auto it = g_tags.find(photon::CURRENT);
+    return it == g_tags.end() ? QosTag() : it->second;
+}
+
+} // namespace
+
+IoClass current_io_class() {
+    return current_tag().cls;
+}
+
+QosScope::QosScope(IoClass cls, TokenBucket *image) {
+    std::lock_guard<std::mutex> lock(g_tags_mtx);
+    auto &tag = g_tags[photon::CURRENT];
+    m_prev_cls = tag.cls;
+    m_prev_image = tag.image;
+    tag = {cls, image};
+}
+
+QosScope::~QosScope() {
+    std::lock_guard<std::mutex> lock(g_tags_mtx);
+    if (m_prev_cls == IoClass::Foreground && m_prev_image == nullptr) {
+        g_tags.erase(photon::CURRENT);
+    } else {
+        g_tags[photon::CURRENT] = {m_prev_cls, m_prev_image};
+    }
+}
+
+class QosScheduler {
+public:
+    explicit QosScheduler(const QosOptions &opts) : m_opts(opts) {
+        if (m_opts.max_inflight == 0)
+            m_opts.max_inflight = 1;
+        m_buckets[(int)IoClass::Prefetch].set_rate(opts.prefetch_rate);
+        m_buckets[(int)IoClass::Download].set_rate(opts.download_rate);
+    }
+
+    void acquire(const QosTag &tag, size_t n) {
+        auto c = (int)tag.cls;
+        if (tag.cls != IoClass::Foreground) {
+            double share;
+            {
+                std::lock_guard<std::mutex> lock(m_mtx);
+                share = m_bg_share;
+            }
+            auto wait = m_buckets[c].take(n, share);
+            if (tag.image)
+                wait = std::max(wait, tag.image->take(n, share));
+            if (wait)
+                photon::thread_usleep(wait);
+        }
+        Waiter w{tag.cls};
+        {
+            std::lock_guard<std::mutex> lock(m_mtx);
+            auto start = std::max(m_vclock, m_finish[c]);
+            m_finish[c] = start + n / kWeights[c];
+            m_queue.emplace(std::make_pair(m_finish[c], m_seq++), &w);
+            dispatch();
+        }
+        w.sem.wait(1);
+        // the dispatcher signals under the lock, don't let `w` go before it's done
+        std::lock_guard<std::mutex> lock(m_mtx);
+    }
+
+    void release(IoClass cls, uint64_t latency) {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_inflight--;
+        if (cls != IoClass::Foreground) {
+            m_bg_inflight--;
+        } else {
+            m_fg_latency = m_fg_latency ? (m_fg_latency * 7 + latency) / 8 : latency;
+            adjust_share();
+        }
+        dispatch();
+    }
+
+private:
+    static constexpr double kWeights[(int)IoClass::Count] = {8, 2, 1};
+    static constexpr double kMinShare = 1.0 / 16;
+    static const uint64_t kAdjustInterval = 100 * 1000;
+
+    struct Waiter {
+        IoClass cls;
+        photon::semaphore sem;
+    };
+
+    uint32_t bg_limit() const {
+        return std::max(1u, (uint32_t)(m_opts.max_inflight * m_bg_share));
+    }
+
+    bool admissible(IoClass cls) const {
+        if (m_inflight >= m_opts.max_inflight)
+            return false;
+        return cls == IoClass::Foreground || m_bg_inflight < bg_limit();
+    }
+
+    // starts the waiters in order of their virtual finish time
+    void dispatch() {
+        for (auto it = m_queue.begin();
+             it != m_queue.end() && m_inflight < m_opts.max_inflight;) {
+            auto w = it->second;
+            if (!admissible(w->cls)) {
+                ++it;
+                continue;
+            }
+            m_vclock = std::max(m_vclock, it->first.first);
+            m_inflight++;
+            if (w->cls != IoClass::Foreground)
+                m_bg_inflight++;
+            it = m_queue.erase(it);
+            w->sem.signal(1);
+        }
+    }
+
+    // AIMD on the background share, by the foreground latency
+    void adjust_share() {
+        if (photon::now < m_last_adjust + kAdjustInterval)
+            return;
+        m_last_adjust = photon::now;
+        auto prev = m_bg_share;
+        if (m_fg_latency > m_opts.latency_target_us) {
+            m_bg_share = std::max(kMinShare, m_bg_share / 2);
+        } else {
+            m_bg_share = std::min(1.0, m_bg_share + kMinShare);
+        }
+        if (m_bg_share != prev)
+            LOG_DEBUG("background share of remote reads ` -> `, foreground latency ` us", prev,
+                      m_bg_share, m_fg_latency);
+    }
+
+    QosOptions m_opts;
+    TokenBucket m_buckets[(int)IoClass::Count];
+    std::mutex m_mtx;
+    std::map<std::pair<double, uint64_t>, Waiter *> m_queue;
+    double m_vclock = 0, m_finish[(int)IoClass::Count] = {0};
+    uint64_t m_seq = 0;
+    uint32_t m_inflight = 0, m_bg_inflight = 0;
+    double m_bg_share = 1.0;
+    uint64_t m_fg_latency = 0, m_last_adjust = 0;
+};
+
+constexpr double QosScheduler::kWeights[];
+
+class QosFile : public ForwardFile_Ownership {
+public:
+    QosScheduler *m_sched;
+
+    QosFile(IFile *file, QosScheduler *sched) : ForwardFile_Ownership(file, true), m_sched(sched) {
+    }
+
+    template <typename F>
+    ssize_t scheduled(size_t count, F read) {
+        auto tag = current_tag();
+        m_sched->acquire(tag, count);
+        auto begin = photon::now;
+        auto ret = read();
+        m_sched->release(tag.cls, photon::now - begin);
+        return ret;
+    }
+
+    virtual ssize_t pread(void *buf, size_t cnt, off_t offset) override {
+        return scheduled(cnt, [&]() { return m_file->pread(buf, cnt, offset); });
+    }
+
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        return scheduled(iov_sum(iov, iovcnt),
+                         [&]() { return m_file->preadv(iov, iovcnt, offset); });
+    }
+
+    virtual ssize_t preadv2(const struct iovec *iov, int iovcnt, off_t offset,
+                            int flags) override {
+        return scheduled(iov_sum(iov, iovcnt),
+                         [&]() { return m_file->preadv2(iov, iovcnt, offset, flags); });
+    }
+
+    static size_t iov_sum(const struct iovec *iov, int iovcnt) {
+        size_t n = 0;
+        for (int i = 0; i < iovcnt; i++)
+            n += iov[i].iov_len;
+        return n;
+    }
+};
+
+class QosFS : public ForwardFS_Ownership {
+public:
+    QosScheduler m_sched;
+
+    QosFS(IFileSystem *fs, const QosOptions &opts, bool ownership)
+        : ForwardFS_Ownership(fs, ownership), m_sched(opts) {
+    }
+
+    virtual IFile *open(const char *fn, int flags) override {
+        auto file = m_fs->open(fn, flags);
+        if (!file)
+            return nullptr;
+        return new QosFile(file, &m_sched);
+    }
+
+    virtual IFile *open(const char *fn, int flags, mode_t mode) override {
+        auto file = m_fs->open(fn, flags, mode);
+        if (!file)
+            return nullptr;
+        return new QosFile(file, &m_sched);
+    }
+};
+
+IFileSystem *new_qos_fs(IFileSystem *fs, const QosOptions &opts, bool ownership) {
+    return new QosFS(fs, opts, ownership);
+}
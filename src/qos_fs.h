@@ -0,0 +1,83 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#pragma once
+
+#include <stdint.h>
+#include <mutex>
+#include <photon/fs/filesystem.h>
+
+// Classes of the reads reaching the remote fs, in priority order.
+enum class IoClass : int {
+    Foreground = 0,
+    Prefetch,
+    Download,
+    Count,
+};
+
+// A token bucket of `rate` bytes per second, 0 for unlimited. It is a
+// virtual clock of when the sent bytes are paid off, so a burst of one
+// second is allowed after an idle period.
+class TokenBucket {
+public:
+    explicit TokenBucket(uint64_t rate = 0) : m_rate(rate) {
+    }
+
+    void set_rate(uint64_t rate) {
+        m_rate = rate;
+    }
+
+    // takes `n` bytes at `share` of the rate, returns the microseconds to
+    // wait before sending them
+    uint64_t take(size_t n, double share = 1.0);
+
+private:
+    uint64_t m_rate;
+    uint64_t m_paid_until = 0;
+    std::mutex m_mtx;
+};
+
+// Tags the remote reads issued by the current photon thread with `cls`,
+// charging them to `image` too if given, for the lifetime of the scope.
+class QosScope {
+public:
+    explicit QosScope(IoClass cls, TokenBucket *image = nullptr);
+    ~QosScope();
+
+private:
+    IoClass m_prev_cls;
+    TokenBucket *m_prev_image;
+};
+
+// The class of the reads of the current photon thread.
+IoClass current_io_class();
+
+struct QosOptions {
+    // remote reads in flight; background ones get their share of it
+    uint32_t max_inflight = 32;
+    // bytes per second for prefetch and download, 0 for unlimited
+    uint64_t prefetch_rate = 0;
+    uint64_t download_rate = 0;
+    // background traffic backs off while the foreground latency is above it
+    uint64_t latency_target_us = 50 * 1000;
+};
+
+// Schedules the reads of `fs` by their class: weighted fair queuing among
+// the classes once `max_inflight` reads are running, token buckets for the
+// background classes, and AIMD backoff of the background share when the
+// foreground latency rises above the target.
+photon::fs::IFileSystem *new_qos_fs(photon::fs::IFileSystem *fs, const QosOptions &opts,
+                                    bool ownership = true);
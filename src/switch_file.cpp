@@ -19,8 +19,11 @@
 #include <photon/common/alog-audit.h>
 #include <photon/common/alog-stdstring.h>
 #include <photon/thread/thread.h>
+#include <photon/common/iovector.h>
 #include <photon/fs/filesystem.h>
+#include <photon/fs/forwardfs.h>
 #include <photon/fs/localfs.h>
+#include "overlaybd/cache/cache.h"
 #include "overlaybd/tar/tar_file.h"
 #include "overlaybd/zfile/zfile.h"
 
@@ -175,3 +178,75 @@ again:
     }
     return new SwitchFile(file, local, file_path);
 };
+
+bool LocalRanges::covers(off_t offset, size_t count) const {
+    if (block_size == 0 || count == 0)
+        return false;
+    uint64_t last = (offset + count - 1) / block_size;
+    if (last >= bitmap.size() * 8)
+        return false;
+    for (uint64_t i = offset / block_size; i <= last; i++) {
+        if (!(bitmap[i / 8] & (1 << (i % 8))))
+            return false;
+    }
+    return true;
+}
+
+class RangeSwitchFile : public ForwardFile_Ownership {
+public:
+    IFile *m_local_file = nullptr;
+    std::string m_filepath;
+    LocalRanges *m_ranges;
+
+    RangeSwitchFile(IFile *source, const char *filepath, LocalRanges *ranges)
+        : ForwardFile_Ownership(source, true), m_filepath(filepath), m_ranges(ranges) {
+    }
+
+    ~RangeSwitchFile() {
+        safe_delete(m_local_file);
+        delete m_ranges;
+    }
+
+    // the local file, opened when first read from
+    IFile *local_file() {
+        if (m_local_file == nullptr) {
+            m_local_file = open_localfile_adaptor(m_filepath.c_str(), O_RDONLY, 0644, 0);
+            if (m_local_file == nullptr)
+                LOG_ERRNO_RETURN(0, nullptr, "failed to open download file, path: `", m_filepath);
+        }
+        return m_local_file;
+    }
+
+    virtual ssize_t pread(void *buf, size_t count, off_t offset) override {
+        if (m_ranges->covers(offset, count) && local_file()) {
+            auto ret = m_local_file->pread(buf, count, offset);
+            if (ret == (ssize_t)count)
+                return ret;
+        }
+        return m_file->pread(buf, count, offset);
+    }
+
+    virtual ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override {
+        auto count = iovector_view((struct iovec *)iov, iovcnt).sum();
+        if (m_ranges->covers(offset, count) && local_file()) {
+            auto ret = m_local_file->preadv(iov, iovcnt, offset);
+            if (ret == (ssize_t)count)
+                return ret;
+        }
+        return m_file->preadv(iov, iovcnt, offset);
+    }
+
+    // the blocks downloaded are not verified until the whole layer is, so
+    // nothing read is to be trusted by the generation of the cache
+    virtual int vioctl(int request, va_list args) override {
+        if (request == IOCTL_GET_GENERATION) {
+            errno = ENOSYS;
+            return -1;
+        }
+        return m_file->vioctl(request, args);
+    }
+};
+
+IFile *new_range_switch_file(IFile *source, const char *filepath, LocalRanges *ranges) {
+    return new RangeSwitchFile(source, filepath, ranges);
+}
@@ -14,6 +14,8 @@
    limitations under the License.
 */
 #pragma once
+#include <cstdint>
+#include <vector>
 #include <photon/fs/filesystem.h>
 
 // switch to local file after background download finished, and audit for local file pread
@@ -26,3 +28,18 @@ public:
 extern "C" ISwitchFile *new_switch_file(photon::fs::IFile *source, bool local = false,
                                         const char *filepath = nullptr);
 
+
+// The blocks of a layer being downloaded that are written and synced, set by
+// the download, which the reads of the blob are served from locally.
+struct LocalRanges {
+    uint32_t block_size = 0;
+    std::vector<uint8_t> bitmap;
+
+    bool covers(off_t offset, size_t count) const;
+};
+
+// Serves the reads of the blob `source` that `ranges` cover from the local file
+// at `filepath`, and the rest from `source`, before the download switches the
+// whole layer. owns `source` and `ranges`.
+photon::fs::IFile *new_range_switch_file(photon::fs::IFile *source, const char *filepath,
+                                         LocalRanges *ranges);
@@ -0,0 +1,344 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// End-to-end benchmark of overlaybd images. Synthetic multi-layer images are
+// built in --work_dir, served by a local fake registry with --latency_us
+// added to every request, and opened through an ImageService with a file
+// cache, reporting:
+//   - cold start: opening the first image with an empty cache, plus its
+//     first read
+//   - warm start and memory: opening --images more images of the same
+//     layers, by ImageFile::memory_usage() and by the growth of RSS
+//   - random 4K IOPS of --threads readers for --duration_s seconds
+//   - sequential MB/s of a single reader over the whole image
+// The same seed builds the same layers, so runs are comparable.
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <gflags/gflags.h>
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/common/estring.h>
+#include <photon/fs/localfs.h>
+#include <photon/net/http/server.h>
+#include <photon/net/socket.h>
+#include <photon/photon.h>
+#include <photon/thread/thread11.h>
+#include "../image_file.h"
+#include "../image_service.h"
+#include "../overlaybd/lsmt/file.h"
+#include "../overlaybd/zfile/zfile.h"
+
+DEFINE_bool(ut_pass, false, "pass unit test directly. This suite is only for manual test");
+DEFINE_string(work_dir, "/tmp/overlaybd_perf", "where the layers, configs and cache are put");
+DEFINE_uint32(layers, 8, "# of layers of the image");
+DEFINE_uint64(image_size_mb, 1024, "virtual size of the image in MB");
+DEFINE_uint32(extents, 4096, "# of extents written in each layer, i.e. index fragmentation");
+DEFINE_uint32(extent_kb, 32, "size of each extent in KB");
+DEFINE_string(format, "zfile", "format of the layers, raw or zfile");
+DEFINE_uint32(seed, 1, "seed of the layer contents and of the random reads");
+DEFINE_uint32(port, 64280, "port of the fake registry");
+DEFINE_uint64(latency_us, 2000, "latency added to every request of the fake registry");
+DEFINE_uint32(images, 8, "# of images opened after the first one, for warm start and memory");
+DEFINE_uint32(threads, 32, "# of concurrent random readers");
+DEFINE_uint32(duration_s, 10, "duration of the random reads");
+
+using namespace photon::fs;
+using namespace photon::net::http;
+
+static double elapsed_s(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static size_t rss_bytes() {
+    size_t pages = 0, resident = 0;
+    auto f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+struct Blob {
+    std::string digest, path;
+    uint64_t size;
+};
+
+// text-like data, compressible by LZ4
+static void fill(std::vector<char> &buf, std::mt19937 &rng) {
+    static const char words[] = "overlaybd lsmt zfile registry layer block index cache ";
+    for (size_t i = 0; i < buf.size(); i++)
+        buf[i] = (rng() % 4) ? words[i % (sizeof(words) - 1)] : (char)rng();
+}
+
+static int build_layer(uint32_t i, std::mt19937 &rng, Blob &blob) {
+    auto dir = FLAGS_work_dir + "/layers";
+    auto base = estring().appends(dir, "/layer", i);
+    std::unique_ptr<IFile> fdata(open_localfile_adaptor((base + ".data").c_str(),
+                                                        O_RDWR | O_CREAT | O_TRUNC, 0644));
+    std::unique_ptr<IFile> findex(open_localfile_adaptor((base + ".index").c_str(),
+                                                         O_RDWR | O_CREAT | O_TRUNC, 0644));
+    if (!fdata || !findex)
+        LOG_ERRNO_RETURN(0, -1, "failed to create files of layer `", i);
+    LSMT::LayerInfo args(fdata.get(), findex.get());
+    args.virtual_size = FLAGS_image_size_mb << 20;
+    std::unique_ptr<LSMT::IFileRW> rw(LSMT::create_file_rw(args, false));
+    if (!rw)
+        LOG_ERRNO_RETURN(0, -1, "failed to create lsmt file of layer `", i);
+
+    std::vector<char> buf(FLAGS_extent_kb * 1024);
+    auto slots = args.virtual_size / buf.size();
+    for (uint32_t j = 0; j < FLAGS_extents; j++) {
+        fill(buf, rng);
+        auto offset = (rng() % slots) * buf.size();
+        if (rw->pwrite(buf.data(), buf.size(), offset) != (ssize_t)buf.size())
+            LOG_ERRNO_RETURN(0, -1, "failed to write layer `", i);
+    }
+
+    auto commit = base + ".commit";
+    {
+        std::unique_ptr<IFile> as(
+            open_localfile_adaptor(commit.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+        LSMT::CommitArgs cargs(as.get());
+        if (!as || rw->commit(cargs) != 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to commit layer `", i);
+    }
+    blob.path = commit;
+    if (FLAGS_format == "zfile") {
+        blob.path = base + ".zfile";
+        std::unique_ptr<IFile> src(open_localfile_adaptor(commit.c_str(), O_RDONLY));
+        std::unique_ptr<IFile> dst(
+            open_localfile_adaptor(blob.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+        ZFile::CompressOptions opt;
+        opt.verify = 1;
+        ZFile::CompressArgs zargs(opt);
+        if (!src || !dst || ZFile::zfile_compress(src.get(), dst.get(), &zargs) != 0)
+            LOG_ERRNO_RETURN(0, -1, "failed to compress layer `", i);
+    }
+    struct stat st;
+    if (::stat(blob.path.c_str(), &st) != 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to stat layer `", i);
+    blob.size = st.st_size;
+    char digest[80];
+    snprintf(digest, sizeof(digest), "sha256:%064x", i + FLAGS_seed * 1000);
+    blob.digest = digest;
+    return 0;
+}
+
+// serves GET /v2/<repository>/blobs/<digest> with ranges from the local layers
+class FakeRegistry : public HTTPHandler {
+public:
+    std::vector<Blob> *blobs;
+
+    explicit FakeRegistry(std::vector<Blob> *blobs) : blobs(blobs) {}
+
+    int handle_request(Request &req, Response &resp, std::string_view) override {
+        photon::thread_usleep(FLAGS_latency_us);
+        std::string target(req.target());
+        auto digest = target.substr(target.rfind('/') + 1);
+        const Blob *blob = nullptr;
+        for (auto &b : *blobs) {
+            if (b.digest == digest)
+                blob = &b;
+        }
+        if (!blob) {
+            resp.set_result(404);
+            resp.headers.content_length(0);
+            return 0;
+        }
+        uint64_t begin = 0, end = blob->size - 1;
+        std::string range(req.headers["Range"]);
+        bool ranged = sscanf(range.c_str(), "bytes=%lu-%lu", &begin, &end) >= 1;
+        end = std::min(end, blob->size - 1);
+        if (begin > end) {
+            resp.set_result(416);
+            resp.headers.content_length(0);
+            return 0;
+        }
+        std::vector<char> buf(end - begin + 1);
+        std::unique_ptr<IFile> file(open_localfile_adaptor(blob->path.c_str(), O_RDONLY));
+        if (!file || file->pread(buf.data(), buf.size(), begin) != (ssize_t)buf.size())
+            LOG_ERRNO_RETURN(0, -1, "failed to read `", blob->path);
+        resp.set_result(ranged ? 206 : 200);
+        if (ranged)
+            resp.headers.insert("Content-Range",
+                                estring().appends("bytes ", begin, "-", end, "/", blob->size));
+        resp.headers.content_length(buf.size());
+        resp.keep_alive(true);
+        return resp.write(buf.data(), buf.size()) == (ssize_t)buf.size() ? 0 : -1;
+    }
+};
+
+static int write_configs(const std::vector<Blob> &blobs) {
+    auto global = estring().appends(
+        "{\"enableAudit\":false,\"logPath\":\"\",\"logLevel\":2,",
+        "\"registryCacheDir\":\"", FLAGS_work_dir, "/cache\",\"registryCacheSizeGB\":32,",
+        "\"cacheConfig\":{\"cacheType\":\"file\",\"cacheDir\":\"", FLAGS_work_dir,
+        "/cache\",\"cacheSizeGB\":32}}");
+    std::string lowers;
+    for (size_t i = 0; i < blobs.size(); i++) {
+        auto dir = estring().appends(FLAGS_work_dir, "/layer_dirs/", i);
+        if (system(("mkdir -p " + dir).c_str()) != 0)
+            return -1;
+        lowers += estring().appends(i ? "," : "", "{\"dir\":\"", dir, "\",\"digest\":\"",
+                                    blobs[i].digest, "\",\"size\":", blobs[i].size, "}");
+    }
+    auto image = estring().appends("{\"repoBlobUrl\":\"http://127.0.0.1:", FLAGS_port,
+                                   "/v2/bench/blobs\",\"lowers\":[", lowers, "]}");
+    for (auto &x : {std::make_pair("/global.json", &global), std::make_pair("/image.json", &image)}) {
+        std::unique_ptr<IFile> f(open_localfile_adaptor((FLAGS_work_dir + x.first).c_str(),
+                                                        O_RDWR | O_CREAT | O_TRUNC, 0644));
+        if (!f || f->write(x.second->data(), x.second->size()) != (ssize_t)x.second->size())
+            LOG_ERRNO_RETURN(0, -1, "failed to write `", x.first);
+    }
+    return 0;
+}
+
+static void bench_random(ImageFile *file) {
+    uint64_t ops = 0, errors = 0;
+    auto deadline = photon::now + FLAGS_duration_s * 1000UL * 1000;
+    std::vector<photon::join_handle *> jhs;
+    for (uint32_t t = 0; t < FLAGS_threads; t++) {
+        jhs.push_back(photon::thread_enable_join(photon::thread_create11([&, t]() {
+            std::mt19937 rng(FLAGS_seed + t);
+            char buf[4096] __attribute__((aligned(4096)));
+            auto blocks = file->size / sizeof(buf);
+            while (photon::now < deadline) {
+                if (file->pread(buf, sizeof(buf), (rng() % blocks) * sizeof(buf)) ==
+                    (ssize_t)sizeof(buf))
+                    ops++;
+                else
+                    errors++;
+            }
+        })));
+    }
+    for (auto jh : jhs)
+        photon::thread_join(jh);
+    printf("random 4K: threads: %u, iops: %.0f, errors: %lu\n", FLAGS_threads,
+           (double)ops / FLAGS_duration_s, errors);
+}
+
+static void bench_sequential(ImageFile *file) {
+    std::vector<char> buf(1024 * 1024);
+    size_t total = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (off_t offset = 0; offset + (off_t)buf.size() <= (off_t)file->size;
+         offset += buf.size()) {
+        if (file->pread(buf.data(), buf.size(), offset) != (ssize_t)buf.size()) {
+            LOG_ERROR("sequential read failed at `", offset);
+            break;
+        }
+        total += buf.size();
+    }
+    auto t = elapsed_s(start);
+    printf("sequential 1M: %.1fMB/s\n", total / t / 1024 / 1024);
+}
+
+int main(int argc, char **argv) {
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+    log_output_level = ALOG_INFO;
+    if (FLAGS_ut_pass) {
+        LOG_INFO("pass unit test");
+        return 0;
+    }
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER(photon::fini());
+
+    if (system(("rm -rf " + FLAGS_work_dir + " && mkdir -p " + FLAGS_work_dir + "/layers " +
+                FLAGS_work_dir + "/cache").c_str()) != 0)
+        LOG_ERROR_RETURN(0, -1, "failed to prepare `", FLAGS_work_dir);
+
+    // builders and opening log too much in info level
+    log_output_level = ALOG_WARN;
+    std::mt19937 rng(FLAGS_seed);
+    std::vector<Blob> blobs(FLAGS_layers);
+    auto start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < FLAGS_layers; i++) {
+        if (build_layer(i, rng, blobs[i]) != 0)
+            return -1;
+    }
+    uint64_t blob_bytes = 0;
+    for (auto &b : blobs)
+        blob_bytes += b.size;
+    printf("layers: %u x %u extents of %uKB, format: %s, blobs: %.1fMB, built in %.1fs\n",
+           FLAGS_layers, FLAGS_extents, FLAGS_extent_kb, FLAGS_format.c_str(),
+           blob_bytes / 1024.0 / 1024, elapsed_s(start));
+    if (write_configs(blobs) != 0)
+        return -1;
+
+    FakeRegistry registry(&blobs);
+    auto tcpserver = photon::net::new_tcp_socket_server();
+    DEFER(delete tcpserver);
+    tcpserver->setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+    if (tcpserver->bind(FLAGS_port, photon::net::IPAddr("127.0.0.1")) < 0 ||
+        tcpserver->listen() < 0)
+        LOG_ERRNO_RETURN(0, -1, "failed to listen on port `", FLAGS_port);
+    auto httpserver = new_http_server();
+    DEFER(delete httpserver);
+    httpserver->add_handler(&registry, false, "/v2");
+    tcpserver->set_handler(httpserver->get_connection_handler());
+    tcpserver->start_loop();
+
+    auto imgservice = create_image_service((FLAGS_work_dir + "/global.json").c_str());
+    if (!imgservice)
+        LOG_ERROR_RETURN(0, -1, "failed to create image service");
+    DEFER(delete imgservice);
+    auto image_conf = FLAGS_work_dir + "/image.json";
+
+    start = std::chrono::steady_clock::now();
+    std::unique_ptr<ImageFile> file(imgservice->create_image_file(image_conf.c_str()));
+    if (!file)
+        LOG_ERROR_RETURN(0, -1, "failed to open image");
+    auto open_s = elapsed_s(start);
+    char first[4096];
+    file->pread(first, sizeof(first), 0);
+    printf("cold start: open %.3fs, first read %.3fs, registry latency %luus\n", open_s,
+           elapsed_s(start), FLAGS_latency_us);
+
+    auto rss = rss_bytes();
+    std::vector<std::unique_ptr<ImageFile>> more;
+    start = std::chrono::steady_clock::now();
+    for (uint32_t i = 0; i < FLAGS_images; i++) {
+        more.emplace_back(imgservice->create_image_file(image_conf.c_str()));
+        if (!more.back())
+            LOG_ERROR_RETURN(0, -1, "failed to open image");
+    }
+    if (FLAGS_images) {
+        auto open_s = elapsed_s(start) / FLAGS_images;
+        auto grown = rss_bytes();
+        grown = grown > rss ? grown - rss : 0;
+        auto usage = file->memory_usage();
+        printf("warm start: %.3fs per image, memory per image: %zuKB accounted (index %zuKB, "
+               "prefetch %zuKB), %zuKB of rss\n",
+               open_s, usage.total() / 1024, usage.index / 1024, usage.prefetch / 1024,
+               grown / FLAGS_images / 1024);
+    }
+    more.clear();
+
+    bench_random(file.get());
+    bench_sequential(file.get());
+    return 0;
+}
@@ -17,6 +17,7 @@
 #include <gtest/gtest.h>
 #include "photon/common/alog.h"
 #include "photon/thread/thread.h"
+#include "photon/thread/thread11.h"
 #include "photon/net/http/server.h"
 #include "photon/net/socket.h"
 #include "photon/photon.h"
@@ -26,8 +27,20 @@
 #include "photon/net/curl.h"
 
 #include <fcntl.h>
+#include <openssl/sha.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 
 #include "../image_service.cpp"
+#include "../overlaybd/cache/full_file_cache/cache_pool.h"
+#include "../bk_download.h"
+#include "../switch_file.h"
+#include "../tools/sha256file.h"
+#include <photon/fs/forwardfs.h>
+#include <photon/fs/localfs.h>
+#include <photon/net/http/client.h>
+#include <rapidjson/document.h>
 
 photon::net::ISocketServer *new_server(std::string ip, uint16_t port) {
     auto server = photon::net::new_tcp_socket_server();
@@ -112,6 +125,798 @@ TEST(ImageTest, enableMetrics) {
     delete is;
 }
 
+TEST(ImageTest, qosTokenBucket) {
+    TokenBucket unlimited;
+    EXPECT_EQ(unlimited.take(1UL << 30), 0UL);
+
+    // a second of idle credit, then paced at the rate
+    TokenBucket bucket(1024 * 1024);
+    EXPECT_EQ(bucket.take(1024 * 1024), 0UL);
+    EXPECT_GE(bucket.take(1024 * 1024), 990UL * 1000);
+    // half of the share takes twice as long
+    auto wait = bucket.take(1024 * 1024, 0.5);
+    EXPECT_GE(wait, 2900UL * 1000);
+}
+
+TEST(ImageTest, latencyHistogram) {
+    EXPECT_EQ(LatencyHistogram::bucket_of(0), 0);
+    EXPECT_EQ(LatencyHistogram::bucket_of(1), 0);
+    EXPECT_EQ(LatencyHistogram::bucket_of(5), 4); // (4, 6]
+    EXPECT_EQ(LatencyHistogram::bucket_of(1UL << 40), LatencyHistogram::BUCKETS - 1);
+
+    LatencyHistogram h;
+    for (int i = 0; i < 99; i++)
+        h.put(100);
+    h.put(10000);
+    EXPECT_EQ(h.count(), 100UL);
+    EXPECT_EQ(h.sum(), 99UL * 100 + 10000);
+    EXPECT_EQ(h.quantile(0.5), 128UL);
+    EXPECT_EQ(h.quantile(1), 12288UL);
+
+    auto text = h.render("lat", "type=\"t\"");
+    EXPECT_NE(text.find("lat_bucket{type=\"t\",le=\"96\"} 0\n"), std::string::npos);
+    EXPECT_NE(text.find("lat_bucket{type=\"t\",le=\"128\"} 99\n"), std::string::npos);
+    EXPECT_NE(text.find("lat_bucket{type=\"t\",le=\"+Inf\"} 100\n"), std::string::npos);
+    EXPECT_NE(text.find("lat_count{type=\"t\"} 100\n"), std::string::npos);
+}
+
+TEST(ImageTest, ioTrace) {
+    ASSERT_EQ(IOTrace::init(2, 2), 0);
+    DEFER(IOTrace::init(0));
+    for (int i = 0; i < 6; i++) {
+        auto t = IOTrace::begin("read", i * 4096, 4096);
+        EXPECT_EQ(t != nullptr, i % 2 == 0);
+        {
+            IOTrace::ScopeStage lsmt(IOTrace::LSMT);
+            IOTrace::ScopeStage cache(IOTrace::CACHE);
+            photon::thread_usleep(1000);
+        }
+        if (t) {
+            EXPECT_EQ(t->stage_calls[IOTrace::LSMT], 1U);
+            EXPECT_EQ(t->stage_calls[IOTrace::LAYER], 0U);
+            EXPECT_GE(t->stage_us[IOTrace::LSMT], t->stage_us[IOTrace::CACHE]);
+        }
+        IOTrace::end(t, 4096);
+        EXPECT_EQ(IOTrace::current(), nullptr);
+    }
+    // the last 2 of the 3 sampled requests
+    auto text = IOTrace::dump();
+    EXPECT_EQ(std::count(text.begin(), text.end(), '\n'), 2);
+    EXPECT_EQ(text.find("\"offset\":0,"), std::string::npos);
+    EXPECT_NE(text.find("\"offset\":8192,"), std::string::npos);
+    EXPECT_NE(text.find("\"offset\":16384,"), std::string::npos);
+}
+
+TEST(ImageTest, openTimeline) {
+    OpenTimeline timeline;
+    auto start = photon::now;
+    timeline.add("open", start, start + 3000);
+    timeline.add("config_parse", start - 1000, start);
+    {
+        OpenTimeline::Scope scope(&timeline, "layer0.");
+        OpenTimeline::add_current("credential", start + 1000);
+    }
+    // not in a scope
+    OpenTimeline::add_current("credential", start);
+    auto json = timeline.to_json();
+    EXPECT_EQ(json.find("{\"phases\":[{\"name\":\"config_parse\",\"startUs\":0,\"us\":1000},"
+                        "{\"name\":\"open\",\"startUs\":1000,\"us\":3000},"
+                        "{\"name\":\"layer0.credential\",\"startUs\":2000,"), 0UL);
+    EXPECT_EQ(std::count(json.begin(), json.end(), '{'), 4);
+
+    std::string path = "/tmp/overlaybd_open_timeline_test";
+    timeline.set_path(path);
+    ASSERT_EQ(timeline.save(), 0);
+    char buf[4096];
+    int fd = ::open(path.c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    auto n = ::read(fd, buf, sizeof(buf));
+    ::close(fd);
+    ::unlink(path.c_str());
+    EXPECT_EQ(std::string(buf, n > 0 ? n : 0), json);
+}
+
+TEST(ImageTest, layerSquash) {
+    LayerSquash squash("/tmp", 2, 2);
+    std::vector<ImageConfigNS::LayerConfig> lowers(1);
+    EXPECT_EQ(squash.key(lowers), "");
+    // squashed by the one of the 2nd open, once at a time
+    EXPECT_FALSE(squash.opened("chain"));
+    EXPECT_TRUE(squash.opened("chain"));
+    EXPECT_FALSE(squash.opened("chain"));
+    EXPECT_FALSE(squash.opened("chain"));
+    squash.cancel("chain");
+    EXPECT_FALSE(squash.opened("chain"));
+    EXPECT_TRUE(squash.opened("chain"));
+    EXPECT_EQ(squash.lookup("overlaybd_squash_test_none"), "");
+}
+
+// accepts a blob upload in chunks, as a registry does
+class FakeUpload : public photon::net::http::HTTPHandler {
+public:
+    std::string location, data, digest;
+
+    int handle_request(photon::net::http::Request &req, photon::net::http::Response &resp,
+                       std::string_view) override {
+        using photon::net::http::Verb;
+        std::string target(req.target());
+        resp.headers.content_length(0);
+        if (req.verb() == Verb::POST) {
+            resp.set_result(202);
+        } else if (req.verb() == Verb::PATCH) {
+            size_t n = req.headers.content_length();
+            std::string body(n, 0);
+            if (req.read(&body[0], n) != (ssize_t)n)
+                LOG_ERRNO_RETURN(0, -1, "failed to read upload chunk");
+            data += body;
+            resp.set_result(202);
+            resp.headers.insert("Range", "0-" + std::to_string(data.size() - 1));
+        } else if (req.verb() == Verb::PUT) {
+            auto pos = target.find("digest=");
+            if (pos != std::string::npos)
+                digest = target.substr(pos + 7);
+            resp.set_result(201);
+            resp.headers.insert("Docker-Content-Digest", digest);
+            return 0;
+        } else {
+            resp.set_result(405);
+            return 0;
+        }
+        resp.headers.insert("Location", location);
+        return 0;
+    }
+};
+
+TEST(ImageTest, streamUpload) {
+    FakeUpload registry;
+    registry.location = "http://127.0.0.1:64212/v2/test/blobs/uploads/1";
+    auto tcpserver = photon::net::new_tcp_socket_server();
+    DEFER(delete tcpserver);
+    tcpserver->setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+    ASSERT_EQ(tcpserver->bind(64212, photon::net::IPAddr("127.0.0.1")), 0);
+    ASSERT_EQ(tcpserver->listen(), 0);
+    auto httpserver = photon::net::http::new_http_server();
+    DEFER(delete httpserver);
+    httpserver->add_handler(&registry, false, "/v2");
+    tcpserver->set_handler(httpserver->get_connection_handler());
+    tcpserver->start_loop();
+
+    // writes spanning more chunks than are buffered while streaming
+    const size_t chunk = 4096;
+    std::string blob(chunk * 7 + 100, 0);
+    for (auto &c : blob)
+        c = rand() % 256;
+    std::string url = "http://127.0.0.1:64212/v2/test/blobs/uploads/", username, password;
+    std::unique_ptr<photon::fs::IFile> uploader(
+        new_registry_uploader(nullptr, url, username, password, 10UL * 1000 * 1000, chunk));
+    ASSERT_NE(uploader, nullptr);
+    ASSERT_EQ(uploader->write(&blob[0], chunk * 3 + 10), (ssize_t)(chunk * 3 + 10));
+    ASSERT_EQ(uploader->write(&blob[chunk * 3 + 10], 10), 10);
+    ASSERT_EQ(uploader->write(&blob[chunk * 3 + 20], blob.size() - chunk * 3 - 20),
+              (ssize_t)(blob.size() - chunk * 3 - 20));
+    ASSERT_EQ(uploader->fsync(), 0);
+    EXPECT_EQ(registry.data, blob);
+
+    unsigned char sha[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *)blob.data(), blob.size(), sha);
+    char hex[SHA256_DIGEST_LENGTH * 2 + 1];
+    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+        sprintf(hex + i * 2, "%02x", sha[i]);
+    EXPECT_EQ(registry.digest, std::string("sha256:") + hex);
+}
+
+TEST(ImageTest, gcUpperLayer) {
+    std::string data = "/tmp/overlaybd_gc_test.data", index = "/tmp/overlaybd_gc_test.index";
+    DEFER({
+        ::unlink(data.c_str());
+        ::unlink(index.c_str());
+    });
+    auto open_upper = [&](int flags) {
+        auto fdata = photon::fs::open_localfile_adaptor(data.c_str(), flags, 0644);
+        auto findex = photon::fs::open_localfile_adaptor(index.c_str(), flags, 0644);
+        return std::make_pair(fdata, findex);
+    };
+    auto files = open_upper(O_RDWR | O_CREAT | O_TRUNC);
+    LSMT::LayerInfo args(files.first, files.second);
+    args.virtual_size = 1 << 20;
+    std::unique_ptr<LSMT::IFileRW> file(LSMT::create_file_rw(args, true));
+    ASSERT_NE(file, nullptr);
+    char buf[4096];
+    for (int i = 0; i < 8; i++) {
+        memset(buf, 'a' + i, sizeof(buf));
+        ASSERT_EQ(file->pwrite(buf, sizeof(buf), 0), (ssize_t)sizeof(buf));
+    }
+    memset(buf, 'z', sizeof(buf));
+    ASSERT_EQ(file->pwrite(buf, sizeof(buf), 4096), (ssize_t)sizeof(buf));
+    // 7 of the 9 blocks are garbage
+    EXPECT_EQ(gc_upper_layer(file.get(), data, index, 80), 1);
+    ASSERT_EQ(gc_upper_layer(file.get(), data, index, 50), 0);
+    EXPECT_NE(::access((data + ".gc").c_str(), F_OK), 0);
+    EXPECT_NE(::access((index + ".gc").c_str(), F_OK), 0);
+    struct stat st;
+    ASSERT_EQ(::stat(data.c_str(), &st), 0);
+    EXPECT_EQ(st.st_size, 4096 * 3);
+
+    file.reset();
+    files = open_upper(O_RDWR);
+    file.reset(LSMT::open_file_rw(files.first, files.second, true));
+    ASSERT_NE(file, nullptr);
+    for (auto x : {std::make_pair(0, 'h'), std::make_pair(4096, 'z')}) {
+        ASSERT_EQ(file->pread(buf, sizeof(buf), x.first), (ssize_t)sizeof(buf));
+        EXPECT_EQ(buf[0], x.second);
+        EXPECT_EQ(buf[sizeof(buf) - 1], x.second);
+    }
+}
+
+TEST(ImageTest, ioRecord) {
+    const char *path = "/tmp/overlaybd_io_record_test";
+    auto recorder = IORecorder::create(path);
+    ASSERT_NE(recorder, nullptr);
+    // more than a batch, put at completion, out of submission order
+    const uint64_t n = 10000;
+    auto start = photon::now;
+    for (uint64_t i = 0; i < n; i++) {
+        auto op = i % 2 ? IORecord::READ : IORecord::WRITE;
+        recorder->put(op, i * 4096, 4096, start + (i ^ 1), i % 7 == 0);
+    }
+    // a discard of the whole device is longer than 4GB
+    recorder->put(IORecord::DISCARD, 0, 8UL << 30, start + n, false);
+    delete recorder;
+
+    std::vector<IORecord> records;
+    IORecordHeader header;
+    ASSERT_EQ(IORecorder::load(path, records, &header), 0);
+    EXPECT_NE(header.start_us, 0UL);
+    ASSERT_EQ(records.size(), n + 1);
+    // sorted by submission
+    auto base = records[0].time_us;
+    for (uint64_t i = 0; i < n; i++) {
+        auto &r = records[i];
+        auto k = i ^ 1;
+        EXPECT_EQ(r.time_us - base, i);
+        EXPECT_EQ(r.op, k % 2 ? IORecord::READ : IORecord::WRITE);
+        EXPECT_EQ(r.offset, k * 4096);
+        EXPECT_EQ(r.length, 4096UL);
+        EXPECT_EQ(r.failed, k % 7 == 0);
+    }
+    EXPECT_EQ(records[n].op, IORecord::DISCARD);
+    EXPECT_EQ(records[n].length, 8UL << 30);
+    unlink(path);
+}
+
+struct CountingResolver {
+    int count = 0;
+    bool fail = false;
+    int resolve(const std::string &remote_path, CredentialCache::Credential &cred) {
+        count++;
+        photon::thread_usleep(10 * 1000);
+        if (fail)
+            return -1;
+        cred = {"user", "pw" + std::to_string(count)};
+        return 0;
+    }
+};
+
+TEST(ImageTest, credentialCache) {
+    CountingResolver resolver;
+    CredentialCache cache({&resolver, &CountingResolver::resolve}, 10UL * 1000 * 1000);
+    const std::string key = "registry/repo/", path = "https://registry/v2/repo/blobs/x";
+    EXPECT_EQ(cache.get(key, path).second, "pw1");
+    EXPECT_EQ(cache.get(key, path).second, "pw1");
+    EXPECT_EQ(resolver.count, 1);
+
+    // a rejected credential is resolved again, once for the lookups sharing it
+    cache.invalidate(key);
+    cache.invalidate("registry/other/");
+    std::vector<photon::join_handle *> threads;
+    std::vector<std::string> passwords(4);
+    for (auto &pw : passwords) {
+        auto th = photon::thread_create11([&]() { pw = cache.get(key, path).second; });
+        threads.push_back(photon::thread_enable_join(th));
+    }
+    for (auto th : threads)
+        photon::thread_join(th);
+    for (auto &pw : passwords)
+        EXPECT_EQ(pw, "pw2");
+    EXPECT_EQ(resolver.count, 2);
+
+    // and not returned if it can't be
+    cache.invalidate(key);
+    resolver.fail = true;
+    EXPECT_EQ(cache.get(key, path).second, "");
+    resolver.fail = false;
+    EXPECT_EQ(cache.get(key, path).second, "pw4");
+}
+
+// counts the lines written through it
+class CountingLogOutput : public ILogOutput {
+public:
+    std::atomic<uint64_t> lines{0};
+    bool destructed = false;
+    void write(int, const char *begin, const char *end) override {
+        lines += std::count(begin, end, '\n');
+    }
+    int get_log_file_fd() override {
+        return -1;
+    }
+    uint64_t set_throttle(uint64_t t = -1) override {
+        return 0;
+    }
+    uint64_t get_throttle() override {
+        return 0;
+    }
+    void destruct() override {
+        destructed = true;
+    }
+};
+
+TEST(ImageTest, asyncAudit) {
+    const int nthreads = 4, n = 50;
+    auto base = AsyncAudit::rings();
+    const char line[] = "audit record\n";
+    CountingLogOutput counting;
+    auto output = AsyncAudit::new_async_log_output(&counting, 256);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++) {
+        threads.emplace_back([&]() {
+            for (int i = 0; i < n; i++)
+                output->write(ALOG_INFO, line, line + sizeof(line) - 1);
+        });
+    }
+    for (auto &th : threads)
+        th.join();
+    // the rings of the threads gone are kept for the threads to come
+    EXPECT_GE(AsyncAudit::rings(), base + 1);
+    output->destruct();
+    EXPECT_TRUE(counting.destructed);
+    EXPECT_EQ(counting.lines.load(), (uint64_t)nthreads * n);
+    EXPECT_EQ(AsyncAudit::rings(), base);
+}
+
+static Cache::FileCachePool *new_transfer_pool(const std::string &root) {
+    system(("rm -rf " + root + " && mkdir -p " + root).c_str());
+    auto pool = new Cache::FileCachePool(photon::fs::new_localfs_adaptor(root.c_str()), 1,
+                                         1000 * 1000, 128UL << 20, 1UL << 20);
+    pool->Init();
+    return pool;
+}
+
+// a request of the cache export at 127.0.0.1:64214, returns the status code
+static int cache_request(photon::net::http::Client *client, const std::string &path,
+                         const std::string &token, const char *file = nullptr, off_t offset = 0,
+                         size_t count = 0, std::string *body = nullptr) {
+    photon::net::http::Client::OperationOnStack<64 * 1024 - 1> op(
+        client, photon::net::http::Verb::GET, "http://127.0.0.1:64214/cache" + path);
+    std::string auth = "Bearer " + token;
+    if (!token.empty())
+        op.req.headers.insert("Authorization", auth);
+    if (file) {
+        op.req.headers.insert(CacheTransfer::kFileHeader, file);
+        op.req.headers.range(offset, offset + count - 1);
+    }
+    op.set_enable_proxy(false);
+    client->call(&op);
+    if (body) {
+        body->clear();
+        char buf[64 * 1024];
+        ssize_t ret;
+        while ((ret = op.resp.read(buf, sizeof(buf))) > 0)
+            body->append(buf, ret);
+    }
+    return op.status_code;
+}
+
+TEST(ImageTest, cacheTransfer) {
+    EXPECT_TRUE(CacheTransfer::valid_name("/sha256:abc"));
+    EXPECT_TRUE(CacheTransfer::valid_name("/dir/a..b"));
+    for (auto name : {"", "/", "a", "/../a", "/a/..", "/./a", "/a//b", "/a/", "/a\nb"})
+        EXPECT_FALSE(CacheTransfer::valid_name(name)) << name;
+
+    const size_t unit = 1UL << 20;
+    std::unique_ptr<Cache::FileCachePool> src(new_transfer_pool("/tmp/cache_transfer/src/"));
+    std::unique_ptr<Cache::FileCachePool> dst(new_transfer_pool("/tmp/cache_transfer/dst/"));
+    // units 0 and 2 of /a cached
+    std::string data(3 * unit, 0);
+    for (auto &c : data)
+        c = rand() % 256;
+    auto store = src->open("/a", O_RDWR | O_CREAT, 0644);
+    ASSERT_NE(store, nullptr);
+    store->set_actual_size(data.size());
+    ASSERT_EQ(store->queryRefillRange(0, data.size()).second, data.size());
+    ASSERT_EQ(store->pwrite(&data[0], unit, 0), (ssize_t)unit);
+    ASSERT_EQ(store->pwrite(&data[2 * unit], unit, 2 * unit), (ssize_t)unit);
+    store->release();
+    std::vector<std::string> names;
+    ASSERT_EQ(src->list_files(names), 0);
+    EXPECT_EQ(names, std::vector<std::string>{"/a"});
+
+    CacheTransfer::ExportHandler handler("secret");
+    handler.add("file", src.get(), unit);
+    auto tcpserver = photon::net::new_tcp_socket_server();
+    DEFER(delete tcpserver);
+    tcpserver->setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+    ASSERT_EQ(tcpserver->bind(64214, photon::net::IPAddr("127.0.0.1")), 0);
+    ASSERT_EQ(tcpserver->listen(), 0);
+    auto httpserver = photon::net::http::new_http_server();
+    DEFER(delete httpserver);
+    httpserver->add_handler(&handler, false, "/cache");
+    tcpserver->set_handler(httpserver->get_connection_handler());
+    tcpserver->start_loop();
+    auto client = photon::net::http::new_http_client();
+    DEFER(delete client);
+
+    // nothing without the token, nor files not listed by a manifest
+    EXPECT_EQ(cache_request(client, "/manifest?pool=file", ""), 401);
+    EXPECT_EQ(cache_request(client, "/manifest?pool=file", "secreT"), 401);
+    EXPECT_EQ(cache_request(client, "/data?pool=file", "secret", "/a", 0, unit), 404);
+    EXPECT_EQ(cache_request(client, "/data?pool=file", "secret", "/../a", 0, unit), 400);
+
+    std::string body;
+    ASSERT_EQ(cache_request(client, "/manifest?pool=file", "secret", nullptr, 0, 0, &body), 200);
+    rapidjson::Document doc;
+    doc.Parse(body.data(), body.size());
+    ASSERT_FALSE(doc.HasParseError());
+    EXPECT_EQ(doc["refillUnit"].GetUint64(), unit);
+    auto files = doc["files"].GetArray();
+    ASSERT_EQ(files.Size(), 1U);
+    EXPECT_STREQ(files[0]["name"].GetString(), "/a");
+    EXPECT_EQ(files[0]["size"].GetUint64(), data.size());
+    auto ranges = files[0]["ranges"].GetArray();
+    ASSERT_EQ(ranges.Size(), 2U);
+    EXPECT_EQ(ranges[0][0].GetUint64(), 0UL);
+    EXPECT_EQ(ranges[0][1].GetUint64(), unit);
+    EXPECT_EQ(ranges[1][0].GetUint64(), 2 * unit);
+    EXPECT_EQ(ranges[1][1].GetUint64(), unit);
+
+    EXPECT_EQ(cache_request(client, "/data?pool=file", "secret", "/a", 2 * unit, unit, &body),
+              206);
+    EXPECT_EQ(body, data.substr(2 * unit, unit));
+    // not cached, which would be refilled from the registry
+    EXPECT_EQ(cache_request(client, "/data?pool=file", "secret", "/a", unit, unit), 416);
+    EXPECT_EQ(cache_request(client, "/data?pool=file", "secret", "/b", 0, unit), 404);
+
+    // the cached ranges are loaded, and skipped once loaded
+    const std::string url = "http://127.0.0.1:64214/cache";
+    EXPECT_EQ(CacheTransfer::import(url, "file", dst.get(), unit, 2, "secreT"), -1);
+    EXPECT_EQ(CacheTransfer::import(url, "file", dst.get(), unit, 2, "secret"),
+              (ssize_t)(2 * unit));
+    EXPECT_EQ(CacheTransfer::import(url, "file", dst.get(), unit, 2, "secret"), 0);
+    store = dst->open("/a", O_RDONLY, 0);
+    ASSERT_NE(store, nullptr);
+    DEFER(store->release());
+    std::string got(3 * unit, 0);
+    EXPECT_EQ(store->pread(&got[0], unit, 0), (ssize_t)unit);
+    EXPECT_EQ(store->pread(&got[2 * unit], unit, 2 * unit), (ssize_t)unit);
+    EXPECT_EQ(got.substr(0, unit), data.substr(0, unit));
+    EXPECT_EQ(got.substr(2 * unit), data.substr(2 * unit));
+    EXPECT_EQ(store->queryRefillRange(unit, unit).second, unit);
+}
+
+// a blob read by the background download, counting the blocks read, and
+// failing those from `fail_from` on
+class CountedFile : public photon::fs::ForwardFile_Ownership {
+public:
+    uint64_t reads = 0;
+    off_t fail_from;
+
+    CountedFile(photon::fs::IFile *file, off_t fail_from = -1)
+        : ForwardFile_Ownership(file, true), fail_from(fail_from) {
+    }
+    ssize_t pread(void *buf, size_t count, off_t offset) override {
+        if (fail_from >= 0 && offset >= fail_from) {
+            errno = EIO;
+            return -1;
+        }
+        reads++;
+        return m_file->pread(buf, count, offset);
+    }
+};
+
+struct BkDownloadTest {
+    const uint32_t bs = 64 * 1024;
+    const uint64_t nblocks = 10;
+    const std::string blob = "/tmp/bk_download/blob";
+    const std::string dir = "/tmp/bk_download/layer";
+    const std::string dl_path = dir + "/" + BKDL::DOWNLOAD_TMP_NAME;
+    const std::string commit_path = dir + "/" + COMMIT_FILE_NAME;
+    // the last block is a partial one
+    const size_t size = nblocks * bs - 1000;
+    std::string data, digest;
+    int running = 1;
+    std::unique_ptr<ISwitchFile> sw;
+
+    BkDownloadTest() {
+        system("rm -rf /tmp/bk_download && mkdir -p /tmp/bk_download/layer");
+        data.resize(size);
+        for (auto &c : data)
+            c = rand() % 256;
+        std::unique_ptr<photon::fs::IFile> file(
+            photon::fs::open_localfile_adaptor(blob.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+        file->pwrite(data.data(), size, 0);
+        std::unique_ptr<SHA256Stream> hash(new_sha256_stream());
+        hash->update(data.data(), size);
+        digest = hash->sha256_checksum();
+        sw.reset(new_switch_file(photon::fs::open_localfile_adaptor(blob.c_str(), O_RDONLY), false,
+                                 blob.c_str()));
+    }
+
+    BKDL::BkDownload *new_download(CountedFile *&src, off_t fail_from = -1) {
+        src = new CountedFile(photon::fs::open_localfile_adaptor(blob.c_str(), O_RDONLY),
+                              fail_from);
+        return new BKDL::BkDownload(sw.get(), src, size, dir, digest, blob, running, 0, 3, bs);
+    }
+
+    std::string read_file(const std::string &path) {
+        std::unique_ptr<photon::fs::IFile> file(
+            photon::fs::open_localfile_adaptor(path.c_str(), O_RDONLY));
+        if (!file)
+            return {};
+        struct stat st;
+        file->fstat(&st);
+        std::string ret(st.st_size, 0);
+        file->pread(&ret[0], st.st_size, 0);
+        return ret;
+    }
+};
+
+TEST(ImageTest, bkDownloadResume) {
+    for (bool corrupt : {false, true}) {
+        BkDownloadTest t;
+        CountedFile *src;
+        // 4 blocks, then the registry fails
+        std::unique_ptr<BKDL::BkDownload> dl(t.new_download(src, 4 * t.bs));
+        EXPECT_FALSE(dl->download());
+        EXPECT_EQ(src->reads, 4U);
+
+        // the blocks written, the bitmap and the hash state of them are kept
+        auto tail = t.read_file(t.dl_path);
+        ASSERT_EQ(tail.size(), t.size + sizeof(BKDL::DownloadMeta) + 2);
+        BKDL::DownloadMeta meta;
+        memcpy(&meta, &tail[t.size], sizeof(meta));
+        EXPECT_EQ(meta.magic, BKDL::DOWNLOAD_META_MAGIC);
+        EXPECT_EQ(meta.file_size, t.size);
+        EXPECT_EQ(meta.nblocks, t.nblocks);
+        EXPECT_EQ(meta.block_size, t.bs);
+        EXPECT_EQ(meta.hashed, 4U);
+        EXPECT_GT(meta.hash_state_size, 0U);
+        EXPECT_EQ((uint8_t)tail[t.size + sizeof(meta)], 0x0f);
+        EXPECT_EQ((uint8_t)tail[t.size + sizeof(meta) + 1], 0);
+        EXPECT_EQ(tail.substr(0, 4 * t.bs), t.data.substr(0, 4 * t.bs));
+        if (corrupt) {
+            // the blocks hashed are not read back, so a wrong state fails the check
+            meta.hash_state[0] ^= 1;
+            std::unique_ptr<photon::fs::IFile> file(
+                photon::fs::open_localfile_adaptor(t.dl_path.c_str(), O_RDWR));
+            ASSERT_EQ(file->pwrite(&meta, sizeof(meta), t.size), (ssize_t)sizeof(meta));
+        }
+
+        // resumed by another process, fetching only the blocks left
+        dl.reset(t.new_download(src));
+        if (!corrupt) {
+            EXPECT_TRUE(dl->download());
+            EXPECT_EQ(src->reads, t.nblocks - 4);
+            EXPECT_EQ(t.read_file(t.commit_path), t.data);
+            EXPECT_NE(access(t.dl_path.c_str(), F_OK), 0);
+            continue;
+        }
+        EXPECT_FALSE(dl->download());
+        EXPECT_EQ(src->reads, t.nblocks - 4);
+        // the tail is cut before the verification
+        EXPECT_EQ(t.read_file(t.dl_path).size(), t.size);
+        EXPECT_NE(access(t.commit_path.c_str(), F_OK), 0);
+        // and the next try starts over
+        EXPECT_TRUE(dl->download());
+        EXPECT_EQ(src->reads, 2 * t.nblocks - 4);
+        EXPECT_EQ(t.read_file(t.commit_path), t.data);
+    }
+}
+
+TEST(ImageTest, bkDownloadOldVersion) {
+    BkDownloadTest t;
+    // a .download of an older version, without the tail: the blocks without
+    // holes are taken as written
+    {
+        std::unique_ptr<photon::fs::IFile> file(photon::fs::open_localfile_adaptor(
+            t.dl_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+        ASSERT_EQ(file->ftruncate(t.size), 0);
+        ASSERT_EQ(file->pwrite(t.data.data(), 4 * t.bs, 0), (ssize_t)(4 * t.bs));
+    }
+    CountedFile *src;
+    std::unique_ptr<BKDL::BkDownload> dl(t.new_download(src));
+    EXPECT_TRUE(dl->download());
+    EXPECT_EQ(src->reads, t.nblocks - 4);
+    EXPECT_EQ(t.read_file(t.commit_path), t.data);
+
+    // a complete one fails the verification if it's wrong, and is downloaded again
+    BkDownloadTest t2;
+    {
+        std::unique_ptr<photon::fs::IFile> file(photon::fs::open_localfile_adaptor(
+            t2.dl_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+        std::string wrong = t2.data;
+        wrong[t2.bs] ^= 1;
+        ASSERT_EQ(file->pwrite(wrong.data(), t2.size, 0), (ssize_t)t2.size);
+    }
+    dl.reset(t2.new_download(src));
+    EXPECT_FALSE(dl->download());
+    EXPECT_EQ(src->reads, 0U);
+    EXPECT_TRUE(dl->download());
+    EXPECT_EQ(src->reads, t2.nblocks);
+    EXPECT_EQ(t2.read_file(t2.commit_path), t2.data);
+}
+
+// a request of the runtime settings at localhost:9863/admin, returns the status code
+static int admin_request(photon::net::http::Client *client, photon::net::http::Verb verb,
+                         const std::string &query, const std::string &token) {
+    photon::net::http::Client::OperationOnStack<64 * 1024 - 1> op(
+        client, verb, "http://127.0.0.1:9863/admin" + query);
+    std::string auth = "Bearer " + token;
+    if (!token.empty())
+        op.req.headers.insert("Authorization", auth);
+    op.set_enable_proxy(false);
+    client->call(&op);
+    return op.status_code;
+}
+
+TEST(ImageTest, adminAuth) {
+    system("mkdir -p /tmp/overlaybd /var/log");
+    // neither a token nor an address, not served
+    system("echo \'{\"enableAudit\":false,\"logPath\":\"\",\"exporterConfig\":{\"enable\":true,"
+           "\"adminUriPrefix\":\"/admin\"}}\'>/tmp/overlaybd/config.json");
+    ImageService *is = create_image_service("/tmp/overlaybd/config.json");
+    ASSERT_NE(is, nullptr);
+    EXPECT_EQ(is->admin, nullptr);
+    delete is;
+
+    system("echo \'{\"enableAudit\":false,\"logPath\":\"\",\"exporterConfig\":{\"enable\":true,"
+           "\"adminUriPrefix\":\"/admin\",\"cacheToken\":\"secret\"}}\'>/tmp/overlaybd/config.json");
+    is = create_image_service("/tmp/overlaybd/config.json");
+    ASSERT_NE(is, nullptr);
+    DEFER(delete is);
+    ASSERT_NE(is->admin, nullptr);
+    auto client = photon::net::http::new_http_client();
+    DEFER(delete client);
+    using photon::net::http::Verb;
+    EXPECT_EQ(admin_request(client, Verb::GET, "", ""), 401);
+    EXPECT_EQ(admin_request(client, Verb::PUT, "?prefetchConcurrency=1", ""), 401);
+    EXPECT_EQ(admin_request(client, Verb::PUT, "?prefetchConcurrency=1", "secreT"), 401);
+    EXPECT_EQ(prefetch_get_max_concurrency(), 0);
+    EXPECT_EQ(admin_request(client, Verb::PUT, "?prefetchConcurrency=1", "secret"), 200);
+    EXPECT_EQ(prefetch_get_max_concurrency(), 1);
+    EXPECT_EQ(admin_request(client, Verb::PUT, "?prefetchConcurrency=0", "secret"), 200);
+    EXPECT_EQ(admin_request(client, Verb::GET, "", "secret"), 200);
+}
+
+// a request of the peer server at 127.0.0.1:64215, returns the status code
+static int peer_request(photon::net::http::Client *client, const std::string &token,
+                        const std::string &digest, off_t begin, off_t end,
+                        std::string *body = nullptr) {
+    photon::net::http::Client::OperationOnStack<64 * 1024 - 1> op(
+        client, photon::net::http::Verb::GET,
+        std::string("http://127.0.0.1:64215") + kPeerUriPrefix);
+    std::string auth = "Bearer " + token;
+    if (!token.empty())
+        op.req.headers.insert("Authorization", auth);
+    op.req.headers.insert(kPeerBlobHeader, digest);
+    op.req.headers.range(begin, end);
+    op.set_enable_proxy(false);
+    client->call(&op);
+    if (body) {
+        body->clear();
+        char buf[64 * 1024];
+        ssize_t ret;
+        while ((ret = op.resp.read(buf, sizeof(buf))) > 0)
+            body->append(buf, ret);
+    }
+    return op.status_code;
+}
+
+TEST(ImageTest, peerRing) {
+    const std::string digest = "sha256:" + std::string(64, 'a');
+    EXPECT_TRUE(PeerRing::valid_digest(digest));
+    for (auto d : {std::string(""), std::string("sha256:"), "sha256:" + std::string(63, 'a'),
+                   "sha256:" + std::string(65, 'a'), "sha256:" + std::string(64, 'A'),
+                   "sha512:" + std::string(64, 'a'), "sha256:" + std::string(63, 'a') + "/",
+                   "../256:" + std::string(64, 'a')})
+        EXPECT_FALSE(PeerRing::valid_digest(d)) << d;
+    EXPECT_EQ(PeerRing::blob_digest("/v2/library/ubuntu/blobs/" + digest), digest);
+
+    EXPECT_TRUE(PeerRing::authorized("Bearer secret", "secret"));
+    for (auto auth : {"", "secret", "Bearer ", "Bearer secreT", "Bearer secret ", "bearer secret"})
+        EXPECT_FALSE(PeerRing::authorized(auth, "secret")) << auth;
+    EXPECT_FALSE(PeerRing::authorized("Bearer ", ""));
+
+    // every node agrees on the owners, and owns a share of the blocks
+    std::vector<std::string> peers = {"10.0.0.1:19150", "10.0.0.2:19150", "10.0.0.3:19150"};
+    std::vector<PeerRing> rings;
+    for (auto &p : peers)
+        rings.emplace_back(p, peers);
+    std::map<std::string, int> owned;
+    for (uint64_t i = 0; i < 3000; i++) {
+        auto &owner = rings[0].owner(digest, i);
+        int n = 0;
+        for (auto &r : rings) {
+            EXPECT_EQ(r.owner(digest, i), owner);
+            n += r.owned(digest, i);
+        }
+        EXPECT_EQ(n, 1);
+        owned[owner]++;
+    }
+    ASSERT_EQ(owned.size(), peers.size());
+    for (auto &o : owned)
+        EXPECT_GT(o.second, 500) << o.first;
+
+    // a node leaving moves only the blocks it owned
+    std::vector<std::string> rest(peers.begin(), peers.begin() + 2);
+    PeerRing smaller(peers[0], rest);
+    for (uint64_t i = 0; i < 3000; i++) {
+        if (rings[0].owner(digest, i) != peers[2])
+            EXPECT_EQ(smaller.owner(digest, i), rings[0].owner(digest, i));
+    }
+    EXPECT_FALSE(PeerRing().owned(digest, 0));
+}
+
+TEST(ImageTest, peerServer) {
+    const size_t bs = 1UL << 20;
+    const std::string self = "127.0.0.1:64215";
+    std::vector<std::string> peers = {self, "10.0.0.2:19150"};
+    const std::string digest = "sha256:" + std::string(64, 'b');
+    PeerRing ring(self, peers);
+    // blocks of ours, one not cached, and one of the other peer
+    uint64_t mine = 0, uncached, theirs = 0;
+    while (!ring.owned(digest, mine))
+        mine++;
+    uncached = mine + 1;
+    while (!ring.owned(digest, uncached))
+        uncached++;
+    while (ring.owned(digest, theirs))
+        theirs++;
+
+    std::unique_ptr<Cache::FileCachePool> pool(new_transfer_pool("/tmp/peer_server/"));
+    auto size = (std::max(uncached, theirs) + 2) * bs;
+    std::string data(bs, 0);
+    for (auto &c : data)
+        c = rand() % 256;
+    auto store = pool->open("/" + digest, O_RDWR | O_CREAT, 0644);
+    ASSERT_NE(store, nullptr);
+    store->set_actual_size(size);
+    ASSERT_EQ(store->queryRefillRange(0, size).second, size);
+    ASSERT_EQ(store->pwrite(&data[0], bs, mine * bs), (ssize_t)bs);
+    ASSERT_EQ(store->pwrite(&data[0], bs, theirs * bs), (ssize_t)bs);
+    store->release();
+
+    PeerHandler handler(pool.get(), ring, bs, "secret");
+    auto tcpserver = photon::net::new_tcp_socket_server();
+    DEFER(delete tcpserver);
+    tcpserver->setsockopt(SOL_SOCKET, SO_REUSEPORT, 1);
+    ASSERT_EQ(tcpserver->bind(64215, photon::net::IPAddr("127.0.0.1")), 0);
+    ASSERT_EQ(tcpserver->listen(), 0);
+    auto httpserver = photon::net::http::new_http_server();
+    DEFER(delete httpserver);
+    httpserver->add_handler(&handler, false, kPeerUriPrefix);
+    tcpserver->set_handler(httpserver->get_connection_handler());
+    tcpserver->start_loop();
+    auto client = photon::net::http::new_http_client();
+    DEFER(delete client);
+
+    off_t begin = mine * bs, end = begin + bs - 1;
+    // nothing without the token
+    EXPECT_EQ(peer_request(client, "", digest, begin, end), 401);
+    EXPECT_EQ(peer_request(client, "secreT", digest, begin, end), 401);
+    // nor by a path, nor across blocks, nor blocks of other peers
+    EXPECT_EQ(peer_request(client, "secret", "../" + digest, begin, end), 400);
+    EXPECT_EQ(peer_request(client, "secret", digest, begin, end + 1), 421);
+    EXPECT_EQ(peer_request(client, "secret", digest, theirs * bs, theirs * bs + bs - 1), 421);
+    // nor blobs or blocks not cached here
+    EXPECT_EQ(peer_request(client, "secret", "sha256:" + std::string(64, 'c'), begin, end), 404);
+    EXPECT_EQ(peer_request(client, "secret", digest, uncached * bs, uncached * bs + bs - 1), 404);
+
+    std::string body;
+    ASSERT_EQ(peer_request(client, "secret", digest, begin, end, &body), 206);
+    EXPECT_EQ(body, data);
+    ASSERT_EQ(peer_request(client, "secret", digest, begin + 100, begin + 199, &body), 206);
+    EXPECT_EQ(body, data.substr(100, 100));
+}
+
 int main(int argc, char** argv) {
     photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
     DEFER(photon::fini(););
@@ -0,0 +1,202 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <fcntl.h>
+#include <string.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <vector>
+#include "photon/common/alog.h"
+#include "photon/common/utility.h"
+#include "photon/fs/localfs.h"
+#include "photon/photon.h"
+#include "../overlaybd/zfile/crc32/crc32c.h"
+#include "../prefetch.h"
+
+using TraceOp = Prefetcher::TraceOp;
+using Trace = std::vector<Prefetcher::TraceFormat>;
+
+TEST(PrefetchTest, planReplay) {
+    Trace records = {
+        {TraceOp::READ, 0, 100, 5000, 30},
+        // adjoins the one above once aligned
+        {TraceOp::READ, 0, 4096, 8192, 10},
+        {TraceOp::READ, 1, 10, 0, 20},
+        {TraceOp::WRITE, 0, 4096, 100000, 0},
+        {TraceOp::READ, 0, 0, 50000, 5},
+    };
+    auto plan = Prefetcher::plan_replay(records, 4096);
+    ASSERT_EQ(plan.size(), 2UL);
+    EXPECT_EQ(plan[0].layer_index, 0U);
+    EXPECT_EQ(plan[0].offset, 4096);
+    EXPECT_EQ(plan[0].count, 8192UL);
+    EXPECT_EQ(plan[0].time_us, 10UL);
+    EXPECT_EQ(plan[1].layer_index, 1U);
+    EXPECT_EQ(plan[1].offset, 0);
+    EXPECT_EQ(plan[1].count, 4096UL);
+    EXPECT_EQ(plan[1].time_us, 20UL);
+}
+
+TEST(PrefetchTest, planReplaySplit) {
+    const size_t MB = 1024 * 1024;
+    Trace records = {
+        {TraceOp::READ, 0, 3 * MB, 0, 50},
+        {TraceOp::READ, 0, 4096, 2 * MB + 100, 5},
+        // duplicated records collapse into the reads above
+        {TraceOp::READ, 0, 4096, 0, 60},
+    };
+    auto plan = Prefetcher::plan_replay(records, 4096);
+    ASSERT_EQ(plan.size(), 3UL);
+    // the last MB is needed first
+    EXPECT_EQ(plan[0].offset, (off_t)(2 * MB));
+    EXPECT_EQ(plan[0].time_us, 5UL);
+    EXPECT_EQ(plan[1].offset, 0);
+    EXPECT_EQ(plan[1].time_us, 50UL);
+    EXPECT_EQ(plan[2].offset, (off_t)MB);
+    EXPECT_EQ(plan[2].time_us, 50UL);
+    for (auto &r : plan) {
+        EXPECT_EQ(r.count, MB);
+    }
+}
+
+static IFile *create_trace(const char *fn) {
+    return open_localfile_adaptor(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+TEST(PrefetchTest, loadTrace) {
+    Trace records = {
+        {TraceOp::READ, 0, 4096, 0, 100},
+        {TraceOp::WRITE, 2, 512, 8192, 200},
+    };
+    std::unique_ptr<IFile> file(create_trace("/tmp/prefetch_test_v2.trace"));
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(Prefetcher::save_trace(file.get(), records), 0);
+    Trace loaded;
+    uint32_t magic = 0;
+    ASSERT_EQ(Prefetcher::load_trace(file.get(), loaded, 0, &magic), 0);
+    EXPECT_EQ(magic, Prefetcher::TRACE_MAGIC_V2);
+    ASSERT_EQ(loaded.size(), records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        EXPECT_EQ(loaded[i].op, records[i].op);
+        EXPECT_EQ(loaded[i].layer_index, records[i].layer_index);
+        EXPECT_EQ(loaded[i].count, records[i].count);
+        EXPECT_EQ(loaded[i].offset, records[i].offset);
+        EXPECT_EQ(loaded[i].time_us, records[i].time_us);
+    }
+
+    // a corrupted record fails the checksum
+    char c = 'W';
+    ASSERT_EQ(file->pwrite(&c, 1, sizeof(Prefetcher::TraceHeader)), 1);
+    EXPECT_NE(Prefetcher::load_trace(file.get(), loaded), 0);
+}
+
+TEST(PrefetchTest, loadTraceV1) {
+    // v1 records are the fields before `time_us`
+    Trace records = {
+        {TraceOp::READ, 1, 4096, 4096, 0},
+        {TraceOp::READ, 0, 8192, 0, 0},
+        {TraceOp::READ, 3, 100, 65536, 0},
+    };
+    std::vector<char> data;
+    for (auto &r : records) {
+        auto p = (const char *)&r;
+        data.insert(data.end(), p, p + Prefetcher::TRACE_FORMAT_V1_SIZE);
+    }
+    Prefetcher::TraceHeader hdr;
+    hdr.magic = Prefetcher::TRACE_MAGIC;
+    hdr.data_size = data.size();
+    hdr.checksum = crc32::crc32c_extend(data.data(), data.size(), 0);
+    std::unique_ptr<IFile> file(create_trace("/tmp/prefetch_test_v1.trace"));
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(file->pwrite(&hdr, sizeof(hdr), 0), (ssize_t)sizeof(hdr));
+    ASSERT_EQ(file->pwrite(data.data(), data.size(), sizeof(hdr)), (ssize_t)data.size());
+
+    Trace loaded;
+    uint32_t magic = 0;
+    ASSERT_EQ(Prefetcher::load_trace(file.get(), loaded, 0, &magic), 0);
+    EXPECT_EQ(magic, Prefetcher::TRACE_MAGIC);
+    ASSERT_EQ(loaded.size(), records.size());
+    for (size_t i = 0; i < records.size(); i++) {
+        EXPECT_EQ(loaded[i].layer_index, records[i].layer_index);
+        EXPECT_EQ(loaded[i].count, records[i].count);
+        EXPECT_EQ(loaded[i].offset, records[i].offset);
+        // taken as accessed in the order recorded
+        EXPECT_EQ(loaded[i].time_us, i);
+    }
+}
+
+TEST(PrefetchTest, saveProfile) {
+    std::vector<Trace> traces = {
+        {{TraceOp::READ, 0, 4096, 0, 10}, {TraceOp::READ, 0, 4096, 4096, 20}},
+        {{TraceOp::READ, 0, 4096, 0, 30}, {TraceOp::READ, 0, 4096, 4096, 40}},
+        {{TraceOp::READ, 0, 4096, 0, 50}, {TraceOp::READ, 1, 4096, 0, 5},
+         {TraceOp::WRITE, 0, 4096, 4096, 1}},
+    };
+    std::unique_ptr<IFile> file(create_trace("/tmp/prefetch_test.profile"));
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(Prefetcher::save_profile(file.get(), traces, 4096), 0);
+
+    // all the ranges, which are the blocks read by as many runs
+    Trace loaded;
+    uint32_t magic = 0;
+    ASSERT_EQ(Prefetcher::load_trace(file.get(), loaded, 0, &magic), 0);
+    EXPECT_EQ(magic, Prefetcher::PROFILE_MAGIC);
+    ASSERT_EQ(loaded.size(), 3UL);
+    EXPECT_EQ(loaded[0].layer_index, 0U);
+    EXPECT_EQ(loaded[0].offset, 0);
+    EXPECT_EQ(loaded[0].count, 4096UL);
+    EXPECT_EQ(loaded[0].time_us, 30UL);
+    EXPECT_EQ(loaded[1].layer_index, 0U);
+    EXPECT_EQ(loaded[1].offset, 4096);
+    EXPECT_EQ(loaded[1].time_us, 40UL);
+    EXPECT_EQ(loaded[2].layer_index, 1U);
+    EXPECT_EQ(loaded[2].time_us, 5UL);
+    for (auto &r : loaded) {
+        EXPECT_EQ(r.op, TraceOp::READ);
+    }
+
+    // those read by half of the runs at least
+    ASSERT_EQ(Prefetcher::load_trace(file.get(), loaded, 50), 0);
+    EXPECT_EQ(loaded.size(), 2UL);
+    ASSERT_EQ(Prefetcher::load_trace(file.get(), loaded, 100), 0);
+    ASSERT_EQ(loaded.size(), 1UL);
+    EXPECT_EQ(loaded[0].offset, 0);
+}
+
+TEST(PrefetchTest, saveProfileMerge) {
+    // adjoining blocks read by as many runs make a single range
+    std::vector<Trace> traces = {
+        {{TraceOp::READ, 0, 3 * 4096, 0, 10}},
+        {{TraceOp::READ, 0, 4096, 8192, 20}, {TraceOp::READ, 0, 8192, 0, 30}},
+    };
+    std::unique_ptr<IFile> file(create_trace("/tmp/prefetch_test_merge.profile"));
+    ASSERT_NE(file, nullptr);
+    ASSERT_EQ(Prefetcher::save_profile(file.get(), traces, 4096), 0);
+    Trace loaded;
+    ASSERT_EQ(Prefetcher::load_trace(file.get(), loaded), 0);
+    ASSERT_EQ(loaded.size(), 1UL);
+    EXPECT_EQ(loaded[0].offset, 0);
+    EXPECT_EQ(loaded[0].count, 3 * 4096UL);
+    EXPECT_EQ(loaded[0].time_us, 20UL);
+}
+
+int main(int argc, char **argv) {
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER(photon::fini(););
+    ::testing::InitGoogleTest(&argc, argv);
+    auto ret = RUN_ALL_TESTS();
+    return ret;
+}
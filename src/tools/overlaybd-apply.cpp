@@ -19,7 +19,9 @@
 #include <photon/fs/subfs.h>
 #include <photon/fs/virtual-file.h>
 #include <photon/fs/extfs/extfs.h>
+#include <photon/fs/fiemap.h>
 #include <photon/photon.h>
+#include <photon/thread/thread.h>
 #include "../overlaybd/lsmt/file.h"
 #include "../overlaybd/zfile/zfile.h"
 #include "../overlaybd/tar/libtar.h"
@@ -28,15 +30,23 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <atomic>
+#include <deque>
+#include <fstream>
 #include <memory>
+#include <sstream>
 #include <string>
+#include <thread>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include "../image_service.h"
 #include "../image_file.h"
+#include "../prefetch.h"
 #include "CLI11.hpp"
 #include "comm_func.h"
 #include "sha256file.h"
@@ -78,10 +88,371 @@ public:
     UNIMPLEMENTED(ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override);
 };
 
+// reads the hot ranges of the uncompressed layer, one "offset length" a line
+static int load_hot_ranges(const std::string &path, std::vector<GzHotRange> &ranges) {
+    auto fp = fopen(path.c_str(), "r");
+    if (fp == nullptr) {
+        LOG_ERRNO_RETURN(0, -1, "failed to open hot ranges `", path);
+    }
+    DEFER(fclose(fp));
+    unsigned long long offset, length;
+    while (fscanf(fp, "%llu %llu", &offset, &length) == 2) {
+        ranges.push_back({(off_t)offset, (size_t)length});
+    }
+    if (!feof(fp)) {
+        LOG_ERROR_RETURN(EINVAL, -1, "invalid hot ranges `, after ` lines", path, ranges.size());
+    }
+    return 0;
+}
+
+static const uint64_t kSector = 512; // unit of the LSMT index
+
+// resolves the files listed in `list_path`, one path a line, to the ranges of
+// the layers they are stored in, through the extents of the files in `fs` and
+// the LSMT index of `base`, and saves them as a trace to replay in the order
+// listed. The layer being applied is relocated by commit, so only the data
+// in the lower layers is resolved.
+static int save_prefetch_list(IFileSystem *fs, IFile *base, const std::string &list_path,
+                              const std::string &trace_path) {
+    auto fp = fopen(list_path.c_str(), "r");
+    if (fp == nullptr) {
+        LOG_ERRNO_RETURN(0, -1, "failed to open prefetch list `", list_path);
+    }
+    DEFER(fclose(fp));
+    auto lsmt = (LSMT::IFileRO *)base;
+    auto rw_tag = lsmt->get_lower_files().size() - 1;
+    auto index = lsmt->index();
+
+    std::vector<Prefetcher::TraceFormat> records;
+    size_t nfiles = 0, skipped = 0;
+    char line[PATH_MAX + 2];
+    while (fgets(line, sizeof(line), fp)) {
+        std::string path(line, strcspn(line, "\r\n"));
+        if (path.empty())
+            continue;
+        std::unique_ptr<IFile> file(fs->open(path.c_str(), O_RDONLY));
+        if (!file) {
+            LOG_WARN("prefetch file ` not found", path);
+            continue;
+        }
+        struct stat st;
+        if (file->fstat(&st) != 0) {
+            LOG_ERRNO_RETURN(0, -1, "failed to stat `", path);
+        }
+        if (!S_ISREG(st.st_mode)) {
+            LOG_WARN("prefetch file ` is not a regular file", path);
+            continue;
+        }
+        // ordered as listed
+        uint64_t time = nfiles++;
+        auto on_data = [&](const LSMT::SegmentMapping &m) {
+            if (m.tag >= rw_tag) {
+                skipped += m.length * kSector;
+            } else {
+                records.push_back({Prefetcher::TraceOp::READ, m.tag,
+                                   m.length * kSector,
+                                   (off_t)(m.moffset * kSector), time});
+            }
+            return 0;
+        };
+        uint64_t offset = 0, size = st.st_size;
+        while (offset < size) {
+            struct fiemap_t<256> fie(offset, size - offset);
+            fie.fm_mapped_extents = 0;
+            if (file->fiemap(&fie) != 0) {
+                LOG_ERRNO_RETURN(0, -1, "fiemap of ` failed", path);
+            }
+            if (fie.fm_mapped_extents == 0) {
+                break;
+            }
+            auto last = false;
+            auto prev = offset;
+            for (uint32_t i = 0; i < fie.fm_mapped_extents; i++) {
+                auto &extent = fie.fm_extents[i];
+                last = extent.fe_flags & FIEMAP_EXTENT_LAST;
+                offset = extent.fe_logical_end();
+                if (extent.fe_flags & (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_UNWRITTEN))
+                    continue;
+                auto begin = extent.fe_physical / kSector;
+                auto end = (extent.fe_physical + extent.fe_length + kSector - 1) /
+                           kSector;
+                while (begin < end) {
+                    LSMT::Segment s{begin, (uint32_t)std::min(end - begin,
+                                                              (uint64_t)LSMT::Segment::MAX_LENGTH)};
+                    LSMT::foreach_segments(
+                        index, s, [](const LSMT::Segment &) { return 0; }, on_data);
+                    begin = s.end();
+                }
+            }
+            if (last || offset <= prev) {
+                break;
+            }
+        }
+    }
+
+    auto out = open_file(trace_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (out == nullptr) {
+        LOG_ERRNO_RETURN(0, -1, "failed to create prefetch trace `", trace_path);
+    }
+    DEFER(delete out);
+    if (Prefetcher::save_trace(out, records) != 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to save prefetch trace `", trace_path);
+    }
+    if (skipped) {
+        LOG_WARN("` bytes of the listed files are in the layer being applied, not resolved",
+                 skipped);
+    }
+    LOG_INFO("resolved ` files to ` ranges in `", nfiles, records.size(), trace_path);
+    return 0;
+}
+
+// Reads a layer, inflating it if it's gzip'ed, on a thread of its own into a
+// bounded queue of chunks, so that a layer is decompressed while the previous
+// one is being extracted, and while its own entries are being written. It's
+// a stream, only skipping forward is supported.
+class LayerStream : public VirtualReadOnlyFile {
+public:
+    static const size_t CHUNK = 1024 * 1024;
+
+    LayerStream(const std::string &path, size_t depth)
+        : m_depth(depth ? depth : 1), m_slots(m_depth) {
+        m_thread = std::thread(&LayerStream::produce, this, path);
+    }
+    ~LayerStream() {
+        m_stop = true;
+        m_slots.signal(m_depth);
+        m_thread.join();
+    }
+
+    // the producer runs on a vcpu of its own, it's waited for by photon
+    // semaphores so that the vcpu of the reader keeps serving its threads
+    ssize_t read(void *buf, size_t count) override {
+        size_t done = 0;
+        while (done < count) {
+            if (m_front_pos == m_front.size()) {
+                m_chunks.wait(1);
+                photon::scoped_lock lock(m_mtx);
+                if (m_queue.empty()) {
+                    // at the end, left for the reads after this one
+                    m_chunks.signal(1);
+                    break;
+                }
+                m_front = std::move(m_queue.front());
+                m_queue.pop_front();
+                m_front_pos = 0;
+                m_slots.signal(1);
+            }
+            auto n = std::min(count - done, m_front.size() - m_front_pos);
+            if (buf)
+                memcpy((char *)buf + done, m_front.data() + m_front_pos, n);
+            done += n;
+            m_front_pos += n;
+        }
+        m_pos += done;
+        if (done == 0 && m_eno) {
+            LOG_ERROR_RETURN(m_eno, -1, "failed to read layer");
+        }
+        return done;
+    }
+
+    off_t lseek(off_t offset, int whence) override {
+        if (whence != SEEK_CUR || offset < 0) {
+            LOG_ERROR_RETURN(ESPIPE, -1, "layer stream only skips forward");
+        }
+        if (offset > 0 && read(nullptr, offset) != offset) {
+            LOG_ERROR_RETURN(EIO, -1, "failed to skip ` bytes of layer", offset);
+        }
+        return m_pos;
+    }
+
+    int fstat(struct stat *buf) override {
+        memset(buf, 0, sizeof(*buf));
+        buf->st_mode = S_IFIFO | 0444;
+        return 0;
+    }
+
+    UNIMPLEMENTED_POINTER(IFileSystem *filesystem() override);
+    UNIMPLEMENTED(ssize_t readv(const struct iovec *iov, int iovcnt) override);
+    UNIMPLEMENTED(ssize_t preadv(const struct iovec *iov, int iovcnt, off_t offset) override);
+
+private:
+    size_t m_depth;
+    std::thread m_thread;
+    photon::mutex m_mtx;
+    // free slots of the queue, and chunks queued or the end of the layer
+    photon::semaphore m_slots, m_chunks{0};
+    std::deque<std::vector<char>> m_queue;
+    std::vector<char> m_front;
+    size_t m_front_pos = 0;
+    off_t m_pos = 0;
+    std::atomic<bool> m_stop{false};
+    int m_eno = 0;
+
+    void produce(std::string path) {
+        photon::init(photon::INIT_EVENT_EPOLL, photon::INIT_IO_NONE);
+        DEFER(photon::fini());
+        int eno = 0;
+        if (stream(path) < 0) {
+            eno = errno ? errno : EIO;
+        }
+        photon::scoped_lock lock(m_mtx);
+        m_eno = eno;
+        m_chunks.signal(1);
+    }
+
+    int stream(const std::string &path) {
+        std::unique_ptr<IFile> file(open_localfile_adaptor(path.c_str(), O_RDONLY, 0644, 0));
+        if (!file) {
+            LOG_ERRNO_RETURN(0, -1, "failed to open layer `", path);
+        }
+        struct stat st;
+        if (file->fstat(&st) == 0 && !S_ISFIFO(st.st_mode) && is_gzfile(file.get())) {
+            file.reset(open_gzfile_adaptor(path.c_str()));
+            if (!file) {
+                LOG_ERRNO_RETURN(0, -1, "failed to open gzip layer `", path);
+            }
+        }
+        while (true) {
+            std::vector<char> chunk(CHUNK);
+            auto n = file->read(chunk.data(), chunk.size());
+            if (n < 0) {
+                LOG_ERRNO_RETURN(0, -1, "failed to read layer `", path);
+            }
+            if (n == 0) {
+                return 0;
+            }
+            chunk.resize(n);
+            m_slots.wait(1);
+            if (m_stop) {
+                return 0;
+            }
+            photon::scoped_lock lock(m_mtx);
+            m_queue.push_back(std::move(chunk));
+            m_chunks.signal(1);
+        }
+    }
+};
+
+// commits the upper layer of an image config into `commit_file`, as a plain
+// LSMT layer keeping the UUIDs of the upper, as overlaybd-commit with `--uuid`
+static int commit_upper(const std::string &image_config_path, const std::string &commit_file) {
+    ImageConfigNS::ImageConfig cfg;
+    if (!cfg.ParseJSON(image_config_path)) {
+        LOG_ERROR_RETURN(EINVAL, -1, "failed to parse image config `", image_config_path);
+    }
+    auto data = cfg.upper().data(), index = cfg.upper().index();
+    if (data.empty() || index.empty()) {
+        LOG_ERROR_RETURN(EINVAL, -1, "no upper layer in image config `", image_config_path);
+    }
+    auto fdata = open_file(data.c_str(), O_RDWR);
+    auto findex = open_file(index.c_str(), O_RDONLY);
+    std::unique_ptr<LSMT::IFileRW> fin(LSMT::open_file_rw(fdata, findex, true));
+    if (!fin) {
+        LOG_ERRNO_RETURN(0, -1, "failed to open upper layer `", data);
+    }
+    std::unique_ptr<IFile> fout(open_file(commit_file.c_str(), O_RDWR | O_CREAT | O_TRUNC,
+                                          S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+    LSMT::CommitArgs args(fout.get());
+    UUID uu;
+    if (fin->get_uuid(uu) == 0 && !uu.is_null()) {
+        args.uuid = uu;
+    }
+    // a sparse layer is copied by copy_file_range(2) with them
+    args.data_fd = ::open(data.c_str(), O_RDONLY | O_CLOEXEC);
+    args.as_fd = ::open(commit_file.c_str(), O_WRONLY | O_CLOEXEC);
+    DEFER({
+        if (args.data_fd >= 0)
+            ::close(args.data_fd);
+        if (args.as_fd >= 0)
+            ::close(args.as_fd);
+    });
+    if (fin->commit(args) < 0 || fout->close() < 0) {
+        LOG_ERRNO_RETURN(0, -1, "failed to commit upper layer of ` as `", image_config_path,
+                         commit_file);
+    }
+    return 0;
+}
+
+struct BatchLayer {
+    std::string input_path, image_config_path, commit_file;
+};
+
+// applies the layers of `batch_path`, one "input_path image_config_path
+// [commit_file]" a line, in order in one process. The image service lives
+// through the batch, so that the lower layers opened again for the next
+// layer share the indexes already loaded, and the merged index of the chain
+// only merges the layer committed last. Each layer is decompressed ahead while
+// the previous one is extracted, by up to `buffer_mb` of the tar stream, and
+// is committed as it finishes if its commit_file is given.
+static int apply_batch(const std::string &config_path, const std::string &batch_path, bool mkfs,
+                       size_t buffer_mb) {
+    std::vector<BatchLayer> layers;
+    std::ifstream in(batch_path);
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream ss(line);
+        BatchLayer l;
+        if (!(ss >> l.input_path) || l.input_path[0] == '#')
+            continue;
+        if (!(ss >> l.image_config_path)) {
+            LOG_ERROR_RETURN(EINVAL, -1, "no image config of layer ` in batch `", l.input_path,
+                             batch_path);
+        }
+        ss >> l.commit_file;
+        layers.push_back(l);
+    }
+    if (layers.empty()) {
+        LOG_ERROR_RETURN(EINVAL, -1, "no layers in batch `", batch_path);
+    }
+
+    std::unique_ptr<ImageService> imgservice(create_image_service(config_path.c_str()));
+    if (!imgservice) {
+        LOG_ERROR_RETURN(0, -1, "failed to create image service");
+    }
+    auto depth = (buffer_mb << 20) / LayerStream::CHUNK;
+    std::unique_ptr<LayerStream> next(new LayerStream(layers[0].input_path, depth));
+    for (size_t i = 0; i < layers.size(); i++) {
+        auto &l = layers[i];
+        std::unique_ptr<LayerStream> stream(std::move(next));
+        if (i + 1 < layers.size()) {
+            next.reset(new LayerStream(layers[i + 1].input_path, depth));
+        }
+        auto start = photon::now;
+        std::unique_ptr<IFile> imgfile(imgservice->create_image_file(l.image_config_path.c_str()));
+        if (!imgfile) {
+            LOG_ERROR_RETURN(0, -1, "failed to create image file of `", l.image_config_path);
+        }
+        {
+            std::unique_ptr<IFileSystem> target(
+                create_ext4fs(imgfile.get(), mkfs && i == 0, true, "/"));
+            auto base_file = ((ImageFile *)imgfile.get())->get_base();
+            UnTar tar(stream.get(), target.get(), 0, 4096, base_file, false);
+            if (tar.extract_all() < 0) {
+                LOG_ERROR_RETURN(0, -1, "failed to extract layer `", l.input_path);
+            }
+        }
+        imgfile.reset();
+        if (!l.commit_file.empty() && commit_upper(l.image_config_path, l.commit_file) != 0) {
+            return -1;
+        }
+        LOG_INFO("layer ` of ` (`) applied in ` ms", i + 1, layers.size(), l.input_path,
+                 (photon::now - start) / 1000);
+        fprintf(stdout, "applied %s\n", l.input_path.c_str());
+    }
+    return 0;
+}
+
 int main(int argc, char **argv) {
     std::string image_config_path, input_path, gz_index_path, config_path, sha256_checksum;
+    std::string gz_hot_ranges;
+    uint32_t gz_hot_span_kb = 128;
+    int gz_index_threads = 1;
+    std::string gz_dict_compress = "zlib";
     string tarheader;
-    bool raw = false, mkfs = false, verbose = false;
+    std::string prefetch_list, prefetch_trace;
+    bool raw = false, mkfs = false, verbose = false, prune = false;
+    std::string batch;
+    size_t batch_buffer_mb = 256;
 
     CLI::App app{"this is overlaybd-apply, apply OCIv1 tar layer to overlaybd format"};
     app.add_flag("--raw", raw, "apply to raw image")->default_val(false);
@@ -90,16 +461,41 @@ int main(int argc, char **argv) {
     app.add_flag("--verbose", verbose, "output debug info")->default_val(false);
     app.add_option("--service_config_path", config_path, "overlaybd image service config path")->type_name("FILEPATH")->check(CLI::ExistingFile)->default_val("/etc/overlaybd/overlaybd.json");
     app.add_option("--gz_index_path", gz_index_path, "build gzip index if layer is gzip, only used with turboOCIv1")->type_name("FILEPATH");
-    app.add_option("--checksum", sha256_checksum, "sha256 checksum for origin uncompressed data");
-    app.add_option("input_path", input_path, "input OCIv1 tar layer path")->type_name("FILEPATH")->check(CLI::ExistingFile)->required();
+    app.add_option("--gz_index_hot_ranges", gz_hot_ranges, "place gzip index entries densely in these ranges of the uncompressed layer, one 'offset length' a line")->type_name("FILEPATH")->check(CLI::ExistingFile);
+    app.add_option("--gz_index_hot_span", gz_hot_span_kb, "span of gzip index entries in the hot ranges, in KB")->default_val(128);
+    app.add_option("--gz_index_threads", gz_index_threads, "threads to build gzip index with, ignored with --gz_index_hot_ranges")->default_val(1);
+    app.add_option("--gz_index_dict_compress", gz_dict_compress, "compression of the windows in gzip index, zlib or zstd (faster to seek)")->check(CLI::IsMember({"zlib", "zstd"}))->default_val("zlib");
+    auto prune_flag = app.add_flag("--prune", prune, "scan the tar headers first, to skip the entries overwritten later in the layer and remove the whiteouts in a batch")->default_val(false);
+    app.add_option("--checksum", sha256_checksum, "sha256 checksum for origin uncompressed data")->excludes(prune_flag);
+    auto list_opt = app.add_option("--prefetch_list", prefetch_list, "files to prefetch at boot, e.g. the entrypoint and its libraries, one path a line, resolved to the ranges of the lower layers they are stored in")->type_name("FILEPATH")->check(CLI::ExistingFile);
+    auto trace_opt = app.add_option("--prefetch_trace", prefetch_trace, "save the ranges of --prefetch_list as a prefetch trace to replay")->type_name("FILEPATH");
+    list_opt->needs(trace_opt);
+    trace_opt->needs(list_opt);
+    auto batch_opt = app.add_option("--batch", batch, "apply the layers listed, one 'input_path image_config_path [commit_file]' a line, in order in one process, committing the upper of each to commit_file as it finishes")->type_name("FILEPATH")->check(CLI::ExistingFile);
+    batch_opt->excludes("--raw", "--gz_index_path", "--checksum", "--prefetch_list", prune_flag);
+    app.add_option("--batch_buffer", batch_buffer_mb, "MB of the next layer decompressed ahead in batch mode")->default_val(256);
+    app.add_option("input_path", input_path, "input OCIv1 tar layer path")->type_name("FILEPATH")->check(CLI::ExistingFile);
 
-    app.add_option("image_config_path", image_config_path, "overlaybd image config path")->type_name("FILEPATH")->check(CLI::ExistingFile)->required();
+    app.add_option("image_config_path", image_config_path, "overlaybd image config path")->type_name("FILEPATH")->check(CLI::ExistingFile);
     CLI11_PARSE(app, argc, argv);
+    if (batch.empty() == (input_path.empty() || image_config_path.empty())) {
+        fprintf(stderr, "either input_path and image_config_path, or --batch is required\n");
+        exit(-1);
+    }
 
     set_log_output_level(verbose ? 0 : 1);
     photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
     DEFER({photon::fini();});
 
+    if (!batch.empty()) {
+        if (apply_batch(config_path, batch, mkfs, batch_buffer_mb) != 0) {
+            fprintf(stderr, "failed to apply batch %s\n", batch.c_str());
+            exit(-1);
+        }
+        fprintf(stdout, "overlaybd-apply done\n");
+        return 0;
+    }
+
 
     ImageService *imgservice = nullptr;
     photon::fs::IFile *imgfile = nullptr;
@@ -117,6 +513,11 @@ int main(int argc, char **argv) {
         delete imgservice;
     });
     bool gen_turboOCI = (gz_index_path != "" );
+    // the data of turboOCI layers is read from the tar blobs, not traced
+    if (!prefetch_list.empty() && (raw || gen_turboOCI)) {
+        fprintf(stderr, "--prefetch_list is not supported with raw or turboOCI images\n");
+        exit(-1);
+    }
 
     auto target = create_ext4fs(imgfile, mkfs, !gen_turboOCI, "/");
     DEFER({ delete target; });
@@ -136,7 +537,23 @@ int main(int argc, char **argv) {
         src_file = new FIFOFile(tarf);
     } else if (is_gzfile(tarf)) {
         if (gz_index_path != "") {
-            auto res = create_gz_index(tarf, gz_index_path.c_str(), 1024*1024);
+            std::vector<GzHotRange> hot_ranges;
+            if (!gz_hot_ranges.empty() && load_hot_ranges(gz_hot_ranges, hot_ranges) != 0) {
+                fprintf(stderr, "failed to load hot ranges\n");
+                exit(-1);
+            }
+            int algo = GZ_DICT_COMPERSS_ALGO, level = GZ_COMPRESS_LEVEL;
+            if (gz_dict_compress == "zstd") {
+                algo = DICT_COMPRESS_ALGO_ZSTD;
+                level = 3;
+            }
+            int res;
+            if (hot_ranges.empty() && gz_index_threads > 1) {
+                res = create_gz_index_parallel(tarf, gz_index_path.c_str(), gz_index_threads, 1024*1024, algo, level);
+            } else {
+                res = create_gz_index_adaptive(tarf, gz_index_path.c_str(), hot_ranges,
+                                               (off_t)gz_hot_span_kb << 10, 1024*1024, algo, level);
+            }
             LOG_INFO("create_gz_index ", VALUE(res));
             tarf->lseek(0, 0);
         }
@@ -151,7 +568,7 @@ int main(int argc, char **argv) {
 
     photon::fs::IFile* base_file = raw ? nullptr : ((ImageFile *)imgfile)->get_base();
 
-    auto tar = new UnTar(src_file, target, 0, 4096, base_file, gen_turboOCI);
+    auto tar = new UnTar(src_file, target, prune ? TAR_PRUNE : 0, 4096, base_file, gen_turboOCI);
 
     if (tar->extract_all() < 0) {
         fprintf(stderr, "failed to extract\n");
@@ -164,6 +581,12 @@ int main(int argc, char **argv) {
                 exit(-1);
             }
         }
+        if (!prefetch_list.empty()) {
+            if (save_prefetch_list(target, base_file, prefetch_list, prefetch_trace) != 0) {
+                fprintf(stderr, "failed to save prefetch trace\n");
+                exit(-1);
+            }
+        }
         fprintf(stdout, "overlaybd-apply done\n");
         fprintf(stderr, "%s\n",  sha256_checksum.c_str());
     }
@@ -49,6 +49,34 @@ IFile *open_file(IFileSystem *fs, const char *fn, int flags, mode_t mode = 0) {
     return file;
 }
 
+// the layers a commit is stacked on, bottom first, plain or zfile, optionally tar-wrapped
+IFileRO *open_lowers(IFileSystem *fs, const vector<string> &paths) {
+    vector<IFile *> files;
+    for (auto &path : paths) {
+        IFile *file = open_file(fs, path.c_str(), O_RDONLY);
+        auto tar_file = new_tar_file_adaptor(file);
+        if (tar_file == nullptr) {
+            fprintf(stderr, "failed to open lower layer '%s'\n", path.c_str());
+            exit(-1);
+        }
+        file = tar_file;
+        if (ZFile::is_zfile(file) == 1) {
+            file = ZFile::zfile_open_ro(file, true, true);
+            if (file == nullptr) {
+                fprintf(stderr, "failed to open zfile '%s'\n", path.c_str());
+                exit(-1);
+            }
+        }
+        files.push_back(file);
+    }
+    auto ret = open_files_ro(files.data(), files.size(), true);
+    if (ret == nullptr) {
+        fprintf(stderr, "failed to open lower layers, %d: %s\n", errno, strerror(errno));
+        exit(-1);
+    }
+    return ret;
+}
+
 int main(int argc, char **argv) {
     string commit_msg;
     string uuid, parent_uuid;
@@ -59,10 +87,13 @@ int main(int argc, char **argv) {
     bool build_turboOCI = false;
     bool build_fastoci = false;
     bool tar = false, rm_old = false, seal = false, commit_sealed = false;
-    bool verbose = false;
+    bool verbose = false, skip_zero = false, wide_index = false, fenced_index = false;
     int compress_threads = 1;
+    int copy_threads = 4;
+    size_t copy_bs = 1024;
     std::string upload_url, cred_file_path;
     ssize_t upload_bs = 262144;
+    vector<string> dedup_lowers;
 
     CLI::App app{"this is overlaybd-commit"};
     app.add_option("-m", commit_msg, "add some custom message if needed");
@@ -79,10 +110,25 @@ int main(int argc, char **argv) {
     app.add_flag("--fastoci", build_fastoci, "commit using turboOCIv1 format (depracated)")->default_val(false);
     app.add_option("data_file", data_file_path, "data file path")->type_name("FILEPATH")->check(CLI::ExistingFile)->required();
     app.add_option("index_file", index_file_path, "index file path")->type_name("FILEPATH");
-    app.add_option("commit_file", commit_file_path, "commit file path")->type_name("FILEPATH");
+    app.add_option("commit_file", commit_file_path, "commit file path, may be omitted with '--upload' to stream the upload without a local copy")->type_name("FILEPATH");
     app.add_flag("--seal", seal, "seal only, data_file is output itself")->default_val(false);
     app.add_flag("--commit_sealed", commit_sealed, "commit sealed, index_file is output")->default_val(false);
     app.add_option("--compress_threads", compress_threads, "compress threads")->default_val(1);
+    app.add_flag("--skip_zero", skip_zero,
+                 "with -z, store blocks of zeros with no data, not readable by earlier versions")
+        ->default_val(false);
+    app.add_option("--copy_threads", copy_threads, "threads copying data of the layer")->default_val(4);
+    app.add_option("--copy_bs", copy_bs, "buffer size of each copying thread, in KB")->default_val(1024);
+    app.add_option("--dedup_lowers", dedup_lowers,
+                   "lower layers the commit will be stacked on, bottom first, whose content it leaves out where equal")
+        ->type_name("FILEPATH")
+        ->check(CLI::ExistingFile);
+    app.add_flag("--wide_index", wide_index,
+                 "write index in the wide format, for large sequential layers, not readable by earlier versions")
+        ->default_val(false);
+    app.add_flag("--fenced_index", fenced_index,
+                 "pad the data to 4K and write a checksummed index, loaded without checking every mapping")
+        ->default_val(false);
     app.add_flag("--verbose", verbose, "output debug info")->default_val(false);
     app.add_option("--upload", upload_url, "registry upload url");
     app.add_option("--upload_bs", upload_bs, "block size for upload, in KB");
@@ -120,7 +166,19 @@ int main(int argc, char **argv) {
         return 0;
     }
 
-    if (rm_old) {
+    // without a commit file, the layer is streamed to the registry as
+    // it is committed (and compressed), never landing on local disk
+    bool streaming = commit_file_path.empty();
+    if (streaming && upload_url.empty()) {
+        fprintf(stderr, "commit_file is required without '--upload'.\n");
+        exit(-1);
+    }
+    if (streaming && tar) {
+        // the tar header records the file size, which is unknown until the end
+        fprintf(stderr, "'-t' requires a commit_file, it can not be streamed.\n");
+        exit(-1);
+    }
+    if (rm_old && !streaming) {
         lfs->unlink(commit_file_path.c_str());
     }
     IFile *fout = nullptr;
@@ -155,42 +213,69 @@ int main(int argc, char **argv) {
         if (tar) {
             fs = new_tar_fs_adaptor(fs);
         }
-        fout = open_file(fs, commit_file_path.c_str(), O_RDWR | O_EXCL | O_CREAT,
-                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        out = fout;
+        if (!streaming) {
+            fout = open_file(fs, commit_file_path.c_str(), O_RDWR | O_EXCL | O_CREAT,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
+    } else {
+        if (algorithm != "" || block_size != -1) {
+            fprintf(stderr, "WARNING option '--bs' and '--algorithm' will be ignored without '-z'\n");
+        }
+        if (!streaming) {
+            fout = open_file(lfs, commit_file_path.c_str(),  O_RDWR | O_EXCL | O_CREAT,
+                        S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        }
+    }
+    out = fout;
 
-        zfile_args = new ZFile::CompressArgs(opt);
-        zfile_args->workers = compress_threads;
-        zfile_args->overwrite_header = true;
-
-        if (!upload_url.empty()) {
-            zfile_args->overwrite_header = false;
-            LOG_INFO("upload to `", upload_url);
-            std::string username, password;
-            if (load_cred_from_file(cred_file_path, upload_url, username, password) <  0) {
-                fprintf(stderr, "failed to read upload cred file\n");
-                exit(-1);
-            }
-            upload_builder = new_registry_uploader(out, upload_url, username, password, 2UL*60*1000*1000, upload_bs*1024);
-            if (upload_builder == nullptr) {
-                fprintf(stderr, "failed to init upload\n");
-                exit(-1);
-            }
-            out = upload_builder;
+    if (!upload_url.empty()) {
+        LOG_INFO("upload to `", upload_url);
+        std::string username, password;
+        if (load_cred_from_file(cred_file_path, upload_url, username, password) <  0) {
+            fprintf(stderr, "failed to read upload cred file\n");
+            exit(-1);
         }
+        // fout is nullptr when streaming
+        upload_builder = new_registry_uploader(fout, upload_url, username, password, 2UL*60*1000*1000, upload_bs*1024);
+        if (upload_builder == nullptr) {
+            fprintf(stderr, "failed to init upload\n");
+            exit(-1);
+        }
+        out = upload_builder;
+    }
 
+    if (compress_zfile) {
+        zfile_args = new ZFile::CompressArgs(opt);
+        zfile_args->workers = compress_threads;
+        zfile_args->skip_zero_blocks = skip_zero;
+        // the uploaded stream is write-only, headers can not be rewritten
+        zfile_args->overwrite_header = upload_url.empty();
         zfile_builder = ZFile::new_zfile_builder(out, zfile_args, false);
         out = zfile_builder;
-    } else {
-        if (algorithm != "" || block_size != 0) {
-            fprintf(stderr, "WARNING option '--bs' and '--algorithm' will be ignored without '-z'\n");
-        }
-        fout = open_file(lfs, commit_file_path.c_str(),  O_RDWR | O_EXCL | O_CREAT,
-                    S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        out = fout;
     }
 
     CommitArgs args(out);
+    args.io_workers = copy_threads;
+    args.io_buffer_size = copy_bs * 1024;
+    args.zero_detect = true;
+    args.wide_index = wide_index;
+    args.fenced_index = fenced_index;
+    if (out == fout && !build_turboOCI && !commit_sealed) {
+        // a sparse layer is copied by copy_file_range(2) with them, others ignore them
+        args.data_fd = ::open(data_file_path.c_str(), O_RDONLY | O_CLOEXEC);
+        args.as_fd = ::open(commit_file_path.c_str(), O_WRONLY | O_CLOEXEC);
+    }
+    DEFER({
+        if (args.data_fd >= 0)
+            ::close(args.data_fd);
+        if (args.as_fd >= 0)
+            ::close(args.as_fd);
+    });
+    unique_ptr<IFileRO> dedup_base;
+    if (!dedup_lowers.empty()) {
+        dedup_base.reset(open_lowers(lfs, dedup_lowers));
+        args.dedup_base = dedup_base.get();
+    }
     if (!uuid.empty()) {
         memset(args.uuid.data, 0, UUID::String::LEN);
         memcpy(args.uuid.data, uuid.c_str(), uuid.length());
@@ -208,16 +293,22 @@ int main(int argc, char **argv) {
     if (ret < 0) {
         fprintf(stderr, "failed to perform commit(), %d: %s\n", errno, strerror(errno));
     }
-    out->close();
+    if (zfile_builder) {
+        zfile_builder->close();
+    }
     delete zfile_builder;
     if (zfile_args) {
         delete zfile_args;
     }
 
+    // the uploader reads the data back from fout, until the upload is done
     if (upload_builder != nullptr && upload_builder->fsync() < 0) {
         fprintf(stderr, "failed to commit or upload");
         return -1;
     }
+    if (fout) {
+        fout->close();
+    }
 
     delete upload_builder;
     delete fout;
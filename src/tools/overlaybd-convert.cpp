@@ -0,0 +1,242 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/fs/localfs.h>
+#include <photon/fs/path.h>
+#include <photon/photon.h>
+#include "../overlaybd/lsmt/file.h"
+#include "../overlaybd/zfile/zfile.h"
+#include "../overlaybd/tar/libtar.h"
+#include "../overlaybd/tar/tar_file.h"
+#include "../overlaybd/gzip/gz.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "CLI11.hpp"
+#include "comm_func.h"
+
+using namespace std;
+using namespace photon::fs;
+
+// Converts an OCI layer, a tar or tar.gz file or stream, into a committed
+// (optionally zfile compressed) overlaybd layer in one run: the layer is
+// extracted into ext4 on an RW layer stacked on the lower layers, whose
+// data and index are anonymous files (O_TMPFILE) that vanish with the
+// process, then committed through the zfile builder into the output. It
+// takes the place of overlaybd-create, overlaybd-apply and overlaybd-commit
+// with their intermediate files, for conversion services.
+
+// the layers the output is stacked on, bottom first, plain or zfile,
+// optionally tar-wrapped; the underlying files are added to `files`
+static LSMT::IFileRO *open_lowers(const vector<string> &paths, vector<IFile *> &files) {
+    for (auto &path : paths) {
+        IFile *file = new_tar_file_adaptor(open_file(path.c_str(), O_RDONLY));
+        if (file == nullptr) {
+            LOG_ERROR_RETURN(0, nullptr, "failed to open lower layer `", path);
+        }
+        if (ZFile::is_zfile(file) == 1) {
+            file = ZFile::zfile_open_ro(file, true, true);
+            if (file == nullptr) {
+                LOG_ERROR_RETURN(0, nullptr, "failed to open zfile `", path);
+            }
+        }
+        files.push_back(file);
+    }
+    return LSMT::open_files_ro(files.data(), files.size(), false);
+}
+
+static IFile *open_tmpfile(const string &dir) {
+    auto file = open_localfile_adaptor(dir.c_str(), O_TMPFILE | O_RDWR, 0600, 0);
+    if (file == nullptr) {
+        LOG_ERRNO_RETURN(0, nullptr, "failed to create anonymous file in `", dir);
+    }
+    return file;
+}
+
+// extracts the layer into ext4 on the RW layer of `fdata` and `findex`, stacked
+// on `lowers` if any, or on a new filesystem
+static int extract(const string &input_path, IFile *fdata, IFile *findex,
+                   LSMT::IFileRO *lowers, uint64_t vsize, const string &parent_uuid) {
+    LSMT::LayerInfo info(fdata, findex);
+    info.virtual_size = vsize;
+    if (!parent_uuid.empty())
+        info.parent_uuid.parse(parent_uuid.c_str(), parent_uuid.size());
+    auto upper = LSMT::create_file_rw(info, false);
+    if (upper == nullptr) {
+        LOG_ERRNO_RETURN(0, -1, "failed to create RW layer");
+    }
+    LSMT::IFileRW *file = upper;
+    if (lowers) {
+        // without the ownership, neither the layers nor their files are deleted with it
+        file = LSMT::stack_files(upper, lowers, false, false);
+        if (file == nullptr) {
+            delete upper;
+            LOG_ERRNO_RETURN(0, -1, "failed to stack RW layer on lower layers");
+        }
+    }
+    DEFER({
+        if (file != upper)
+            delete file;
+        delete upper;
+    });
+
+    // plain tar is read through as is, a file or a stream
+    unique_ptr<IFile> src(open_gzfile_adaptor(input_path.c_str()));
+    if (!src) {
+        LOG_ERRNO_RETURN(0, -1, "failed to open layer `", input_path);
+    }
+    unique_ptr<IFileSystem> target(create_ext4fs(file, lowers == nullptr, true, "/"));
+    UnTar tar(src.get(), target.get(), 0, 4096, file, false);
+    if (tar.extract_all() < 0) {
+        LOG_ERROR_RETURN(0, -1, "failed to extract layer `", input_path);
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    string input_path, output_path, tmp_dir, uuid, parent_uuid, algorithm = "lz4";
+    vector<string> lower_paths;
+    uint64_t vsize_gb = 64;
+    bool compress_zfile = false, tar = false, verbose = false, pooled_index = false;
+    int block_size = 4, compress_threads = 1;
+
+    CLI::App app{"this is overlaybd-convert, convert an OCIv1 tar(.gz) layer to an overlaybd layer in one run"};
+    app.add_option("--lowers", lower_paths, "layers the output is stacked on, bottom first, plain or zfile, a new filesystem is made without them")
+        ->type_name("FILEPATH")
+        ->check(CLI::ExistingFile);
+    app.add_option("--vsize", vsize_gb, "virtual size of the image (GB), without --lowers")->default_val(64);
+    app.add_option("--tmp_dir", tmp_dir, "directory of the anonymous RW layer, the directory of the output by default");
+    app.add_option("--uuid", uuid, "uuid of the output layer");
+    app.add_option("-p,--parent-uuid", parent_uuid, "parent uuid of the output layer");
+    app.add_flag("-z", compress_zfile, "compress to zfile")->default_val(false);
+    app.add_option("--algorithm", algorithm, "compress algorithm, [lz4|zstd]")->default_val("lz4");
+    app.add_option("--bs", block_size, "The size of a data block in KB. Must be a power of two between 4K~64K [4/8/16/32/64]")->default_val(4);
+    app.add_option("--compress_threads", compress_threads, "compress threads")->default_val(1);
+    app.add_flag("-t", tar, "wrapper with tar")->default_val(false);
+    app.add_flag("--pooled_index", pooled_index, "allocate the index of the RW layer from a pool, for large layers of many files")->default_val(false);
+    app.add_flag("--verbose", verbose, "output debug info")->default_val(false);
+    app.add_option("input_path", input_path, "input OCIv1 tar(.gz) layer path, '-' for STDIN")->required();
+    app.add_option("output_path", output_path, "output overlaybd layer path")->type_name("FILEPATH")->required();
+    CLI11_PARSE(app, argc, argv);
+
+    set_log_output_level(verbose ? 0 : 1);
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER({ photon::fini(); });
+    LSMT::set_pooled_index0(pooled_index);
+
+    ZFile::CompressOptions opt;
+    opt.verify = 1;
+    if (algorithm == "lz4") {
+        opt.algo = ZFile::CompressOptions::LZ4;
+    } else if (algorithm == "zstd") {
+        opt.algo = ZFile::CompressOptions::ZSTD;
+    } else {
+        fprintf(stderr, "invalid '--algorithm' parameters.\n");
+        exit(-1);
+    }
+    opt.block_size = block_size * 1024;
+    if ((opt.block_size & (opt.block_size - 1)) != 0 || block_size > 64 || block_size < 4) {
+        fprintf(stderr, "invalid '--bs' parameters.\n");
+        exit(-1);
+    }
+    if (input_path == "-") {
+        input_path = "/dev/stdin";
+    }
+    if (tmp_dir.empty()) {
+        tmp_dir = string(photon::fs::Path(output_path.c_str()).dirname());
+        if (tmp_dir.empty())
+            tmp_dir = ".";
+    }
+
+    vector<IFile *> lower_files;
+    unique_ptr<LSMT::IFileRO> lowers;
+    DEFER({
+        lowers.reset();
+        for (auto f : lower_files)
+            delete f;
+    });
+    uint64_t vsize = vsize_gb << 30;
+    if (!lower_paths.empty()) {
+        lowers.reset(open_lowers(lower_paths, lower_files));
+        if (!lowers) {
+            fprintf(stderr, "failed to open lower layers, %d: %s\n", errno, strerror(errno));
+            exit(-1);
+        }
+        struct stat st;
+        lowers->fstat(&st);
+        vsize = st.st_size;
+    }
+
+    unique_ptr<IFile> fdata(open_tmpfile(tmp_dir)), findex(open_tmpfile(tmp_dir));
+    if (!fdata || !findex) {
+        fprintf(stderr, "failed to create RW layer in %s, %d: %s\n", tmp_dir.c_str(), errno,
+                strerror(errno));
+        exit(-1);
+    }
+    if (extract(input_path, fdata.get(), findex.get(), lowers.get(), vsize, parent_uuid) != 0) {
+        fprintf(stderr, "failed to extract %s\n", input_path.c_str());
+        exit(-1);
+    }
+
+    unique_ptr<LSMT::IFileRW> fin(LSMT::open_file_rw(fdata.get(), findex.get(), false));
+    if (!fin) {
+        fprintf(stderr, "failed to reopen RW layer, %d: %s\n", errno, strerror(errno));
+        exit(-1);
+    }
+    unique_ptr<IFileSystem> lfs(new_localfs_adaptor());
+    IFileSystem *fs = lfs.get();
+    if (tar) {
+        fs = new_tar_fs_adaptor(fs);
+    }
+    unique_ptr<IFile> fout(open_file(output_path.c_str(), O_RDWR | O_EXCL | O_CREAT,
+                                     S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH, fs));
+    IFile *out = fout.get();
+    unique_ptr<ZFile::CompressArgs> zfile_args;
+    unique_ptr<IFile> zfile_builder;
+    if (compress_zfile) {
+        zfile_args.reset(new ZFile::CompressArgs(opt));
+        zfile_args->workers = compress_threads;
+        zfile_builder.reset(ZFile::new_zfile_builder(out, zfile_args.get(), false));
+        out = zfile_builder.get();
+    }
+
+    LSMT::CommitArgs args(out);
+    if (!uuid.empty()) {
+        memset(args.uuid.data, 0, UUID::String::LEN);
+        memcpy(args.uuid.data, uuid.c_str(), uuid.length());
+    }
+    if (!parent_uuid.empty()) {
+        memset(args.parent_uuid.data, 0, UUID::String::LEN);
+        memcpy(args.parent_uuid.data, parent_uuid.c_str(), parent_uuid.length());
+    }
+    if (fin->commit(args) < 0 || out->close() < 0) {
+        fprintf(stderr, "failed to commit %s, %d: %s\n", output_path.c_str(), errno,
+                strerror(errno));
+        exit(-1);
+    }
+    printf("overlaybd-convert has converted %s to %s SUCCESSFULLY\n", input_path.c_str(),
+           output_path.c_str());
+    return 0;
+}
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include "../overlaybd/lsmt/file.h"
+#include "../overlaybd/zfile/zfile.h"
 #include <photon/common/alog.h>
 #include <photon/fs/localfs.h>
 #include <photon/fs/extfs/extfs.h>
@@ -43,11 +44,37 @@ IFile *open_file(const char *fn, int flags, mode_t mode = 0) {
     return file;
 }
 
-
+// the uuid and the virtual size of a sealed base layer
+void read_base_layer(const char *fn, string &uuid, uint64_t &vsize) {
+    IFile *file = open_file(fn, O_RDONLY);
+    if (ZFile::is_zfile(file) == 1) {
+        file = ZFile::zfile_open_ro(file, true, true);
+        if (!file) {
+            fprintf(stderr, "failed to open zfile '%s'\n", fn);
+            exit(-1);
+        }
+    }
+    unique_ptr<LSMT::IFileRO> base(LSMT::open_file_ro(file, true));
+    if (!base) {
+        fprintf(stderr, "failed to open base layer '%s', %d: %s\n", fn, errno, strerror(errno));
+        exit(-1);
+    }
+    UUID id;
+    if (base->get_uuid(id) != 0 || id.is_null()) {
+        fprintf(stderr, "base layer '%s' has no uuid\n", fn);
+        exit(-1);
+    }
+    UUID::String str;
+    id.to_string(str.data, sizeof(str.data));
+    uuid = str.data;
+    struct stat st;
+    base->fstat(&st);
+    vsize = st.st_size;
+}
 
 int main(int argc, char **argv) {
     uint64_t vsize;
-    string parent_uuid;
+    string parent_uuid, base_layer;
     bool sparse = false;
     std::string data_file_path, index_file_path, warp_index_path;
     bool build_turboOCI = false;
@@ -63,6 +90,11 @@ int main(int argc, char **argv) {
     app.add_flag("--fastoci", build_fastoci, "commit using turboOCI format(depracated)")->default_val(false);
     app.add_flag("--raw", raw, "create raw image")->default_val(false);
     app.add_flag("--mkfs", mkfs, "mkfs after create")->default_val(false);
+    app.add_option("--base", base_layer,
+                   "create on a formatted base layer, e.g. /opt/overlaybd/baselayers/ext4_64, "
+                   "instead of mkfs; its uuid is the parent uuid and its size the virtual size")
+        ->type_name("FILEPATH")
+        ->excludes("-u");
     app.add_option("data_file", data_file_path, "data file path")->type_name("FILEPATH")->required();
     app.add_option("index_file", index_file_path, "index file path")->type_name("FILEPATH")->required();
     app.add_option("vsize", vsize, "virtual size(GB)")->type_name("INT")->check(CLI::NonNegativeNumber)->required();
@@ -76,6 +108,17 @@ int main(int argc, char **argv) {
     DEFER({photon::fini();});
 
     vsize *= 1024 * 1024 * 1024;
+    if (!base_layer.empty()) {
+        if (mkfs || raw || build_turboOCI) {
+            fprintf(stderr, "--base can't be used with --mkfs, --raw or --turboOCI\n");
+            exit(-1);
+        }
+        uint64_t base_vsize;
+        read_base_layer(base_layer.c_str(), parent_uuid, base_vsize);
+        if (vsize != base_vsize)
+            printf("virtual size is set to %" PRIu64 " bytes of the base layer\n", base_vsize);
+        vsize = base_vsize;
+    }
     const auto flag = O_RDWR | O_EXCL | O_CREAT;
     const auto mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
     IFile* fdata = open_file(data_file_path.c_str(), flag, mode);
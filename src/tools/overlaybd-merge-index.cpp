@@ -0,0 +1,94 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <photon/common/alog.h>
+#include <photon/common/alog-stdstring.h>
+#include <photon/fs/localfs.h>
+#include <photon/photon.h>
+#include "../overlaybd/lsmt/file.h"
+#include "../overlaybd/zfile/zfile.h"
+#include "../overlaybd/tar/tar_file.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "CLI11.hpp"
+
+using namespace std;
+using namespace photon::fs;
+
+// Builds the merged index of the lower layers of an image once, at conversion
+// time, to be published alongside it and referenced by `mergedIndex` of the
+// image config, so that the image opens without loading and merging the
+// indexes of its layers on the node.
+
+int main(int argc, char **argv) {
+    vector<string> layer_paths;
+    string output_path;
+    bool verbose = false;
+
+    CLI::App app{"this is overlaybd-merge-index, build the merged index of the layers of an image"};
+    app.add_option("layers", layer_paths, "the layers of the image, bottom first, plain or zfile, optionally tar-wrapped")
+        ->type_name("FILEPATH")
+        ->check(CLI::ExistingFile)
+        ->required();
+    app.add_option("-o,--output", output_path, "output merged index path")->type_name("FILEPATH")->required();
+    app.add_flag("--verbose", verbose, "output debug info")->default_val(false);
+    CLI11_PARSE(app, argc, argv);
+
+    set_log_output_level(verbose ? 0 : 1);
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER({ photon::fini(); });
+
+    vector<IFile *> files;
+    for (auto &path : layer_paths) {
+        IFile *file = new_tar_file_adaptor(open_localfile_adaptor(path.c_str(), O_RDONLY, 0644, 0));
+        if (file == nullptr) {
+            fprintf(stderr, "failed to open layer '%s', %d: %s\n", path.c_str(), errno, strerror(errno));
+            exit(-1);
+        }
+        if (ZFile::is_zfile(file) == 1) {
+            file = ZFile::zfile_open_ro(file, true, true);
+            if (file == nullptr) {
+                fprintf(stderr, "failed to open zfile '%s'\n", path.c_str());
+                exit(-1);
+            }
+        }
+        files.push_back(file);
+    }
+    unique_ptr<LSMT::IFileRO> merged(LSMT::open_files_ro(files.data(), files.size(), true));
+    if (!merged) {
+        fprintf(stderr, "failed to merge the indexes of the layers, %d: %s\n", errno, strerror(errno));
+        exit(-1);
+    }
+    unique_ptr<IFile> out(open_localfile_adaptor(output_path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644, 0));
+    if (!out) {
+        fprintf(stderr, "failed to create %s, %d: %s\n", output_path.c_str(), errno, strerror(errno));
+        exit(-1);
+    }
+    if (LSMT::save_merged_index(merged.get(), out.get()) != 0 || out->fsync() != 0) {
+        fprintf(stderr, "failed to write %s, %d: %s\n", output_path.c_str(), errno, strerror(errno));
+        exit(-1);
+    }
+    printf("overlaybd-merge-index has merged the indexes of %zu layers into %s SUCCESSFULLY\n",
+           layer_paths.size(), output_path.c_str());
+    return 0;
+}
@@ -0,0 +1,186 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "../image_file.h"
+#include "../image_service.h"
+#include "../io_record.h"
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include <photon/common/alog.h>
+#include <photon/common/utility.h>
+#include <photon/photon.h>
+#include <photon/thread/thread11.h>
+#include "CLI11.hpp"
+
+using namespace std;
+
+// Replays the guest I/O recorded by `ioRecordPath` against an image, at the
+// recorded pace or faster, and compares the latencies with the recorded ones.
+struct OpStats {
+    const char *name;
+    uint64_t skipped = 0, errors = 0;
+    vector<uint32_t> replayed, recorded;
+
+    void report() {
+        if (replayed.empty() && skipped == 0)
+            return;
+        printf("%-8s %10zu ops %8lu errors %8lu skipped\n", name, replayed.size(), errors,
+               skipped);
+        print("replayed", replayed);
+        print("recorded", recorded);
+    }
+
+    static void print(const char *what, vector<uint32_t> &lat) {
+        if (lat.empty())
+            return;
+        sort(lat.begin(), lat.end());
+        auto q = [&](double p) { return lat[min<size_t>(lat.size() - 1, p * lat.size())]; };
+        uint64_t sum = 0;
+        for (auto l : lat)
+            sum += l;
+        printf("  %-8s us: avg %8lu p50 %8u p90 %8u p99 %8u p99.9 %8u max %8u\n", what,
+               sum / lat.size(), q(0.5), q(0.9), q(0.99), q(0.999), lat.back());
+    }
+};
+
+int main(int argc, char **argv) {
+    string record, image_config, global_config;
+    double speed = 1;
+    uint32_t concurrency = 64;
+    bool writes = false, verbose = false;
+
+    CLI::App app{"this is a tool to replay the guest I/O recorded by ioRecordPath against an image"};
+    app.add_option("record_file", record, "io record file")
+        ->type_name("FILEPATH")
+        ->check(CLI::ExistingFile)
+        ->required();
+    app.add_option("--image", image_config, "image config the record is replayed against")
+        ->type_name("FILEPATH")
+        ->check(CLI::ExistingFile)
+        ->required();
+    app.add_option("--config", global_config, "overlaybd config, the default one if not set")
+        ->type_name("FILEPATH")
+        ->check(CLI::ExistingFile);
+    app.add_option("--speed", speed, "pace of the replay relative to the recording, 0 for as fast as possible")
+        ->default_val(1);
+    app.add_option("--concurrency", concurrency, "max # of requests in flight")->default_val(64);
+    app.add_flag("--writes", writes, "replay writes, discards and syncs, which modify the image")
+        ->default_val(false);
+    app.add_flag("--verbose", verbose, "output debug info")->default_val(false);
+    CLI11_PARSE(app, argc, argv);
+
+    set_log_output_level(verbose ? 0 : 1);
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER({ photon::fini(); });
+
+    if (speed < 0 || concurrency == 0) {
+        fprintf(stderr, "--speed must not be negative, --concurrency must be positive\n");
+        exit(-1);
+    }
+    vector<IORecord> records;
+    if (IORecorder::load(record, records) != 0) {
+        fprintf(stderr, "failed to load io record %s\n", record.c_str());
+        exit(-1);
+    }
+    auto imgservice = create_image_service(global_config.empty() ? nullptr : global_config.c_str());
+    if (imgservice == nullptr) {
+        fprintf(stderr, "failed to create image service\n");
+        exit(-1);
+    }
+    DEFER(delete imgservice);
+    unique_ptr<ImageFile> file(imgservice->create_image_file(image_config.c_str()));
+    if (!file) {
+        fprintf(stderr, "failed to create image file\n");
+        exit(-1);
+    }
+
+    OpStats reads{"read"}, wrs{"write"}, discards{"discard"}, syncs{"sync"};
+    auto stats_of = [&](uint8_t op) -> OpStats * {
+        switch (op) {
+        case IORecord::READ: return &reads;
+        case IORecord::WRITE: return &wrs;
+        case IORecord::DISCARD: return &discards;
+        case IORecord::SYNC: return &syncs;
+        }
+        return nullptr;
+    };
+
+    photon::semaphore slots(concurrency);
+    uint64_t max_lag = 0;
+    auto start = photon::now;
+    for (auto &r : records) {
+        auto s = stats_of(r.op);
+        if (s == nullptr)
+            continue;
+        if (r.op != IORecord::READ && !writes) {
+            s->skipped++;
+            continue;
+        }
+        if (speed > 0) {
+            auto due = start + (uint64_t)(r.time_us / speed);
+            if (photon::now < due)
+                photon::thread_usleep(due - photon::now);
+            else
+                max_lag = max(max_lag, photon::now - due);
+        }
+        slots.wait(1);
+        s->recorded.push_back(r.latency_us);
+        photon::thread_create11([&, r, s]() {
+            DEFER(slots.signal(1));
+            void *buf = nullptr;
+            bool data = r.op == IORecord::READ || r.op == IORecord::WRITE;
+            if (data && r.length && posix_memalign(&buf, 4096, r.length) != 0) {
+                s->errors++;
+                return;
+            }
+            DEFER(free(buf));
+            auto begin = photon::now;
+            int64_t ret = 0;
+            switch (r.op) {
+            case IORecord::READ:
+                ret = file->pread(buf, r.length, r.offset);
+                break;
+            case IORecord::WRITE:
+                memset(buf, 0, r.length);
+                ret = file->pwrite(buf, r.length, r.offset);
+                break;
+            case IORecord::DISCARD:
+                // as the frontends do for UNMAP / WRITE_SAME / DISCARD
+                ret = file->fallocate(3, r.offset, r.length);
+                break;
+            case IORecord::SYNC:
+                ret = file->fdatasync();
+                break;
+            }
+            s->replayed.push_back(min<uint64_t>(photon::now - begin, UINT32_MAX));
+            if (ret < 0)
+                s->errors++;
+        });
+    }
+    slots.wait(concurrency);
+    auto elapsed = photon::now - start;
+    uint64_t span = records.empty() ? 0 : records.back().time_us;
+
+    printf("replayed %zu records of %s in %lu ms, recorded in %lu ms, max dispatch lag %lu us\n",
+           records.size(), record.c_str(), elapsed / 1000, span / 1000, max_lag);
+    for (auto s : {&reads, &wrs, &discards, &syncs})
+        s->report();
+    return 0;
+}
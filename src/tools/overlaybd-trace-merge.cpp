@@ -0,0 +1,93 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "../prefetch.h"
+#include <fcntl.h>
+#include <memory>
+#include <string>
+#include <vector>
+#include <photon/common/alog.h>
+#include <photon/common/utility.h>
+#include <photon/fs/localfs.h>
+#include <photon/photon.h>
+#include "CLI11.hpp"
+
+using namespace std;
+using namespace photon::fs;
+
+// Merges the traces recorded by many boots of a container into one profile,
+// which replays the ranges most of the boots read, in their median order.
+int main(int argc, char **argv) {
+    vector<string> traces;
+    string output;
+    size_t align = 0;
+    bool verbose = false;
+
+    CLI::App app{"this is a tool to merge the prefetch traces of many runs into a profile"};
+    app.add_option("trace_files", traces, "traces recorded by the runs")
+        ->type_name("FILEPATH")
+        ->check(CLI::ExistingFile)
+        ->required();
+    app.add_option("-o,--output", output, "output profile path")->type_name("FILEPATH")->required();
+    app.add_option("--align", align, "size of the blocks the accesses are counted by, in bytes")
+        ->default_val(262144);
+    app.add_flag("--verbose", verbose, "output debug info")->default_val(false);
+    CLI11_PARSE(app, argc, argv);
+
+    set_log_output_level(verbose ? 0 : 1);
+    photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
+    DEFER({ photon::fini(); });
+
+    if (align == 0 || (align & (align - 1)) != 0) {
+        fprintf(stderr, "--align must be a power of two\n");
+        exit(-1);
+    }
+
+    vector<vector<Prefetcher::TraceFormat>> runs;
+    uint32_t version = 0;
+    for (auto &fn : traces) {
+        unique_ptr<IFile> file(open_localfile_adaptor(fn.c_str(), O_RDONLY));
+        if (!file) {
+            fprintf(stderr, "failed to open trace %s\n", fn.c_str());
+            exit(-1);
+        }
+        runs.emplace_back();
+        uint32_t magic = 0;
+        if (Prefetcher::load_trace(file.get(), runs.back(), 0, &magic) != 0) {
+            fprintf(stderr, "invalid trace %s\n", fn.c_str());
+            exit(-1);
+        }
+        // the times of v1 records are their order, which don't mix with real ones
+        if (magic == Prefetcher::PROFILE_MAGIC || (version && magic != version)) {
+            fprintf(stderr, "trace %s is a profile or of another version\n", fn.c_str());
+            exit(-1);
+        }
+        version = magic;
+        LOG_INFO("loaded ` records from `", runs.back().size(), fn);
+    }
+
+    unique_ptr<IFile> out(open_localfile_adaptor(output.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644));
+    if (!out) {
+        fprintf(stderr, "failed to create %s\n", output.c_str());
+        exit(-1);
+    }
+    if (Prefetcher::save_profile(out.get(), runs, align) != 0) {
+        fprintf(stderr, "failed to save profile %s\n", output.c_str());
+        exit(-1);
+    }
+    fprintf(stdout, "merged %zu traces into %s\n", runs.size(), output.c_str());
+    return 0;
+}
@@ -28,7 +28,9 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <algorithm>
 #include <memory>
+#include <thread>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -61,13 +63,13 @@ IFile *new_streamFile(){
     return new IStreamFile;
 }
 
-int verify_crc(IFile* src_file) {
+int verify_crc(IFile* src_file, int nthreads) {
 
     if (is_zfile(src_file) != 1) {
         fprintf(stderr, "format error! <source_file> should be a zfile.\n");
         exit(-1);
     }
-    return zfile_validation_check(src_file);
+    return zfile_validation_check(src_file, nthreads);
 }
 
 int main(int argc, char **argv) {
@@ -76,28 +78,46 @@ int main(int argc, char **argv) {
     bool tar = false;
     bool extract = false;
     bool verify = false;
+    bool skip_zero = false;
     std::string fn_src, fn_dst;
     std::string algorithm;
     int block_size;
+    int dict_size;
+    int level;
     bool verbose = false;
+    int threads;
 
     CLI::App app{"this is a zfile tool to create/extract zfile"};
     app.add_flag("-t", tar, "wrapper with tar")->default_val(false);
     app.add_flag("-x", extract, "extract zfile")->default_val(false);
     app.add_flag("--verify", verify, "verify checksum of {source_file}")->default_val(false);
     app.add_flag("-f", rm_old, "force compress. unlink exist")->default_val(false);
-    app.add_option("--algorithm", algorithm, "compress algorithm, [lz4|zstd]")->default_str("lz4");
+    app.add_flag("--skip_zero", skip_zero,
+                 "store blocks of zeros with no data, not readable by earlier versions")
+        ->default_val(false);
+    app.add_option("--algorithm", algorithm, "compress algorithm, [lz4|zstd|adaptive]")->default_str("lz4");
+    app.add_option("--level", level, "compression level of zstd, 0 for default")->default_val(0);
     app.add_option(
            "--bs", block_size,
            "The size of a data block in KB. Must be a power of two between 4K~64K [4/8/16/32/64])")
         ->default_val(4);
+    app.add_option("--dict_size", dict_size,
+                   "The max size in KB of the dictionary trained from the source file, zstd only. "
+                   "0 disables it")
+        ->default_val(0);
     app.add_option("source_file", fn_src, "source file path")
         ->type_name("FILEPATH")
         // ->check(CLI::ExistingFile)
         ->required();
     app.add_option("target_file", fn_dst, "target file path")->type_name("FILEPATH");
+    app.add_option("--threads", threads,
+                   "threads to extract (-x) or verify a zfile with, 0 for # of cores")
+        ->default_val(0);
     app.add_flag("--verbose", verbose, "output debug info")->default_val(false);
     CLI11_PARSE(app, argc, argv);
+    if (threads <= 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
 
     set_log_output_level(verbose ? 0 : 1);
     photon::init(photon::INIT_EVENT_DEFAULT, photon::INIT_IO_DEFAULT);
@@ -111,6 +131,7 @@ int main(int argc, char **argv) {
         if (fn_src.empty()) {
             LOG_INFO("read source from STDIN");
             file = new_streamFile();
+            threads = 1; // read in order
         } else {
             file = lfs->open(fn_src.c_str(), O_RDONLY);
         }
@@ -118,7 +139,7 @@ int main(int argc, char **argv) {
             fprintf(stderr, "failed to open file %s\n", fn_src.c_str());
             exit(-1);
         }
-        if (verify_crc(new_tar_file_adaptor(file))!=0) {
+        if (verify_crc(new_tar_file_adaptor(file), threads)!=0) {
             printf("%s is not a valid zfile blob or checksum can't be found.\n", fn_src.c_str());
             return -1;
         }
@@ -139,12 +160,23 @@ int main(int argc, char **argv) {
         opt.algo = CompressOptions::LZ4;
     } else if (algorithm == "zstd") {
         opt.algo = CompressOptions::ZSTD;
+    } else if (algorithm == "adaptive") {
+        // stores each block as is, in LZ4 or in ZSTD, whichever fits it best
+        opt.algo = CompressOptions::ADAPTIVE;
     }
+    opt.level = level;
     opt.block_size = block_size * 1024;
     if ((opt.block_size & (opt.block_size - 1)) != 0 || (block_size > 64 || block_size < 4)) {
         fprintf(stderr, "invalid '--bs' parameters.\nj");
         exit(-1);
     }
+    if (dict_size > 0) {
+        if (opt.algo == CompressOptions::LZ4 || pipe || extract) {
+            fprintf(stderr, "'--dict_size' requires zstd and a source file to compress.\n");
+            exit(-1);
+        }
+        opt.dict_size = dict_size * 1024;
+    }
     if (rm_old) {
         lfs->unlink(fn_dst.c_str());
     }
@@ -154,6 +186,7 @@ int main(int argc, char **argv) {
     }
     int ret = 0;
     CompressArgs args(opt);
+    args.skip_zero_blocks = skip_zero;
     if (!extract) {
         printf("compress file %s as %s\n", fn_src.c_str(), fn_dst.c_str());
         IFile *infile = (!pipe ? lfs->open(fn_src.c_str(), O_RDONLY) : new_streamFile() );
@@ -195,7 +228,7 @@ int main(int argc, char **argv) {
         }
         DEFER(delete outfile);
 
-        ret = zfile_decompress(infile, outfile);
+        ret = zfile_decompress(infile, outfile, threads);
         if (ret != 0) {
             fprintf(stderr, "decompress failed, errno:%d\n", errno);
             exit(-1);
@@ -3,6 +3,7 @@
 #include "sha256file.h"
 #include <photon/common/alog.h>
 #include <string>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <unistd.h>
@@ -68,6 +69,39 @@ SHA256File *new_sha256_file(IFile *file, bool ownership = true) {
     return new SHA256CheckedFile(file, ownership);
 }
 
+class SHA256StreamImpl : public SHA256Stream {
+public:
+    SHA256_CTX ctx = {0};
+
+    SHA256StreamImpl() {
+        SHA256_Init(&ctx);
+    }
+    void update(const void *buf, size_t count) override {
+        SHA256_Update(&ctx, buf, count);
+    }
+    std::string sha256_checksum() override {
+        unsigned char sha[32];
+        SHA256_Final(sha, &ctx);
+        char res[SHA256_DIGEST_LENGTH * 2];
+        for (int i = 0; i < SHA256_DIGEST_LENGTH; i++)
+            sprintf(res + (i * 2), "%02x", sha[i]);
+        return "sha256:" + std::string(res, SHA256_DIGEST_LENGTH * 2);
+    }
+    std::string state() override {
+        return std::string((const char *)&ctx, sizeof(ctx));
+    }
+    bool restore(const std::string &state) override {
+        if (state.size() != sizeof(ctx))
+            return false;
+        memcpy(&ctx, state.data(), sizeof(ctx));
+        return true;
+    }
+};
+
+SHA256Stream *new_sha256_stream() {
+    return new SHA256StreamImpl();
+}
+
 string sha256sum(const char *fn) {
     constexpr size_t BUFFERSIZE = 65536;
     // auto file = open_localfile_adaptor(fn, O_RDONLY | O_DIRECT);
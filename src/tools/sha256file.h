@@ -11,4 +11,17 @@ public:
 
 SHA256File *new_sha256_file(photon::fs::IFile *file, bool ownership);
 
+// sha256 of data that's fed in pieces rather than read through a file
+class SHA256Stream {
+public:
+    virtual ~SHA256Stream() = default;
+    virtual void update(const void *buf, size_t count) = 0;
+    virtual std::string sha256_checksum() = 0;
+    // the state after the data fed so far, to continue from after a restart
+    virtual std::string state() = 0;
+    virtual bool restore(const std::string &state) = 0;
+};
+
+SHA256Stream *new_sha256_stream();
+
 std::string sha256sum(const char *fn);
@@ -40,19 +40,28 @@
 #include "../image_file.h"
 #include "CLI11.hpp"
 #include "comm_func.h"
+#include "sha256file.h"
 
 using namespace std;
 using namespace photon::fs;
 
-int dump_tar_headers(IFile *src_file, const string &out) {
+int dump_tar_headers(IFile *src_file, const string &out, const string &index_out) {
 
     auto dst_file = open_file(out.c_str(), O_TRUNC | O_CREAT | O_RDWR, 0644);
     if (dst_file == nullptr) {
         LOG_ERRNO_RETURN(0, -1, "create dst file failed.");
     }
     DEFER({ delete dst_file; });
+    IFile *index_file = nullptr;
+    if (!index_out.empty()) {
+        index_file = open_file(index_out.c_str(), O_TRUNC | O_CREAT | O_RDWR, 0644);
+        if (index_file == nullptr) {
+            LOG_ERRNO_RETURN(0, -1, "create index file failed.");
+        }
+    }
+    DEFER({ delete index_file; });
     auto tar = new UnTar(src_file, nullptr, 0, 4096, nullptr, false);
-    auto obj_count = tar->dump_tar_headers(dst_file);
+    auto obj_count = tar->dump_tar_headers(dst_file, index_file);
     if (obj_count < 0) {
         return -1;
     }
@@ -61,9 +70,10 @@ int dump_tar_headers(IFile *src_file, const string &out) {
 }
 
 int main(int argc, char **argv) {
-    std::string image_config_path, input_path, gz_index_path, config_path, fstype;
+    std::string image_config_path, input_path, gz_index_path, config_path, fstype, sha256_checksum;
+    std::string tar_index_path, aligned_data_path;
     bool raw = false, mkfs = false, verbose = false;
-    bool export_tar_headers = false, import_tar_headers = false;
+    bool export_tar_headers = false, import_tar_headers = false, prune = false;
 
     CLI::App app{"this is turboOCI-apply, apply OCIv1 tar layer to 'Overlaybd-TurboOCI v1' format"};
     app.add_flag("--mkfs", mkfs, "mkfs before apply")->default_val(false);
@@ -77,10 +87,23 @@ int main(int argc, char **argv) {
                    "build gzip index if layer is gzip, only used with turboOCI")
         ->type_name("FILEPATH")
         ->default_val("gzip.meta");
+    app.add_option("--checksum", sha256_checksum,
+                   "sha256 checksum for origin uncompressed data, only checked with erofs");
     app.add_flag("--import", import_tar_headers, "generate turboOCI file from <input_path>")
         ->default_val(false);
     app.add_flag("--export", export_tar_headers, "export tar meta from <input_path>")
         ->default_val(false);
+    app.add_flag("--prune", prune,
+                 "scan the tar headers first, to skip the entries overwritten later in the "
+                 "layer and remove the whiteouts in a batch, only used with ext4")
+        ->default_val(false);
+    app.add_option("--export_index", tar_index_path,
+                   "with --export, also write an index of the tar entries sorted by path hash")
+        ->type_name("FILEPATH");
+    app.add_option("--aligned_data", aligned_data_path,
+                   "with erofs, copy the file data to this file at 4K aligned offsets, to be the "
+                   "target of the layer instead of the tar(gz)")
+        ->type_name("FILEPATH");
     app.add_option("input_path", input_path, "input OCIv1 tar(gz) layer path")
         ->type_name("FILEPATH")
         ->check(CLI::ExistingFile)
@@ -109,7 +132,7 @@ int main(int argc, char **argv) {
         src_file = tarf;
     }
     if (export_tar_headers) {
-        return dump_tar_headers(src_file, image_config_path);
+        return dump_tar_headers(src_file, image_config_path, tar_index_path);
     }
     auto lfs = new_localfs_adaptor();
     if (lfs->access(image_config_path.c_str(), 0) != 0) {
@@ -137,18 +160,36 @@ int main(int argc, char **argv) {
 
         auto tar =
            new TarErofs(src_file, imgfile, 4096, base_file, true, cfg.lowers().size() == 0);
+        std::unique_ptr<photon::fs::IFile> aligned_data;
+        if (!aligned_data_path.empty()) {
+            aligned_data.reset(open_file(aligned_data_path.c_str(), O_TRUNC | O_CREAT | O_RDWR, 0644));
+            tar->set_aligned_target(aligned_data.get());
+        }
+        // digested while mkfs.erofs consumes the stream
+        std::unique_ptr<SHA256Stream> digest;
+        if (!sha256_checksum.empty()) {
+            digest.reset(new_sha256_stream());
+            tar->set_stream_hook([&](const char *buf, size_t count) { digest->update(buf, count); });
+        }
 
         if (tar->extract_all() < 0) {
             fprintf(stderr, "failed to extract\n");
             exit(-1);
         }
+        if (digest) {
+            auto calc = digest->sha256_checksum();
+            if (calc != sha256_checksum) {
+                fprintf(stderr, "sha256 checksum mismatch, expect: %s, got: %s\n", sha256_checksum.c_str(), calc.c_str());
+                exit(-1);
+            }
+        }
     } else {
         auto target = create_ext4fs(imgfile, mkfs, false, "/");
         DEFER({ delete target; });
 
         photon::fs::IFile *base_file = raw ? nullptr : ((ImageFile *)imgfile)->get_base();
         bool gen_turboOCI = true;
-        int option = (import_tar_headers ? TAR_IGNORE_CRC : 0);
+        int option = (import_tar_headers ? TAR_IGNORE_CRC : 0) | (prune ? TAR_PRUNE : 0);
         auto tar =
             new UnTar(src_file, target, option, 4096, base_file, gen_turboOCI, import_tar_headers);
         if (tar->extract_all() < 0) {
@@ -0,0 +1,473 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#include "ublk.h"
+#include "image_file.h"
+#include "io_trace.h"
+#include <photon/common/alog.h>
+#include <photon/io/fd-events.h>
+#include <photon/thread/thread.h>
+#include <photon/thread/thread-pool.h>
+#include <photon/thread/thread11.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <linux/ublk_cmd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#define UBLK_CONTROL_DEV "/dev/ublk-control"
+#define UBLK_CDEV_PREFIX "/dev/ublkc"
+#define UBLK_MAX_IO_BYTES (512UL << 10)
+#define UBLK_MAX_DISCARD_BYTES (64UL << 20)
+#define UBLK_MAX_IDLE_WORKERS 16
+
+// A minimal io_uring, just enough for uring_cmd submission. Completions are
+// waited for with photon::wait_for_fd_readable on the ring fd, so waiting
+// never blocks the vcpu.
+class Uring {
+public:
+    int fd = -1;
+
+    ~Uring() {
+        exit();
+    }
+
+    void exit() {
+        if (m_sqes)
+            munmap(m_sqes, m_sqes_len);
+        if (m_cq_ptr && m_cq_ptr != m_sq_ptr)
+            munmap(m_cq_ptr, m_cq_len);
+        if (m_sq_ptr)
+            munmap(m_sq_ptr, m_sq_len);
+        if (fd >= 0)
+            close(fd);
+        m_sqes = nullptr;
+        m_sq_ptr = m_cq_ptr = nullptr;
+        fd = -1;
+    }
+
+    int init(unsigned entries, bool sqe128) {
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        if (sqe128)
+            p.flags |= IORING_SETUP_SQE128;
+        fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (fd < 0)
+            LOG_ERRNO_RETURN(0, -1, "io_uring_setup failed");
+
+        m_sqe_size = sqe128 ? 128 : sizeof(struct io_uring_sqe);
+        m_sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        m_cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            m_sq_len = m_cq_len = std::max(m_sq_len, m_cq_len);
+        m_sq_ptr = map(m_sq_len, IORING_OFF_SQ_RING);
+        if (!m_sq_ptr)
+            return -1;
+        if (p.features & IORING_FEAT_SINGLE_MMAP) {
+            m_cq_ptr = m_sq_ptr;
+        } else if (!(m_cq_ptr = map(m_cq_len, IORING_OFF_CQ_RING))) {
+            return -1;
+        }
+        m_sqes_len = p.sq_entries * m_sqe_size;
+        m_sqes = (char *)map(m_sqes_len, IORING_OFF_SQES);
+        if (!m_sqes)
+            return -1;
+
+        auto sq = (char *)m_sq_ptr, cq = (char *)m_cq_ptr;
+        m_sq_head = (unsigned *)(sq + p.sq_off.head);
+        m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+        m_sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+        m_sq_entries = p.sq_entries;
+        m_sq_array = (unsigned *)(sq + p.sq_off.array);
+        m_cq_head = (unsigned *)(cq + p.cq_off.head);
+        m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+        m_cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+        m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+        m_local_tail = *m_sq_tail;
+        return 0;
+    }
+
+    // a zeroed sqe, or nullptr if the submission queue is full
+    struct io_uring_sqe *get_sqe() {
+        auto head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        if (m_local_tail - head >= m_sq_entries)
+            return nullptr;
+        auto idx = m_local_tail & m_sq_mask;
+        auto sqe = (struct io_uring_sqe *)(m_sqes + idx * m_sqe_size);
+        memset(sqe, 0, m_sqe_size);
+        m_sq_array[idx] = idx;
+        m_local_tail++;
+        return sqe;
+    }
+
+    int submit() {
+        unsigned n = m_local_tail - *m_sq_tail;
+        if (n == 0)
+            return 0;
+        __atomic_store_n(m_sq_tail, m_local_tail, __ATOMIC_RELEASE);
+        int ret = syscall(__NR_io_uring_enter, fd, n, 0, 0, nullptr, 0);
+        if (ret < 0)
+            LOG_ERRNO_RETURN(0, -1, "io_uring_enter failed");
+        return ret;
+    }
+
+    struct io_uring_cqe *peek_cqe() {
+        auto head = *m_cq_head;
+        if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+            return nullptr;
+        return &m_cqes[head & m_cq_mask];
+    }
+
+    void cqe_seen() {
+        __atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    struct io_uring_cqe *wait_cqe() {
+        struct io_uring_cqe *cqe;
+        while (!(cqe = peek_cqe())) {
+            photon::wait_for_fd_readable(fd);
+        }
+        return cqe;
+    }
+
+private:
+    void *map(size_t len, off_t off) {
+        auto ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, off);
+        if (ptr == MAP_FAILED)
+            LOG_ERRNO_RETURN(0, nullptr, "mmap io_uring failed, offset: `", off);
+        return ptr;
+    }
+
+    void *m_sq_ptr = nullptr, *m_cq_ptr = nullptr;
+    char *m_sqes = nullptr;
+    size_t m_sq_len = 0, m_cq_len = 0, m_sqes_len = 0, m_sqe_size = 0;
+    unsigned *m_sq_head, *m_sq_tail, *m_sq_array, *m_cq_head, *m_cq_tail;
+    unsigned m_sq_mask, m_sq_entries, m_cq_mask, m_local_tail;
+    struct io_uring_cqe *m_cqes;
+};
+
+static uint8_t ilog2(uint32_t v) {
+    uint8_t r = 0;
+    while (v >>= 1)
+        r++;
+    return r;
+}
+
+class UblkDeviceImpl : public UblkDevice {
+public:
+    UblkDeviceImpl(ImageFile *file, int dev_id, uint32_t queue_depth)
+        : m_file(file), m_dev_id(dev_id),
+          m_depth(std::min(queue_depth ? queue_depth : 128U, (uint32_t)UBLK_MAX_QUEUE_DEPTH)) {
+    }
+
+    ~UblkDeviceImpl() {
+        for (auto buf : m_bufs)
+            free(buf);
+        if (m_iods)
+            munmap(m_iods, m_iods_len);
+        if (m_cdev_fd >= 0)
+            close(m_cdev_fd);
+        if (m_ctrl_fd >= 0)
+            close(m_ctrl_fd);
+    }
+
+    int dev_id() const override {
+        return m_added ? (int)m_info.dev_id : -1;
+    }
+
+    int run() override {
+        int ret = setup();
+        if (ret == 0) {
+            auto th = photon::thread_create11(&UblkDeviceImpl::queue_loop, this);
+            auto jh = photon::thread_enable_join(th);
+            ublksrv_ctrl_cmd cmd = ctrl(0, 0);
+            cmd.data[0] = getpid();
+            ret = ctrl_cmd(UBLK_CMD_START_DEV, cmd);
+            if (ret == 0) {
+                m_started = true;
+                LOG_INFO("ublk device /dev/ublkb` started, depth: `", m_info.dev_id, m_depth);
+                if (m_stopping)
+                    stop();
+            } else {
+                LOG_ERROR("start ublk device ` failed, errno: `", m_info.dev_id, errno);
+                m_quit = true;
+                photon::thread_interrupt(th);
+            }
+            photon::thread_join(jh);
+        }
+        // DEL_DEV waits for the char device to be released; closing the ring
+        // also cancels the fetch commands still queued in it
+        m_queue.exit();
+        if (m_iods) {
+            munmap(m_iods, m_iods_len);
+            m_iods = nullptr;
+        }
+        if (m_cdev_fd >= 0) {
+            close(m_cdev_fd);
+            m_cdev_fd = -1;
+        }
+        if (m_added) {
+            ublksrv_ctrl_cmd cmd = ctrl(0, 0);
+            if (ctrl_cmd(UBLK_CMD_DEL_DEV, cmd) != 0)
+                LOG_ERROR("delete ublk device ` failed, errno: `", m_info.dev_id, errno);
+            m_added = false;
+        }
+        return ret;
+    }
+
+    void stop() override {
+        m_stopping = true;
+        if (!m_started)
+            return;
+        m_started = false;
+        ublksrv_ctrl_cmd cmd = ctrl(0, 0);
+        if (ctrl_cmd(UBLK_CMD_STOP_DEV, cmd) != 0)
+            LOG_ERROR("stop ublk device ` failed, errno: `", m_info.dev_id, errno);
+    }
+
+private:
+    ImageFile *m_file;
+    int m_dev_id;
+    uint32_t m_depth;
+    int m_ctrl_fd = -1, m_cdev_fd = -1;
+    Uring m_ctrl, m_queue;
+    photon::mutex m_ctrl_mtx;
+    struct ublksrv_ctrl_dev_info m_info;
+    struct ublksrv_io_desc *m_iods = nullptr;
+    size_t m_iods_len = 0;
+    std::vector<void *> m_bufs;
+    uint32_t m_inflight = 0;
+    bool m_added = false, m_started = false, m_stopping = false, m_quit = false;
+
+    struct io_task {
+        UblkDeviceImpl *dev;
+        uint16_t tag;
+    };
+
+    ublksrv_ctrl_cmd ctrl(void *addr, uint16_t len) {
+        ublksrv_ctrl_cmd cmd;
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.dev_id = m_info.dev_id;
+        cmd.queue_id = (uint16_t)-1;
+        cmd.addr = (uint64_t)addr;
+        cmd.len = len;
+        return cmd;
+    }
+
+    int ctrl_cmd(uint32_t op, const ublksrv_ctrl_cmd &cmd) {
+        photon::scoped_lock lock(m_ctrl_mtx);
+        auto sqe = m_ctrl.get_sqe();
+        if (!sqe)
+            LOG_ERROR_RETURN(EBUSY, -1, "ublk control ring is full");
+        sqe->opcode = IORING_OP_URING_CMD;
+        sqe->fd = m_ctrl_fd;
+        sqe->cmd_op = op;
+        memcpy(sqe->cmd, &cmd, sizeof(cmd));
+        if (m_ctrl.submit() < 0)
+            return -1;
+        auto cqe = m_ctrl.wait_cqe();
+        int res = cqe->res;
+        m_ctrl.cqe_seen();
+        if (res < 0) {
+            errno = -res;
+            return -1;
+        }
+        return 0;
+    }
+
+    int setup() {
+        m_ctrl_fd = open(UBLK_CONTROL_DEV, O_RDWR);
+        if (m_ctrl_fd < 0)
+            LOG_ERRNO_RETURN(0, -1, "open ` failed, is ublk_drv loaded?", UBLK_CONTROL_DEV);
+        if (m_ctrl.init(32, true) != 0)
+            return -1;
+
+        memset(&m_info, 0, sizeof(m_info));
+        m_info.nr_hw_queues = 1;
+        m_info.queue_depth = m_depth;
+        m_info.max_io_buf_bytes = UBLK_MAX_IO_BYTES;
+        m_info.dev_id = (uint32_t)m_dev_id;
+        m_info.ublksrv_pid = getpid();
+        auto cmd = ctrl(&m_info, sizeof(m_info));
+        if (ctrl_cmd(UBLK_CMD_ADD_DEV, cmd) != 0)
+            LOG_ERRNO_RETURN(0, -1, "add ublk device failed");
+        m_added = true;
+
+        struct ublk_params params;
+        memset(&params, 0, sizeof(params));
+        params.len = sizeof(params);
+        params.types = UBLK_PARAM_TYPE_BASIC;
+        auto &basic = params.basic;
+        basic.logical_bs_shift = ilog2(m_file->block_size);
+        basic.physical_bs_shift = std::max(basic.logical_bs_shift, (uint8_t)12);
+        basic.io_min_shift = basic.logical_bs_shift;
+        basic.io_opt_shift = basic.physical_bs_shift;
+        basic.max_sectors = UBLK_MAX_IO_BYTES >> 9;
+        basic.dev_sectors = m_file->num_lbas * m_file->block_size >> 9;
+        if (m_file->write_cache)
+            basic.attrs |= UBLK_ATTR_VOLATILE_CACHE | UBLK_ATTR_FUA;
+        if (m_file->read_only) {
+            basic.attrs |= UBLK_ATTR_READ_ONLY;
+        } else {
+            // discards become punch-holes, recorded as zeroed segments in
+            // the RW layer like SCSI UNMAP on the TCMU path
+            params.types |= UBLK_PARAM_TYPE_DISCARD;
+            params.discard.discard_granularity = m_file->block_size;
+            params.discard.max_discard_sectors = UBLK_MAX_DISCARD_BYTES >> 9;
+            params.discard.max_write_zeroes_sectors = UBLK_MAX_DISCARD_BYTES >> 9;
+            params.discard.max_discard_segments = 1;
+        }
+        cmd = ctrl(&params, sizeof(params));
+        if (ctrl_cmd(UBLK_CMD_SET_PARAMS, cmd) != 0)
+            LOG_ERRNO_RETURN(0, -1, "set params of ublk device ` failed", m_info.dev_id);
+
+        // the char device node is created by udev asynchronously
+        auto cdev = std::string(UBLK_CDEV_PREFIX) + std::to_string(m_info.dev_id);
+        for (int i = 0; i < 100 && m_cdev_fd < 0; i++) {
+            m_cdev_fd = open(cdev.c_str(), O_RDWR);
+            if (m_cdev_fd < 0)
+                photon::thread_usleep(10 * 1000);
+        }
+        if (m_cdev_fd < 0)
+            LOG_ERRNO_RETURN(0, -1, "open ` failed", cdev);
+
+        auto page = sysconf(_SC_PAGESIZE);
+        m_iods_len = (m_depth * sizeof(struct ublksrv_io_desc) + page - 1) / page * page;
+        auto ptr = mmap(nullptr, m_iods_len, PROT_READ, MAP_SHARED | MAP_POPULATE, m_cdev_fd,
+                        UBLKSRV_CMD_BUF_OFFSET);
+        if (ptr == MAP_FAILED)
+            LOG_ERRNO_RETURN(0, -1, "mmap io descriptors of ` failed", cdev);
+        m_iods = (struct ublksrv_io_desc *)ptr;
+
+        if (m_queue.init(m_depth, false) != 0)
+            return -1;
+        m_bufs.resize(m_depth, nullptr);
+        for (uint32_t tag = 0; tag < m_depth; tag++) {
+            if (posix_memalign(&m_bufs[tag], 4096, UBLK_MAX_IO_BYTES) != 0)
+                LOG_ERROR_RETURN(ENOMEM, -1, "alloc io buffer failed");
+            if (queue_io_cmd(UBLK_IO_FETCH_REQ, tag, 0) != 0)
+                return -1;
+        }
+        return m_queue.submit() < 0 ? -1 : 0;
+    }
+
+    int queue_io_cmd(uint32_t op, uint16_t tag, int32_t result) {
+        auto sqe = m_queue.get_sqe();
+        if (!sqe)
+            LOG_ERROR_RETURN(EBUSY, -1, "ublk queue ring is full");
+        sqe->opcode = IORING_OP_URING_CMD;
+        sqe->fd = m_cdev_fd;
+        sqe->cmd_op = op;
+        sqe->user_data = tag;
+        struct ublksrv_io_cmd cmd;
+        cmd.q_id = 0;
+        cmd.tag = tag;
+        cmd.result = result;
+        cmd.addr = (uint64_t)m_bufs[tag];
+        memcpy(sqe->cmd, &cmd, sizeof(cmd));
+        return 0;
+    }
+
+    int32_t do_io(const struct ublksrv_io_desc *iod, void *buf) {
+        off_t offset = iod->start_sector << 9;
+        size_t length = (size_t)iod->nr_sectors << 9;
+        ssize_t ret;
+        switch (ublksrv_get_op(iod)) {
+        case UBLK_IO_OP_READ: {
+            struct iovec iov{buf, length};
+            auto trace = IOTrace::begin("read", offset, length);
+            ret = m_file->preadv(&iov, 1, offset);
+            IOTrace::end(trace, ret);
+            break;
+        }
+        case UBLK_IO_OP_WRITE: {
+            struct iovec iov{buf, length};
+            auto trace = IOTrace::begin("write", offset, length);
+            ret = m_file->pwritev(&iov, 1, offset);
+            if (ret == (ssize_t)length && (iod->op_flags & UBLK_IO_F_FUA) &&
+                m_file->write_cache && m_file->fdatasync() != 0)
+                ret = -1;
+            IOTrace::end(trace, ret);
+            break;
+        }
+        case UBLK_IO_OP_FLUSH:
+            return m_file->fdatasync() == 0 ? 0 : -EIO;
+        case UBLK_IO_OP_DISCARD:
+        case UBLK_IO_OP_WRITE_ZEROES:
+            if (m_file->fallocate(3, offset, length) != 0)
+                return errno ? -errno : -EIO;
+            return 0;
+        default:
+            return -EOPNOTSUPP;
+        }
+        if (ret == (ssize_t)length)
+            return (int32_t)ret;
+        if (ret < 0 && errno == EROFS)
+            return -EROFS;
+        LOG_ERROR("ublk io failed, op: `, offset: `, length: `, ret: `", ublksrv_get_op(iod), offset,
+                  length, ret);
+        return -EIO;
+    }
+
+    static void *handle_io(void *arg) {
+        auto t = (io_task *)arg;
+        auto self = t->dev;
+        auto tag = t->tag;
+        delete t;
+        int32_t res = self->do_io(&self->m_iods[tag], self->m_bufs[tag]);
+        if (self->queue_io_cmd(UBLK_IO_COMMIT_AND_FETCH_REQ, tag, res) == 0)
+            self->m_queue.submit();
+        self->m_inflight--;
+        return nullptr;
+    }
+
+    void queue_loop() {
+        auto pool = photon::new_thread_pool(std::min(m_depth, (uint32_t)UBLK_MAX_IDLE_WORKERS));
+        uint32_t aborted = 0;
+        while (aborted < m_depth && !m_quit) {
+            struct io_uring_cqe *cqe;
+            while ((cqe = m_queue.peek_cqe())) {
+                auto tag = (uint16_t)cqe->user_data;
+                int res = cqe->res;
+                m_queue.cqe_seen();
+                if (res == UBLK_IO_RES_OK) {
+                    m_inflight++;
+                    pool->thread_create(&UblkDeviceImpl::handle_io, new io_task{this, tag});
+                } else {
+                    if (res != UBLK_IO_RES_ABORT)
+                        LOG_ERROR("ublk fetch failed, tag: `, res: `", tag, res);
+                    aborted++;
+                }
+            }
+            if (aborted < m_depth && !m_quit)
+                photon::wait_for_fd_readable(m_queue.fd);
+        }
+        while (m_inflight > 0)
+            photon::thread_usleep(1000);
+        photon::delete_thread_pool(pool);
+        LOG_INFO("ublk queue of device ` exited", m_info.dev_id);
+    }
+};
+
+UblkDevice *new_ublk_device(ImageFile *file, int dev_id, uint32_t queue_depth) {
+    if (!file)
+        LOG_ERROR_RETURN(EINVAL, nullptr, "invalid image file");
+    return new UblkDeviceImpl(file, dev_id, queue_depth);
+}
@@ -0,0 +1,41 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+#pragma once
+
+#include <cstdint>
+
+class ImageFile;
+
+// A ublk (userspace block driver) frontend for one ImageFile. Requests are
+// fetched and committed with io_uring passthrough commands on /dev/ublkcN
+// and served by ImageFile::preadv/pwritev directly, skipping the SCSI
+// emulation and the target_core_user ring of the TCMU frontend.
+class UblkDevice {
+public:
+    virtual ~UblkDevice() {}
+
+    // adds and starts /dev/ublkbN, then serves requests until stop() is
+    // called or the device is removed; must run in a photon thread
+    virtual int run() = 0;
+
+    virtual void stop() = 0;
+
+    // -1 before the device is added
+    virtual int dev_id() const = 0;
+};
+
+// dev_id -1 lets the driver choose a free id
+UblkDevice *new_ublk_device(ImageFile *file, int dev_id = -1, uint32_t queue_depth = 128);
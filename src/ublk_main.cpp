@@ -0,0 +1,75 @@
+/*
+   Copyright The Overlaybd Authors
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+// overlaybd-ublk serves one image through a ublk block device instead of
+// TCMU. Usage:
+//     overlaybd-ublk <image config> [global config]
+// The device is removed on SIGTERM / SIGINT.
+
+#include "image_file.h"
+#include "image_service.h"
+#include "ublk.h"
+#include <photon/common/alog.h>
+#include <photon/io/signal.h>
+#include <photon/photon.h>
+#include <photon/thread/thread.h>
+#include <sys/prctl.h>
+#include <malloc.h>
+
+static UblkDevice *ublk_dev = nullptr;
+
+void sigint_handler(int signal = SIGINT) {
+    LOG_INFO("sigint received");
+    if (ublk_dev)
+        ublk_dev->stop();
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <image config> [global config]\n", argv[0]);
+        return -1;
+    }
+    mallopt(M_TRIM_THRESHOLD, 128 * 1024);
+    prctl(PR_SET_THP_DISABLE, 1);
+
+    const char *config_path = argc > 2 ? argv[2] : nullptr;
+    photon::init(photon::INIT_EVENT_DEFAULT | cache_media_event_engine(config_path),
+                 photon::INIT_IO_DEFAULT);
+    photon::block_all_signal();
+    photon::sync_signal(SIGTERM, &sigint_handler);
+    photon::sync_signal(SIGINT, &sigint_handler);
+
+    auto imgservice = create_image_service(config_path);
+    if (imgservice == nullptr) {
+        LOG_ERROR("failed to create image service");
+        return -1;
+    }
+    ImageFile *file = imgservice->create_image_file(argv[1]);
+    if (file == nullptr) {
+        LOG_ERROR("create image file failed, config: `", argv[1]);
+        delete imgservice;
+        return -1;
+    }
+
+    ublk_dev = new_ublk_device(file, -1, imgservice->global_conf.deviceMaxInflight());
+    int ret = ublk_dev ? ublk_dev->run() : -1;
+    delete ublk_dev;
+    ublk_dev = nullptr;
+
+    delete file;
+    delete imgservice;
+    return ret;
+}